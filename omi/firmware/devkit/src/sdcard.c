@@ -1,6 +1,9 @@
 #include "sdcard.h"
 
+#include <ctype.h>
 #include <ff.h>
+#include <stddef.h>
+#include <string.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/fs/fs.h>
@@ -10,9 +13,94 @@
 #include <zephyr/storage/disk_access.h>
 #include <zephyr/sys/check.h>
 #include <zephyr/pm/device.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/crc.h>
 
 LOG_MODULE_REGISTER(sdcard, CONFIG_LOG_DEFAULT_LEVEL);
 
+#define SD_REQ_QUEUE_MSGS 25       // Number of messages in the SD request queue
+#define SD_FSYNC_THRESHOLD 20000   // Threshold in bytes to trigger fsync
+#define WRITE_BATCH_COUNT 10       // Number of writes to batch before writing to SD card
+#define WRITE_BATCH_IDLE_MS 1000   // A partial batch is written after no new data for this long
+#define SD_WORKER_STACK_SIZE 4096
+#define SD_WORKER_PRIORITY 7
+#define SD_REQ_TIMEOUT_MS 5000     // Longest wait for a request that returns a result
+#define MAX_AUDIO_FILES 99         // audio/a01.txt to audio/a99.txt
+#define FILE_TABLE_PATH "/SD:/files.bin"
+#define FILE_TABLE_MAGIC 0x31425446 // "FTB1"
+#define FILE_ABSENT UINT32_MAX
+
+// Every file access goes through the SD worker, so the pusher only queues a block and moves on.
+// The data file stays open and blocks are written in batches instead of open/write/close each
+typedef enum {
+    REQ_WRITE_DATA,
+    REQ_READ_DATA,
+    REQ_MOVE_READ_POINTER,
+    REQ_MOVE_WRITE_POINTER,
+    REQ_CLEAR_AUDIO_FILE,
+    REQ_CLEAR_AUDIO_DIR,
+    REQ_SAVE_OFFSET,
+    REQ_GET_OFFSET,
+    REQ_FLUSH,
+} sd_req_type_t;
+
+typedef struct {
+    sd_req_type_t type;
+    struct k_sem *done; // given with res set, NULL for writes
+    int *res;
+    union {
+        struct {
+            uint8_t buf[MAX_WRITE_SIZE];
+            uint32_t len;
+        } write;
+        struct {
+            uint8_t *out_buf;
+            int length;
+            int offset;
+        } read;
+        uint8_t num;     // file number
+        uint32_t offset; // REQ_SAVE_OFFSET
+    } u;
+} sd_req_t;
+
+K_MSGQ_DEFINE(sd_msgq, sizeof(sd_req_t), SD_REQ_QUEUE_MSGS, 4);
+K_THREAD_STACK_DEFINE(sd_worker_stack, SD_WORKER_STACK_SIZE);
+static struct k_thread sd_worker_thread_data;
+static k_tid_t sd_worker_tid = NULL;
+
+static void sd_worker_thread(void);
+
+// batch write buffer, owned by the worker
+static uint8_t write_batch_buffer[WRITE_BATCH_COUNT * MAX_WRITE_SIZE];
+static size_t write_batch_offset = 0;
+static size_t bytes_since_sync = 0;
+
+// data file at write_buffer, open while data_file_open
+static struct fs_file_t data_file;
+static bool data_file_open = false;
+static uint32_t data_file_written = 0; // bytes written to the data file
+static atomic_t data_file_size;        // the same plus blocks queued or batched, as readers will see it
+
+// In-RAM copy of /SD:/audio, so mount and sync setup don't walk the directory or stat each file.
+// Loaded from FILE_TABLE_PATH at mount with a scan as the fallback, and kept current by the worker.
+// Only the data file grows between saves, and its size is taken from the file when it is opened
+struct file_table {
+    uint32_t magic;
+    uint8_t read_num;
+    uint8_t write_num;
+    uint16_t reserved;
+    uint32_t size[MAX_AUDIO_FILES]; // bytes in a<i + 1>.txt, FILE_ABSENT if there is none
+    uint32_t crc;
+};
+
+static struct file_table file_table;
+static bool file_table_saved = false; // FILE_TABLE_PATH matches the files on the card
+
+static int sd_scan_audio_dir(void);
+static bool sd_load_file_table(void);
+static int sd_save_file_table(void);
+static void sd_invalidate_file_table(void);
+
 static FATFS fat_fs;
 
 static struct fs_mount_t mount_point = {
@@ -77,37 +165,37 @@ int mount_sd_card(void)
 
     res = fs_mkdir("/SD:/audio");
 
-    if (res == FR_OK) {
+    bool new_dir = res == FR_OK;
+    if (new_dir) {
         LOG_INF("audio directory created successfully");
-        initialize_audio_file(1);
     } else if (res == FR_EXIST) {
         LOG_INF("audio directory already exists");
     } else {
         LOG_INF("audio directory creation failed: %d", res);
     }
 
-    struct fs_dir_t audio_dir_entry;
-    fs_dir_t_init(&audio_dir_entry);
-    err = fs_opendir(&audio_dir_entry, "/SD:/audio");
-    if (err) {
-        LOG_ERR("error while opening directory ", err);
-        return -1;
+    // A table left from a deleted audio directory doesn't count
+    if (new_dir || !sd_load_file_table()) {
+        if (sd_scan_audio_dir()) {
+            LOG_ERR(" error getting file count");
+            return -1;
+        }
     }
-    LOG_INF("result of opendir: %d", err);
     initialize_audio_file(1);
-    struct fs_dirent file_count_entry;
-    file_count = get_file_contents(&audio_dir_entry, &file_count_entry);
     file_count = 1;
-    if (file_count < 0) {
-        LOG_ERR(" error getting file count");
-        return -1;
-    }
-
-    fs_closedir(&audio_dir_entry);
-    // file_count++;
     LOG_INF("new num files: %d", file_count);
 
     res = move_write_pointer(file_count);
+    if (res && file_table_saved) {
+        // The card was changed elsewhere since the table was saved
+        LOG_INF("file table out of date, rescanning");
+        sd_invalidate_file_table();
+        res = sd_scan_audio_dir();
+        if (!res) {
+            initialize_audio_file(file_count);
+            res = move_write_pointer(file_count);
+        }
+    }
     if (res) {
         LOG_ERR("erro while moving the write pointer");
         return -1;
@@ -121,6 +209,10 @@ int mount_sd_card(void)
     }
     LOG_INF("file count: %d", file_count);
 
+    if (!file_table_saved) {
+        sd_save_file_table();
+    }
+
     struct fs_dirent info_file_entry; // check if the info file exists. if not, generate new info file
     const char *info_path = "/SD:/info.txt";
     res = fs_stat(info_path, &info_file_entry); // for later
@@ -132,44 +224,212 @@ int mount_sd_card(void)
 
     LOG_INF("result of check: %d", res);
 
+    sd_worker_tid = k_thread_create(&sd_worker_thread_data,
+                                    sd_worker_stack,
+                                    K_THREAD_STACK_SIZEOF(sd_worker_stack),
+                                    (k_thread_entry_t) sd_worker_thread,
+                                    NULL,
+                                    NULL,
+                                    NULL,
+                                    SD_WORKER_PRIORITY,
+                                    0,
+                                    K_NO_WAIT);
+    k_thread_name_set(sd_worker_tid, "sd_worker");
     return 0;
 }
 
-uint32_t get_file_size(uint8_t num)
+static uint8_t audio_file_num(const char *name)
 {
-    char *ptr = generate_new_audio_header(num);
-    snprintf(current_full_path, sizeof(current_full_path), "%s%s", disk_mount_pt, ptr);
-    k_free(ptr);
-    struct fs_dirent entry;
-    int res = fs_stat(&current_full_path, &entry);
-    if (res) {
-        LOG_ERR("invalid file in get file size\n");
+    // FAT short names may come back upper case
+    if ((name[0] != 'a' && name[0] != 'A') || !isdigit((unsigned char) name[1]) ||
+        !isdigit((unsigned char) name[2]) || name[3] != '.') {
         return 0;
     }
-    return (uint32_t) entry.size;
+    return (name[1] - '0') * 10 + (name[2] - '0');
 }
 
-int move_read_pointer(uint8_t num)
+static bool audio_file_exists(uint8_t num)
 {
-    char *read_ptr = generate_new_audio_header(num);
-    snprintf(read_buffer, sizeof(read_buffer), "%s%s", disk_mount_pt, read_ptr);
-    k_free(read_ptr);
+    return num > 0 && num <= MAX_AUDIO_FILES && file_table.size[num - 1] != FILE_ABSENT;
+}
+
+static bool sd_load_file_table(void)
+{
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+    if (fs_open(&file, FILE_TABLE_PATH, FS_O_READ)) {
+        return false;
+    }
+    ssize_t rd = fs_read(&file, &file_table, sizeof(file_table));
+    fs_close(&file);
+    if (rd != sizeof(file_table) || file_table.magic != FILE_TABLE_MAGIC ||
+        file_table.crc != crc32_ieee((uint8_t *) &file_table, offsetof(struct file_table, crc))) {
+        LOG_INF("file table invalid, rescanning");
+        return false;
+    }
+    file_table_saved = true;
+    return true;
+}
+
+static int sd_save_file_table(void)
+{
+    if (audio_file_exists(file_table.write_num) && data_file_open) {
+        file_table.size[file_table.write_num - 1] = data_file_written;
+    }
+    file_table.magic = FILE_TABLE_MAGIC;
+    file_table.crc = crc32_ieee((uint8_t *) &file_table, offsetof(struct file_table, crc));
+
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+    int res = fs_open(&file, FILE_TABLE_PATH, FS_O_WRITE | FS_O_CREATE);
+    if (res) {
+        LOG_ERR("error opening file table %d", res);
+        return res;
+    }
+    ssize_t bw = fs_write(&file, &file_table, sizeof(file_table));
+    fs_close(&file);
+    if (bw != sizeof(file_table)) {
+        LOG_ERR("error writing file table %d", (int) bw);
+        return -EIO;
+    }
+    file_table_saved = true;
+    return 0;
+}
+
+// Drop the saved table before files are created or deleted, so a reset halfway through rescans
+static void sd_invalidate_file_table(void)
+{
+    if (file_table_saved) {
+        fs_unlink(FILE_TABLE_PATH);
+        file_table_saved = false;
+    }
+}
+
+static int sd_scan_audio_dir(void)
+{
+    struct fs_dir_t dir;
     struct fs_dirent entry;
-    int res = fs_stat(&read_buffer, &entry);
+    fs_dir_t_init(&dir);
+    int res = fs_opendir(&dir, "/SD:/audio");
+    if (res) {
+        LOG_ERR("error while opening directory %d", res);
+        return res;
+    }
+    for (int i = 0; i < MAX_AUDIO_FILES; i++) {
+        file_table.size[i] = FILE_ABSENT;
+    }
+    int count = 0;
+    while ((res = fs_readdir(&dir, &entry)) == 0 && entry.name[0] != 0) {
+        uint8_t num = audio_file_num(entry.name);
+        if (entry.type != FS_DIR_ENTRY_FILE || num == 0) {
+            continue;
+        }
+        file_table.size[num - 1] = entry.size;
+        LOG_INF("file name is %s, %u bytes", entry.name, (unsigned) entry.size);
+        count++;
+    }
+    fs_closedir(&dir);
+    LOG_INF("%d audio files", count);
+    return res;
+}
+
+// Open the file at write_buffer for batched appends
+static int sd_open_data_file(void)
+{
+    fs_file_t_init(&data_file);
+    int res = fs_open(&data_file, write_buffer, FS_O_RDWR);
     if (res) {
+        LOG_ERR("error opening data file %d", res);
+        return res;
+    }
+    res = fs_seek(&data_file, 0, FS_SEEK_END);
+    off_t size = res ? res : fs_tell(&data_file);
+    if (size < 0) {
+        fs_close(&data_file);
+        return (int) size;
+    }
+    data_file_open = true;
+    // Blocks still queued go to the reopened file
+    atomic_add(&data_file_size, (atomic_val_t) size - (atomic_val_t) data_file_written);
+    data_file_written = size;
+    if (file_table.write_num > 0 && file_table.write_num <= MAX_AUDIO_FILES) {
+        file_table.size[file_table.write_num - 1] = size;
+    }
+    return 0;
+}
+
+static void sd_close_data_file(void)
+{
+    if (data_file_open) {
+        fs_close(&data_file);
+        data_file_open = false;
+    }
+}
+
+// Append the batched blocks to the data file. A short write is cut back to whole blocks
+static int sd_flush_batch(void)
+{
+    if (write_batch_offset == 0) {
+        return 0;
+    }
+    size_t wanted = write_batch_offset;
+    write_batch_offset = 0;
+    if (!data_file_open) {
+        atomic_sub(&data_file_size, (atomic_val_t) wanted);
+        return -EBADF;
+    }
+
+    int res = fs_seek(&data_file, 0, FS_SEEK_END);
+    ssize_t bw = res ? res : fs_write(&data_file, write_batch_buffer, wanted);
+    if (bw < 0 || (size_t) bw != wanted) {
+        LOG_ERR("batch write error %d, wanted %u", (int) bw, (unsigned) wanted);
+        size_t kept = bw > 0 ? bw - bw % MAX_WRITE_SIZE : 0;
+        if (bw > 0 && fs_truncate(&data_file, data_file_written + kept) < 0) {
+            LOG_ERR("failed to truncate the data file to whole blocks");
+        }
+        atomic_sub(&data_file_size, (atomic_val_t) (wanted - kept));
+        data_file_written += kept;
+        bytes_since_sync += kept;
+        return -EIO;
+    }
+
+    data_file_written += bw;
+    bytes_since_sync += bw;
+    if (bytes_since_sync >= SD_FSYNC_THRESHOLD) {
+        res = fs_sync(&data_file);
+        if (res < 0) {
+            LOG_ERR("fs_sync data failed: %d", res);
+        }
+        bytes_since_sync = 0;
+    }
+    return 0;
+}
+
+static int sd_do_move_read_pointer(uint8_t num)
+{
+    if (!audio_file_exists(num)) {
         LOG_ERR("invalid file in move read ptr\n");
         return -1;
     }
+    char *read_ptr = generate_new_audio_header(num);
+    snprintf(read_buffer, sizeof(read_buffer), "%s%s", disk_mount_pt, read_ptr);
+    k_free(read_ptr);
+    file_table.read_num = num;
     return 0;
 }
 
-int move_write_pointer(uint8_t num)
+static int sd_do_move_write_pointer(uint8_t num)
 {
+    if (!audio_file_exists(num)) {
+        LOG_ERR("invalid file in move write pointer\n");
+        return -1;
+    }
+    sd_close_data_file();
     char *write_ptr = generate_new_audio_header(num);
     snprintf(write_buffer, sizeof(write_buffer), "%s%s", disk_mount_pt, write_ptr);
     k_free(write_ptr);
-    struct fs_dirent entry;
-    int res = fs_stat(&write_buffer, &entry);
+    file_table.write_num = num;
+    int res = sd_open_data_file();
     if (res) {
         LOG_ERR("invalid file in move write pointer\n");
         return -1;
@@ -192,8 +452,13 @@ int create_file(const char *file_path)
     return 0;
 }
 
-int read_audio_data(uint8_t *buf, int amount, int offset)
+static int sd_do_read_audio_data(uint8_t *buf, int amount, int offset)
 {
+    if (data_file_open && strcmp(read_buffer, write_buffer) == 0) {
+        int rc = fs_seek(&data_file, offset, FS_SEEK_SET);
+        return rc ? rc : fs_read(&data_file, buf, amount);
+    }
+
     struct fs_file_t read_file;
     fs_file_t_init(&read_file);
     uint8_t *temp_ptr = buf;
@@ -212,25 +477,23 @@ int read_audio_data(uint8_t *buf, int amount, int offset)
     return rc;
 }
 
-int write_to_file(uint8_t *data, uint32_t length)
-{
-    struct fs_file_t write_file;
-    fs_file_t_init(&write_file);
-    uint8_t *write_ptr = data;
-    fs_open(&write_file, write_buffer, FS_O_WRITE | FS_O_APPEND);
-    fs_write(&write_file, write_ptr, length);
-    fs_close(&write_file);
-    return 0;
-}
 
 int initialize_audio_file(uint8_t num)
 {
+    if (audio_file_exists(num)) {
+        return 0;
+    }
     char *header = generate_new_audio_header(num);
     if (header == NULL) {
         return -1;
     }
+    sd_invalidate_file_table();
+    int res = create_file(header);
     k_free(header);
-    create_file(header);
+    if (res) {
+        return -1;
+    }
+    file_table.size[num - 1] = 0;
     return 0;
 }
 
@@ -257,41 +520,22 @@ char *generate_new_audio_header(uint8_t num)
     return ptr_;
 }
 
-int get_file_contents(struct fs_dir_t *zdp, struct fs_dirent *entry)
-{
-    if (zdp->mp->fs->readdir(zdp, entry)) {
-        return -1;
-    }
-    if (entry->name[0] == 0) {
-        return 0;
-    }
-    int count = 0;
-    file_num_array[count] = entry->size;
-    LOG_INF("file numarray %d %d ", count, file_num_array[count]);
-    LOG_INF("file name is %s ", entry->name);
-    count++;
-    while (zdp->mp->fs->readdir(zdp, entry) == 0) {
-        if (entry->name[0] == 0) {
-            break;
-        }
-        file_num_array[count] = entry->size;
-        LOG_INF("file numarray %d %d ", count, file_num_array[count]);
-        LOG_INF("file name is %s ", entry->name);
-        count++;
-    }
-    return count;
-}
 // we should clear instead of delete since we lose fifo structure
-int clear_audio_file(uint8_t num)
+static int sd_do_clear_audio_file(uint8_t num)
 {
     char *clear_header = generate_new_audio_header(num);
     snprintf(current_full_path, sizeof(current_full_path), "%s%s", disk_mount_pt, clear_header);
     k_free(clear_header);
+    if (strcmp(current_full_path, write_buffer) == 0) {
+        sd_close_data_file(); // reopened by the worker
+    }
+    sd_invalidate_file_table();
     int res = fs_unlink(current_full_path);
     if (res) {
         LOG_ERR("error deleting file");
         return -1;
     }
+    file_table.size[num - 1] = FILE_ABSENT;
 
     char *create_file_header = generate_new_audio_header(num);
     k_msleep(10);
@@ -301,8 +545,9 @@ int clear_audio_file(uint8_t num)
         LOG_ERR("error creating file");
         return -1;
     }
+    file_table.size[num - 1] = 0;
 
-    return 0;
+    return sd_save_file_table();
 }
 
 int delete_audio_file(uint8_t num)
@@ -310,16 +555,18 @@ int delete_audio_file(uint8_t num)
     char *ptr = generate_new_audio_header(num);
     snprintf(current_full_path, sizeof(current_full_path), "%s%s", disk_mount_pt, ptr);
     k_free(ptr);
+    sd_invalidate_file_table();
     int res = fs_unlink(current_full_path);
     if (res) {
         LOG_PRINTK("error deleting file in delete\n");
         return -1;
     }
+    file_table.size[num - 1] = FILE_ABSENT;
 
     return 0;
 }
 // the nuclear option.
-int clear_audio_directory()
+static int sd_do_clear_audio_directory()
 {
     if (file_count == 1) {
         return 0;
@@ -328,6 +575,7 @@ int clear_audio_directory()
     //  char* path_ = "/SD:/audio";
     //  clear_audio_file(file_count);
     int res = 0;
+    sd_close_data_file();
     for (uint8_t i = file_count; i > 0; i--) {
         res = delete_audio_file(i);
         k_msleep(10);
@@ -353,13 +601,17 @@ int clear_audio_directory()
     }
     LOG_ERR("done with clearing");
 
+    for (int i = 0; i < MAX_AUDIO_FILES; i++) {
+        file_table.size[i] = FILE_ABSENT;
+    }
+    file_table.size[0] = 0;
     file_count = 1;
-    move_write_pointer(1);
-    return 0;
+    sd_do_move_write_pointer(1);
+    return sd_save_file_table();
     // if files are cleared, then directory is oked for destrcution.
 }
 
-int save_offset(uint32_t offset)
+static int sd_do_save_offset(uint32_t offset)
 {
     uint8_t buf[4] = {offset & 0xFF, (offset >> 8) & 0xFF, (offset >> 16) & 0xFF, (offset >> 24) & 0xFF};
 
@@ -379,7 +631,7 @@ int save_offset(uint32_t offset)
     return 0;
 }
 
-int get_offset()
+static int sd_do_get_offset()
 {
     uint8_t buf[4];
     struct fs_file_t read_file;
@@ -407,8 +659,183 @@ int get_offset()
     return offset_ptr[0];
 }
 
+static int sd_handle_request(sd_req_t *req)
+{
+    // Requests other than writes see every block queued before them
+    if (req->type != REQ_WRITE_DATA) {
+        sd_flush_batch();
+    }
+
+    int res = 0;
+    switch (req->type) {
+    case REQ_WRITE_DATA:
+        memcpy(write_batch_buffer + write_batch_offset, req->u.write.buf, req->u.write.len);
+        write_batch_offset += req->u.write.len;
+        if (write_batch_offset + MAX_WRITE_SIZE > sizeof(write_batch_buffer)) {
+            res = sd_flush_batch();
+        }
+        break;
+    case REQ_READ_DATA:
+        res = sd_do_read_audio_data(req->u.read.out_buf, req->u.read.length, req->u.read.offset);
+        break;
+    case REQ_MOVE_READ_POINTER:
+        res = sd_do_move_read_pointer(req->u.num);
+        break;
+    case REQ_MOVE_WRITE_POINTER:
+        res = sd_do_move_write_pointer(req->u.num);
+        break;
+    case REQ_CLEAR_AUDIO_FILE:
+        res = sd_do_clear_audio_file(req->u.num);
+        break;
+    case REQ_CLEAR_AUDIO_DIR:
+        res = sd_do_clear_audio_directory();
+        break;
+    case REQ_SAVE_OFFSET:
+        res = sd_do_save_offset(req->u.offset);
+        break;
+    case REQ_GET_OFFSET:
+        res = sd_do_get_offset();
+        break;
+    case REQ_FLUSH:
+        if (data_file_open) {
+            res = fs_sync(&data_file);
+            bytes_since_sync = 0;
+        }
+        sd_save_file_table(); // with the data file size, so the next mount doesn't scan
+        break;
+    }
+
+    // Clearing closes the data file, and a failed clear may leave it closed
+    if (!data_file_open && sd_worker_tid) {
+        sd_open_data_file();
+    }
+    return res;
+}
+
+static void sd_worker_thread(void)
+{
+    sd_req_t req;
+
+    while (1) {
+        k_timeout_t wait = write_batch_offset ? K_MSEC(WRITE_BATCH_IDLE_MS) : K_FOREVER;
+        if (k_msgq_get(&sd_msgq, &req, wait) != 0) {
+            sd_flush_batch(); // no new audio for a while, don't leave it in RAM
+            continue;
+        }
+        int res = sd_handle_request(&req);
+        if (req.done) {
+            *req.res = res;
+            k_sem_give(req.done);
+        }
+    }
+}
+
+// Run a request on the worker and wait for its result (inline while mount_sd_card() runs)
+static int sd_submit(sd_req_t *req)
+{
+    if (!sd_worker_tid) {
+        return sd_handle_request(req);
+    }
+
+    struct k_sem done;
+    int res = -ETIMEDOUT;
+    k_sem_init(&done, 0, 1);
+    req->done = &done;
+    req->res = &res;
+    if (k_msgq_put(&sd_msgq, req, K_MSEC(SD_REQ_TIMEOUT_MS)) != 0) {
+        LOG_ERR("SD request %d not queued", req->type);
+        return -EBUSY;
+    }
+    if (k_sem_take(&done, K_MSEC(SD_REQ_TIMEOUT_MS)) != 0) {
+        // The worker still owns the request, wait it out rather than let it write to a dead stack frame
+        LOG_ERR("SD request %d is taking longer than %d ms", req->type, SD_REQ_TIMEOUT_MS);
+        k_sem_take(&done, K_FOREVER);
+    }
+    return res;
+}
+
+int write_to_file(uint8_t *data, uint32_t length)
+{
+    if (!sd_worker_tid || length > MAX_WRITE_SIZE) {
+        return -EINVAL;
+    }
+    sd_req_t req = {.type = REQ_WRITE_DATA};
+    memcpy(req.u.write.buf, data, length);
+    req.u.write.len = length;
+
+    atomic_add(&data_file_size, (atomic_val_t) length);
+    int ret = k_msgq_put(&sd_msgq, &req, K_MSEC(100));
+    if (ret) {
+        atomic_sub(&data_file_size, (atomic_val_t) length);
+        LOG_ERR("Failed to queue write_to_file request: %d", ret);
+        return ret;
+    }
+    return 0;
+}
+
+int read_audio_data(uint8_t *buf, int amount, int offset)
+{
+    sd_req_t req = {.type = REQ_READ_DATA};
+    req.u.read.out_buf = buf;
+    req.u.read.length = amount;
+    req.u.read.offset = offset;
+    return sd_submit(&req);
+}
+
+uint32_t get_file_size(uint8_t num)
+{
+    if (!audio_file_exists(num)) {
+        return 0;
+    }
+    if (num == file_table.write_num) {
+        return (uint32_t) atomic_get(&data_file_size); // includes blocks still queued for the worker
+    }
+    return file_table.size[num - 1]; // only the data file grows
+}
+
+int move_read_pointer(uint8_t num)
+{
+    sd_req_t req = {.type = REQ_MOVE_READ_POINTER, .u.num = num};
+    return sd_submit(&req);
+}
+
+int move_write_pointer(uint8_t num)
+{
+    sd_req_t req = {.type = REQ_MOVE_WRITE_POINTER, .u.num = num};
+    return sd_submit(&req);
+}
+
+int clear_audio_file(uint8_t num)
+{
+    sd_req_t req = {.type = REQ_CLEAR_AUDIO_FILE, .u.num = num};
+    return sd_submit(&req);
+}
+
+int clear_audio_directory()
+{
+    sd_req_t req = {.type = REQ_CLEAR_AUDIO_DIR};
+    return sd_submit(&req);
+}
+
+int save_offset(uint32_t offset)
+{
+    sd_req_t req = {.type = REQ_SAVE_OFFSET, .u.offset = offset};
+    return sd_submit(&req);
+}
+
+int get_offset()
+{
+    sd_req_t req = {.type = REQ_GET_OFFSET};
+    return sd_submit(&req);
+}
+
 void sd_off()
  {
+    if (sd_worker_tid && sd_enabled) {
+        sd_req_t req = {.type = REQ_FLUSH}; // write the batch before the card loses power
+        sd_submit(&req);
+    }
+
     // Suspend SPI peripheral to save power
     const struct device *spi_dev = DEVICE_DT_GET(DT_NODELABEL(spi2));
     if (device_is_ready(spi_dev)) {
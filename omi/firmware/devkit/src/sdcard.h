@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define MAX_WRITE_SIZE 440 // Bytes per audio block written to the SD card
+
 /**
  * @brief Mount the SD Card. Initializes the audio files
  *
@@ -35,11 +37,12 @@ char *generate_new_audio_header(uint8_t num);
 int initialize_audio_file(uint8_t num);
 
 /**
- * @brief Write to the current audio file specified by the write pointer
- *
+ * @brief Queue a block for the current audio file specified by the write pointer
  *
+ * The SD worker keeps the file open and appends blocks in batches, so this only copies the
+ * block (at most MAX_WRITE_SIZE bytes). Reads, sizes and clears see every block queued before them.
  *
- * @return number of bytes written
+ * @return 0 if queued, negative errno code if the queue stayed full
  */
 int write_to_file(uint8_t *data, uint32_t length);
 
@@ -54,9 +57,10 @@ int read_audio_data(uint8_t *buf, int amount, int offset);
 /**
  * @brief Get the size of the specified audio file number
  *
+ * Served from the file table kept in RAM, without touching the card. The file being written
+ * counts the blocks still queued.
  *
- *
- * @return size of the file in bytes
+ * @return size of the file in bytes, 0 if there is no such file
  */
 uint32_t get_file_size(uint8_t num);
 
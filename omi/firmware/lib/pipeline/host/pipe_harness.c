@@ -0,0 +1,350 @@
+/* Host harness of the building blocks of the pendant's audio path, the off-device counterpart of
+ * "pipeline bench":
+ *
+ *     pipe_harness [frames]
+ *
+ * codec.c and transport.c need Zephyr, the BT host and the PDM driver, so they are not built here.
+ * The harness runs the lib/pipeline code they call, with the pendant's constants: synthetic
+ * speech-like PCM through the VAD gate of codec.c, libopus with the pendant's encoder settings,
+ * the live framing of the pusher into a mocked GATT notify at a 247 and a 23-byte MTU, packed and
+ * fragmented, and the storage record packing into 440-byte blocks. Between encoder and pusher it
+ * uses pipe_ring, the tx ring of omiGlass; the pendant's frame_queue is not part of it. The mocked
+ * notify and the block submit parse everything back against the frames that went in.
+ *
+ * Reports frames per second, payload copies and bytes copied per frame, notifications, blocks and
+ * allocations (ring slots and storage blocks; the path itself never calls malloc). Exits 1 if a
+ * frame comes back different or is lost.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <opus.h>
+
+#include "pipe_frame.h"
+#include "pipe_port.h"
+#include "pipe_record.h"
+#include "pipe_ring.h"
+#include "pipe_vad.h"
+
+// The pendant's values, from omi/src/lib/core/config.h
+#define SAMPLE_RATE 16000
+#define FRAME_SAMPLES (SAMPLE_RATE / 50) // CODEC_PACKAGE_SAMPLES, 20 ms
+#define FRAME_MAX 160                    // CODEC_OUTPUT_MAX_BYTES
+#define OPUS_BITRATE 32000               // CODEC_OPUS_BITRATE
+#define OPUS_COMPLEXITY 3                // CODEC_OPUS_COMPLEXITY
+#define RING_BYTES 8192                  // pipe_ring bytes, a power of two: ~85 encoded frames and their 2-byte lengths
+#define PACK_MAX_FRAMES 3                // AUDIO_PACK_MAX_FRAMES
+#define BLOCK_SIZE 440                   // MAX_WRITE_SIZE
+#define BLOCK_COUNT 4                    // spill blocks in flight to the SD worker
+#define DEFAULT_FRAMES 15000             // 5 minutes of audio
+#define MTU_MAX 247
+#define ATT_HEADER_SIZE 3
+#define TWO_PI 6.2831853f
+
+struct sink {
+    const char *name;
+    uint16_t mtu;
+    bool packed;
+};
+
+static const struct sink sinks[] = {
+    {"packed, 247-byte MTU", MTU_MAX, true},
+    {"fragmented, 247-byte MTU", MTU_MAX, false},
+    {"fragmented, 23-byte MTU", 23, false},
+};
+
+static const struct pipe_vad_config vad_config = {
+    .samples = FRAME_SAMPLES,
+    .min_level = 120,      // CODEC_VAD_MIN_LEVEL
+    .noise_margin = 3,     // CODEC_VAD_NOISE_MARGIN
+    .hangover_frames = 25, // CODEC_VAD_HANGOVER_FRAMES
+    .keepalive_frames = 50,
+};
+
+static const struct pipe_record_format record_format = {BLOCK_SIZE, FRAME_MAX};
+
+struct harness_stats {
+    uint32_t frames;   // PCM frames in
+    uint32_t gated;    // frames the VAD dropped
+    uint32_t encoded;  // frames queued to the ring and the store
+    uint64_t encoded_bytes;
+    uint32_t copies;   // payload copies
+    uint64_t copied;   // payload bytes copied
+    uint32_t slots;    // ring slots taken
+    uint32_t dropped;  // puts refused for a full ring
+    uint32_t notifications;
+    uint64_t notified; // bytes handed to notify, headers included
+    uint32_t received; // frames the mocked app reassembled
+    uint32_t blocks;   // storage blocks allocated
+    uint32_t stored;   // frames parsed back from full blocks
+    uint32_t failures;
+};
+
+static struct harness_stats stats;
+static int16_t pcm[FRAME_SAMPLES];
+static uint8_t ring_buf[RING_BYTES];
+static struct pipe_ring ring;
+static uint8_t packet[MTU_MAX - ATT_HEADER_SIZE];
+static uint8_t frame[FRAME_MAX];
+static struct pipe_frame_pack pack;
+static uint16_t packet_id;
+
+// Frames the app and the store should see, in order
+#define EXPECT_COUNT 64
+static uint8_t expect_data[EXPECT_COUNT][FRAME_MAX];
+static uint8_t expect_len[EXPECT_COUNT];
+static uint32_t expect_head;
+static uint32_t notify_tail;
+static uint32_t store_tail;
+
+static uint8_t reassembly[FRAME_MAX];
+static uint16_t reassembly_len;
+
+static uint8_t blocks[BLOCK_COUNT][BLOCK_SIZE];
+static uint32_t block_next;
+static struct pipe_record_packer packer;
+
+static OpusEncoder *encoder;
+
+static void fail(const char *what, uint32_t n)
+{
+    if (stats.failures++ < 10) {
+        printf("FAIL: %s at frame %u\n", what, n);
+    }
+}
+
+static void count_copy(uint16_t len)
+{
+    stats.copies++;
+    stats.copied += len;
+}
+
+// Voiced harmonics with a gliding pitch and a syllable envelope, pauses and a little noise, as
+// pipeline_bench.c feeds the pendant
+static void fill_pcm(uint32_t n)
+{
+    static uint32_t noise = 0x12345678;
+    uint32_t first_sample = n * FRAME_SAMPLES;
+    bool pause = (n / 100) % 3 == 2;
+
+    for (uint16_t i = 0; i < FRAME_SAMPLES; i++) {
+        float t = (float) (first_sample + i) / SAMPLE_RATE;
+        float f0 = 140.0f + 40.0f * sinf(TWO_PI * 0.7f * t);
+        float envelope = pause ? 0 : 0.5f + 0.5f * sinf(TWO_PI * 4.0f * t);
+        float voiced = 0;
+        for (int h = 1; h <= 6; h++) {
+            voiced += sinf(TWO_PI * f0 * h * t) / h;
+        }
+        noise = noise * 1664525u + 1013904223u;
+        float sample = 6000.0f * envelope * voiced + (float) ((int32_t) noise >> 24);
+        pcm[i] = (int16_t) (sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample);
+    }
+}
+
+static uint16_t encode(uint32_t n, uint8_t *out)
+{
+    int len = opus_encode(encoder, pcm, FRAME_SAMPLES, out, FRAME_MAX);
+    if (len <= 0) {
+        fail("opus_encode", n);
+        return 0;
+    }
+    return (uint16_t) len;
+}
+
+// The app's side of the mocked notify: unpack or reassemble, then compare
+static void app_frame(const uint8_t *data, uint16_t len, uint32_t n)
+{
+    uint8_t *expect = expect_data[notify_tail % EXPECT_COUNT];
+    if (notify_tail == expect_head || len != expect_len[notify_tail % EXPECT_COUNT] || memcmp(data, expect, len)) {
+        fail("the app received a different frame", n);
+    }
+    notify_tail++;
+    stats.received++;
+}
+
+static void notify(const uint8_t *data, uint16_t len, uint32_t n)
+{
+    stats.notifications++;
+    stats.notified += len;
+    if (data[2] & PIPE_FRAME_PACK_FLAG) {
+        uint16_t pos = PIPE_FRAME_HEADER_SIZE;
+        for (uint8_t i = 0; i < (data[2] & PIPE_FRAME_PACK_MAX); i++) {
+            app_frame(data + pos + 1, data[pos], n);
+            pos += 1 + data[pos];
+        }
+        if (pos != len) {
+            fail("the pack length differs from its entries", n);
+        }
+        return;
+    }
+    if (data[2] == 0) {
+        reassembly_len = 0;
+    }
+    memcpy(reassembly + reassembly_len, data + PIPE_FRAME_HEADER_SIZE, len - PIPE_FRAME_HEADER_SIZE);
+    reassembly_len += len - PIPE_FRAME_HEADER_SIZE;
+}
+
+// The pusher: take one frame from the ring and frame it as push_packed_to_gatt/push_to_gatt do
+static void push(const struct sink *sink, uint32_t n)
+{
+    uint16_t capacity = sink->mtu - ATT_HEADER_SIZE;
+    uint16_t len = pipe_ring_get(&ring, frame, sizeof(frame));
+    if (len == 0) {
+        return;
+    }
+    count_copy(len);
+
+    if (sink->packed) {
+        if (pack.count >= PACK_MAX_FRAMES || !pipe_frame_pack_fits(&pack, capacity, len, 0)) {
+            notify(packet, pipe_frame_pack_finish(&pack, packet_id++), n);
+        }
+        pipe_frame_pack_add(&pack, frame, len, 0);
+        count_copy(len);
+        return;
+    }
+
+    uint16_t offset = 0;
+    for (uint8_t index = 0; offset < len; index++) {
+        uint16_t taken = pipe_frame_fragment(packet, capacity, packet_id++, index, frame + offset, len - offset);
+        count_copy(taken);
+        offset += taken;
+        notify(packet, taken + PIPE_FRAME_HEADER_SIZE, n);
+    }
+    app_frame(reassembly, reassembly_len, n);
+}
+
+static uint8_t *block_alloc(void)
+{
+    stats.blocks++;
+    return blocks[block_next++ % BLOCK_COUNT];
+}
+
+// The SD worker's side: parse the full block back
+static void block_submit(uint8_t *block)
+{
+    struct pipe_record record;
+    uint16_t pos = 0;
+    int ret;
+
+    while ((ret = pipe_record_next(&record_format, block, &pos, &record)) > 0) {
+        uint32_t i = store_tail % EXPECT_COUNT;
+        if (store_tail == expect_head || record.tag || record.size != expect_len[i] ||
+            memcmp(record.data, expect_data[i], record.size)) {
+            fail("a stored record differs from its frame", store_tail);
+        }
+        store_tail++;
+        stats.stored++;
+    }
+    if (ret < 0) {
+        fail("a storage block is malformed", store_tail);
+    }
+}
+
+static void run(const struct sink *sink, uint32_t frames)
+{
+    struct pipe_vad vad;
+    uint8_t encoded[FRAME_MAX];
+
+    memset(&stats, 0, sizeof(stats));
+    expect_head = notify_tail = store_tail = 0;
+    pipe_ring_init(&ring, ring_buf, sizeof(ring_buf));
+    pipe_frame_pack_init(&pack, packet);
+    pipe_vad_init(&vad, &vad_config);
+    packer = (struct pipe_record_packer) {&record_format, NULL, 0, block_alloc, block_submit};
+    opus_encoder_ctl(encoder, OPUS_RESET_STATE);
+
+    uint64_t busy = 0;
+    for (uint32_t n = 0; n < frames; n++) {
+        bool voiced;
+        fill_pcm(n);
+        stats.frames++;
+
+        uint32_t start = pipe_ticks();
+        if (!pipe_vad_gate(&vad, pcm, &voiced)) {
+            stats.gated++;
+            busy += pipe_ticks() - start;
+            continue;
+        }
+        uint16_t len = encode(n, encoded);
+        if (len == 0) {
+            continue;
+        }
+        // Neither the app nor the store may fall a whole window behind
+        if (expect_head - store_tail >= EXPECT_COUNT || expect_head - notify_tail >= EXPECT_COUNT) {
+            fail("frames pile up unseen", n);
+            break;
+        }
+        memcpy(expect_data[expect_head % EXPECT_COUNT], encoded, len);
+        expect_len[expect_head % EXPECT_COUNT] = (uint8_t) len;
+        expect_head++;
+        stats.encoded++;
+        stats.encoded_bytes += len;
+
+        // write_to_tx_queue, then write_to_storage from the same frame
+        if (pipe_ring_put(&ring, encoded, len)) {
+            count_copy(len);
+            stats.slots++;
+        } else {
+            stats.dropped++;
+        }
+        uint8_t head = (uint8_t) len;
+        if (!pipe_record_append(&packer, &head, 1, encoded, len)) {
+            fail("no storage block", n);
+        }
+        count_copy(len);
+
+        push(sink, n);
+        busy += pipe_ticks() - start;
+    }
+    if (pack.count > 0) {
+        notify(packet, pipe_frame_pack_finish(&pack, packet_id++), frames);
+    }
+    if (stats.received != stats.encoded - stats.dropped) {
+        fail("frames lost between the encoder and the app", frames);
+    }
+
+    uint32_t us = pipe_ticks_to_us(busy);
+    uint32_t sent = stats.encoded ? stats.encoded : 1;
+    printf("%s: %u frames, %u gated, %u encoded (%.1f bytes avg)\n", sink->name, stats.frames, stats.gated,
+           stats.encoded, (double) stats.encoded_bytes / sent);
+    printf("  %.0f frames/s (%.0fx real time), %.2f copies and %.1f bytes copied per encoded frame\n",
+           us ? stats.frames * 1e6 / us : 0, us ? stats.frames * 20e3 / us : 0, (double) stats.copies / sent,
+           (double) stats.copied / sent);
+    printf("  %u notifications (%.2f per frame, %.1f bytes avg), %u ring slots, %u dropped\n", stats.notifications,
+           (double) stats.notifications / sent, stats.notifications ? (double) stats.notified / stats.notifications : 0,
+           stats.slots, stats.dropped);
+    printf("  %u storage blocks allocated, %u frames parsed back, %u received by the app\n", stats.blocks,
+           stats.stored, stats.received);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t frames = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : DEFAULT_FRAMES;
+    uint32_t failures = 0;
+
+    pipe_ticks_init();
+    int err;
+    encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_RESTRICTED_LOWDELAY, &err);
+    if (err != OPUS_OK) {
+        printf("FAIL: opus_encoder_create: %d\n", err);
+        return 1;
+    }
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(OPUS_BITRATE));
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(OPUS_COMPLEXITY));
+    opus_encoder_ctl(encoder, OPUS_SET_VBR(1));
+    opus_encoder_ctl(encoder, OPUS_SET_VBR_CONSTRAINT(0));
+    printf("Audio path harness: libopus %s\n", opus_get_version_string());
+
+    for (size_t i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        run(&sinks[i], frames);
+        failures += stats.failures;
+    }
+    opus_encoder_destroy(encoder);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,262 @@
+/* Host tests of the pipeline core: the shared benchmarks with their results checked, and round
+ * trips of the live framing through a parser written from the format description in pipe_frame.h.
+ * Prints the benchmark numbers, exits 1 if any check fails.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pipe_bench.h"
+#include "pipe_frame.h"
+#include "pipe_port.h"
+#include "pipe_stats.h"
+
+#define TEST_FRAMES 20000
+#define TEST_RECORDS 200000
+#define FRAME_MAX 300
+#define PACKET_MAX 517
+#define PACKET_MIN 8 // smallest packets taking a FRAME_MAX frame in fragments 0 to 63
+
+static int failures = 0;
+static uint32_t rng = 1;
+
+#define CHECK(cond, ...)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                                                                \
+            printf(__VA_ARGS__);                                                                                       \
+            printf("\n");                                                                                              \
+            failures++;                                                                                                \
+        }                                                                                                              \
+    } while (0)
+
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static void test_ring(void)
+{
+    static const uint16_t lengths[] = {1, 3, 80, 160, 1000};
+    struct pipe_bench_ring_result r;
+
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        pipe_bench_ring(TEST_FRAMES, lengths[i], &r);
+        CHECK(r.frames == TEST_FRAMES && r.dropped == 0 && r.corrupt == 0,
+              "ring of %u-byte frames: %u dropped, %u corrupt", lengths[i], r.dropped, r.corrupt);
+        printf("Ring: %u frames of %u bytes in %u us\n", r.frames, lengths[i], r.us);
+    }
+}
+
+static void test_record(void)
+{
+    static const struct pipe_record_format formats[] = {{440, 160}, {440, 164}, {512, 251}, {64, 20}, {4, 1}};
+    static const uint8_t tags[] = {0xFC, 0xFD, 0xFE, 0xFF};
+    static const struct pipe_record_format too_long = {440, PIPE_RECORD_TAG_MIN};
+    struct pipe_bench_record_result r;
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        int ret = pipe_bench_record(&formats[i], tags, sizeof(tags), TEST_RECORDS, 1 + (uint32_t) i, &r);
+        CHECK(ret == 0 && r.mismatches == 0 && r.appended == TEST_RECORDS,
+              "records in %u-byte blocks: %d, %u mismatches, first at record %u", formats[i].block_size, ret,
+              r.mismatches, r.bad_record);
+        CHECK(r.parsed + PIPE_BENCH_MAX_BLOCK / 2 >= r.appended, "only %u of %u records parsed back", r.parsed,
+              r.appended);
+        printf("Records: %u in %u blocks of %u bytes, pack %u us, parse %u us\n", r.appended, r.blocks,
+               formats[i].block_size, r.pack_us, r.parse_us);
+    }
+    CHECK(pipe_bench_record(&too_long, tags, sizeof(tags), 1, 1, &r) == -EINVAL,
+          "audio lengths that read as tags must be refused");
+}
+
+static void test_vad(void)
+{
+    static const struct pipe_vad_config config = {
+        .samples = 320,
+        .min_level = 120,
+        .noise_margin = 3,
+        .hangover_frames = 10,
+        .keepalive_frames = 50,
+    };
+    struct pipe_bench_vad_result r;
+
+    pipe_bench_vad(&config, TEST_FRAMES, &r);
+    // Syllables take 40 of every 100 frames
+    CHECK(r.voiced > TEST_FRAMES / 4 && r.voiced <= TEST_FRAMES / 2, "%u of %u frames voiced", r.voiced, r.frames);
+    CHECK(r.passed >= r.voiced && r.passed < TEST_FRAMES * 3 / 4, "%u passed, %u voiced", r.passed, r.voiced);
+    printf("VAD: %u frames in %u us, %u voiced, %u passed\n", r.frames, r.us, r.voiced, r.passed);
+}
+
+// Seconds of steady speech must not raise the floor until the gate closes on it
+static void test_vad_sustained(void)
+{
+    static const struct pipe_vad_config config = {
+        .samples = 320,
+        .min_level = 120,
+        .noise_margin = 3,
+        .hangover_frames = 10,
+        .keepalive_frames = 50,
+    };
+    static int16_t frame[320];
+    struct pipe_vad vad;
+    uint32_t unvoiced = 0;
+
+    pipe_vad_init(&vad, &config);
+    for (uint32_t n = 0; n < 50 + 500 + 50; n++) {
+        // A second of room noise, ten seconds of speech at a steady level, a second of noise again
+        bool speech = n >= 50 && n < 550;
+        for (size_t i = 0; i < config.samples; i++) {
+            int32_t amplitude = speech ? 2000 : 40;
+            frame[i] = (int16_t) ((int32_t) (next_random() % (2 * amplitude + 1)) - amplitude);
+        }
+        bool voiced = pipe_vad_voiced(&vad, frame);
+        if (speech && !voiced) {
+            unvoiced++;
+        }
+        if (n == 50 + 500 + 49) {
+            CHECK(!voiced, "noise after the speech is voiced, floor %u", vad.noise_floor);
+        }
+    }
+    CHECK(unvoiced == 0, "%u of 500 frames of steady speech unvoiced", unvoiced);
+}
+
+static void test_stats(void)
+{
+    struct pipe_stats stats;
+    struct pipe_stats_summary s;
+
+    memset(&stats, 0, sizeof(stats));
+    pipe_stats_get(&stats, &s);
+    CHECK(s.count == 0 && s.max == 0, "empty stats");
+    for (uint32_t i = 0; i < 99; i++) {
+        pipe_stats_add(&stats, 100);
+    }
+    pipe_stats_add(&stats, 5000);
+    pipe_stats_get(&stats, &s);
+    CHECK(s.count == 100 && s.min == 100 && s.max == 5000 && s.avg == 149, "min %u avg %u max %u", s.min, s.avg,
+          s.max);
+    // 100 is in the bucket below 128
+    CHECK(s.p99 == 128, "p99 %u", s.p99);
+}
+
+static void fill_frame(uint8_t *frame, uint16_t len, uint32_t n)
+{
+    for (uint16_t i = 0; i < len; i++) {
+        frame[i] = (uint8_t) (n * 31 + i);
+    }
+}
+
+// Split random frames into fragments and join them back as the app does
+static void test_fragments(void)
+{
+    uint8_t frame[FRAME_MAX];
+    uint8_t joined[FRAME_MAX];
+    uint8_t packet[PACKET_MAX];
+    uint16_t id = 0xFFF0; // wraps during the run
+
+    for (uint32_t n = 0; n < TEST_FRAMES; n++) {
+        uint16_t len = 1 + next_random() % FRAME_MAX;
+        uint16_t max_packet = PACKET_MIN + next_random() % (PACKET_MAX - PACKET_MIN + 1);
+        uint8_t first = (n & 1) ? PIPE_FRAME_TIMESTAMP_FLAG : 0;
+        uint16_t offset = 0;
+        uint8_t index = 0;
+        int ok = 1;
+
+        fill_frame(frame, len, n);
+        while (offset < len && ok) {
+            uint16_t expected_id = id;
+            uint16_t taken = pipe_frame_fragment(packet, max_packet, id++, index == 0 ? first : index, frame + offset,
+                                                 len - offset);
+            uint16_t packet_id = (uint16_t) (packet[0] | packet[1] << 8);
+            // Fragment indexes stay below the flag bits
+            ok = taken > 0 && taken + PIPE_FRAME_HEADER_SIZE <= max_packet && packet_id == expected_id &&
+                 index < PIPE_FRAME_TIMESTAMP_FLAG && packet[2] == (index == 0 ? first : index);
+            memcpy(joined + offset, packet + PIPE_FRAME_HEADER_SIZE, taken);
+            offset += taken;
+            index++;
+        }
+        CHECK(ok && offset == len && memcmp(frame, joined, len) == 0, "frame %u of %u bytes in %u-byte packets", n,
+              len, max_packet);
+    }
+}
+
+// Pack random frames and take them apart again
+static void test_packs(void)
+{
+    uint8_t frames[PIPE_FRAME_PACK_MAX + 1][UINT8_MAX];
+    uint16_t lengths[PIPE_FRAME_PACK_MAX + 1];
+    uint8_t packet[PACKET_MAX];
+    struct pipe_frame_pack pack;
+    uint32_t packs = 0;
+
+    pipe_frame_pack_init(&pack, packet);
+    for (uint32_t n = 0; n < TEST_FRAMES; n++) {
+        uint16_t max_packet = 23 + next_random() % (PACKET_MAX - 23);
+        uint8_t flags = (n / 8) & 1 ? PIPE_FRAME_TIMESTAMP_FLAG : 0;
+        uint8_t count = 0;
+        uint8_t pack_flags = flags;
+
+        // Fill one pack until the next frame doesn't fit
+        for (;;) {
+            uint16_t room = max_packet - PIPE_FRAME_HEADER_SIZE - 1;
+            uint16_t len = 1 + next_random() % (room < 64 ? room : 64);
+            if (!pipe_frame_pack_fits(&pack, max_packet, len, flags)) {
+                break;
+            }
+            fill_frame(frames[count], len, n + count);
+            lengths[count] = len;
+            pipe_frame_pack_add(&pack, frames[count], len, flags);
+            count++;
+        }
+        CHECK(count > 0 && count <= PIPE_FRAME_PACK_MAX, "%u frames in a %u-byte pack", count, max_packet);
+
+        uint16_t size = pipe_frame_pack_finish(&pack, (uint16_t) n);
+        CHECK(size <= max_packet && packet[0] == (uint8_t) n && packet[1] == (uint8_t) (n >> 8) &&
+                  packet[2] == (PIPE_FRAME_PACK_FLAG | pack_flags | count),
+              "pack header %02x for %u frames", packet[2], count);
+        uint16_t pos = PIPE_FRAME_HEADER_SIZE;
+        for (uint8_t i = 0; i < count; i++) {
+            int ok = pos < size && packet[pos] == lengths[i] && pos + 1 + lengths[i] <= size &&
+                     memcmp(packet + pos + 1, frames[i], lengths[i]) == 0;
+            CHECK(ok, "entry %u of pack %u", i, packs);
+            pos += 1 + lengths[i];
+        }
+        CHECK(pos == size, "pack %u is %u bytes, its entries end at %u", packs, size, pos);
+        CHECK(pipe_frame_pack_finish(&pack, 0) == 0, "a finished pack must be empty");
+        packs++;
+    }
+
+    // Entries with and without a capture time never share a pack
+    pipe_frame_pack_add(&pack, packet, 10, PIPE_FRAME_TIMESTAMP_FLAG);
+    CHECK(!pipe_frame_pack_fits(&pack, PACKET_MAX, 10, 0), "mixed timestamp flags in one pack");
+    pipe_frame_pack_init(&pack, packet);
+}
+
+static void test_ticks(void)
+{
+    uint32_t start = pipe_ticks();
+    uint32_t hz = pipe_ticks_hz();
+
+    CHECK(pipe_ticks_to_us(hz) == 1000000, "one second of ticks is %u us", pipe_ticks_to_us(hz));
+    CHECK(pipe_ticks_to_us((uint64_t) hz * 3600) == 3600000000u, "an hour of ticks");
+    CHECK(pipe_ticks() - start < hz, "ticks run backwards or far too fast");
+}
+
+int main(void)
+{
+    pipe_ticks_init();
+    test_ring();
+    test_record();
+    test_vad();
+    test_vad_sustained();
+    test_stats();
+    test_fragments();
+    test_packs();
+    test_ticks();
+    printf("Pipeline core: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+// The pipeline core and its tests compiled as C++ in one unit, so a construct only C accepts fails
+// here rather than in the omiGlass build.
+
+#include "../pipe_bench.c"
+#include "../pipe_frame.c"
+#include "../pipe_record.c"
+#include "../pipe_ring.c"
+#include "../pipe_stats.c"
+#include "../pipe_vad.c"
+
+#include "pipe_test.c"
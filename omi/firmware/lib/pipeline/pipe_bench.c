@@ -0,0 +1,238 @@
+#include "pipe_bench.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "pipe_port.h"
+#include "pipe_ring.h"
+
+#define PIPE_BENCH_PENDING (PIPE_BENCH_MAX_BLOCK / 2) // records of one block at most
+#define PIPE_BENCH_VAD_SAMPLES 960                   // 20 ms at 48 kHz
+#define PIPE_BENCH_VAD_PERIOD 100                    // frames per syllable and pause
+#define PIPE_BENCH_VAD_VOICED 40                     // voiced frames at the start of each period
+
+// xorshift32, never seeded with 0
+static uint32_t bench_rng;
+
+static uint32_t bench_random(void)
+{
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 17;
+    bench_rng ^= bench_rng << 5;
+    return bench_rng;
+}
+
+static uint8_t bench_byte(uint32_t record, uint16_t i)
+{
+    return (uint8_t) (record * 131 + i * 7 + (record >> 8));
+}
+
+//
+// Ring
+//
+
+static uint8_t ring_buf[PIPE_BENCH_RING_BYTES];
+static uint8_t ring_frame[PIPE_BENCH_RING_BYTES / 4];
+static uint8_t ring_out[PIPE_BENCH_RING_BYTES / 4];
+
+void pipe_bench_ring(uint32_t frames, uint16_t frame_len, struct pipe_bench_ring_result *result)
+{
+    struct pipe_ring ring;
+    uint32_t put = 0;
+    uint32_t taken = 0;
+
+    memset(result, 0, sizeof(*result));
+    frame_len = frame_len == 0 ? 1 : frame_len > sizeof(ring_frame) ? sizeof(ring_frame) : frame_len;
+    // Half the ring per burst, so the frames land at every offset and wrap
+    uint32_t burst = sizeof(ring_buf) / 2 / (frame_len + 2);
+    pipe_ring_init(&ring, ring_buf, sizeof(ring_buf));
+    pipe_ticks_init();
+
+    uint32_t start = pipe_ticks();
+    while (taken < frames) {
+        for (uint32_t i = 0; i < burst && put < frames; i++, put++) {
+            ring_frame[0] = (uint8_t) put;
+            pipe_ring_put(&ring, ring_frame, frame_len);
+        }
+        uint16_t len;
+        while ((len = pipe_ring_get(&ring, ring_out, sizeof(ring_out))) > 0) {
+            if (len != frame_len || ring_out[0] != (uint8_t) taken) {
+                result->corrupt++;
+            }
+            result->bytes += len;
+            taken++;
+        }
+        if (taken < put) {
+            // Dropped puts leave nothing to take
+            taken = put;
+        }
+    }
+    result->us = pipe_ticks_to_us(pipe_ticks() - start);
+    result->frames = frames;
+    result->dropped = ring.dropped;
+}
+
+//
+// Voice activity gate
+//
+
+static int16_t vad_frame[PIPE_BENCH_VAD_SAMPLES];
+
+// A 200 Hz triangle under a syllable envelope, or just the noise floor during pauses
+static void vad_fill(uint32_t n, uint16_t samples)
+{
+    uint32_t phase = n % PIPE_BENCH_VAD_PERIOD;
+    int32_t amplitude = phase < PIPE_BENCH_VAD_VOICED ? 500 + 200 * (int32_t) (phase % 10) : 0;
+
+    for (uint16_t i = 0; i < samples; i++) {
+        int32_t t = (int32_t) ((n * samples + i) % 240);
+        int32_t triangle = t < 120 ? t - 60 : 180 - t;
+        int32_t noise = (int32_t) (bench_random() >> 25) - 64;
+        vad_frame[i] = (int16_t) (triangle * amplitude / 60 + noise);
+    }
+}
+
+void pipe_bench_vad(const struct pipe_vad_config *config, uint32_t frames, struct pipe_bench_vad_result *result)
+{
+    struct pipe_vad vad;
+    uint64_t gate_ticks = 0;
+
+    memset(result, 0, sizeof(*result));
+    if (config->samples > PIPE_BENCH_VAD_SAMPLES) {
+        return;
+    }
+    pipe_vad_init(&vad, config);
+    pipe_ticks_init();
+    bench_rng = 1;
+
+    for (uint32_t n = 0; n < frames; n++) {
+        bool voiced;
+        vad_fill(n, config->samples);
+        uint32_t start = pipe_ticks();
+        bool passed = pipe_vad_gate(&vad, vad_frame, &voiced);
+        gate_ticks += pipe_ticks() - start;
+        result->voiced += voiced;
+        result->passed += passed;
+    }
+    result->frames = frames;
+    result->us = pipe_ticks_to_us(gate_ticks);
+}
+
+//
+// Record round trip
+//
+
+struct record_expect {
+    uint8_t tag;
+    uint8_t size;
+};
+
+static uint8_t record_block[PIPE_BENCH_MAX_BLOCK];
+static uint8_t record_payload[UINT8_MAX];
+static struct record_expect record_pending[PIPE_BENCH_PENDING];
+static const struct pipe_record_format *record_format;
+static struct pipe_bench_record_result *record_result;
+static uint64_t record_parse_ticks;
+static uint64_t record_fill_ticks;
+
+// Stale bytes past the terminator must never be read as records
+static uint8_t *record_alloc(void)
+{
+    uint32_t start = pipe_ticks();
+    for (size_t i = 0; i < record_format->block_size; i += sizeof(uint32_t)) {
+        uint32_t word = bench_random();
+        size_t left = record_format->block_size - i;
+        memcpy(record_block + i, &word, left < sizeof(word) ? left : sizeof(word));
+    }
+    record_fill_ticks += pipe_ticks() - start;
+    return record_block;
+}
+
+static void record_submit(uint8_t *block)
+{
+    struct pipe_bench_record_result *result = record_result;
+    struct pipe_record record;
+    uint16_t pos = 0;
+    int ret;
+    uint32_t start = pipe_ticks();
+
+    result->blocks++;
+    while ((ret = pipe_record_next(record_format, block, &pos, &record)) > 0) {
+        const struct record_expect *expect = &record_pending[result->parsed % PIPE_BENCH_PENDING];
+        bool match = result->parsed < result->appended && record.tag == expect->tag && record.size == expect->size;
+        for (uint16_t i = 0; match && i < record.size; i++) {
+            match = record.data[i] == bench_byte(result->parsed, i);
+        }
+        if (!match && result->mismatches++ == 0) {
+            result->bad_record = result->parsed;
+            result->bad_block = result->blocks;
+            result->bad_pos = pos;
+            result->bad_tag = record.tag;
+            result->bad_size = record.size;
+            result->expected_tag = expect->tag;
+            result->expected_size = expect->size;
+        }
+        result->parsed++;
+    }
+    if (ret < 0 && result->mismatches++ == 0) {
+        result->bad_block = result->blocks;
+        result->bad_pos = pos;
+        result->malformed = 1;
+    }
+    record_parse_ticks += pipe_ticks() - start;
+}
+
+int pipe_bench_record(const struct pipe_record_format *format, const uint8_t *tags, uint8_t tag_count,
+                      uint32_t records, uint32_t seed, struct pipe_bench_record_result *result)
+{
+    struct pipe_record_packer packer = {
+        .format = format, .block = NULL, .offset = 0, .alloc = record_alloc, .submit = record_submit};
+    uint16_t end = format->block_size - 1;
+    uint64_t append_ticks = 0;
+
+    memset(result, 0, sizeof(*result));
+    if (format->block_size > PIPE_BENCH_MAX_BLOCK || format->block_size < 4 || format->max_frame == 0 ||
+        format->max_frame >= PIPE_RECORD_TAG_MIN) {
+        return -EINVAL;
+    }
+    // Every record must fit an empty block
+    uint16_t max_tagged = end - 2 < UINT8_MAX ? end - 2 : UINT8_MAX;
+    uint16_t max_frame = end - 1 < format->max_frame ? end - 1 : format->max_frame;
+    record_format = format;
+    record_result = result;
+    record_parse_ticks = record_fill_ticks = 0;
+    bench_rng = seed ? seed : 1;
+    pipe_ticks_init();
+
+    for (uint32_t n = 0; n < records && result->mismatches == 0; n++) {
+        uint32_t r = bench_random();
+        uint16_t space = packer.block ? end - packer.offset : end;
+        struct record_expect expect = {0, 0};
+        if ((r & 0xF) == 0 && tag_count > 0) {
+            expect.tag = tags[(r >> 4) % tag_count];
+            expect.size = 1 + (r >> 8) % max_tagged;
+        } else if ((r & 0xF) == 1 && space > 1 && space - 1 <= max_frame) {
+            // Fill the block up to the last byte
+            expect.size = space - 1;
+        } else {
+            expect.size = 1 + (r >> 8) % max_frame;
+        }
+        uint8_t head[2] = {expect.tag, expect.size};
+        uint8_t head_len = expect.tag ? 2 : 1;
+        for (uint16_t i = 0; i < expect.size; i++) {
+            record_payload[i] = bench_byte(result->appended, i);
+        }
+        record_pending[result->appended % PIPE_BENCH_PENDING] = expect;
+        result->appended++;
+
+        uint32_t start = pipe_ticks();
+        pipe_record_append(&packer, expect.tag ? head : head + 1, head_len, record_payload, expect.size);
+        append_ticks += pipe_ticks() - start;
+        result->bytes += head_len + expect.size;
+    }
+
+    // Filling and parsing run from within the appends
+    result->pack_us = pipe_ticks_to_us(append_ticks - record_parse_ticks - record_fill_ticks);
+    result->parse_us = pipe_ticks_to_us(record_parse_ticks);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef PIPE_BENCH_H
+#define PIPE_BENCH_H
+
+#include <stdint.h>
+
+#include "pipe_record.h"
+#include "pipe_vad.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Benchmarks of the pipeline core, the same code on every product so their numbers compare. Each
+ * one runs to completion on the calling thread and fills in a result for the caller to log; they
+ * share static buffers, so only one may run at a time. Times come from pipe_ticks().
+ */
+#define PIPE_BENCH_MAX_BLOCK 512   // largest record block the round trip takes
+#define PIPE_BENCH_RING_BYTES 4096 // ring of the ring benchmark
+
+struct pipe_bench_ring_result {
+    uint32_t frames;  // frames put and taken back
+    uint32_t dropped; // puts refused for a full ring, 0 unless the ring is broken
+    uint32_t corrupt; // frames that came back different
+    uint64_t bytes;
+    uint32_t us;
+};
+
+struct pipe_bench_vad_result {
+    uint32_t frames;
+    uint32_t voiced;
+    uint32_t passed; // voiced, hangover and keepalive frames
+    uint32_t us;
+};
+
+struct pipe_bench_record_result {
+    uint32_t appended;
+    uint32_t parsed; // records parsed back, those in the open block at the end never are
+    uint32_t blocks;
+    uint32_t mismatches;
+    uint64_t bytes;
+    uint32_t pack_us;
+    uint32_t parse_us;
+    // First mismatch, valid if mismatches > 0
+    uint32_t bad_record;
+    uint32_t bad_block;
+    uint16_t bad_pos;
+    uint8_t bad_tag;
+    uint8_t bad_size;
+    uint8_t expected_tag;
+    uint8_t expected_size;
+    uint8_t malformed; // the block itself failed to parse at bad_pos
+};
+
+/**
+ * @brief Push frames of frame_len bytes through a ring, in bursts that wrap it, and check them
+ */
+void pipe_bench_ring(uint32_t frames, uint16_t frame_len, struct pipe_bench_ring_result *result);
+
+/**
+ * @brief Gate frames of synthetic syllables and pauses over a noise floor
+ *
+ * @param config Gate under test, at most 960 samples per frame
+ */
+void pipe_bench_vad(const struct pipe_vad_config *config, uint32_t frames, struct pipe_bench_vad_result *result);
+
+/**
+ * @brief Round-trip random record sequences through the packer and the parser
+ *
+ * Packs audio and tagged records of random lengths, biased towards the exact-fit and overflow
+ * cases, parses every full block back and checks each record's tag, length and payload. Blocks
+ * are refilled with random bytes when allocated, so stale data past a terminator is never taken
+ * for records. Stops at the first mismatch.
+ *
+ * @param format Format under test, blocks of at most PIPE_BENCH_MAX_BLOCK bytes
+ * @param tags Tags to mix in, tag_count of them
+ * @param seed Seed of the length sequence, so a failing run can be repeated
+ * @return 0, -EINVAL if the format is too large, has no audio records or audio lengths that read as tags
+ */
+int pipe_bench_record(const struct pipe_record_format *format, const uint8_t *tags, uint8_t tag_count,
+                      uint32_t records, uint32_t seed, struct pipe_bench_record_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPE_BENCH_H
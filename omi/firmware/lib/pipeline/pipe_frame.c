@@ -0,0 +1,55 @@
+#include "pipe_frame.h"
+
+#include <string.h>
+
+uint16_t pipe_frame_fragment(uint8_t *packet, uint16_t max_packet, uint16_t id, uint8_t index, const uint8_t *data,
+                             uint16_t len)
+{
+    uint16_t room = max_packet - PIPE_FRAME_HEADER_SIZE;
+    uint16_t taken = len < room ? len : room;
+
+    pipe_frame_header(packet, id, index);
+    memcpy(packet + PIPE_FRAME_HEADER_SIZE, data, taken);
+    return taken;
+}
+
+void pipe_frame_pack_init(struct pipe_frame_pack *pack, uint8_t *packet)
+{
+    pack->packet = packet;
+    pack->size = PIPE_FRAME_HEADER_SIZE;
+    pack->count = 0;
+    pack->flags = 0;
+}
+
+bool pipe_frame_pack_fits(const struct pipe_frame_pack *pack, uint16_t max_packet, uint16_t len, uint8_t flags)
+{
+    // Each entry is [len][frame]
+    if (len == 0 || len > UINT8_MAX || pack->size + 1 + len > max_packet) {
+        return false;
+    }
+    return pack->count == 0 || (pack->count < PIPE_FRAME_PACK_MAX && flags == pack->flags);
+}
+
+void pipe_frame_pack_add(struct pipe_frame_pack *pack, const uint8_t *frame, uint16_t len, uint8_t flags)
+{
+    if (pack->count == 0) {
+        pack->flags = flags;
+    }
+    pack->packet[pack->size] = (uint8_t) len;
+    memcpy(pack->packet + pack->size + 1, frame, len);
+    pack->size += 1 + len;
+    pack->count++;
+}
+
+uint16_t pipe_frame_pack_finish(struct pipe_frame_pack *pack, uint16_t id)
+{
+    uint16_t size = pack->size;
+
+    if (pack->count == 0) {
+        return 0;
+    }
+    pipe_frame_header(pack->packet, id, PIPE_FRAME_PACK_FLAG | pack->flags | pack->count);
+    pack->size = PIPE_FRAME_HEADER_SIZE;
+    pack->count = 0;
+    return size;
+}
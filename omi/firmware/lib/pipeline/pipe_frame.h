@@ -0,0 +1,81 @@
+#ifndef PIPE_FRAME_H
+#define PIPE_FRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Live audio framing over BLE notifications, as the app parses it on every product.
+ *
+ * Each notification starts with [id lo][id hi][index]: id counts notifications, so the app sees
+ * losses. A frame larger than one notification is split into fragments with index 0, 1, 2...;
+ * PIPE_FRAME_TIMESTAMP_FLAG in the index of fragment 0 tells that the frame starts with its
+ * capture time. A packed notification carries several whole frames instead:
+ * [id lo][id hi][PIPE_FRAME_PACK_FLAG | timestamp flag | count] then count x [len][frame].
+ * Fragment indices never reach the flags, so the app can tell the two apart.
+ */
+#define PIPE_FRAME_HEADER_SIZE 3
+#define PIPE_FRAME_TIMESTAMP_FLAG 0x40
+#define PIPE_FRAME_PACK_FLAG 0x80
+#define PIPE_FRAME_PACK_MAX 0x3F // frames per packed notification
+
+// A packed notification being filled, in the caller's packet buffer
+struct pipe_frame_pack {
+    uint8_t *packet;
+    uint16_t size; // bytes used, the header included
+    uint8_t count;
+    uint8_t flags; // PIPE_FRAME_TIMESTAMP_FLAG if the entries carry a capture time, the same for all
+};
+
+static inline void pipe_frame_header(uint8_t *packet, uint16_t id, uint8_t index)
+{
+    packet[0] = (uint8_t) (id & 0xFF);
+    packet[1] = (uint8_t) (id >> 8);
+    packet[2] = index;
+}
+
+/**
+ * @brief Build the next fragment of a frame into packet
+ *
+ * @param max_packet Size of the notification, the header included
+ * @param index 0 (with the timestamp flag if any) for the first fragment, then 1, 2...
+ * @param data Rest of the frame
+ * @param len Bytes left in the frame
+ * @return Bytes of the frame the fragment took, the packet is PIPE_FRAME_HEADER_SIZE longer
+ */
+uint16_t pipe_frame_fragment(uint8_t *packet, uint16_t max_packet, uint16_t id, uint8_t index, const uint8_t *data,
+                             uint16_t len);
+
+/**
+ * @brief Start an empty pack over packet
+ */
+void pipe_frame_pack_init(struct pipe_frame_pack *pack, uint8_t *packet);
+
+/**
+ * @brief Check whether a frame of len bytes joins the pack without overflowing max_packet
+ *
+ * An empty pack takes any frame that fits a notification; a pack that holds frames only takes one
+ * with the same flags, and none beyond PIPE_FRAME_PACK_MAX.
+ */
+bool pipe_frame_pack_fits(const struct pipe_frame_pack *pack, uint16_t max_packet, uint16_t len, uint8_t flags);
+
+/**
+ * @brief Append a frame, after pipe_frame_pack_fits()
+ */
+void pipe_frame_pack_add(struct pipe_frame_pack *pack, const uint8_t *frame, uint16_t len, uint8_t flags);
+
+/**
+ * @brief Write the header of the packed notification and empty the pack for the next one
+ *
+ * @return Length of the notification in packet, 0 if the pack held no frame
+ */
+uint16_t pipe_frame_pack_finish(struct pipe_frame_pack *pack, uint16_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPE_FRAME_H
@@ -0,0 +1,100 @@
+#ifndef PIPE_PORT_H
+#define PIPE_PORT_H
+
+/* Platform shim of the pipeline core, the little the library needs from below it: a tick counter
+ * for the benchmarks and 32-bit atomics between one producer and one consumer. Zephyr (pendant
+ * and devkit), ESP-IDF or Arduino-ESP32 (glasses) and the host (tools) are picked by the usual
+ * compiler defines; everything else in the library is plain C99 that builds as C or C++.
+ */
+
+#include <stdint.h>
+
+#if defined(__ZEPHYR__)
+#include <zephyr/kernel.h>
+#if defined(CONFIG_CPU_CORTEX_M_HAS_DWT)
+#include <cmsis_core.h>
+
+// The DWT cycle counter, k_cycle_get_32() only ticks at 32 kHz on the nRF parts
+static inline void pipe_ticks_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static inline uint32_t pipe_ticks(void)
+{
+    return DWT->CYCCNT;
+}
+
+static inline uint32_t pipe_ticks_hz(void)
+{
+    return SystemCoreClock;
+}
+#else
+static inline void pipe_ticks_init(void)
+{
+}
+
+static inline uint32_t pipe_ticks(void)
+{
+    return k_cycle_get_32();
+}
+
+static inline uint32_t pipe_ticks_hz(void)
+{
+    return sys_clock_hw_cycles_per_sec();
+}
+#endif
+
+#elif defined(ESP_PLATFORM)
+#include "esp_timer.h"
+
+// Microseconds: the CPU cycle counter stops with the clock changes of light sleep and DFS
+static inline void pipe_ticks_init(void)
+{
+}
+
+static inline uint32_t pipe_ticks(void)
+{
+    return (uint32_t) esp_timer_get_time();
+}
+
+static inline uint32_t pipe_ticks_hz(void)
+{
+    return 1000000;
+}
+
+#else
+#include <time.h>
+
+static inline void pipe_ticks_init(void)
+{
+}
+
+static inline uint32_t pipe_ticks(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) ((uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000);
+}
+
+static inline uint32_t pipe_ticks_hz(void)
+{
+    return 1000000;
+}
+#endif
+
+// Tick intervals, right across a counter wrap. In 64 bits, a 32 kHz counter has no whole ticks per us.
+static inline uint32_t pipe_ticks_to_us(uint64_t ticks)
+{
+    return (uint32_t) (ticks * 1000000 / pipe_ticks_hz());
+}
+
+// Ordering between one producer and one consumer, the GCC builtins every port's compiler has
+#define PIPE_LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define PIPE_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PIPE_STORE_RELAXED(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define PIPE_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define PIPE_ADD_RELAXED(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+#endif // PIPE_PORT_H
@@ -0,0 +1,79 @@
+#include "pipe_record.h"
+
+#include <errno.h>
+#include <string.h>
+
+// The last byte is never filled, so even a tagged terminator always fits
+static inline uint16_t block_end(const struct pipe_record_format *format)
+{
+    return format->block_size - 1;
+}
+
+static void submit_block(struct pipe_record_packer *packer)
+{
+    packer->submit(packer->block);
+    packer->block = NULL;
+    packer->offset = 0;
+}
+
+bool pipe_record_append(struct pipe_record_packer *packer, const uint8_t *head, uint8_t head_len, const uint8_t *data,
+                        uint16_t size)
+{
+    uint16_t end = block_end(packer->format);
+    uint16_t record_size = head_len + size;
+
+    // A record that doesn't fit leaves its head as the terminator
+    if (packer->block && packer->offset + record_size > end) {
+        memcpy(packer->block + packer->offset, head, head_len);
+        submit_block(packer);
+    }
+
+    if (!packer->block) {
+        packer->block = packer->alloc();
+        if (!packer->block) {
+            return false;
+        }
+        packer->offset = 0;
+    }
+
+    memcpy(packer->block + packer->offset, head, head_len);
+    memcpy(packer->block + packer->offset + head_len, data, size);
+    packer->offset += record_size;
+    if (packer->offset == end) {
+        // Exact fit, no terminator needed
+        submit_block(packer);
+    }
+    return true;
+}
+
+int pipe_record_next(const struct pipe_record_format *format, const uint8_t *block, uint16_t *pos,
+                     struct pipe_record *record)
+{
+    uint16_t end = block_end(format);
+    if (*pos >= end) {
+        return 0;
+    }
+
+    uint16_t head = 1;
+    uint8_t len = block[*pos];
+    record->tag = 0;
+    if (PIPE_RECORD_IS_TAGGED(len)) {
+        head = 2;
+        record->tag = len;
+        len = block[*pos + 1];
+    } else if (len > format->max_frame) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return -EINVAL;
+    }
+    if (*pos + head + len > end) {
+        // The terminator, a block that starts with one was never filled
+        return *pos > 0 ? 0 : -EINVAL;
+    }
+
+    record->size = len;
+    record->data = block + *pos + head;
+    *pos += head + len;
+    return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef PIPE_RECORD_H
+#define PIPE_RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Storage record format: records packed into fixed-size blocks, for offline audio on any medium.
+ *
+ * A block is a run of records. An audio record is [length][frame]; any other record starts with a
+ * tag byte above every possible frame length: [tag][length][payload]. The head of the record that
+ * did not fit ends the block, a record that fills it up to the last byte leaves none. The last byte
+ * of a block is never filled, so even a tagged terminator always fits.
+ */
+#define PIPE_RECORD_TAG_MIN 0xFC // head bytes from here up are tags
+#define PIPE_RECORD_IS_TAGGED(b) ((b) >= PIPE_RECORD_TAG_MIN)
+
+struct pipe_record_format {
+    uint16_t block_size; // bytes per block
+    uint8_t max_frame;   // longest audio record, longer untagged lengths are malformed
+};
+
+struct pipe_record_packer {
+    const struct pipe_record_format *format;
+    uint8_t *block;                 // open block, NULL until the next record
+    uint16_t offset;                // bytes used in the open block
+    uint8_t *(*alloc)(void);        // a fresh block, NULL if none is free
+    void (*submit)(uint8_t *block); // takes a full block
+};
+
+struct pipe_record {
+    uint8_t tag; // PIPE_RECORD_TAG_MIN or above, 0 for audio
+    uint8_t size;
+    const uint8_t *data;
+};
+
+/**
+ * @brief Append one record, submitting the open block when it is full
+ *
+ * @param head The record's [length] or [tag][length]
+ * @param head_len 1 or 2
+ * @param data Payload
+ * @param size Payload length, the length in the head
+ * @return true if appended, false if no block could be allocated
+ */
+bool pipe_record_append(struct pipe_record_packer *packer, const uint8_t *head, uint8_t head_len, const uint8_t *data,
+                        uint16_t size);
+
+/**
+ * @brief Parse the record at pos of a full block
+ *
+ * @param pos Offset of the record, advanced past it
+ * @param record Filled with the record, pointing into block
+ * @return 1 for a record, 0 at the end of the block, -EINVAL if the block is malformed
+ */
+int pipe_record_next(const struct pipe_record_format *format, const uint8_t *block, uint16_t *pos,
+                     struct pipe_record *record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPE_RECORD_H
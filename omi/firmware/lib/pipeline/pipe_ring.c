@@ -0,0 +1,135 @@
+#include "pipe_ring.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "pipe_port.h"
+
+#define PIPE_RING_LEN_SIZE 2 // length in front of every frame
+
+// Copy in or out at a free-running position, in at most two memcpy
+static void ring_copy_in(struct pipe_ring *ring, uint32_t pos, const uint8_t *src, uint32_t len)
+{
+    uint32_t offset = pos & (ring->size - 1);
+    uint32_t first = ring->size - offset < len ? ring->size - offset : len;
+    memcpy(ring->buf + offset, src, first);
+    memcpy(ring->buf, src + first, len - first);
+}
+
+static void ring_copy_out(const struct pipe_ring *ring, uint32_t pos, uint8_t *dst, uint32_t len)
+{
+    uint32_t offset = pos & (ring->size - 1);
+    uint32_t first = ring->size - offset < len ? ring->size - offset : len;
+    memcpy(dst, ring->buf + offset, first);
+    memcpy(dst + first, ring->buf, len - first);
+}
+
+static uint16_t ring_frame_len(const struct pipe_ring *ring, uint32_t tail)
+{
+    uint8_t header[PIPE_RING_LEN_SIZE];
+    ring_copy_out(ring, tail, header, PIPE_RING_LEN_SIZE);
+    return (uint16_t) (header[0] | (header[1] << 8));
+}
+
+void pipe_ring_init(struct pipe_ring *ring, uint8_t *buf, uint32_t size)
+{
+    assert(size != 0 && (size & (size - 1)) == 0);
+    ring->buf = buf;
+    ring->size = size;
+    PIPE_STORE_RELAXED(&ring->head, 0);
+    PIPE_STORE_RELAXED(&ring->tail, 0);
+    PIPE_STORE_RELAXED(&ring->dropped, 0);
+}
+
+bool pipe_ring_put(struct pipe_ring *ring, const uint8_t *data, uint16_t len)
+{
+    return pipe_ring_put_parts(ring, NULL, 0, data, len);
+}
+
+bool pipe_ring_put_parts(struct pipe_ring *ring, const uint8_t *prefix, uint16_t prefix_len, const uint8_t *data,
+                         uint16_t len)
+{
+    uint32_t head = PIPE_LOAD_RELAXED(&ring->head);
+    uint32_t tail = PIPE_LOAD_ACQUIRE(&ring->tail);
+    uint32_t frame_len = (uint32_t) prefix_len + len;
+    uint32_t needed = PIPE_RING_LEN_SIZE + frame_len;
+
+    if (frame_len == 0 || frame_len > UINT16_MAX || ring->size - (head - tail) < needed) {
+        PIPE_ADD_RELAXED(&ring->dropped, 1);
+        return false;
+    }
+
+    uint8_t header[PIPE_RING_LEN_SIZE] = {(uint8_t) (frame_len & 0xFF), (uint8_t) (frame_len >> 8)};
+    ring_copy_in(ring, head, header, PIPE_RING_LEN_SIZE);
+    if (prefix_len > 0) {
+        ring_copy_in(ring, head + PIPE_RING_LEN_SIZE, prefix, prefix_len);
+    }
+    ring_copy_in(ring, head + PIPE_RING_LEN_SIZE + prefix_len, data, len);
+
+    // Published only once written, a consumer seeing the new head reads the whole frame
+    PIPE_STORE_RELEASE(&ring->head, head + needed);
+    return true;
+}
+
+uint16_t pipe_ring_get(struct pipe_ring *ring, uint8_t *out, uint16_t max)
+{
+    uint32_t tail = PIPE_LOAD_RELAXED(&ring->tail);
+    uint32_t head = PIPE_LOAD_ACQUIRE(&ring->head);
+
+    if (head == tail) {
+        return 0;
+    }
+    uint16_t len = ring_frame_len(ring, tail);
+    if (len <= max) {
+        ring_copy_out(ring, tail + PIPE_RING_LEN_SIZE, out, len);
+    }
+
+    // Handed back to the producer only once read
+    PIPE_STORE_RELEASE(&ring->tail, tail + PIPE_RING_LEN_SIZE + len);
+    return len <= max ? len : 0;
+}
+
+uint16_t pipe_ring_peek(struct pipe_ring *ring, uint8_t *prefix, uint16_t prefix_len, struct pipe_ring_span span[2])
+{
+    uint32_t tail = PIPE_LOAD_RELAXED(&ring->tail);
+    uint32_t head = PIPE_LOAD_ACQUIRE(&ring->head);
+
+    if (head == tail) {
+        return 0;
+    }
+    uint16_t len = ring_frame_len(ring, tail);
+    if (len < prefix_len) {
+        return len;
+    }
+    ring_copy_out(ring, tail + PIPE_RING_LEN_SIZE, prefix, prefix_len);
+
+    uint32_t offset = (tail + PIPE_RING_LEN_SIZE + prefix_len) & (ring->size - 1);
+    uint32_t rest = len - prefix_len;
+    uint32_t first = ring->size - offset < rest ? ring->size - offset : rest;
+    span[0].data = ring->buf + offset;
+    span[0].len = (uint16_t) first;
+    span[1].data = ring->buf;
+    span[1].len = (uint16_t) (rest - first);
+    return len;
+}
+
+void pipe_ring_skip(struct pipe_ring *ring)
+{
+    uint32_t tail = PIPE_LOAD_RELAXED(&ring->tail);
+    uint32_t head = PIPE_LOAD_ACQUIRE(&ring->head);
+
+    if (head == tail) {
+        return;
+    }
+    PIPE_STORE_RELEASE(&ring->tail, tail + PIPE_RING_LEN_SIZE + ring_frame_len(ring, tail));
+}
+
+uint32_t pipe_ring_used(struct pipe_ring *ring)
+{
+    return PIPE_LOAD_ACQUIRE(&ring->head) - PIPE_LOAD_ACQUIRE(&ring->tail);
+}
+
+bool pipe_ring_empty(struct pipe_ring *ring)
+{
+    return PIPE_LOAD_ACQUIRE(&ring->head) == PIPE_LOAD_RELAXED(&ring->tail);
+}
@@ -0,0 +1,94 @@
+#ifndef PIPE_RING_H
+#define PIPE_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Lock-free single-producer / single-consumer ring of variable-size frames.
+ *
+ * Each frame is stored as [uint16 length, little endian][data] and copied with memcpy in at most
+ * two segments when it wraps. head and tail are free-running byte counters: the producer only
+ * writes head, the consumer only writes tail, so one thread or core on each side may use the ring
+ * without a lock. The consumer can also look at a frame in place and drop it later, e.g. once a
+ * notification carrying it has gone out.
+ */
+struct pipe_ring {
+    uint8_t *buf;
+    uint32_t size;    // bytes in buf, a power of two
+    uint32_t head;    // bytes ever written, owned by the producer
+    uint32_t tail;    // bytes ever read, owned by the consumer
+    uint32_t dropped; // frames rejected because the ring was full
+};
+
+// Contiguous part of a frame inside the ring
+struct pipe_ring_span {
+    const uint8_t *data;
+    uint16_t len;
+};
+
+/**
+ * @brief Initialize an empty ring over buf
+ *
+ * @param size Size of buf in bytes, a power of two
+ */
+void pipe_ring_init(struct pipe_ring *ring, uint8_t *buf, uint32_t size);
+
+/**
+ * @brief Append one frame (producer only)
+ *
+ * @param len Frame length, 1 to 65535 bytes
+ * @return true if queued, false if the ring had no room (the frame is dropped and counted)
+ */
+bool pipe_ring_put(struct pipe_ring *ring, const uint8_t *data, uint16_t len);
+
+/**
+ * @brief Append one frame stored as prefix followed by data, without assembling it first (producer only)
+ *
+ * @param prefix_len Length of prefix, prefix_len + len is 1 to 65535 bytes
+ * @return true if queued, false if the ring had no room (the frame is dropped and counted)
+ */
+bool pipe_ring_put_parts(struct pipe_ring *ring, const uint8_t *prefix, uint16_t prefix_len, const uint8_t *data,
+                         uint16_t len);
+
+/**
+ * @brief Take the oldest frame (consumer only)
+ *
+ * @param max Size of out, a longer frame is discarded
+ * @return Frame length, 0 if the ring is empty or the frame was discarded
+ */
+uint16_t pipe_ring_get(struct pipe_ring *ring, uint8_t *out, uint16_t max);
+
+/**
+ * @brief Look at the oldest frame in place, without taking it (consumer only)
+ *
+ * @param prefix Buffer for the first prefix_len bytes of the frame
+ * @param span Set to the rest of the frame in the ring, span[1] is empty unless it wraps
+ * @return Frame length, 0 if the ring is empty; prefix and span are unset if shorter than prefix_len
+ */
+uint16_t pipe_ring_peek(struct pipe_ring *ring, uint8_t *prefix, uint16_t prefix_len, struct pipe_ring_span span[2]);
+
+/**
+ * @brief Drop the oldest frame, after pipe_ring_peek() (consumer only)
+ */
+void pipe_ring_skip(struct pipe_ring *ring);
+
+/**
+ * @brief Bytes taken by queued frames and their lengths
+ */
+uint32_t pipe_ring_used(struct pipe_ring *ring);
+
+/**
+ * @brief Check whether the ring holds no frame
+ */
+bool pipe_ring_empty(struct pipe_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPE_RING_H
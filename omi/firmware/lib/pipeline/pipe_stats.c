@@ -0,0 +1,41 @@
+#include "pipe_stats.h"
+
+#include <string.h>
+
+void pipe_stats_add(struct pipe_stats *stats, uint32_t value)
+{
+    uint32_t bucket = value ? 32 - __builtin_clz(value) : 0;
+
+    stats->count++;
+    stats->total += value;
+    if (stats->count == 1 || value < stats->min) {
+        stats->min = value;
+    }
+    if (value > stats->max) {
+        stats->max = value;
+    }
+    stats->buckets[bucket < PIPE_STATS_BUCKETS ? bucket : PIPE_STATS_BUCKETS - 1]++;
+}
+
+void pipe_stats_get(const struct pipe_stats *stats, struct pipe_stats_summary *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    if (stats->count == 0) {
+        return;
+    }
+
+    summary->count = stats->count;
+    summary->min = stats->min;
+    summary->avg = (uint32_t) (stats->total / stats->count);
+    summary->max = stats->max;
+
+    // The bucket holding the 99th percentile, reported as its upper bound
+    uint32_t below = 0;
+    for (int i = 0; i < PIPE_STATS_BUCKETS; i++) {
+        below += stats->buckets[i];
+        if ((uint64_t) below * 100 >= (uint64_t) stats->count * 99) {
+            summary->p99 = (1u << i) < stats->max ? 1u << i : stats->max;
+            break;
+        }
+    }
+}
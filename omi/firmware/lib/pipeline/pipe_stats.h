@@ -0,0 +1,46 @@
+#ifndef PIPE_STATS_H
+#define PIPE_STATS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Latency statistics of one pipeline stage: count, min, mean and max, and a p99 from power-of-two
+ * buckets, so a stage costs a few adds whatever its rate. The unit is the caller's, microseconds
+ * everywhere so far. A zeroed struct is empty; each one must only be added to from one thread.
+ */
+#define PIPE_STATS_BUCKETS 24 // bucket i holds values below 2^i, the last one everything above
+
+struct pipe_stats {
+    uint32_t count;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+    uint32_t buckets[PIPE_STATS_BUCKETS];
+};
+
+struct pipe_stats_summary {
+    uint32_t count;
+    uint32_t min;
+    uint32_t avg;
+    uint32_t p99; // upper bound of its bucket, capped by the max
+    uint32_t max;
+};
+
+/**
+ * @brief Add one value
+ */
+void pipe_stats_add(struct pipe_stats *stats, uint32_t value);
+
+/**
+ * @brief Summarize the values added since the struct was zeroed, all zero if none
+ */
+void pipe_stats_get(const struct pipe_stats *stats, struct pipe_stats_summary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPE_STATS_H
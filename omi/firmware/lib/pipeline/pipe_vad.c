@@ -0,0 +1,60 @@
+#include "pipe_vad.h"
+
+#include <stddef.h>
+
+void pipe_vad_init(struct pipe_vad *vad, const struct pipe_vad_config *config)
+{
+    vad->config = config;
+    vad->noise_floor = config->min_level;
+    vad->hangover = 0;
+    vad->silent_frames = 0;
+}
+
+bool pipe_vad_voiced(struct pipe_vad *vad, const int16_t *frame)
+{
+    const struct pipe_vad_config *config = vad->config;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < config->samples; i++) {
+        int32_t v = frame[i];
+        sum += (uint32_t) (v < 0 ? -v : v);
+    }
+    uint32_t level = sum / config->samples;
+
+    uint32_t threshold = vad->noise_floor * config->noise_margin;
+    bool voiced = level > (threshold > config->min_level ? threshold : config->min_level);
+
+    // Track the floor down immediately, and up slowly through unvoiced frames only, so speech does
+    // not drag it along however long it lasts
+    if (level < vad->noise_floor) {
+        uint32_t lowest = config->min_level / 4;
+        vad->noise_floor = level > lowest ? level : lowest;
+    } else if (!voiced) {
+        vad->noise_floor += (level - vad->noise_floor) >> 6;
+    }
+    return voiced;
+}
+
+bool pipe_vad_gate(struct pipe_vad *vad, const int16_t *frame, bool *voiced)
+{
+    bool is_voiced = pipe_vad_voiced(vad, frame);
+    if (voiced) {
+        *voiced = is_voiced;
+    }
+
+    if (is_voiced) {
+        vad->hangover = vad->config->hangover_frames;
+    } else if (vad->hangover > 0) {
+        vad->hangover--;
+    }
+    if (vad->hangover > 0) {
+        vad->silent_frames = 0;
+        return true;
+    }
+
+    // Let a keepalive frame through periodically during silence
+    if (vad->config->keepalive_frames && ++vad->silent_frames >= vad->config->keepalive_frames) {
+        vad->silent_frames = 0;
+        return true;
+    }
+    return false;
+}
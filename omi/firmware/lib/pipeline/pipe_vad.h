@@ -0,0 +1,55 @@
+#ifndef PIPE_VAD_H
+#define PIPE_VAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cheap energy voice-activity gate for 16-bit PCM frames: the mean absolute amplitude against a
+ * noise floor that follows quiet stretches down at once and up slowly, never through speech.
+ * Voiced frames and a hangover after them pass, silence is dropped but for a keepalive frame now
+ * and then, so a receiver keeps time.
+ */
+struct pipe_vad_config {
+    uint16_t samples;          // per frame
+    uint16_t min_level;        // mean |sample| below which a frame is always silence
+    uint8_t noise_margin;      // speech must be this many times above the noise floor
+    uint16_t hangover_frames;  // frames passed after the last voiced one
+    uint16_t keepalive_frames; // one frame in this many passes during silence, 0 for none
+};
+
+struct pipe_vad {
+    const struct pipe_vad_config *config;
+    uint32_t noise_floor;
+    uint16_t hangover;
+    uint16_t silent_frames;
+};
+
+/**
+ * @brief Start a gate with the floor at the minimum level
+ */
+void pipe_vad_init(struct pipe_vad *vad, const struct pipe_vad_config *config);
+
+/**
+ * @brief Classify one frame and update the noise floor
+ *
+ * @return true if the frame is voiced
+ */
+bool pipe_vad_voiced(struct pipe_vad *vad, const int16_t *frame);
+
+/**
+ * @brief Decide whether a frame should be encoded and sent
+ *
+ * @param voiced Set to pipe_vad_voiced() of the frame, may be NULL
+ * @return true to send the frame
+ */
+bool pipe_vad_gate(struct pipe_vad *vad, const int16_t *frame, bool *voiced);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPE_VAD_H
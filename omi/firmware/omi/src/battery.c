@@ -13,10 +13,18 @@ LOG_MODULE_REGISTER(battery, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define BATTERY_STATES_COUNT 16
 
-#define ADC_TOTAL_SAMPLES 50
+#define ADC_TOTAL_SAMPLES 9   // median of 9 by a fixed compare network
+#define ADC_OVERSAMPLING 3    // each sample averages 2^3 conversions in the SAADC
 // +1 for the calibration sample
 int16_t sample_buffer[ADC_TOTAL_SAMPLES + 1];
 
+#define BATTERY_CALIBRATE_INTERVAL_MS (30 * 60 * 1000) // offset drifts with temperature, slowly
+#define BATTERY_REFRESH_MIN_MS 10000    // charging, unknown slope or close to critical
+#define BATTERY_REFRESH_MAX_MS 120000   // steady discharge
+#define BATTERY_REFRESH_STEP_MV 5       // aim for about this much change between reads
+#define BATTERY_SLOPE_SPAN_MS 300000    // slope measured over at least this long, reads are noisy
+#define BATTERY_NEAR_CRITICAL_MV 100    // above CONFIG_OMI_BATTERY_CRITICAL_MV
+
 #define ADC_RESOLUTION 12
 #define ADC_GAIN ADC_GAIN_1_3
 #define ADC_REFERENCE ADC_REF_INTERNAL
@@ -40,6 +48,15 @@ static const struct gpio_dt_spec bat_chg_pin = GPIO_DT_SPEC_GET_OR(DT_NODELABEL(
 
 static struct gpio_callback bat_chg_cb;
 
+static bool channel_ready;
+static int64_t calibrated_at;
+
+// Refresh cadence, from the discharge slope between two reads at least BATTERY_SLOPE_SPAN_MS apart
+static uint16_t last_millivolt;
+static uint16_t slope_ref_millivolt;
+static int64_t slope_ref_at;
+static uint32_t slope_uv_per_min; // discharge only, 0 while unknown
+
 static K_MUTEX_DEFINE(battery_mut);
 
 // 150mAh LiPo battery discharge profile
@@ -104,8 +121,71 @@ struct adc_sequence sequence = {
     .buffer = sample_buffer,
     .buffer_size = sizeof(sample_buffer),
     .resolution = ADC_RESOLUTION,
+    .oversampling = ADC_OVERSAMPLING,
 };
 
+#define SORT_PAIR(a, b)                                                                                                \
+    do {                                                                                                               \
+        if ((a) > (b)) {                                                                                               \
+            int16_t t = (a);                                                                                           \
+            (a) = (b);                                                                                                 \
+            (b) = t;                                                                                                   \
+        }                                                                                                              \
+    } while (0)
+
+// Median of 9 in 19 compare-exchanges, whatever the input
+static int16_t median9(int16_t *p)
+{
+    SORT_PAIR(p[1], p[2]);
+    SORT_PAIR(p[4], p[5]);
+    SORT_PAIR(p[7], p[8]);
+    SORT_PAIR(p[0], p[1]);
+    SORT_PAIR(p[3], p[4]);
+    SORT_PAIR(p[6], p[7]);
+    SORT_PAIR(p[1], p[2]);
+    SORT_PAIR(p[4], p[5]);
+    SORT_PAIR(p[7], p[8]);
+    SORT_PAIR(p[0], p[3]);
+    SORT_PAIR(p[5], p[8]);
+    SORT_PAIR(p[4], p[7]);
+    SORT_PAIR(p[3], p[6]);
+    SORT_PAIR(p[1], p[4]);
+    SORT_PAIR(p[2], p[5]);
+    SORT_PAIR(p[4], p[7]);
+    SORT_PAIR(p[4], p[2]);
+    SORT_PAIR(p[6], p[4]);
+    SORT_PAIR(p[4], p[2]);
+    return p[4];
+}
+BUILD_ASSERT(ADC_TOTAL_SAMPLES == 9, "median9() takes exactly 9 samples");
+
+// Channel setup survives between reads, redo it only after a failure
+static int battery_channel_setup(void)
+{
+    if (channel_ready) {
+        return 0;
+    }
+    int err = adc_channel_setup(adc_dev, &m_1st_channel_cfg);
+    if (err) {
+        return err;
+    }
+    channel_ready = true;
+    return 0;
+}
+
+// Offset calibration by the driver, which waits for it; the first sample after it is skipped anyway
+static void battery_read_samples_prepare(void)
+{
+    sequence.calibrate = calibrated_at == 0 || k_uptime_get() - calibrated_at >= BATTERY_CALIBRATE_INTERVAL_MS;
+}
+
+static void battery_read_samples_done(void)
+{
+    if (sequence.calibrate) {
+        calibrated_at = k_uptime_get();
+    }
+}
+
 uint8_t update_ema_filter(uint32_t current_ema, uint8_t new_value)
 {
     // handle edge case transitions directly
@@ -137,6 +217,47 @@ static void battery_charging_callback(const struct device *dev, struct gpio_call
     }
 }
 
+static void battery_track_slope(uint16_t millivolt)
+{
+    int64_t now = k_uptime_get();
+    last_millivolt = millivolt;
+
+    // Charging makes the slope meaningless, measure again once it stops
+    if (is_charging || slope_ref_at == 0) {
+        slope_ref_millivolt = millivolt;
+        slope_ref_at = now;
+        slope_uv_per_min = 0;
+        return;
+    }
+
+    int64_t span = now - slope_ref_at;
+    if (span < BATTERY_SLOPE_SPAN_MS) {
+        return;
+    }
+    int32_t drop_mv = (int32_t) slope_ref_millivolt - millivolt;
+    slope_uv_per_min = drop_mv > 0 ? (uint32_t) ((int64_t) drop_mv * 1000 * 60000 / span) : 0;
+    slope_ref_millivolt = millivolt;
+    slope_ref_at = now;
+}
+
+uint32_t battery_refresh_interval_ms(void)
+{
+    k_mutex_lock(&battery_mut, K_FOREVER);
+    uint32_t interval = BATTERY_REFRESH_MAX_MS;
+    if (is_charging || last_millivolt < CONFIG_OMI_BATTERY_CRITICAL_MV + BATTERY_NEAR_CRITICAL_MV) {
+        interval = BATTERY_REFRESH_MIN_MS;
+    } else if (slope_uv_per_min == 0) {
+        // Unknown yet, or flat: sample often enough to measure a slope within one span
+        interval = slope_ref_at != 0 && k_uptime_get() - slope_ref_at >= BATTERY_SLOPE_SPAN_MS ? BATTERY_REFRESH_MAX_MS
+                                                                                              : BATTERY_REFRESH_MIN_MS;
+    } else {
+        uint64_t step = (uint64_t) BATTERY_REFRESH_STEP_MV * 1000 * 60000 / slope_uv_per_min;
+        interval = CLAMP(step, BATTERY_REFRESH_MIN_MS, BATTERY_REFRESH_MAX_MS);
+    }
+    k_mutex_unlock(&battery_mut);
+    return interval;
+}
+
 int battery_get_millivolt(uint16_t *battery_millivolt)
 {
     int err;
@@ -165,7 +286,7 @@ int battery_get_millivolt(uint16_t *battery_millivolt)
         return -ENODEV;
     }
 
-    err = adc_channel_setup(adc_dev, &m_1st_channel_cfg);
+    err = battery_channel_setup();
     if (err) {
         LOG_ERR("ADC channel setup failed (error %d)", err);
         gpio_pin_configure_dt(&bat_read_pin, GPIO_INPUT); // Restore pin state
@@ -173,43 +294,19 @@ int battery_get_millivolt(uint16_t *battery_millivolt)
         return err;
     }
 
-    // Trigger offset calibration. The first sample after this will be affected.
-    NRF_SAADC_S->TASKS_CALIBRATEOFFSET = 1;
-    k_busy_wait(100); // Short delay for calibration, if needed.
-
+    battery_read_samples_prepare();
     err = adc_read(adc_dev, &sequence);
     if (err) {
         LOG_WRN("ADC read failed (error %d)", err);
+        channel_ready = false;
         gpio_pin_configure_dt(&bat_read_pin, GPIO_INPUT); // Restore pin state
         k_mutex_unlock(&battery_mut);
         return err;
     }
+    battery_read_samples_done();
 
-    // Calculate median of valid samples, discarding the first one (post-calibration)
-    // Copy samples to a temporary array for sorting
-    int16_t sorted_samples[ADC_TOTAL_SAMPLES];
-    for (int i = 0; i < ADC_TOTAL_SAMPLES; i++) {
-        sorted_samples[i] = sample_buffer[i + 1];
-    }
-
-    // Simple bubble sort for median calculation
-    for (int i = 0; i < ADC_TOTAL_SAMPLES - 1; i++) {
-        for (int j = 0; j < ADC_TOTAL_SAMPLES - i - 1; j++) {
-            if (sorted_samples[j] > sorted_samples[j + 1]) {
-                int16_t temp = sorted_samples[j];
-                sorted_samples[j] = sorted_samples[j + 1];
-                sorted_samples[j + 1] = temp;
-            }
-        }
-    }
-
-    // Calculate median
-    int32_t adc_raw_val;
-    if (ADC_TOTAL_SAMPLES % 2 == 0) {
-        adc_raw_val = (sorted_samples[ADC_TOTAL_SAMPLES / 2 - 1] + sorted_samples[ADC_TOTAL_SAMPLES / 2]) / 2;
-    } else {
-        adc_raw_val = sorted_samples[ADC_TOTAL_SAMPLES / 2];
-    }
+    // Median of the valid samples, discarding the first one (post-calibration)
+    int32_t adc_raw_val = median9(&sample_buffer[1]);
 
     LOG_INF("Median ADC raw (after discarding 1st of %d total): %d", ADC_TOTAL_SAMPLES + 1, adc_raw_val);
 
@@ -249,6 +346,7 @@ int battery_get_millivolt(uint16_t *battery_millivolt)
         return -EAGAIN; // Skip first measurement to allow voltage to stabilize
     }
 
+    battery_track_slope(*battery_millivolt);
     k_mutex_unlock(&battery_mut);
 
     return 0;
@@ -360,24 +458,23 @@ int battery_enable_read()
         return -ENODEV;
     }
 
-    err = adc_channel_setup(adc_dev, &m_1st_channel_cfg);
+    err = battery_channel_setup();
     if (err) {
         LOG_ERR("ADC channel setup failed (error %d)", err);
         gpio_pin_configure_dt(&bat_read_pin, GPIO_INPUT); // Restore pin state
         return err;
     }
 
-    // Trigger offset calibration with proper settling time
-    NRF_SAADC_S->TASKS_CALIBRATEOFFSET = 1;
-    k_msleep(5);
-
-    // Read samples
+    // Read samples, calibrating the offset first
+    battery_read_samples_prepare();
     err = adc_read(adc_dev, &sequence);
     if (err) {
         LOG_WRN("ADC read failed (error %d)", err);
+        channel_ready = false;
         gpio_pin_configure_dt(&bat_read_pin, GPIO_INPUT); // Restore pin state
         return err;
     }
+    battery_read_samples_done();
 
     // Restore bat_read_pin
     err = gpio_pin_configure_dt(&bat_read_pin, GPIO_INPUT);
@@ -0,0 +1,240 @@
+#include "flash_cache.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/pm/device.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "lib/core/sd_card.h"
+
+LOG_MODULE_REGISTER(flash_cache, CONFIG_LOG_DEFAULT_LEVEL);
+
+// The log is a ring of fixed slots, one SD write block each. A sector is erased when the head
+// enters it, so one sector is always kept free. Draining a slot only clears bits in its header,
+// which NOR flash can do without an erase, so a reset never hands out a block twice.
+//
+// It owns the flash_cache_partition of the SPI flash's fixed-partitions, which the board
+// devicetree (or an overlay) reserves for it, e.g. 1 MB for ~3.5 min of 32 kbps audio.
+#if !FIXED_PARTITION_EXISTS(flash_cache_partition)
+#error "CONFIG_OMI_ENABLE_FLASH_CACHE needs a flash_cache_partition in the SPI flash's fixed-partitions"
+#endif
+#define FLASH_CACHE_SIZE FIXED_PARTITION_SIZE(flash_cache_partition)
+#define FLASH_CACHE_SECTOR_SIZE 4096
+#define FLASH_CACHE_SLOT_SIZE 512
+#define FLASH_CACHE_SLOTS (FLASH_CACHE_SIZE / FLASH_CACHE_SLOT_SIZE)
+#define FLASH_CACHE_SLOTS_PER_SECTOR (FLASH_CACHE_SECTOR_SIZE / FLASH_CACHE_SLOT_SIZE)
+
+#define SLOT_STATE_ERASED 0xFF
+#define SLOT_STATE_VALID 0x7F
+#define SLOT_STATE_DRAINED 0x00
+
+struct slot_header {
+    uint32_t seq;
+    uint32_t utc_s;
+    uint16_t len;
+    uint8_t state;
+    uint8_t reserved;
+} __packed;
+
+BUILD_ASSERT(sizeof(struct slot_header) + MAX_WRITE_SIZE <= FLASH_CACHE_SLOT_SIZE, "Block doesn't fit a slot");
+BUILD_ASSERT(FLASH_CACHE_SIZE % FLASH_CACHE_SECTOR_SIZE == 0 && FLASH_CACHE_SIZE >= 2 * FLASH_CACHE_SECTOR_SIZE,
+             "flash_cache_partition must be whole sectors, at least two");
+
+static const struct device *const flash_dev = FIXED_PARTITION_DEVICE(flash_cache_partition);
+static const struct flash_area *cache_area;
+
+static uint32_t head = 0; // next slot to write
+static uint32_t tail = 0; // oldest valid slot
+static uint32_t used = 0;
+static uint32_t used_bytes = 0;
+static uint32_t next_seq = 0;
+
+// Within the partition
+static inline off_t slot_address(uint32_t slot)
+{
+    return (off_t) slot * FLASH_CACHE_SLOT_SIZE;
+}
+
+static inline uint32_t next_slot(uint32_t slot)
+{
+    return (slot + 1) % FLASH_CACHE_SLOTS;
+}
+
+int flash_cache_init(void)
+{
+    struct slot_header header;
+    bool found = false;
+    uint32_t min_seq = 0, max_seq = 0;
+
+    if (!device_is_ready(flash_dev)) {
+        LOG_ERR("SPI Flash device (%s) not ready.", flash_dev->name);
+        return -ENODEV;
+    }
+    int ret = pm_device_action_run(flash_dev, PM_DEVICE_ACTION_RESUME);
+    if (ret < 0 && ret != -EALREADY) {
+        LOG_ERR("Failed to resume SPI Flash device (%s): %d", flash_dev->name, ret);
+        return ret;
+    }
+    ret = flash_area_open(FIXED_PARTITION_ID(flash_cache_partition), &cache_area);
+    if (ret < 0) {
+        LOG_ERR("Failed to open the flash cache partition: %d", ret);
+        return ret;
+    }
+
+    // Valid slots form one run around the ring; find its ends
+    used = 0;
+    used_bytes = 0;
+    for (uint32_t slot = 0; slot < FLASH_CACHE_SLOTS; slot++) {
+        ret = flash_area_read(cache_area, slot_address(slot), &header, sizeof(header));
+        if (ret < 0) {
+            LOG_ERR("Flash cache scan failed at slot %u: %d", slot, ret);
+            return ret;
+        }
+        if (header.state != SLOT_STATE_VALID || header.len > MAX_WRITE_SIZE) {
+            continue;
+        }
+        if (!found || header.seq < min_seq) {
+            min_seq = header.seq;
+            tail = slot;
+        }
+        if (!found || header.seq > max_seq) {
+            max_seq = header.seq;
+            head = next_slot(slot);
+        }
+        found = true;
+        used++;
+        used_bytes += header.len;
+    }
+
+    if (!found) {
+        head = 0;
+        tail = 0;
+        next_seq = 0;
+    } else {
+        next_seq = max_seq + 1;
+    }
+
+    // The rest of the head sector may hold a half-written slot, start on a fresh one
+    if (head % FLASH_CACHE_SLOTS_PER_SECTOR) {
+        head = (head - head % FLASH_CACHE_SLOTS_PER_SECTOR + FLASH_CACHE_SLOTS_PER_SECTOR) % FLASH_CACHE_SLOTS;
+    }
+    if (!found) {
+        tail = head;
+    }
+
+    LOG_INF("Flash cache: %u blocks (%u bytes) waiting", used, used_bytes);
+    return 0;
+}
+
+int flash_cache_append(const uint8_t *block, size_t len, uint32_t utc_s)
+{
+    if (len > MAX_WRITE_SIZE) {
+        return -EINVAL;
+    }
+
+    if (head % FLASH_CACHE_SLOTS_PER_SECTOR == 0) {
+        // Entering a sector: it must not hold anything undrained
+        if (used > 0 && (tail + FLASH_CACHE_SLOTS - head) % FLASH_CACHE_SLOTS < FLASH_CACHE_SLOTS_PER_SECTOR) {
+            return -ENOSPC;
+        }
+        int ret = flash_area_erase(cache_area, slot_address(head), FLASH_CACHE_SECTOR_SIZE);
+        if (ret < 0) {
+            LOG_ERR("Flash cache erase at slot %u failed: %d", head, ret);
+            return ret;
+        }
+    }
+
+    // Data first, so a slot only turns valid once all of it is there
+    int ret = flash_area_write(cache_area, slot_address(head) + sizeof(struct slot_header), block, len);
+    if (ret == 0) {
+        struct slot_header header = {
+            .seq = next_seq,
+            .utc_s = utc_s,
+            .len = len,
+            .state = SLOT_STATE_VALID,
+            .reserved = 0xFF,
+        };
+        ret = flash_area_write(cache_area, slot_address(head), &header, sizeof(header));
+    }
+    if (ret < 0) {
+        LOG_ERR("Flash cache write at slot %u failed: %d", head, ret);
+        // The slot may be half programmed, skip it
+        head = next_slot(head);
+        return ret;
+    }
+
+    if (used == 0) {
+        tail = head;
+    }
+    next_seq++;
+    head = next_slot(head);
+    used++;
+    used_bytes += len;
+    return 0;
+}
+
+int flash_cache_peek(uint8_t *block, size_t *len, uint32_t *utc_s)
+{
+    struct slot_header header;
+
+    // Skipped (failed) slots between tail and head aren't valid, step over them
+    while (used > 0) {
+        int ret = flash_area_read(cache_area, slot_address(tail), &header, sizeof(header));
+        if (ret < 0) {
+            return ret;
+        }
+        if (header.state == SLOT_STATE_VALID && header.len <= MAX_WRITE_SIZE) {
+            ret = flash_area_read(cache_area, slot_address(tail) + sizeof(header), block, header.len);
+            if (ret < 0) {
+                return ret;
+            }
+            *len = header.len;
+            *utc_s = header.utc_s;
+            return 0;
+        }
+        if (tail == head) {
+            break;
+        }
+        tail = next_slot(tail);
+    }
+    return -ENODATA;
+}
+
+int flash_cache_pop(void)
+{
+    struct slot_header header;
+
+    if (used == 0) {
+        return -ENODATA;
+    }
+
+    int ret = flash_area_read(cache_area, slot_address(tail), &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    uint8_t state = SLOT_STATE_DRAINED;
+    ret = flash_area_write(cache_area, slot_address(tail) + offsetof(struct slot_header, state), &state, 1);
+    if (ret < 0) {
+        LOG_ERR("Flash cache drain mark at slot %u failed: %d", tail, ret);
+        return ret;
+    }
+
+    used--;
+    used_bytes -= MIN(used_bytes, header.len);
+    tail = next_slot(tail);
+    return 0;
+}
+
+uint32_t flash_cache_blocks(void)
+{
+    return used;
+}
+
+uint32_t flash_cache_bytes(void)
+{
+    return used_bytes;
+}
@@ -0,0 +1,59 @@
+#ifndef FLASH_CACHE_H
+#define FLASH_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Audio block log on the external SPI NOR flash
+ *
+ * Blocks written by the SD worker land here first, so the SD card only has to be powered up
+ * now and then to take them all at once. The log survives a reset. Only the SD worker may
+ * call these, except flash_cache_bytes().
+ */
+
+/**
+ * @brief Wake the flash and recover blocks left in the log before the reset
+ *
+ * @return 0 on success, negative error code otherwise.
+ */
+int flash_cache_init(void);
+
+/**
+ * @brief Append one block to the log
+ *
+ * @param block Block data, at most MAX_WRITE_SIZE bytes
+ * @param len Number of bytes in the block
+ * @param utc_s Time the block was recorded, 0 if unknown
+ * @return 0 on success, -ENOSPC if the log is full, negative error code otherwise.
+ */
+int flash_cache_append(const uint8_t *block, size_t len, uint32_t utc_s);
+
+/**
+ * @brief Copy the oldest block in the log
+ *
+ * @param block Buffer of MAX_WRITE_SIZE bytes
+ * @param len Set to the number of bytes in the block
+ * @param utc_s Set to the time the block was recorded
+ * @return 0 on success, -ENODATA if the log is empty, negative error code otherwise.
+ */
+int flash_cache_peek(uint8_t *block, size_t *len, uint32_t *utc_s);
+
+/**
+ * @brief Drop the oldest block once it is safely elsewhere
+ *
+ * @return 0 on success, negative error code otherwise.
+ */
+int flash_cache_pop(void);
+
+/**
+ * @brief Number of blocks waiting in the log
+ */
+uint32_t flash_cache_blocks(void);
+
+/**
+ * @brief Number of audio bytes waiting in the log
+ */
+uint32_t flash_cache_bytes(void);
+
+#endif // FLASH_CACHE_H
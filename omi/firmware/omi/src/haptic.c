@@ -5,21 +5,111 @@
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "lib/core/monitor.h"
+#endif
 
 LOG_MODULE_REGISTER(haptic, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define MAX_HAPTIC_DURATION 5000
+#define HAPTIC_QUEUE_DEPTH 4
 
 static const struct gpio_dt_spec haptic_pin = GPIO_DT_SPEC_GET_OR(DT_NODELABEL(motor_pin), gpios, {0});
 
-// Haptic Off Work Item
-static struct k_work_delayable haptic_off_work;
+// Waveforms alternate on and off times in ms, starting with on
+struct haptic_waveform {
+    const uint16_t *steps; // NULL for a single pulse of pulse_ms
+    uint16_t pulse_ms;
+    uint8_t count;
+};
+
+static const uint16_t double_steps[] = {80, 120, 80};
+static const uint16_t triple_steps[] = {60, 90, 60, 90, 60};
+static const uint16_t alert_steps[] = {300, 150, 300, 150, 300};
+
+static const struct haptic_waveform waveforms[HAPTIC_PATTERN_COUNT] = {
+    [HAPTIC_PULSE_SHORT] = {NULL, 100, 1},
+    [HAPTIC_PULSE_MEDIUM] = {NULL, 300, 1},
+    [HAPTIC_PULSE_LONG] = {NULL, 500, 1},
+    [HAPTIC_DOUBLE] = {double_steps, 0, ARRAY_SIZE(double_steps)},
+    [HAPTIC_TRIPLE] = {triple_steps, 0, ARRAY_SIZE(triple_steps)},
+    [HAPTIC_ALERT] = {alert_steps, 0, ARRAY_SIZE(alert_steps)},
+};
+
+// Callers only queue waveforms. A timer plays them back to back, one step per expiry, so playback
+// needs no thread and never waits behind the caller, even one sleeping on the system workqueue.
+K_MSGQ_DEFINE(haptic_queue, sizeof(struct haptic_waveform), HAPTIC_QUEUE_DEPTH, 4);
+
+#define HAPTIC_FLAG_PLAYING 0 // the timer is running the player
+#define HAPTIC_FLAG_PREEMPT 1 // abandon the waveform playing, it was replaced or stopped
+static atomic_t haptic_flags = ATOMIC_INIT(0);
 
-// Work handler to turn off haptic motor
-static void haptic_off_work_handler(struct k_work *work)
+// Only the timer handler touches these
+static struct haptic_waveform current;
+static uint8_t current_step;
+
+static void haptic_step(struct k_timer *timer);
+K_TIMER_DEFINE(haptic_timer, haptic_step, NULL);
+
+static void motor_set(bool on)
 {
-    haptic_off();
-    LOG_INF("Haptic turned off by work handler");
+    gpio_pin_set_dt(&haptic_pin, on);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_HAPTIC, on);
+#endif
+}
+
+static void haptic_step(struct k_timer *timer)
+{
+    if (atomic_test_and_clear_bit(&haptic_flags, HAPTIC_FLAG_PREEMPT)) {
+        current.count = 0;
+    }
+
+    while (current_step >= current.count) {
+        if (k_msgq_get(&haptic_queue, &current, K_NO_WAIT) == 0) {
+            current_step = 0;
+            continue;
+        }
+        current.count = 0;
+        motor_set(false);
+        atomic_clear_bit(&haptic_flags, HAPTIC_FLAG_PLAYING);
+        // Something queued between the get and the clear would otherwise wait for the next pattern
+        if (k_msgq_num_used_get(&haptic_queue) == 0 || atomic_test_and_set_bit(&haptic_flags, HAPTIC_FLAG_PLAYING)) {
+            return;
+        }
+    }
+
+    uint16_t ms = current.steps ? current.steps[current_step] : current.pulse_ms;
+    motor_set(current_step % 2 == 0);
+    current_step++;
+    k_timer_start(&haptic_timer, K_MSEC(ms), K_NO_WAIT);
+}
+
+// Start the player now, cutting short the step in progress if told to
+static void haptic_kick(bool preempt)
+{
+    if (preempt) {
+        atomic_set_bit(&haptic_flags, HAPTIC_FLAG_PREEMPT);
+        atomic_set_bit(&haptic_flags, HAPTIC_FLAG_PLAYING);
+    } else if (atomic_test_and_set_bit(&haptic_flags, HAPTIC_FLAG_PLAYING)) {
+        return;
+    }
+    k_timer_start(&haptic_timer, K_NO_WAIT, K_NO_WAIT);
+}
+
+static int haptic_enqueue(const struct haptic_waveform *waveform)
+{
+    if (!gpio_is_ready_dt(&haptic_pin)) {
+        LOG_ERR("Haptic GPIO device not ready");
+        return -ENODEV;
+    }
+    if (k_msgq_put(&haptic_queue, waveform, K_NO_WAIT) != 0) {
+        LOG_WRN("Haptic queue full, dropping pattern");
+        return -ENOMEM;
+    }
+    return 0;
 }
 
 // BLE Service definitions
@@ -66,8 +156,8 @@ static ssize_t haptic_write_handler(struct bt_conn *conn,
     uint8_t value = ((uint8_t *) buf)[0];
     LOG_INF("Haptic write received: value %d", value);
 
-    // Map received value to haptic duration
-    // 1 -> 100ms, 2 -> 300ms, 3 -> 500ms
+    // Map received value to haptic pattern
+    // 1 -> 100ms, 2 -> 300ms, 3 -> 500ms, 4 -> double, 5 -> triple, 6 -> alert
     switch (value) {
     case 1:
         play_haptic_milli(100);
@@ -78,6 +168,15 @@ static ssize_t haptic_write_handler(struct bt_conn *conn,
     case 3:
         play_haptic_milli(500);
         break;
+    case 4:
+        haptic_play(HAPTIC_DOUBLE);
+        break;
+    case 5:
+        haptic_play(HAPTIC_TRIPLE);
+        break;
+    case 6:
+        haptic_play(HAPTIC_ALERT);
+        break;
     default:
         LOG_WRN("Haptic write: Invalid value %d", value);
         return len;
@@ -95,46 +194,50 @@ int haptic_init(void)
         return -ENODEV;
     }
 
-    // Initialize the delayable work item
-    k_work_init_delayable(&haptic_off_work, haptic_off_work_handler);
+    // Configured once here, the player drives the pin from the timer interrupt
+    int err = gpio_pin_configure_dt(&haptic_pin, GPIO_OUTPUT_INACTIVE);
+    if (err) {
+        LOG_ERR("Failed to configure haptic pin for output (err %d)", err);
+        return err;
+    }
 
     LOG_INF("Haptic system initialized");
     return 0;
 }
 
-void play_haptic_milli(uint32_t duration)
+int haptic_play(enum haptic_pattern pattern)
 {
-    if (!gpio_is_ready_dt(&haptic_pin)) {
-        LOG_ERR("Haptic GPIO device not ready");
-        return;
+    if (pattern >= HAPTIC_PATTERN_COUNT) {
+        return -EINVAL;
     }
+    int err = haptic_enqueue(&waveforms[pattern]);
+    if (!err) {
+        haptic_kick(false);
+    }
+    return err;
+}
 
-    // Cancel any pending off work before proceeding
-    k_work_cancel_delayable(&haptic_off_work);
+void play_haptic_milli(uint32_t duration)
+{
+    // Replaces whatever is playing or queued, as a single pulse always did
+    k_msgq_purge(&haptic_queue);
 
     if (duration == 0) {
         // If duration is 0, ensure the pin is off and we are done.
-        gpio_pin_set_dt(&haptic_pin, 0);
+        haptic_kick(true);
         LOG_INF("Haptic explicitly stopped (duration 0)");
         return;
     }
 
-    // Configure GPIO pin just before turning it on
-    int err = gpio_pin_configure_dt(&haptic_pin, GPIO_OUTPUT);
-    if (err) {
-        LOG_ERR("Failed to configure haptic pin for output (err %d)", err);
-        return;
-    }
-
     if (duration > MAX_HAPTIC_DURATION) {
         LOG_WRN("Requested haptic duration %u exceeds max %d, capping.", duration, MAX_HAPTIC_DURATION);
         duration = MAX_HAPTIC_DURATION;
     }
 
+    struct haptic_waveform pulse = {NULL, (uint16_t) duration, 1};
     LOG_INF("Playing haptic for %u ms", duration);
-    gpio_pin_set_dt(&haptic_pin, 1);
-    // Schedule the work item to turn the haptic off after the duration
-    k_work_schedule(&haptic_off_work, K_MSEC(duration));
+    haptic_enqueue(&pulse);
+    haptic_kick(true);
 }
 
 void register_haptic_service(void)
@@ -149,5 +252,7 @@ void register_haptic_service(void)
 
 void haptic_off()
 {
-    gpio_pin_set_dt(&haptic_pin, 0);
+    k_msgq_purge(&haptic_queue);
+    haptic_kick(true);
+    motor_set(false);
 }
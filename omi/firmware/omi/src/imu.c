@@ -10,7 +10,11 @@
 #include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/util.h>
 
+#include "lib/core/config.h"
 #include "lib/core/settings.h"
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+#include "lib/core/warm_resume.h"
+#endif
 #include "rtc.h"
 
 LOG_MODULE_REGISTER(imu, CONFIG_LOG_DEFAULT_LEVEL);
@@ -31,6 +35,54 @@ LOG_MODULE_REGISTER(imu, CONFIG_LOG_DEFAULT_LEVEL);
 #define LSM6DS_CTRL10_TIMER_EN      BIT(5)
 #define LSM6DS_WAKE_UP_DUR_TIMER_HR BIT(4)
 
+/* Wake-up (motion) detection:
+ * - TAP_CFG = 0x58, INTERRUPTS_ENABLE is bit 7, SLOPE_FDS (bit 4) = 0 picks the slope filter,
+ *   LIR (bit 0) = 0 keeps the interrupt a pulse so nothing has to clear it over I2C
+ * - WAKE_UP_THS = 0x5B, WK_THS in bits 5:0 (1 LSB = full scale / 64)
+ * - WAKE_UP_DUR = 0x5C, WAKE_DUR in bits 6:5 (0 = one sample is enough)
+ * - MD1_CFG = 0x5E, INT1_WU is bit 5
+ */
+#define LSM6DS_REG_TAP_CFG          0x58
+#define LSM6DS_REG_WAKE_UP_THS      0x5B
+#define LSM6DS_REG_MD1_CFG          0x5E
+
+#define LSM6DS_TAP_CFG_INTERRUPTS_ENABLE BIT(7)
+#define LSM6DS_TAP_CFG_SLOPE_FDS         BIT(4)
+#define LSM6DS_TAP_CFG_LIR               BIT(0)
+#define LSM6DS_WAKE_UP_THS_MASK          0x3F
+#define LSM6DS_WAKE_UP_DUR_MASK          (BIT(6) | BIT(5))
+#define LSM6DS_MD1_CFG_INT1_WU           BIT(5)
+
+/* Embedded tap and activity engines (CONFIG_OMI_ENABLE_IMU_GESTURES), see ST AN5040:
+ * - TAP_CFG = 0x58, INACT_EN in bits 6:5 (01 = accelerometer to 12.5 Hz while inactive),
+ *   TAP_X/Y/Z_EN in bits 3:1, LIR (bit 0) = 1 latches the sources until they are read
+ * - TAP_THS_6D = 0x59, TAP_THS in bits 4:0 (1 LSB = full scale / 32)
+ * - INT_DUR2 = 0x5A, DUR in bits 7:4, QUIET in bits 3:2, SHOCK in bits 1:0
+ * - WAKE_UP_THS = 0x5B, SINGLE_DOUBLE_TAP is bit 7 (1 = double taps detected as well)
+ * - WAKE_UP_DUR = 0x5C, SLEEP_DUR in bits 3:0 (1 LSB = 512 / ODR)
+ * - MD1_CFG = 0x5E, INT1_INACT_STATE bit 7, INT1_SINGLE_TAP bit 6 (left off: the first tap of every
+ *   double and each bump would wake the MCU for an I2C read), INT1_DOUBLE_TAP bit 3
+ * - WAKE_UP_SRC = 0x1B, SLEEP_STATE_IA bit 4, WU_IA bit 3; TAP_SRC = 0x1C, SINGLE_TAP bit 5,
+ *   DOUBLE_TAP bit 4. Reading them clears the latched interrupt.
+ */
+#define LSM6DS_REG_WAKE_UP_SRC           0x1B
+#define LSM6DS_REG_TAP_SRC               0x1C
+#define LSM6DS_REG_TAP_THS_6D            0x59
+#define LSM6DS_REG_INT_DUR2              0x5A
+
+#define LSM6DS_TAP_CFG_INACT_XL_LP       BIT(5)
+#define LSM6DS_TAP_CFG_INACT_MASK        (BIT(6) | BIT(5))
+#define LSM6DS_TAP_CFG_TAP_XYZ           (BIT(3) | BIT(2) | BIT(1))
+#define LSM6DS_TAP_THS_MASK              0x1F
+#define LSM6DS_WAKE_UP_THS_DOUBLE_TAP    BIT(7)
+#define LSM6DS_WAKE_UP_DUR_SLEEP_MASK    0x0F
+#define LSM6DS_MD1_CFG_INT1_INACT_STATE  BIT(7)
+#define LSM6DS_MD1_CFG_INT1_DOUBLE_TAP   BIT(3)
+#define LSM6DS_MD1_CFG_GESTURES          (LSM6DS_MD1_CFG_INT1_INACT_STATE | LSM6DS_MD1_CFG_INT1_DOUBLE_TAP)
+#define LSM6DS_WAKE_UP_SRC_SLEEP_STATE   BIT(4)
+#define LSM6DS_WAKE_UP_SRC_WU            BIT(3)
+#define LSM6DS_TAP_SRC_DOUBLE_TAP        BIT(4)
+
 /* LSM6DS3TR-C timestamp resolution:
  * - TIMER_HR = 0: 1 LSB = 6.4 ms (default)
  * - TIMER_HR = 1: 1 LSB = 25 us
@@ -45,6 +97,7 @@ static int lsm6dsl_power_ensure_on(void);
 static const struct i2c_dt_spec lsm6dsl_i2c = I2C_DT_SPEC_GET(DT_ALIAS(lsm6dsl));
 static const struct gpio_dt_spec lsm6dsl_en = GPIO_DT_SPEC_GET(DT_NODELABEL(lsm6dsl_en_pin), enable_gpios);
 static const struct device *const lsm6dsl_dev = DEVICE_DT_GET(DT_ALIAS(lsm6dsl));
+static const struct gpio_dt_spec lsm6dsl_int1 = GPIO_DT_SPEC_GET_OR(DT_ALIAS(lsm6dsl), irq_gpios, {0});
 
 static void lsm6dsl_force_minimal_run_mode(void)
 {
@@ -55,6 +108,12 @@ static void lsm6dsl_force_minimal_run_mode(void)
 
 	/* 12.5 Hz = 12 + 0.5 (in micro). */
 	struct sensor_value odr = { .val1 = 12, .val2 = 500000 };
+	uint16_t gesture_odr = lsm6dsl_gesture_odr_hz();
+	if (gesture_odr) {
+		/* Taps are lost below it, the IMU drops to 12.5 Hz by itself while inactive */
+		odr.val1 = gesture_odr;
+		odr.val2 = 0;
+	}
 	(void)sensor_attr_set(lsm6dsl_dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
 
 	/* Best-effort attempt to stop gyro to save power. Not all drivers accept 0 Hz. */
@@ -251,23 +310,35 @@ void lsm6dsl_time_prepare_for_system_off(void)
 	}
 	LOG_INF("system_off prep: epoch_s=%llu", epoch_s);
 
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+	/* Kept in retained RAM: if that is lost so is the IMU's power, and with it the counter. */
+	warm_resume_set_time_base(epoch_s, ts);
+#else
 	err = app_settings_save_lsm6dsl_time_base(epoch_s, ts);
 	if (err) {
 		LOG_WRN("system_off prep: failed to save base (err %d)", err);
 	} else {
 		LOG_INF("system_off prep: saved base OK");
 	}
+#endif
 }
 
 int lsm6dsl_time_boot_adjust_rtc(void)
 {
 	uint64_t base_epoch_s;
 	uint32_t base_ts;
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+	const struct warm_state *warm = warm_resume_get();
+	base_epoch_s = warm ? warm->time.epoch_s : 0;
+	base_ts = warm ? warm->time.imu_ts : 0;
+	int err;
+#else
 	int err = app_settings_get_lsm6dsl_time_base(&base_epoch_s, &base_ts);
 	if (err) {
 		LOG_WRN("boot adjust: failed to read saved base (err %d)", err);
 		return err;
 	}
+#endif
 	if (base_epoch_s == 0) {
 		LOG_DBG("boot adjust: no saved base");
 		return 0;
@@ -313,12 +384,258 @@ int lsm6dsl_time_boot_adjust_rtc(void)
 		return err;
 	}
 
+#ifndef CONFIG_OMI_ENABLE_WARM_RESUME
 	/* Clear the base so we don't reapply on every reboot. */
 	err = app_settings_save_lsm6dsl_time_base(0, 0);
 	if (err) {
 		LOG_WRN("boot adjust: failed to clear base (err %d)", err);
 	}
+#endif
 
 	LOG_INF("Applied IMU timestamp delta: +%llu ms", delta_ms);
 	return 1;
 }
+
+static lsm6dsl_motion_handler motion_handler;
+static struct gpio_callback int1_cb;
+static bool int1_ready;
+
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+static lsm6dsl_gesture_handler gesture_handler;
+
+static void lsm6dsl_gesture_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(gesture_work, lsm6dsl_gesture_work_handler);
+#endif
+
+static void lsm6dsl_int1_isr(const struct device *port, struct gpio_callback *cb, uint32_t pins)
+{
+	ARG_UNUSED(port);
+	ARG_UNUSED(cb);
+	ARG_UNUSED(pins);
+
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+	/* Latched sources, read over I2C to tell the events apart and to release the line */
+	if (gesture_handler) {
+		k_work_schedule(&gesture_work, K_NO_WAIT);
+		return;
+	}
+#endif
+	if (motion_handler) {
+		motion_handler();
+	}
+}
+
+static int lsm6dsl_reg_update(uint8_t reg, uint8_t mask, uint8_t value)
+{
+	uint8_t old;
+	int err = i2c_reg_read_byte_dt(&lsm6dsl_i2c, reg, &old);
+	if (err) {
+		return err;
+	}
+	return i2c_reg_write_byte_dt(&lsm6dsl_i2c, reg, (old & (uint8_t)~mask) | value);
+}
+
+/* INT1 is shared by wake-on-motion and the gesture engines, one callback serves both. */
+static int lsm6dsl_int1_setup(void)
+{
+	if (int1_ready) {
+		return 0;
+	}
+
+	int err = gpio_pin_configure_dt(&lsm6dsl_int1, GPIO_INPUT);
+	if (!err) {
+		gpio_init_callback(&int1_cb, lsm6dsl_int1_isr, BIT(lsm6dsl_int1.pin));
+		err = gpio_add_callback(lsm6dsl_int1.port, &int1_cb);
+	}
+	if (!err) {
+		err = gpio_pin_interrupt_configure_dt(&lsm6dsl_int1, GPIO_INT_EDGE_TO_ACTIVE);
+	}
+	if (err) {
+		LOG_WRN("INT1 setup failed (err %d)", err);
+		return err;
+	}
+	int1_ready = true;
+	return 0;
+}
+
+int lsm6dsl_motion_wake_enable(lsm6dsl_motion_handler handler)
+{
+	if (lsm6dsl_int1.port == NULL || !device_is_ready(lsm6dsl_int1.port)) {
+		LOG_WRN("motion wake: no LSM6DSL INT1 line");
+		return -ENODEV;
+	}
+	if (!device_is_ready(lsm6dsl_i2c.bus)) {
+		LOG_WRN("lsm6dso i2c bus not ready");
+		return -ENODEV;
+	}
+
+	int err = lsm6dsl_power_ensure_on();
+	if (err) {
+		return err;
+	}
+	/* The slope detector needs a running accelerometer; the timestamp setup wants the same. */
+	lsm6dsl_force_minimal_run_mode();
+
+	err = lsm6dsl_reg_update(LSM6DS_REG_WAKE_UP_THS, LSM6DS_WAKE_UP_THS_MASK,
+				 IMU_WAKE_THRESHOLD & LSM6DS_WAKE_UP_THS_MASK);
+	if (!err) {
+		/* Leaves TIMER_HR alone, the system_off timestamp depends on it */
+		err = lsm6dsl_reg_update(LSM6DS_REG_WAKE_UP_DUR, LSM6DS_WAKE_UP_DUR_MASK, 0);
+	}
+	if (!err) {
+		/* An armed gesture engine keeps the sources latched and reports motion itself */
+		uint8_t mask = LSM6DS_TAP_CFG_INTERRUPTS_ENABLE | LSM6DS_TAP_CFG_SLOPE_FDS;
+		if (lsm6dsl_gesture_odr_hz() == 0) {
+			mask |= LSM6DS_TAP_CFG_LIR;
+		}
+		err = lsm6dsl_reg_update(LSM6DS_REG_TAP_CFG, mask, LSM6DS_TAP_CFG_INTERRUPTS_ENABLE);
+	}
+	if (!err) {
+		err = lsm6dsl_reg_update(LSM6DS_REG_MD1_CFG, LSM6DS_MD1_CFG_INT1_WU, LSM6DS_MD1_CFG_INT1_WU);
+	}
+	if (err) {
+		LOG_WRN("motion wake: register setup failed (err %d)", err);
+		return err;
+	}
+
+	motion_handler = handler;
+	err = lsm6dsl_int1_setup();
+	if (err) {
+		return err;
+	}
+
+	LOG_INF("Wake-on-motion armed, threshold %d", IMU_WAKE_THRESHOLD);
+	return 0;
+}
+
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+static void lsm6dsl_gesture_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	/* WAKE_UP_SRC then TAP_SRC, one burst read clears both latches */
+	uint8_t src[2];
+	int err = i2c_burst_read_dt(&lsm6dsl_i2c, LSM6DS_REG_WAKE_UP_SRC, src, sizeof(src));
+	if (err) {
+		/* The latch keeps INT1 high until read, no further edge would come */
+		LOG_WRN("gestures: source read failed (err %d), retrying", err);
+		k_work_schedule(&gesture_work, K_MSEC(IMU_GESTURE_RETRY_MS));
+		return;
+	}
+
+	lsm6dsl_gesture_handler handler = gesture_handler;
+	if (handler == NULL) {
+		return;
+	}
+	if (src[1] & LSM6DS_TAP_SRC_DOUBLE_TAP) {
+		handler(LSM6DSL_GESTURE_DOUBLE_TAP);
+	}
+	if (src[0] & LSM6DS_WAKE_UP_SRC_WU) {
+		handler(LSM6DSL_GESTURE_MOTION);
+		if (motion_handler) {
+			motion_handler();
+		}
+	}
+	if (src[0] & LSM6DS_WAKE_UP_SRC_SLEEP_STATE) {
+		handler(LSM6DSL_GESTURE_INACTIVE);
+	}
+}
+
+int lsm6dsl_gestures_enable(lsm6dsl_gesture_handler handler)
+{
+	if (handler == NULL) {
+		return -EINVAL;
+	}
+	if (lsm6dsl_int1.port == NULL || !device_is_ready(lsm6dsl_int1.port)) {
+		LOG_WRN("gestures: no LSM6DSL INT1 line");
+		return -ENODEV;
+	}
+	if (!device_is_ready(lsm6dsl_i2c.bus)) {
+		LOG_WRN("lsm6dso i2c bus not ready");
+		return -ENODEV;
+	}
+
+	int err = lsm6dsl_power_ensure_on();
+	if (err) {
+		return err;
+	}
+
+	/* Set first, so the run mode below picks the tap rate and an edge is never left unread */
+	gesture_handler = handler;
+	lsm6dsl_force_minimal_run_mode();
+
+	err = lsm6dsl_reg_update(LSM6DS_REG_TAP_THS_6D, LSM6DS_TAP_THS_MASK,
+				 IMU_TAP_THRESHOLD & LSM6DS_TAP_THS_MASK);
+	if (!err) {
+		err = i2c_reg_write_byte_dt(&lsm6dsl_i2c, LSM6DS_REG_INT_DUR2, IMU_TAP_TIMING);
+	}
+	if (!err) {
+		err = lsm6dsl_reg_update(LSM6DS_REG_WAKE_UP_THS,
+					 LSM6DS_WAKE_UP_THS_DOUBLE_TAP | LSM6DS_WAKE_UP_THS_MASK,
+					 LSM6DS_WAKE_UP_THS_DOUBLE_TAP |
+						 (IMU_WAKE_THRESHOLD & LSM6DS_WAKE_UP_THS_MASK));
+	}
+	if (!err) {
+		/* Leaves TIMER_HR alone, the system_off timestamp depends on it */
+		err = lsm6dsl_reg_update(LSM6DS_REG_WAKE_UP_DUR,
+					 LSM6DS_WAKE_UP_DUR_MASK | LSM6DS_WAKE_UP_DUR_SLEEP_MASK,
+					 IMU_INACTIVE_DUR & LSM6DS_WAKE_UP_DUR_SLEEP_MASK);
+	}
+	if (!err) {
+		err = lsm6dsl_reg_update(LSM6DS_REG_TAP_CFG,
+					 LSM6DS_TAP_CFG_INTERRUPTS_ENABLE | LSM6DS_TAP_CFG_INACT_MASK |
+						 LSM6DS_TAP_CFG_SLOPE_FDS | LSM6DS_TAP_CFG_TAP_XYZ |
+						 LSM6DS_TAP_CFG_LIR,
+					 LSM6DS_TAP_CFG_INTERRUPTS_ENABLE | LSM6DS_TAP_CFG_INACT_XL_LP |
+						 LSM6DS_TAP_CFG_TAP_XYZ | LSM6DS_TAP_CFG_LIR);
+	}
+	if (!err) {
+		err = lsm6dsl_reg_update(LSM6DS_REG_MD1_CFG, LSM6DS_MD1_CFG_GESTURES | LSM6DS_MD1_CFG_INT1_WU,
+					 LSM6DS_MD1_CFG_GESTURES | LSM6DS_MD1_CFG_INT1_WU);
+	}
+	if (!err) {
+		err = lsm6dsl_int1_setup();
+	}
+	if (err) {
+		LOG_WRN("gestures: setup failed (err %d)", err);
+		lsm6dsl_gestures_disable();
+		return err;
+	}
+
+	/* The line may already be latched high, and an edge is all the ISR sees */
+	k_work_schedule(&gesture_work, K_NO_WAIT);
+	LOG_INF("IMU gestures armed at %d Hz, tap threshold %d", IMU_GESTURE_ODR_HZ, IMU_TAP_THRESHOLD);
+	return 0;
+}
+
+void lsm6dsl_gestures_disable(void)
+{
+	if (gesture_handler == NULL) {
+		return;
+	}
+	gesture_handler = NULL;
+	(void)k_work_cancel_delayable(&gesture_work);
+	if (!device_is_ready(lsm6dsl_i2c.bus)) {
+		return;
+	}
+
+	/* Wake-on-motion, if armed, goes back to pulses that need no I2C */
+	uint8_t md1 = LSM6DS_MD1_CFG_GESTURES | (motion_handler ? 0 : LSM6DS_MD1_CFG_INT1_WU);
+	(void)lsm6dsl_reg_update(LSM6DS_REG_MD1_CFG, md1, 0);
+	(void)lsm6dsl_reg_update(LSM6DS_REG_TAP_CFG,
+				 LSM6DS_TAP_CFG_INACT_MASK | LSM6DS_TAP_CFG_TAP_XYZ | LSM6DS_TAP_CFG_LIR, 0);
+	(void)lsm6dsl_reg_update(LSM6DS_REG_WAKE_UP_THS, LSM6DS_WAKE_UP_THS_DOUBLE_TAP, 0);
+	(void)lsm6dsl_reg_update(LSM6DS_REG_WAKE_UP_DUR, LSM6DS_WAKE_UP_DUR_SLEEP_MASK, 0);
+	lsm6dsl_force_minimal_run_mode();
+	LOG_INF("IMU gestures disarmed");
+}
+#endif
+
+uint16_t lsm6dsl_gesture_odr_hz(void)
+{
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+	return gesture_handler ? IMU_GESTURE_ODR_HZ : 0;
+#else
+	return 0;
+#endif
+}
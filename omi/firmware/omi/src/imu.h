@@ -22,4 +22,51 @@ void lsm6dsl_time_prepare_for_system_off(void);
  */
 int lsm6dsl_time_boot_adjust_rtc(void);
 
+typedef void (*lsm6dsl_motion_handler)(void);
+
+/**
+ * @brief Route the LSM6DSL wake-up (motion) interrupt to a handler.
+ *
+ * Programs the accelerometer slope detector with IMU_WAKE_THRESHOLD and signals it on INT1.
+ * The handler runs in interrupt context, once per motion event, until the next reboot; while the
+ * gesture engines are armed it runs from the system workqueue instead.
+ *
+ * @return 0 on success, -ENODEV without an INT1 line in the devicetree, negative errno on failure.
+ */
+int lsm6dsl_motion_wake_enable(lsm6dsl_motion_handler handler);
+
+enum lsm6dsl_gesture {
+	LSM6DSL_GESTURE_DOUBLE_TAP, /* single taps are not routed to INT1, bumps and footsteps make them */
+	LSM6DSL_GESTURE_MOTION,     /* wake-up slope above IMU_WAKE_THRESHOLD, also the end of inactivity */
+	LSM6DSL_GESTURE_INACTIVE,   /* no motion for IMU_INACTIVE_DUR, the accelerometer dropped to 12.5 Hz */
+};
+
+typedef void (*lsm6dsl_gesture_handler)(enum lsm6dsl_gesture gesture);
+
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+/**
+ * @brief Arm the LSM6DSL embedded double-tap, wake-up and inactivity engines on INT1.
+ *
+ * Runs the accelerometer at IMU_GESTURE_ODR_HZ while there is motion; the IMU itself drops to
+ * 12.5 Hz after IMU_INACTIVE_DUR without it and comes back on the next wake-up, so the MCU does
+ * no sampling at all. Sources are latched, the handler runs from the system workqueue once they
+ * have been read. Can be combined with lsm6dsl_motion_wake_enable().
+ *
+ * @return 0 on success, -ENODEV without an INT1 line in the devicetree, negative errno on failure.
+ */
+int lsm6dsl_gestures_enable(lsm6dsl_gesture_handler handler);
+
+/**
+ * @brief Disarm the gesture engines, leaving wake-on-motion as it was.
+ */
+void lsm6dsl_gestures_disable(void);
+#endif
+
+/**
+ * @brief Accelerometer rate the gesture engines need, 0 when they are not armed.
+ *
+ * Whoever sets the idle accelerometer rate must not go below it.
+ */
+uint16_t lsm6dsl_gesture_odr_hz(void);
+
 #endif
@@ -1,8 +1,10 @@
 #include "lib/core/led.h"
 
 #include <zephyr/drivers/pwm.h>
+#include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
+#include "lib/core/housekeeping.h"
 #include "lib/core/settings.h"
 #include "lib/core/utils.h"
 
@@ -13,6 +15,8 @@ static const struct pwm_dt_spec led_red = PWM_DT_SPEC_GET(DT_NODELABEL(led_red))
 static const struct pwm_dt_spec led_green = PWM_DT_SPEC_GET(DT_NODELABEL(led_green));
 static const struct pwm_dt_spec led_blue = PWM_DT_SPEC_GET(DT_NODELABEL(led_blue));
 
+static uint8_t max_level = 100;
+
 int led_start()
 {
     ASSERT_TRUE(pwm_is_ready_dt(&led_red));
@@ -35,7 +39,7 @@ static void set_led_on_off(const struct pwm_dt_spec *led, bool on)
         if (ratio > 100) {
             ratio = 100;
         }
-        pulse_width_ns = (led->period * ratio) / 100;
+        pulse_width_ns = (uint32_t) ((uint64_t) led->period * ratio * max_level / 10000);
     }
 
     pwm_set_pulse_dt(led, pulse_width_ns);
@@ -84,12 +88,119 @@ void set_led_pwm(led_color_t color, uint8_t level)
         level = 100;
     }
 
-    uint32_t pulse_width_ns = (led->period * level) / 100;
+    uint32_t pulse_width_ns = (uint32_t) ((uint64_t) led->period * level * max_level / 10000);
     pwm_set_pulse_dt(led, pulse_width_ns);
 }
 
+void led_set_max_level(uint8_t percent)
+{
+    max_level = MIN(percent, 100);
+}
+
+// Pattern engine: one step per work item run, the PWM holds each level in hardware in between.
+// Only a pattern in progress schedules anything.
+#define LED_PATTERN_STEP_MIN_MS 10
+
+static const struct led_pattern *pattern;
+static uint16_t pattern_step;
+static uint8_t pattern_loops_left;
+
+static void led_pattern_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(led_pattern_work, led_pattern_work_handler);
+
+static void pattern_set_level(uint8_t mask, uint8_t level)
+{
+    for (int color = LED_RED; color <= LED_BLUE; color++) {
+        if (mask & LED_MASK(color)) {
+            set_led_pwm(color, level);
+        }
+    }
+}
+
+static void led_pattern_work_handler(struct k_work *work)
+{
+    const struct led_pattern *current = pattern;
+    if (!current) {
+        return;
+    }
+
+    if (pattern_step == current->steps) {
+        if (pattern_loops_left == 1) {
+            pattern_set_level(current->colors, 0);
+            pattern = NULL;
+            return;
+        }
+        if (pattern_loops_left > 1) {
+            pattern_loops_left--;
+        }
+        pattern_step = 0;
+    }
+
+    pattern_set_level(current->colors, current->levels[pattern_step++]);
+    k_work_reschedule_for_queue(&housekeeping_work_q,
+                                &led_pattern_work,
+                                K_MSEC(MAX(current->step_ms, LED_PATTERN_STEP_MIN_MS)));
+}
+
+void led_pattern_play(const struct led_pattern *new_pattern)
+{
+    struct k_work_sync sync;
+
+    k_work_cancel_delayable_sync(&led_pattern_work, &sync);
+    if (pattern) {
+        pattern_set_level(pattern->colors, 0);
+    }
+    pattern = new_pattern;
+    pattern_step = 0;
+    pattern_loops_left = new_pattern->loops;
+    k_work_reschedule_for_queue(&housekeeping_work_q, &led_pattern_work, K_NO_WAIT);
+}
+
+void led_pattern_stop(void)
+{
+    struct k_work_sync sync;
+
+    k_work_cancel_delayable_sync(&led_pattern_work, &sync);
+    if (pattern) {
+        pattern_set_level(pattern->colors, 0);
+        pattern = NULL;
+    }
+}
+
+bool led_pattern_active(void)
+{
+    return pattern != NULL;
+}
+
+// Ease-in-out quadratic fade in to 50%, then out from 70%, 10ms per step
+static const uint8_t ready_levels[] = {
+    0,  0,  0,  0,  0,  1,  1,  1,  2,  3,  4,  4,  5,  6,  7,  9,  10, 11, 12, 14, 16, 17, 19, 21, 23, 25,
+    26, 28, 30, 32, 34, 35, 37, 38, 39, 41, 42, 43, 44, 45, 46, 46, 47, 48, 48, 49, 49, 49, 49, 49, 50, 70,
+    69, 69, 69, 69, 68, 67, 67, 66, 65, 64, 63, 61, 60, 59, 57, 55, 53, 51, 49, 47, 45, 42, 40, 37, 35, 32,
+    29, 27, 24, 22, 20, 18, 16, 14, 12, 10, 9,  8,  6,  5,  4,  3,  2,  2,  1,  0,  0,  0,  0,  0,
+};
+
+const struct led_pattern led_pattern_ready = {
+    .levels = ready_levels,
+    .steps = ARRAY_SIZE(ready_levels),
+    .step_ms = 10,
+    .colors = LED_MASK(LED_GREEN),
+    .loops = 2,
+};
+
+static const uint8_t boot_levels[] = {100};
+
+const struct led_pattern led_pattern_boot = {
+    .levels = boot_levels,
+    .steps = ARRAY_SIZE(boot_levels),
+    .step_ms = 300,
+    .colors = LED_MASK(LED_BLUE),
+    .loops = 1,
+};
+
 void led_off(void)
 {
+    led_pattern_stop();
     set_led_red(false);
     k_msleep(10);
     set_led_green(false);
@@ -1,15 +1,45 @@
 #include "accel.h"
 
+#include <string.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/drivers/gpio.h>
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+#include <zephyr/drivers/i2c.h>
+#endif
 #include <zephyr/drivers/sensor.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+#include "button.h"
+#include "flight_rec.h"
+#include "imu.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+#include "codec.h"
+#include "sd_card.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+#include "features.h"
+#include "rtc.h"
+#endif
+#include "subscription.h"
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+#include "transport.h"
+#endif
 
 LOG_MODULE_REGISTER(accel, CONFIG_LOG_DEFAULT_LEVEL);
 
+#if defined(CONFIG_OMI_ENABLE_IMU_RECORDING) && !defined(CONFIG_OMI_ENABLE_ACCEL_FIFO)
+#error "CONFIG_OMI_ENABLE_IMU_RECORDING reads the IMU through CONFIG_OMI_ENABLE_ACCEL_FIFO"
+#endif
+#if defined(CONFIG_OMI_ENABLE_IMU_GESTURES) && defined(CONFIG_OMI_ENABLE_ACCEL_FIFO)
+#error "CONFIG_OMI_ENABLE_IMU_GESTURES and CONFIG_OMI_ENABLE_ACCEL_FIFO both need the LSM6DSL INT1 line"
+#endif
+
 // Accelerometer data
 static struct sensors mega_sensor;
 static struct device *lsm6dsl_dev;
@@ -38,6 +68,7 @@ static struct bt_gatt_attr accel_service_attr[] = {
     BT_GATT_CCC(accel_ccc_config_changed_handler, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE), // scheduler
 };
 static struct bt_gatt_service accel_service = BT_GATT_SERVICE(accel_service_attr);
+static struct subscription accel_subscription = SUBSCRIPTION_INIT;
 
 static ssize_t accel_data_read_characteristic(struct bt_conn *conn,
                                               const struct bt_gatt_attr *attr,
@@ -47,9 +78,426 @@ static ssize_t accel_data_read_characteristic(struct bt_conn *conn,
 {
     LOG_INF("Acceleration data read characteristic");
     int axis_mode = 6; // 3 for accel, 6 for (also) gyro
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+    axis_mode |= ACCEL_MODE_BATCHED;
+    if (transport_get_modes(conn) & OMI_MODE_IMU_DELTA) {
+        axis_mode |= ACCEL_MODE_DELTA;
+    }
+#endif
     return bt_gatt_attr_read(conn, attr, buf, len, offset, &axis_mode, sizeof(axis_mode));
 }
 
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+#ifdef CONFIG_OMI_ENABLE_IDLE_LISTEN
+#error "CONFIG_OMI_ENABLE_ACCEL_FIFO and CONFIG_OMI_ENABLE_IDLE_LISTEN both need the LSM6DSL INT1 line"
+#endif
+
+#define ACCEL_FIFO_ODR_HZ 104      // accel and gyro rate while streaming
+#define ACCEL_FIFO_BATCH_SAMPLES 16 // watermark, one notification per batch on a 247 byte MTU
+#define ACCEL_FIFO_POLL_MS 1000     // drain anyway if a watermark edge was missed
+
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+#if !defined(CONFIG_OMI_ENABLE_OFFLINE_STORAGE)
+#error "CONFIG_OMI_ENABLE_IMU_RECORDING records into the offline storage"
+#endif
+#define ACCEL_RECORD_DECIMATION 4 // offline recordings keep every 4th sample, 26Hz at 104Hz
+#endif
+
+#define ACCEL_FIFO_ODR_MIN_HZ 26 // FIFO ODR code 2, each code above doubles the rate
+#if ACCEL_FIFO_ODR_HZ != 26 && ACCEL_FIFO_ODR_HZ != 52 && ACCEL_FIFO_ODR_HZ != 104 && ACCEL_FIFO_ODR_HZ != 208 && \
+    ACCEL_FIFO_ODR_HZ != 416
+#error "ACCEL_FIFO_ODR_HZ must be one of 26, 52, 104, 208 or 416"
+#endif
+
+/* LSM6DSL FIFO registers:
+ * - FIFO_CTRL1/2 = 0x06/0x07, watermark in 16-bit words, FTH[10:8] in CTRL2 bits 2:0
+ * - FIFO_CTRL3 = 0x08, gyro decimation in bits 5:3, accel in bits 2:0 (1 = every sample)
+ * - FIFO_CTRL5 = 0x0A, FIFO ODR in bits 6:3, mode in bits 2:0 (0 bypass/reset, 6 continuous)
+ * - INT1_CTRL = 0x0D, INT1_FTH is bit 3
+ * - FIFO_STATUS1..4 = 0x3A..0x3D, unread words and the pattern index of the next word
+ * - FIFO_DATA_OUT_L/H = 0x3E/0x3F, a burst read wraps back to 0x3E and keeps popping words
+ * With both sensors undecimated a sample is 6 words in the order gyro X Y Z, accel X Y Z.
+ */
+#define LSM6DSL_REG_FIFO_CTRL1 0x06
+#define LSM6DSL_REG_FIFO_CTRL3 0x08
+#define LSM6DSL_REG_FIFO_CTRL5 0x0A
+#define LSM6DSL_REG_INT1_CTRL 0x0D
+#define LSM6DSL_REG_CTRL1_XL 0x10
+#define LSM6DSL_REG_CTRL2_G 0x11
+#define LSM6DSL_REG_FIFO_STATUS1 0x3A
+#define LSM6DSL_REG_FIFO_DATA_OUT_L 0x3E
+
+#define LSM6DSL_FIFO_MODE_BYPASS 0x00
+#define LSM6DSL_FIFO_MODE_CONTINUOUS 0x06
+#define LSM6DSL_FIFO_NO_DECIMATION ((1 << 3) | 1)
+#define LSM6DSL_INT1_FTH BIT(3)
+#define LSM6DSL_FIFO_STATUS2_OVER_RUN BIT(6)
+#define LSM6DSL_FIFO_WORDS_PER_SAMPLE 6
+
+#define ACCEL_BATCH_SAMPLE_BYTES (LSM6DSL_FIFO_WORDS_PER_SAMPLE * sizeof(int16_t))
+#define ACCEL_BATCH_MAX_BYTES (sizeof(struct accel_batch_header) + ACCEL_FIFO_BATCH_SAMPLES * ACCEL_BATCH_SAMPLE_BYTES)
+#define ACCEL_DELTA_MAX_BYTES 244 // one delta coded notification on a 247 byte MTU
+#define ACCEL_DELTA_SAMPLE_MAX_BYTES (LSM6DSL_FIFO_WORDS_PER_SAMPLE * 3) // 3 varint bytes per 16-bit zigzag
+BUILD_ASSERT(ACCEL_DELTA_MAX_BYTES >= ACCEL_BATCH_MAX_BYTES, "batch_buf holds raw batches too");
+
+static const struct i2c_dt_spec lsm6dsl_i2c = I2C_DT_SPEC_GET(DT_COMPAT_GET_ANY_STATUS_OKAY(st_lsm6dsl));
+static const struct gpio_dt_spec lsm6dsl_int1 =
+    GPIO_DT_SPEC_GET_OR(DT_COMPAT_GET_ANY_STATUS_OKAY(st_lsm6dsl), irq_gpios, {0});
+static struct gpio_callback fifo_cb;
+static bool fifo_running = false;
+static uint16_t fifo_odr_hz = ACCEL_FIFO_ODR_HZ; // rate of the running FIFO
+static atomic_t fifo_max_hz = ATOMIC_INIT(ACCEL_FIFO_ODR_HZ);
+static uint8_t accel_fs_g;
+static uint16_t gyro_fs_dps;
+static uint8_t batch_buf[ACCEL_DELTA_MAX_BYTES] __aligned(4);
+static int16_t fifo_samples[ACCEL_FIFO_BATCH_SAMPLES][LSM6DSL_FIFO_WORDS_PER_SAMPLE];
+
+// A batch being filled: struct accel_batch_header, then the samples raw or delta coded
+struct accel_pack {
+    uint8_t *buf; // 4-byte aligned
+    uint16_t cap;
+    uint16_t len; // 0 until started
+    bool delta;
+    int16_t prev[LSM6DSL_FIFO_WORDS_PER_SAMPLE];
+};
+
+static struct accel_pack live_pack = {.buf = batch_buf};
+
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+// Storage record payloads are at most 255 bytes
+static uint8_t record_buf[UINT8_MAX] __aligned(4);
+static struct accel_pack record_pack = {.buf = record_buf, .cap = sizeof(record_buf), .delta = true};
+static uint8_t record_phase = 0;
+#endif
+
+static void accel_fifo_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(accel_work, accel_fifo_work_handler);
+
+// Highest supported rate within both ACCEL_FIFO_ODR_HZ and the cap
+static uint16_t fifo_target_hz(void)
+{
+    uint16_t hz = ACCEL_FIFO_ODR_HZ;
+    while (hz > ACCEL_FIFO_ODR_MIN_HZ && hz > (uint16_t) atomic_get(&fifo_max_hz)) {
+        hz /= 2;
+    }
+    return hz;
+}
+
+static int fifo_set_mode(uint8_t mode)
+{
+    uint8_t odr_code = 2;
+    for (uint16_t hz = ACCEL_FIFO_ODR_MIN_HZ; hz < fifo_odr_hz; hz *= 2) {
+        odr_code++;
+    }
+    return i2c_reg_write_byte_dt(&lsm6dsl_i2c, LSM6DSL_REG_FIFO_CTRL5, (odr_code << 3) | mode);
+}
+
+// Full scales are whatever the driver configured, the batch header carries them for the app
+static void fifo_read_full_scales(void)
+{
+    static const uint8_t accel_g[] = {2, 16, 4, 8};
+    static const uint16_t gyro_dps[] = {250, 500, 1000, 2000};
+    uint8_t ctrl[2] = {0};
+
+    i2c_burst_read_dt(&lsm6dsl_i2c, LSM6DSL_REG_CTRL1_XL, ctrl, sizeof(ctrl));
+    accel_fs_g = accel_g[(ctrl[0] >> 2) & 0x3];
+    gyro_fs_dps = (ctrl[1] & BIT(1)) ? 125 : gyro_dps[(ctrl[1] >> 2) & 0x3];
+}
+
+static int fifo_start(void)
+{
+    uint16_t threshold = ACCEL_FIFO_BATCH_SAMPLES * LSM6DSL_FIFO_WORDS_PER_SAMPLE;
+    uint8_t fth[2] = {threshold & 0xFF, (threshold >> 8) & 0x07};
+
+    fifo_odr_hz = fifo_target_hz();
+    struct sensor_value odr = {.val1 = fifo_odr_hz, .val2 = 0};
+    if (sensor_attr_set(lsm6dsl_dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr) < 0 ||
+        sensor_attr_set(lsm6dsl_dev, SENSOR_CHAN_GYRO_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr) < 0) {
+        LOG_ERR("Cannot set the %d Hz streaming rate", fifo_odr_hz);
+        return -EIO;
+    }
+    fifo_read_full_scales();
+
+    // Bypass empties the FIFO, so the first word read is always a gyro X
+    int err = fifo_set_mode(LSM6DSL_FIFO_MODE_BYPASS);
+    if (!err) {
+        err = i2c_burst_write_dt(&lsm6dsl_i2c, LSM6DSL_REG_FIFO_CTRL1, fth, sizeof(fth));
+    }
+    if (!err) {
+        err = i2c_reg_write_byte_dt(&lsm6dsl_i2c, LSM6DSL_REG_FIFO_CTRL3, LSM6DSL_FIFO_NO_DECIMATION);
+    }
+    if (!err) {
+        err = i2c_reg_update_byte_dt(&lsm6dsl_i2c, LSM6DSL_REG_INT1_CTRL, LSM6DSL_INT1_FTH, LSM6DSL_INT1_FTH);
+    }
+    if (!err) {
+        err = fifo_set_mode(LSM6DSL_FIFO_MODE_CONTINUOUS);
+    }
+    if (err) {
+        LOG_ERR("FIFO setup failed (err %d)", err);
+        return err;
+    }
+
+    fifo_running = true;
+    LOG_INF("Streaming IMU at %d Hz, %d samples per batch", fifo_odr_hz, ACCEL_FIFO_BATCH_SAMPLES);
+    return 0;
+}
+
+static void fifo_stop(void)
+{
+    struct sensor_value odr = {.val1 = 10, .val2 = 0};
+
+    fifo_running = false;
+    i2c_reg_update_byte_dt(&lsm6dsl_i2c, LSM6DSL_REG_INT1_CTRL, LSM6DSL_INT1_FTH, 0);
+    fifo_set_mode(LSM6DSL_FIFO_MODE_BYPASS);
+    // Back to the idle rate from accel_start()
+    sensor_attr_set(lsm6dsl_dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+    sensor_attr_set(lsm6dsl_dev, SENSOR_CHAN_GYRO_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+    LOG_INF("IMU streaming stopped");
+}
+
+static void pack_start(struct accel_pack *pack, uint32_t timestamp_ms, uint32_t period_us)
+{
+    struct accel_batch_header *header = (struct accel_batch_header *) pack->buf;
+
+    header->timestamp_ms = timestamp_ms;
+    header->period_us = period_us;
+    header->gyro_fs_dps = gyro_fs_dps;
+    header->accel_fs_g = accel_fs_g;
+    header->count = 0;
+    pack->len = sizeof(*header);
+}
+
+static uint8_t pack_count(const struct accel_pack *pack)
+{
+    return pack->len ? ((const struct accel_batch_header *) pack->buf)->count : 0;
+}
+
+// Appends one sample, false if it doesn't fit and the batch has to go out first
+static bool pack_add(struct accel_pack *pack, const int16_t *sample)
+{
+    struct accel_batch_header *header = (struct accel_batch_header *) pack->buf;
+    uint8_t coded[ACCEL_DELTA_SAMPLE_MAX_BYTES];
+    uint16_t len = 0;
+
+    if (header->count == UINT8_MAX) {
+        return false;
+    }
+    if (!pack->delta || header->count == 0) {
+        memcpy(coded, sample, ACCEL_BATCH_SAMPLE_BYTES);
+        len = ACCEL_BATCH_SAMPLE_BYTES;
+    } else {
+        for (int axis = 0; axis < LSM6DSL_FIFO_WORDS_PER_SAMPLE; axis++) {
+            // Wraps like the decoder's int16 sum, so every step fits 16 bits
+            int16_t delta = (int16_t) (sample[axis] - pack->prev[axis]);
+            uint16_t zigzag = (uint16_t) ((uint16_t) delta << 1) ^ (uint16_t) (delta >> 15);
+            while (zigzag >= 0x80) {
+                coded[len++] = (zigzag & 0x7F) | 0x80;
+                zigzag >>= 7;
+            }
+            coded[len++] = (uint8_t) zigzag;
+        }
+    }
+    if (pack->len + len > pack->cap) {
+        return false;
+    }
+
+    memcpy(pack->buf + pack->len, coded, len);
+    pack->len += len;
+    memcpy(pack->prev, sample, ACCEL_BATCH_SAMPLE_BYTES);
+    header->count++;
+    return true;
+}
+
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+// Motion is mostly smooth at 26Hz, so most samples shrink to 6 bytes and a record holds about 40
+static void record_flush(void)
+{
+    if (pack_count(&record_pack) && !write_record_to_storage(STORAGE_RECORD_IMU_VARINT, record_buf, record_pack.len)) {
+        LOG_WRN("IMU record dropped, storage is behind");
+    }
+    record_pack.len = 0;
+}
+
+static void record_sample_add(const int16_t *sample, uint32_t timestamp_ms)
+{
+    bool keep = record_phase == 0;
+    record_phase = (record_phase + 1) % ACCEL_RECORD_DECIMATION;
+    if (!keep) {
+        return;
+    }
+
+    uint32_t period_us = ACCEL_RECORD_DECIMATION * 1000000 / fifo_odr_hz;
+    if (record_pack.len == 0) {
+        pack_start(&record_pack, timestamp_ms, period_us);
+    }
+    if (!pack_add(&record_pack, sample)) {
+        record_flush();
+        pack_start(&record_pack, timestamp_ms, period_us);
+        pack_add(&record_pack, sample);
+    }
+}
+#endif
+
+static void live_send(struct bt_conn *conn)
+{
+    int err = transport_notify(conn, &accel_service.attrs[1], live_pack.buf, live_pack.len);
+    if (err) {
+        // Keep popping, samples left behind would only be stale by the next watermark
+        LOG_WRN("IMU batch notify failed (err %d)", err);
+    }
+    live_pack.len = 0;
+}
+
+// Sends everything in the FIFO to the subscriber (conn, if any), each notification a header and as many
+// whole samples as the MTU allows, and with recording on also into offline storage records
+static void fifo_drain(struct bt_conn *conn, bool recording)
+{
+    uint8_t status[4];
+    int err = i2c_burst_read_dt(&lsm6dsl_i2c, LSM6DSL_REG_FIFO_STATUS1, status, sizeof(status));
+    if (err) {
+        LOG_ERR("FIFO status read failed (err %d)", err);
+        return;
+    }
+
+    // Samples are lost on overrun and the pattern may be mid-sample, start over clean
+    if (status[1] & LSM6DSL_FIFO_STATUS2_OVER_RUN) {
+        LOG_WRN("IMU FIFO overrun, restarting it");
+        fifo_set_mode(LSM6DSL_FIFO_MODE_BYPASS);
+        fifo_set_mode(LSM6DSL_FIFO_MODE_CONTINUOUS);
+        return;
+    }
+
+    uint16_t words = status[0] | ((status[1] & 0x07) << 8);
+    uint32_t total = words / LSM6DSL_FIFO_WORDS_PER_SAMPLE;
+    if (conn) {
+        // Raw batches keep their watermark-sized limit, delta coded ones fill the notification
+        uint16_t payload = bt_gatt_get_mtu(conn) - 3;
+        live_pack.delta = (transport_get_modes(conn) & OMI_MODE_IMU_DELTA) != 0;
+        live_pack.cap = MIN(payload, live_pack.delta ? ACCEL_DELTA_MAX_BYTES : ACCEL_BATCH_MAX_BYTES);
+        if (live_pack.cap < sizeof(struct accel_batch_header) + ACCEL_BATCH_SAMPLE_BYTES) {
+            // Not one sample fits until the MTU is negotiated. Drain anyway, left in the FIFO they
+            // would only overrun it, and record them if recording
+            conn = NULL;
+        }
+    }
+    if (total == 0) {
+        return;
+    }
+
+    // The newest sample was taken just now; 0 while the clock is not synchronized, as for audio
+    uint64_t newest_ms = rtc_get_utc_time_ms();
+    uint32_t period_us = 1000000 / fifo_odr_hz;
+    live_pack.len = 0;
+
+    for (uint32_t read = 0; read < total;) {
+        uint32_t count = MIN(total - read, ACCEL_FIFO_BATCH_SAMPLES);
+        err = i2c_burst_read_dt(&lsm6dsl_i2c, LSM6DSL_REG_FIFO_DATA_OUT_L, (uint8_t *) fifo_samples,
+                                count * ACCEL_BATCH_SAMPLE_BYTES);
+        if (err) {
+            LOG_ERR("FIFO read failed (err %d)", err);
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t timestamp_ms = 0;
+            if (newest_ms) {
+                timestamp_ms = (uint32_t) (newest_ms - (uint64_t) (total - 1 - read - i) * period_us / 1000);
+            }
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+            if (recording) {
+                record_sample_add(fifo_samples[i], timestamp_ms);
+            }
+#endif
+            if (!conn) {
+                continue;
+            }
+            if (live_pack.len == 0) {
+                pack_start(&live_pack, timestamp_ms, period_us);
+            }
+            if (!pack_add(&live_pack, fifo_samples[i])) {
+                live_send(conn);
+                pack_start(&live_pack, timestamp_ms, period_us);
+                pack_add(&live_pack, fifo_samples[i]);
+            }
+        }
+        read += count;
+    }
+    if (conn && pack_count(&live_pack)) {
+        live_send(conn);
+    }
+}
+
+static void accel_fifo_work_handler(struct k_work *work)
+{
+    struct bt_conn *conn = get_current_connection();
+    bool notifying = conn && subscription_is_notifying(&accel_subscription);
+    bool recording = false;
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+    // Nothing signals the start of offline capture, so the poll keeps running to notice it
+    recording = codec_is_offline();
+    if (!recording) {
+        record_pack.len = 0;
+    }
+#endif
+
+    if (!notifying && !recording) {
+        // Nobody listening, the FIFO and the higher rate only cost power
+        if (fifo_running) {
+            fifo_stop();
+        }
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+        k_work_reschedule(&accel_work, K_MSEC(ACCEL_FIFO_POLL_MS));
+#endif
+        return;
+    }
+    if (!fifo_running && fifo_start()) {
+        return;
+    }
+
+    fifo_drain(notifying ? conn : NULL, recording);
+    if (fifo_odr_hz != fifo_target_hz()) {
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+        // A record holds one period, close it at the old rate
+        record_flush();
+#endif
+        fifo_stop();
+        if (fifo_start()) {
+            return;
+        }
+    }
+    k_work_reschedule(&accel_work, K_MSEC(ACCEL_FIFO_POLL_MS));
+}
+
+void accel_set_max_rate(uint16_t hz)
+{
+    if (atomic_set(&fifo_max_hz, hz) != hz && fifo_running) {
+        k_work_reschedule(&accel_work, K_NO_WAIT);
+    }
+}
+
+static void fifo_watermark_isr(const struct device *port, struct gpio_callback *cb, uint32_t pins)
+{
+    k_work_reschedule(&accel_work, K_NO_WAIT);
+}
+
+static int fifo_irq_setup(void)
+{
+    if (lsm6dsl_int1.port == NULL || !device_is_ready(lsm6dsl_int1.port) || !device_is_ready(lsm6dsl_i2c.bus)) {
+        LOG_ERR("LSM6DSL INT1 or bus not available for FIFO streaming");
+        return -ENODEV;
+    }
+
+    int err = gpio_pin_configure_dt(&lsm6dsl_int1, GPIO_INPUT);
+    if (!err) {
+        gpio_init_callback(&fifo_cb, fifo_watermark_isr, BIT(lsm6dsl_int1.pin));
+        err = gpio_add_callback(lsm6dsl_int1.port, &fifo_cb);
+    }
+    if (!err) {
+        err = gpio_pin_interrupt_configure_dt(&lsm6dsl_int1, GPIO_INT_EDGE_TO_ACTIVE);
+    }
+    return err;
+}
+#else
 #define ACCEL_REFRESH_INTERVAL 1000 // 1.0 seconds
 
 void broadcast_accel(struct k_work *work_item);
@@ -59,6 +507,12 @@ void broadcast_accel(struct k_work *work_item)
 {
     struct bt_conn *current_connection = NULL; // This will need to be passed in
 
+    // Nobody listening, skip the sensor reads
+    if (!subscription_is_notifying(&accel_subscription)) {
+        k_work_reschedule(&accel_work, K_MSEC(ACCEL_REFRESH_INTERVAL));
+        return;
+    }
+
     sensor_sample_fetch_chan(lsm6dsl_dev, SENSOR_CHAN_ACCEL_XYZ);
     sensor_channel_get(lsm6dsl_dev, SENSOR_CHAN_ACCEL_X, &mega_sensor.a_x);
     sensor_channel_get(lsm6dsl_dev, SENSOR_CHAN_ACCEL_Y, &mega_sensor.a_y);
@@ -70,12 +524,45 @@ void broadcast_accel(struct k_work *work_item)
     sensor_channel_get(lsm6dsl_dev, SENSOR_CHAN_GYRO_Z, &mega_sensor.g_z);
 
     // Only time mega sensor is changed is through here (hopefully), so no chance of race condition
-    int err = bt_gatt_notify(current_connection, &accel_service.attrs[1], &mega_sensor, sizeof(mega_sensor));
+    int err = transport_notify(current_connection, &accel_service.attrs[1], &mega_sensor, sizeof(mega_sensor));
     if (err) {
         LOG_ERR("Error updating Accelerometer data");
     }
     k_work_reschedule(&accel_work, K_MSEC(ACCEL_REFRESH_INTERVAL));
 }
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+// Runs on the system workqueue, after the IMU's latched sources were read
+static void accel_gesture(enum lsm6dsl_gesture gesture)
+{
+    static bool still = false;
+
+    switch (gesture) {
+    case LSM6DSL_GESTURE_DOUBLE_TAP:
+        LOG_INF("Housing double tap");
+#ifdef CONFIG_OMI_ENABLE_BUTTON
+        // Single taps also come from bumps and footsteps, only double taps stand in for the button
+        button_housing_double_tap();
+#endif
+        break;
+    case LSM6DSL_GESTURE_MOTION:
+        if (!still) {
+            return;
+        }
+        still = false;
+        LOG_INF("Motion after inactivity");
+        break;
+    case LSM6DSL_GESTURE_INACTIVE:
+        still = true;
+        LOG_INF("IMU inactive");
+        break;
+    default:
+        return;
+    }
+    FLIGHT_REC(FLIGHT_REC_IMU_GESTURE, gesture, 0);
+}
+#endif
 
 struct gpio_dt_spec accel_gpio_pin = {.port = DEVICE_DT_GET(DT_NODELABEL(gpio1)),
                                       .pin = 8,
@@ -84,6 +571,11 @@ struct gpio_dt_spec accel_gpio_pin = {.port = DEVICE_DT_GET(DT_NODELABEL(gpio1))
 // Use d4,d5
 static void accel_ccc_config_changed_handler(const struct bt_gatt_attr *attr, uint16_t value)
 {
+    subscription_update(&accel_subscription, value);
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+    // Starts or stops streaming, the bus can't be used from here
+    k_work_reschedule(&accel_work, K_NO_WAIT);
+#endif
     if (value == BT_GATT_CCC_NOTIFY) {
         LOG_INF("Client subscribed for notifications");
     } else if (value == 0) {
@@ -132,6 +624,20 @@ int accel_start(void)
         LOG_ERR("Sensor sample update error");
         return 0;
     }
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+    if (fifo_irq_setup()) {
+        return 0;
+    }
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+    k_work_reschedule(&accel_work, K_MSEC(ACCEL_FIFO_POLL_MS));
+#endif
+#endif
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+    // Not fatal, the button still works
+    if (lsm6dsl_gestures_enable(accel_gesture)) {
+        LOG_WRN("IMU gestures unavailable");
+    }
+#endif
 
     LOG_INF("Accelerometer is ready for use \n");
 
@@ -145,5 +651,13 @@ void register_accel_service(struct bt_conn *conn)
 
 void accel_off(void)
 {
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+    lsm6dsl_gestures_disable();
+#endif
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+    gpio_pin_interrupt_configure_dt(&lsm6dsl_int1, GPIO_INT_DISABLE);
+    k_work_cancel_delayable(&accel_work);
+    fifo_running = false;
+#endif
     gpio_pin_set_dt(&accel_gpio_pin, 0);
 }
@@ -18,6 +18,41 @@ struct sensors {
     struct sensor_value g_z;
 };
 
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+// Set in the axis mode read from the characteristic when notifications carry batches
+#define ACCEL_MODE_BATCHED BIT(8)
+// Also set when the reading central enabled OMI_MODE_IMU_DELTA and its batches are delta coded
+#define ACCEL_MODE_DELTA BIT(9)
+
+/**
+ * One notification of FIFO mode, followed by count samples of six little-endian int16:
+ * gyro X, Y, Z then accel X, Y, Z, raw counts at the full scales given here.
+ *
+ * Delta coded (OMI_MODE_IMU_DELTA, and every STORAGE_RECORD_IMU_VARINT record) only the first
+ * sample is raw. Each later one is six varints, one per axis in the same order: the difference
+ * to the previous sample as int16 (wrapping), zigzag mapped ((d << 1) ^ (d >> 15)) and coded
+ * 7 bits per byte, low bits first, 0x80 set on all but the last byte. A difference within +-63
+ * takes one byte. Every batch starts over with a raw sample, so a lost one costs only itself.
+ */
+struct accel_batch_header {
+    uint32_t timestamp_ms; // low 32 bits of the UTC time (ms) of the first sample, 0 if unknown
+    uint32_t period_us;    // time between samples
+    uint16_t gyro_fs_dps;  // gyro full scale, +-dps at 32767
+    uint8_t accel_fs_g;    // accel full scale, +-g at 32767
+    uint8_t count;
+} __packed;
+
+/**
+ * @brief Cap the streaming rate, for the performance governor
+ *
+ * The FIFO runs at the highest of 26, 52, 104, 208 and 416 Hz up to both the cap and its compile-time
+ * rate, and restarts at the new rate after its next drain. The batch header reports the rate in use.
+ *
+ * @param hz Highest rate allowed, UINT16_MAX lifts the cap
+ */
+void accel_set_max_rate(uint16_t hz);
+#endif
+
 // Public functions
 int accel_start(void);
 void accel_off(void);
@@ -0,0 +1,288 @@
+#include "benchmark.h"
+
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "subscription.h"
+#include "transport.h"
+
+LOG_MODULE_REGISTER(benchmark, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define BENCH_MAX_IN_FLIGHT 8
+#define BENCH_MAX_RETRIES 3
+#define BENCH_MAX_PACKET_SIZE 244
+#define BENCH_HISTOGRAM_BUCKETS 8
+
+// Upper bounds of the enqueue-to-sent latency buckets in us, the last bucket is open-ended
+static const uint32_t bench_bucket_limits_us[BENCH_HISTOGRAM_BUCKETS - 1] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000};
+
+struct bench_results {
+    uint32_t duration_ms;
+    uint32_t packets_sent;
+    uint32_t bytes_sent;
+    uint32_t throughput_bps;
+    uint32_t notify_failures;
+    uint32_t retries;
+    uint32_t latency_histogram[BENCH_HISTOGRAM_BUCKETS];
+    uint8_t running;
+} __packed;
+
+static ssize_t bench_command_write_handler(struct bt_conn *conn,
+                                           const struct bt_gatt_attr *attr,
+                                           const void *buf,
+                                           uint16_t len,
+                                           uint16_t offset,
+                                           uint8_t flags);
+static ssize_t bench_results_read_handler(struct bt_conn *conn,
+                                          const struct bt_gatt_attr *attr,
+                                          void *buf,
+                                          uint16_t len,
+                                          uint16_t offset);
+static void bench_data_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+//
+// Service and Characteristic
+//
+// Benchmark service with UUID 19B10040-E8F2-537E-4F6C-D104768A1214
+// exposes following characteristics:
+// - Data (UUID 19B10041-E8F2-537E-4F6C-D104768A1214) synthetic packets (notify)
+// - Command (UUID 19B10042-E8F2-537E-4F6C-D104768A1214) start/stop a run (write)
+// - Results (UUID 19B10043-E8F2-537E-4F6C-D104768A1214) statistics of the last run (read/notify)
+static struct bt_uuid_128 bench_service_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10040, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 bench_data_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10041, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 bench_command_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10042, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 bench_results_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10043, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+
+static struct bt_gatt_attr bench_service_attr[] = {
+    BT_GATT_PRIMARY_SERVICE(&bench_service_uuid),
+    BT_GATT_CHARACTERISTIC(&bench_data_uuid.uuid, BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE, NULL, NULL, NULL),
+    BT_GATT_CCC(bench_data_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(&bench_command_uuid.uuid,
+                           BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_WRITE,
+                           NULL,
+                           bench_command_write_handler,
+                           NULL),
+    BT_GATT_CHARACTERISTIC(&bench_results_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ,
+                           bench_results_read_handler,
+                           NULL,
+                           NULL),
+    BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+};
+
+static struct bt_gatt_service bench_service = BT_GATT_SERVICE(bench_service_attr);
+static struct subscription bench_subscription = SUBSCRIPTION_INIT;
+
+//
+// State
+//
+
+static uint16_t bench_rate_hz;
+static uint16_t bench_packet_size;
+static uint8_t bench_duration_s;
+static atomic_t bench_stop_flag;
+static struct bench_results results;
+
+K_SEM_DEFINE(bench_start_sem, 0, 1);
+K_SEM_DEFINE(bench_in_flight, BENCH_MAX_IN_FLIGHT, BENCH_MAX_IN_FLIGHT);
+
+// Enqueue timestamps of in-flight packets, indexed by the count of packets queued. Notifications on a
+// connection complete in order and at most BENCH_MAX_IN_FLIGHT are queued, so a slot is free again when reused
+static uint32_t bench_sent_at[BENCH_MAX_IN_FLIGHT];
+static uint8_t bench_packet[BENCH_MAX_PACKET_SIZE];
+
+K_THREAD_STACK_DEFINE(bench_stack, 1024);
+static struct k_thread bench_thread;
+
+static void bench_data_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    subscription_update(&bench_subscription, value);
+}
+
+static ssize_t bench_command_write_handler(struct bt_conn *conn,
+                                           const struct bt_gatt_attr *attr,
+                                           const void *buf,
+                                           uint16_t len,
+                                           uint16_t offset,
+                                           uint8_t flags)
+{
+    const uint8_t *data = buf;
+
+    if (len == 1 && data[0] == 0) {
+        atomic_set(&bench_stop_flag, 1);
+        return len;
+    }
+    if (len != 5) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+    if (results.running) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    uint16_t rate = sys_get_le16(data);
+    uint16_t size = sys_get_le16(data + 2);
+    if (rate == 0 || rate > 1000 || size < sizeof(uint32_t) || size > BENCH_MAX_PACKET_SIZE || data[4] == 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    bench_rate_hz = rate;
+    bench_packet_size = size;
+    bench_duration_s = data[4];
+    k_sem_give(&bench_start_sem);
+    return len;
+}
+
+static ssize_t bench_results_read_handler(struct bt_conn *conn,
+                                          const struct bt_gatt_attr *attr,
+                                          void *buf,
+                                          uint16_t len,
+                                          uint16_t offset)
+{
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &results, sizeof(results));
+}
+
+//
+// Runner
+//
+
+static void bench_packet_sent(struct bt_conn *conn, void *user_data)
+{
+    uint32_t slot = POINTER_TO_UINT(user_data);
+    uint32_t latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - bench_sent_at[slot]);
+
+    uint8_t bucket = 0;
+    while (bucket < BENCH_HISTOGRAM_BUCKETS - 1 && latency_us >= bench_bucket_limits_us[bucket]) {
+        bucket++;
+    }
+    results.latency_histogram[bucket]++;
+    k_sem_give(&bench_in_flight);
+}
+
+static bool bench_send(struct bt_conn *conn, uint32_t seq, uint32_t slot, uint16_t size)
+{
+    struct bt_gatt_notify_params params = {
+        .attr = &bench_service.attrs[1],
+        .data = bench_packet,
+        .len = size,
+        .func = bench_packet_sent,
+        .user_data = UINT_TO_POINTER(slot),
+    };
+
+    sys_put_le32(seq, bench_packet);
+    for (int attempt = 0; attempt < BENCH_MAX_RETRIES; attempt++) {
+        bench_sent_at[slot] = k_cycle_get_32();
+        int err = bt_gatt_notify_cb(conn, &params);
+        if (!err) {
+            return true;
+        }
+        results.retries++;
+        k_sleep(K_MSEC(1));
+    }
+    return false;
+}
+
+static void bench_run(void)
+{
+    struct bt_conn *conn = get_current_connection();
+    if (!conn || !subscription_is_notifying(&bench_subscription)) {
+        LOG_WRN("Benchmark needs a connection with the data characteristic subscribed");
+        return;
+    }
+    conn = bt_conn_ref(conn);
+
+    memset(&results, 0, sizeof(results));
+    results.running = 1;
+    atomic_set(&bench_stop_flag, 0);
+    uint16_t size = MIN(bench_packet_size, bt_gatt_get_mtu(conn) - 3);
+    memset(bench_packet, 0xA5, sizeof(bench_packet));
+    LOG_INF("Benchmark: %u packets/s of %u bytes for %u s", bench_rate_hz, size, bench_duration_s);
+
+    int64_t start = k_uptime_get();
+    int64_t end = start + bench_duration_s * MSEC_PER_SEC;
+    uint32_t seq = 0;
+    uint32_t queued = 0; // only counts sends, seq also advances on a timed out credit
+    while (!atomic_get(&bench_stop_flag) && k_uptime_get() < end) {
+        // Keep to the requested rate; a link that can't keep up shows up as failures, not a slower rate
+        int64_t due = start + (int64_t) seq * MSEC_PER_SEC / bench_rate_hz;
+        int64_t now = k_uptime_get();
+        if (due > now) {
+            k_sleep(K_MSEC(due - now));
+        }
+
+        if (k_sem_take(&bench_in_flight, K_MSEC(MSEC_PER_SEC / bench_rate_hz + 1)) != 0) {
+            results.notify_failures++;
+        } else if (bench_send(conn, seq, queued % BENCH_MAX_IN_FLIGHT, size)) {
+            queued++;
+            results.packets_sent++;
+            results.bytes_sent += size;
+        } else {
+            results.notify_failures++;
+            k_sem_give(&bench_in_flight);
+        }
+        seq++;
+    }
+
+    // Let the last notifications complete so they land in the histogram
+    for (int i = 0; i < BENCH_MAX_IN_FLIGHT; i++) {
+        k_sem_take(&bench_in_flight, K_MSEC(500));
+    }
+    for (int i = 0; i < BENCH_MAX_IN_FLIGHT; i++) {
+        k_sem_give(&bench_in_flight);
+    }
+
+    results.duration_ms = (uint32_t) (k_uptime_get() - start);
+    if (results.duration_ms) {
+        results.throughput_bps = (uint32_t) ((uint64_t) results.bytes_sent * 8000 / results.duration_ms);
+    }
+    results.running = 0;
+    LOG_INF("Benchmark done: %u packets, %u bps, %u failures, %u retries",
+            results.packets_sent,
+            results.throughput_bps,
+            results.notify_failures,
+            results.retries);
+
+    transport_notify(conn, &bench_service.attrs[6], &results, MIN(sizeof(results), bt_gatt_get_mtu(conn) - 3));
+    bt_conn_unref(conn);
+}
+
+static void bench_entry(void)
+{
+    while (1) {
+        k_sem_take(&bench_start_sem, K_FOREVER);
+        bench_run();
+    }
+}
+
+int benchmark_init(void)
+{
+    int err = bt_gatt_service_register(&bench_service);
+    if (err) {
+        LOG_ERR("Failed to register benchmark service (err %d)", err);
+        return err;
+    }
+
+    k_thread_create(&bench_thread,
+                    bench_stack,
+                    K_THREAD_STACK_SIZEOF(bench_stack),
+                    (k_thread_entry_t) bench_entry,
+                    NULL,
+                    NULL,
+                    NULL,
+                    K_PRIO_PREEMPT(7),
+                    0,
+                    K_NO_WAIT);
+    k_thread_name_set(&bench_thread, "benchmark");
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#ifdef CONFIG_OMI_ENABLE_BENCHMARK
+
+/**
+ * @brief Register the BLE benchmark service and start its (idle) worker thread
+ *
+ * Writing [rate_hz u16][size u16][duration_s u8] to the command characteristic
+ * streams synthetic notifications at that rate and size; a single 0 byte stops
+ * a running benchmark. Results are read from (and notified on) the results
+ * characteristic once the run ends.
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int benchmark_init(void);
+
+#endif // CONFIG_OMI_ENABLE_BENCHMARK
+
+#endif // BENCHMARK_H
@@ -15,7 +15,13 @@
 #include "haptic.h"
 #include "led.h"
 #include "mic.h"
+#include "power.h"
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+#include "warm_resume.h"
+#endif
+#include "settings.h"
 #include "speaker.h"
+#include "subscription.h"
 #include "transport.h"
 #include "wdog_facade.h"
 #ifdef CONFIG_OMI_ENABLE_WIFI
@@ -56,8 +62,11 @@ static struct bt_gatt_attr button_service_attr[] = {
 
 static struct bt_gatt_service button_service = BT_GATT_SERVICE(button_service_attr);
 
+static struct subscription button_subscription = SUBSCRIPTION_INIT;
+
 static void button_ccc_config_changed_handler(const struct bt_gatt_attr *attr, uint16_t value)
 {
+    subscription_update(&button_subscription, value);
     if (value == BT_GATT_CCC_NOTIFY) {
         LOG_INF("Client subscribed for notifications");
     } else if (value == 0) {
@@ -69,15 +78,14 @@ static void button_ccc_config_changed_handler(const struct bt_gatt_attr *attr, u
 static const struct device *const buttons = DEVICE_DT_GET(DT_ALIAS(buttons));
 static const struct gpio_dt_spec usr_btn = GPIO_DT_SPEC_GET_OR(DT_NODELABEL(usr_btn), gpios, {0});
 
-static bool was_pressed = false;
-
 // Using GPIO callback due to the lower priority of the input subsystem vs. storage.c's thread that prevents the
-// callback from working properly.
-#define BUTTON_CHECK_INTERVAL 40 // 0.04 seconds, 25 Hz
+// callback from working properly. Each edge runs the FSM once the contact settled, and a gesture in progress
+// wakes it at its next deadline; with the button idle nothing runs.
+#define BUTTON_DEBOUNCE_MS 20
 
-void check_button_level(struct k_work *work_item);
+static void button_work_handler(struct k_work *work_item);
 
-K_WORK_DELAYABLE_DEFINE(button_work, check_button_level);
+K_WORK_DELAYABLE_DEFINE(button_work, button_work_handler);
 
 #define DEFAULT_STATE 0
 #define SINGLE_TAP 1
@@ -88,24 +96,16 @@ K_WORK_DELAYABLE_DEFINE(button_work, check_button_level);
 
 // 4 is button down, 5 is button up
 static FSM_STATE_T current_button_state = IDLE;
-static uint32_t inc_count_1 = 0;
-static uint32_t inc_count_0 = 0;
 
 static int final_button_state[2] = {0, 0};
-const static int threshold = 10;
 
-static void reset_count()
-{
-    inc_count_0 = 0;
-    inc_count_1 = 0;
-}
 static inline void notify_press()
 {
     final_button_state[0] = BUTTON_PRESS;
     LOG_INF("Button pressed");
     struct bt_conn *conn = get_current_connection();
-    if (conn != NULL) {
-        bt_gatt_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
+    if (conn != NULL && subscription_is_notifying(&button_subscription)) {
+        transport_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
     }
 }
 
@@ -114,8 +114,8 @@ static inline void notify_unpress()
     final_button_state[0] = BUTTON_RELEASE;
     LOG_INF("Button released");
     struct bt_conn *conn = get_current_connection();
-    if (conn != NULL) {
-        bt_gatt_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
+    if (conn != NULL && subscription_is_notifying(&button_subscription)) {
+        transport_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
     }
 }
 
@@ -124,8 +124,8 @@ static inline void notify_tap()
     final_button_state[0] = SINGLE_TAP;
     LOG_INF("Button single tap");
     struct bt_conn *conn = get_current_connection();
-    if (conn != NULL) {
-        bt_gatt_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
+    if (conn != NULL && subscription_is_notifying(&button_subscription)) {
+        transport_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
     }
 }
 
@@ -134,8 +134,8 @@ static inline void notify_double_tap()
     final_button_state[0] = DOUBLE_TAP; // button press
     LOG_INF("Button double tap");
     struct bt_conn *conn = get_current_connection();
-    if (conn != NULL) {
-        bt_gatt_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
+    if (conn != NULL && subscription_is_notifying(&button_subscription)) {
+        transport_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
     }
 }
 
@@ -144,8 +144,8 @@ static inline void notify_long_tap()
     final_button_state[0] = LONG_TAP; // button press
     LOG_INF("Button long tap");
     struct bt_conn *conn = get_current_connection();
-    if (conn != NULL) {
-        bt_gatt_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
+    if (conn != NULL && subscription_is_notifying(&button_subscription)) {
+        transport_notify(conn, &button_service.attrs[1], &final_button_state, sizeof(final_button_state));
     }
 }
 
@@ -164,100 +164,85 @@ typedef enum {
     BUTTON_EVENT_RELEASE
 } ButtonEvent;
 
-static uint32_t current_time = 0;
 static uint32_t btn_press_start_time;
-static uint32_t btn_release_time;
 static uint32_t btn_last_tap_time;
 static bool btn_is_pressed;
+static bool btn_tap_pending;     // a short tap that may still become a double tap
+static bool btn_release_pending; // a gesture whose release hasn't been reported yet
 
 static u_int8_t btn_last_event = BUTTON_EVENT_NONE;
 
-void check_button_level(struct k_work *work_item)
+static void button_report_release(void)
 {
-    current_time = current_time + 1;
-
-    u_int8_t btn_state = was_pressed ? BUTTON_PRESSED : BUTTON_RELEASED;
+    if (btn_last_event != BUTTON_EVENT_RELEASE) {
+        LOG_PRINTK("release detected\n");
+        btn_last_event = BUTTON_EVENT_RELEASE;
+        notify_unpress();
+    }
+    btn_release_pending = false;
+    current_button_state = GRACE;
+}
 
-    ButtonEvent event = BUTTON_EVENT_NONE;
+static void button_work_handler(struct k_work *work_item)
+{
+    uint32_t now = k_uptime_get_32();
+    bool pressed = gpio_pin_get_dt(&usr_btn) == BUTTON_PRESSED;
 
-    // Debouncing pressed state
-    if (btn_state == BUTTON_PRESSED && !btn_is_pressed) {
+    if (pressed && !btn_is_pressed) {
         btn_is_pressed = true;
-        btn_press_start_time = current_time;
-    } else if (btn_state == BUTTON_RELEASED && btn_is_pressed) {
+        btn_release_pending = true;
+        btn_press_start_time = now;
+        // Someone is handling the device, a phone may be looking for it
+        transport_advertise_fast();
+    } else if (!pressed && btn_is_pressed) {
         btn_is_pressed = false;
-        btn_release_time = current_time;
 
-        // Check for double tap
-        uint32_t press_duration = (btn_release_time - btn_press_start_time) * BUTTON_CHECK_INTERVAL;
+        uint32_t press_duration = now - btn_press_start_time;
         if (press_duration < TAP_THRESHOLD) {
-            if (btn_last_tap_time > 0 &&
-                (current_time - btn_last_tap_time) * BUTTON_CHECK_INTERVAL < DOUBLE_TAP_WINDOW) {
-                event = BUTTON_EVENT_DOUBLE_TAP;
-                btn_last_tap_time = 0; // Reset double-tap / single-tap detection
+            if (btn_tap_pending && now - btn_last_tap_time < DOUBLE_TAP_WINDOW) {
+                LOG_INF("double tap detected\n");
+                btn_last_event = BUTTON_EVENT_DOUBLE_TAP;
+                btn_tap_pending = false; // Reset double-tap / single-tap detection
+                notify_double_tap();
             } else {
-                btn_last_tap_time = current_time;
+                btn_tap_pending = true;
+                btn_last_tap_time = now;
             }
+        } else {
+            button_report_release();
         }
     }
 
-    // Check for single tap
-    if (btn_state == BUTTON_RELEASED && !btn_is_pressed) {
-        uint32_t press_duration = (btn_release_time - btn_press_start_time) * BUTTON_CHECK_INTERVAL;
-        if (press_duration < TAP_THRESHOLD && btn_last_tap_time > 0 &&
-            (current_time - btn_press_start_time) * BUTTON_CHECK_INTERVAL > TAP_THRESHOLD) {
-            event = BUTTON_EVENT_SINGLE_TAP;
-            btn_last_tap_time = 0;
-        } else if ((current_time - btn_press_start_time) * BUTTON_CHECK_INTERVAL > TAP_THRESHOLD) {
-            event = BUTTON_EVENT_RELEASE;
+    uint32_t held = now - btn_press_start_time;
+    if (btn_is_pressed) {
+        // Long press, one time event
+        if (held >= LONG_PRESS_TIME) {
+            if (btn_last_event != BUTTON_EVENT_LONG_PRESS) {
+                LOG_INF("long press detected\n");
+                btn_last_event = BUTTON_EVENT_LONG_PRESS;
+                turnoff_all();
+            }
+            return;
         }
+        k_work_reschedule(&button_work, K_MSEC(LONG_PRESS_TIME - held));
+        return;
     }
 
-    // Check for long press
-    if (btn_is_pressed && (current_time - btn_press_start_time) * BUTTON_CHECK_INTERVAL >= LONG_PRESS_TIME) {
-        event = BUTTON_EVENT_LONG_PRESS;
+    if (!btn_release_pending) {
+        return;
     }
-
-    // Single tap
-    if (event == BUTTON_EVENT_SINGLE_TAP) {
+    // A tap stays open for a second press until TAP_THRESHOLD after it started
+    if (held <= TAP_THRESHOLD) {
+        k_work_reschedule(&button_work, K_MSEC(TAP_THRESHOLD + 1 - held));
+        return;
+    }
+    if (btn_tap_pending) {
         LOG_INF("single tap detected\n");
-        btn_last_event = event;
-
+        btn_last_event = BUTTON_EVENT_SINGLE_TAP;
+        btn_tap_pending = false;
         notify_tap();
     }
-
-    // Double tap
-    if (event == BUTTON_EVENT_DOUBLE_TAP) {
-        LOG_INF("double tap detected\n");
-        btn_last_event = event;
-        notify_double_tap();
-    }
-
-    // Long press, one time event
-    if (event == BUTTON_EVENT_LONG_PRESS && btn_last_event != BUTTON_EVENT_LONG_PRESS) {
-        LOG_INF("long press detected\n");
-        btn_last_event = event;
-        turnoff_all();
-    }
-
-    // Releases, one time event
-    if (event == BUTTON_EVENT_RELEASE && btn_last_event != BUTTON_EVENT_RELEASE) {
-        LOG_PRINTK("release detected\n");
-        btn_last_event = event;
-        notify_unpress();
-
-        // Reset
-        current_time = 0;
-        btn_press_start_time = 0;
-        btn_release_time = 0;
-        btn_last_tap_time = 0;
-    }
-    if (event == BUTTON_EVENT_RELEASE) {
-        current_button_state = GRACE;
-    }
-
-    k_work_reschedule(&button_work, K_MSEC(BUTTON_CHECK_INTERVAL));
-    return 0;
+    button_report_release();
 }
 
 static ssize_t button_data_read_characteristic(struct bt_conn *conn,
@@ -275,8 +260,8 @@ static struct gpio_callback button_cb_data;
 
 static void button_gpio_callback(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
 {
-    was_pressed = (gpio_pin_get_dt(&usr_btn) == 1);
-    LOG_INF("Button %s (GPIO callback)", was_pressed ? "pressed" : "released");
+    // Every bounce pushes the read back, the FSM only sees the settled level
+    k_work_reschedule(&button_work, K_MSEC(BUTTON_DEBOUNCE_MS));
 }
 
 int button_regist_callback()
@@ -335,7 +320,8 @@ int button_init()
 
 void activate_button_work()
 {
-    k_work_schedule(&button_work, K_MSEC(BUTTON_CHECK_INTERVAL));
+    // Picks up a button already held at boot, edges drive it from here
+    k_work_schedule(&button_work, K_NO_WAIT);
 }
 
 void register_button_service()
@@ -343,6 +329,14 @@ void register_button_service()
     bt_gatt_service_register(&button_service);
 }
 
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+void button_housing_double_tap(void)
+{
+    // Both run on the system workqueue, so this never interleaves with the button FSM
+    notify_double_tap();
+}
+#endif
+
 FSM_STATE_T get_current_button_state()
 {
     return current_button_state;
@@ -358,9 +352,8 @@ void turnoff_all()
     is_off = true;
 
 #ifdef CONFIG_OMI_ENABLE_HAPTIC
-    play_haptic_milli(100);
-    k_msleep(300);
-    haptic_off();
+    // Buzzes on its own, done long before the power off below
+    haptic_play(HAPTIC_PULSE_SHORT);
 #endif
 
     // Delays for stability
@@ -386,9 +379,8 @@ void turnoff_all()
     k_msleep(100);
 #endif
 
-    if (is_sd_on()) {
-        app_sd_off();
-    }
+    // Unmounts the card and suspends the flash
+    power_release(POWER_ACTIVITY_CAPTURE);
     k_msleep(300);
 
     // Put the buttons device to sleep if button is enabled
@@ -429,6 +421,11 @@ void turnoff_all()
     
     /* Persist an IMU timestamp base so we can estimate time across system_off. */
     lsm6dsl_time_prepare_for_system_off();
+    // Settings changed in the last moments are still only in RAM
+    app_settings_flush();
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+    warm_resume_save();
+#endif
     k_msleep(1000);
     LOG_INF("Entering system off; press usr_btn to restart");
 
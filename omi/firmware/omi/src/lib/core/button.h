@@ -14,6 +14,13 @@ FSM_STATE_T get_current_button_state();
 
 void force_button_state(FSM_STATE_T state);
 
+#ifdef CONFIG_OMI_ENABLE_IMU_GESTURES
+/**
+ * @brief Report a double tap on the housing, seen by the IMU, as a double press of the button
+ */
+void button_housing_double_tap(void);
+#endif
+
 // Input message queue from evt/button.c
 extern struct k_msgq input_button;
 
@@ -1,13 +1,50 @@
 #include "codec.h"
 
+#include <string.h>
 #include <zephyr/logging/log.h>
-#include <zephyr/sys/ring_buffer.h>
+#include <zephyr/sys/atomic.h>
+#ifdef CONFIG_OMI_ENABLE_CODEC_BENCHMARK
+#include <cmsis_core.h>
+#include <math.h>
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+#endif
 
 #include "config.h"
+#include "flight_rec.h"
+#ifdef CONFIG_OMI_ENABLE_IDLE_LISTEN
+#include "idle_listen.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_KWS
+#include "kws.h"
+#endif
+#include "mic.h"
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "monitor.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_PREPROCESS
+#include "preprocess.h"
+#endif
+#include "settings.h"
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+#ifndef CONFIG_OMI_ENABLE_SPEAKER
+#error "CONFIG_OMI_ENABLE_PLAYBACK_GATE needs the speaker, CONFIG_OMI_ENABLE_SPEAKER"
+#endif
+#include "speaker.h"
+#endif
+#include "transport.h"
+#include "tune.h"
 #include "utils.h"
+#ifdef CONFIG_OMI_ENABLE_VAD
+#include "pipe_vad.h"
+#endif
 #ifdef CODEC_OPUS
 #include "lib/opus-1.2.1/opus.h"
 #endif
+#ifdef CODEC_LC3
+#include <lc3.h>
+#endif
 
 LOG_MODULE_REGISTER(codec, CONFIG_LOG_DEFAULT_LEVEL);
 
@@ -26,16 +63,59 @@ void set_codec_callback(codec_callback callback)
 // Input
 //
 
-uint8_t codec_ring_buffer_data[AUDIO_BUFFER_SAMPLES * 2]; // 2 bytes per sample
-struct ring_buf codec_ring_buf;
-int codec_receive_pcm(int16_t *data, size_t len) // this gets called after mic data is finished
+// Mic frames are written straight into these buffers and encoded in place,
+// so PCM never has to be staged through an intermediate ring buffer.
+K_MEM_SLAB_DEFINE_STATIC(codec_frame_slab, CODEC_PACKAGE_SAMPLES * sizeof(int16_t), CODEC_FRAME_POOL_COUNT, 4);
+struct codec_frame_msg {
+    int16_t *frame;
+    uint32_t capture_ms;
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+    uint32_t uptime_ms; // capture_ms is wall clock and may be unset, the speaker keeps uptime
+#endif
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    uint32_t queued_at;
+#endif
+};
+K_MSGQ_DEFINE(codec_frame_msgq, sizeof(struct codec_frame_msg), CODEC_FRAME_POOL_COUNT, 4);
+
+int16_t *codec_alloc_frame(void)
+{
+    void *frame;
+    if (k_mem_slab_alloc(&codec_frame_slab, &frame, K_NO_WAIT) != 0) {
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_CODEC_FULL, 1);
+#endif
+        return NULL;
+    }
+    return (int16_t *) frame;
+}
+
+void codec_release_frame(int16_t *frame)
 {
+    k_mem_slab_free(&codec_frame_slab, (void *) frame);
+}
 
-    int written = ring_buf_put(&codec_ring_buf, (uint8_t *) data, len * 2);
-    if (written != len * 2) {
-        LOG_ERR("Failed to write %d bytes to codec ring buffer", len * 2);
-        return -1;
+int codec_submit_frame(int16_t *frame, uint32_t capture_ms) // this gets called after mic data is finished
+{
+    struct codec_frame_msg msg = {.frame = frame, .capture_ms = capture_ms};
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+    msg.uptime_ms = k_uptime_get_32();
+#endif
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    msg.queued_at = monitor_trace_now();
+#endif
+    int err = k_msgq_put(&codec_frame_msgq, &msg, K_NO_WAIT);
+    if (err) {
+        LOG_ERR("Failed to queue frame to codec (err %d)", err);
+        codec_release_frame(frame);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_CODEC_FULL, 1);
+#endif
+        return err;
     }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_queue_level(MONITOR_QUEUE_CODEC, k_msgq_num_used_get(&codec_frame_msgq), CODEC_FRAME_POOL_COUNT);
+#endif
 
     return 0;
 }
@@ -44,11 +124,22 @@ int codec_receive_pcm(int16_t *data, size_t len) // this gets called after mic d
 // Thread
 //
 
-int16_t codec_input_samples[CODEC_PACKAGE_SAMPLES];
 uint8_t codec_output_bytes[CODEC_OUTPUT_MAX_BYTES];
 K_THREAD_STACK_DEFINE(codec_stack, 19000);
 static struct k_thread codec_thread;
-uint16_t execute_codec();
+uint16_t execute_codec(const int16_t *input);
+
+#if CODEC_OPUS && CODEC_OFFLINE_FRAME_MS > 20
+// The offline profile encodes several mic frames per Opus packet, the live path stays at 20ms
+BUILD_ASSERT(CODEC_OFFLINE_FRAME_MS == 40 || CODEC_OFFLINE_FRAME_MS == 60, "Opus packets hold 20, 40 or 60ms");
+BUILD_ASSERT(CODEC_OFFLINE_BITRATE / 8 * CODEC_OFFLINE_FRAME_MS / 1000 <= CODEC_OUTPUT_MAX_BYTES,
+             "A long offline packet must fit codec_output_bytes");
+#define CODEC_LONG_FRAMES (CODEC_OFFLINE_FRAME_MS / 20)
+static int16_t long_pcm[CODEC_LONG_FRAMES * CODEC_PACKAGE_SAMPLES];
+static uint8_t long_fill = 0;    // mic frames in long_pcm, codec thread only
+static uint32_t long_capture_ms; // of the first of them
+static uint16_t execute_codec_samples(const int16_t *input, uint16_t samples);
+#endif
 
 #if CODEC_OPUS
 #if (CONFIG_OPUS_MODE == CONFIG_OPUS_MODE_CELT)
@@ -61,30 +152,445 @@ __ALIGN(4)
 static uint8_t m_opus_encoder[OPUS_ENCODER_SIZE];
 static OpusEncoder *const m_opus_state = (OpusEncoder *) m_opus_encoder;
 #endif
+#if CODEC_LC3
+#ifndef CONFIG_LIBLC3
+#error "CONFIG_OMI_CODEC_LC3 needs CONFIG_LIBLC3"
+#endif
+static LC3_ENCODER_MEM_T(CODEC_LC3_FRAME_US, AUDIO_SAMPLE_RATE) m_lc3_encoder_mem;
+static lc3_encoder_t m_lc3_encoder;
+static int m_lc3_frame_bytes; // per LC3 frame, set from the bitrate
+#endif
+
+//
+// Profiles
+//
+
+struct codec_profile {
+    const char *name;
+    int32_t bitrate;
+    uint8_t complexity;
+    uint8_t vbr;
+};
+
+static const struct codec_profile codec_profiles[CODEC_PROFILE_COUNT + 1] = {
+    [CODEC_PROFILE_LOW_POWER] = {"low-power", 16000, 1, 1},
+#if CODEC_OPUS
+    [CODEC_PROFILE_BALANCED] = {"balanced", CODEC_OPUS_BITRATE, CODEC_OPUS_COMPLEXITY, CODEC_OPUS_VBR},
+#else
+    [CODEC_PROFILE_BALANCED] = {"balanced", CODEC_LC3_BITRATE, 0, 0}, // LC3 only takes the bitrate
+#endif
+    [CODEC_PROFILE_HIGH_FIDELITY] = {"high-fidelity", 48000, 6, 1},
+    [CODEC_PROFILE_OFFLINE] = {"offline", CODEC_OFFLINE_BITRATE, CODEC_OFFLINE_COMPLEXITY, 1},
+};
+
+static atomic_t requested_profile = ATOMIC_INIT(CODEC_PROFILE_DEFAULT);
+static atomic_t profile_cap = ATOMIC_INIT(CODEC_PROFILE_COUNT - 1);
+static atomic_t offline_capture = ATOMIC_INIT(0);
+#ifdef CONFIG_OMI_ENABLE_KWS
+static int64_t kws_boost_until = 0; // codec thread only
+#endif
+static uint8_t active_profile = CODEC_PROFILE_DEFAULT;
+
+int codec_set_profile(uint8_t profile)
+{
+    if (profile >= CODEC_PROFILE_COUNT) {
+        return -EINVAL;
+    }
+    atomic_set(&requested_profile, profile);
+    return 0;
+}
+
+uint8_t codec_get_profile(void)
+{
+    return (uint8_t) atomic_get(&requested_profile);
+}
+
+void codec_set_profile_cap(uint8_t profile)
+{
+    atomic_set(&profile_cap, MIN(profile, CODEC_PROFILE_COUNT - 1));
+}
+
+void codec_set_offline(bool offline)
+{
+    atomic_set(&offline_capture, offline);
+}
+
+bool codec_is_offline(void)
+{
+    return atomic_get(&offline_capture);
+}
+
+//
+// Adaptive bitrate
+//
+
+// Level 0 runs at the profile bitrate; every level is capped by the profile as well
+static const int32_t codec_abr_ladder[] = {INT32_MAX, 24000, 16000};
+static uint8_t abr_level = 0;
+static uint8_t abr_healthy_windows = 0;
+static uint16_t abr_window_frames = 0;
+static uint32_t abr_last_notify_failures = 0;
+static uint32_t abr_last_queue_drops = 0;
+TUNABLE uint32_t abr_window = CODEC_ABR_WINDOW_FRAMES;
+TUNABLE uint32_t abr_high_watermark = CODEC_ABR_HIGH_WATERMARK;
+TUNABLE uint32_t abr_low_watermark = CODEC_ABR_LOW_WATERMARK;
+TUNABLE uint32_t abr_recover_windows = CODEC_ABR_RECOVER_WINDOWS;
+#if CODEC_OPUS
+static uint32_t fec_last_frames_sent = 0;
+static uint32_t fec_last_frames_lost = 0;
+static uint16_t fec_loss_q8 = 0; // smoothed loss percentage, Q8
+static bool fec_enabled = false;
+#endif
+
+static int32_t codec_abr_bitrate(void)
+{
+    return MIN(codec_profiles[active_profile].bitrate, codec_abr_ladder[abr_level]);
+}
+
+// Only called from the codec thread (or before it starts), never concurrently with the encoder
+static int codec_set_bitrate(int32_t bitrate)
+{
+#if CODEC_OPUS
+    return opus_encoder_ctl(m_opus_state, OPUS_SET_BITRATE(bitrate)) == OPUS_OK ? 0 : -EINVAL;
+#else
+    int bytes = lc3_frame_bytes(CODEC_LC3_FRAME_US, bitrate);
+    if (bytes <= 0 || bytes * (CODEC_PACKAGE_SAMPLES / CODEC_LC3_FRAME_SAMPLES) > CODEC_OUTPUT_MAX_BYTES) {
+        return -EINVAL;
+    }
+    m_lc3_frame_bytes = bytes;
+    return 0;
+#endif
+}
+
+#if CODEC_OPUS
+
+// Tell the encoder how lossy the link is, so it can trade bits for robustness
+static void codec_fec_update(const struct transport_tx_stats *stats)
+{
+    uint32_t sent = stats->frames_sent - fec_last_frames_sent;
+    uint32_t lost = stats->frames_lost - fec_last_frames_lost;
+    fec_last_frames_sent = stats->frames_sent;
+    fec_last_frames_lost = stats->frames_lost;
+    if (sent + lost == 0) {
+        return;
+    }
+
+    // Smooth over a few windows so a single burst does not flap the settings. Kept in Q8 and always
+    // stepped at least one unit towards the window, so a steady loss is tracked exactly instead of
+    // settling up to a percent below it
+    int32_t window_q8 = (int32_t) MIN(lost * (100 << 8) / (sent + lost), CODEC_FEC_MAX_LOSS_PERC << 8);
+    int32_t diff = window_q8 - fec_loss_q8;
+    uint8_t last_perc = (uint8_t) ((fec_loss_q8 + 128) >> 8);
+    fec_loss_q8 = (uint16_t) (fec_loss_q8 + (diff + (diff > 0 ? 3 : diff < 0 ? -3 : 0)) / 4);
+    uint8_t loss_perc = (uint8_t) ((fec_loss_q8 + 128) >> 8);
+    if (loss_perc != last_perc) {
+        if (opus_encoder_ctl(m_opus_state, OPUS_SET_PACKET_LOSS_PERC(loss_perc)) != OPUS_OK) {
+            LOG_ERR("Failed to set expected packet loss %u%%", loss_perc);
+        }
+    }
+
+    bool enable = fec_enabled ? fec_loss_q8 > (CODEC_FEC_DISABLE_LOSS_PERC << 8)
+                              : fec_loss_q8 >= (CODEC_FEC_ENABLE_LOSS_PERC << 8);
+    if (enable != fec_enabled) {
+        if (opus_encoder_ctl(m_opus_state, OPUS_SET_INBAND_FEC(enable)) != OPUS_OK) {
+            LOG_ERR("Failed to %s in-band FEC", enable ? "enable" : "disable");
+            return;
+        }
+        fec_enabled = enable;
+        LOG_INF("In-band FEC %s (observed loss %u%%)", enable ? "on" : "off", loss_perc);
+    }
+}
+#endif
+
+// Step the bitrate down while the link is under pressure, back up once it has been healthy for a while
+static void codec_abr_update(void)
+{
+    if (++abr_window_frames < abr_window) {
+        return;
+    }
+    abr_window_frames = 0;
+
+    struct transport_tx_stats stats;
+    transport_get_tx_stats(&stats);
+    bool failing = stats.notify_failures != abr_last_notify_failures || stats.queue_drops != abr_last_queue_drops;
+    abr_last_notify_failures = stats.notify_failures;
+    abr_last_queue_drops = stats.queue_drops;
+
+#if CODEC_OPUS
+    codec_fec_update(&stats);
+#endif
+
+    uint8_t level = abr_level;
+    if (failing || stats.queue_usage >= abr_high_watermark) {
+        abr_healthy_windows = 0;
+        if (level < ARRAY_SIZE(codec_abr_ladder) - 1) {
+            level++;
+        }
+    } else if (stats.queue_usage <= abr_low_watermark) {
+        if (level > 0 && ++abr_healthy_windows >= abr_recover_windows) {
+            abr_healthy_windows = 0;
+            level--;
+        }
+    } else {
+        abr_healthy_windows = 0;
+    }
+
+    if (level == abr_level) {
+        return;
+    }
+    abr_level = level;
+    if (codec_set_bitrate(codec_abr_bitrate())) {
+        LOG_ERR("Failed to set bitrate %d", codec_abr_bitrate());
+        return;
+    }
+    LOG_INF("Adaptive bitrate %d bps (level %u, tx queue %u%%)", codec_abr_bitrate(), abr_level, stats.queue_usage);
+}
+
+// Only called from the codec thread (or before it starts), never concurrently with the encoder
+static int codec_apply_profile(uint8_t profile)
+{
+    const struct codec_profile *p = &codec_profiles[profile];
+
+    active_profile = profile;
+    ASSERT_OK(codec_set_bitrate(codec_abr_bitrate()));
+    bool boosted = false;
+#ifdef CONFIG_OMI_ENABLE_KWS
+    // A wake phrase boost is too short to be worth the block a PDM restart loses
+    boosted = kws_boost_until != 0;
+#endif
+    if (!boosted) {
+        mic_set_pdm_profile(profile);
+    }
+#if CODEC_OPUS
+    ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_VBR(p->vbr)) == OPUS_OK);
+    ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_COMPLEXITY(p->complexity)) == OPUS_OK);
+
+    LOG_INF("Codec profile %s: %d bps, complexity %u, vbr %u", p->name, codec_abr_bitrate(), p->complexity, p->vbr);
+#else
+    LOG_INF("Codec profile %s: %d bps, %d bytes per LC3 frame", p->name, codec_abr_bitrate(), m_lc3_frame_bytes);
+#endif
+    return 0;
+}
+
+//
+// Voice activity detection
+//
+
+#ifdef CONFIG_OMI_ENABLE_VAD
+static const struct pipe_vad_config vad_config = {
+    .samples = CODEC_PACKAGE_SAMPLES,
+    .min_level = CODEC_VAD_MIN_LEVEL,
+    .noise_margin = CODEC_VAD_NOISE_MARGIN,
+    .hangover_frames = CODEC_VAD_HANGOVER_FRAMES,
+    .keepalive_frames = CODEC_VAD_KEEPALIVE_FRAMES,
+};
+static struct pipe_vad vad;
+
+// Returns true if the frame should be encoded and sent
+static bool vad_gate(const int16_t *frame)
+{
+    bool voiced;
+    bool send = pipe_vad_gate(&vad, frame, &voiced);
+#ifdef CONFIG_OMI_ENABLE_IDLE_LISTEN
+    if (voiced) {
+        idle_listen_voice();
+    }
+#endif
+    return send;
+}
+#endif
+
+//
+// Playback gating
+//
+
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+TUNABLE uint32_t playback_tail_ms = CODEC_PLAYBACK_TAIL_MS;
+static uint16_t playback_skipped; // codec thread only, frames of the current playback
+
+// Returns true if the frame should be processed, false while the mic hears our own speaker
+static bool playback_gate(uint32_t uptime_ms)
+{
+    if (speaker_was_playing(uptime_ms, playback_tail_ms)) {
+        if (playback_skipped == 0) {
+            FLIGHT_REC(FLIGHT_REC_PLAYBACK_GATE, 1, 0);
+        }
+        if (playback_skipped < UINT16_MAX) {
+            playback_skipped++;
+        }
+        return false;
+    }
+    if (playback_skipped) {
+        LOG_DBG("Skipped %u frames of speaker playback", playback_skipped);
+        FLIGHT_REC(FLIGHT_REC_PLAYBACK_GATE, 0, playback_skipped);
+        playback_skipped = 0;
+    }
+    return true;
+}
+#endif
+
+// Hands an encoded frame on, in codec_output_bytes
+static void codec_emit(uint16_t output_size, uint32_t capture_ms)
+{
+    FLIGHT_REC(FLIGHT_REC_CODEC_FRAME, active_profile, output_size);
+
+    codec_abr_update();
+
+    // Notify
+    if (_callback) {
+        _callback(codec_output_bytes, output_size, capture_ms);
+    }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_progress(MONITOR_WORKER_CODEC, MONITOR_STEP_ENCODED);
+#endif
+}
+
+#ifdef CODEC_LONG_FRAMES
+// A gap in the audio ends the long frame early, a packet only ever holds contiguous audio
+static void long_frame_flush(void)
+{
+    if (long_fill == 0) {
+        return;
+    }
+    uint16_t output_size = execute_codec_samples(long_pcm, long_fill * CODEC_PACKAGE_SAMPLES);
+    long_fill = 0;
+    codec_emit(output_size, long_capture_ms);
+}
+#endif
+
+// Gives back a frame that is not encoded
+static void codec_skip_frame(int16_t *frame)
+{
+    codec_release_frame(frame);
+#ifdef CODEC_LONG_FRAMES
+    long_frame_flush();
+#endif
+}
 
 void codec_entry()
 {
 
     uint16_t output_size;
+    struct codec_frame_msg msg;
+    int16_t *frame;
     while (1) {
 
-        // Check if we have enough data
-        if (ring_buf_size_get(&codec_ring_buf) < CODEC_PACKAGE_SAMPLES * 2) {
-            // LOG_PRINTK("waiting on data....\n");
-            k_sleep(K_MSEC(10));
+        // Sleep until the mic hands over a full frame
+        k_msgq_get(&codec_frame_msgq, &msg, K_FOREVER);
+        frame = msg.frame;
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        monitor_trace_stage(MONITOR_STAGE_CODEC_WAIT, msg.queued_at);
+#endif
+
+        // Pick up a profile change between frames
+        uint8_t profile =
+            atomic_get(&offline_capture) ? CODEC_PROFILE_OFFLINE : (uint8_t) atomic_get(&requested_profile);
+#ifdef CONFIG_OMI_ENABLE_KWS
+        // The wake phrase boosts whatever is capturing, offline too, for KWS_BOOST_MS
+        if (kws_boost_until && k_uptime_get() < kws_boost_until) {
+            profile = CODEC_PROFILE_HIGH_FIDELITY;
+        } else {
+            kws_boost_until = 0;
+        }
+#endif
+        // The governor's cap holds for live audio, a recording keeps what it is stored with
+        if (!atomic_get(&offline_capture)) {
+            profile = MIN(profile, (uint8_t) atomic_get(&profile_cap));
+        }
+#ifdef CODEC_LONG_FRAMES
+        if (profile != active_profile) {
+            // The offline audio held back goes nowhere once live, the first live packet is 20ms again
+            long_fill = 0;
+        }
+#endif
+        if (profile != active_profile && codec_apply_profile(profile)) {
+            LOG_ERR("Failed to apply codec profile %u", profile);
+            atomic_set(&requested_profile, active_profile);
+        }
+
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+        // The device's own playback, before the noise and speech estimates below learn from it
+        if (!playback_gate(msg.uptime_ms)) {
+            codec_skip_frame(frame);
             continue;
         }
-        // Read package
-        ring_buf_get(&codec_ring_buf, (uint8_t *) codec_input_samples, CODEC_PACKAGE_SAMPLES * 2);
+#endif
 
-        // Run Codec
-        output_size = execute_codec();
+#ifdef CONFIG_OMI_ENABLE_PREPROCESS
+        // Clean the frame up first so the VAD and the encoder both see the suppressed signal
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        uint32_t preprocess_start = monitor_trace_now();
+#endif
+        preprocess_frame(frame);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        monitor_trace_stage(MONITOR_STAGE_PREPROCESS, preprocess_start);
+#endif
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+        // Before the VAD, which may drop the frame, and on the cleaned up signal
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        uint32_t kws_start = monitor_trace_now();
+#endif
+        bool keyword = kws_frame(frame);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        monitor_trace_stage(MONITOR_STAGE_KWS, kws_start);
+#endif
+        if (keyword) {
+            LOG_INF("Wake phrase, high fidelity for %d ms", KWS_BOOST_MS);
+            FLIGHT_REC(FLIGHT_REC_KEYWORD, active_profile, 0);
+            kws_boost_until = k_uptime_get() + KWS_BOOST_MS;
+        }
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_VAD
+        // Drop silent frames before spending any encode cycles or airtime on them
+        if (!vad_gate(frame)) {
+            codec_skip_frame(frame);
+            continue;
+        }
+#endif
 
-        // Notify
-        if (_callback) {
-            _callback(codec_output_bytes, output_size);
+        // Encoding is the costliest step, skip it for a frame nothing would send, store or hold
+        if (!transport_audio_wanted()) {
+            codec_skip_frame(frame);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+            monitor_inc_encode_skips();
+#endif
+            continue;
         }
 
+#ifdef CODEC_LONG_FRAMES
+        if (active_profile == CODEC_PROFILE_OFFLINE) {
+            // Collect the mic frames of one long packet, encoded once the last one is in
+            if (long_fill == 0) {
+                long_capture_ms = msg.capture_ms;
+            }
+            memcpy(&long_pcm[long_fill * CODEC_PACKAGE_SAMPLES], frame, CODEC_PACKAGE_SAMPLES * sizeof(int16_t));
+            long_fill++;
+            codec_release_frame(frame);
+            if (long_fill < CODEC_LONG_FRAMES) {
+                continue;
+            }
+            output_size = execute_codec_samples(long_pcm, CODEC_LONG_FRAMES * CODEC_PACKAGE_SAMPLES);
+            long_fill = 0;
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+            monitor_deadline_check(MONITOR_DEADLINE_ENCODE, msg.queued_at);
+#endif
+            codec_emit(output_size, long_capture_ms);
+            k_yield();
+            continue;
+        }
+#endif
+
+        // Run Codec in place, then give the frame back to the pool right away
+        output_size = execute_codec(frame);
+        codec_release_frame(frame);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        monitor_deadline_check(MONITOR_DEADLINE_ENCODE, msg.queued_at);
+#endif
+        codec_emit(output_size, msg.capture_ms);
+
         // Yield
         k_yield();
     }
@@ -96,11 +602,8 @@ int codec_start()
 // OPUS
 #if CODEC_OPUS
     ASSERT_TRUE(opus_encoder_get_size(1) == sizeof(m_opus_encoder));
-    ASSERT_TRUE(opus_encoder_init(m_opus_state, 16000, 1, CODEC_OPUS_APPLICATION) == OPUS_OK);
-    ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_BITRATE(CODEC_OPUS_BITRATE)) == OPUS_OK);
-    ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_VBR(CODEC_OPUS_VBR)) == OPUS_OK);
+    ASSERT_TRUE(opus_encoder_init(m_opus_state, AUDIO_SAMPLE_RATE, 1, CODEC_OPUS_APPLICATION) == OPUS_OK);
     ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_VBR_CONSTRAINT(0)) == OPUS_OK);
-    ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_COMPLEXITY(CODEC_OPUS_COMPLEXITY)) == OPUS_OK);
     ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE)) == OPUS_OK);
     ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_LSB_DEPTH(16)) == OPUS_OK);
     ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_DTX(0)) == OPUS_OK);
@@ -108,8 +611,51 @@ int codec_start()
     ASSERT_TRUE(opus_encoder_ctl(m_opus_state, OPUS_SET_PACKET_LOSS_PERC(0)) == OPUS_OK);
 #endif
 
+// LC3
+#if CODEC_LC3
+    m_lc3_encoder = lc3_setup_encoder(CODEC_LC3_FRAME_US, AUDIO_SAMPLE_RATE, 0, &m_lc3_encoder_mem);
+    if (!m_lc3_encoder) {
+        LOG_ERR("LC3 encoder setup failed");
+        return -EINVAL;
+    }
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_PREPROCESS
+    int err = preprocess_init();
+    if (err) {
+        return err;
+    }
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+    // Without a wake phrase the rest of the audio path works as before
+    if (kws_init()) {
+        LOG_WRN("Keyword spotter unavailable");
+    }
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_VAD
+    pipe_vad_init(&vad, &vad_config);
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_TUNING
+    tune_register("abr_window", &abr_window, 1, 500, "frames per link pressure check");
+    tune_register("abr_high_pct", &abr_high_watermark, 1, 100, "tx queue fill that steps the bitrate down");
+    tune_register("abr_low_pct", &abr_low_watermark, 0, 99, "tx queue fill counted as healthy");
+    tune_register("abr_recover", &abr_recover_windows, 1, 100, "healthy checks before stepping back up");
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+    tune_register("playback_tail_ms", &playback_tail_ms, 0, 2000, "frames skipped this long after speaker playback");
+#endif
+#endif
+
+    // Apply the saved profile (bitrate, VBR, complexity)
+    if (codec_set_profile(app_settings_get_codec_profile())) {
+        LOG_WRN("Saved codec profile invalid, using default");
+        codec_set_profile(CODEC_PROFILE_DEFAULT);
+    }
+    ASSERT_OK(codec_apply_profile(codec_get_profile()));
+
     // Thread
-    ring_buf_init(&codec_ring_buf, sizeof(codec_ring_buffer_data), codec_ring_buffer_data);
     k_thread_create(&codec_thread,
                     codec_stack,
                     K_THREAD_STACK_SIZEOF(codec_stack),
@@ -117,9 +663,10 @@ int codec_start()
                     NULL,
                     NULL,
                     NULL,
-                    K_PRIO_PREEMPT(7),
+                    K_PRIO_PREEMPT(THREAD_PRIO_CODEC),
                     0,
                     K_NO_WAIT);
+    k_thread_name_set(&codec_thread, "codec");
 
     // Success
     return 0;
@@ -131,10 +678,15 @@ int codec_start()
 
 #if CODEC_OPUS
 
-uint16_t execute_codec()
+static uint16_t execute_codec_samples(const int16_t *input, uint16_t samples)
 {
-    opus_int32 size = opus_encode(
-        m_opus_state, codec_input_samples, CODEC_PACKAGE_SAMPLES, codec_output_bytes, sizeof(codec_output_bytes));
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    uint32_t encode_start = monitor_trace_now();
+#endif
+    opus_int32 size = opus_encode(m_opus_state, input, samples, codec_output_bytes, sizeof(codec_output_bytes));
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    monitor_trace_stage(MONITOR_STAGE_ENCODE, encode_start);
+#endif
     if (size < 0) {
         LOG_WRN("Opus encoding failed: %d", size);
         return 0;
@@ -143,4 +695,178 @@ uint16_t execute_codec()
     return size;
 }
 
+uint16_t execute_codec(const int16_t *input)
+{
+    return execute_codec_samples(input, CODEC_PACKAGE_SAMPLES);
+}
+
+#ifdef CONFIG_OMI_ENABLE_CODEC_BENCHMARK
+//
+// Encode benchmark
+//
+
+// Runs on its own thread and encoder, so live capture carries on (and competes for the CPU,
+// min is the cleanest figure). Every combination encodes the same synthetic speech-like corpus.
+#define CODEC_BENCH_FRAMES 50 // 1 s of audio at 20 ms
+#define CODEC_BENCH_MAX_FRAME_SAMPLES CODEC_PACKAGE_SAMPLES
+#define CODEC_BENCH_TWO_PI 6.2831853f
+
+static const uint8_t codec_bench_complexities[] = {0, 1, 3, 5, 8, 10};
+static const int32_t codec_bench_bitrates[] = {16000, 24000, 32000, 48000};
+static const uint16_t codec_bench_frame_samples[] = {AUDIO_SAMPLE_RATE / 100, AUDIO_SAMPLE_RATE / 50}; // 10, 20ms
+
+static uint8_t bench_opus_encoder[OPUS_ENCODER_SIZE];
+static OpusEncoder *const bench_opus_state = (OpusEncoder *) bench_opus_encoder;
+static int16_t bench_pcm[CODEC_BENCH_MAX_FRAME_SAMPLES];
+static uint8_t bench_output[CODEC_OUTPUT_MAX_BYTES * 2];
+K_THREAD_STACK_DEFINE(codec_bench_stack, 19000);
+static struct k_thread codec_bench_thread;
+static atomic_t codec_bench_running = ATOMIC_INIT(0);
+
+// Voiced harmonics with a gliding pitch and a syllable envelope, plus a little noise
+static void codec_bench_fill(uint32_t first_sample, uint16_t samples)
+{
+    static uint32_t noise = 0x12345678;
+    for (uint16_t i = 0; i < samples; i++) {
+        float t = (float) (first_sample + i) / AUDIO_SAMPLE_RATE;
+        float f0 = 140.0f + 40.0f * sinf(CODEC_BENCH_TWO_PI * 0.7f * t);
+        float envelope = 0.5f + 0.5f * sinf(CODEC_BENCH_TWO_PI * 4.0f * t);
+        float voiced = 0;
+        for (int h = 1; h <= 6; h++) {
+            voiced += sinf(CODEC_BENCH_TWO_PI * f0 * h * t) / h;
+        }
+        noise = noise * 1664525u + 1013904223u;
+        float sample = 6000.0f * envelope * voiced + (float) ((int32_t) noise >> 20);
+        bench_pcm[i] = (int16_t) CLAMP(sample, INT16_MIN, INT16_MAX);
+    }
+}
+
+static int codec_bench_setup(uint8_t complexity, int32_t bitrate)
+{
+    if (opus_encoder_init(bench_opus_state, AUDIO_SAMPLE_RATE, 1, CODEC_OPUS_APPLICATION) != OPUS_OK ||
+        opus_encoder_ctl(bench_opus_state, OPUS_SET_VBR_CONSTRAINT(0)) != OPUS_OK ||
+        opus_encoder_ctl(bench_opus_state, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE)) != OPUS_OK ||
+        opus_encoder_ctl(bench_opus_state, OPUS_SET_LSB_DEPTH(16)) != OPUS_OK ||
+        opus_encoder_ctl(bench_opus_state, OPUS_SET_VBR(CODEC_OPUS_VBR)) != OPUS_OK ||
+        opus_encoder_ctl(bench_opus_state, OPUS_SET_BITRATE(bitrate)) != OPUS_OK ||
+        opus_encoder_ctl(bench_opus_state, OPUS_SET_COMPLEXITY(complexity)) != OPUS_OK) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void codec_bench_entry(void *p1, void *p2, void *p3)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    LOG_INF("Codec benchmark: %u frames per run, %u MHz, %s kernels, hot code in %s", CODEC_BENCH_FRAMES,
+            SystemCoreClock / 1000000, IS_ENABLED(CONFIG_OMI_OPUS_GENERIC_KERNELS) ? "generic C" : "EDSP",
+            IS_ENABLED(CONFIG_OMI_ENABLE_RAM_CODE) ? "RAM" : "flash");
+    for (size_t f = 0; f < ARRAY_SIZE(codec_bench_frame_samples); f++) {
+        for (size_t b = 0; b < ARRAY_SIZE(codec_bench_bitrates); b++) {
+            for (size_t c = 0; c < ARRAY_SIZE(codec_bench_complexities); c++) {
+                uint16_t samples = codec_bench_frame_samples[f];
+                if (codec_bench_setup(codec_bench_complexities[c], codec_bench_bitrates[b])) {
+                    LOG_ERR("Codec benchmark: encoder setup failed");
+                    continue;
+                }
+
+                uint32_t min = UINT32_MAX, max = 0, bytes = 0;
+                uint64_t total = 0;
+                for (uint32_t n = 0; n < CODEC_BENCH_FRAMES; n++) {
+                    codec_bench_fill(n * samples, samples);
+                    uint32_t start = DWT->CYCCNT;
+                    opus_int32 size = opus_encode(bench_opus_state, bench_pcm, samples, bench_output,
+                                                  sizeof(bench_output));
+                    uint32_t cycles = DWT->CYCCNT - start;
+                    if (size < 0) {
+                        LOG_ERR("Codec benchmark: encode failed: %d", size);
+                        break;
+                    }
+                    bytes += size;
+                    total += cycles;
+                    min = MIN(min, cycles);
+                    max = MAX(max, cycles);
+                }
+                LOG_INF("%2u ms %5d bps cx %2u: cycles/frame min %u mean %u max %u, %u bytes/frame",
+                        samples / 16, codec_bench_bitrates[b], codec_bench_complexities[c], min,
+                        (uint32_t) (total / CODEC_BENCH_FRAMES), max, bytes / CODEC_BENCH_FRAMES);
+            }
+        }
+    }
+
+#if defined(CONFIG_INIT_STACKS) && defined(CONFIG_THREAD_STACK_INFO)
+    size_t unused;
+    if (k_thread_stack_space_get(k_current_get(), &unused) == 0) {
+        LOG_INF("Codec benchmark: peak stack %u of %u bytes",
+                (unsigned) (K_THREAD_STACK_SIZEOF(codec_bench_stack) - unused),
+                (unsigned) K_THREAD_STACK_SIZEOF(codec_bench_stack));
+    }
+#endif
+    LOG_INF("Codec benchmark done");
+    atomic_set(&codec_bench_running, 0);
+}
+
+int codec_benchmark_start(void)
+{
+    if (!atomic_cas(&codec_bench_running, 0, 1)) {
+        return -EBUSY;
+    }
+    // A fresh thread refills its stack pattern, so the peak covers this run only
+    k_thread_create(&codec_bench_thread, codec_bench_stack, K_THREAD_STACK_SIZEOF(codec_bench_stack),
+                    codec_bench_entry, NULL, NULL, NULL, K_PRIO_PREEMPT(8), 0, K_NO_WAIT);
+    k_thread_name_set(&codec_bench_thread, "codec_bench");
+    return 0;
+}
+
+#ifdef CONFIG_SHELL
+static int cmd_codec_bench(const struct shell *sh, size_t argc, char **argv)
+{
+    int err = codec_benchmark_start();
+    if (err) {
+        shell_error(sh, "Benchmark already running");
+        return err;
+    }
+    shell_print(sh, "Benchmark started, results go to the log");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(codec_cmds,
+                               SHELL_CMD(bench, NULL, "Encode cycle-count benchmark", cmd_codec_bench),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(codec, &codec_cmds, "Audio codec", NULL);
+#endif
+#endif
+
+#endif
+
+//
+// LC3 codec
+//
+
+#if CODEC_LC3
+
+uint16_t execute_codec(const int16_t *input)
+{
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    uint32_t encode_start = monitor_trace_now();
+#endif
+    // Frames of one packet share the bitrate, so the receiver can split the packet evenly
+    uint16_t size = 0;
+    for (size_t pos = 0; pos < CODEC_PACKAGE_SAMPLES; pos += CODEC_LC3_FRAME_SAMPLES) {
+        if (lc3_encode(m_lc3_encoder, LC3_PCM_FORMAT_S16, input + pos, 1, m_lc3_frame_bytes,
+                       codec_output_bytes + size)) {
+            LOG_WRN("LC3 encoding failed");
+            return 0;
+        }
+        size += m_lc3_frame_bytes;
+    }
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    monitor_trace_stage(MONITOR_STAGE_ENCODE, encode_start);
+#endif
+    LOG_DBG("LC3 encoding success: %u", size);
+    return size;
+}
+
 #endif
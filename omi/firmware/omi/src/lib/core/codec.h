@@ -3,12 +3,93 @@
 #include <zephyr/kernel.h>
 
 // Callback
-typedef void (*codec_callback)(uint8_t *data, size_t len);
+// capture_ms is passed through from codec_submit_frame()
+typedef void (*codec_callback)(uint8_t *data, size_t len, uint32_t capture_ms);
 void set_codec_callback(codec_callback callback);
 
 // Integration
 
-int codec_receive_pcm(int16_t *data, size_t len);
+/**
+ * @brief Take an empty frame from the codec input pool
+ *
+ * The frame holds CODEC_PACKAGE_SAMPLES mono samples. The caller fills it and
+ * passes it to codec_submit_frame(), or returns it with codec_release_frame().
+ *
+ * @return Pointer to the frame, or NULL if the pool is exhausted
+ */
+int16_t *codec_alloc_frame(void);
+
+/**
+ * @brief Queue a filled frame for encoding
+ *
+ * Ownership of the frame passes to the codec, which returns it to the pool
+ * after encoding (or immediately, if the queue is full).
+ *
+ * @param frame Frame from codec_alloc_frame()
+ * @param capture_ms Capture timestamp handed on to the codec callback with the encoded frame
+ * @return 0 if successful, negative errno code if error
+ */
+int codec_submit_frame(int16_t *frame, uint32_t capture_ms);
+
+/**
+ * @brief Return an unused frame to the codec input pool
+ */
+void codec_release_frame(int16_t *frame);
+
+/**
+ * @brief Select the active codec profile
+ *
+ * The encoder is reconfigured by the codec thread before the next frame,
+ * so this is safe to call from any context (e.g. a GATT write handler).
+ *
+ * @param profile One of the CODEC_PROFILE_* identifiers
+ * @return 0 if successful, -EINVAL if the profile is unknown
+ */
+int codec_set_profile(uint8_t profile);
+
+/**
+ * @brief Get the codec profile currently in effect
+ *
+ * @return One of the CODEC_PROFILE_* identifiers
+ */
+uint8_t codec_get_profile(void);
+
+/**
+ * @brief Cap the live profile, for the performance governor
+ *
+ * Frames are encoded with the lower of the selected profile and the cap, wake phrase boosts
+ * included; codec_get_profile() still reports the selection. Offline recording is not capped.
+ *
+ * @param profile Highest CODEC_PROFILE_* allowed, CODEC_PROFILE_COUNT - 1 lifts the cap
+ */
+void codec_set_profile_cap(uint8_t profile);
+
+/**
+ * @brief Switch between the live profile and the offline recording profile
+ *
+ * While offline, frames are encoded with CODEC_PROFILE_OFFLINE for storage instead of the
+ * profile from codec_set_profile(), which is restored once offline capture ends.
+ *
+ * @param offline true while frames go to offline storage
+ */
+void codec_set_offline(bool offline);
+
+/**
+ * @brief Check whether frames currently go to offline storage
+ */
+bool codec_is_offline(void);
+
+#ifdef CONFIG_OMI_ENABLE_CODEC_BENCHMARK
+/**
+ * @brief Run the encode benchmark on its own thread
+ *
+ * Encodes a fixed corpus for every complexity, bitrate and frame size combination and logs
+ * the DWT cycles per frame (min/mean/max), plus the peak stack with CONFIG_INIT_STACKS.
+ *
+ * @return 0 if started, -EBUSY if a run is in progress
+ */
+int codec_benchmark_start(void);
+#endif
 
 /**
  * @brief Initialize the Codec
@@ -1,12 +1,121 @@
 #include <haly/nrfy_gpio.h>
 
-// #define SAMPLE_RATE 16000
+#ifdef CONFIG_OMI_NARROWBAND
+#define AUDIO_SAMPLE_RATE 8000     // narrowband for multi-day offline capture, decimated from 16kHz PDM
+#else
+#define AUDIO_SAMPLE_RATE 16000
+#endif
 #define MIC_GAIN 64
 #define MIC_IRC_PRIORITY 7
-#define MIC_BUFFER_SAMPLES 1600    // 100ms
-#define AUDIO_BUFFER_SAMPLES 16000 // 1s
+#define MIC_BLOCK_MS 20            // PDM block, whole codec frames: 20 leaves no frame waiting, 100 wakes 5x less
+#define MIC_SLAB_MS 200            // PDM audio the slab holds while the mic thread is held up
+#define MIC_DC_BLOCK_POLE_Q15 32563 // DC blocker in the downmix (CONFIG_OMI_MIC_DC_BLOCK), ~16Hz corner
+#define MIC_BEAMFORM_SPACING_UM 10000 // distance between the mics (CONFIG_OMI_MIC_BEAMFORM), at most ~21mm
+#define MIC_BEAMFORM_FRONT 0          // PDM channel nearer the mouth: 0 left, 1 right
+// PDM decimation ratio per codec profile, the clock is the 16kHz PCM rate times it. The mics' bias current and the
+// PDM peripheral scale with the clock, so 64 is the lowest drain; 80 (nRF5340 only) oversamples more for a lower
+// in-band noise floor. 0 leaves the clock to the driver, anywhere from 512kHz to 3.5MHz.
+#define MIC_PDM_RATIO_LOW_POWER 64
+#define MIC_PDM_RATIO_BALANCED 64
+#ifdef CONFIG_OMI_NARROWBAND
+#define MIC_PDM_RATIO_HIGH_FIDELITY 64 // a 4kHz band is oversampled plenty at 64
+#else
+#define MIC_PDM_RATIO_HIGH_FIDELITY 80
+#endif
+#define MIC_PDM_RATIO_OFFLINE 64
+#define MIC_PDM_CLK_TOLERANCE_PERCENT 4 // clock window around the target, the PDM prescaler can't hit every rate
+#ifdef CONFIG_OMI_MIC_MONO
+#define MIC_CHANNELS 1             // Single populated mic, no downmix
+#define NETWORK_RING_BUF_SIZE 128  // spend the halved PDM slab on deeper transport buffering
+#else
+#define MIC_CHANNELS 2
 #define NETWORK_RING_BUF_SIZE 32   // number of frames * CODEC_OUTPUT_MAX_BYTES
+#endif
+// Thread priorities by pipeline stage, lower runs first. The live path outranks all bulk work, so an
+// offline sync, a card flush or a DFU only ever gets the CPU the live path leaves.
+#define THREAD_PRIO_MIC 5       // PDM blocks, hands frames to the codec
+#define THREAD_PRIO_SPEAKER 5   // playback, the I2S queue must never run dry
+#define THREAD_PRIO_CODEC 6     // must encode a frame within DEADLINE_ENCODE_MS
+#define THREAD_PRIO_PUSHER 7    // must take an encoded frame within DEADLINE_PUSH_MS
+#define THREAD_PRIO_SD_WORKER 8 // card I/O, behind its own queue
+#define THREAD_PRIO_STORAGE 9   // offline sync
+#define THREAD_PRIO_WIFI 9      // Wi-Fi bring-up and hub session upkeep, recording goes on under a sync
+#define THREAD_PRIO_DFU 10      // delta firmware updates
+#define THREAD_PRIO_HOUSEKEEPING 11 // battery, LED patterns, settings and trace flushes, metrics sampling
+#define HOUSEKEEPING_STACK_SIZE 2048
+#define DEADLINE_ENCODE_MS 20   // mic hands a frame over -> encoded, one frame period
+#define DEADLINE_PUSH_MS 60     // encoded frame queued -> the pusher takes it, two streaming intervals
 #define MINIMAL_PACKET_SIZE 100    // Less than that doesn't make sence to send anything at all
+#define AUDIO_PACK_MAX_FRAMES 3     // frames coalesced per notification (CONFIG_OMI_ENABLE_AUDIO_PACKING)
+#define AUDIO_PACK_MAX_LATENCY_MS 100 // a partial pack is sent after this long
+#define CONN_EVENT_PREPARE_US 2000    // pusher woken ahead of each connection event (CONFIG_OMI_ENABLE_CONN_EVENT_SYNC)
+#define CONN_EVENT_SYNC_STALE_MS 100  // without a prepare for this long, every queued frame wakes the pusher again
+#define AUDIO_STREAM_INTERVAL_MS 30 // longest connection interval of the streaming link policy
+#define AUDIO_STREAM_MAX_BYTES_PER_S (CODEC_OUTPUT_MAX_BYTES * AUDIO_SAMPLE_RATE / CODEC_PACKAGE_SAMPLES)
+// Audio notifications in flight: an interval of the top bitrate in the smallest packets, rounded up, plus one
+// being refilled as the event ends. Audio, storage and control credits together stay <= CONFIG_BT_CONN_TX_MAX.
+#define AUDIO_NOTIFY_CREDITS (AUDIO_STREAM_MAX_BYTES_PER_S * AUDIO_STREAM_INTERVAL_MS / 1000 / MINIMAL_PACKET_SIZE + 2)
+#define CONTROL_NOTIFY_CREDITS 2    // battery, button, IMU, metrics and status notifications in flight
+#define AUDIO_NOTIFY_TIMEOUT_MS 200 // give up on a packet if nothing completes for this long
+#define AUDIO_NOTIFY_RETRIES 3      // notify attempts per packet before it is dropped
+#define AUDIO_ISO_BUFS 2            // SDUs in flight on the audio CIS (CONFIG_OMI_ENABLE_ISO_AUDIO)
+#define WIFI_LIVE_SEND_TIMEOUT_MS 40 // a live frame the Wi-Fi link can't take in this long goes over BLE
+#define PREROLL_MS 3000             // audio held while no sink takes it (CONFIG_OMI_ENABLE_PREROLL)
+#define PREROLL_FRAME_BYTES 80      // RAM budgeted per pre-roll frame, bigger frames shorten the pre-roll
+#define LINK_POLICY_INTERVAL_MS 1000 // how often the link policy re-evaluates the workload
+#define LINK_POLICY_IDLE_TICKS 5    // quiet evaluations before relaxing to the idle parameters
+#define CONN_SETUP_STEP_TIMEOUT_MS 300 // a setup procedure the peer never completes holds up the next one this long
+#define ADV_FAST_DURATION_MS 30000 // fast advertising after boot, disconnect and button presses
+#define ADV_STANDARD_DURATION_MS 300000 // then the standard interval, slow advertising after that
+#define ADV_RETRY_MS 100            // retry when advertising cannot restart yet
+#define STORAGE_NOTIFY_CREDITS 2    // offline sync notifications in flight next to live audio
+#define STORAGE_AUTO_SYNC_CHECK_MS 2000 // how often an idle link is checked for backlog
+// USB CDC ACM port (CONFIG_OMI_ENABLE_USB_SYNC, CONFIG_OMI_ENABLE_USB_STREAM)
+#define USB_TX_RING_BYTES 2048        // bytes waiting for the endpoint
+#define USB_TX_TIMEOUT_MS 2000        // a host that reads nothing for this long ends the sync
+#define USB_STREAM_METRICS_MS 200     // monitor snapshots in the profiling stream
+#define USB_STREAM_TRACE_MS 20        // flight recorder events in it (CONFIG_OMI_ENABLE_FLIGHT_REC)
+#define WIFI_BENCH_MAX_S 60          // longest Wi-Fi benchmark run (CONFIG_OMI_ENABLE_WIFI_BENCHMARK)
+// Delta firmware updates (CONFIG_OMI_ENABLE_DELTA_DFU)
+#define DELTA_DFU_WINDOW_BYTES 4096     // patch bytes a client may send ahead of the last notified offset
+#define DELTA_DFU_ACK_BYTES 1024        // progress is notified after this many patch bytes
+#define DELTA_DFU_REBOOT_DELAY_MS 1000  // lets the final status go out before rebooting into MCUboot
+// SD pre-erase (CONFIG_OMI_ENABLE_SD_PREERASE): free clusters ahead of the data file are erased while idle
+#define SD_PREERASE_AHEAD_BYTES (512 * 1024) // kept erased past the write position, ~2 min of audio at 32 kbps
+#define SD_PREERASE_CHUNK_BYTES (64 * 1024)  // per erase command, rounded to whole clusters
+#define SD_PREERASE_INTERVAL_MS 1000          // between erase commands
+#define SD_PREERASE_TIMEOUT_MS 1000           // longest an erase may keep the card busy
+// Firmware updates staged on the SD card over Wi-Fi (CONFIG_OMI_ENABLE_SD_DFU)
+#define SD_DFU_STALL_TIMEOUT_MS 10000   // a download that gets no bytes from the hub for this long fails
+#define SD_DFU_REBOOT_DELAY_MS 1000     // lets the result go out before rebooting into MCUboot
+// MCUmgr firmware uploads (CONFIG_OMI_ENABLE_SMP_DFU)
+#define SMP_DFU_REPORT_MS 1000          // progress and transfer rate are notified this often during an upload
+#define SMP_DFU_IDLE_TIMEOUT_MS 5000    // an upload with no chunk for this long no longer holds the DFU link policy
+// Sync planner (CONFIG_OMI_ENABLE_SYNC_PLANNER)
+#define SYNC_PLAN_BLE_BPS 8000          // BLE sync throughput in bytes/s until one has been measured
+#define SYNC_PLAN_WIFI_BPS 250000       // Wi-Fi sync throughput to the hub in bytes/s
+#define SYNC_PLAN_BURST_BYTES (32 * 1024) // smaller backlogs wait for more audio before an auto sync
+#define SYNC_PLAN_MAX_WAIT_MS (10 * 60 * 1000) // a backlog held back this long syncs over BLE anyway
+#define SYNC_PLAN_SAMPLE_BYTES (16 * 1024) // shorter syncs don't update the measured throughput
+#define SYNC_PLAN_LOW_ROOM_BYTES (32 * 1024 * 1024) // less room left on the card syncs without waiting
+#define STORAGE_READ_AHEAD_BLOCKS 10 // 440-byte blocks per read-ahead chunk at least, two chunks are kept
+#define STORAGE_CMD_QUEUE_LEN 4      // storage commands waiting for the storage thread
+#define STORAGE_L2CAP_PSM 0x0081     // LE CoC for offline sync (CONFIG_OMI_ENABLE_STORAGE_L2CAP)
+#define STORAGE_L2CAP_SDU_BLOCKS 4   // 440-byte blocks per SDU, capped by the peer's MTU
+#define STORAGE_L2CAP_BUFS 2         // SDUs in flight
+#define SD_SPI_CLOCK_HZ 25000000     // SD clock after identification (SPI mode default speed), capped by the slot
+#define SD_IDLE_OFF_MS 30000         // SD card is unmounted and cut after this long without requests, 0 keeps it on
+#define SD_RING_RETENTION SD_RETENTION_SYNCED // what a full card evicts at boot (CONFIG_OMI_ENABLE_SD_RING)
+
+// Scratch arena (scratch.h): offline sync, Wi-Fi sync and speaker playback take turns with one buffer.
+// The read-ahead chunks grow into whatever room the largest user leaves them
+#define SCRATCH_SYNC_BYTES (2 * 440 * STORAGE_READ_AHEAD_BLOCKS)
+#ifdef CONFIG_OMI_ENABLE_SPEAKER
+#define SCRATCH_SPEAKER_BYTES 10240 // speaker PCM and Opus rings
+#else
+#define SCRATCH_SPEAKER_BYTES 0
+#endif
+#define SCRATCH_ARENA_SIZE (SCRATCH_SYNC_BYTES > SCRATCH_SPEAKER_BYTES ? SCRATCH_SYNC_BYTES : SCRATCH_SPEAKER_BYTES)
 
 // PIN definitions
 // https://github.com/Seeed-Studio/Adafruit_nRF52_Arduino/blob/5aa3573913449410fd60f76b75673c53855ff2ec/variants/Seeed_XIAO_nRF52840_Sense/variant.cpp#L34
@@ -15,27 +124,181 @@
 #define PDM_PWR_PIN NRF_GPIO_PIN_MAP(1, 10)
 
 // Codecs
-#ifdef CONFIG_OMI_CODEC_OPUS
+#if defined(CONFIG_OMI_CODEC_OPUS)
 #define CODEC_OPUS 1
+#elif defined(CONFIG_OMI_CODEC_LC3)
+#define CODEC_LC3 1
 #else
-#error "Enable CONFIG_OMI_CODEC_OPUS in the project .conf file"
+#error "Enable CONFIG_OMI_CODEC_OPUS or CONFIG_OMI_CODEC_LC3 in the project .conf file"
 #endif
 
 #if CODEC_OPUS
-#define CODEC_PACKAGE_SAMPLES 160 * 2
-#define CODEC_OUTPUT_MAX_BYTES CODEC_PACKAGE_SAMPLES / 2
+#define CODEC_PACKAGE_SAMPLES (AUDIO_SAMPLE_RATE / 50) // 20ms
+#define CODEC_OUTPUT_MAX_BYTES 160                     // 64 kbps, whatever the sample rate
 #define CODEC_OPUS_APPLICATION OPUS_APPLICATION_RESTRICTED_LOWDELAY
+#ifdef CONFIG_OMI_NARROWBAND
+#define CODEC_OPUS_BITRATE 16000
+#else
 #define CODEC_OPUS_BITRATE 32000
+#endif
 #define CODEC_OPUS_VBR 1 // Or 1
 #define CODEC_OPUS_COMPLEXITY 3
 #endif
+#if CODEC_LC3
+#define CODEC_LC3_FRAME_US 10000
+#define CODEC_LC3_FRAME_SAMPLES (AUDIO_SAMPLE_RATE / 100)
+#define CODEC_PACKAGE_SAMPLES (CODEC_LC3_FRAME_SAMPLES * 2) // two LC3 frames, so the pipeline keeps its 20ms cadence
+#define CODEC_OUTPUT_MAX_BYTES 160
+#ifdef CONFIG_OMI_NARROWBAND
+#define CODEC_LC3_BITRATE 24000       // 30 bytes per LC3 frame
+#else
+#define CODEC_LC3_BITRATE 32000       // 40 bytes per LC3 frame
+#endif
+#endif
+#define CODEC_FRAME_POOL_COUNT 10 // frames in flight between mic and encoder (200ms)
+
+// With frame timestamps every queued frame starts with its 4-byte capture time (little endian),
+// which then travels as part of the frame payload to GATT and SD alike. PIPE_FRAME_TIMESTAMP_FLAG
+// in the index byte tells the app that the frame (fragment 0) or every packed entry carries it;
+// GATT sinks that did not enable OMI_MODE_FRAME_TIMESTAMPS get the frames without it.
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+#define FRAME_TIMESTAMP_SIZE 4
+#else
+#define FRAME_TIMESTAMP_SIZE 0
+#endif
+
+// Codec profiles, selectable at runtime through the settings service
+#define CODEC_PROFILE_LOW_POWER 0
+#define CODEC_PROFILE_BALANCED 1 // CODEC_OPUS_BITRATE / CODEC_OPUS_COMPLEXITY, or CODEC_LC3_BITRATE
+#define CODEC_PROFILE_HIGH_FIDELITY 2
+#define CODEC_PROFILE_COUNT 3
+#define CODEC_PROFILE_DEFAULT CODEC_PROFILE_BALANCED
+
+// Offline capture (no connection, frames go to storage) has its own profile, not selectable
+#define CODEC_PROFILE_OFFLINE CODEC_PROFILE_COUNT
+#define CODEC_OFFLINE_BITRATE 16000  // twice the recording time per MAX_STORAGE_BYTES
+#define CODEC_OFFLINE_COMPLEXITY 5   // no radio traffic to compete with, spend it on quality
+#define CODEC_OFFLINE_FRAME_MS 60    // Opus packet length offline, 20, 40 or 60; fewer records and encoder calls
+
+// Voice-activity gating (CONFIG_OMI_ENABLE_VAD): silent frames are neither encoded nor sent
+#define CODEC_VAD_MIN_LEVEL 120         // mean |sample| below which a frame is always silence
+#define CODEC_VAD_NOISE_MARGIN 3        // speech must be this many times above the noise floor
+#define CODEC_VAD_HANGOVER_FRAMES 25    // keep sending 500ms after the last voiced frame
+#define CODEC_VAD_KEEPALIVE_FRAMES 50   // one frame per second while silent so the app keeps time
+
+// Playback gating (CONFIG_OMI_ENABLE_PLAYBACK_GATE, needs the speaker): frames captured while the
+// speaker plays are neither encoded, sent nor stored
+#define CODEC_PLAYBACK_TAIL_MS 200 // still skipped after the last sample, covers the room and the mic block
+
+// Motion-gated listening (CONFIG_OMI_ENABLE_IDLE_LISTEN, needs the VAD)
+#define IDLE_LISTEN_AFTER_MS (10 * 60 * 1000) // no motion or speech this long duty-cycles the mic
+#define IDLE_LISTEN_PERIOD_MS 10000           // one probe per period while idle
+#define IDLE_LISTEN_PROBE_MS 600              // mic on time per probe, enough for the VAD to settle
+#define IDLE_LISTEN_CHECK_MS 1000             // inactivity check interval at full capture
+#define IMU_WAKE_THRESHOLD 2                  // wake-up slope threshold, 31.25mg per step at +-2g
+
+// Performance governor (CONFIG_OMI_ENABLE_GOVERNOR, needs the battery): tiers by remaining charge
+#define GOVERNOR_INTERVAL_MS 60000    // tier check period
+#define GOVERNOR_SAVER_PERCENT 40     // at or below, the saver tier
+#define GOVERNOR_LOW_PERCENT 20       // at or below, the low tier
+#define GOVERNOR_CRITICAL_PERCENT 10  // at or below, the critical tier
+#define GOVERNOR_HYSTERESIS_PERCENT 5 // a tier is only left upward this far above where it was entered
+#define GOVERNOR_MIN_RUNTIME_MIN 120  // one tier lower while the energy ledger projects less (monitor only)
+#define GOVERNOR_BATTERY_UAH 150000   // battery capacity, for the runtime projection
+
+// LSM6DSL embedded tap and activity engines (CONFIG_OMI_ENABLE_IMU_GESTURES), values from ST AN5040
+#define IMU_GESTURE_ODR_HZ 416 // accelerometer rate while moving, taps are unreliable below it
+#define IMU_TAP_THRESHOLD 9    // 62.5mg per step at +-2g
+#define IMU_TAP_TIMING 0x7F    // INT_DUR2: 7 for the double-tap window, 3 for quiet and shock
+#define IMU_INACTIVE_DUR 8     // inactivity after 8 * 512 / IMU_GESTURE_ODR_HZ, ~10s
+#define IMU_GESTURE_RETRY_MS 5 // a failed read of the latched sources is tried again after this long
+
+// Pre-processing between mic and encoder (CONFIG_OMI_ENABLE_PREPROCESS), all fixed point
+#define PREPROCESS_HPF_POLE_Q15 31739        // DC blocker pole, ~80Hz corner at 16kHz (40Hz at 8kHz)
+#define PREPROCESS_NS_OVERSUBTRACT 2         // noise estimate is doubled before it is subtracted
+#define PREPROCESS_NS_MIN_GAIN_Q15 5827      // never attenuate a band by more than 15dB
+#define PREPROCESS_NS_NOISE_RISE_SHIFT 8     // noise floor climbs over ~2.5s of steady sound
+#define PREPROCESS_NS_BUDGET_US 3000         // noise suppression time allowed per 20ms frame
+#define PREPROCESS_NS_BACKOFF_FRAMES 50      // skip it for 1s after it ran over its budget
+#define PREPROCESS_AGC_UNITY 256             // AGC gains are in 1/256
+#define PREPROCESS_AGC_TARGET_LEVEL 3000     // mean |sample| of levelled speech
+#define PREPROCESS_AGC_MIN_LEVEL 200         // frames quieter than this hold the gain
+#define PREPROCESS_AGC_MIN_GAIN (PREPROCESS_AGC_UNITY / 2)
+#define PREPROCESS_AGC_MAX_GAIN (PREPROCESS_AGC_UNITY * 8)
+#define PREPROCESS_AGC_RELEASE_SHIFT 5       // gain rises over ~640ms, falls within a few frames
+
+// Wake phrase spotting (CONFIG_OMI_ENABLE_KWS), on the pre-processed frames ahead of the VAD
+#define KWS_TEMPLATE_FRAMES 60           // longest wake phrase, 1.2s
+#define KWS_TEMPLATE_MIN_FRAMES 15       // shorter utterances are not taken as a phrase
+#define KWS_TEMPLATE_MAX_BYTES 1024      // settings entry holding the enrolled phrase
+#define KWS_ENROLL_GAP_FRAMES 15         // 300ms without voice ends the phrase being enrolled
+#define KWS_ENROLL_TIMEOUT_FRAMES 500    // enrollment gives up after 10s without voice
+#define KWS_VOICE_MARGIN_Q4 48           // voiced frames are 9dB above the noise floor
+#define KWS_MATCH_THRESHOLD_Q4 12        // mean feature distance of a match, ~2.2dB per band
+#define KWS_REFRACTORY_FRAMES 50         // one detection per second at most
+#define KWS_BOOST_MS 30000               // high-fidelity profile this long after a detection
+#define KWS_BUDGET_US 1500               // spotting time allowed per 20ms frame
+#define KWS_BACKOFF_FRAMES 50            // skip it for 1s after it ran over its budget
+
+// Adaptive bitrate: step down under transmit pressure, recover with hysteresis
+#define CODEC_ABR_WINDOW_FRAMES 25      // evaluate link pressure every 500ms
+#define CODEC_ABR_HIGH_WATERMARK 50     // tx queue fill (%) treated as pressure
+#define CODEC_ABR_LOW_WATERMARK 10      // tx queue fill (%) treated as healthy
+#define CODEC_ABR_RECOVER_WINDOWS 6     // healthy windows (3s) before stepping back up
+
+// Loss-adaptive FEC: expected loss follows the observed notify loss rate
+#define CODEC_FEC_ENABLE_LOSS_PERC 2    // turn in-band FEC on at this smoothed loss rate
+#define CODEC_FEC_DISABLE_LOSS_PERC 1   // and off again once it falls to this
+#define CODEC_FEC_MAX_LOSS_PERC 30      // cap on the loss percentage reported to the encoder
+#define MIC_FRAME_SAMPLES CODEC_PACKAGE_SAMPLES // mic hands PCM over in encoder-sized frames
 #define CONFIG_OPUS_MODE CONFIG_OPUS_MODE_CELT
 
 // Codec IDs
 
 #ifdef CODEC_OPUS
+#ifdef CONFIG_OMI_NARROWBAND
+#define CODEC_ID 22 // Opus 8kHz, 20ms frames
+#else
 #define CODEC_ID 21
 #endif
+#endif
+#ifdef CODEC_LC3
+#ifdef CONFIG_OMI_NARROWBAND
+#define CODEC_ID 41 // LC3 8kHz 10ms, each packet holds two frames of equal size
+#else
+#define CODEC_ID 40 // LC3 10ms, each packet holds two frames of equal size
+#endif
+#endif
+
+// Monitor (CONFIG_OMI_ENABLE_MONITOR)
+#define MONITOR_SAMPLE_INTERVAL_MS 1000 // CPU load sampling period
+#define MONITOR_NOTIFY_INTERVAL_MS 10000 // metrics notification period while subscribed
+#define MONITOR_THREAD_REPORT_INTERVAL_MS 60000 // per-thread CPU/stack usage log period
+
+// Energy ledger currents in uA, datasheet typicals until calibrated against a power profiler
+#define ENERGY_BASE_UA 250             // everything asleep, regulator quiescent and the IMU
+#define ENERGY_RADIO_CONNECTED_UA 150  // connection events of an idle link
+#define ENERGY_RADIO_NOTIFY_NC 6000    // one audio notification, ~1ms of radio at ~6mA with ramp-up
+#define ENERGY_MIC_UA 1300             // two PDM mics and the PDM peripheral
+#define ENERGY_CPU_UA 3300             // CPU running from flash at 64MHz on the DC/DC
+#define ENERGY_SD_UA 1500              // SD card powered and idle
+#define ENERGY_SD_ACCESS_UA 30000      // while a read, write or sync is in progress, on top of idle
+#define ENERGY_WIFI_UA 20000           // Wi-Fi associated, averaged over power save and traffic
+#define ENERGY_SPEAKER_UA 3000         // amplifier enabled, playback on top is not counted
+#define ENERGY_HAPTIC_UA 60000         // motor driven
+
+// Flight recorder (CONFIG_OMI_ENABLE_FLIGHT_REC), ~300 events/s while streaming, 8 bytes each
+#define FLIGHT_REC_EVENTS 512    // RAM ring, a power of two
+#define FLIGHT_REC_FLUSH_MS 1000 // events are written to the card at least this often
 
 // Logs
 // #define LOG_DISCARDED
+
+// Logs on per-frame, per-batch and per-command paths are debug records unless CONFIG_OMI_LOG_HOT_PATHS
+// raises them. Keep their arguments to integers, so that with dictionary logging
+// (CONFIG_LOG_DICTIONARY_SUPPORT) each one is a few bytes of binary record and no formatting
+#ifdef CONFIG_OMI_LOG_HOT_PATHS
+#define LOG_HOT(...) LOG_INF(__VA_ARGS__)
+#else
+#define LOG_HOT(...) LOG_DBG(__VA_ARGS__)
+#endif
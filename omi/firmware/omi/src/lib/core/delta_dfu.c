@@ -0,0 +1,539 @@
+#include "delta_dfu.h"
+
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/storage/stream_flash.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/reboot.h>
+#include <zephyr/sys/ring_buffer.h>
+
+#include "config.h"
+#include "subscription.h"
+#include "transport.h"
+
+LOG_MODULE_REGISTER(delta_dfu, CONFIG_LOG_DEFAULT_LEVEL);
+
+// Patch format, see scripts/delta_patch.py
+#define DELTA_MAGIC 0x544C4544 // "DELT"
+#define DELTA_VERSION 1
+#define DELTA_HEADER_SIZE 24
+#define DELTA_OP_COPY 0x01   // [source_offset u32][length u32]
+#define DELTA_OP_INSERT 0x02 // [length u16][length bytes]
+#define DELTA_PENDING_MAX DELTA_HEADER_SIZE
+
+#define DFU_CMD_START 0x01
+#define DFU_CMD_ABORT 0x02
+#define DFU_CHUNK_SIZE 256     // patch, source and read-back bytes handled at a time
+#define DFU_WRITE_BUF_SIZE 512 // stream_flash buffer, a multiple of the flash write block size
+
+BUILD_ASSERT(DELTA_DFU_ACK_BYTES < DELTA_DFU_WINDOW_BYTES, "A full window must trigger a progress notification");
+
+#define SOURCE_AREA FIXED_PARTITION_ID(slot0_partition)
+#define TARGET_AREA FIXED_PARTITION_ID(slot1_partition)
+
+static ssize_t dfu_control_read_handler(struct bt_conn *conn,
+                                        const struct bt_gatt_attr *attr,
+                                        void *buf,
+                                        uint16_t len,
+                                        uint16_t offset);
+static ssize_t dfu_control_write_handler(struct bt_conn *conn,
+                                         const struct bt_gatt_attr *attr,
+                                         const void *buf,
+                                         uint16_t len,
+                                         uint16_t offset,
+                                         uint8_t flags);
+static ssize_t dfu_data_write_handler(struct bt_conn *conn,
+                                      const struct bt_gatt_attr *attr,
+                                      const void *buf,
+                                      uint16_t len,
+                                      uint16_t offset,
+                                      uint8_t flags);
+static void dfu_control_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+//
+// Service and Characteristic
+//
+// Delta DFU service with UUID 19B10060-E8F2-537E-4F6C-D104768A1214
+// exposes following characteristics:
+// - Control (UUID 19B10061-E8F2-537E-4F6C-D104768A1214) start/abort, struct delta_dfu_status (read/write/notify)
+// - Data (UUID 19B10062-E8F2-537E-4F6C-D104768A1214) [offset u32][patch bytes] (write without response)
+static struct bt_uuid_128 dfu_service_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10060, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 dfu_control_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10061, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 dfu_data_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10062, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+
+static struct bt_gatt_attr dfu_service_attr[] = {
+    BT_GATT_PRIMARY_SERVICE(&dfu_service_uuid),
+    BT_GATT_CHARACTERISTIC(&dfu_control_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+                           dfu_control_read_handler,
+                           dfu_control_write_handler,
+                           NULL),
+    BT_GATT_CCC(dfu_control_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(&dfu_data_uuid.uuid,
+                           BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+                           BT_GATT_PERM_WRITE,
+                           NULL,
+                           dfu_data_write_handler,
+                           NULL),
+};
+
+static struct bt_gatt_service dfu_service = BT_GATT_SERVICE(dfu_service_attr);
+static struct subscription dfu_subscription = SUBSCRIPTION_INIT;
+
+//
+// State
+//
+
+// Commands from the control handler, carried out by the worker
+static atomic_t dfu_cmd;
+static atomic_t dfu_cmd_size;
+K_SEM_DEFINE(dfu_sem, 0, 1);
+
+// Patch bytes on their way from the data handler to the worker. The lock also keeps a write from
+// landing in the ring while the worker resets it for a new update
+RING_BUF_DECLARE(dfu_rx_ring, DELTA_DFU_WINDOW_BYTES);
+static struct k_spinlock dfu_rx_lock;
+static bool dfu_accepting;
+static uint32_t dfu_rx_offset; // patch bytes taken into the ring
+static uint32_t dfu_patch_size;
+
+// Everything below is only touched by the worker
+static struct delta_dfu_status status = {.window = DELTA_DFU_WINDOW_BYTES};
+static uint32_t acked;
+static uint32_t source_size;
+static uint32_t target_size;
+static uint32_t target_crc;
+static bool header_done;
+static uint8_t pending[DELTA_PENDING_MAX]; // header or operation being parsed
+static size_t pending_len;
+static uint32_t insert_left; // bytes of the current INSERT still to come
+
+static const struct flash_area *source_fa;
+static const struct flash_area *target_fa;
+static struct stream_flash_ctx stream;
+static uint8_t write_buf[DFU_WRITE_BUF_SIZE] __aligned(4);
+static uint8_t rx_chunk[DFU_CHUNK_SIZE];
+static uint8_t flash_chunk[DFU_CHUNK_SIZE];
+
+K_THREAD_STACK_DEFINE(dfu_stack, 1536);
+static struct k_thread dfu_thread;
+
+static void dfu_notify(void)
+{
+    acked = status.applied;
+    if (subscription_is_notifying(&dfu_subscription)) {
+        transport_notify(NULL, &dfu_service.attrs[1], &status, sizeof(status));
+    }
+}
+
+static void dfu_control_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    subscription_update(&dfu_subscription, value);
+}
+
+static ssize_t dfu_control_read_handler(struct bt_conn *conn,
+                                        const struct bt_gatt_attr *attr,
+                                        void *buf,
+                                        uint16_t len,
+                                        uint16_t offset)
+{
+    struct delta_dfu_status snapshot = status;
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &snapshot, sizeof(snapshot));
+}
+
+static ssize_t dfu_control_write_handler(struct bt_conn *conn,
+                                         const struct bt_gatt_attr *attr,
+                                         const void *buf,
+                                         uint16_t len,
+                                         uint16_t offset,
+                                         uint8_t flags)
+{
+    const uint8_t *data = buf;
+
+    if (len == 5 && data[0] == DFU_CMD_START) {
+        atomic_set(&dfu_cmd_size, (atomic_val_t) sys_get_le32(&data[1]));
+    } else if (!(len == 1 && data[0] == DFU_CMD_ABORT)) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+    atomic_set(&dfu_cmd, data[0]);
+    k_sem_give(&dfu_sem);
+    return len;
+}
+
+static ssize_t dfu_data_write_handler(struct bt_conn *conn,
+                                      const struct bt_gatt_attr *attr,
+                                      const void *buf,
+                                      uint16_t len,
+                                      uint16_t offset,
+                                      uint8_t flags)
+{
+    const uint8_t *data = buf;
+    bool taken = false;
+
+    if (len <= 4) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+    uint32_t patch_offset = sys_get_le32(data);
+    uint16_t n = len - 4;
+
+    // Anything the worker isn't expecting next is dropped, the client resends from the notified offset
+    k_spinlock_key_t key = k_spin_lock(&dfu_rx_lock);
+    if (dfu_accepting && patch_offset == dfu_rx_offset && n <= dfu_patch_size - dfu_rx_offset &&
+        n <= ring_buf_space_get(&dfu_rx_ring)) {
+        ring_buf_put(&dfu_rx_ring, data + 4, n);
+        dfu_rx_offset += n;
+        taken = true;
+    }
+    k_spin_unlock(&dfu_rx_lock, key);
+
+    if (taken) {
+        k_sem_give(&dfu_sem);
+    }
+    return len;
+}
+
+static void dfu_set_accepting(bool accepting, uint32_t patch_size)
+{
+    k_spinlock_key_t key = k_spin_lock(&dfu_rx_lock);
+    dfu_accepting = accepting;
+    if (accepting) {
+        ring_buf_reset(&dfu_rx_ring);
+        dfu_rx_offset = 0;
+        dfu_patch_size = patch_size;
+    }
+    k_spin_unlock(&dfu_rx_lock, key);
+}
+
+static void dfu_close(void)
+{
+    if (source_fa) {
+        flash_area_close(source_fa);
+        source_fa = NULL;
+    }
+    if (target_fa) {
+        flash_area_close(target_fa);
+        target_fa = NULL;
+    }
+}
+
+static void dfu_stop(enum delta_dfu_state state, enum delta_dfu_error error)
+{
+    dfu_set_accepting(false, 0);
+    dfu_close();
+    status.state = state;
+    status.error = error;
+    if (error != DELTA_DFU_ERR_NONE) {
+        LOG_ERR("Delta update failed (error %d) at patch offset %u", error, status.applied);
+    }
+    dfu_notify();
+}
+
+static int dfu_crc(const struct flash_area *fa, uint32_t size, uint32_t *crc)
+{
+    *crc = 0;
+    for (uint32_t off = 0; off < size; off += DFU_CHUNK_SIZE) {
+        uint32_t n = MIN(DFU_CHUNK_SIZE, size - off);
+        int err = flash_area_read(fa, off, flash_chunk, n);
+        if (err) {
+            return err;
+        }
+        *crc = crc32_ieee_update(*crc, flash_chunk, n);
+    }
+    return 0;
+}
+
+static bool dfu_write(const uint8_t *data, size_t len)
+{
+    int err = stream_flash_buffered_write(&stream, data, len, false);
+    if (err) {
+        LOG_ERR("Secondary slot write failed (err %d)", err);
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+        return false;
+    }
+    status.written += len;
+    return true;
+}
+
+static bool dfu_copy(uint32_t offset, uint32_t length)
+{
+    if (offset > source_size || length > source_size - offset) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_PATCH);
+        return false;
+    }
+    while (length > 0) {
+        uint32_t n = MIN(DFU_CHUNK_SIZE, length);
+        if (flash_area_read(source_fa, offset, flash_chunk, n)) {
+            dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+            return false;
+        }
+        if (!dfu_write(flash_chunk, n)) {
+            return false;
+        }
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool dfu_check_header(void)
+{
+    if (sys_get_le32(&pending[0]) != DELTA_MAGIC || pending[4] != DELTA_VERSION) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_HEADER);
+        return false;
+    }
+    source_size = sys_get_le32(&pending[8]);
+    uint32_t source_crc = sys_get_le32(&pending[12]);
+    target_size = sys_get_le32(&pending[16]);
+    target_crc = sys_get_le32(&pending[20]);
+    if (target_size == 0 || source_size > source_fa->fa_size || target_size > target_fa->fa_size) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_TOO_LARGE);
+        return false;
+    }
+
+    uint32_t crc;
+    if (dfu_crc(source_fa, source_size, &crc)) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+        return false;
+    }
+    if (crc != source_crc) {
+        LOG_ERR("Patch is for image CRC %08x, running %08x", source_crc, crc);
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_SOURCE);
+        return false;
+    }
+
+    // Pages are erased as the image reaches them
+    int err = stream_flash_init(&stream,
+                                flash_area_get_device(target_fa),
+                                write_buf,
+                                sizeof(write_buf),
+                                target_fa->fa_off,
+                                target_fa->fa_size,
+                                NULL);
+    if (err) {
+        LOG_ERR("stream_flash_init failed (err %d)", err);
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+        return false;
+    }
+    LOG_INF("Delta update: %u byte image from %u bytes of the running one", target_size, source_size);
+    return true;
+}
+
+// Bytes of the header or the current operation still to be parsed
+static size_t dfu_pending_need(void)
+{
+    if (!header_done) {
+        return DELTA_HEADER_SIZE;
+    }
+    if (pending_len == 0) {
+        return 1;
+    }
+    switch (pending[0]) {
+    case DELTA_OP_COPY:
+        return 9;
+    case DELTA_OP_INSERT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+static bool dfu_run_pending(void)
+{
+    if (!header_done) {
+        header_done = true;
+        return dfu_check_header();
+    }
+    if (status.written == target_size) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_PATCH); // operations past the end of the image
+        return false;
+    }
+
+    uint32_t length;
+    switch (pending[0]) {
+    case DELTA_OP_COPY:
+        length = sys_get_le32(&pending[5]);
+        if (length > target_size - status.written) {
+            break;
+        }
+        return dfu_copy(sys_get_le32(&pending[1]), length);
+    case DELTA_OP_INSERT:
+        length = sys_get_le16(&pending[1]);
+        if (length > target_size - status.written) {
+            break;
+        }
+        insert_left = length;
+        return true;
+    default:
+        break;
+    }
+    dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_PATCH);
+    return false;
+}
+
+static void dfu_feed(const uint8_t *data, size_t len)
+{
+    while (len > 0 && status.state == DELTA_DFU_RECEIVING) {
+        size_t n;
+        if (insert_left > 0) {
+            n = MIN(len, insert_left);
+            if (!dfu_write(data, n)) {
+                return;
+            }
+            insert_left -= n;
+        } else {
+            n = MIN(len, dfu_pending_need() - pending_len);
+            memcpy(&pending[pending_len], data, n);
+            pending_len += n;
+            if (pending_len == dfu_pending_need()) {
+                pending_len = 0;
+                if (!dfu_run_pending()) {
+                    return;
+                }
+            }
+        }
+        data += n;
+        len -= n;
+        status.applied += n;
+    }
+}
+
+static void dfu_start(uint32_t patch_size)
+{
+    dfu_set_accepting(false, 0);
+    dfu_close();
+    memset(&status, 0, sizeof(status));
+    status.window = DELTA_DFU_WINDOW_BYTES;
+    header_done = false;
+    pending_len = 0;
+    insert_left = 0;
+
+    if (patch_size <= DELTA_HEADER_SIZE) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_PATCH);
+        return;
+    }
+    if (flash_area_open(SOURCE_AREA, &source_fa) || flash_area_open(TARGET_AREA, &target_fa)) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+        return;
+    }
+    LOG_INF("Delta update started, %u byte patch", patch_size);
+    status.state = DELTA_DFU_RECEIVING;
+    dfu_set_accepting(true, patch_size);
+    dfu_notify();
+}
+
+// MCUboot writes its swap state at the end of the slot, which the image pages didn't erase
+static int dfu_erase_trailer(void)
+{
+    struct flash_pages_info page;
+    int err = flash_get_page_info_by_offs(flash_area_get_device(target_fa),
+                                          target_fa->fa_off + status.written - 1,
+                                          &page);
+    if (err) {
+        return err;
+    }
+    off_t start = page.start_offset + page.size - target_fa->fa_off;
+    if (start >= target_fa->fa_size) {
+        return 0;
+    }
+    return flash_area_erase(target_fa, start, target_fa->fa_size - start);
+}
+
+static void dfu_finish(void)
+{
+    status.state = DELTA_DFU_VERIFYING;
+    dfu_notify();
+
+    uint32_t crc;
+    if (stream_flash_buffered_write(&stream, NULL, 0, true) || dfu_crc(target_fa, target_size, &crc)) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+        return;
+    }
+    if (crc != target_crc) {
+        LOG_ERR("Rebuilt image CRC %08x, expected %08x", crc, target_crc);
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_CRC);
+        return;
+    }
+    // The CRC proves the patch rebuilt the image it was made for; MCUboot still checks its
+    // signature before the swap, so it is requested permanent rather than test-and-confirm
+    if (dfu_erase_trailer() || boot_request_upgrade(BOOT_UPGRADE_PERMANENT)) {
+        dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_FLASH);
+        return;
+    }
+
+    LOG_INF("Delta update verified, rebooting into the new image");
+    dfu_stop(DELTA_DFU_DONE, DELTA_DFU_ERR_NONE);
+    k_sleep(K_MSEC(DELTA_DFU_REBOOT_DELAY_MS));
+    sys_reboot(SYS_REBOOT_WARM);
+}
+
+static void dfu_entry(void)
+{
+    while (1) {
+        k_sem_take(&dfu_sem, K_FOREVER);
+
+        atomic_val_t cmd = atomic_clear(&dfu_cmd);
+        if (cmd == DFU_CMD_START) {
+            dfu_start((uint32_t) atomic_get(&dfu_cmd_size));
+        } else if (cmd == DFU_CMD_ABORT && status.state != DELTA_DFU_IDLE) {
+            LOG_INF("Delta update aborted");
+            dfu_stop(DELTA_DFU_IDLE, DELTA_DFU_ERR_NONE);
+        }
+
+        while (status.state == DELTA_DFU_RECEIVING) {
+            k_spinlock_key_t key = k_spin_lock(&dfu_rx_lock);
+            uint32_t n = ring_buf_get(&dfu_rx_ring, rx_chunk, sizeof(rx_chunk));
+            k_spin_unlock(&dfu_rx_lock, key);
+            if (n == 0) {
+                break;
+            }
+            dfu_feed(rx_chunk, n);
+            if (status.state == DELTA_DFU_RECEIVING && status.applied < dfu_patch_size &&
+                status.applied - acked >= DELTA_DFU_ACK_BYTES) {
+                dfu_notify();
+            }
+        }
+
+        if (status.state == DELTA_DFU_RECEIVING && status.applied == dfu_patch_size) {
+            if (status.written == target_size && insert_left == 0 && pending_len == 0) {
+                dfu_finish();
+            } else {
+                dfu_stop(DELTA_DFU_FAILED, DELTA_DFU_ERR_PATCH); // patch ended inside the image
+            }
+        }
+    }
+}
+
+int delta_dfu_init(void)
+{
+    int err = bt_gatt_service_register(&dfu_service);
+    if (err) {
+        LOG_ERR("Failed to register delta DFU service (err %d)", err);
+        return err;
+    }
+
+    k_thread_create(&dfu_thread,
+                    dfu_stack,
+                    K_THREAD_STACK_SIZEOF(dfu_stack),
+                    (k_thread_entry_t) dfu_entry,
+                    NULL,
+                    NULL,
+                    NULL,
+                    K_PRIO_PREEMPT(THREAD_PRIO_DFU),
+                    0,
+                    K_NO_WAIT);
+    k_thread_name_set(&dfu_thread, "delta_dfu");
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef DELTA_DFU_H
+#define DELTA_DFU_H
+
+#include <stdint.h>
+
+#ifdef CONFIG_OMI_ENABLE_DELTA_DFU
+
+/**
+ * @brief States reported on the delta DFU control characteristic
+ */
+enum delta_dfu_state {
+    DELTA_DFU_IDLE = 0,
+    DELTA_DFU_RECEIVING = 1, // Patch bytes are applied into the secondary slot as they arrive
+    DELTA_DFU_VERIFYING = 2, // Patch applied, reading the slot back against the target CRC
+    DELTA_DFU_DONE = 3,      // Upgrade requested, rebooting into MCUboot
+    DELTA_DFU_FAILED = 4,    // See the error field, a new start command retries
+};
+
+enum delta_dfu_error {
+    DELTA_DFU_ERR_NONE = 0,
+    DELTA_DFU_ERR_HEADER = 1,    // Bad magic or version
+    DELTA_DFU_ERR_SOURCE = 2,    // Patch was made against another image than the one running
+    DELTA_DFU_ERR_TOO_LARGE = 3, // Source or target doesn't fit its slot
+    DELTA_DFU_ERR_PATCH = 4,     // Unknown operation, COPY out of range or patch size mismatch
+    DELTA_DFU_ERR_FLASH = 5,     // Flash read, write or erase failed
+    DELTA_DFU_ERR_CRC = 6,       // Rebuilt image doesn't have the target CRC
+};
+
+/**
+ * @brief Value of the control characteristic, little endian
+ */
+struct delta_dfu_status {
+    uint8_t state;    // enum delta_dfu_state
+    uint8_t error;    // enum delta_dfu_error
+    uint32_t applied; // Patch bytes taken so far, the next data write starts here
+    uint32_t written; // Image bytes written to the secondary slot
+    uint16_t window;  // Patch bytes a client may send past applied
+} __attribute__((packed));
+
+/**
+ * @brief Register the delta DFU service and start its (idle) worker thread
+ *
+ * A delta patch (scripts/delta_patch.py) rebuilds a new signed image from the one in the primary
+ * slot. Writing [0x01][patch_size u32] to the control characteristic starts an update, [0x02]
+ * aborts it. Patch bytes are then written without response to the data characteristic as
+ * [offset u32][bytes], at most window bytes past the last notified applied offset; a write at any
+ * other offset is dropped and the client resends from applied. Once the slot holds an image with
+ * the patch's target CRC the upgrade is requested and the device reboots into MCUboot, which
+ * checks the image signature before the swap.
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int delta_dfu_init(void);
+
+#endif // CONFIG_OMI_ENABLE_DELTA_DFU
+
+#endif // DELTA_DFU_H
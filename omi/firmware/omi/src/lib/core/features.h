@@ -17,6 +17,67 @@ typedef enum {
     OMI_FEATURE_LED_DIMMING = (1 << 7),
     OMI_FEATURE_MIC_GAIN = (1 << 8),
     OMI_FEATURE_WIFI = (1 << 9),
+    OMI_FEATURE_CODEC_PROFILES = (1 << 10),
+    OMI_FEATURE_AUDIO_PACKING = (1 << 11),
+    OMI_FEATURE_FRAME_TIMESTAMPS = (1 << 12),
+    OMI_FEATURE_METRICS = (1 << 13),
+    OMI_FEATURE_STORAGE_TIME_RANGE = (1 << 14),
+    OMI_FEATURE_STORAGE_L2CAP = (1 << 15),
+    OMI_FEATURE_ISO_AUDIO = (1 << 16),
+    OMI_FEATURE_SPEAKER_OPUS = (1 << 17),
+    OMI_FEATURE_WIFI_LIVE_AUDIO = (1 << 18),
+    OMI_FEATURE_DELTA_DFU = (1 << 19),
+    OMI_FEATURE_SD_DFU = (1 << 20),
+    OMI_FEATURE_SMP_DFU = (1 << 21),
+    OMI_FEATURE_USB_SYNC = (1 << 22),
+    OMI_FEATURE_NFC_PAIRING = (1 << 23),
+    OMI_FEATURE_KWS = (1 << 24),
+    OMI_FEATURE_PLAYBACK_GATE = (1 << 25),
+    OMI_FEATURE_LONG_OFFLINE_FRAMES = (1 << 26),
 } omi_feature_t;
 
+/**
+ * @brief Audio stream modes the app and the firmware agree on through the capabilities characteristic
+ */
+typedef enum {
+    OMI_MODE_AUDIO_PACKING = (1 << 0),    // several whole frames per notification
+    OMI_MODE_FRAME_TIMESTAMPS = (1 << 1), // capture time ahead of every frame, flag 0x40 of the index byte
+    OMI_MODE_IMU_DELTA = (1 << 2),        // IMU batches delta coded, see struct accel_batch_header
+} omi_mode_t;
+
+// Used for a central that never negotiates, as before negotiation existed. Modes added later
+// stay out of it, so a new fast path never reaches an app that can't decode it.
+#define OMI_MODES_LEGACY (OMI_MODE_AUDIO_PACKING | OMI_MODE_FRAME_TIMESTAMPS)
+
+#define OMI_CAPS_VERSION 1
+
+/**
+ * @brief Capability descriptor, read from the capabilities characteristic, little endian
+ *
+ * Later versions only append fields.
+ */
+struct omi_caps {
+    uint8_t version;         // OMI_CAPS_VERSION
+    uint8_t codec_id;        // codec of the audio data characteristic, as the codec characteristic reads
+    uint8_t storage_format;  // STORAGE_FORMAT_VERSION of the offline audio file
+    uint8_t pack_max_frames; // frames per packed notification
+    uint16_t max_notify;     // largest notification payload on this link right now
+    uint32_t features;       // omi_feature_t
+    uint32_t modes;          // omi_mode_t this firmware supports
+    uint32_t enabled;        // omi_mode_t in use for this central
+} __attribute__((packed));
+
+/**
+ * @brief Negotiation, written to the capabilities characteristic, little endian
+ *
+ * The firmware enables the modes both sides support for the writing central and reports them in
+ * omi_caps.enabled. With several centrals the stream uses only the modes every one of them has
+ * enabled. Longer writes from a newer app are accepted, the extra bytes ignored.
+ */
+struct omi_caps_request {
+    uint8_t version;     // highest descriptor version the app understands, at least 1
+    uint32_t modes;      // omi_mode_t the app can decode
+    uint16_t max_notify; // largest notification payload the app takes, 0 for no limit
+} __attribute__((packed));
+
 #endif // FEATURES_H
@@ -0,0 +1,143 @@
+#include "flight_rec.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "config.h"
+#include "housekeeping.h"
+#include "rtc.h"
+#include "sd_card.h"
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+#include "usb.h"
+#endif
+
+LOG_MODULE_REGISTER(flight_rec, CONFIG_LOG_DEFAULT_LEVEL);
+
+BUILD_ASSERT((FLIGHT_REC_EVENTS & (FLIGHT_REC_EVENTS - 1)) == 0, "The ring size must be a power of two");
+
+// A record is [STORAGE_RECORD_TRACE][length][header][events], its length fits in one byte
+#define RECORD_HEAD 2
+#define RECORD_MAX_EVENTS ((UINT8_MAX - sizeof(struct flight_rec_header)) / sizeof(struct flight_rec_event))
+#define BLOCK_END (MAX_WRITE_SIZE - 1)
+
+static struct flight_rec_event ring[FLIGHT_REC_EVENTS];
+static uint32_t ring_head = 0; // events logged
+static uint32_t ring_tail = 0; // events flushed or lost
+static uint16_t ring_lost = 0;
+static struct k_spinlock ring_lock;
+
+static void flight_rec_flush_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(flight_rec_flush_work, flight_rec_flush_handler);
+
+static k_timeout_t flush_period(void)
+{
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+    if (usb_stream_active()) {
+        return K_MSEC(USB_STREAM_TRACE_MS);
+    }
+#endif
+    return K_MSEC(FLIGHT_REC_FLUSH_MS);
+}
+
+void flight_rec_log(enum flight_rec_event_id id, uint8_t arg8, uint16_t arg)
+{
+    uint32_t cycles = k_cycle_get_32();
+
+    k_spinlock_key_t key = k_spin_lock(&ring_lock);
+    if (ring_head - ring_tail == FLIGHT_REC_EVENTS) {
+        ring_tail++;
+        if (ring_lost < UINT16_MAX) {
+            ring_lost++;
+        }
+    }
+    struct flight_rec_event *event = &ring[ring_head++ & (FLIGHT_REC_EVENTS - 1)];
+    event->cycles = cycles;
+    event->id = id;
+    event->arg8 = arg8;
+    event->arg = arg;
+    uint32_t pending = ring_head - ring_tail;
+    k_spin_unlock(&ring_lock, key);
+
+    // The first event starts the flush period, a filling ring cuts it short
+    if (pending == 1) {
+        k_work_schedule_for_queue(&housekeeping_work_q, &flight_rec_flush_work, flush_period());
+    } else if (pending == FLIGHT_REC_EVENTS * 3 / 4) {
+        k_work_reschedule_for_queue(&housekeeping_work_q, &flight_rec_flush_work, K_NO_WAIT);
+    }
+}
+
+// Moves up to max events from the ring into a record at out, returns the record's size or 0
+static size_t fill_record(uint8_t *out, size_t max)
+{
+    struct flight_rec_header header = {
+        .uptime_ms = k_uptime_get_32(),
+        .utc_s = get_utc_time(),
+        .cycles = k_cycle_get_32(),
+        .cycle_hz = sys_clock_hw_cycles_per_sec(),
+    };
+    uint8_t *events = out + RECORD_HEAD + sizeof(header);
+    size_t count = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&ring_lock);
+    while (count < max && ring_tail != ring_head) {
+        memcpy(events + count * sizeof(struct flight_rec_event), &ring[ring_tail++ & (FLIGHT_REC_EVENTS - 1)],
+               sizeof(struct flight_rec_event));
+        count++;
+    }
+    header.lost = ring_lost;
+    ring_lost = 0;
+    k_spin_unlock(&ring_lock, key);
+
+    if (count == 0) {
+        return 0;
+    }
+    out[0] = STORAGE_RECORD_TRACE;
+    out[1] = (uint8_t) (sizeof(header) + count * sizeof(struct flight_rec_event));
+    memcpy(out + RECORD_HEAD, &header, sizeof(header));
+    return RECORD_HEAD + out[1];
+}
+
+static void flight_rec_flush_handler(struct k_work *work)
+{
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+    // Bench profiling takes the events over USB instead of into the audio stream
+    if (usb_stream_active()) {
+        uint8_t record[RECORD_HEAD + UINT8_MAX];
+        size_t size;
+        while ((size = fill_record(record, RECORD_MAX_EVENTS)) > 0) {
+            usb_stream_send(USB_STREAM_MSG_TRACE, NULL, 0, record + RECORD_HEAD, size - RECORD_HEAD);
+        }
+        return;
+    }
+#endif
+
+    // Without a card the ring just keeps the latest events
+    while (ring_head != ring_tail && sd_accepts_writes()) {
+        uint8_t *block = alloc_file_block();
+        if (!block) {
+            break;
+        }
+
+        size_t pos = 0;
+        while (BLOCK_END - pos >= RECORD_HEAD + sizeof(struct flight_rec_header) + sizeof(struct flight_rec_event)) {
+            size_t max = (BLOCK_END - pos - RECORD_HEAD - sizeof(struct flight_rec_header)) /
+                         sizeof(struct flight_rec_event);
+            size_t size = fill_record(block + pos, MIN(max, RECORD_MAX_EVENTS));
+            if (size == 0) {
+                break;
+            }
+            pos += size;
+        }
+        // A tag with a length that can't fit ends the block, the last byte is always there for it
+        if (pos < BLOCK_END) {
+            block[pos] = STORAGE_RECORD_TRACE;
+            block[pos + 1] = UINT8_MAX;
+        }
+        write_block_to_file(block, MAX_WRITE_SIZE);
+    }
+
+    if (ring_head != ring_tail) {
+        k_work_schedule_for_queue(&housekeeping_work_q, &flight_rec_flush_work, flush_period());
+    }
+}
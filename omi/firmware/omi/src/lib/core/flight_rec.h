@@ -0,0 +1,55 @@
+#ifndef FLIGHT_REC_H
+#define FLIGHT_REC_H
+
+#include <stdint.h>
+#include <zephyr/toolchain.h>
+
+/* Flight recorder: pipeline events go into a RAM ring with a k_cycle_get_32() stamp, and are
+ * written every FLIGHT_REC_FLUSH_MS into the audio stream as STORAGE_RECORD_TRACE records, so a
+ * storage sync brings them back with the audio around them. Each record is a
+ * struct flight_rec_header followed by up to FLIGHT_REC_RECORD_EVENTS events.
+ */
+enum flight_rec_event_id {
+    FLIGHT_REC_MIC_BLOCK,     // arg: samples in the PDM block
+    FLIGHT_REC_CODEC_FRAME,   // arg: encoded bytes, arg8: codec profile
+    FLIGHT_REC_TX_ENQUEUE,    // arg8: 1 queued / 0 tx queue full, arg: tx queue fill in percent
+    FLIGHT_REC_TX_DEQUEUE,    // arg: frame bytes
+    FLIGHT_REC_NOTIFY,        // arg8: 1 sent / 0 failed, arg: bt_gatt_notify_cb() error
+    FLIGHT_REC_SD_START,      // arg8: sd_req_type_t
+    FLIGHT_REC_SD_END,        // arg8: sd_req_type_t, arg: duration in ms
+    FLIGHT_REC_CONN,          // arg8: 1 connected / 0 disconnected, arg: HCI error or reason
+    FLIGHT_REC_CONN_PARAMS,   // arg8: peripheral latency, arg: interval in 1.25 ms units
+    FLIGHT_REC_KEYWORD,       // arg8: codec profile before the boost, arg: 0
+    FLIGHT_REC_DEADLINE,      // arg8: enum monitor_deadline, arg: us past it (saturated)
+    FLIGHT_REC_IMU_GESTURE,   // arg8: enum lsm6dsl_gesture, arg: 0
+    FLIGHT_REC_PLAYBACK_GATE, // arg8: 1 skipping / 0 resumed, arg: frames skipped on resume
+};
+
+struct flight_rec_header {
+    uint32_t uptime_ms;
+    uint32_t utc_s;    // 0 if the clock is unsynced
+    uint32_t cycles;   // k_cycle_get_32() at uptime_ms, the events are stamped on the same clock
+    uint32_t cycle_hz; // of that clock
+    uint16_t lost;     // events overwritten in the ring since the previous record
+} __packed;
+
+struct flight_rec_event {
+    uint32_t cycles;
+    uint8_t id; // enum flight_rec_event_id
+    uint8_t arg8;
+    uint16_t arg;
+} __packed;
+
+#ifdef CONFIG_OMI_ENABLE_FLIGHT_REC
+/**
+ * @brief Record an event, callable from any context including ISRs
+ */
+void flight_rec_log(enum flight_rec_event_id id, uint8_t arg8, uint16_t arg);
+#define FLIGHT_REC(id, arg8, arg) flight_rec_log(id, arg8, arg)
+#else
+#define FLIGHT_REC(id, arg8, arg)                                                                                      \
+    do {                                                                                                               \
+    } while (0)
+#endif
+
+#endif // FLIGHT_REC_H
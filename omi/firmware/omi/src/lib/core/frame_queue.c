@@ -0,0 +1,98 @@
+#include "frame_queue.h"
+
+#include <string.h>
+
+#define FRAME_HEADER_SIZE 2
+#define FRAME_WRAP_MARKER 0xFFFF
+
+static inline void write_header(uint8_t *at, uint16_t value)
+{
+    at[0] = value & 0xFF;
+    at[1] = (value >> 8) & 0xFF;
+}
+
+static inline uint16_t read_header(const uint8_t *at)
+{
+    return at[0] | (at[1] << 8);
+}
+
+void frame_queue_init(struct frame_queue *queue, uint8_t *buf, uint32_t size)
+{
+    queue->buf = buf;
+    queue->size = size;
+    queue->put_pos = 0;
+    queue->get_pos = 0;
+    atomic_set(&queue->head, 0);
+    atomic_set(&queue->tail, 0);
+}
+
+uint8_t *frame_queue_put_claim(struct frame_queue *queue, uint16_t len)
+{
+    uint32_t head = (uint32_t) atomic_get(&queue->head);
+    uint32_t tail = (uint32_t) atomic_get(&queue->tail);
+    uint32_t need = FRAME_HEADER_SIZE + len;
+
+    // head must never catch up with tail, otherwise a full queue would look empty
+    if (head >= tail) {
+        if (need < queue->size - head) {
+            queue->put_pos = head;
+        } else if (need < tail) {
+            queue->put_pos = 0;
+        } else {
+            return NULL;
+        }
+    } else if (head + need < tail) {
+        queue->put_pos = head;
+    } else {
+        return NULL;
+    }
+
+    return queue->buf + queue->put_pos + FRAME_HEADER_SIZE;
+}
+
+void frame_queue_put_finish(struct frame_queue *queue, uint16_t len)
+{
+    uint32_t head = (uint32_t) atomic_get(&queue->head);
+
+    // Tell the consumer to skip the unused end of the buffer
+    if (queue->put_pos != head && queue->size - head >= FRAME_HEADER_SIZE) {
+        write_header(queue->buf + head, FRAME_WRAP_MARKER);
+    }
+    write_header(queue->buf + queue->put_pos, len);
+
+    atomic_set(&queue->head, (atomic_val_t) (queue->put_pos + FRAME_HEADER_SIZE + len));
+}
+
+uint16_t frame_queue_get_claim(struct frame_queue *queue, uint8_t **data)
+{
+    uint32_t tail = (uint32_t) atomic_get(&queue->tail);
+    uint32_t head = (uint32_t) atomic_get(&queue->head);
+
+    if (tail == head) {
+        return 0;
+    }
+
+    // The producer wrapped: nothing else fits behind tail
+    if (queue->size - tail < FRAME_HEADER_SIZE || read_header(queue->buf + tail) == FRAME_WRAP_MARKER) {
+        tail = 0;
+        atomic_set(&queue->tail, 0);
+    }
+
+    uint16_t len = read_header(queue->buf + tail);
+    *data = queue->buf + tail + FRAME_HEADER_SIZE;
+    queue->get_pos = tail + FRAME_HEADER_SIZE + len;
+    return len;
+}
+
+void frame_queue_get_finish(struct frame_queue *queue)
+{
+    atomic_set(&queue->tail, (atomic_val_t) queue->get_pos);
+}
+
+uint32_t frame_queue_used(struct frame_queue *queue)
+{
+    uint32_t head = (uint32_t) atomic_get(&queue->head);
+    uint32_t tail = (uint32_t) atomic_get(&queue->tail);
+
+    return head >= tail ? head - tail : queue->size - tail + head;
+}
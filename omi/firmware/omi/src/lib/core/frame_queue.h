@@ -0,0 +1,61 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <stdint.h>
+#include <zephyr/sys/atomic.h>
+
+/**
+ * Single-producer/single-consumer queue of variable-length frames.
+ *
+ * Every frame is stored contiguously behind a 2-byte length, so both sides
+ * work on the frame in place through claim/finish pairs. A frame that does
+ * not fit before the end of the buffer starts again at offset 0.
+ * No locking: the producer only moves head, the consumer only moves tail.
+ */
+struct frame_queue {
+    uint8_t *buf;
+    uint32_t size;
+    atomic_t head;
+    atomic_t tail;
+    uint32_t put_pos; // producer only
+    uint32_t get_pos; // consumer only
+};
+
+/**
+ * @brief Initialize an empty queue on top of a caller-provided buffer
+ */
+void frame_queue_init(struct frame_queue *queue, uint8_t *buf, uint32_t size);
+
+/**
+ * @brief Reserve room for a frame of the given length
+ *
+ * @return Pointer to write the frame to, or NULL if the queue is too full
+ */
+uint8_t *frame_queue_put_claim(struct frame_queue *queue, uint16_t len);
+
+/**
+ * @brief Publish the frame written into the last claimed slot
+ *
+ * @param len Length actually written, no more than the claimed length
+ */
+void frame_queue_put_finish(struct frame_queue *queue, uint16_t len);
+
+/**
+ * @brief Get the oldest frame without removing it
+ *
+ * @param data Set to the start of the frame
+ * @return Frame length, or 0 if the queue is empty
+ */
+uint16_t frame_queue_get_claim(struct frame_queue *queue, uint8_t **data);
+
+/**
+ * @brief Remove the frame returned by the last frame_queue_get_claim()
+ */
+void frame_queue_get_finish(struct frame_queue *queue);
+
+/**
+ * @brief Bytes currently taken by queued frames and their headers
+ */
+uint32_t frame_queue_used(struct frame_queue *queue);
+
+#endif // FRAME_QUEUE_H
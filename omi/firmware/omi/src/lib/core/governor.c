@@ -0,0 +1,333 @@
+#include "governor.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+#include <zephyr/sys/atomic.h>
+
+#include "accel.h"
+#include "codec.h"
+#include "config.h"
+#include "housekeeping.h"
+#include "led.h"
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "monitor.h"
+#endif
+#include "power.h"
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+#include "sd_card.h"
+#endif
+#include "subscription.h"
+#include "transport.h"
+
+LOG_MODULE_REGISTER(governor, CONFIG_LOG_DEFAULT_LEVEL);
+
+#ifndef CONFIG_OMI_ENABLE_BATTERY
+#error "CONFIG_OMI_ENABLE_GOVERNOR picks its tier from the battery level, enable CONFIG_OMI_ENABLE_BATTERY"
+#endif
+
+extern bool is_charging;
+
+// What each tier lets the rest of the firmware use
+struct governor_limits {
+    uint8_t codec_profile; // highest CODEC_PROFILE_*
+    uint8_t adv_floor;     // fastest enum transport_adv_stage
+    uint8_t led_level;     // LED brightness, percent
+    uint16_t imu_hz;       // highest IMU streaming rate
+    bool wifi;
+};
+
+static const struct governor_limits tier_limits[GOVERNOR_TIER_COUNT] = {
+    [GOVERNOR_TIER_FULL] = {CODEC_PROFILE_HIGH_FIDELITY, TRANSPORT_ADV_FAST, 100, UINT16_MAX, true},
+    [GOVERNOR_TIER_SAVER] = {CODEC_PROFILE_BALANCED, TRANSPORT_ADV_STANDARD, 50, 52, true},
+    [GOVERNOR_TIER_LOW] = {CODEC_PROFILE_LOW_POWER, TRANSPORT_ADV_SLOW, 20, 26, false},
+    [GOVERNOR_TIER_CRITICAL] = {CODEC_PROFILE_LOW_POWER, TRANSPORT_ADV_SLOW, 0, 26, false},
+};
+
+// Battery level at or below which each tier is entered
+static const uint8_t tier_enter_percent[GOVERNOR_TIER_COUNT] = {
+    [GOVERNOR_TIER_FULL] = 100,
+    [GOVERNOR_TIER_SAVER] = GOVERNOR_SAVER_PERCENT,
+    [GOVERNOR_TIER_LOW] = GOVERNOR_LOW_PERCENT,
+    [GOVERNOR_TIER_CRITICAL] = GOVERNOR_CRITICAL_PERCENT,
+};
+
+static const char *const tier_names[GOVERNOR_TIER_COUNT] = {"full", "saver", "low", "critical"};
+
+static struct governor_state state = {
+    .tier = GOVERNOR_TIER_FULL,
+    .runtime_min = GOVERNOR_RUNTIME_UNKNOWN,
+};
+static struct k_spinlock state_lock;
+static atomic_t forced_tier = ATOMIC_INIT(GOVERNOR_TIER_COUNT); // GOVERNOR_TIER_COUNT while automatic
+static uint8_t battery_tier = GOVERNOR_TIER_FULL;                 // work handler only
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+static bool runtime_short = false; // projected runtime below GOVERNOR_MIN_RUNTIME_MIN, one tier lower
+static uint32_t last_energy_uah;
+static int64_t last_energy_ms = 0;
+#endif
+
+static ssize_t governor_read_handler(struct bt_conn *conn,
+                                     const struct bt_gatt_attr *attr,
+                                     void *buf,
+                                     uint16_t len,
+                                     uint16_t offset);
+static void governor_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+//
+// Service and Characteristic
+//
+// Governor service with UUID 19B10070-E8F2-537E-4F6C-D104768A1214
+// exposes following characteristics:
+// - Tier (UUID 19B10071-E8F2-537E-4F6C-D104768A1214) struct governor_state (read/notify on change)
+static struct bt_uuid_128 governor_service_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10070, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 governor_tier_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10071, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+
+static struct bt_gatt_attr governor_service_attr[] = {
+    BT_GATT_PRIMARY_SERVICE(&governor_service_uuid),
+    BT_GATT_CHARACTERISTIC(&governor_tier_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ,
+                           governor_read_handler,
+                           NULL,
+                           NULL),
+    BT_GATT_CCC(governor_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+};
+
+static struct bt_gatt_service governor_service = BT_GATT_SERVICE(governor_service_attr);
+static struct subscription governor_subscription = SUBSCRIPTION_INIT;
+
+static void governor_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(governor_work, governor_work_handler);
+
+static ssize_t governor_read_handler(struct bt_conn *conn,
+                                     const struct bt_gatt_attr *attr,
+                                     void *buf,
+                                     uint16_t len,
+                                     uint16_t offset)
+{
+    struct governor_state value;
+    governor_get_state(&value);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &value, sizeof(value));
+}
+
+static void governor_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    subscription_update(&governor_subscription, value);
+}
+
+static void governor_notify(const struct governor_state *value)
+{
+    struct bt_conn *conn = get_current_connection();
+    if (conn && subscription_is_notifying(&governor_subscription)) {
+        transport_notify(conn, &governor_service.attrs[1], value, sizeof(*value));
+    }
+}
+
+//
+// Tier selection
+//
+
+// Lower tiers are entered at their threshold, but only left once the level is
+// GOVERNOR_HYSTERESIS_PERCENT above it, so a reading wobbling at a threshold changes nothing
+static uint8_t tier_for_percent(uint8_t percent, uint8_t current)
+{
+    uint8_t tier = GOVERNOR_TIER_FULL;
+    for (uint8_t t = GOVERNOR_TIER_SAVER; t < GOVERNOR_TIER_COUNT; t++) {
+        if (percent <= tier_enter_percent[t]) {
+            tier = t;
+        }
+    }
+    if (tier >= current) {
+        return tier;
+    }
+    while (current > tier && percent > tier_enter_percent[current] + GOVERNOR_HYSTERESIS_PERCENT) {
+        current--;
+    }
+    return current;
+}
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+// Projects the runtime left at the drain the energy ledger saw since the last check
+static uint16_t runtime_projection(uint8_t percent, uint16_t previous)
+{
+    uint32_t uah = monitor_get_energy_total_uah();
+    int64_t now = k_uptime_get();
+    uint16_t runtime = previous;
+
+    // The ledger goes back to zero on every metrics reset, such a window is skipped
+    if (last_energy_ms && uah > last_energy_uah && now > last_energy_ms) {
+        uint64_t avg_ua = (uint64_t) (uah - last_energy_uah) * 3600000 / (uint64_t) (now - last_energy_ms);
+        uint64_t left_uah = (uint64_t) GOVERNOR_BATTERY_UAH * percent / 100;
+        runtime = (uint16_t) MIN(left_uah * 60 / MAX(avg_ua, 1), GOVERNOR_RUNTIME_UNKNOWN - 1);
+    }
+    last_energy_uah = uah;
+    last_energy_ms = now;
+    return runtime;
+}
+#endif
+
+static void governor_apply(uint8_t tier)
+{
+    const struct governor_limits *limits = &tier_limits[tier];
+
+    codec_set_profile_cap(limits->codec_profile);
+    transport_set_adv_floor(limits->adv_floor);
+    led_set_max_level(limits->led_level);
+#if defined(CONFIG_OMI_ENABLE_ACCELEROMETER) && defined(CONFIG_OMI_ENABLE_ACCEL_FIFO)
+    accel_set_max_rate(limits->imu_hz);
+#endif
+    // Last, it may wait for the Wi-Fi interface to go down
+    power_set_wifi_allowed(limits->wifi);
+}
+
+static void governor_work_handler(struct k_work *work)
+{
+    struct governor_state next;
+    governor_get_state(&next);
+
+    // 0 until the first battery reading, the device shuts down long before a real 0%
+    next.charging = is_charging;
+    if (battery_percentage || is_charging) {
+        next.battery_percent = battery_percentage;
+        battery_tier = is_charging ? GOVERNOR_TIER_FULL : tier_for_percent(battery_percentage, battery_tier);
+    }
+
+    uint8_t tier = battery_tier;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    next.runtime_min = runtime_projection(next.battery_percent, next.runtime_min);
+    if (next.runtime_min != GOVERNOR_RUNTIME_UNKNOWN && !is_charging) {
+        // The lower tier draws less, so it is only left with a margin
+        if (next.runtime_min < GOVERNOR_MIN_RUNTIME_MIN) {
+            runtime_short = true;
+        } else if (next.runtime_min >= GOVERNOR_MIN_RUNTIME_MIN * 3 / 2) {
+            runtime_short = false;
+        }
+    }
+    if (runtime_short && !is_charging) {
+        tier = MIN(tier + 1, GOVERNOR_TIER_CRITICAL);
+    }
+#endif
+
+    uint8_t forced = (uint8_t) atomic_get(&forced_tier);
+    next.forced = forced < GOVERNOR_TIER_COUNT;
+    if (next.forced) {
+        tier = forced;
+    }
+
+    bool changed = tier != state.tier;
+    next.tier = tier;
+    if (changed) {
+        LOG_INF("Tier %s -> %s (battery %u%%%s, runtime %u min%s)", tier_names[state.tier], tier_names[tier],
+                next.battery_percent, next.charging ? ", charging" : "", next.runtime_min,
+                next.forced ? ", forced" : "");
+        governor_apply(tier);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&state_lock);
+    state = next;
+    k_spin_unlock(&state_lock, key);
+
+    if (changed) {
+        governor_notify(&next);
+    }
+    k_work_reschedule_for_queue(&housekeeping_work_q, &governor_work, K_MSEC(GOVERNOR_INTERVAL_MS));
+}
+
+int governor_start(void)
+{
+    // The first battery reading may still be on its way, the handler waits for it
+    int err = k_work_schedule_for_queue(&housekeeping_work_q, &governor_work, K_NO_WAIT);
+    if (err < 0) {
+        LOG_ERR("Failed to start the governor (err %d)", err);
+        return err;
+    }
+    LOG_INF("Governor started, checking every %d s", GOVERNOR_INTERVAL_MS / 1000);
+    return 0;
+}
+
+int governor_service_init(void)
+{
+    int err = bt_gatt_service_register(&governor_service);
+    if (err) {
+        LOG_ERR("Failed to register governor service (err %d)", err);
+    }
+    return err;
+}
+
+void governor_get_state(struct governor_state *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&state_lock);
+    *out = state;
+    k_spin_unlock(&state_lock, key);
+}
+
+#ifdef CONFIG_SHELL
+static int cmd_governor_status(const struct shell *sh, size_t argc, char **argv)
+{
+    struct governor_state value;
+    governor_get_state(&value);
+    const struct governor_limits *limits = &tier_limits[value.tier];
+
+    shell_print(sh, "Tier %s%s, battery %u%%%s", tier_names[value.tier], value.forced ? " (forced)" : "",
+                value.battery_percent, value.charging ? ", charging" : "");
+    if (value.runtime_min == GOVERNOR_RUNTIME_UNKNOWN) {
+        shell_print(sh, "Runtime unknown");
+    } else {
+        shell_print(sh, "Runtime %u min at the recent drain", value.runtime_min);
+    }
+    shell_print(sh, "Codec profile <= %u, advertising >= stage %u, LEDs %u%%, IMU <= %u Hz, Wi-Fi %s",
+                limits->codec_profile, limits->adv_floor, limits->led_level, limits->imu_hz,
+                limits->wifi ? "allowed" : "off");
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    struct sd_capacity capacity;
+    sd_get_capacity(&capacity);
+    shell_print(sh, "Card %u MB, %u MB free, room for %u MB of audio", capacity.card_kb >> 10,
+                capacity.free_kb >> 10, capacity.room_bytes >> 20);
+#endif
+    return 0;
+}
+
+static int cmd_governor_force(const struct shell *sh, size_t argc, char **argv)
+{
+    uint8_t tier = GOVERNOR_TIER_COUNT;
+    for (uint8_t t = 0; t < GOVERNOR_TIER_COUNT; t++) {
+        if (!strcmp(argv[1], tier_names[t])) {
+            tier = t;
+        }
+    }
+    if (tier == GOVERNOR_TIER_COUNT) {
+        shell_error(sh, "Unknown tier %s, one of full, saver, low, critical", argv[1]);
+        return -EINVAL;
+    }
+
+    atomic_set(&forced_tier, tier);
+    k_work_reschedule_for_queue(&housekeeping_work_q, &governor_work, K_NO_WAIT);
+    shell_print(sh, "Holding tier %s", tier_names[tier]);
+    return 0;
+}
+
+static int cmd_governor_auto(const struct shell *sh, size_t argc, char **argv)
+{
+    atomic_set(&forced_tier, GOVERNOR_TIER_COUNT);
+    k_work_reschedule_for_queue(&housekeeping_work_q, &governor_work, K_NO_WAIT);
+    shell_print(sh, "Tier follows the battery again");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(governor_cmds,
+                               SHELL_CMD(status, NULL, "Show the tier and its limits", cmd_governor_status),
+                               SHELL_CMD_ARG(force, NULL, "Hold <full|saver|low|critical>", cmd_governor_force, 2, 0),
+                               SHELL_CMD(auto, NULL, "Pick the tier from the battery again", cmd_governor_auto),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(governor, &governor_cmds, "Battery-aware performance governor", NULL);
+#endif
@@ -0,0 +1,55 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdint.h>
+
+/**
+ * Performance tiers, stepped through as the battery runs down. Each tier caps what the ones
+ * above it allow: the codec profile, the advertising stages, LED brightness, the IMU streaming
+ * rate and Wi-Fi. Settings chosen by the user stay as they are and come back with the tier.
+ */
+enum governor_tier {
+    GOVERNOR_TIER_FULL,     // Everything as configured, also whenever charging
+    GOVERNOR_TIER_SAVER,    // Balanced codec at most, no fast advertising, LEDs at half, IMU at 52 Hz
+    GOVERNOR_TIER_LOW,      // Low-power codec, slow advertising only, dim LEDs, IMU at 26 Hz, no Wi-Fi
+    GOVERNOR_TIER_CRITICAL, // As low, with the LEDs off
+    GOVERNOR_TIER_COUNT,
+};
+
+#define GOVERNOR_RUNTIME_UNKNOWN 0xFFFF
+
+/**
+ * @brief Value of the tier characteristic, little endian
+ */
+struct governor_state {
+    uint8_t tier;            // enum governor_tier
+    uint8_t battery_percent; // the reading the tier was chosen on
+    uint8_t charging;
+    uint8_t forced;          // 1 while the shell holds the tier
+    uint16_t runtime_min;    // projected at the recent drain, GOVERNOR_RUNTIME_UNKNOWN without the monitor
+} __attribute__((packed));
+
+/**
+ * @brief Start checking the battery every GOVERNOR_INTERVAL_MS
+ *
+ * Call after the battery, the codec and the transport are up.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int governor_start(void);
+
+/**
+ * @brief Register the governor GATT service
+ *
+ * The tier characteristic can be read at any time and, once subscribed, is notified on every tier change.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int governor_service_init(void);
+
+/**
+ * @brief Get the current tier and what it was chosen on
+ */
+void governor_get_state(struct governor_state *state);
+
+#endif // GOVERNOR_H
@@ -13,11 +13,34 @@
  */
 int haptic_init(void);
 
+// Predefined waveforms for haptic_play()
+enum haptic_pattern {
+    HAPTIC_PULSE_SHORT,  // 100ms
+    HAPTIC_PULSE_MEDIUM, // 300ms
+    HAPTIC_PULSE_LONG,   // 500ms
+    HAPTIC_DOUBLE,       // two short buzzes
+    HAPTIC_TRIPLE,       // three short buzzes
+    HAPTIC_ALERT,        // three long buzzes
+    HAPTIC_PATTERN_COUNT
+};
+
+/**
+ * @brief Queue a predefined haptic pattern.
+ *
+ * Returns immediately; patterns play back to back from a kernel timer.
+ * Safe to call from any thread, work item or interrupt.
+ *
+ * @param pattern Waveform to play.
+ * @return 0 on success, -ENOMEM if the queue is full, other negative error code otherwise.
+ */
+int haptic_play(enum haptic_pattern pattern);
+
 /**
  * @brief Play a haptic effect for a specified duration.
  *
- * Activates the haptic motor for the given duration in milliseconds.
- * The duration is capped by MAX_HAPTIC_DURATION.
+ * Activates the haptic motor for the given duration in milliseconds, replacing
+ * anything playing or queued. Returns immediately. The duration is capped by
+ * MAX_HAPTIC_DURATION, 0 stops the motor.
  *
  * @param duration Duration in milliseconds.
  */
@@ -30,6 +53,9 @@ void play_haptic_milli(uint32_t duration);
  */
 void register_haptic_service(void);
 
+/**
+ * @brief Stop the motor now and drop any queued patterns.
+ */
 void haptic_off();
 
 #endif // HAPTIC_H_
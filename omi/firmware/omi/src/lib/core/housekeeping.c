@@ -0,0 +1,20 @@
+#include "housekeeping.h"
+
+#include "config.h"
+
+K_THREAD_STACK_DEFINE(housekeeping_stack, HOUSEKEEPING_STACK_SIZE);
+struct k_work_q housekeeping_work_q;
+
+void housekeeping_start(void)
+{
+    struct k_work_queue_config cfg = {
+        .name = "housekeeping",
+        .no_yield = false,
+    };
+
+    k_work_queue_start(&housekeeping_work_q,
+                       housekeeping_stack,
+                       K_THREAD_STACK_SIZEOF(housekeeping_stack),
+                       K_PRIO_PREEMPT(THREAD_PRIO_HOUSEKEEPING),
+                       &cfg);
+}
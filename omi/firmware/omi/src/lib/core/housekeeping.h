@@ -0,0 +1,20 @@
+#ifndef HOUSEKEEPING_H
+#define HOUSEKEEPING_H
+
+#include <zephyr/kernel.h>
+
+/*
+ * Low-priority work queue for periodic and deferred bookkeeping: battery readings, LED patterns,
+ * settings and trace flushes, metrics sampling. Anything that may busy-wait, hold a mutex or write
+ * flash goes here, so the system work queue stays free for button, link and IMU events.
+ */
+extern struct k_work_q housekeeping_work_q;
+
+/**
+ * @brief Start the housekeeping work queue
+ *
+ * Must be called before any work is submitted to it, first thing in main().
+ */
+void housekeeping_start(void);
+
+#endif
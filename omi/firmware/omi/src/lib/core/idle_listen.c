@@ -0,0 +1,111 @@
+#include "idle_listen.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+#include "config.h"
+#include "imu.h"
+#include "mic.h"
+#include "power.h"
+
+LOG_MODULE_REGISTER(idle_listen, CONFIG_LOG_DEFAULT_LEVEL);
+
+#ifndef CONFIG_OMI_ENABLE_VAD
+#error "CONFIG_OMI_ENABLE_IDLE_LISTEN needs CONFIG_OMI_ENABLE_VAD to hear speech"
+#endif
+
+enum listen_state {
+    LISTEN_ACTIVE, // full capture
+    LISTEN_IDLE,   // mic paused until the next probe
+    LISTEN_PROBE,  // mic on for a short listen
+};
+
+// Only the work handler changes the state; the IMU interrupt and the codec only leave timestamps
+static enum listen_state listen_state = LISTEN_ACTIVE;
+static atomic_t last_motion_ms = ATOMIC_INIT(0);
+static atomic_t last_voice_ms = ATOMIC_INIT(0);
+
+static void idle_listen_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(idle_listen_work, idle_listen_work_handler);
+
+static void enter_active(const char *reason)
+{
+    power_release(POWER_ACTIVITY_QUIET);
+    listen_state = LISTEN_ACTIVE;
+    LOG_INF("Full capture (%s)", reason);
+    k_work_reschedule(&idle_listen_work, K_MSEC(IDLE_LISTEN_CHECK_MS));
+}
+
+static void enter_idle(void)
+{
+    power_request(POWER_ACTIVITY_QUIET);
+    listen_state = LISTEN_IDLE;
+    k_work_reschedule(&idle_listen_work, K_MSEC(IDLE_LISTEN_PERIOD_MS - IDLE_LISTEN_PROBE_MS));
+}
+
+static void idle_listen_work_handler(struct k_work *work)
+{
+    uint32_t now = k_uptime_get_32();
+    uint32_t last_activity = MAX((uint32_t) atomic_get(&last_motion_ms), (uint32_t) atomic_get(&last_voice_ms));
+
+    switch (listen_state) {
+    case LISTEN_ACTIVE:
+        if (now - last_activity >= IDLE_LISTEN_AFTER_MS && mic_is_running()) {
+            LOG_INF("No motion or speech for %u s, listening every %u ms", (now - last_activity) / 1000,
+                    IDLE_LISTEN_PERIOD_MS);
+            enter_idle();
+        } else {
+            k_work_reschedule(&idle_listen_work, K_MSEC(IDLE_LISTEN_CHECK_MS));
+        }
+        break;
+
+    case LISTEN_IDLE:
+        if (now - last_activity < IDLE_LISTEN_AFTER_MS) {
+            enter_active("motion");
+        } else {
+            power_release(POWER_ACTIVITY_QUIET);
+            listen_state = LISTEN_PROBE;
+            k_work_reschedule(&idle_listen_work, K_MSEC(IDLE_LISTEN_PROBE_MS));
+        }
+        break;
+
+    case LISTEN_PROBE:
+        if (now - last_activity < IDLE_LISTEN_AFTER_MS) {
+            enter_active(now - (uint32_t) atomic_get(&last_voice_ms) < IDLE_LISTEN_AFTER_MS ? "speech" : "motion");
+        } else {
+            enter_idle();
+        }
+        break;
+    }
+}
+
+static void idle_listen_motion(void)
+{
+    atomic_set(&last_motion_ms, (atomic_val_t) k_uptime_get_32());
+    if (listen_state != LISTEN_ACTIVE) {
+        k_work_reschedule(&idle_listen_work, K_NO_WAIT);
+    }
+}
+
+void idle_listen_voice(void)
+{
+    atomic_set(&last_voice_ms, (atomic_val_t) k_uptime_get_32());
+    if (listen_state == LISTEN_PROBE) {
+        k_work_reschedule(&idle_listen_work, K_NO_WAIT);
+    }
+}
+
+int idle_listen_start(void)
+{
+    atomic_set(&last_motion_ms, (atomic_val_t) k_uptime_get_32());
+
+    // Without the interrupt only speech can end an idle stretch, so don't start one
+    int err = lsm6dsl_motion_wake_enable(idle_listen_motion);
+    if (err) {
+        return err;
+    }
+
+    k_work_reschedule(&idle_listen_work, K_MSEC(IDLE_LISTEN_CHECK_MS));
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef IDLE_LISTEN_H
+#define IDLE_LISTEN_H
+
+/**
+ * @brief Start motion-gated mic duty cycling
+ *
+ * After IDLE_LISTEN_AFTER_MS without motion or speech the mic is paused and only switched on for
+ * IDLE_LISTEN_PROBE_MS every IDLE_LISTEN_PERIOD_MS to listen for voice. Speech in a probe or a
+ * wake-on-motion interrupt from the IMU restores full capture. Call after mic_start().
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int idle_listen_start(void);
+
+/**
+ * @brief Report that the current mic frame holds speech
+ *
+ * Called by the codec thread from the VAD.
+ */
+void idle_listen_voice(void);
+
+#endif
@@ -0,0 +1,335 @@
+#include "kws.h"
+
+#include <arm_math.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+#include "config.h"
+#include "housekeeping.h"
+#include "settings.h"
+
+LOG_MODULE_REGISTER(kws, CONFIG_LOG_DEFAULT_LEVEL);
+
+// One feature vector per 20ms frame: 16 log band energies relative to their mean (the spectral
+// shape, independent of loudness), and the frame energy above the noise floor. Energies are log2
+// in Q4, 16 steps per 3dB. The frame is zero-padded to the FFT size, 31.25Hz per bin at either rate.
+#if AUDIO_SAMPLE_RATE == 8000
+#define KWS_FFT_ORDER 8
+#else
+#define KWS_FFT_ORDER 9
+#endif
+#define KWS_FFT_SIZE (1 << KWS_FFT_ORDER)
+#define KWS_BANDS 16
+#define KWS_FEATURES (KWS_BANDS + 1)
+#define KWS_COST_MAX (UINT32_MAX / 2)
+
+BUILD_ASSERT(KWS_FFT_SIZE >= CODEC_PACKAGE_SAMPLES, "FFT must hold a whole frame");
+BUILD_ASSERT(KWS_TEMPLATE_FRAMES <= UINT8_MAX, "Template frames are counted in a byte");
+BUILD_ASSERT(1 + KWS_TEMPLATE_FRAMES * KWS_FEATURES <= KWS_TEMPLATE_MAX_BYTES, "Template must fit its setting");
+
+// First bin of each band, roughly mel spaced from 60Hz to 4kHz
+static const uint8_t kws_band_edges[KWS_BANDS + 1] = {
+    2, 4, 6, 8, 11, 14, 18, 22, 27, 33, 40, 48, 58, 70, 85, 104, 128,
+};
+
+struct kws_template {
+    uint8_t count;
+    int8_t features[KWS_TEMPLATE_FRAMES][KWS_FEATURES];
+} __packed;
+
+static arm_rfft_instance_q31 fft;
+static q31_t window[CODEC_PACKAGE_SAMPLES];
+static q31_t fft_buffer[KWS_FFT_SIZE];
+static q31_t spectrum[2 * KWS_FFT_SIZE];
+static int32_t noise_floor_q4 = INT32_MAX;
+
+static struct kws_template template;  // enrolled wake phrase, count 0 if none
+static struct kws_template enrolling; // utterance being captured
+static struct kws_template saving;    // copy of template for the housekeeping thread to save
+static struct k_spinlock template_lock; // codec thread changing template vs. the copy
+static uint32_t cost[KWS_TEMPLATE_FRAMES]; // best path ending at each template frame
+static uint16_t path_len[KWS_TEMPLATE_FRAMES];
+static uint16_t refractory = 0;  // frames left before the next detection may fire
+static uint16_t backoff = 0;     // frames left with the spotter skipped after it ran over budget
+
+static uint16_t enroll_wait = 0; // frames left for the utterance to start
+static uint8_t enroll_voiced = 0; // frames up to and including the last voiced one
+static uint8_t enroll_gap = 0;
+
+enum kws_request {
+    KWS_REQUEST_NONE,
+    KWS_REQUEST_ENROLL,
+    KWS_REQUEST_FORGET,
+};
+static atomic_t request = ATOMIC_INIT(KWS_REQUEST_NONE);
+static atomic_t state = ATOMIC_INIT(KWS_STATE_NONE);
+
+static void save_work_handler(struct k_work *work)
+{
+    // Saving takes a flash write, the codec thread must not wait on it
+    k_spinlock_key_t key = k_spin_lock(&template_lock);
+    memcpy(&saving, &template, 1 + template.count * KWS_FEATURES);
+    k_spin_unlock(&template_lock, key);
+
+    int err = app_settings_save_kws_template((const uint8_t *) &saving, 1 + saving.count * KWS_FEATURES);
+    if (err) {
+        LOG_ERR("Failed to save the wake phrase (err %d)", err);
+    }
+}
+
+static K_WORK_DEFINE(save_work, save_work_handler);
+
+static int32_t log2_q4(uint64_t x)
+{
+    if (x == 0) {
+        return 0;
+    }
+    int msb = 63 - __builtin_clzll(x);
+    uint32_t frac = msb >= 4 ? (uint32_t) (x >> (msb - 4)) : (uint32_t) (x << (4 - msb));
+    return msb * 16 + (frac & 0xF);
+}
+
+// Returns true if the frame is voiced, meaning well above the noise floor
+static bool extract_features(const int16_t *frame, int8_t *features)
+{
+    for (int n = 0; n < CODEC_PACKAGE_SAMPLES; n++) {
+        fft_buffer[n] = (q31_t) (((int64_t) ((q31_t) frame[n] << 16) * window[n]) >> 31);
+    }
+    memset(&fft_buffer[CODEC_PACKAGE_SAMPLES], 0, (KWS_FFT_SIZE - CODEC_PACKAGE_SAMPLES) * sizeof(q31_t));
+    arm_rfft_q31(&fft, fft_buffer, spectrum);
+
+    int32_t band_log[KWS_BANDS];
+    int32_t mean = 0;
+    uint64_t total = 0;
+    for (int b = 0; b < KWS_BANDS; b++) {
+        uint64_t energy = 0;
+        for (int k = kws_band_edges[b]; k < kws_band_edges[b + 1]; k++) {
+            int64_t re = spectrum[2 * k] >> 12;
+            int64_t im = spectrum[2 * k + 1] >> 12;
+            energy += (uint64_t) (re * re + im * im);
+        }
+        // Per bin, so wide bands don't dominate
+        energy /= kws_band_edges[b + 1] - kws_band_edges[b];
+        band_log[b] = log2_q4(energy);
+        mean += band_log[b];
+        total += energy;
+    }
+    mean /= KWS_BANDS;
+    for (int b = 0; b < KWS_BANDS; b++) {
+        features[b] = (int8_t) CLAMP(band_log[b] - mean, INT8_MIN, INT8_MAX);
+    }
+
+    // Same floor tracking as the VAD: down at once, up only slowly
+    int32_t level = log2_q4(total);
+    if (level < noise_floor_q4) {
+        noise_floor_q4 = level;
+    } else {
+        noise_floor_q4 += (level - noise_floor_q4) >> 6;
+    }
+    int32_t above = level - noise_floor_q4;
+    features[KWS_BANDS] = (int8_t) CLAMP(above, 0, INT8_MAX);
+    return above >= KWS_VOICE_MARGIN_Q4;
+}
+
+static uint32_t distance(const int8_t *a, const int8_t *b)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < KWS_FEATURES; i++) {
+        sum += abs(a[i] - b[i]);
+    }
+    return sum;
+}
+
+static void reset_match(void)
+{
+    for (int j = 0; j < KWS_TEMPLATE_FRAMES; j++) {
+        cost[j] = KWS_COST_MAX;
+        path_len[j] = 0;
+    }
+}
+
+// Subsequence DTW with an open beginning: a path may start at any input frame, so the column of
+// costs is all the state there is and every frame costs one pass over the template
+static bool match(const int8_t *features)
+{
+    uint8_t count = template.count;
+    uint32_t diag = KWS_COST_MAX; // previous column, one template frame back
+    uint16_t diag_len = 0;
+
+    for (int j = 0; j < count; j++) {
+        uint32_t d = distance(features, template.features[j]);
+        uint32_t best = 0;
+        uint16_t best_len = 0;
+        if (j > 0) {
+            // Diagonal (last column, j - 1), input ahead on the same template frame (last column, j),
+            // template ahead on the same input frame (this column, j - 1)
+            best = diag;
+            best_len = diag_len;
+            if (cost[j] < best) {
+                best = cost[j];
+                best_len = path_len[j];
+            }
+            if (cost[j - 1] < best) {
+                best = cost[j - 1];
+                best_len = path_len[j - 1];
+            }
+        }
+        diag = cost[j];
+        diag_len = path_len[j];
+        cost[j] = MIN(best + d, KWS_COST_MAX);
+        path_len[j] = MIN(best_len + 1, UINT16_MAX);
+    }
+
+    uint16_t len = path_len[count - 1];
+    if (len < count / 2 || len > count * 2) {
+        return false;
+    }
+    uint32_t score = cost[count - 1] / len / KWS_FEATURES;
+    if (score > KWS_MATCH_THRESHOLD_Q4) {
+        return false;
+    }
+    LOG_INF("Wake phrase, score %u over %u frames", score, len);
+    return true;
+}
+
+// The utterance runs from its first voiced frame until KWS_ENROLL_GAP_FRAMES without voice
+static void enroll(const int8_t *features, bool voiced)
+{
+    uint8_t count = enrolling.count;
+    if (count == 0 && !voiced) {
+        if (--enroll_wait == 0) {
+            LOG_WRN("No wake phrase heard, enrollment cancelled");
+            atomic_set(&state, template.count ? KWS_STATE_ENROLLED : KWS_STATE_NONE);
+        }
+        return;
+    }
+
+    memcpy(enrolling.features[count], features, KWS_FEATURES);
+    enrolling.count = ++count;
+    if (voiced) {
+        enroll_voiced = count;
+        enroll_gap = 0;
+    } else {
+        enroll_gap++;
+    }
+    if (enroll_gap < KWS_ENROLL_GAP_FRAMES && count < KWS_TEMPLATE_FRAMES) {
+        return;
+    }
+
+    if (enroll_voiced < KWS_TEMPLATE_MIN_FRAMES) {
+        // A click or a cough, keep waiting for the phrase
+        enrolling.count = 0;
+        return;
+    }
+    k_spinlock_key_t key = k_spin_lock(&template_lock);
+    template.count = enroll_voiced;
+    memcpy(template.features, enrolling.features, enroll_voiced * KWS_FEATURES);
+    k_spin_unlock(&template_lock, key);
+    reset_match();
+    refractory = KWS_REFRACTORY_FRAMES;
+    atomic_set(&state, KWS_STATE_ENROLLED);
+    k_work_submit_to_queue(&housekeeping_work_q, &save_work);
+    LOG_INF("Wake phrase enrolled, %u frames", enroll_voiced);
+}
+
+static void handle_request(void)
+{
+    switch (atomic_set(&request, KWS_REQUEST_NONE)) {
+    case KWS_REQUEST_ENROLL:
+        enrolling.count = 0;
+        enroll_voiced = 0;
+        enroll_gap = 0;
+        enroll_wait = KWS_ENROLL_TIMEOUT_FRAMES;
+        atomic_set(&state, KWS_STATE_ENROLLING);
+        break;
+    case KWS_REQUEST_FORGET: {
+        k_spinlock_key_t key = k_spin_lock(&template_lock);
+        template.count = 0;
+        k_spin_unlock(&template_lock, key);
+        atomic_set(&state, KWS_STATE_NONE);
+        k_work_submit_to_queue(&housekeeping_work_q, &save_work);
+        LOG_INF("Wake phrase forgotten");
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool kws_frame(const int16_t *frame)
+{
+    handle_request();
+    uint8_t current = atomic_get(&state);
+    if (current == KWS_STATE_NONE) {
+        return false;
+    }
+    if (backoff > 0) {
+        backoff--;
+        return false;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    int8_t features[KWS_FEATURES];
+    bool voiced = extract_features(frame, features);
+    bool detected = false;
+    if (current == KWS_STATE_ENROLLING) {
+        enroll(features, voiced);
+    } else if (refractory > 0) {
+        refractory--;
+    } else if (match(features)) {
+        detected = true;
+        reset_match();
+        refractory = KWS_REFRACTORY_FRAMES;
+    }
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    // Encoding must not fall behind the mic, give the CPU back for a while
+    if (us > KWS_BUDGET_US) {
+        LOG_WRN("Keyword spotting took %u us, skipping it for %u frames", us, KWS_BACKOFF_FRAMES);
+        backoff = KWS_BACKOFF_FRAMES;
+        reset_match();
+    }
+    return detected;
+}
+
+void kws_enroll(bool enroll)
+{
+    atomic_set(&request, enroll ? KWS_REQUEST_ENROLL : KWS_REQUEST_FORGET);
+    if (enroll) {
+        // Reported at once, the codec thread starts listening with the next frame
+        atomic_set(&state, KWS_STATE_ENROLLING);
+    }
+}
+
+uint8_t kws_get_state(void)
+{
+    return (uint8_t) atomic_get(&state);
+}
+
+int kws_init(void)
+{
+    if (arm_rfft_init_q31(&fft, KWS_FFT_SIZE, 0, 1) != ARM_MATH_SUCCESS) {
+        LOG_ERR("Failed to set up the %d point FFT", KWS_FFT_SIZE);
+        return -EINVAL;
+    }
+    // Hann window over the frame
+    for (int n = 0; n < CODEC_PACKAGE_SAMPLES; n++) {
+        float s = sinf((float) M_PI * n / CODEC_PACKAGE_SAMPLES);
+        window[n] = (q31_t) (s * s * 2147483647.0f);
+    }
+    reset_match();
+
+    int len = app_settings_get_kws_template((uint8_t *) &template, sizeof(template));
+    if (len > 0 && template.count >= KWS_TEMPLATE_MIN_FRAMES && template.count <= KWS_TEMPLATE_FRAMES &&
+        len == 1 + template.count * KWS_FEATURES) {
+        atomic_set(&state, KWS_STATE_ENROLLED);
+        LOG_INF("Listening for the wake phrase, %u frames", template.count);
+    } else {
+        template.count = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef KWS_H
+#define KWS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KWS_STATE_NONE 0      // no wake phrase enrolled, the spotter costs nothing
+#define KWS_STATE_ENROLLED 1  // listening for the wake phrase
+#define KWS_STATE_ENROLLING 2 // the next utterance becomes the wake phrase
+
+/**
+ * @brief Prepare the keyword spotter and load the enrolled wake phrase
+ *
+ * Must be called once before the first kws_frame().
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int kws_init(void);
+
+/**
+ * @brief Run the spotter on one frame
+ *
+ * Computes log band energies of the frame and matches the recent frames against the enrolled
+ * wake phrase with subsequence DTW, all fixed point. Only the codec thread may call this.
+ *
+ * @param frame CODEC_PACKAGE_SAMPLES mono samples
+ * @return true if the wake phrase ended with this frame
+ */
+bool kws_frame(const int16_t *frame);
+
+/**
+ * @brief Enroll the next utterance as the wake phrase, or forget the enrolled one
+ *
+ * Takes effect at the next frame. An enrolled phrase is saved in the settings partition.
+ *
+ * @param enroll true to enroll, false to forget
+ */
+void kws_enroll(bool enroll);
+
+/**
+ * @brief Get the spotter state
+ *
+ * @return One of the KWS_STATE_* values
+ */
+uint8_t kws_get_state(void);
+
+#endif
@@ -25,4 +25,49 @@ void set_led_blue(bool on);
 void set_led_pwm(led_color_t color, uint8_t level);
 void led_off(void);
 
+/**
+ * @brief Scale every LED level, for the performance governor
+ *
+ * Applies from the next time an LED or pattern step is set, 100 (the default) is full brightness.
+ *
+ * @param percent 0-100, 0 keeps the LEDs dark
+ */
+void led_set_max_level(uint8_t percent);
+
+#define LED_MASK(color) (1 << (color))
+
+/**
+ * A precomputed animation: each step holds a PWM level (0-100) on the chosen LEDs for step_ms.
+ */
+struct led_pattern {
+    const uint8_t *levels;
+    uint16_t steps;
+    uint16_t step_ms;
+    uint8_t colors; // LED_MASK() of every LED the levels apply to
+    uint8_t loops;  // times to play it, 0 repeats until stopped
+};
+
+extern const struct led_pattern led_pattern_boot;  // blue pulse while booting
+extern const struct led_pattern led_pattern_ready; // two green fades
+
+/**
+ * @brief Play a pattern in the background, replacing the one playing
+ *
+ * Returns immediately, the steps run from the housekeeping work queue. The LEDs of the
+ * pattern are switched off when it ends.
+ */
+void led_pattern_play(const struct led_pattern *pattern);
+
+/**
+ * @brief Stop the playing pattern and switch its LEDs off
+ *
+ * led_off() does this as well.
+ */
+void led_pattern_stop(void);
+
+/**
+ * @brief Check whether a pattern owns the LEDs, status updates should leave them alone
+ */
+bool led_pattern_active(void);
+
 #endif
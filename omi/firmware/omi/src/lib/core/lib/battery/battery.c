@@ -174,6 +174,11 @@ int battery_get_millivolt(uint16_t *battery_millivolt)
     return ret;
 }
 
+uint32_t battery_refresh_interval_ms(void)
+{
+    return 10000;
+}
+
 int battery_get_percentage(uint8_t *battery_percentage, uint16_t battery_millivolt)
 {
 
@@ -19,6 +19,10 @@
 #ifndef __BATTERY_H__
 #define __BATTERY_H__
 
+#ifndef CONFIG_OMI_BATTERY_CRITICAL_MV
+#define CONFIG_OMI_BATTERY_CRITICAL_MV 3500 // mV, the device shuts down below this
+#endif
+
 /**
  * @brief Set battery charging to fast charge (100mA).
  *
@@ -58,6 +62,16 @@ int battery_charge_stop(void);
  */
 int battery_get_millivolt(uint16_t *battery_millivolt);
 
+/**
+ * @brief Delay until the next battery measurement is worth taking.
+ *
+ * Short while charging, close to the critical level or before the discharge slope is known,
+ * otherwise long enough for about 5mV of change, up to 2 minutes.
+ *
+ * @retval Milliseconds until the next battery_get_millivolt().
+ */
+uint32_t battery_refresh_interval_ms(void);
+
 /**
  * @brief Calculates the battery percentage using the battery voltage.
  *
@@ -74,4 +74,10 @@
 // <o> Complexity <0-10>
 // <i> A number from range 0-10. Higher complexity assures better quality but also higher CPU and memory resources consumption.
 /**@brief Opus Options: Complexity <0-10> */
-// #define CONFIG_OPUS_COMPLEXITY 0
\ No newline at end of file
+// #define CONFIG_OPUS_COMPLEXITY 0
+
+// The inline EDSP macros and the Thumb-2 xcorr kernel need the Cortex-M4 DSP extension. Without it
+// the assembler would reject them deep inside the library, so fail early with a readable message.
+#if defined(OPUS_ARM_PRESUME_EDSP) && !defined(__ARM_FEATURE_DSP)
+#error "Opus EDSP kernels need a core with the DSP extension (-mcpu=cortex-m4), set CONFIG_OMI_OPUS_GENERIC_KERNELS"
+#endif
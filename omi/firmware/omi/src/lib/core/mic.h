@@ -4,7 +4,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-typedef void (*mix_handler)(int16_t *);
+// capture_ms: low 32 bits of the UTC time (ms) at which the frame's first sample was captured, 0 if the clock is unsynced
+typedef void (*mix_handler)(int16_t *frame, uint32_t capture_ms);
+typedef int16_t *(*mic_frame_alloc_handler)(void);
 
 /**
  * @brief Initialize the Microphone
@@ -16,7 +18,48 @@ typedef void (*mix_handler)(int16_t *);
 int mic_start();
 void set_mic_callback(mix_handler _callback);
 
+/**
+ * @brief Set the provider of output frames
+ *
+ * Each captured block is downmixed straight into frames of MIC_FRAME_SAMPLES
+ * mono samples obtained from this allocator, and every filled frame is passed
+ * to the mic callback, which takes ownership of it. A block is MIC_BLOCK_MS,
+ * so each one yields one or more frames in a burst; both run on the mic
+ * thread and must return well within a block.
+ */
+void set_mic_frame_allocator(mic_frame_alloc_handler allocator);
+
 void mic_off();
 void mic_on();
+
+/**
+ * @brief Stop capture without tearing down the mic thread
+ *
+ * No frames are delivered until mic_resume(). Does nothing if already paused.
+ */
+void mic_pause();
+
+/**
+ * @brief Restart capture after mic_pause()
+ */
+void mic_resume();
+
+/**
+ * @brief Check whether the mic is capturing
+ *
+ * @return true between mic_start()/mic_resume() and mic_pause()/mic_off()
+ */
+bool mic_is_running();
+
+/**
+ * @brief Run the PDM at the clock a codec profile asks for
+ *
+ * The lowest clock that gives the PCM rate at the profile's MIC_PDM_RATIO_*. The mic thread
+ * restarts the PDM between blocks, losing at most one block, and logs the clock it got. Nothing
+ * happens if the profile maps to the ratio already running. May be called before mic_start().
+ *
+ * @param profile One of the CODEC_PROFILE_* identifiers, or CODEC_PROFILE_OFFLINE
+ */
+void mic_set_pdm_profile(uint8_t profile);
 void mic_set_gain(uint8_t gain_level);
 #endif
@@ -1,6 +1,27 @@
 #include "monitor.h"
 
+#include <string.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/fatal.h>
+#include <zephyr/kernel.h>
+#include <zephyr/linker/section_tags.h>
 #include <zephyr/logging/log.h>
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/reboot.h>
+
+#include "config.h"
+#include "flight_rec.h"
+#include "housekeeping.h"
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+#include "pipe_stats.h"
+#endif
+#include "subscription.h"
+#include "transport.h"
 
 LOG_MODULE_REGISTER(monitor, CONFIG_LOG_DEFAULT_LEVEL);
 
@@ -11,17 +32,430 @@ static uint32_t broadcast_audio_count = 0;
 static uint32_t broadcast_audio_failed_count = 0;
 static uint32_t write_to_tx_queue_count = 0;
 static uint32_t storage_write_count = 0;
+static uint32_t encode_skip_count = 0;
+
+// Audio path queues and drops, updated from several threads
+static atomic_t queue_high_water[MONITOR_QUEUE_COUNT];
+static atomic_t drop_count[MONITOR_DROP_COUNT];
+
+// SD card latency, errors and throughput. The SD worker updates them while the report and reset run
+// on other threads, so they are only touched under sd_lock
+static struct k_spinlock sd_lock;
+static uint32_t sd_write_samples = 0;
+static uint32_t sd_write_total_ms = 0;
+static uint32_t sd_write_max_ms = 0;
+static uint16_t sd_latency_hist[MONITOR_SD_OP_COUNT][MONITOR_SD_LATENCY_BUCKETS];
+static uint16_t sd_errors[MONITOR_SD_OP_COUNT];
+static uint32_t sd_bytes[MONITOR_SD_OP_COUNT];
+static uint32_t sd_busy_ms[MONITOR_SD_OP_COUNT];
+static struct monitor_sd_card sd_card;
+
+// Boot timelines, kept across warm resets. A bad magic means the RAM was lost (power-on)
+#define BOOT_LOG_MAGIC 0x544F4F42 // "BOOT"
+
+struct boot_log {
+    uint32_t magic;
+    uint32_t next;
+    struct monitor_boot_record records[MONITOR_BOOT_HISTORY];
+};
+
+static struct boot_log boot_log __noinit;
+static struct monitor_boot_record *boot_current;
+static struct k_spinlock boot_lock;
+
+// Reset forensics: progress is kept in plain RAM and only copied into retained RAM by a capture
+#define FORENSICS_MAGIC 0x534E4546 // "FENS"
+
+struct forensics_log {
+    uint32_t magic;
+    struct monitor_forensics snapshot;
+};
+
+static struct forensics_log forensics_log __noinit;
+static struct monitor_forensics last_reset; // Left by the previous boot, taken over by monitor_init()
+static atomic_t queue_level[MONITOR_QUEUE_COUNT];
+static uint8_t worker_step[MONITOR_WORKER_COUNT];
+static uint32_t worker_step_ms[MONITOR_WORKER_COUNT];
+static uint8_t sd_request = MONITOR_SD_IDLE;
+static uint32_t sd_request_ms;
+static uint32_t last_notify_ms; // 0 until the first notification
+
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+// Stage latencies in us, each stage written by a single thread
+static struct pipe_stats stage_traces[MONITOR_STAGE_COUNT];
+
+// Deadline misses, each deadline written by a single thread
+static const uint32_t deadline_us[MONITOR_DEADLINE_COUNT] = {
+    [MONITOR_DEADLINE_ENCODE] = DEADLINE_ENCODE_MS * 1000,
+    [MONITOR_DEADLINE_PUSH] = DEADLINE_PUSH_MS * 1000,
+};
+static atomic_t deadline_misses[MONITOR_DEADLINE_COUNT];
+static uint32_t deadline_worst_us[MONITOR_DEADLINE_COUNT];
+#endif
+
+// Energy ledger, charge in uA*ms (nC). A rail that is on is charged for its time so far on readout
+static const uint32_t energy_rail_ua[MONITOR_ENERGY_COUNT] = {
+    [MONITOR_ENERGY_BASE] = ENERGY_BASE_UA,
+    [MONITOR_ENERGY_RADIO] = ENERGY_RADIO_CONNECTED_UA,
+    [MONITOR_ENERGY_MIC] = ENERGY_MIC_UA,
+    [MONITOR_ENERGY_CPU] = ENERGY_CPU_UA,
+    [MONITOR_ENERGY_SD] = ENERGY_SD_UA,
+    [MONITOR_ENERGY_WIFI] = ENERGY_WIFI_UA,
+    [MONITOR_ENERGY_SPEAKER] = ENERGY_SPEAKER_UA,
+    [MONITOR_ENERGY_HAPTIC] = ENERGY_HAPTIC_UA,
+};
+
+static uint64_t energy_charge[MONITOR_ENERGY_COUNT];
+static int64_t energy_on_since[MONITOR_ENERGY_COUNT];
+static uint32_t energy_on = BIT(MONITOR_ENERGY_BASE);
+static struct k_spinlock energy_lock;
+
+static atomic_t cpu_load = ATOMIC_INIT(MONITOR_CPU_LOAD_UNKNOWN);
+static atomic_t min_stack_unused = ATOMIC_INIT(UINT16_MAX);
+
+static ssize_t metrics_read_handler(struct bt_conn *conn,
+                                    const struct bt_gatt_attr *attr,
+                                    void *buf,
+                                    uint16_t len,
+                                    uint16_t offset);
+static void metrics_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+//
+// Service and Characteristic
+//
+// Metrics service with UUID 19B10050-E8F2-537E-4F6C-D104768A1214
+// exposes following characteristics:
+// - Metrics (UUID 19B10051-E8F2-537E-4F6C-D104768A1214) struct monitor_snapshot (read/notify)
+static struct bt_uuid_128 metrics_service_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10050, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 metrics_characteristic_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10051, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+
+static struct bt_gatt_attr metrics_service_attr[] = {
+    BT_GATT_PRIMARY_SERVICE(&metrics_service_uuid),
+    BT_GATT_CHARACTERISTIC(&metrics_characteristic_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ,
+                           metrics_read_handler,
+                           NULL,
+                           NULL),
+    BT_GATT_CCC(metrics_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+};
+
+static struct bt_gatt_service metrics_service = BT_GATT_SERVICE(metrics_service_attr);
+static struct subscription metrics_subscription = SUBSCRIPTION_INIT;
+
+static void monitor_notify_work_handler(struct k_work *work);
+static void monitor_sample_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(monitor_notify_work, monitor_notify_work_handler);
+static K_WORK_DELAYABLE_DEFINE(monitor_sample_work, monitor_sample_work_handler);
+
+static ssize_t metrics_read_handler(struct bt_conn *conn,
+                                    const struct bt_gatt_attr *attr,
+                                    void *buf,
+                                    uint16_t len,
+                                    uint16_t offset)
+{
+    struct monitor_snapshot snapshot;
+    monitor_get_snapshot(&snapshot);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &snapshot, sizeof(snapshot));
+}
+
+static void metrics_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    subscription_update(&metrics_subscription, value);
+    if (value == BT_GATT_CCC_NOTIFY) {
+        k_work_reschedule_for_queue(&housekeeping_work_q, &monitor_notify_work, K_NO_WAIT);
+    } else {
+        k_work_cancel_delayable(&monitor_notify_work);
+    }
+}
+
+static void monitor_notify_work_handler(struct k_work *work)
+{
+    struct bt_conn *conn = get_current_connection();
+    if (!conn || !subscription_is_notifying(&metrics_subscription)) {
+        // Resubscribing restarts the notifications
+        return;
+    }
+
+    // A link that never raised its MTU gets the leading fields, the rest can be read
+    struct monitor_snapshot snapshot;
+    monitor_get_snapshot(&snapshot);
+    transport_notify(conn, &metrics_service.attrs[1], &snapshot, MIN(sizeof(snapshot), bt_gatt_get_mtu(conn) - 3));
+
+    k_work_schedule_for_queue(&housekeeping_work_q, &monitor_notify_work, K_MSEC(MONITOR_NOTIFY_INTERVAL_MS));
+}
+
+//
+// CPU load and threads
+//
+
+#ifdef CONFIG_THREAD_MONITOR
+struct thread_entry {
+    const struct k_thread *thread;
+    uint64_t last_cycles;
+    bool seen;
+    struct monitor_thread_stats stats;
+};
+
+static struct thread_entry thread_table[MONITOR_MAX_THREADS];
+static size_t thread_table_count = 0;
+static K_MUTEX_DEFINE(thread_table_lock);
+static uint64_t thread_sample_elapsed = 0;
+
+static struct thread_entry *thread_entry_get(const struct k_thread *thread)
+{
+    for (size_t i = 0; i < thread_table_count; i++) {
+        if (thread_table[i].thread == thread) {
+            return &thread_table[i];
+        }
+    }
+    if (thread_table_count == MONITOR_MAX_THREADS) {
+        return NULL;
+    }
+
+    struct thread_entry *entry = &thread_table[thread_table_count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->thread = thread;
+    entry->stats.cpu_percent = MONITOR_CPU_LOAD_UNKNOWN;
+    return entry;
+}
+
+static void sample_thread(const struct k_thread *thread, void *user_data)
+{
+    struct thread_entry *entry = thread_entry_get(thread);
+    if (!entry) {
+        return;
+    }
+    entry->seen = true;
+
+    const char *name = k_thread_name_get((k_tid_t) thread);
+    if (name && name[0]) {
+        strncpy(entry->stats.name, name, sizeof(entry->stats.name) - 1);
+    } else {
+        snprintk(entry->stats.name, sizeof(entry->stats.name), "%p", thread);
+    }
+
+#ifdef CONFIG_SCHED_THREAD_USAGE_ALL
+    k_thread_runtime_stats_t stats;
+    if (k_thread_runtime_stats_get((k_tid_t) thread, &stats) == 0) {
+        if (entry->last_cycles > 0 && thread_sample_elapsed > 0) {
+            uint64_t busy = stats.execution_cycles - entry->last_cycles;
+            entry->stats.cpu_percent = (uint8_t) MIN(busy * 100 / thread_sample_elapsed, 100);
+        }
+        entry->last_cycles = stats.execution_cycles;
+    }
+#endif
+
+#ifdef CONFIG_THREAD_STACK_INFO
+    entry->stats.stack_size = thread->stack_info.size;
+#ifdef CONFIG_INIT_STACKS
+    size_t unused;
+    if (k_thread_stack_space_get(thread, &unused) == 0) {
+        entry->stats.stack_unused = unused;
+    }
+#endif
+#endif
+}
+
+static void sample_threads(uint64_t elapsed)
+{
+    k_mutex_lock(&thread_table_lock, K_FOREVER);
+    thread_sample_elapsed = elapsed;
+    for (size_t i = 0; i < thread_table_count; i++) {
+        thread_table[i].seen = false;
+    }
+
+    k_thread_foreach_unlocked(sample_thread, NULL);
+
+    // Forget threads that have exited
+    size_t kept = 0;
+    uint32_t min_unused = UINT16_MAX;
+    for (size_t i = 0; i < thread_table_count; i++) {
+        if (thread_table[i].seen) {
+            if (thread_table[i].stats.stack_size > 0) {
+                min_unused = MIN(min_unused, thread_table[i].stats.stack_unused);
+            }
+            thread_table[kept++] = thread_table[i];
+        }
+    }
+    thread_table_count = kept;
+    atomic_set(&min_stack_unused, (atomic_val_t) min_unused);
+    k_mutex_unlock(&thread_table_lock);
+}
+#endif
+
+//
+// Energy ledger
+//
+
+static void energy_add(enum monitor_energy_rail rail, uint64_t charge)
+{
+    k_spinlock_key_t key = k_spin_lock(&energy_lock);
+    energy_charge[rail] += charge;
+    k_spin_unlock(&energy_lock, key);
+}
+
+void monitor_energy_set(enum monitor_energy_rail rail, bool on)
+{
+    if (rail >= MONITOR_ENERGY_COUNT || rail == MONITOR_ENERGY_BASE || rail == MONITOR_ENERGY_CPU) {
+        return;
+    }
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&energy_lock);
+    bool was_on = (energy_on & BIT(rail)) != 0;
+    if (on && !was_on) {
+        energy_on |= BIT(rail);
+        energy_on_since[rail] = now;
+    } else if (!on && was_on) {
+        energy_on &= ~BIT(rail);
+        energy_charge[rail] += (uint64_t) (now - energy_on_since[rail]) * energy_rail_ua[rail];
+    }
+    k_spin_unlock(&energy_lock, key);
+}
+
+static void energy_get_uah(uint32_t uah[MONITOR_ENERGY_COUNT])
+{
+    int64_t now = k_uptime_get();
+    uint64_t charge[MONITOR_ENERGY_COUNT];
+
+    k_spinlock_key_t key = k_spin_lock(&energy_lock);
+    for (int i = 0; i < MONITOR_ENERGY_COUNT; i++) {
+        charge[i] = energy_charge[i];
+        if (energy_on & BIT(i)) {
+            charge[i] += (uint64_t) (now - energy_on_since[i]) * energy_rail_ua[i];
+        }
+    }
+    k_spin_unlock(&energy_lock, key);
+
+    charge[MONITOR_ENERGY_RADIO] += (uint64_t) gatt_notify_count * ENERGY_RADIO_NOTIFY_NC;
+    for (int i = 0; i < MONITOR_ENERGY_COUNT; i++) {
+        uah[i] = (uint32_t) MIN(charge[i] / 3600000, UINT32_MAX);
+    }
+}
+
+uint32_t monitor_get_energy_total_uah(void)
+{
+    uint32_t uah[MONITOR_ENERGY_COUNT];
+    uint64_t total = 0;
+
+    energy_get_uah(uah);
+    for (int i = 0; i < MONITOR_ENERGY_COUNT; i++) {
+        total += uah[i];
+    }
+    return (uint32_t) MIN(total, UINT32_MAX);
+}
+
+static void energy_reset(void)
+{
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&energy_lock);
+    for (int i = 0; i < MONITOR_ENERGY_COUNT; i++) {
+        energy_charge[i] = 0;
+        energy_on_since[i] = now;
+    }
+    k_spin_unlock(&energy_lock, key);
+}
+
+static void monitor_sample_work_handler(struct k_work *work)
+{
+    __maybe_unused uint64_t elapsed = 0;
+#ifdef CONFIG_SCHED_THREAD_USAGE_ALL
+    static uint64_t last_execution_cycles;
+    static uint64_t last_total_cycles;
+    k_thread_runtime_stats_t stats;
+
+    // execution_cycles also counts the idle thread, total_cycles does not
+    if (k_thread_runtime_stats_all_get(&stats) == 0) {
+        elapsed = last_execution_cycles > 0 ? stats.execution_cycles - last_execution_cycles : 0;
+        uint64_t busy = stats.total_cycles - last_total_cycles;
+        if (elapsed > 0) {
+            atomic_set(&cpu_load, (atomic_val_t) MIN(busy * 100 / elapsed, 100));
+        }
+        if (last_total_cycles > 0) {
+            energy_add(MONITOR_ENERGY_CPU, k_cyc_to_us_floor64(busy) * ENERGY_CPU_UA / 1000);
+        }
+        last_execution_cycles = stats.execution_cycles;
+        last_total_cycles = stats.total_cycles;
+    }
+#endif
+
+#ifdef CONFIG_THREAD_MONITOR
+    static uint32_t samples_since_report;
+    sample_threads(elapsed);
+    if (++samples_since_report >= MONITOR_THREAD_REPORT_INTERVAL_MS / MONITOR_SAMPLE_INTERVAL_MS) {
+        samples_since_report = 0;
+        monitor_log_threads();
+    }
+#endif
+    k_work_schedule_for_queue(&housekeeping_work_q, &monitor_sample_work, K_MSEC(MONITOR_SAMPLE_INTERVAL_MS));
+}
+
+size_t monitor_get_thread_stats(struct monitor_thread_stats *stats, size_t max)
+{
+#ifdef CONFIG_THREAD_MONITOR
+    k_mutex_lock(&thread_table_lock, K_FOREVER);
+    size_t count = MIN(max, thread_table_count);
+    for (size_t i = 0; i < count; i++) {
+        stats[i] = thread_table[i].stats;
+    }
+    k_mutex_unlock(&thread_table_lock);
+    return count;
+#else
+    return 0;
+#endif
+}
+
+void monitor_log_threads(void)
+{
+    struct monitor_thread_stats stats[MONITOR_MAX_THREADS];
+    size_t count = monitor_get_thread_stats(stats, ARRAY_SIZE(stats));
+
+    for (size_t i = 0; i < count; i++) {
+        LOG_INF("Thread %s: CPU %d%%, stack %u/%u bytes unused",
+                stats[i].name,
+                stats[i].cpu_percent,
+                stats[i].stack_unused,
+                stats[i].stack_size);
+    }
+}
 
 int monitor_init(void)
 {
     LOG_INF("Monitor system initialized");
+    if (forensics_log.magic == FORENSICS_MAGIC) {
+        last_reset = forensics_log.snapshot;
+        monitor_log_forensics();
+    }
+    forensics_log.magic = 0;
     monitor_reset();
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+#ifndef CONFIG_SCHED_THREAD_USAGE_ALL
+    LOG_INF("CONFIG_SCHED_THREAD_USAGE_ALL is off, CPU load is not reported");
+#endif
+    k_work_schedule_for_queue(&housekeeping_work_q, &monitor_sample_work, K_NO_WAIT);
     return 0;
 }
 
+int monitor_service_init(void)
+{
+    int err = bt_gatt_service_register(&metrics_service);
+    if (err) {
+        LOG_ERR("Failed to register metrics service (err %d)", err);
+    }
+    return err;
+}
+
 void monitor_inc_gatt_notify(void)
 {
     gatt_notify_count++;
+    last_notify_ms = MAX(k_uptime_get_32(), 1);
 }
 
 void monitor_inc_mic_buffer(void)
@@ -49,6 +483,373 @@ void monitor_inc_storage_write(void)
     storage_write_count++;
 }
 
+void monitor_inc_encode_skips(void)
+{
+    encode_skip_count++;
+}
+
+void monitor_queue_level(enum monitor_queue queue, uint32_t used, uint32_t capacity)
+{
+    if (queue >= MONITOR_QUEUE_COUNT || capacity == 0) {
+        return;
+    }
+
+    atomic_val_t level = (atomic_val_t) MIN((uint64_t) used * 100 / capacity, 100);
+    atomic_set(&queue_level[queue], level);
+    atomic_val_t high = atomic_get(&queue_high_water[queue]);
+    while (level > high && !atomic_cas(&queue_high_water[queue], high, level)) {
+        high = atomic_get(&queue_high_water[queue]);
+    }
+}
+
+void monitor_add_drops(enum monitor_drop_cause cause, uint32_t count)
+{
+    if (cause < MONITOR_DROP_COUNT) {
+        atomic_add(&drop_count[cause], (atomic_val_t) count);
+    }
+}
+
+void monitor_sd_latency(enum monitor_sd_op op, uint32_t ms)
+{
+    if (op >= MONITOR_SD_OP_COUNT) {
+        return;
+    }
+    energy_add(MONITOR_ENERGY_SD, (uint64_t) ms * ENERGY_SD_ACCESS_UA);
+    uint32_t bucket = MIN(ms ? 32 - __builtin_clz(ms) : 0, MONITOR_SD_LATENCY_BUCKETS - 1);
+    k_spinlock_key_t key = k_spin_lock(&sd_lock);
+    sd_busy_ms[op] += ms;
+    if (sd_latency_hist[op][bucket] < UINT16_MAX) {
+        sd_latency_hist[op][bucket]++;
+    }
+    if (op != MONITOR_SD_READ) {
+        sd_write_samples++;
+        sd_write_total_ms += ms;
+        if (ms > sd_write_max_ms) {
+            sd_write_max_ms = ms;
+        }
+    }
+    k_spin_unlock(&sd_lock, key);
+}
+
+// Average and worst write latency as one consistent pair
+static void sd_write_latency_get(uint32_t *avg_ms, uint32_t *max_ms)
+{
+    k_spinlock_key_t key = k_spin_lock(&sd_lock);
+    *avg_ms = sd_write_samples ? sd_write_total_ms / sd_write_samples : 0;
+    *max_ms = sd_write_max_ms;
+    k_spin_unlock(&sd_lock, key);
+}
+
+void monitor_sd_error(enum monitor_sd_op op)
+{
+    if (op >= MONITOR_SD_OP_COUNT) {
+        return;
+    }
+    k_spinlock_key_t key = k_spin_lock(&sd_lock);
+    if (sd_errors[op] < UINT16_MAX) {
+        sd_errors[op]++;
+    }
+    k_spin_unlock(&sd_lock, key);
+}
+
+void monitor_sd_bytes(enum monitor_sd_op op, uint32_t bytes)
+{
+    if (op < MONITOR_SD_OP_COUNT) {
+        k_spinlock_key_t key = k_spin_lock(&sd_lock);
+        sd_bytes[op] += bytes;
+        k_spin_unlock(&sd_lock, key);
+    }
+}
+
+void monitor_sd_card(const struct monitor_sd_card *card)
+{
+    k_spinlock_key_t key = k_spin_lock(&sd_lock);
+    sd_card = *card;
+    k_spin_unlock(&sd_lock, key);
+}
+
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+//
+// Audio path stages
+//
+
+static inline uint32_t cycles_to_us(uint64_t cycles)
+{
+    return (uint32_t) (cycles / (SystemCoreClock / 1000000));
+}
+
+void monitor_trace_stage(enum monitor_stage stage, uint32_t start)
+{
+    if (stage >= MONITOR_STAGE_COUNT) {
+        return;
+    }
+    pipe_stats_add(&stage_traces[stage], cycles_to_us(monitor_trace_now() - start));
+}
+
+void monitor_deadline_check(enum monitor_deadline deadline, uint32_t start)
+{
+    if (deadline >= MONITOR_DEADLINE_COUNT) {
+        return;
+    }
+    uint32_t us = cycles_to_us(monitor_trace_now() - start);
+    if (us <= deadline_us[deadline]) {
+        return;
+    }
+
+    uint32_t late_us = us - deadline_us[deadline];
+    atomic_inc(&deadline_misses[deadline]);
+    deadline_worst_us[deadline] = MAX(deadline_worst_us[deadline], late_us);
+    FLIGHT_REC(FLIGHT_REC_DEADLINE, deadline, MIN(late_us, UINT16_MAX));
+}
+
+uint32_t monitor_get_deadline_misses(enum monitor_deadline deadline, uint32_t *worst_us)
+{
+    if (deadline >= MONITOR_DEADLINE_COUNT) {
+        return 0;
+    }
+    if (worst_us) {
+        *worst_us = deadline_worst_us[deadline];
+    }
+    return (uint32_t) atomic_get(&deadline_misses[deadline]);
+}
+
+void monitor_get_stage_stats(enum monitor_stage stage, struct monitor_stage_stats *stats)
+{
+    struct pipe_stats_summary summary = {0};
+
+    if (stage < MONITOR_STAGE_COUNT) {
+        pipe_stats_get(&stage_traces[stage], &summary);
+    }
+    stats->count = summary.count;
+    stats->min_us = summary.min;
+    stats->avg_us = summary.avg;
+    stats->p99_us = summary.p99;
+    stats->max_us = summary.max;
+}
+#endif
+
+//
+// Boot timeline
+//
+
+// Called with boot_lock held
+static struct monitor_boot_record *boot_record_get(void)
+{
+    if (!boot_current) {
+        if (boot_log.magic != BOOT_LOG_MAGIC || boot_log.next >= MONITOR_BOOT_HISTORY) {
+            memset(&boot_log, 0, sizeof(boot_log));
+            boot_log.magic = BOOT_LOG_MAGIC;
+        }
+        boot_current = &boot_log.records[boot_log.next];
+        memset(boot_current, 0, sizeof(*boot_current));
+        boot_log.next = (boot_log.next + 1) % MONITOR_BOOT_HISTORY;
+    }
+    return boot_current;
+}
+
+void monitor_boot_mark(enum monitor_boot_phase phase)
+{
+    if (phase >= MONITOR_BOOT_PHASE_COUNT) {
+        return;
+    }
+    uint32_t us = MAX(k_ticks_to_us_floor32(k_uptime_ticks()), 1);
+
+    k_spinlock_key_t key = k_spin_lock(&boot_lock);
+    struct monitor_boot_record *record = boot_record_get();
+    if (record->phase_us[phase] == 0) {
+        record->phase_us[phase] = us;
+    }
+    k_spin_unlock(&boot_lock, key);
+}
+
+size_t monitor_get_boot_history(struct monitor_boot_record *records, size_t max)
+{
+    size_t count = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&boot_lock);
+    boot_record_get();
+    for (size_t i = 0; i < MONITOR_BOOT_HISTORY && count < max; i++) {
+        size_t index = (boot_log.next + MONITOR_BOOT_HISTORY - 1 - i) % MONITOR_BOOT_HISTORY;
+        const struct monitor_boot_record *record = &boot_log.records[index];
+        bool reached = false;
+        for (int phase = 0; phase < MONITOR_BOOT_PHASE_COUNT; phase++) {
+            reached |= record->phase_us[phase] != 0;
+        }
+        if (!reached && i > 0) {
+            break;
+        }
+        records[count++] = *record;
+    }
+    k_spin_unlock(&boot_lock, key);
+    return count;
+}
+
+void monitor_log_boots(void)
+{
+    static const char *const phase_names[MONITOR_BOOT_PHASE_COUNT] = {
+        "watchdog", "settings", "rtc", "mic", "sd mount", "bt enable", "transport", "first frame",
+    };
+    struct monitor_boot_record records[MONITOR_BOOT_HISTORY];
+    size_t count = monitor_get_boot_history(records, ARRAY_SIZE(records));
+
+    for (size_t i = 0; i < count; i++) {
+        LOG_INF("Boot -%u:", (unsigned) i);
+        for (int phase = 0; phase < MONITOR_BOOT_PHASE_COUNT; phase++) {
+            if (records[i].phase_us[phase]) {
+                LOG_INF("  %-12s %8u us", phase_names[phase], records[i].phase_us[phase]);
+            }
+        }
+    }
+}
+
+//
+// Reset forensics
+//
+
+void monitor_progress(enum monitor_worker worker, enum monitor_step step)
+{
+    if (worker >= MONITOR_WORKER_COUNT) {
+        return;
+    }
+    worker_step_ms[worker] = k_uptime_get_32();
+    worker_step[worker] = step;
+}
+
+void monitor_sd_request(uint8_t type)
+{
+    sd_request_ms = k_uptime_get_32();
+    sd_request = type;
+}
+
+void monitor_forensics_capture(enum monitor_forensic_cause cause, uint32_t reason)
+{
+    struct monitor_forensics *snapshot = &forensics_log.snapshot;
+    uint32_t now = k_uptime_get_32();
+
+    snapshot->cause = cause;
+    snapshot->reason = reason;
+    snapshot->uptime_ms = now;
+    for (int i = 0; i < MONITOR_QUEUE_COUNT; i++) {
+        snapshot->queue_level[i] = (uint8_t) atomic_get(&queue_level[i]);
+    }
+    for (int i = 0; i < MONITOR_WORKER_COUNT; i++) {
+        snapshot->last_step[i] = worker_step[i];
+        snapshot->step_age_ms[i] = worker_step[i] != MONITOR_STEP_NONE ? now - worker_step_ms[i] : 0;
+    }
+    snapshot->sd_request = sd_request;
+    snapshot->sd_request_ms = sd_request != MONITOR_SD_IDLE ? now - sd_request_ms : 0;
+    snapshot->ble_connected = get_current_connection() != NULL;
+    snapshot->notify_age_ms = last_notify_ms ? now - last_notify_ms : UINT32_MAX;
+    forensics_log.magic = FORENSICS_MAGIC;
+}
+
+void monitor_forensics_discard(void)
+{
+    forensics_log.magic = 0;
+}
+
+void monitor_get_forensics(struct monitor_forensics *forensics)
+{
+    *forensics = last_reset;
+}
+
+void monitor_log_forensics(void)
+{
+    static const char *const cause_names[] = {"none", "watchdog", "fatal error"};
+    static const char *const worker_names[MONITOR_WORKER_COUNT] = {"mic", "codec", "pusher", "sd", "storage", "main"};
+    static const char *const step_names[] = {"none",    "mic block", "encoded",   "dequeued",
+                                             "sent",    "sd done",   "sync pass", "fed"};
+    const struct monitor_forensics *f = &last_reset;
+
+    if (f->cause == MONITOR_FORENSIC_NONE) {
+        LOG_INF("The previous boot left no forensic snapshot");
+        return;
+    }
+    LOG_WRN("Previous boot ended by %s (reason %u) at %u ms", cause_names[MIN(f->cause, ARRAY_SIZE(cause_names) - 1)],
+            f->reason, f->uptime_ms);
+    LOG_WRN("  Queues: codec %u%%, TX %u%%, SD %u%%", f->queue_level[MONITOR_QUEUE_CODEC],
+            f->queue_level[MONITOR_QUEUE_TX], f->queue_level[MONITOR_QUEUE_SD]);
+    for (int i = 0; i < MONITOR_WORKER_COUNT; i++) {
+        LOG_WRN("  %-8s last %s, %u ms before", worker_names[i],
+                step_names[MIN(f->last_step[i], ARRAY_SIZE(step_names) - 1)], f->step_age_ms[i]);
+    }
+    if (f->sd_request != MONITOR_SD_IDLE) {
+        LOG_WRN("  SD request %u running for %u ms", f->sd_request, f->sd_request_ms);
+    } else {
+        LOG_WRN("  SD worker idle");
+    }
+    LOG_WRN("  BLE %s, last audio notification %d ms before", f->ble_connected ? "connected" : "disconnected",
+            f->notify_age_ms == UINT32_MAX ? -1 : (int) f->notify_age_ms);
+}
+
+#ifdef CONFIG_RESET_ON_FATAL_ERROR
+// NCS brings the handler, which resets; the link wraps it (CMakeLists.txt) so the snapshot is taken first
+void __real_k_sys_fatal_error_handler(unsigned int reason, const struct arch_esf *esf);
+
+void __wrap_k_sys_fatal_error_handler(unsigned int reason, const struct arch_esf *esf)
+{
+    monitor_forensics_capture(MONITOR_FORENSIC_FATAL, reason);
+    __real_k_sys_fatal_error_handler(reason, esf);
+}
+#else
+// Replaces the kernel default, which halts until the watchdog resets the SoC up to 30 s later
+void k_sys_fatal_error_handler(unsigned int reason, const struct arch_esf *esf)
+{
+    ARG_UNUSED(esf);
+
+    monitor_forensics_capture(MONITOR_FORENSIC_FATAL, reason);
+    LOG_PANIC();
+    LOG_ERR("Fatal error %u, rebooting", reason);
+    sys_reboot(SYS_REBOOT_WARM);
+}
+#endif
+
+void monitor_get_snapshot(struct monitor_snapshot *snapshot)
+{
+    snapshot->version = MONITOR_SNAPSHOT_VERSION;
+    snapshot->uptime_ms = k_uptime_get_32();
+    snapshot->mic_buffers = total_mic_buffer_bytes;
+    snapshot->gatt_notify = gatt_notify_count;
+    snapshot->broadcast_audio = broadcast_audio_count;
+    snapshot->broadcast_audio_failed = broadcast_audio_failed_count;
+    snapshot->tx_queue_write = write_to_tx_queue_count;
+    snapshot->storage_write = storage_write_count;
+    for (int i = 0; i < MONITOR_DROP_COUNT; i++) {
+        snapshot->drops[i] = (uint32_t) atomic_get(&drop_count[i]);
+    }
+    for (int i = 0; i < MONITOR_QUEUE_COUNT; i++) {
+        snapshot->queue_high_water[i] = (uint8_t) atomic_get(&queue_high_water[i]);
+    }
+    uint32_t sd_avg_ms, sd_max_ms;
+    sd_write_latency_get(&sd_avg_ms, &sd_max_ms);
+    snapshot->cpu_load = (uint8_t) atomic_get(&cpu_load);
+    snapshot->sd_write_latency_avg_ms = (uint16_t) MIN(sd_avg_ms, UINT16_MAX);
+    snapshot->sd_write_latency_max_ms = (uint16_t) MIN(sd_max_ms, UINT16_MAX);
+    snapshot->min_stack_unused = (uint16_t) atomic_get(&min_stack_unused);
+    k_spinlock_key_t sd_key = k_spin_lock(&sd_lock);
+    memcpy(snapshot->sd_latency_hist, sd_latency_hist, sizeof(sd_latency_hist));
+    memcpy(snapshot->sd_errors, sd_errors, sizeof(sd_errors));
+    snapshot->sd_card = sd_card;
+    memcpy(snapshot->sd_bytes, sd_bytes, sizeof(sd_bytes));
+    memcpy(snapshot->sd_busy_ms, sd_busy_ms, sizeof(sd_busy_ms));
+    k_spin_unlock(&sd_lock, sd_key);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    for (int i = 0; i < MONITOR_DEADLINE_COUNT; i++) {
+        snapshot->deadline_misses[i] = (uint32_t) atomic_get(&deadline_misses[i]);
+    }
+#else
+    memset(snapshot->deadline_misses, 0, sizeof(snapshot->deadline_misses));
+#endif
+    k_spinlock_key_t key = k_spin_lock(&boot_lock);
+    snapshot->boot = *boot_record_get();
+    k_spin_unlock(&boot_lock, key);
+    uint32_t energy_uah[MONITOR_ENERGY_COUNT];
+    energy_get_uah(energy_uah);
+    memcpy(snapshot->energy_uah, energy_uah, sizeof(energy_uah));
+    snapshot->last_reset = last_reset;
+    snapshot->encode_skips = encode_skip_count;
+}
+
 void monitor_log_metrics(void)
 {
     LOG_INF("Metrics: Mic buffers: %u, GATT notify: %u, Broadcast: %u, Broadcast failed: %u, TX queue: %u, Storage: %u",
@@ -58,6 +859,66 @@ void monitor_log_metrics(void)
             broadcast_audio_failed_count,
             write_to_tx_queue_count,
             storage_write_count);
+    LOG_INF("Queues high-water: codec %d%%, TX %d%%, SD %d%%; Drops: codec %d, TX full %d, notify %d, SD queue %d, "
+            "storage full %d",
+            (int) atomic_get(&queue_high_water[MONITOR_QUEUE_CODEC]),
+            (int) atomic_get(&queue_high_water[MONITOR_QUEUE_TX]),
+            (int) atomic_get(&queue_high_water[MONITOR_QUEUE_SD]),
+            (int) atomic_get(&drop_count[MONITOR_DROP_CODEC_FULL]),
+            (int) atomic_get(&drop_count[MONITOR_DROP_TX_QUEUE_FULL]),
+            (int) atomic_get(&drop_count[MONITOR_DROP_NOTIFY_FAILED]),
+            (int) atomic_get(&drop_count[MONITOR_DROP_SD_QUEUE_FULL]),
+            (int) atomic_get(&drop_count[MONITOR_DROP_STORAGE_FULL]));
+    LOG_INF("Encode skips (no sink): %u", encode_skip_count);
+    uint32_t sd_avg_ms, sd_max_ms;
+    sd_write_latency_get(&sd_avg_ms, &sd_max_ms);
+    LOG_INF("CPU load: %d%%, SD write latency: avg %u ms, max %u ms", (int) atomic_get(&cpu_load), sd_avg_ms,
+            sd_max_ms);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    static const char *const stage_names[MONITOR_STAGE_COUNT] = {"mic",    "codec wait", "preprocess",
+                                                                 "encode", "tx wait",    "notify", "kws"};
+    for (int stage = 0; stage < MONITOR_STAGE_COUNT; stage++) {
+        struct monitor_stage_stats stats;
+        monitor_get_stage_stats(stage, &stats);
+        LOG_INF("Stage %s: %u frames, us min %u avg %u p99 %u max %u", stage_names[stage], stats.count,
+                stats.min_us, stats.avg_us, stats.p99_us, stats.max_us);
+    }
+    static const char *const deadline_names[MONITOR_DEADLINE_COUNT] = {"encode", "push"};
+    for (int deadline = 0; deadline < MONITOR_DEADLINE_COUNT; deadline++) {
+        uint32_t worst_us;
+        uint32_t misses = monitor_get_deadline_misses(deadline, &worst_us);
+        LOG_INF("Deadline %s: %u misses, worst %u us late", deadline_names[deadline], misses, worst_us);
+    }
+#endif
+    BUILD_ASSERT(MONITOR_ENERGY_COUNT == 8, "Update the energy log line");
+    uint32_t uah[MONITOR_ENERGY_COUNT];
+    energy_get_uah(uah);
+    LOG_INF("Energy uAh: base %u, radio %u, mic %u, CPU %u, SD %u, Wi-Fi %u, speaker %u, haptic %u", uah[0], uah[1],
+            uah[2], uah[3], uah[4], uah[5], uah[6], uah[7]);
+    BUILD_ASSERT(MONITOR_SD_LATENCY_BUCKETS == 10, "Update the SD latency log line");
+    uint16_t hist[MONITOR_SD_OP_COUNT][MONITOR_SD_LATENCY_BUCKETS];
+    uint16_t errors[MONITOR_SD_OP_COUNT];
+    uint32_t bytes[MONITOR_SD_OP_COUNT];
+    uint32_t busy_ms[MONITOR_SD_OP_COUNT];
+    struct monitor_sd_card card;
+    k_spinlock_key_t key = k_spin_lock(&sd_lock);
+    memcpy(hist, sd_latency_hist, sizeof(hist));
+    memcpy(errors, sd_errors, sizeof(errors));
+    memcpy(bytes, sd_bytes, sizeof(bytes));
+    memcpy(busy_ms, sd_busy_ms, sizeof(busy_ms));
+    card = sd_card;
+    k_spin_unlock(&sd_lock, key);
+    static const char *const sd_op_names[MONITOR_SD_OP_COUNT] = {"write", "sync", "read"};
+    for (int op = 0; op < MONITOR_SD_OP_COUNT; op++) {
+        const uint16_t *h = hist[op];
+        LOG_INF("SD %s: errors %u, ms <1:%u 1:%u 2:%u 4:%u 8:%u 16:%u 32:%u 64:%u 128:%u 256+:%u",
+                sd_op_names[op], errors[op], h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7], h[8], h[9]);
+    }
+    static const char *const sd_card_names[] = {"none", "SDSC", "SDHC", "SDXC"};
+    LOG_INF("SD card: %s, %u MB, SPI %u kHz; write %u kB/s, read %u kB/s",
+            sd_card_names[MIN(card.type, ARRAY_SIZE(sd_card_names) - 1)], card.capacity_mb, card.clock_khz,
+            busy_ms[MONITOR_SD_WRITE] ? bytes[MONITOR_SD_WRITE] / busy_ms[MONITOR_SD_WRITE] : 0,
+            busy_ms[MONITOR_SD_READ] ? bytes[MONITOR_SD_READ] / busy_ms[MONITOR_SD_READ] : 0);
 }
 
 void monitor_reset(void)
@@ -68,5 +929,75 @@ void monitor_reset(void)
     broadcast_audio_failed_count = 0;
     write_to_tx_queue_count = 0;
     storage_write_count = 0;
+    for (int i = 0; i < MONITOR_QUEUE_COUNT; i++) {
+        atomic_set(&queue_high_water[i], 0);
+    }
+    for (int i = 0; i < MONITOR_DROP_COUNT; i++) {
+        atomic_set(&drop_count[i], 0);
+    }
+    encode_skip_count = 0;
+    k_spinlock_key_t key = k_spin_lock(&sd_lock);
+    sd_write_samples = 0;
+    sd_write_total_ms = 0;
+    sd_write_max_ms = 0;
+    memset(sd_latency_hist, 0, sizeof(sd_latency_hist));
+    memset(sd_errors, 0, sizeof(sd_errors));
+    memset(sd_bytes, 0, sizeof(sd_bytes));
+    memset(sd_busy_ms, 0, sizeof(sd_busy_ms));
+    k_spin_unlock(&sd_lock, key);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    memset(stage_traces, 0, sizeof(stage_traces));
+#endif
+    energy_reset();
     LOG_DBG("All metrics reset");
 }
+
+#ifdef CONFIG_SHELL
+static int cmd_monitor_threads(const struct shell *sh, size_t argc, char **argv)
+{
+    struct monitor_thread_stats stats[MONITOR_MAX_THREADS];
+    size_t count = monitor_get_thread_stats(stats, ARRAY_SIZE(stats));
+
+    if (count == 0) {
+        shell_print(sh, "Thread statistics need CONFIG_THREAD_MONITOR");
+        return 0;
+    }
+    shell_print(sh, "%-20s %5s %7s %7s", "Thread", "CPU%", "Stack", "Unused");
+    for (size_t i = 0; i < count; i++) {
+        shell_print(sh,
+                    "%-20s %5d %7u %7u",
+                    stats[i].name,
+                    stats[i].cpu_percent,
+                    stats[i].stack_size,
+                    stats[i].stack_unused);
+    }
+    return 0;
+}
+
+static int cmd_monitor_metrics(const struct shell *sh, size_t argc, char **argv)
+{
+    monitor_log_metrics();
+    return 0;
+}
+
+static int cmd_monitor_boot(const struct shell *sh, size_t argc, char **argv)
+{
+    monitor_log_boots();
+    return 0;
+}
+
+static int cmd_monitor_forensics(const struct shell *sh, size_t argc, char **argv)
+{
+    monitor_log_forensics();
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(monitor_cmds,
+                               SHELL_CMD(threads, NULL, "Per-thread CPU and stack usage", cmd_monitor_threads),
+                               SHELL_CMD(metrics, NULL, "Log the audio path metrics", cmd_monitor_metrics),
+                               SHELL_CMD(boot, NULL, "Log the last boot timelines", cmd_monitor_boot),
+                               SHELL_CMD(forensics, NULL, "Log the pipeline state the last reset left",
+                                         cmd_monitor_forensics),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(monitor, &monitor_cmds, "Performance monitor", NULL);
+#endif
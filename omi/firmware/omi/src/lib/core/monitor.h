@@ -2,7 +2,11 @@
 #define MONITOR_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+#include <cmsis_core.h>
+#endif
 
 /**
  * @brief Initialize the monitoring system
@@ -11,6 +15,16 @@
  */
 int monitor_init(void);
 
+/**
+ * @brief Register the metrics GATT service
+ *
+ * The metrics characteristic can be read at any time and, once subscribed,
+ * is notified every MONITOR_NOTIFY_INTERVAL_MS.
+ *
+ * @return 0 on success, negative error code on failure
+ */
+int monitor_service_init(void);
+
 /**
  * @brief Increment the GATT notify counter
  */
@@ -41,6 +55,413 @@ void monitor_inc_tx_queue_write(void);
  */
 void monitor_inc_storage_write(void);
 
+/**
+ * @brief Count a frame the codec didn't encode because no sink could take it
+ */
+void monitor_inc_encode_skips(void);
+
+/**
+ * @brief Queues on the audio path whose fill level is tracked
+ */
+enum monitor_queue {
+    MONITOR_QUEUE_CODEC, // PCM frames waiting for the encoder
+    MONITOR_QUEUE_TX,    // Encoded frames waiting for GATT or storage
+    MONITOR_QUEUE_SD,    // Requests waiting for the SD card worker
+    MONITOR_QUEUE_COUNT,
+};
+
+/**
+ * @brief Reasons an audio frame is lost on its way out of the device
+ */
+enum monitor_drop_cause {
+    MONITOR_DROP_CODEC_FULL,     // No free PCM frame or codec queue full
+    MONITOR_DROP_TX_QUEUE_FULL,  // Encoded frame didn't fit the TX ring
+    MONITOR_DROP_NOTIFY_FAILED,  // GATT notify failed after all retries
+    MONITOR_DROP_SD_QUEUE_FULL,  // No free SD write block or spill slot, or a block couldn't be queued
+    MONITOR_DROP_STORAGE_FULL,   // Offline storage full or SD card off, or aged out of the pre-roll
+    MONITOR_DROP_COUNT,
+};
+
+/**
+ * @brief Deadlines of the live audio path, checked per frame (CONFIG_OMI_ENABLE_LATENCY_TRACE)
+ */
+enum monitor_deadline {
+    MONITOR_DEADLINE_ENCODE, // mic hands the frame over -> encoded, within DEADLINE_ENCODE_MS
+    MONITOR_DEADLINE_PUSH,   // encoded frame queued -> the pusher takes it, within DEADLINE_PUSH_MS
+    MONITOR_DEADLINE_COUNT,
+};
+
+/**
+ * @brief SD card operations whose latency and errors are tracked
+ */
+enum monitor_sd_op {
+    MONITOR_SD_WRITE, // fs_write of a batch
+    MONITOR_SD_SYNC,  // fs_sync of the data file
+    MONITOR_SD_READ,  // fs_read for a sync request
+    MONITOR_SD_OP_COUNT,
+};
+
+// Bucket 0 is under 1 ms, bucket i (i > 0) is 2^(i-1) up to 2^i ms, the last one is open ended
+#define MONITOR_SD_LATENCY_BUCKETS 10
+
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+/**
+ * @brief Stages of the audio path, each timed per frame with the DWT cycle counter
+ */
+enum monitor_stage {
+    MONITOR_STAGE_MIC,        // PDM block handed out by the driver -> frame submitted to the codec
+    MONITOR_STAGE_CODEC_WAIT, // waiting in the codec queue
+    MONITOR_STAGE_PREPROCESS, // high-pass, noise suppression and AGC (CONFIG_OMI_ENABLE_PREPROCESS)
+    MONITOR_STAGE_ENCODE,     // opus_encode() or lc3_encode()
+    MONITOR_STAGE_TX_WAIT,    // waiting in the TX queue for the pusher
+    MONITOR_STAGE_NOTIFY,     // pusher takes the frame -> bt_gatt_notify_cb() (or the CIS) accepted all of it
+    MONITOR_STAGE_KWS,        // wake phrase spotter (CONFIG_OMI_ENABLE_KWS)
+    MONITOR_STAGE_COUNT,
+};
+
+struct monitor_stage_stats {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t p99_us; // upper bound, from power-of-two buckets
+    uint32_t max_us;
+};
+
+/**
+ * @brief Current cycle count, the start of a stage
+ */
+static inline uint32_t monitor_trace_now(void)
+{
+    return DWT->CYCCNT;
+}
+
+/**
+ * @brief Record that a frame finished a stage
+ *
+ * Each stage must only be recorded from one thread.
+ *
+ * @param stage Stage the frame went through
+ * @param start monitor_trace_now() when the frame entered it
+ */
+void monitor_trace_stage(enum monitor_stage stage, uint32_t start);
+
+/**
+ * @brief Get the latency statistics of one stage since the last reset
+ */
+void monitor_get_stage_stats(enum monitor_stage stage, struct monitor_stage_stats *stats);
+
+/**
+ * @brief Check that a frame met a deadline, counting and recording it if not
+ *
+ * Each deadline must only be checked from one thread.
+ *
+ * @param deadline Deadline the frame was held to
+ * @param start monitor_trace_now() when its clock started
+ */
+void monitor_deadline_check(enum monitor_deadline deadline, uint32_t start);
+
+/**
+ * @brief Get the misses of one deadline since the reset and the worst lateness
+ *
+ * @param deadline Deadline to report
+ * @param worst_us Set to how far past the deadline the worst miss was, may be NULL
+ * @return Missed frames
+ */
+uint32_t monitor_get_deadline_misses(enum monitor_deadline deadline, uint32_t *worst_us);
+#endif
+
+/**
+ * @brief Startup milestones, timed from reset
+ */
+enum monitor_boot_phase {
+    MONITOR_BOOT_WATCHDOG,    // watchdog_init() done
+    MONITOR_BOOT_SETTINGS,    // app_settings_init() done
+    MONITOR_BOOT_RTC,         // init_rtc() done
+    MONITOR_BOOT_MIC,         // mic_start() done
+    MONITOR_BOOT_SD_MOUNT,    // SD card mounted by the worker
+    MONITOR_BOOT_BT_ENABLE,   // bt_enable() done
+    MONITOR_BOOT_TRANSPORT,   // transport_start() done
+    MONITOR_BOOT_FIRST_FRAME, // first encoded frame out of the codec
+    MONITOR_BOOT_PHASE_COUNT,
+};
+
+/**
+ * @brief Power consumers in the energy ledger, each charged at its ENERGY_*_UA constant
+ */
+enum monitor_energy_rail {
+    MONITOR_ENERGY_BASE,    // Always on: regulators, sensors and the CPU asleep
+    MONITOR_ENERGY_RADIO,   // Connected link, plus a fixed charge per audio notification
+    MONITOR_ENERGY_MIC,     // PDM clock and mics while capturing
+    MONITOR_ENERGY_CPU,     // CPU awake (codec thread and everything else), needs CONFIG_SCHED_THREAD_USAGE_ALL
+    MONITOR_ENERGY_SD,      // SD card rail powered, plus its reads and writes
+    MONITOR_ENERGY_WIFI,    // Wi-Fi interface up
+    MONITOR_ENERGY_SPEAKER, // Speaker amplifier enabled
+    MONITOR_ENERGY_HAPTIC,  // Haptic motor driven
+    MONITOR_ENERGY_COUNT,
+};
+
+/**
+ * @brief Record that a rail was switched on or off
+ *
+ * Repeated calls with the same state are ignored. May be called from any thread or an ISR.
+ * MONITOR_ENERGY_BASE and MONITOR_ENERGY_CPU are accounted by the monitor itself.
+ */
+void monitor_energy_set(enum monitor_energy_rail rail, bool on);
+
+/**
+ * @brief Estimated charge drawn by all rails since the last monitor_reset(), in uAh
+ *
+ * Goes back down when the metrics are reset, callers taking differences must allow for that.
+ */
+uint32_t monitor_get_energy_total_uah(void);
+
+#define MONITOR_BOOT_HISTORY 4 // boots kept in RAM that survives a warm reset
+
+/**
+ * @brief When each phase of one boot was reached, in microseconds since reset (0 if it wasn't)
+ */
+struct monitor_boot_record {
+    uint32_t phase_us[MONITOR_BOOT_PHASE_COUNT];
+} __attribute__((packed));
+
+/**
+ * @brief Threads of the audio path whose progress is kept for the reset forensics
+ */
+enum monitor_worker {
+    MONITOR_WORKER_MIC,     // PDM reader
+    MONITOR_WORKER_CODEC,   // Encoder
+    MONITOR_WORKER_PUSHER,  // TX queue to GATT, ISO, Wi-Fi or storage
+    MONITOR_WORKER_SD,      // SD card worker
+    MONITOR_WORKER_STORAGE, // Offline sync sender
+    MONITOR_WORKER_MAIN,    // Main loop, which feeds the watchdog
+    MONITOR_WORKER_COUNT,
+};
+
+/**
+ * @brief Steps a worker completes, only the last one is kept
+ */
+enum monitor_step {
+    MONITOR_STEP_NONE,      // Nothing completed yet this boot
+    MONITOR_STEP_MIC_BLOCK, // PDM block read and handed to the codec
+    MONITOR_STEP_ENCODED,   // Frame encoded and queued for the pusher
+    MONITOR_STEP_DEQUEUED,  // Frame taken from the TX queue
+    MONITOR_STEP_SENT,      // Frame accepted by a link or by storage
+    MONITOR_STEP_SD_DONE,   // SD request finished
+    MONITOR_STEP_SYNC_PASS, // One pass of the storage loop
+    MONITOR_STEP_FED,       // Watchdog fed
+};
+
+/**
+ * @brief What a forensic snapshot was taken for
+ */
+enum monitor_forensic_cause {
+    MONITOR_FORENSIC_NONE,     // The last reset left no snapshot
+    MONITOR_FORENSIC_WATCHDOG, // Watchdog pre-timeout, the reset followed
+    MONITOR_FORENSIC_FATAL,    // Fatal error, the warm reboot followed
+};
+
+#define MONITOR_SD_IDLE 0xFF // sd_request when the SD worker was between requests
+
+/**
+ * @brief Pipeline state just before the previous reset, kept in RAM that survives a warm reset
+ */
+struct monitor_forensics {
+    uint8_t cause;                              // enum monitor_forensic_cause
+    uint32_t reason;                            // K_ERR_* for a fatal error, 0 otherwise
+    uint32_t uptime_ms;                         // Of the previous boot when the snapshot was taken
+    uint8_t queue_level[MONITOR_QUEUE_COUNT];   // Percent of capacity at the time
+    uint8_t last_step[MONITOR_WORKER_COUNT];    // enum monitor_step
+    uint32_t step_age_ms[MONITOR_WORKER_COUNT]; // Since that step
+    uint8_t sd_request;                         // sd_req_type_t in progress, MONITOR_SD_IDLE if none
+    uint32_t sd_request_ms;                     // How long it had been running
+    uint8_t ble_connected;
+    uint32_t notify_age_ms;                     // Since the last successful audio notification, UINT32_MAX if none
+} __attribute__((packed));
+
+/**
+ * @brief All metrics at one point in time
+ *
+ * This is also the value of the metrics characteristic, little endian.
+ * Fields are only ever appended; bump MONITOR_SNAPSHOT_VERSION when they are.
+ */
+#define MONITOR_SNAPSHOT_VERSION 9
+#define MONITOR_CPU_LOAD_UNKNOWN 0xFF
+
+struct monitor_snapshot {
+    uint8_t version;
+    uint32_t uptime_ms;
+    uint32_t mic_buffers;
+    uint32_t gatt_notify;
+    uint32_t broadcast_audio;
+    uint32_t broadcast_audio_failed;
+    uint32_t tx_queue_write;
+    uint32_t storage_write;
+    uint32_t drops[MONITOR_DROP_COUNT];
+    uint8_t queue_high_water[MONITOR_QUEUE_COUNT]; // Percent of capacity
+    uint8_t cpu_load;                              // Percent over the last sample period
+    uint16_t sd_write_latency_avg_ms;
+    uint16_t sd_write_latency_max_ms;
+    uint16_t min_stack_unused; // Smallest stack headroom of any thread in bytes, 0xFFFF if unknown (version 2)
+    uint16_t sd_latency_hist[MONITOR_SD_OP_COUNT][MONITOR_SD_LATENCY_BUCKETS]; // Saturating counts (version 3)
+    uint16_t sd_errors[MONITOR_SD_OP_COUNT];                                   // (version 3)
+    struct monitor_boot_record boot;                                           // This boot (version 4)
+    uint32_t energy_uah[MONITOR_ENERGY_COUNT]; // Estimated charge per rail since the reset in uAh (version 5)
+    struct monitor_sd_card sd_card;            // (version 6)
+    uint32_t sd_bytes[MONITOR_SD_OP_COUNT];    // Moved by successful operations (version 6)
+    uint32_t sd_busy_ms[MONITOR_SD_OP_COUNT];  // Spent in operations, bytes per ms is the throughput (version 6)
+    uint32_t deadline_misses[MONITOR_DEADLINE_COUNT]; // Since the reset, 0 without latency tracing (version 7)
+    struct monitor_forensics last_reset;              // Left by the previous boot (version 8)
+    uint32_t encode_skips; // Frames left unencoded as no sink could take them, tx queue full included (version 9)
+} __attribute__((packed));
+
+/**
+ * @brief Record the current fill level of a queue, keeping its high-water mark
+ *
+ * @param queue Queue being reported
+ * @param used Entries (or bytes) currently in the queue
+ * @param capacity Entries (or bytes) the queue can hold
+ */
+void monitor_queue_level(enum monitor_queue queue, uint32_t used, uint32_t capacity);
+
+/**
+ * @brief Count dropped audio frames against their cause
+ */
+void monitor_add_drops(enum monitor_drop_cause cause, uint32_t count);
+
+/**
+ * @brief Record how long one SD card operation took
+ *
+ * Writes and syncs also feed sd_write_latency_avg_ms and sd_write_latency_max_ms.
+ */
+void monitor_sd_latency(enum monitor_sd_op op, uint32_t ms);
+
+/**
+ * @brief Count a failed SD card operation
+ */
+void monitor_sd_error(enum monitor_sd_op op);
+
+/**
+ * @brief Count the bytes moved by a successful SD card operation
+ *
+ * Together with the time monitor_sd_latency() adds up per operation this gives the card throughput.
+ */
+void monitor_sd_bytes(enum monitor_sd_op op, uint32_t bytes);
+
+/**
+ * @brief SD card types, told apart by capacity
+ */
+enum monitor_sd_card_type {
+    MONITOR_SD_CARD_NONE, // No card mounted yet
+    MONITOR_SD_CARD_SDSC, // Up to 2 GB
+    MONITOR_SD_CARD_SDHC, // Up to 32 GB
+    MONITOR_SD_CARD_SDXC, // Larger
+};
+
+/**
+ * @brief The mounted SD card and the bus it runs on
+ */
+struct monitor_sd_card {
+    uint8_t type; // enum monitor_sd_card_type
+    uint32_t capacity_mb;
+    uint32_t clock_khz; // SPI clock after identification, 0 if it couldn't be set
+} __attribute__((packed));
+
+/**
+ * @brief Record the card found by the last mount
+ */
+void monitor_sd_card(const struct monitor_sd_card *card);
+
+/**
+ * @brief Record that the current boot reached a phase
+ *
+ * Only the first call per phase counts. May be called before monitor_init() and from any thread.
+ */
+void monitor_boot_mark(enum monitor_boot_phase phase);
+
+/**
+ * @brief Copy the timelines of the last boots, newest (this one) first
+ *
+ * @param records Array to fill
+ * @param max Number of entries in the array
+ * @return Number of boots copied
+ */
+size_t monitor_get_boot_history(struct monitor_boot_record *records, size_t max);
+
+/**
+ * @brief Log the timelines of the last boots
+ */
+void monitor_log_boots(void);
+
+/**
+ * @brief Record that a worker completed a step
+ *
+ * Two plain stores, cheap enough for every frame. Each worker must only be reported from its own thread.
+ */
+void monitor_progress(enum monitor_worker worker, enum monitor_step step);
+
+/**
+ * @brief Record the SD request the worker starts, or MONITOR_SD_IDLE when it finishes one
+ */
+void monitor_sd_request(uint8_t type);
+
+/**
+ * @brief Snapshot the pipeline state into retained RAM for the next boot to report
+ *
+ * Callable from an ISR or the fatal error handler: no locks, no logging.
+ *
+ * @param cause Why the snapshot was taken
+ * @param reason K_ERR_* for a fatal error, 0 otherwise
+ */
+void monitor_forensics_capture(enum monitor_forensic_cause cause, uint32_t reason);
+
+/**
+ * @brief Drop a snapshot taken this boot, the stall it was taken for cleared before the reset
+ */
+void monitor_forensics_discard(void);
+
+/**
+ * @brief Get the snapshot the previous boot left, cause is MONITOR_FORENSIC_NONE if there was none
+ */
+void monitor_get_forensics(struct monitor_forensics *forensics);
+
+/**
+ * @brief Log the snapshot the previous boot left
+ */
+void monitor_log_forensics(void);
+
+/**
+ * @brief Copy all current metrics into a snapshot
+ */
+void monitor_get_snapshot(struct monitor_snapshot *snapshot);
+
+#define MONITOR_MAX_THREADS 16
+
+/**
+ * @brief CPU and stack usage of one thread over the last sample period
+ */
+struct monitor_thread_stats {
+    char name[24];
+    uint8_t cpu_percent;   // MONITOR_CPU_LOAD_UNKNOWN without CONFIG_SCHED_THREAD_USAGE_ALL
+    uint32_t stack_size;   // 0 without CONFIG_THREAD_STACK_INFO
+    uint32_t stack_unused; // Never-touched stack bytes, needs CONFIG_INIT_STACKS
+};
+
+/**
+ * @brief Copy the latest per-thread statistics
+ *
+ * Threads are sampled every MONITOR_SAMPLE_INTERVAL_MS when CONFIG_THREAD_MONITOR is enabled.
+ *
+ * @param stats Array to fill
+ * @param max Number of entries in the array
+ * @return Number of threads copied
+ */
+size_t monitor_get_thread_stats(struct monitor_thread_stats *stats, size_t max);
+
+/**
+ * @brief Log the latest per-thread statistics
+ */
+void monitor_log_threads(void);
+
 /**
  * @brief Log all current metrics
  */
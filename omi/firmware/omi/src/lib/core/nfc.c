@@ -5,6 +5,13 @@
 #include <nfc_t2t_lib.h>
 #include <zephyr/drivers/hwinfo.h>
 #include <zephyr/logging/log.h>
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+#include <nfc/ndef/le_oob_rec.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+
+#include "transport.h"
+#endif
 
 // for later......
 LOG_MODULE_REGISTER(nfc, CONFIG_LOG_DEFAULT_LEVEL);
@@ -12,12 +19,36 @@ LOG_MODULE_REGISTER(nfc, CONFIG_LOG_DEFAULT_LEVEL);
 #define MAX_URI_LENGTH 64
 #define MAX_DEVICE_ID_LENGTH 7 // 6 chars + null terminator
 #define NDEF_MSG_BUF_SIZE 256
-#define MAX_REC_COUNT 1
+#define MAX_REC_COUNT 2
 
 static uint8_t ndef_msg_buf[NDEF_MSG_BUF_SIZE];
+static uint32_t ndef_msg_len = 0;
 static char device_id[MAX_DEVICE_ID_LENGTH];
 static char uri_buffer[MAX_URI_LENGTH];
 
+NFC_NDEF_MSG_DEF(nfc_msg, MAX_REC_COUNT);
+
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+#ifndef CONFIG_BT_SMP
+#error "CONFIG_OMI_ENABLE_NFC_PAIRING needs CONFIG_BT_SMP"
+#endif
+
+// A phone that reads the tag gets the address and LE Secure Connections OOB data first, so it
+// connects straight away instead of scanning and pairs authenticated without user interaction.
+// The OOB data is single use: it is generated again after every pairing attempt.
+static struct bt_le_oob oob_local;
+static struct nfc_ndef_le_oob_rec_payload_desc oob_payload;
+
+static void nfc_pairing_refresh(struct k_work *work);
+static K_WORK_DEFINE(nfc_pairing_refresh_work, nfc_pairing_refresh);
+
+static void nfc_field_on(struct k_work *work)
+{
+    transport_advertise_fast();
+}
+static K_WORK_DEFINE(nfc_field_on_work, nfc_field_on);
+#endif
+
 // int get_device_id(char *device_id_out, size_t len)
 // {
 //     if (len < MAX_DEVICE_ID_LENGTH) {
@@ -80,6 +111,12 @@ int nfc_wake(void)
 static void nfc_callback(void *context, nfc_t2t_event_t event, const uint8_t *data, size_t data_length)
 {
     LOG_INF("NFC Event: %d", event);
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+    // A phone is reading the tag and will connect in a moment. Called from the NFC interrupt
+    if (event == NFC_T2T_EVENT_FIELD_ON) {
+        k_work_submit(&nfc_field_on_work);
+    }
+#endif
 }
 
 static int nfc_create_message(void)
@@ -93,8 +130,30 @@ static int nfc_create_message(void)
 
     snprintf(uri_buffer, sizeof(uri_buffer), "https://friend.based.com/pair?id=%s", device_id);
 
-    NFC_NDEF_MSG_DEF(nfc_msg, MAX_REC_COUNT);
     NFC_NDEF_URI_RECORD_DESC_DEF(uri_rec, 0, uri_buffer, strlen(uri_buffer));
+    nfc_ndef_msg_clear(&NFC_NDEF_MSG(nfc_msg));
+
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+    err = bt_le_oob_get_local(BT_ID_DEFAULT, &oob_local);
+    if (err != 0) {
+        LOG_ERR("Failed to get local OOB data, error: %d", err);
+        return err;
+    }
+    oob_payload = (struct nfc_ndef_le_oob_rec_payload_desc) {
+        .addr = &oob_local.addr,
+        .le_sc_data = &oob_local.le_sc_data,
+        .local_name = bt_get_name(),
+        .le_role = NFC_NDEF_LE_OOB_REC_LE_ROLE(NFC_NDEF_LE_OOB_REC_LE_ROLE_PERIPH_ONLY),
+        .flags = NFC_NDEF_LE_OOB_REC_FLAGS(BT_LE_AD_NO_BREDR),
+    };
+    NFC_NDEF_LE_OOB_RECORD_DESC_DEF(oob_rec, '0', &oob_payload);
+    // First, so the phone's handover picks it up before anything else
+    err = nfc_ndef_msg_record_add(&NFC_NDEF_MSG(nfc_msg), &NFC_NDEF_LE_OOB_RECORD_DESC(oob_rec));
+    if (err != 0) {
+        LOG_ERR("Failed to add OOB record to NDEF message, error: %d", err);
+        return -EIO;
+    }
+#endif
 
     err = nfc_ndef_msg_record_add(&NFC_NDEF_MSG(nfc_msg), &NFC_NDEF_URI_RECORD_DESC(uri_rec));
     if (err != 0) {
@@ -102,8 +161,8 @@ static int nfc_create_message(void)
         return -EIO;
     }
 
-    uint32_t msg_len = sizeof(ndef_msg_buf);
-    err = nfc_ndef_msg_encode(&NFC_NDEF_MSG(nfc_msg), ndef_msg_buf, &msg_len);
+    ndef_msg_len = sizeof(ndef_msg_buf);
+    err = nfc_ndef_msg_encode(&NFC_NDEF_MSG(nfc_msg), ndef_msg_buf, &ndef_msg_len);
     if (err != 0) {
         LOG_ERR("Failed to encode NDEF message, error: %d", err);
         return -EIO;
@@ -112,10 +171,76 @@ static int nfc_create_message(void)
     return 0;
 }
 
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+static void nfc_pairing_refresh(struct k_work *work)
+{
+    // The payload can only change while emulation is stopped
+    nfc_t2t_emulation_stop();
+    if (nfc_create_message() == 0) {
+        nfc_t2t_payload_set(ndef_msg_buf, ndef_msg_len);
+    }
+    nfc_t2t_emulation_start();
+}
+
+static void auth_oob_data_request(struct bt_conn *conn, struct bt_conn_oob_info *info)
+{
+    // The phone read our data from the tag; a tag has no way to get the phone's
+    if (info->type != BT_CONN_OOB_LE_SC || info->lesc.oob_config != BT_CONN_OOB_LOCAL_ONLY) {
+        LOG_WRN("OOB data requested that the tag can't provide");
+        bt_conn_auth_cancel(conn);
+        return;
+    }
+    int err = bt_le_oob_set_sc_data(conn, &oob_local.le_sc_data, NULL);
+    if (err) {
+        LOG_ERR("Failed to set OOB data (err %d)", err);
+        bt_conn_auth_cancel(conn);
+    }
+}
+
+static void auth_cancel(struct bt_conn *conn)
+{
+    LOG_INF("Pairing cancelled");
+}
+
+static void pairing_complete(struct bt_conn *conn, bool bonded)
+{
+    LOG_INF("Paired, %s", bonded ? "bonded" : "not bonded");
+    k_work_submit(&nfc_pairing_refresh_work);
+}
+
+static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason)
+{
+    LOG_WRN("Pairing failed (reason %d)", reason);
+    k_work_submit(&nfc_pairing_refresh_work);
+}
+
+// No display or keyboard: phones without the tag data still pair with Just Works
+static struct bt_conn_auth_cb auth_callbacks = {
+    .oob_data_request = auth_oob_data_request,
+    .cancel = auth_cancel,
+};
+
+static struct bt_conn_auth_info_cb auth_info_callbacks = {
+    .pairing_complete = pairing_complete,
+    .pairing_failed = pairing_failed,
+};
+#endif
+
 int nfc_init(void)
 {
     int err;
 
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+    err = bt_conn_auth_cb_register(&auth_callbacks);
+    if (err == 0) {
+        err = bt_conn_auth_info_cb_register(&auth_info_callbacks);
+    }
+    if (err != 0) {
+        LOG_ERR("Failed to register pairing callbacks, error: %d", err);
+        return err;
+    }
+#endif
+
     err = nfc_create_message();
     if (err != 0) {
         LOG_ERR("Failed to create NFC message, error: %d", err);
@@ -130,7 +255,7 @@ int nfc_init(void)
     }
 
     /* Set payload */
-    err = nfc_t2t_payload_set(ndef_msg_buf, sizeof(ndef_msg_buf));
+    err = nfc_t2t_payload_set(ndef_msg_buf, ndef_msg_len);
     if (err != 0) {
         LOG_ERR("Failed to set NFC payload, error: %d", err);
         return err;
@@ -10,7 +10,9 @@ int nfc_wake(void);
 /**
  * @brief Initialize NFC functionality
  *
- * This function sets up NFC with the device's pairing ID and URL.
+ * This function sets up NFC with the device's pairing ID and URL. With CONFIG_OMI_ENABLE_NFC_PAIRING
+ * the tag also carries the Bluetooth address and LE Secure Connections OOB data, so a phone tap
+ * connects and pairs without scanning; call it after bt_enable() and loading the identity.
  *
  * @return 0 if successful, negative errno code if error
  */
@@ -0,0 +1,272 @@
+#include "pipeline_bench.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+
+#include "codec.h"
+#include "config.h"
+#include "mic.h"
+#include "pipe_bench.h"
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+#include "storage.h"
+#endif
+#include "storage_record.h"
+#include "transport.h"
+
+LOG_MODULE_REGISTER(pipeline_bench, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define PIPELINE_BENCH_FRAMES 500         // 10 s of audio at 20 ms
+#define PIPELINE_BENCH_SETTLE_MS 100      // no progress for this long ends the run
+#define PIPELINE_BENCH_DRAIN_TIMEOUT_MS 5000
+#define PIPELINE_BENCH_TWO_PI 6.2831853f
+#define PIPELINE_PACK_RECORDS 1000000
+#define PIPELINE_CORE_FRAMES 10000
+
+K_THREAD_STACK_DEFINE(pipeline_bench_stack, 2048);
+static struct k_thread pipeline_bench_thread;
+static atomic_t pipeline_bench_running = ATOMIC_INIT(0);
+
+// Voiced harmonics with a gliding pitch and a syllable envelope, plus a little noise, so the VAD
+// and the encoder see something like speech
+static void pipeline_bench_fill(int16_t *frame, uint32_t first_sample)
+{
+    static uint32_t noise = 0x12345678;
+    for (uint16_t i = 0; i < CODEC_PACKAGE_SAMPLES; i++) {
+        float t = (float) (first_sample + i) / AUDIO_SAMPLE_RATE;
+        float f0 = 140.0f + 40.0f * sinf(PIPELINE_BENCH_TWO_PI * 0.7f * t);
+        float envelope = 0.5f + 0.5f * sinf(PIPELINE_BENCH_TWO_PI * 4.0f * t);
+        float voiced = 0;
+        for (int h = 1; h <= 6; h++) {
+            voiced += sinf(PIPELINE_BENCH_TWO_PI * f0 * h * t) / h;
+        }
+        noise = noise * 1664525u + 1013904223u;
+        float sample = 6000.0f * envelope * voiced + (float) ((int32_t) noise >> 20);
+        frame[i] = (int16_t) CLAMP(sample, INT16_MIN, INT16_MAX);
+    }
+}
+
+// Returns the uptime of the last frame the pusher took, once nothing moved for PIPELINE_BENCH_SETTLE_MS
+static int64_t pipeline_bench_drain(void)
+{
+    struct transport_bench_stats stats;
+    int64_t deadline = k_uptime_get() + PIPELINE_BENCH_DRAIN_TIMEOUT_MS;
+    int64_t last_progress = k_uptime_get();
+    uint32_t last_frames = UINT32_MAX;
+
+    while (k_uptime_get() < deadline) {
+        transport_bench_get(&stats);
+        if (stats.frames != last_frames || transport_audio_pending()) {
+            last_frames = stats.frames;
+            last_progress = k_uptime_get();
+        } else if (k_uptime_get() - last_progress >= PIPELINE_BENCH_SETTLE_MS) {
+            break;
+        }
+        k_sleep(K_MSEC(5));
+    }
+    return last_progress;
+}
+
+static void pipeline_bench_entry(void *p1, void *p2, void *p3)
+{
+    uint32_t frames = (uint32_t) (uintptr_t) p1;
+    bool mic_was_running = mic_is_running();
+    uint32_t alloc_stalls = 0;
+    uint32_t submit_failures = 0;
+
+    // Live frames still in flight go out to their real sinks first
+    if (mic_was_running) {
+        mic_pause();
+    }
+    pipeline_bench_drain();
+    transport_bench_sink(true);
+
+    LOG_INF("Pipeline benchmark: %u frames of %u samples", frames, CODEC_PACKAGE_SAMPLES);
+    int64_t start = k_uptime_get();
+    for (uint32_t n = 0; n < frames; n++) {
+        int16_t *frame;
+        // The pool runs dry whenever the encoder falls behind, which is what paces the replay
+        while (!(frame = codec_alloc_frame())) {
+            alloc_stalls++;
+            k_sleep(K_MSEC(1));
+        }
+        pipeline_bench_fill(frame, n * CODEC_PACKAGE_SAMPLES);
+        if (codec_submit_frame(frame, k_uptime_get_32())) {
+            submit_failures++;
+        }
+    }
+    int64_t end = pipeline_bench_drain();
+
+    struct transport_bench_stats stats;
+    transport_bench_get(&stats);
+    transport_bench_sink(false);
+    if (mic_was_running) {
+        mic_resume();
+    }
+
+    uint32_t queued = frames - submit_failures;
+    uint32_t elapsed_ms = MAX((uint32_t) (end - start), 1);
+    uint32_t delivered = MAX(stats.frames, 1);
+    uint32_t fps_x10 = stats.frames * 10000 / elapsed_ms;
+    uint32_t copies_x100 = stats.copies * 100 / delivered;
+    LOG_INF("%u frames in %u ms, %u.%u frames/s (%ux real time), %u gated by the VAD", stats.frames, elapsed_ms,
+            fps_x10 / 10, fps_x10 % 10, fps_x10 * CODEC_PACKAGE_SAMPLES / AUDIO_SAMPLE_RATE / 10,
+            queued > stats.queue_claims ? queued - stats.queue_claims : 0);
+    LOG_INF("Copies per frame %u.%02u, %u bytes per frame, %u notifications, %u storage blocks", copies_x100 / 100,
+            copies_x100 % 100, stats.copied_bytes / delivered, stats.packets, stats.storage_blocks);
+    LOG_INF("Allocations: %u codec frames (%u waits on an empty pool, %u not queued), %u tx queue slots (%u full)",
+            frames, alloc_stalls, submit_failures, stats.queue_claims, stats.queue_drops);
+    LOG_INF("Pipeline benchmark done");
+    atomic_set(&pipeline_bench_running, 0);
+}
+
+//
+// Storage record round trip and pipeline core
+//
+
+static void pipeline_pack_entry(void *p1, void *p2, void *p3)
+{
+    static const uint8_t tags[] = {STORAGE_RECORD_IMU, STORAGE_RECORD_IMU_VARINT, STORAGE_RECORD_TRACE};
+    uint32_t records = (uint32_t) (uintptr_t) p1;
+    uint32_t seed = (uint32_t) (uintptr_t) p2;
+    struct pipe_bench_record_result r;
+
+    LOG_INF("Storage record round trip: %u records, seed %u", records, seed);
+    pipe_bench_record(&storage_record_format, tags, ARRAY_SIZE(tags), records, seed, &r);
+    if (r.malformed) {
+        LOG_ERR("Block %u malformed at %u", r.bad_block, r.bad_pos);
+    } else if (r.mismatches) {
+        LOG_ERR("Record %u in block %u at %u: tag 0x%02x size %u, expected tag 0x%02x size %u", r.bad_record,
+                r.bad_block, r.bad_pos, r.bad_tag, r.bad_size, r.expected_tag, r.expected_size);
+    }
+
+    // Records still in the open block are never parsed, there is no terminator yet
+    uint32_t pack_ms = r.pack_us / 1000;
+    uint32_t parse_ms = r.parse_us / 1000;
+    LOG_INF("%u records in %u blocks, %u parsed back, %u mismatches", r.appended, r.blocks, r.parsed, r.mismatches);
+    LOG_INF("Pack %u ms, parse %u ms for %u KB: %u KB/s packed, %u KB/s parsed", pack_ms, parse_ms,
+            (uint32_t) (r.bytes / 1024), (uint32_t) (r.bytes * 1000 / 1024 / MAX(pack_ms, 1)),
+            (uint32_t) (r.bytes * 1000 / 1024 / MAX(parse_ms, 1)));
+    LOG_INF("Storage record round trip %s", r.mismatches ? "FAILED" : "passed");
+    atomic_set(&pipeline_bench_running, 0);
+}
+
+// The same runs as the other products' builds of the library, so the numbers compare
+static void pipeline_core_entry(void *p1, void *p2, void *p3)
+{
+    static const struct pipe_vad_config vad_config = {
+        .samples = CODEC_PACKAGE_SAMPLES,
+        .min_level = CODEC_VAD_MIN_LEVEL,
+        .noise_margin = CODEC_VAD_NOISE_MARGIN,
+        .hangover_frames = CODEC_VAD_HANGOVER_FRAMES,
+        .keepalive_frames = CODEC_VAD_KEEPALIVE_FRAMES,
+    };
+    uint32_t frames = (uint32_t) (uintptr_t) p1;
+    struct pipe_bench_ring_result ring;
+    struct pipe_bench_vad_result vad;
+
+    pipe_bench_ring(frames, CODEC_OUTPUT_MAX_BYTES, &ring);
+    LOG_INF("Ring: %u frames of %u bytes in %u us, %u KB/s, %u dropped, %u corrupt", ring.frames,
+            CODEC_OUTPUT_MAX_BYTES, ring.us, (uint32_t) (ring.bytes * 1000000 / 1024 / MAX(ring.us, 1)),
+            ring.dropped, ring.corrupt);
+    pipe_bench_vad(&vad_config, frames, &vad);
+    LOG_INF("VAD: %u frames of %u samples in %u us, %u us per frame, %u voiced, %u passed", vad.frames,
+            CODEC_PACKAGE_SAMPLES, vad.us, vad.us / MAX(vad.frames, 1), vad.voiced, vad.passed);
+    atomic_set(&pipeline_bench_running, 0);
+}
+
+int pipeline_pack_test_start(uint32_t records, uint32_t seed)
+{
+    if (!atomic_cas(&pipeline_bench_running, 0, 1)) {
+        return -EBUSY;
+    }
+    k_thread_create(&pipeline_bench_thread, pipeline_bench_stack, K_THREAD_STACK_SIZEOF(pipeline_bench_stack),
+                    pipeline_pack_entry, (void *) (uintptr_t) (records ? records : PIPELINE_PACK_RECORDS),
+                    (void *) (uintptr_t) seed, NULL, K_PRIO_PREEMPT(14), 0, K_NO_WAIT);
+    k_thread_name_set(&pipeline_bench_thread, "pipeline_bench");
+    return 0;
+}
+
+int pipeline_core_bench_start(uint32_t frames)
+{
+    if (!atomic_cas(&pipeline_bench_running, 0, 1)) {
+        return -EBUSY;
+    }
+    k_thread_create(&pipeline_bench_thread, pipeline_bench_stack, K_THREAD_STACK_SIZEOF(pipeline_bench_stack),
+                    pipeline_core_entry, (void *) (uintptr_t) (frames ? frames : PIPELINE_CORE_FRAMES), NULL, NULL,
+                    K_PRIO_PREEMPT(14), 0, K_NO_WAIT);
+    k_thread_name_set(&pipeline_bench_thread, "pipeline_bench");
+    return 0;
+}
+
+int pipeline_bench_start(uint32_t frames)
+{
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    // A sync owns the mic and the pusher's attention
+    if (storage_sync_active()) {
+        return -EBUSY;
+    }
+#endif
+    if (!atomic_cas(&pipeline_bench_running, 0, 1)) {
+        return -EBUSY;
+    }
+    k_thread_create(&pipeline_bench_thread, pipeline_bench_stack, K_THREAD_STACK_SIZEOF(pipeline_bench_stack),
+                    pipeline_bench_entry, (void *) (uintptr_t) (frames ? frames : PIPELINE_BENCH_FRAMES), NULL, NULL,
+                    K_PRIO_PREEMPT(8), 0, K_NO_WAIT);
+    k_thread_name_set(&pipeline_bench_thread, "pipeline_bench");
+    return 0;
+}
+
+#ifdef CONFIG_SHELL
+static int cmd_pipeline_bench(const struct shell *sh, size_t argc, char **argv)
+{
+    uint32_t frames = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : 0;
+    int err = pipeline_bench_start(frames);
+    if (err) {
+        shell_error(sh, "Benchmark already running or a sync is in progress");
+        return err;
+    }
+    shell_print(sh, "Benchmark started, results go to the log");
+    return 0;
+}
+
+static int cmd_pipeline_pack(const struct shell *sh, size_t argc, char **argv)
+{
+    uint32_t records = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : 0;
+    uint32_t seed = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : k_cycle_get_32();
+    int err = pipeline_pack_test_start(records, seed);
+    if (err) {
+        shell_error(sh, "Benchmark already running");
+        return err;
+    }
+    shell_print(sh, "Round trip started with seed %u, results go to the log", seed);
+    return 0;
+}
+
+static int cmd_pipeline_core(const struct shell *sh, size_t argc, char **argv)
+{
+    uint32_t frames = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : 0;
+    int err = pipeline_core_bench_start(frames);
+    if (err) {
+        shell_error(sh, "Benchmark already running");
+        return err;
+    }
+    shell_print(sh, "Core benchmark started, results go to the log");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(pipeline_cmds,
+                               SHELL_CMD_ARG(bench, NULL, "Replay [frames] through codec, framing and packing",
+                                             cmd_pipeline_bench, 1, 1),
+                               SHELL_CMD_ARG(pack, NULL, "Round-trip [records] [seed] through the storage packer",
+                                             cmd_pipeline_pack, 1, 2),
+                               SHELL_CMD_ARG(core, NULL, "Run [frames] through the shared ring and VAD benchmarks",
+                                             cmd_pipeline_core, 1, 1),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(pipeline, &pipeline_cmds, "Audio pipeline", NULL);
+#endif
@@ -0,0 +1,45 @@
+#ifndef PIPELINE_BENCH_H
+#define PIPELINE_BENCH_H
+
+#include <stdint.h>
+
+/**
+ * @brief Replay a synthetic corpus through the audio pipeline on its own thread
+ *
+ * The mic is paused and the frames go through the codec queue and encoder, the tx queue and the
+ * pusher's GATT framing and storage packing, with the GATT layer and the SD card mocked out (see
+ * transport_bench_sink()). Logs frames per second, payload copies per frame and the allocations
+ * taken from each pool, then hands capture back.
+ *
+ * @param frames Frames to replay, 0 for PIPELINE_BENCH_FRAMES
+ * @return 0 if started, -EBUSY if a run or a storage sync is in progress
+ */
+int pipeline_bench_start(uint32_t frames);
+
+/**
+ * @brief Round-trip random record sequences through the storage packer on the benchmark thread
+ *
+ * Runs pipe_bench_record() of the shared pipeline library over storage_record_format: audio and
+ * tagged records of random lengths, biased towards the exact-fit and overflow cases, each full
+ * block parsed back and every record's tag, length and payload checked. Logs mismatches, blocks,
+ * and the pack and parse throughput. Uses RAM blocks only, the card is not touched.
+ *
+ * @param records Records to pack, 0 for PIPELINE_PACK_RECORDS
+ * @param seed Seed of the length sequence, so a failing run can be repeated
+ * @return 0 if started, -EBUSY if a run is in progress
+ */
+int pipeline_pack_test_start(uint32_t records, uint32_t seed);
+
+/**
+ * @brief Run the shared pipeline library's ring and VAD benchmarks on the benchmark thread
+ *
+ * Frames of CODEC_OUTPUT_MAX_BYTES through a pipe_ring, and synthetic speech of
+ * CODEC_PACKAGE_SAMPLES through the codec's VAD settings. The same runs exist on every product
+ * built with the library, so their logged numbers compare directly.
+ *
+ * @param frames Frames for each run, 0 for PIPELINE_CORE_FRAMES
+ * @return 0 if started, -EBUSY if a run is in progress
+ */
+int pipeline_core_bench_start(uint32_t frames);
+
+#endif // PIPELINE_BENCH_H
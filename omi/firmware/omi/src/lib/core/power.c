@@ -0,0 +1,185 @@
+#include "power.h"
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/pm/device_runtime.h>
+#include <zephyr/sys/atomic.h>
+
+#include "mic.h"
+#include "sd_card.h"
+#ifdef CONFIG_OMI_ENABLE_WIFI
+#include "wifi.h"
+#endif
+
+LOG_MODULE_REGISTER(power, CONFIG_LOG_DEFAULT_LEVEL);
+
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+#define CAPTURE_FLASH POWER_FLASH // recorded audio lands in the flash log first
+#else
+#define CAPTURE_FLASH 0
+#endif
+
+struct power_needs {
+    uint8_t needs;  // POWER_* bits the activity runs on
+    uint8_t blocks; // POWER_* bits kept off while it runs, whoever else needs them
+};
+
+static const struct power_needs activity_needs[POWER_ACTIVITY_COUNT] = {
+    [POWER_ACTIVITY_CAPTURE] = {POWER_MIC | POWER_SD | CAPTURE_FLASH, 0},
+    [POWER_ACTIVITY_SYNC] = {POWER_SD, 0},
+    [POWER_ACTIVITY_WIFI_SYNC] = {POWER_SD | POWER_WIFI, 0},
+    [POWER_ACTIVITY_WIFI_LIVE] = {POWER_MIC | POWER_WIFI, 0},
+    [POWER_ACTIVITY_QUIET] = {0, POWER_MIC},
+};
+
+static const struct device *const flash_dev = DEVICE_DT_GET(DT_NODELABEL(spi_flash));
+
+static atomic_t activities; // held activities, one bit each
+static uint8_t powered;     // POWER_* bits switched on, only changed under power_lock
+static atomic_t wifi_blocked;
+K_MUTEX_DEFINE(power_lock);
+
+static void power_apply_work_handler(struct k_work *work);
+K_WORK_DEFINE(power_apply_work, power_apply_work_handler);
+
+static void set_mic(bool on)
+{
+    if (on) {
+        mic_resume();
+    } else {
+        mic_pause();
+    }
+}
+
+static void set_sd(bool on)
+{
+    // The SD worker powers the card when it mounts it, only switching off is up to the manager
+    if (on) {
+        return;
+    }
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    if (!is_sd_on()) {
+        return;
+    }
+#endif
+    app_sd_off();
+}
+
+static void set_flash(bool on)
+{
+    int err = on ? pm_device_runtime_get(flash_dev) : pm_device_runtime_put(flash_dev);
+    if (err) {
+        LOG_ERR("Failed to %s the SPI flash: %d", on ? "resume" : "suspend", err);
+    }
+}
+
+#ifdef CONFIG_OMI_ENABLE_WIFI
+static void set_wifi(bool on)
+{
+    if (on) {
+        wifi_turn_on();
+    } else if (is_wifi_on()) {
+        // Lingers a while, so a session started soon after only has to wait for the hub
+        wifi_end_session();
+    }
+}
+#endif
+
+static const struct {
+    uint8_t bit;
+    void (*set)(bool on);
+} switches[] = {
+    {POWER_MIC, set_mic},
+    {POWER_SD, set_sd},
+    {POWER_FLASH, set_flash},
+#ifdef CONFIG_OMI_ENABLE_WIFI
+    {POWER_WIFI, set_wifi},
+#endif
+};
+
+static void power_apply(void)
+{
+    k_mutex_lock(&power_lock, K_FOREVER);
+
+    uint32_t held = (uint32_t) atomic_get(&activities);
+    uint8_t needs = 0;
+    uint8_t blocks = atomic_get(&wifi_blocked) ? POWER_WIFI : 0;
+    for (int i = 0; i < POWER_ACTIVITY_COUNT; i++) {
+        if (held & BIT(i)) {
+            needs |= activity_needs[i].needs;
+            blocks |= activity_needs[i].blocks;
+        }
+    }
+    uint8_t wanted = needs & ~blocks;
+
+    // Everything going off goes first, so a blocked peripheral stops before the one displacing it starts
+    if (wanted != powered) {
+        for (size_t i = 0; i < ARRAY_SIZE(switches); i++) {
+            if ((powered & ~wanted) & switches[i].bit) {
+                switches[i].set(false);
+            }
+        }
+        for (size_t i = 0; i < ARRAY_SIZE(switches); i++) {
+            if ((wanted & ~powered) & switches[i].bit) {
+                switches[i].set(true);
+            }
+        }
+        LOG_INF("Power state 0x%02x -> 0x%02x (activities 0x%02x)", powered, wanted, held);
+        powered = wanted;
+    }
+
+    k_mutex_unlock(&power_lock);
+}
+
+static void power_apply_work_handler(struct k_work *work)
+{
+    power_apply();
+}
+
+int power_init(void)
+{
+    // Suspends the flash right away, nothing holds it until capture starts
+    int err = pm_device_runtime_enable(flash_dev);
+    if (err) {
+        LOG_ERR("Failed to enable runtime PM for the SPI flash: %d", err);
+    }
+    return err;
+}
+
+void power_request(enum power_activity activity)
+{
+    if (!atomic_test_and_set_bit(&activities, activity)) {
+        power_apply();
+    }
+}
+
+void power_release(enum power_activity activity)
+{
+    if (atomic_test_and_clear_bit(&activities, activity)) {
+        power_apply();
+    }
+}
+
+void power_wifi_stopped(void)
+{
+    // The Wi-Fi thread can't wait for power_lock: whoever holds it may be waiting for Wi-Fi to turn off
+    bool held = atomic_test_and_clear_bit(&activities, POWER_ACTIVITY_WIFI_SYNC);
+    held |= atomic_test_and_clear_bit(&activities, POWER_ACTIVITY_WIFI_LIVE);
+    if (held) {
+        k_work_submit(&power_apply_work);
+    }
+}
+
+void power_set_wifi_allowed(bool allowed)
+{
+    if (atomic_set(&wifi_blocked, !allowed) != !allowed) {
+        LOG_INF("Wi-Fi %s", allowed ? "allowed" : "blocked");
+        power_apply();
+    }
+}
+
+uint8_t power_state(void)
+{
+    return powered;
+}
@@ -0,0 +1,66 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Activities that need peripherals powered. Each one declares what it needs and what it can't
+ * run alongside; the manager keeps a peripheral on exactly while some held activity needs it and
+ * none blocks it, and switches it as activities come and go.
+ */
+enum power_activity {
+    POWER_ACTIVITY_CAPTURE,   // live stream or offline record, held from boot until power off
+    POWER_ACTIVITY_SYNC,      // offline audio to the phone over BLE
+    POWER_ACTIVITY_WIFI_SYNC, // offline audio to the hub over Wi-Fi, recording goes on underneath
+    POWER_ACTIVITY_WIFI_LIVE, // live audio to the hub over Wi-Fi
+    POWER_ACTIVITY_QUIET,     // idle listen between probes, nothing worth capturing
+    POWER_ACTIVITY_COUNT,
+};
+
+// Peripherals under the manager, as a bit mask
+#define POWER_MIC (1 << 0)   // PDM capture
+#define POWER_SD (1 << 1)    // SD card rail, powered up by the SD worker when it mounts
+#define POWER_FLASH (1 << 2) // SPI NOR flash, through device runtime PM
+#define POWER_WIFI (1 << 3)  // nRF7002 interface and hub session
+
+/**
+ * @brief Take the SPI flash under device runtime PM, suspending it until an activity needs it
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int power_init(void);
+
+/**
+ * @brief Start an activity and power what it needs
+ *
+ * Blocks while peripherals switch (bringing Wi-Fi up or down may take seconds), so call from a
+ * thread or work item, not an ISR. Requesting a held activity does nothing.
+ */
+void power_request(enum power_activity activity);
+
+/**
+ * @brief End an activity and power off what nothing else needs
+ */
+void power_release(enum power_activity activity);
+
+/**
+ * @brief End the Wi-Fi activities after the Wi-Fi thread shut the interface down on its own
+ *
+ * Safe from the Wi-Fi thread: the remaining switches run on the system work queue.
+ */
+void power_wifi_stopped(void);
+
+/**
+ * @brief Keep Wi-Fi off whatever the activities want, for the performance governor
+ *
+ * Held Wi-Fi activities stay held, so Wi-Fi comes back once allowed again. Blocks like power_request().
+ */
+void power_set_wifi_allowed(bool allowed);
+
+/**
+ * @brief Get the peripherals the manager has powered, POWER_* bits
+ */
+uint8_t power_state(void);
+
+#endif // POWER_H
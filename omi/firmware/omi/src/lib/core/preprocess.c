@@ -0,0 +1,233 @@
+#include "preprocess.h"
+
+#include <arm_math.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "config.h"
+
+LOG_MODULE_REGISTER(preprocess, CONFIG_LOG_DEFAULT_LEVEL);
+
+// Noise suppression runs on 10ms hops with a 20ms sqrt-Hann window on both analysis and synthesis,
+// which adds back up to exactly the input at 50% overlap. The window is zero-padded to the FFT size.
+#define NS_HOP (AUDIO_SAMPLE_RATE / 100)
+#define NS_WINDOW (2 * NS_HOP)
+#if AUDIO_SAMPLE_RATE == 8000
+#define NS_FFT_ORDER 8
+#else
+#define NS_FFT_ORDER 9
+#endif
+#define NS_FFT_SIZE (1 << NS_FFT_ORDER)
+#define NS_OUT_SHIFT (16 - NS_FFT_ORDER) // forward and inverse arm_rfft_q31() together scale down by NS_FFT_SIZE
+#define NS_BINS (NS_FFT_SIZE / 2 + 1)
+
+BUILD_ASSERT(CODEC_PACKAGE_SAMPLES % NS_HOP == 0, "Codec frames must be whole noise suppression hops");
+BUILD_ASSERT(NS_FFT_SIZE >= NS_WINDOW, "FFT must hold a whole window");
+
+// First bin of each band (31.25Hz per bin at either rate), narrow where speech has most of its energy
+static const uint16_t ns_band_edges[] = {
+#if AUDIO_SAMPLE_RATE == 8000
+    0, 4, 8, 12, 16, 20, 24, 32, 40, 48, 64, 80, 96, NS_BINS,
+#else
+    0, 4, 8, 12, 16, 20, 24, 32, 40, 48, 64, 80, 96, 128, 160, 192, NS_BINS,
+#endif
+};
+#define NS_BANDS (ARRAY_SIZE(ns_band_edges) - 1)
+
+static arm_rfft_instance_q31 fft_forward;
+static arm_rfft_instance_q31 fft_inverse;
+static q31_t window[NS_WINDOW];
+static q31_t fft_buffer[NS_FFT_SIZE];
+static q31_t spectrum[2 * NS_FFT_SIZE];
+static int16_t last_hop[NS_HOP];   // previous input hop, first half of the next window
+static int32_t overlap[NS_HOP];    // second half of the last synthesis window
+static uint64_t noise_energy[NS_BANDS];
+static uint16_t band_gain[NS_BANDS]; // Q15
+static bool noise_primed = false;
+static uint16_t ns_backoff = 0;      // frames left with noise suppression skipped
+
+static int32_t hpf_prev = 0;
+static int32_t hpf_state = 0; // output, Q8
+static int32_t agc_gain = PREPROCESS_AGC_UNITY;
+
+static inline q31_t mul_q31(q31_t a, q31_t b)
+{
+    return (q31_t) (((int64_t) a * b) >> 31);
+}
+
+// One-pole DC blocker, also takes out handling and wind rumble below ~80Hz
+static void highpass(int16_t *samples, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        int32_t x = samples[i];
+        hpf_state = ((x - hpf_prev) << 8) + (int32_t) (((int64_t) hpf_state * PREPROCESS_HPF_POLE_Q15) >> 15);
+        hpf_prev = x;
+        samples[i] = (int16_t) __SSAT(hpf_state >> 8, 16);
+    }
+}
+
+static void update_band_gains(void)
+{
+    for (size_t b = 0; b < NS_BANDS; b++) {
+        uint64_t energy = 0;
+        for (int k = ns_band_edges[b]; k < ns_band_edges[b + 1]; k++) {
+            int64_t re = spectrum[2 * k] >> 12;
+            int64_t im = spectrum[2 * k + 1] >> 12;
+            energy += (uint64_t) (re * re + im * im);
+        }
+
+        // Same floor tracking as the VAD: follow quiet stretches quickly, speech only very slowly
+        if (!noise_primed) {
+            noise_energy[b] = energy;
+        } else if (energy < noise_energy[b]) {
+            noise_energy[b] = (noise_energy[b] * 3 + energy) / 4;
+        } else {
+            noise_energy[b] += (energy - noise_energy[b]) >> PREPROCESS_NS_NOISE_RISE_SHIFT;
+        }
+
+        // Spectral subtraction, over-subtracting so the residual noise stays below the floor
+        int32_t gain = 0;
+        if (energy > 0) {
+            uint64_t ratio = (noise_energy[b] * PREPROCESS_NS_OVERSUBTRACT << 15) / energy;
+            gain = ratio >= 32768 ? 0 : 32768 - (int32_t) ratio;
+        }
+        gain = MAX(gain, PREPROCESS_NS_MIN_GAIN_Q15);
+
+        // Smooth over time against musical noise, opening faster than closing
+        if (gain > band_gain[b]) {
+            band_gain[b] = (band_gain[b] + gain) / 2;
+        } else {
+            band_gain[b] = (band_gain[b] * 3 + gain) / 4;
+        }
+    }
+    noise_primed = true;
+}
+
+static void apply_band_gains(void)
+{
+    for (size_t b = 0; b < NS_BANDS; b++) {
+        int32_t gain = band_gain[b];
+        for (int k = ns_band_edges[b]; k < ns_band_edges[b + 1]; k++) {
+            // Bin and its mirror image, the inverse transform reads both
+            spectrum[2 * k] = (q31_t) (((int64_t) spectrum[2 * k] * gain) >> 15);
+            spectrum[2 * k + 1] = (q31_t) (((int64_t) spectrum[2 * k + 1] * gain) >> 15);
+            if (k > 0 && k < NS_FFT_SIZE / 2) {
+                int m = NS_FFT_SIZE - k;
+                spectrum[2 * m] = (q31_t) (((int64_t) spectrum[2 * m] * gain) >> 15);
+                spectrum[2 * m + 1] = (q31_t) (((int64_t) spectrum[2 * m + 1] * gain) >> 15);
+            }
+        }
+    }
+}
+
+static void suppress_hop(int16_t *hop)
+{
+    // Analysis window over the last two hops, samples in the top half of each q31
+    for (int n = 0; n < NS_HOP; n++) {
+        fft_buffer[n] = mul_q31((q31_t) last_hop[n] << 16, window[n]);
+        fft_buffer[NS_HOP + n] = mul_q31((q31_t) hop[n] << 16, window[NS_HOP + n]);
+    }
+    memset(&fft_buffer[NS_WINDOW], 0, (NS_FFT_SIZE - NS_WINDOW) * sizeof(q31_t));
+    memcpy(last_hop, hop, sizeof(last_hop));
+
+    arm_rfft_q31(&fft_forward, fft_buffer, spectrum);
+    update_band_gains();
+    apply_band_gains();
+    arm_rfft_q31(&fft_inverse, spectrum, fft_buffer);
+
+    // Synthesis window and overlap-add, undoing the transform scaling on the way back to int16
+    for (int n = 0; n < NS_HOP; n++) {
+        int32_t head = mul_q31(fft_buffer[n], window[n]) >> NS_OUT_SHIFT;
+        hop[n] = (int16_t) __SSAT(overlap[n] + head, 16);
+        overlap[n] = mul_q31(fft_buffer[NS_HOP + n], window[NS_HOP + n]) >> NS_OUT_SHIFT;
+    }
+}
+
+// Same one-hop latency as suppress_hop(), so skipping suppression doesn't shift the timeline
+static void delay_frame(int16_t *frame)
+{
+    int16_t newest[NS_HOP];
+    memcpy(newest, &frame[CODEC_PACKAGE_SAMPLES - NS_HOP], sizeof(newest));
+    memmove(&frame[NS_HOP], frame, (CODEC_PACKAGE_SAMPLES - NS_HOP) * sizeof(int16_t));
+    memcpy(frame, last_hop, sizeof(last_hop));
+    memcpy(last_hop, newest, sizeof(last_hop));
+    memset(overlap, 0, sizeof(overlap));
+}
+
+static void suppress_frame(int16_t *frame)
+{
+    if (ns_backoff > 0) {
+        ns_backoff--;
+        delay_frame(frame);
+        return;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    for (int i = 0; i < CODEC_PACKAGE_SAMPLES; i += NS_HOP) {
+        suppress_hop(&frame[i]);
+    }
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    // Encoding must not fall behind the mic, give the CPU back for a while
+    if (us > PREPROCESS_NS_BUDGET_US) {
+        LOG_WRN("Noise suppression took %u us, skipping it for %u frames", us, PREPROCESS_NS_BACKOFF_FRAMES);
+        ns_backoff = PREPROCESS_NS_BACKOFF_FRAMES;
+    }
+}
+
+// Slow AGC towards a target speech level, ramped across the frame so gain changes don't click
+static void agc_frame(int16_t *frame)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < CODEC_PACKAGE_SAMPLES; i++) {
+        sum += (uint32_t) abs(frame[i]);
+    }
+    int32_t level = sum / CODEC_PACKAGE_SAMPLES;
+
+    // Hold the gain through pauses, otherwise it would climb and pump up the residual noise
+    int32_t gain = agc_gain;
+    if (level >= PREPROCESS_AGC_MIN_LEVEL) {
+        int32_t target = (PREPROCESS_AGC_TARGET_LEVEL * PREPROCESS_AGC_UNITY) / level;
+        target = CLAMP(target, PREPROCESS_AGC_MIN_GAIN, PREPROCESS_AGC_MAX_GAIN);
+        if (target < gain) {
+            gain = (gain + target) / 2;
+        } else {
+            gain += (target - gain) >> PREPROCESS_AGC_RELEASE_SHIFT;
+        }
+    }
+
+    for (int i = 0; i < CODEC_PACKAGE_SAMPLES; i++) {
+        int32_t g = agc_gain + (gain - agc_gain) * i / CODEC_PACKAGE_SAMPLES;
+        frame[i] = (int16_t) __SSAT((frame[i] * g) / PREPROCESS_AGC_UNITY, 16);
+    }
+    agc_gain = gain;
+}
+
+int preprocess_init(void)
+{
+    if (arm_rfft_init_q31(&fft_forward, NS_FFT_SIZE, 0, 1) != ARM_MATH_SUCCESS ||
+        arm_rfft_init_q31(&fft_inverse, NS_FFT_SIZE, 1, 1) != ARM_MATH_SUCCESS) {
+        LOG_ERR("Failed to set up the %d point FFT", NS_FFT_SIZE);
+        return -EINVAL;
+    }
+
+    for (int n = 0; n < NS_WINDOW; n++) {
+        window[n] = (q31_t) (sinf((float) M_PI * n / NS_WINDOW) * 2147483647.0f);
+    }
+    for (size_t b = 0; b < NS_BANDS; b++) {
+        band_gain[b] = 32767;
+    }
+
+    LOG_INF("Pre-processing on, noise suppression budget %d us per frame", PREPROCESS_NS_BUDGET_US);
+    return 0;
+}
+
+void preprocess_frame(int16_t *frame)
+{
+    highpass(frame, CODEC_PACKAGE_SAMPLES);
+    suppress_frame(frame);
+    agc_frame(frame);
+}
@@ -0,0 +1,25 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <stdint.h>
+
+/**
+ * @brief Prepare the pre-processing stage
+ *
+ * Must be called once before the first preprocess_frame().
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int preprocess_init(void);
+
+/**
+ * @brief Clean up one mic frame before it is encoded
+ *
+ * Removes DC and rumble, suppresses stationary background noise and levels the result, in place.
+ * The output runs one 10ms hop behind the input. Only the codec thread may call this.
+ *
+ * @param frame CODEC_PACKAGE_SAMPLES mono samples
+ */
+void preprocess_frame(int16_t *frame);
+
+#endif
@@ -0,0 +1,59 @@
+#include "scratch.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "config.h"
+
+LOG_MODULE_REGISTER(scratch, CONFIG_LOG_DEFAULT_LEVEL);
+
+static uint8_t arena[SCRATCH_ARENA_SIZE] __aligned(8);
+static enum scratch_mode owner = SCRATCH_FREE;
+static struct k_spinlock owner_lock;
+
+static const char *const mode_names[SCRATCH_MODE_COUNT] = {"free", "sync", "Wi-Fi sync", "speaker", "firmware"};
+
+void *scratch_acquire(enum scratch_mode mode)
+{
+    if (mode == SCRATCH_FREE || mode >= SCRATCH_MODE_COUNT) {
+        return NULL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&owner_lock);
+    enum scratch_mode held = owner;
+    if (held == SCRATCH_FREE) {
+        owner = mode;
+    }
+    k_spin_unlock(&owner_lock, key);
+
+    if (held != SCRATCH_FREE && held != mode) {
+        LOG_WRN("Scratch arena wanted for %s, held by %s", mode_names[mode], mode_names[held]);
+        return NULL;
+    }
+    if (held == SCRATCH_FREE) {
+        LOG_DBG("Scratch arena taken for %s", mode_names[mode]);
+    }
+    return arena;
+}
+
+void scratch_release(enum scratch_mode mode)
+{
+    k_spinlock_key_t key = k_spin_lock(&owner_lock);
+    bool released = mode != SCRATCH_FREE && owner == mode;
+    if (released) {
+        owner = SCRATCH_FREE;
+    }
+    k_spin_unlock(&owner_lock, key);
+
+    if (released) {
+        LOG_DBG("Scratch arena released by %s", mode_names[mode]);
+    }
+}
+
+enum scratch_mode scratch_owner(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&owner_lock);
+    enum scratch_mode held = owner;
+    k_spin_unlock(&owner_lock, key);
+    return held;
+}
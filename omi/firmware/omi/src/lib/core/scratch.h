@@ -0,0 +1,44 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+/**
+ * Users of the scratch arena, one SCRATCH_ARENA_SIZE buffer for transfers that never run together.
+ *
+ * Live streaming is not one of them: the mic, codec and TX buffers are busy whenever the device
+ * is on and stay resident. Whoever asks while another mode holds the arena gets nothing and has to
+ * wait for it or give up.
+ */
+enum scratch_mode {
+    SCRATCH_FREE,
+    SCRATCH_SYNC,      // offline sync read-ahead, sent over GATT or L2CAP
+    SCRATCH_WIFI_SYNC, // offline sync read-ahead, sent over Wi-Fi
+    SCRATCH_SPEAKER,   // downlink audio waiting for the speaker thread
+    SCRATCH_FIRMWARE,  // firmware image received over Wi-Fi on its way to the SD card
+    SCRATCH_MODE_COUNT,
+};
+
+/**
+ * @brief Take the arena for a mode
+ *
+ * May be called from any thread or an ISR. Asking again for the mode that holds it returns the
+ * same memory, untouched.
+ *
+ * @return SCRATCH_ARENA_SIZE bytes, 8-byte aligned, or NULL if another mode holds the arena
+ */
+void *scratch_acquire(enum scratch_mode mode);
+
+/**
+ * @brief Give the arena back, nothing may touch its memory afterwards
+ *
+ * Ignored unless the mode holds it.
+ */
+void scratch_release(enum scratch_mode mode);
+
+/**
+ * @brief Get the mode holding the arena, SCRATCH_FREE if none
+ */
+enum scratch_mode scratch_owner(void);
+
+#endif // SCRATCH_H
@@ -6,15 +6,31 @@
 #include <sys/types.h>
 #include <zephyr/kernel.h>
 
-#define MAX_STORAGE_BYTES 0x1E000000 // 480MB
+#define MAX_STORAGE_BYTES 0x1E000000 // 480MB, until the card's free space is known
 #define MAX_WRITE_SIZE 440
 
+/* A block is a run of records. An audio record is [length][frame], any other record starts
+ * with a tag byte above every possible frame length: [tag][length][payload]. The first byte(s)
+ * of the record that did not fit end the block.
+ */
+#define STORAGE_RECORD_IMU 0xFF        // payload: struct accel_batch_header, then raw samples
+#define STORAGE_RECORD_IMU_DELTA 0xFE  // same, after the first sample int8 deltas per axis (format 2, not written)
+#define STORAGE_RECORD_TRACE 0xFD      // payload: struct flight_rec_header, then struct flight_rec_event
+#define STORAGE_RECORD_IMU_VARINT 0xFC // same as IMU, after the first sample varint deltas per axis (see accel.h)
+#define STORAGE_RECORD_IS_TAGGED(b) ((b) >= STORAGE_RECORD_IMU_VARINT)
+#define STORAGE_FORMAT_VERSION 4 // Opus frames of any length; 3 varint IMU deltas, 2 int8 ones, 1 audio only
+
 /* Request types for the SD worker */
 typedef enum {
     REQ_CLEAR_AUDIO_DIR,
     REQ_WRITE_DATA,
     REQ_READ_DATA,
-    REQ_SAVE_OFFSET
+    REQ_SAVE_OFFSET,
+    REQ_DELETE_SEGMENT,
+    REQ_FIND_TIME_RANGE,
+    REQ_UPDATE_WRITE,
+    REQ_UPDATE_FINISH,
+    REQ_SET_RETENTION
 } sd_req_type_t;
 
 /* Read request response object */
@@ -27,9 +43,10 @@ struct read_resp {
 /* Generic request message passed to worker */
 typedef struct {
     sd_req_type_t type;
+    uint32_t seq; // set when queued; a write waits for control requests queued before it
     union {
         struct {
-            uint8_t buf[MAX_WRITE_SIZE];
+            uint8_t *buf; // Block from alloc_file_block(), freed by the worker
             size_t len;
             struct read_resp *resp;
         } write;
@@ -42,9 +59,29 @@ typedef struct {
         struct {
             uint32_t offset_value;
         } info;
+        struct {
+            uint8_t mode; // enum sd_retention
+        } retention;
         struct {
             struct read_resp *resp;
         } clear_dir;
+        struct {
+            uint8_t segment;
+            struct read_resp *resp; // read_bytes is the number of bytes removed
+        } delete_segment;
+        struct {
+            uint32_t start_utc_s;
+            uint32_t end_utc_s;
+            uint32_t *start;
+            uint32_t *end;
+            struct read_resp *resp;
+        } time_range;
+        struct {
+            const uint8_t *buf;
+            uint32_t offset;
+            uint32_t length; // REQ_UPDATE_FINISH: image size, 0 to discard the image
+            struct read_resp *resp;
+        } update;
     } u;
 } sd_req_t;
 
@@ -97,28 +134,137 @@ int initialize_audio_file(uint8_t num);
 /**
  * @brief Write to the current audio file specified by the write pointer
  *
+ * Copies the data into a write block, prefer filling one from alloc_file_block() directly.
+ *
  * @param data Buffer containing data to write
- * @param length Number of bytes to write
+ * @param length Number of bytes to write, at most MAX_WRITE_SIZE
  * @return number of bytes written
  */
 uint32_t write_to_file(uint8_t *data, uint32_t length);
 
 /**
- * @brief Read from the current audio file specified by the read pointer
+ * @brief Get an empty block of MAX_WRITE_SIZE bytes to fill with audio data
+ *
+ * @return Block to pass to write_block_to_file(), or NULL if all blocks are still queued
+ */
+uint8_t *alloc_file_block(void);
+
+/**
+ * @brief Get an empty block for recorded audio, without ever waiting
+ *
+ * Like alloc_file_block(), but once every write block is queued the audio spills into a bounded
+ * RAM ring, which the SD worker writes before anything but the queued blocks when it catches up.
+ * While audio is spilled, alloc_file_block() returns NULL so nothing lands ahead of it.
+ *
+ * @return Block to pass to write_block_to_file(), or NULL if the spill ring is full too
+ */
+uint8_t *alloc_audio_block(void);
+
+/**
+ * @brief Append a block from alloc_file_block() or alloc_audio_block() to the current audio file
+ *
+ * Only the pointer is queued, without waiting; the SD worker frees the block once it has been
+ * written. The block is freed right away if it can't be queued, or if it is empty or longer than
+ * MAX_WRITE_SIZE.
+ *
+ * @param block Block to write
+ * @param length Number of bytes used in the block, 1 to MAX_WRITE_SIZE
+ * @return number of bytes queued, 0 on failure
+ */
+uint32_t write_block_to_file(uint8_t *block, uint32_t length);
+
+/**
+ * @brief Read from the stored audio
+ *
+ * The segment files are read as one stream that starts at the oldest segment.
  *
  * @param buf Buffer to read data into
  * @param amount Number of bytes to read
- * @param offset Offset within the file to read from
+ * @param offset Offset within the stream to read from
  * @return number of bytes read
  */
 int read_audio_data(uint8_t *buf, int amount, int offset);
 
 /**
- * @brief Get the size of the specified audio file number
- * @return size of the file in bytes
+ * @brief Queue a read from the stored audio without waiting for it
+ *
+ * The SD worker gives resp->sem once buf is filled; resp->res and resp->read_bytes are
+ * valid from then on. buf and resp must stay valid until then, even if the caller gives up.
+ *
+ * @param buf Buffer to read data into
+ * @param amount Number of bytes to read
+ * @param offset Offset within the stream to read from
+ * @param resp Completion, initialized here
+ * @return 0 if queued, negative errno code if error
+ */
+int read_audio_data_async(uint8_t *buf, int amount, int offset, struct read_resp *resp);
+
+/**
+ * @brief Get the size of the stored audio over all segments
+ * @return size in bytes, complete blocks only
  */
 uint32_t get_file_size();
 
+/**
+ * @brief Get how large the stored audio may grow
+ *
+ * Follows the free space on the card, measured at boot and whenever a segment is started
+ * or deleted, and MAX_STORAGE_BYTES before that.
+ *
+ * @return limit in bytes for get_file_size()
+ */
+uint32_t get_storage_limit(void);
+
+/**
+ * Capacity model of the card, kept up to date without touching it: the card is measured when
+ * a segment is started or deleted, and the stream's growth since is subtracted from that.
+ */
+struct sd_capacity {
+    uint32_t card_kb;       // file system size, 0 until the card was mounted
+    uint32_t free_kb;       // free on the card now (estimate)
+    uint32_t stored_bytes;  // get_file_size()
+    uint32_t pending_bytes; // accepted for the card but not readable yet: queued blocks and the write batch
+    uint32_t limit_bytes;   // get_storage_limit()
+    uint32_t room_bytes;    // what can still be recorded before the limit, pending bytes included
+} __packed;
+
+/**
+ * @brief Get the capacity model, constant time, callable from any thread
+ */
+void sd_get_capacity(struct sd_capacity *capacity);
+
+/**
+ * @brief Get how many more bytes of audio fit under the storage limit, pending ones included
+ *
+ * Constant time, for checks on every frame.
+ */
+uint32_t sd_get_room(void);
+
+/**
+ * @brief Get the ids of the oldest and the newest audio segment
+ */
+void get_segment_range(uint8_t *first, uint8_t *last);
+
+/**
+ * @brief Get the stream offset at which a segment starts
+ *
+ * @param segment Segment id
+ * @param start Set to the offset of the segment's first byte
+ * @return 0 if successful, -ENOENT if the segment isn't stored
+ */
+int get_segment_start(uint8_t segment, uint32_t *start);
+
+/**
+ * @brief Delete the oldest audio segment
+ *
+ * Stream offsets after it, including the saved offset, move back by its size.
+ * Deleting the only segment empties it like clear_audio_directory().
+ *
+ * @param segment Segment id, must be the oldest one
+ * @return number of bytes removed from the stream, negative errno code if error
+ */
+int delete_audio_segment(uint8_t segment);
+
 /**
  * @brief Clear the audio directory.
  *
@@ -128,6 +274,83 @@ uint32_t get_file_size();
  */
 int clear_audio_directory(void);
 
+/**
+ * @brief Find the stored audio recorded between two UTC times
+ *
+ * Uses the sparse time index written every few seconds while the RTC is set, so the
+ * range is widened to the nearest indexed blocks around it.
+ *
+ * @param start_utc_s Start of the range, UTC epoch seconds
+ * @param end_utc_s End of the range, UTC epoch seconds
+ * @param start Set to the stream offset to start reading at
+ * @param end Set to the stream offset to stop reading at
+ * @return 0 if successful, negative errno code if error
+ */
+int find_audio_time_range(uint32_t start_utc_s, uint32_t end_utc_s, uint32_t *start, uint32_t *end);
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+/* What happens once the card is full. Evicting unlinks the oldest segment whenever the newest
+ * one is started without room for a whole segment after it, so recording never stops; stream
+ * offsets move back by the evicted size, as after delete_audio_segment().
+ */
+enum sd_retention {
+    SD_RETENTION_STOP,   // stop recording, as without ring mode
+    SD_RETENTION_SYNCED, // evict only a segment the saved offset is already past
+    SD_RETENTION_OLDEST, // evict the oldest segment, synced or not
+    SD_RETENTION_COUNT,
+};
+
+struct sd_evictions {
+    uint32_t segments; // since boot
+    uint32_t bytes;    // since boot, wraps
+};
+
+/**
+ * @brief Change the retention mode, making room right away if the card is already full
+ *
+ * @param mode One of enum sd_retention, SD_RING_RETENTION until set
+ * @return 0 if queued, negative errno code if error
+ */
+int sd_set_retention(enum sd_retention mode);
+
+/**
+ * @brief Get how much audio was evicted to make room
+ */
+void sd_get_evictions(struct sd_evictions *evictions);
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+// Firmware image staged for MCUboot, which copies it into the secondary slot at boot
+#define SD_UPDATE_DIR "/SD:/update"
+#define SD_UPDATE_PART_PATH SD_UPDATE_DIR "/app.part" // still downloading
+#define SD_UPDATE_PATH SD_UPDATE_DIR "/app.bin"       // complete, see mcuboot_boot_zephyr.c
+
+/**
+ * @brief Queue a write of firmware image bytes to SD_UPDATE_PART_PATH without waiting for it
+ *
+ * A write at offset 0 starts a new image. The SD worker gives resp->sem once buf has been
+ * written; resp->res is valid from then on. buf and resp must stay valid until then.
+ *
+ * @param offset Offset in the image
+ * @param buf Image bytes
+ * @param length Number of bytes
+ * @param resp Completion, initialized here
+ * @return 0 if queued, negative errno code if error
+ */
+int sd_update_write_async(uint32_t offset, const uint8_t *buf, uint32_t length, struct read_resp *resp);
+
+/**
+ * @brief Finish the image written with sd_update_write_async()
+ *
+ * Renames it to SD_UPDATE_PATH, where the bootloader picks it up on the next boot, if it holds
+ * exactly size bytes. Otherwise, or with size 0, the image is deleted.
+ *
+ * @param size Expected image size, 0 to discard it
+ * @return 0 if successful, negative errno code if error
+ */
+int sd_update_finish(uint32_t size);
+#endif
+
 /**
  * @brief Save the current offset to the info file
  *
@@ -160,6 +383,27 @@ void sd_off(void);
  */
 bool is_sd_on(void);
 
+/**
+ * @brief Check if offline storage takes writes
+ *
+ * Unlike is_sd_on(), also true while the card is cut for being idle or the blocks go to the
+ * flash cache: the SD worker mounts the card again for the next write when it has to.
+ *
+ * @return true once the SD worker has started on a usable card
+ */
+bool sd_accepts_writes(void);
+
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+struct warm_storage;
+
+/**
+ * @brief Copy the stream state for the next warm wake, which then skips rescanning the card
+ *
+ * @return true if the card was unmounted cleanly and the state matches what is on it
+ */
+bool sd_warm_save(struct warm_storage *state);
+#endif
+
 #endif // CONFIG_OMI_ENABLE_OFFLINE_STORAGE
 
 #endif // SD_CARD_H
@@ -0,0 +1,189 @@
+#include "sd_crypt.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+LOG_MODULE_REGISTER(sd_crypt, CONFIG_LOG_DEFAULT_LEVEL);
+
+#if !defined(CONFIG_NRF_SECURITY) || !defined(CONFIG_PSA_CRYPTO_DRIVER_CC3XX)
+#error "CONFIG_OMI_ENABLE_SD_ENCRYPTION needs CONFIG_NRF_SECURITY and CONFIG_PSA_CRYPTO_DRIVER_CC3XX"
+#endif
+
+#define SD_CRYPT_DEVICE_KEY_ID (PSA_KEY_ID_USER_MIN + 0x0A)
+#define SD_CRYPT_BLOCK 16
+
+static const uint8_t hkdf_info[] = "omi audio segment v1";
+
+static bool ready = false;
+
+int sd_crypt_init(void)
+{
+    psa_status_t status = psa_crypto_init();
+    if (status != PSA_SUCCESS) {
+        LOG_ERR("PSA crypto init failed: %d", status);
+        return -EIO;
+    }
+
+    psa_key_attributes_t attr = PSA_KEY_ATTRIBUTES_INIT;
+    status = psa_get_key_attributes(SD_CRYPT_DEVICE_KEY_ID, &attr);
+    psa_reset_key_attributes(&attr);
+    if (status == PSA_SUCCESS) {
+        ready = true;
+        return 0;
+    }
+
+    // First boot: the key is generated in the key store and only ever used by id
+    psa_key_id_t key;
+    psa_set_key_id(&attr, SD_CRYPT_DEVICE_KEY_ID);
+    psa_set_key_lifetime(&attr, PSA_KEY_LIFETIME_PERSISTENT);
+    psa_set_key_type(&attr, PSA_KEY_TYPE_DERIVE);
+    psa_set_key_bits(&attr, 256);
+    psa_set_key_usage_flags(&attr, PSA_KEY_USAGE_DERIVE);
+    psa_set_key_algorithm(&attr, PSA_ALG_HKDF(PSA_ALG_SHA_256));
+    status = psa_generate_key(&attr, &key);
+    psa_reset_key_attributes(&attr);
+    if (status != PSA_SUCCESS) {
+        LOG_ERR("Failed to create the storage key: %d", status);
+        return -EIO;
+    }
+    LOG_INF("Created the storage key");
+    ready = true;
+    return 0;
+}
+
+int sd_crypt_new_salt(uint8_t salt[SD_CRYPT_SALT_SIZE])
+{
+    return psa_generate_random(salt, SD_CRYPT_SALT_SIZE) == PSA_SUCCESS ? 0 : -EIO;
+}
+
+void sd_crypt_close(struct sd_crypt *crypt)
+{
+    if (crypt->active) {
+        psa_destroy_key(crypt->key);
+        crypt->active = false;
+    }
+}
+
+int sd_crypt_open(struct sd_crypt *crypt, const uint8_t *salt)
+{
+    sd_crypt_close(crypt);
+    if (!salt) {
+        return 0;
+    }
+    if (!ready) {
+        return -ENOKEY;
+    }
+
+    psa_key_derivation_operation_t op = PSA_KEY_DERIVATION_OPERATION_INIT;
+    psa_key_attributes_t attr = PSA_KEY_ATTRIBUTES_INIT;
+    psa_set_key_type(&attr, PSA_KEY_TYPE_AES);
+    psa_set_key_bits(&attr, 128);
+    psa_set_key_usage_flags(&attr, PSA_KEY_USAGE_ENCRYPT | PSA_KEY_USAGE_DECRYPT);
+    psa_set_key_algorithm(&attr, PSA_ALG_CTR);
+
+    psa_status_t status = psa_key_derivation_setup(&op, PSA_ALG_HKDF(PSA_ALG_SHA_256));
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_SALT, salt, SD_CRYPT_SALT_SIZE);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_input_key(&op, PSA_KEY_DERIVATION_INPUT_SECRET, SD_CRYPT_DEVICE_KEY_ID);
+    }
+    if (status == PSA_SUCCESS) {
+        status =
+            psa_key_derivation_input_bytes(&op, PSA_KEY_DERIVATION_INPUT_INFO, hkdf_info, sizeof(hkdf_info) - 1);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_key_derivation_output_key(&attr, &op, &crypt->key);
+    }
+    psa_key_derivation_abort(&op);
+    psa_reset_key_attributes(&attr);
+    if (status != PSA_SUCCESS) {
+        LOG_ERR("Failed to derive a segment key: %d", status);
+        return -EIO;
+    }
+    crypt->active = true;
+    crypt->epochs = 1;
+    crypt->epoch_start[0] = 0;
+    return 0;
+}
+
+int sd_crypt_rekey(struct sd_crypt *crypt, uint32_t offset)
+{
+    if (!crypt->active) {
+        return 0;
+    }
+    if (crypt->epochs >= SD_CRYPT_MAX_EPOCHS) {
+        return -ENOSPC;
+    }
+    crypt->epoch_start[crypt->epochs++] = offset;
+    return 0;
+}
+
+// The epoch offset is in, the newest one starting at or before it, and where the next one begins
+static uint8_t epoch_at(const struct sd_crypt *crypt, uint32_t offset, uint32_t *end)
+{
+    *end = UINT32_MAX;
+    for (uint8_t e = crypt->epochs - 1; e > 0; e--) {
+        if (crypt->epoch_start[e] <= offset) {
+            return e;
+        }
+        *end = MIN(*end, crypt->epoch_start[e]);
+    }
+    return 0;
+}
+
+static int ctr_apply(struct sd_crypt *crypt, uint8_t epoch, uint32_t offset, uint8_t *buf, size_t len)
+{
+    // The key is unique to the segment, so the counter block is just the epoch and the block number
+    uint8_t iv[SD_CRYPT_BLOCK] = {0};
+    sys_put_be32(epoch, iv + SD_CRYPT_BLOCK - 2 * sizeof(uint32_t));
+    sys_put_be32(offset / SD_CRYPT_BLOCK, iv + SD_CRYPT_BLOCK - sizeof(uint32_t));
+
+    psa_cipher_operation_t op = PSA_CIPHER_OPERATION_INIT;
+    size_t out_len;
+    psa_status_t status = psa_cipher_encrypt_setup(&op, crypt->key, PSA_ALG_CTR);
+    if (status == PSA_SUCCESS) {
+        status = psa_cipher_set_iv(&op, iv, sizeof(iv));
+    }
+    // Skip the key stream up to offset within its block
+    size_t skip = offset % SD_CRYPT_BLOCK;
+    if (status == PSA_SUCCESS && skip) {
+        uint8_t pad[SD_CRYPT_BLOCK] = {0};
+        status = psa_cipher_update(&op, pad, skip, pad, sizeof(pad), &out_len);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_cipher_update(&op, buf, len, buf, len, &out_len);
+    }
+    if (status == PSA_SUCCESS) {
+        status = psa_cipher_finish(&op, NULL, 0, &out_len);
+    }
+    psa_cipher_abort(&op);
+    if (status != PSA_SUCCESS) {
+        LOG_ERR("AES-CTR at %u failed: %d", offset, status);
+        return -EIO;
+    }
+    return 0;
+}
+
+int sd_crypt_apply(struct sd_crypt *crypt, uint32_t offset, uint8_t *buf, size_t len)
+{
+    if (!crypt->active) {
+        return 0;
+    }
+    while (len > 0) {
+        uint32_t end;
+        uint8_t epoch = epoch_at(crypt, offset, &end);
+        size_t chunk = MIN(len, end - offset);
+        int res = ctr_apply(crypt, epoch, offset, buf, chunk);
+        if (res < 0) {
+            return res;
+        }
+        offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef SD_CRYPT_H
+#define SD_CRYPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+
+#include <psa/crypto.h>
+
+#define SD_CRYPT_SALT_SIZE 16
+#define SD_CRYPT_MAX_EPOCHS 16 // key stream generations of one segment, then it is rolled
+
+/*
+ * Encryption at rest for the audio segments, AES-128-CTR on the CryptoCell.
+ *
+ * Every segment has its own key, derived with HKDF-SHA256 from a device key that never leaves the
+ * PSA key store and a random salt kept next to the segment. CTR keeps the ciphertext the size of
+ * the plaintext and decryptable at any offset, so stream offsets, block truncation and partial
+ * reads work on the card exactly as before.
+ *
+ * Bytes rewritten at an offset, after a failed write or a truncated tail, must not reuse the key
+ * stream of what was there. Each rewrite starts an epoch: its number goes into the counter block
+ * next to the block number, and it covers everything from its offset on. The epochs are kept in
+ * the segment's key file after the salt, epoch 0 starts at 0 and gives the key stream of segments
+ * written before epochs existed.
+ */
+struct sd_crypt {
+    psa_key_id_t key;
+    bool active;    // false for a segment written before encryption, read as plaintext
+    uint8_t epochs; // in epoch_start, 1 once open
+    uint32_t epoch_start[SD_CRYPT_MAX_EPOCHS];
+};
+
+/**
+ * @brief Initialize PSA crypto and create the device key on first boot
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int sd_crypt_init(void);
+
+/**
+ * @brief Fill salt with random bytes for a new segment
+ */
+int sd_crypt_new_salt(uint8_t salt[SD_CRYPT_SALT_SIZE]);
+
+/**
+ * @brief Derive the key of a segment, replacing the one crypt held
+ *
+ * @param crypt Segment key state
+ * @param salt The segment's salt, NULL for a plaintext segment
+ * @return 0 if successful, negative errno code if error
+ */
+int sd_crypt_open(struct sd_crypt *crypt, const uint8_t *salt);
+
+/**
+ * @brief Start a new key stream epoch at offset, for bytes written over ones already on the card
+ *
+ * Record it in the segment's key file first, so the data is never written under an epoch that a
+ * later open doesn't know about.
+ *
+ * @param crypt Segment key state, nothing happens for a plaintext segment
+ * @param offset Where the rewrite starts, everything from there on is in the new epoch
+ * @return 0 if successful, -ENOSPC once SD_CRYPT_MAX_EPOCHS are in use
+ */
+int sd_crypt_rekey(struct sd_crypt *crypt, uint32_t offset);
+
+/**
+ * @brief Destroy the segment key
+ */
+void sd_crypt_close(struct sd_crypt *crypt);
+
+/**
+ * @brief Encrypt or decrypt in place
+ *
+ * @param crypt Segment key state, nothing happens for a plaintext segment
+ * @param offset Offset of buf within the segment
+ * @param buf Data
+ * @param len Its length
+ * @return 0 if successful, negative errno code if error
+ */
+int sd_crypt_apply(struct sd_crypt *crypt, uint32_t offset, uint8_t *buf, size_t len);
+
+#endif // CONFIG_OMI_ENABLE_SD_ENCRYPTION
+
+#endif // SD_CRYPT_H
@@ -0,0 +1,114 @@
+#include "sd_dfu.h"
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+
+#include "config.h"
+#include "scratch.h"
+#include "sd_card.h"
+#include "wifi.h"
+
+LOG_MODULE_REGISTER(sd_dfu, CONFIG_LOG_DEFAULT_LEVEL);
+
+#if !defined(CONFIG_OMI_ENABLE_WIFI) || !defined(CONFIG_OMI_ENABLE_OFFLINE_STORAGE)
+#error "CONFIG_OMI_ENABLE_SD_DFU needs CONFIG_OMI_ENABLE_WIFI and CONFIG_OMI_ENABLE_OFFLINE_STORAGE"
+#endif
+
+#define MCUBOOT_IMAGE_MAGIC 0x96f3b83d
+// Two halves of the arena: one is received into while the SD worker writes the other
+#define SD_DFU_CHUNK_SIZE ((SCRATCH_ARENA_SIZE / 2) / 512 * 512)
+
+#define SLOT1_SIZE FIXED_PARTITION_SIZE(slot1_partition)
+
+// Fill buf with the next len bytes of the image
+static int recv_chunk(uint8_t *buf, uint32_t len)
+{
+    uint32_t got = 0;
+    while (got < len) {
+        int n = wifi_recv(buf + got, len - got, SD_DFU_STALL_TIMEOUT_MS);
+        if (n < 0) {
+            return n == -EAGAIN ? -ETIMEDOUT : n;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+int sd_dfu_download(uint32_t size, uint32_t crc, struct sd_dfu_result *res)
+{
+    if (size == 0 || size > SLOT1_SIZE) {
+        return -EFBIG;
+    }
+    uint8_t *arena = scratch_acquire(SCRATCH_FIRMWARE);
+    if (!arena) {
+        return -EBUSY;
+    }
+
+    struct read_resp writes[2];
+    bool pending[2] = {false, false};
+    uint32_t image_crc = 0;
+    int cur = 0;
+    int err = 0;
+    int64_t started_at = k_uptime_get();
+    LOG_INF("Receiving a %u byte firmware image", size);
+
+    res->bytes = 0;
+    while (res->bytes < size) {
+        uint8_t *buf = arena + cur * SD_DFU_CHUNK_SIZE;
+        if (pending[cur]) {
+            k_sem_take(&writes[cur].sem, K_FOREVER);
+            pending[cur] = false;
+            err = writes[cur].res;
+            if (err) {
+                break;
+            }
+        }
+
+        uint32_t length = MIN(size - res->bytes, SD_DFU_CHUNK_SIZE);
+        err = recv_chunk(buf, length);
+        if (err) {
+            break;
+        }
+        if (res->bytes == 0 && (length < 4 || sys_get_le32(buf) != MCUBOOT_IMAGE_MAGIC)) {
+            LOG_ERR("Not an MCUboot image");
+            err = -ENOEXEC;
+            break;
+        }
+        image_crc = crc32_ieee_update(image_crc, buf, length);
+
+        err = sd_update_write_async(res->bytes, buf, length, &writes[cur]);
+        if (err) {
+            break;
+        }
+        pending[cur] = true;
+        res->bytes += length;
+        cur = 1 - cur;
+    }
+
+    // The SD worker may still be writing out of the arena
+    for (int i = 0; i < 2; i++) {
+        if (pending[i]) {
+            k_sem_take(&writes[i].sem, K_FOREVER);
+            if (!err) {
+                err = writes[i].res;
+            }
+        }
+    }
+    scratch_release(SCRATCH_FIRMWARE);
+
+    if (!err && image_crc != crc) {
+        LOG_ERR("Firmware image CRC %08x, expected %08x", image_crc, crc);
+        err = -EBADMSG;
+    }
+    err = err ? err : sd_update_finish(size);
+    if (err) {
+        sd_update_finish(0);
+    }
+    res->duration_ms = k_uptime_get() - started_at;
+    LOG_INF("Firmware download: %u of %u bytes in %u ms, err %d", res->bytes, size, res->duration_ms, err);
+    return err;
+}
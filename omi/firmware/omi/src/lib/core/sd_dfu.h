@@ -0,0 +1,36 @@
+#ifndef SD_DFU_H
+#define SD_DFU_H
+
+#include <stdint.h>
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+
+/**
+ * @brief Result of a Wi-Fi firmware download, notified on the Wi-Fi characteristic after WIFI_FIRMWARE
+ */
+struct sd_dfu_result {
+    uint8_t cmd;          // 0x07
+    int8_t error;         // 0, or the negative errno that ended the download
+    uint32_t bytes;       // image bytes received
+    uint32_t duration_ms; // from the first byte expected to the image staged on the card
+} __attribute__((packed));
+
+/**
+ * @brief Download a firmware image from the hub onto the SD card
+ *
+ * The hub sends the signed MCUboot image (app_update.bin) over the Wi-Fi connection right after
+ * acknowledging WIFI_FIRMWARE. The image is written to the card as it arrives and only kept if it
+ * has the expected size and CRC; the bootloader then copies it to the secondary slot on the next
+ * boot and MCUboot validates it before the swap. Runs on the storage thread and holds the scratch
+ * arena while receiving.
+ *
+ * @param size Image size in bytes
+ * @param crc IEEE CRC32 of the image
+ * @param res Filled in with the result
+ * @return 0 once the image is staged, negative errno code if error
+ */
+int sd_dfu_download(uint32_t size, uint32_t crc, struct sd_dfu_result *res);
+
+#endif // CONFIG_OMI_ENABLE_SD_DFU
+
+#endif // SD_DFU_H
@@ -1,6 +1,7 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <zephyr/drivers/rtc.h>
 
@@ -16,6 +17,9 @@ int app_settings_init(void);
 /**
  * @brief Save the dim light ratio setting.
  *
+ * Takes effect in RAM at once; flash is written after a couple of seconds without
+ * further changes, or by app_settings_flush().
+ *
  * @param new_ratio The new ratio value (e.g., 0-100).
  * @return 0 on success, negative error code otherwise.
  */
@@ -31,6 +35,9 @@ uint8_t app_settings_get_dim_ratio(void);
 /**
  * @brief Save the microphone gain setting.
  *
+ * Takes effect in RAM at once; flash is written after a couple of seconds without
+ * further changes, or by app_settings_flush().
+ *
  * @param new_gain The new gain level (0-8).
  * @return 0 on success, negative error code otherwise.
  */
@@ -43,6 +50,33 @@ int app_settings_save_mic_gain(uint8_t new_gain);
  */
 uint8_t app_settings_get_mic_gain(void);
 
+/**
+ * @brief Save the codec profile setting.
+ *
+ * Takes effect in RAM at once; flash is written after a couple of seconds without
+ * further changes, or by app_settings_flush().
+ *
+ * @param new_profile One of the CODEC_PROFILE_* identifiers.
+ * @return 0 on success, negative error code otherwise.
+ */
+int app_settings_save_codec_profile(uint8_t new_profile);
+
+/**
+ * @brief Get the current codec profile.
+ *
+ * @return The saved CODEC_PROFILE_* identifier.
+ */
+uint8_t app_settings_get_codec_profile(void);
+
+/**
+ * @brief Write pending settings changes to flash now.
+ *
+ * Call before system off, deferred saves would be lost otherwise.
+ *
+ * @return 0 on success, negative error code of the last failed write otherwise.
+ */
+int app_settings_flush(void);
+
 /**
  * @brief Save the RTC timestamp setting.
  *
@@ -92,4 +126,45 @@ int app_settings_save_lsm6dsl_time_base(uint64_t epoch_s, uint32_t imu_timestamp
  */
 int app_settings_get_lsm6dsl_time_base(uint64_t *epoch_s, uint32_t *imu_timestamp);
 
+/**
+ * @brief Save the offline storage sync offset.
+ *
+ * Journals the offset into the settings partition instead of rewriting info.txt on the
+ * SD card. Saving the value already stored is a no-op.
+ *
+ * @param offset Stream offset the app has synced up to.
+ * @param first_segment Oldest audio segment, which the offset counts from.
+ * @return 0 on success, negative error code otherwise.
+ */
+int app_settings_save_sync_offset(uint32_t offset, uint8_t first_segment);
+
+/**
+ * @brief Get the saved offline storage sync offset.
+ *
+ * @param offset Output stream offset.
+ * @param first_segment Output oldest segment at the time it was saved.
+ * @return 0 on success, -ENOENT if never saved.
+ */
+int app_settings_get_sync_offset(uint32_t *offset, uint8_t *first_segment);
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+/**
+ * @brief Save the enrolled wake phrase.
+ *
+ * @param data Template as the keyword spotter stores it, a length of 1 forgets the phrase.
+ * @param len Its length, at most KWS_TEMPLATE_MAX_BYTES.
+ * @return 0 on success, negative error code otherwise.
+ */
+int app_settings_save_kws_template(const uint8_t *data, size_t len);
+
+/**
+ * @brief Get the enrolled wake phrase.
+ *
+ * @param data Output buffer.
+ * @param size Its size.
+ * @return Length of the template, -ENOENT if never saved.
+ */
+int app_settings_get_kws_template(uint8_t *data, size_t size);
+#endif
+
 #endif // SETTINGS_H
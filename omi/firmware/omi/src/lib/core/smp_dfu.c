@@ -0,0 +1,189 @@
+#include "smp_dfu.h"
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/mgmt/mcumgr/grp/img_mgmt/img_mgmt.h>
+#include <zephyr/mgmt/mcumgr/grp/img_mgmt/img_mgmt_callbacks.h>
+#include <zephyr/mgmt/mcumgr/mgmt/callbacks.h>
+#include <zephyr/sys/atomic.h>
+
+#include "config.h"
+#include "subscription.h"
+#include "transport.h"
+
+LOG_MODULE_REGISTER(smp_dfu, CONFIG_LOG_DEFAULT_LEVEL);
+
+#if !defined(CONFIG_MCUMGR_TRANSPORT_BT) || !defined(CONFIG_MCUMGR_GRP_IMG)
+#error "CONFIG_OMI_ENABLE_SMP_DFU needs CONFIG_MCUMGR_TRANSPORT_BT and CONFIG_MCUMGR_GRP_IMG"
+#endif
+#if !defined(CONFIG_MCUMGR_GRP_IMG_STATUS_HOOKS) || !defined(CONFIG_MCUMGR_GRP_IMG_UPLOAD_CHECK_HOOK)
+#error "CONFIG_OMI_ENABLE_SMP_DFU needs CONFIG_MCUMGR_GRP_IMG_STATUS_HOOKS and CONFIG_MCUMGR_GRP_IMG_UPLOAD_CHECK_HOOK"
+#endif
+
+// Requests a client keeps in flight: with fewer buffers than that, BLE stops receiving while a chunk
+// is written to flash and the upload falls back to one request per round trip
+#define SMP_DFU_MIN_NETBUFS 4
+#ifdef CONFIG_MCUMGR_TRANSPORT_NETBUF_COUNT
+BUILD_ASSERT(CONFIG_MCUMGR_TRANSPORT_NETBUF_COUNT >= SMP_DFU_MIN_NETBUFS, "Too few SMP buffers to pipeline uploads");
+#endif
+
+static ssize_t smp_dfu_read_handler(struct bt_conn *conn,
+                                    const struct bt_gatt_attr *attr,
+                                    void *buf,
+                                    uint16_t len,
+                                    uint16_t offset);
+static void smp_dfu_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+//
+// Service and Characteristic
+//
+// SMP DFU progress service with UUID 19B10070-E8F2-537E-4F6C-D104768A1214
+// exposes following characteristics:
+// - Status (UUID 19B10071-E8F2-537E-4F6C-D104768A1214) struct smp_dfu_status (read/notify)
+// The image itself goes through the MCUmgr SMP service.
+static struct bt_uuid_128 smp_dfu_service_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10070, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 smp_dfu_status_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10071, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+
+static struct bt_gatt_attr smp_dfu_service_attr[] = {
+    BT_GATT_PRIMARY_SERVICE(&smp_dfu_service_uuid),
+    BT_GATT_CHARACTERISTIC(&smp_dfu_status_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                           BT_GATT_PERM_READ,
+                           smp_dfu_read_handler,
+                           NULL,
+                           NULL),
+    BT_GATT_CCC(smp_dfu_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+};
+
+static struct bt_gatt_service smp_dfu_service = BT_GATT_SERVICE(smp_dfu_service_attr);
+static struct subscription smp_dfu_subscription = SUBSCRIPTION_INIT;
+
+//
+// State
+//
+
+// Only written from the MCUmgr callbacks, which all run on the SMP work queue, and read by the BT RX
+// thread for a GATT read: changes and copies go under status_lock
+static struct smp_dfu_status status;
+static struct k_spinlock status_lock;
+static int64_t started_at;
+static int64_t reported_at;
+static atomic_t last_chunk_at; // 32 bit uptime ms of the last chunk (never 0), read by the link policy
+
+static void smp_dfu_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    subscription_update(&smp_dfu_subscription, value);
+}
+
+static ssize_t smp_dfu_read_handler(struct bt_conn *conn,
+                                    const struct bt_gatt_attr *attr,
+                                    void *buf,
+                                    uint16_t len,
+                                    uint16_t offset)
+{
+    k_spinlock_key_t key = k_spin_lock(&status_lock);
+    struct smp_dfu_status snapshot = status;
+    k_spin_unlock(&status_lock, key);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &snapshot, sizeof(snapshot));
+}
+
+static void smp_dfu_report(void)
+{
+    int64_t now = k_uptime_get();
+    k_spinlock_key_t key = k_spin_lock(&status_lock);
+    status.elapsed_ms = (uint32_t) (now - started_at);
+    status.rate_bps = status.elapsed_ms ? (uint32_t) ((uint64_t) status.offset * 1000 / status.elapsed_ms) : 0;
+    struct smp_dfu_status snapshot = status;
+    k_spin_unlock(&status_lock, key);
+    reported_at = now;
+    if (subscription_is_notifying(&smp_dfu_subscription)) {
+        transport_notify(NULL, &smp_dfu_service.attrs[1], &snapshot, sizeof(snapshot));
+    }
+}
+
+static void smp_dfu_chunk(const struct img_mgmt_upload_check *check)
+{
+    int64_t now = k_uptime_get();
+    k_spinlock_key_t key = k_spin_lock(&status_lock);
+    if (check->req->off == 0) {
+        started_at = now;
+        status.size = check->action->size;
+    }
+    status.state = SMP_DFU_RECEIVING;
+    status.offset = check->req->off + check->req->img_data.len;
+    k_spin_unlock(&status_lock, key);
+    if (check->req->off == 0) {
+        LOG_INF("Receiving a %u byte image over SMP", (uint32_t) check->action->size);
+    }
+    atomic_set(&last_chunk_at, (atomic_val_t) (k_uptime_get_32() | 1));
+    if (check->req->off == 0 || now - reported_at >= SMP_DFU_REPORT_MS) {
+        smp_dfu_report();
+    }
+}
+
+static void smp_dfu_end(enum smp_dfu_state state)
+{
+    k_spinlock_key_t key = k_spin_lock(&status_lock);
+    status.state = state;
+    k_spin_unlock(&status_lock, key);
+    atomic_set(&last_chunk_at, 0);
+    smp_dfu_report();
+    LOG_INF("SMP upload %s: %u of %u bytes in %u ms, %u B/s",
+            state == SMP_DFU_PENDING ? "complete" : "stopped",
+            status.offset,
+            status.size,
+            status.elapsed_ms,
+            status.rate_bps);
+}
+
+static enum mgmt_cb_return smp_dfu_event(uint32_t event,
+                                         enum mgmt_cb_return prev_status,
+                                         int32_t *rc,
+                                         uint16_t *group,
+                                         bool *abort_more,
+                                         void *data,
+                                         size_t data_size)
+{
+    switch (event) {
+    case MGMT_EVT_OP_IMG_MGMT_DFU_CHUNK:
+        smp_dfu_chunk(data);
+        break;
+    case MGMT_EVT_OP_IMG_MGMT_DFU_PENDING:
+        smp_dfu_end(SMP_DFU_PENDING);
+        break;
+    case MGMT_EVT_OP_IMG_MGMT_DFU_STOPPED:
+        smp_dfu_end(SMP_DFU_STOPPED);
+        break;
+    default:
+        break;
+    }
+    return MGMT_CB_OK;
+}
+
+static struct mgmt_callback smp_dfu_callback = {
+    .callback = smp_dfu_event,
+    .event_id = MGMT_EVT_OP_IMG_MGMT_ALL,
+};
+
+bool smp_dfu_active(void)
+{
+    // A client that disconnects mid-upload sends no STOPPED, so an upload also ends when chunks stop coming
+    uint32_t last = (uint32_t) atomic_get(&last_chunk_at);
+    return last != 0 && k_uptime_get_32() - last < SMP_DFU_IDLE_TIMEOUT_MS;
+}
+
+int smp_dfu_init(void)
+{
+    int err = bt_gatt_service_register(&smp_dfu_service);
+    if (err) {
+        LOG_ERR("Failed to register SMP DFU service (err %d)", err);
+        return err;
+    }
+    mgmt_callback_register(&smp_dfu_callback);
+    return 0;
+}
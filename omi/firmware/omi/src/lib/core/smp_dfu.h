@@ -0,0 +1,47 @@
+#ifndef SMP_DFU_H
+#define SMP_DFU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef CONFIG_OMI_ENABLE_SMP_DFU
+
+enum smp_dfu_state {
+    SMP_DFU_IDLE = 0,
+    SMP_DFU_RECEIVING = 1, // Image upload in progress
+    SMP_DFU_PENDING = 2,   // Image complete, installed by MCUboot on the next reset
+    SMP_DFU_STOPPED = 3,   // Upload aborted or failed
+};
+
+/**
+ * @brief Value of the DFU progress characteristic, little endian
+ */
+struct smp_dfu_status {
+    uint8_t state;       // enum smp_dfu_state
+    uint32_t offset;     // image bytes received
+    uint32_t size;       // image size
+    uint32_t rate_bps;   // image bytes/s averaged over the upload so far
+    uint32_t elapsed_ms; // since the upload started
+} __attribute__((packed));
+
+/**
+ * @brief Hook into MCUmgr image uploads and register the DFU progress service
+ *
+ * Firmware goes through the standard SMP image group, so any MCUmgr client works. The client
+ * should pipeline its upload requests (the SMP window, see the MCUmgr parameters command): SMP
+ * runs on its own work queue, so BLE keeps receiving the next chunks while one is written to
+ * flash. While an upload runs the link policy moves to the DFU parameters, and the progress
+ * characteristic notifies struct smp_dfu_status every SMP_DFU_REPORT_MS.
+ *
+ * @return 0 if successful, negative errno code if error
+ */
+int smp_dfu_init(void);
+
+/**
+ * @brief Check whether an image upload is in progress
+ */
+bool smp_dfu_active(void);
+
+#endif // CONFIG_OMI_ENABLE_SMP_DFU
+
+#endif // SMP_DFU_H
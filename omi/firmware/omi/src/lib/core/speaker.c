@@ -1,6 +1,6 @@
 #include "speaker.h"
 
-#include <math.h>
+#include <cmsis_core.h>
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/bluetooth/l2cap.h>
 #include <zephyr/bluetooth/services/bas.h>
@@ -11,31 +11,151 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/logging/log_ctrl.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/ring_buffer.h>
 
-LOG_MODULE_REGISTER(speaker, CONFIG_LOG_DEFAULT_LEVEL);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "monitor.h"
+#endif
+
+#include "config.h"
+#include "scratch.h"
 
-#define MAX_BLOCK_SIZE 10000 // 24000 * 2
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+#if !CODEC_OPUS
+#error "CONFIG_OMI_ENABLE_SPEAKER_OPUS needs the Opus library, CONFIG_OMI_CODEC_OPUS"
+#endif
+#include "lib/opus-1.2.1/opus.h"
+#endif
+
+LOG_MODULE_REGISTER(speaker, CONFIG_LOG_DEFAULT_LEVEL);
 
-#define BLOCK_COUNT 2
 #define SAMPLE_FREQUENCY 8000
+#ifdef CONFIG_OMI_SPEAKER_MONO_I2S
+/* Mono I2S packs two samples per word and sends them on the left slot, for amps that play it */
+#define NUMBER_OF_CHANNELS 1
+#else
 #define NUMBER_OF_CHANNELS 2
-#define PACKET_SIZE 400
+#endif
 #define WORD_SIZE 16
-#define NUM_CHANNELS 2
+#define NUM_CHANNELS NUMBER_OF_CHANNELS
+
+#if defined(__ARM_FEATURE_DSP) && (__ARM_FEATURE_DSP == 1)
+#define SPEAKER_DUPLICATE_SIMD 1
+#else
+#define SPEAKER_DUPLICATE_SIMD 0
+#endif
+
+#define BLOCK_FRAMES 400 // 50ms per I2S block
+#define BLOCK_SIZE (BLOCK_FRAMES * NUM_CHANNELS * sizeof(int16_t))
+#define BLOCK_COUNT 4             // two queued, one filling, one spare
+#define BLOCK_MS (BLOCK_FRAMES * 1000 / SAMPLE_FREQUENCY)
+#define PRIME_BLOCKS 2            // queued before the clock starts, rides out BT jitter
+#define STREAM_BUF_SIZE 8192      // mono PCM received ahead of playback, 512ms
+#define SPEAKER_THREAD_PRIORITY THREAD_PRIO_SPEAKER
+
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+#define OPUS_BUF_SIZE 2048         // Opus packets received ahead of playback, 0.5s at 32kbps
+#define OPUS_MAX_PACKET 255        // one length byte per packet in opus_buf
+#define OPUS_MAX_FRAME_SAMPLES 480 // 60ms at 8kHz, longer packets are rejected by the decoder
+#define OPUS_DECODER_SIZE 10000    // CELT-only mono decoder, checked against opus_decoder_get_size()
+#define SPEAKER_STACK_SIZE 8192    // CELT decoding allocates its scratch on the stack
+#else
+#define OPUS_BUF_SIZE 0
+#define SPEAKER_STACK_SIZE 1024
+#endif
+BUILD_ASSERT(STREAM_BUF_SIZE + OPUS_BUF_SIZE <= SCRATCH_ARENA_SIZE, "Speaker rings don't fit the scratch arena");
+
+// Phase increment per sample of a tone, the top 8 bits of the phase index sine_table
+#define TONE_STEP(hz_x100) ((uint32_t) (((uint64_t) (hz_x100) << 32) / (SAMPLE_FREQUENCY * 100)))
+#define CHIME_MAX_VOICES 4
+
+/* One period of a sine in Q15, the only oscillator the chimes need */
+static const int16_t sine_table[256] = {
+    0, 804, 1608, 2410, 3212, 4011, 4808, 5602, 6393, 7179, 7962, 8739,
+    9512, 10278, 11039, 11793, 12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594, 23170, 23731, 24279, 24811,
+    25329, 25832, 26319, 26790, 27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971, 32137, 32285, 32412, 32521,
+    32609, 32678, 32728, 32757, 32767, 32757, 32728, 32678, 32609, 32521, 32412, 32285,
+    32137, 31971, 31785, 31580, 31356, 31113, 30852, 30571, 30273, 29956, 29621, 29268,
+    28898, 28510, 28105, 27683, 27245, 26790, 26319, 25832, 25329, 24811, 24279, 23731,
+    23170, 22594, 22005, 21403, 20787, 20159, 19519, 18868, 18204, 17530, 16846, 16151,
+    15446, 14732, 14010, 13279, 12539, 11793, 11039, 10278, 9512, 8739, 7962, 7179,
+    6393, 5602, 4808, 4011, 3212, 2410, 1608, 804, 0, -804, -1608, -2410,
+    -3212, -4011, -4808, -5602, -6393, -7179, -7962, -8739, -9512, -10278, -11039, -11793,
+    -12539, -13279, -14010, -14732, -15446, -16151, -16846, -17530, -18204, -18868, -19519, -20159,
+    -20787, -21403, -22005, -22594, -23170, -23731, -24279, -24811, -25329, -25832, -26319, -26790,
+    -27245, -27683, -28105, -28510, -28898, -29268, -29621, -29956, -30273, -30571, -30852, -31113,
+    -31356, -31580, -31785, -31971, -32137, -32285, -32412, -32521, -32609, -32678, -32728, -32757,
+    -32767, -32757, -32728, -32678, -32609, -32521, -32412, -32285, -32137, -31971, -31785, -31580,
+    -31356, -31113, -30852, -30571, -30273, -29956, -29621, -29268, -28898, -28510, -28105, -27683,
+    -27245, -26790, -26319, -25832, -25329, -24811, -24279, -23731, -23170, -22594, -22005, -21403,
+    -20787, -20159, -19519, -18868, -18204, -17530, -16846, -16151, -15446, -14732, -14010, -13279,
+    -12539, -11793, -11039, -10278, -9512, -8739, -7962, -7179, -6393, -5602, -4808, -4011,
+    -3212, -2410, -1608, -804,
+};
 
-#define PI 3.14159265358979323846
+/* Notification tones: voices mixed at equal level under a linear decay from half scale */
+struct chime {
+    uint32_t steps[CHIME_MAX_VOICES];
+    uint8_t voices;
+    uint16_t frames;       // length
+    uint16_t decay_frames; // silent after this many frames
+};
+
+static const struct chime boot_chime = {
+    .steps = {TONE_STEP(52325), TONE_STEP(65925), TONE_STEP(78399), TONE_STEP(104650)}, // C5, E5, G5, C6
+    .voices = 4,
+    .frames = 2500,
+    .decay_frames = SAMPLE_FREQUENCY,
+};
 
-K_MEM_SLAB_DEFINE_STATIC(mem_slab, MAX_BLOCK_SIZE, BLOCK_COUNT, 2);
+K_MEM_SLAB_DEFINE_STATIC(mem_slab, BLOCK_SIZE, BLOCK_COUNT, 4);
 
 struct device *audio_speaker;
 
-static void *rx_buffer;
-static void *buzz_buffer;
-static int16_t *ptr2;
-static int16_t *clear_ptr;
-
-static uint16_t current_length;
-static uint16_t offset;
+/*
+ * speak() runs in the BT RX context and only copies the mono PCM into stream_buf. The speaker
+ * thread turns it into I2S blocks, so playback starts with the first blocks of a clip
+ * and a clip may be as long as the sender keeps up.
+ *
+ * The rings live in the scratch arena from the start of a clip until the thread has emptied them
+ * after its end. The I2S blocks stay in mem_slab, the driver holds on to them across clips.
+ */
+static struct ring_buf stream_buf;
+static struct k_spinlock stream_lock;
+static bool stream_scratch; // the rings are set up in the arena, under stream_lock
+static bool stream_open;    // a clip is still being received, under stream_lock
+static K_SEM_DEFINE(stream_sem, 0, 1);
+static atomic_t stream_ended;     // the rest of the clip is in stream_buf
+static uint32_t stream_remaining; // bytes of the clip still to come, BT context only
+static bool stream_opus;          // the clip is Opus packets, BT context only
+static bool stream_discard;       // the clip was refused, its packets are skipped, BT context only
+static atomic_ptr_t pending_chime; // rendered by the speaker thread as blocks free up
+
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+// Opus clips are queued as [length][packet] and decoded by the speaker thread, under stream_lock too
+static struct ring_buf opus_buf;
+__ALIGN(4)
+static uint8_t opus_decoder_mem[OPUS_DECODER_SIZE];
+static OpusDecoder *const opus_decoder = (OpusDecoder *) opus_decoder_mem;
+__ALIGN(4)
+static int16_t opus_pcm[OPUS_MAX_FRAME_SAMPLES];
+#endif
+
+// Speaker thread only
+static uint8_t blocks_queued; // since the clock was last started
+static bool tx_running;
+static int16_t *fill_block;
+static size_t fill_frames;
+
+// Uptime span the speaker is audible in, written by the speaker thread, read by the codec
+static atomic_t audible_from;
+static atomic_t audible_until;
+
+K_THREAD_STACK_DEFINE(speaker_stack, SPEAKER_STACK_SIZE);
+static struct k_thread speaker_thread;
 
 struct gpio_dt_spec speaker_gpio_pin = {.port = DEVICE_DT_GET(DT_NODELABEL(gpio0)),
                                         .pin = 4,
@@ -79,6 +199,8 @@ void register_speaker_service()
     }
 }
 
+static void speaker_thread_function(void *p1, void *p2, void *p3);
+
 int speaker_init()
 {
     LOG_INF("Speaker init");
@@ -100,6 +222,9 @@ int speaker_init()
         return -1;
     }
     gpio_pin_set_dt(&speaker_gpio_pin, 1);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_SPEAKER, true);
+#endif
 
     struct i2s_config config = {
         .word_size = WORD_SIZE,                       // how long is one left/right word.
@@ -109,141 +234,473 @@ int speaker_init()
         .options =
             I2S_OPT_FRAME_CLK_MASTER | I2S_OPT_BIT_CLK_MASTER | I2S_OPT_BIT_CLK_GATED, // how to configure the mclock
         .frame_clk_freq = SAMPLE_FREQUENCY,                                            /* Sampling rate */
-        .mem_slab = &mem_slab,        /* Memory slab to store rx/tx data */
-        .block_size = MAX_BLOCK_SIZE, /* size of ONE memory block in bytes */
-        .timeout = -1, /* Number of milliseconds to wait in case Tx queue is full or RX queue is empty, or 0, or
-                          SYS_FOREVER_MS */
+        .mem_slab = &mem_slab,    /* Memory slab to store rx/tx data */
+        .block_size = BLOCK_SIZE, /* size of ONE memory block in bytes */
+        .timeout = 0, /* Never wait for the Tx queue, the slab holds no more blocks than it takes */
     };
     int err = i2s_configure(audio_speaker, I2S_DIR_TX, &config);
     if (err) {
         LOG_ERR("Failed to configure Speaker (%d)", err);
         return -1;
     }
-    err = k_mem_slab_alloc(&mem_slab, &rx_buffer, K_MSEC(200));
-    if (err) {
-        LOG_INF("Failed to allocate memory for speaker%d)", err);
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    if (opus_decoder_get_size(1) > sizeof(opus_decoder_mem)) {
+        LOG_ERR("Opus decoder needs %d bytes, OPUS_DECODER_SIZE is %d", opus_decoder_get_size(1), OPUS_DECODER_SIZE);
         return -1;
     }
-
-    err = k_mem_slab_alloc(&mem_slab, &buzz_buffer, K_MSEC(200));
-    if (err) {
-        LOG_INF("Failed to allocate for chime (%d)", err);
+    err = opus_decoder_init(opus_decoder, SAMPLE_FREQUENCY, 1);
+    if (err != OPUS_OK) {
+        LOG_ERR("Failed to init the Opus decoder (%d)", err);
         return -1;
     }
-
-    memset(rx_buffer, 0, MAX_BLOCK_SIZE);
-    memset(buzz_buffer, 0, MAX_BLOCK_SIZE);
+#endif
+
+    k_thread_create(&speaker_thread,
+                    speaker_stack,
+                    K_THREAD_STACK_SIZEOF(speaker_stack),
+                    speaker_thread_function,
+                    NULL,
+                    NULL,
+                    NULL,
+                    K_PRIO_PREEMPT(SPEAKER_THREAD_PRIORITY),
+                    0,
+                    K_NO_WAIT);
+    k_thread_name_set(&speaker_thread, "speaker");
 
     return 0;
 }
 
+// Called with stream_lock held, sets the rings up in the arena unless they already are
+static bool stream_scratch_get(void)
+{
+    if (stream_scratch) {
+        return true;
+    }
+    uint8_t *arena = scratch_acquire(SCRATCH_SPEAKER);
+    if (!arena) {
+        return false;
+    }
+    ring_buf_init(&stream_buf, STREAM_BUF_SIZE, arena);
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    ring_buf_init(&opus_buf, OPUS_BUF_SIZE, arena + STREAM_BUF_SIZE);
+#endif
+    stream_scratch = true;
+    return true;
+}
+
+// Speaker thread only, hands the arena back once the clip has ended and played out of the rings
+static void stream_scratch_put(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&stream_lock);
+    bool idle = stream_scratch && !stream_open && ring_buf_is_empty(&stream_buf);
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    idle = idle && ring_buf_is_empty(&opus_buf);
+#endif
+    if (idle) {
+        stream_scratch = false;
+        scratch_release(SCRATCH_SPEAKER);
+    }
+    k_spin_unlock(&stream_lock, key);
+}
+
+static bool is_clip_header(uint16_t len)
+{
+    if (stream_remaining == 0) {
+        return len == sizeof(uint32_t) || len == sizeof(uint32_t) + 1;
+    }
+    // Senders may restart a PCM clip with a new length; Opus packets can be any size
+    return !stream_opus && len == sizeof(uint32_t);
+}
+
+static void start_clip(uint16_t len, const uint8_t *header)
+{
+    uint32_t length;
+    memcpy(&length, header, sizeof(length));
+    uint8_t codec = len > sizeof(length) ? header[sizeof(length)] : SPEAKER_CODEC_PCM8;
+
+    switch (codec) {
+    case SPEAKER_CODEC_PCM8:
+        stream_opus = false;
+        length &= ~1U; // whole samples only
+        break;
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    case SPEAKER_CODEC_OPUS:
+        stream_opus = true;
+        break;
+#endif
+    default:
+        // Skipped like Opus, its packets could be any size
+        LOG_WRN("Unsupported speaker codec %u, skipping %u bytes", codec, length);
+        stream_opus = true;
+        stream_remaining = length;
+        stream_discard = true;
+        return;
+    }
+
+    // An offline sync keeps the arena until it is done
+    k_spinlock_key_t key = k_spin_lock(&stream_lock);
+    bool ready = stream_scratch_get();
+    stream_open = ready;
+    k_spin_unlock(&stream_lock, key);
+    if (!ready) {
+        // Its packets still arrive, and some would pass for the header of a new clip
+        LOG_WRN("Speaker buffers in use, skipping the clip");
+        stream_remaining = length;
+        stream_discard = true;
+        return;
+    }
+
+    stream_remaining = length;
+    stream_discard = false;
+    LOG_INF("About to play %u bytes (codec %u)", stream_remaining, codec);
+}
+
+static uint32_t queue_pcm(const void *buf, uint32_t len)
+{
+    k_spinlock_key_t key = k_spin_lock(&stream_lock);
+    uint32_t put = ring_buf_put(&stream_buf, buf, len);
+    k_spin_unlock(&stream_lock, key);
+    if (put < len) {
+        LOG_WRN("Speaker stream overrun, dropped %u bytes", len - put);
+    }
+    return put;
+}
+
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+// Whole packets or nothing, the decoder conceals nothing it never sees anyway
+static uint32_t queue_opus(const void *buf, uint32_t len)
+{
+    if (len == 0 || len > OPUS_MAX_PACKET) {
+        LOG_WRN("Invalid Opus packet of %u bytes", len);
+        return 0;
+    }
+
+    uint8_t length = len;
+    uint32_t put = 0;
+    k_spinlock_key_t key = k_spin_lock(&stream_lock);
+    if (ring_buf_space_get(&opus_buf) >= sizeof(length) + len) {
+        ring_buf_put(&opus_buf, &length, sizeof(length));
+        put = ring_buf_put(&opus_buf, buf, len);
+    }
+    k_spin_unlock(&stream_lock, key);
+    if (put == 0) {
+        LOG_WRN("Speaker stream overrun, dropped an Opus packet");
+    }
+    return put;
+}
+#endif
+
 uint16_t speak(uint16_t len, const void *buf) // direct from bt
 {
-    uint16_t amount = 0;
-    amount = len;
-    if (len == 4) // if stage 1
+    if (is_clip_header(len)) // if stage 1
     {
-        current_length = ((uint32_t *) buf)[0];
-        LOG_INF("About to write %u bytes", current_length);
-        ptr2 = (int16_t *) rx_buffer;
-        clear_ptr = (int16_t *) rx_buffer;
-    } else { // if not stage 1
-        if (current_length > PACKET_SIZE) {
-            LOG_INF("Data length: %u", len);
-            current_length = current_length - PACKET_SIZE;
-            LOG_INF("remaining data: %u", current_length);
-
-            for (int i = 0; i < (int) (len / 2); i++) {
-                *ptr2++ = ((int16_t *) buf)[i];
-                *ptr2++ = ((int16_t *) buf)[i];
-            }
-            offset = offset + len;
-        } else if (current_length < PACKET_SIZE) {
-            LOG_INF("entered the final stretch");
-            LOG_INF("Data length: %u", len);
-            current_length = current_length - len;
-            LOG_INF("remaining data: %u", current_length);
-            // memcpy(rx_buffer+offset, buf, len);
-            for (int i = 0; i < len / 2; i++) {
-                *ptr2++ = ((int16_t *) buf)[i];
-                *ptr2++ = ((int16_t *) buf)[i];
-            }
-            offset = offset + len;
-            LOG_INF("offset: %u", offset);
-            offset = 0;
-            int res = i2s_write(audio_speaker, rx_buffer, MAX_BLOCK_SIZE);
-            if (res < 0) {
-                LOG_PRINTK("Failed to write I2S data: %d\n", res);
-            }
-            i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_START); // calls are probably non blocking
-            if (res != 0) {
-                LOG_PRINTK("Failed to drain I2S transmission: %d\n", res);
-            }
-            res = i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_DRAIN);
-            if (res != 0) {
-                LOG_PRINTK("Failed to drain I2S transmission: %d\n", res);
+        start_clip(len, buf);
+        return len;
+    }
+    if (stream_remaining == 0) {
+        LOG_WRN("Speaker data without a clip, dropping %u bytes", len);
+        return 0;
+    }
+
+    uint32_t take = MIN(len, stream_remaining);
+    if (stream_discard) {
+        stream_remaining -= take;
+        return 0;
+    }
+    uint32_t put;
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    if (stream_opus) {
+        put = queue_opus(buf, take);
+    } else
+#endif
+    {
+        put = queue_pcm(buf, take);
+    }
+
+    stream_remaining -= take;
+    if (stream_remaining == 0) {
+        k_spinlock_key_t key = k_spin_lock(&stream_lock);
+        stream_open = false;
+        k_spin_unlock(&stream_lock, key);
+        atomic_set(&stream_ended, 1);
+    }
+    k_sem_give(&stream_sem);
+    return put;
+}
+
+static void start_tx(void)
+{
+    int err = i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_START);
+    if (err) {
+        LOG_ERR("Failed to start I2S transmission: %d", err);
+        return;
+    }
+    tx_running = true;
+}
+
+// An underrun leaves the I2S in its error state, holding on to the queued blocks
+static void reset_tx(void)
+{
+    if (i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_DROP) != 0) {
+        i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_PREPARE);
+    }
+    tx_running = false;
+    blocks_queued = 0;
+}
+
+// Every block out of the slab is queued or about to be, so playback lasts at least as long as they take
+static void mark_audible(void)
+{
+    uint32_t now = k_uptime_get_32();
+    uint32_t outstanding = BLOCK_COUNT - k_mem_slab_num_free_get(&mem_slab);
+    if ((int32_t) (now - (uint32_t) atomic_get(&audible_until)) > 0) {
+        atomic_set(&audible_from, (atomic_val_t) now);
+    }
+    atomic_set(&audible_until, (atomic_val_t) (now + outstanding * BLOCK_MS));
+}
+
+// Takes ownership of the block, the driver frees it once it has been played
+static void queue_block(void *block)
+{
+    int err = i2s_write(audio_speaker, block, BLOCK_SIZE);
+    if (err == -EIO) {
+        LOG_WRN("Speaker underrun, restarting playback");
+        reset_tx();
+        err = i2s_write(audio_speaker, block, BLOCK_SIZE);
+    }
+    if (err) {
+        LOG_ERR("Failed to write I2S data: %d", err);
+        k_mem_slab_free(&mem_slab, block);
+        return;
+    }
+
+    blocks_queued++;
+    if (!tx_running && blocks_queued >= PRIME_BLOCKS) {
+        start_tx();
+    }
+    mark_audible();
+}
+
+static void *alloc_block(void)
+{
+    void *block;
+    // Blocks come back as they are played, so this only waits on a sender running ahead
+    if (k_mem_slab_alloc(&mem_slab, &block, K_MSEC(BLOCK_COUNT * BLOCK_FRAMES * 1000 / SAMPLE_FREQUENCY)) == 0) {
+        return block;
+    }
+    reset_tx();
+    if (k_mem_slab_alloc(&mem_slab, &block, K_NO_WAIT) == 0) {
+        return block;
+    }
+    return NULL;
+}
+
+static inline void copy_to_block(const int16_t *restrict mono, size_t count, int16_t *restrict out)
+{
+#if NUM_CHANNELS == 1
+    memcpy(out, mono, count * sizeof(int16_t));
+#else
+    size_t i = 0;
+#if SPEAKER_DUPLICATE_SIMD
+    /* Two samples per word in, two frames out: PKHBT/PKHTB copy each half into both lanes.
+     * The output frames are always word aligned, the input only mostly. */
+    if (((uintptr_t) mono & 3) == 0) {
+        const uint32_t *in = (const uint32_t *) mono;
+        uint32_t *frames = (uint32_t *) out;
+        for (; i + 2 <= count; i += 2) {
+            uint32_t pair = in[i / 2];
+            frames[i] = __PKHBT(pair, pair, 16);
+            frames[i + 1] = __PKHTB(pair, pair, 16);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        out[i * 2] = mono[i];
+        out[i * 2 + 1] = mono[i];
+    }
+#endif
+}
+
+// Copies mono samples into the block being filled, queueing each block once full
+static void push_samples(const int16_t *mono, size_t count)
+{
+    while (count > 0) {
+        if (fill_block == NULL) {
+            fill_block = alloc_block();
+            if (fill_block == NULL) {
+                LOG_ERR("No speaker block free, dropping %zu samples", count);
+                return;
             }
-            // clear the buffer
-            k_sleep(K_MSEC(4000));
+            fill_frames = 0;
+        }
+
+        size_t n = MIN(count, BLOCK_FRAMES - fill_frames);
+        copy_to_block(mono, n, &fill_block[fill_frames * NUM_CHANNELS]);
+        fill_frames += n;
+        mono += n;
+        count -= n;
 
-            memset(clear_ptr, 0, MAX_BLOCK_SIZE);
+        if (fill_frames == BLOCK_FRAMES) {
+            queue_block(fill_block);
+            fill_block = NULL;
         }
     }
-    return amount;
 }
 
-void generate_gentle_chime(int16_t *buffer, int num_samples)
+static void play_pcm(void)
 {
-    LOG_INF("Generating gentle chime");                                 // 2500
-    const float frequencies[] = {523.25, 659.25, 783.99, 1046.50};      // C5, E5, G5, C6
-    const int num_freqs = sizeof(frequencies) / sizeof(frequencies[0]); // 4
+    int16_t mono[64] __aligned(4);
+
+    while (1) {
+        k_spinlock_key_t key = k_spin_lock(&stream_lock);
+        uint32_t got = stream_scratch ? ring_buf_get(&stream_buf, (uint8_t *) mono, sizeof(mono)) : 0;
+        k_spin_unlock(&stream_lock, key);
+        if (got == 0) {
+            return;
+        }
+        push_samples(mono, got / 2);
+    }
+}
 
-    for (int i = 0; i < num_samples; i++) {
-        float t = (float) i / SAMPLE_FREQUENCY; // 0.000125
-        float sample = 0;
-        for (int j = 0; j < num_freqs; j++) {
-            sample += sinf(2 * PI * frequencies[j] * t) * (1.0 - t);
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+static void play_opus(void)
+{
+    uint8_t packet[OPUS_MAX_PACKET];
+    uint8_t length;
+
+    while (1) {
+        // speak() puts whole packets, so a length is always followed by its packet
+        k_spinlock_key_t key = k_spin_lock(&stream_lock);
+        if (!stream_scratch || ring_buf_get(&opus_buf, &length, sizeof(length)) == 0) {
+            k_spin_unlock(&stream_lock, key);
+            return;
         }
-        int16_t int_sample = (int16_t) (sample / num_freqs * 32767 * 0.5);
-        buffer[i * NUM_CHANNELS] = int_sample;
-        buffer[i * NUM_CHANNELS + 1] = int_sample;
+        ring_buf_get(&opus_buf, packet, length);
+        k_spin_unlock(&stream_lock, key);
+
+        int samples = opus_decode(opus_decoder, packet, length, opus_pcm, ARRAY_SIZE(opus_pcm), 0);
+        if (samples < 0) {
+            LOG_WRN("Opus decode failed (%d)", samples);
+            continue;
+        }
+        push_samples(opus_pcm, samples);
     }
-    LOG_INF("Done generating gentle chime");
 }
+#endif
 
-int play_boot_sound(void)
+/* Renders frames [first, first + count) of the chime, the phase of a voice is just step * n */
+static void render_chime(const struct chime *chime, uint32_t first, int16_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t n = first + i;
+        int32_t sum = 0;
+        for (int v = 0; v < chime->voices; v++) {
+            sum += sine_table[(chime->steps[v] * n) >> 24];
+        }
+        int32_t level = n < chime->decay_frames ? 32767 - (int32_t) (n * 32767 / chime->decay_frames) : 0;
+        out[i] = (int16_t) (((sum / chime->voices) * level) >> 16);
+    }
+}
+
+// Paced by the blocks coming back from the I2S, so it never needs more than one chunk of RAM
+static void play_chime(const struct chime *chime)
 {
-    int ret;
-    int16_t *buffer = (int16_t *) buzz_buffer;
-    const int samples_per_block = MAX_BLOCK_SIZE / (NUM_CHANNELS * sizeof(int16_t));
+    int16_t chunk[64] __aligned(4);
 
-    generate_gentle_chime(buffer, samples_per_block);
-    LOG_INF("Writing to speaker");
-    k_sleep(K_MSEC(100));
-    ret = i2s_write(audio_speaker, buffer, MAX_BLOCK_SIZE);
-    if (ret) {
-        LOG_ERR("Failed to write initial I2S data: %d", ret);
-        return ret;
+    for (uint32_t first = 0; first < chime->frames; first += ARRAY_SIZE(chunk)) {
+        size_t count = MIN(ARRAY_SIZE(chunk), chime->frames - first);
+        render_chime(chime, first, chunk, count);
+        push_samples(chunk, count);
     }
+}
+
+// DRAIN returns at once and the I2S refuses a new start until it has played out. The driver frees each
+// block once played, so all of them back in the slab means the next clip can start
+static void wait_drained(void)
+{
+    for (uint32_t waited = 0; k_mem_slab_num_free_get(&mem_slab) < BLOCK_COUNT; waited += BLOCK_MS) {
+        if (waited >= (BLOCK_COUNT + 1) * BLOCK_MS) {
+            LOG_WRN("I2S drain timed out, dropping the rest");
+            reset_tx();
+            return;
+        }
+        k_msleep(BLOCK_MS);
+    }
+}
 
-    ret = i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_START);
-    if (ret) {
-        LOG_ERR("Failed to start I2S transmission: %d", ret);
-        return ret;
+static void finish_clip(void)
+{
+    if (fill_block != NULL && fill_frames > 0) {
+        memset(&fill_block[fill_frames * NUM_CHANNELS],
+               0,
+               (BLOCK_FRAMES - fill_frames) * NUM_CHANNELS * sizeof(int16_t));
+        queue_block(fill_block);
+        fill_block = NULL;
+    }
+    // Short clips never filled the priming blocks
+    if (!tx_running && blocks_queued > 0) {
+        start_tx();
     }
+    if (tx_running) {
+        int err = i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_DRAIN);
+        if (err) {
+            LOG_ERR("Failed to drain I2S transmission: %d", err);
+        } else {
+            wait_drained();
+        }
+    }
+    tx_running = false;
+    blocks_queued = 0;
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    opus_decoder_ctl(opus_decoder, OPUS_RESET_STATE);
+#endif
+}
+
+static void speaker_thread_function(void *p1, void *p2, void *p3)
+{
+    while (1) {
+        k_sem_take(&stream_sem, K_FOREVER);
+        // Taken before emptying the buffers, a clip that ends later gives the semaphore again
+        bool ended = atomic_clear(&stream_ended);
+
+        play_pcm();
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+        play_opus();
+#endif
+        if (ended) {
+            finish_clip();
+            stream_scratch_put();
+        }
 
-    ret = i2s_trigger(audio_speaker, I2S_DIR_TX, I2S_TRIGGER_DRAIN);
-    if (ret != 0) {
-        LOG_ERR("Failed to drain I2S transmission: %d", ret);
-        return ret;
+        const struct chime *chime = atomic_ptr_clear(&pending_chime);
+        if (chime != NULL) {
+            play_chime(chime);
+            finish_clip();
+        }
     }
-    k_sleep(K_MSEC(3000));
+}
+
+int play_boot_sound(void)
+{
+    LOG_INF("Writing chime to speaker");
+    atomic_ptr_set(&pending_chime, (void *) &boot_chime);
+    k_sem_give(&stream_sem);
 
     return 0;
 }
 
+bool speaker_was_playing(uint32_t at_ms, uint32_t tail_ms)
+{
+    uint32_t until = (uint32_t) atomic_get(&audible_until) + tail_ms;
+    uint32_t from = (uint32_t) atomic_get(&audible_from);
+    return (int32_t) (at_ms - from) >= 0 && (int32_t) (until - at_ms) > 0;
+}
+
 void speaker_off()
 {
 
     gpio_pin_set_dt(&speaker_gpio_pin, 0);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_SPEAKER, false);
+#endif
 }
@@ -2,6 +2,11 @@
 #define SPEAKER_H
 
 #include <zephyr/kernel.h>
+
+// Codec byte after the length in a clip header, a header without one is PCM
+#define SPEAKER_CODEC_PCM8 1  // 16-bit mono PCM at 8kHz
+#define SPEAKER_CODEC_OPUS 20 // one Opus packet per write, decoded at 8kHz (CONFIG_OMI_ENABLE_SPEAKER_OPUS)
+
 /**
  * @brief Initialize the Speaker
  *
@@ -15,10 +20,14 @@ int speaker_init();
  * @brief Endpoint function for streaming audio
  *
  * Call this function in the following way (Via ble)
- * 1. Send a 2 byte packet containing the audio data size
- * 2. Send to the ble notify id 400 byte packets (with notify), with each 2 bytes being the audio data
- * 3. Repeat step 2 until the audio data is sent. Then the speaker will automatically play the sound
- * when the audio data sent is equal to the audio data size sent in step 1
+ * 1. Send a 4 byte packet containing the audio data size, optionally followed by a SPEAKER_CODEC_* byte
+ * 2. Send to the ble notify id 400 byte packets (with notify), with each 2 bytes being the audio data.
+ * For Opus, send one packet per write instead; the size counts the packet bytes
+ * 3. Repeat step 2 until the audio data is sent. Playback starts once 100ms are buffered and the
+ * speaker plays the tail when the audio data sent is equal to the audio data size sent in step 1
+ *
+ * Never blocks. Up to 512ms of audio are buffered ahead of playback, longer clips must be sent
+ * at about the playback rate (8kHz mono).
  *
  * @return The amount of data successfully sent in bytes.
  */
@@ -33,6 +42,19 @@ uint16_t speak(uint16_t len, const void *buf);
  */
 int play_boot_sound();
 
+/**
+ * @brief Tell whether the speaker was playing at an uptime
+ *
+ * Covers every clip and chime from its first queued block until its last one has been played,
+ * plus tail_ms for the room to ring out. Callable from any thread.
+ *
+ * @param at_ms Uptime in ms, k_uptime_get_32() clock
+ * @param tail_ms How long past the last played sample still counts
+ *
+ * @return true if at_ms falls in or right after the latest playback
+ */
+bool speaker_was_playing(uint32_t at_ms, uint32_t tail_ms);
+
 void speaker_off();
 
 void register_speaker_service();
@@ -11,13 +11,31 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/sys/atomic.h>
+#include <zephyr/sys/crc.h>
 
+#include "config.h"
+#include "mic.h"
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "monitor.h"
+#endif
+#include "power.h"
+#include "scratch.h"
 #include "sd_card.h"
+#include "subscription.h"
 #include "transport.h"
+#include "tune.h"
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+#include "usb.h"
+#endif
 #include "utils.h"
 #ifdef CONFIG_OMI_ENABLE_WIFI
 #include "wifi.h"
 #endif
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+#include <zephyr/sys/reboot.h>
+
+#include "sd_dfu.h"
+#endif
 
 LOG_MODULE_REGISTER(storage, CONFIG_LOG_DEFAULT_LEVEL);
 
@@ -29,6 +47,12 @@ LOG_MODULE_REGISTER(storage, CONFIG_LOG_DEFAULT_LEVEL);
 #define DELETE_COMMAND 1
 #define NUKE 2
 #define STOP_COMMAND 3
+#define AUTO_SYNC_COMMAND 4
+#define TIME_RANGE_COMMAND 5
+#define FRAMING_COMMAND 6
+#define RESUME_COMMAND 7
+#define RETENTION_COMMAND 8
+#define DELETE_SEGMENT_COMMAND 9
 
 #define INVALID_FILE_SIZE 3
 #define ZERO_FILE_SIZE 4
@@ -36,6 +60,9 @@ LOG_MODULE_REGISTER(storage, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define MAX_HEARTBEAT_FRAMES 100
 #define HEARTBEAT 50
+
+// Sync packets between saved offsets
+TUNABLE uint32_t heartbeat_frames = MAX_HEARTBEAT_FRAMES;
 static void storage_config_changed_handler(const struct bt_gatt_attr *attr, uint16_t value);
 static ssize_t storage_write_handler(struct bt_conn *conn,
                                      const struct bt_gatt_attr *attr,
@@ -52,8 +79,19 @@ static ssize_t storage_wifi_handler(struct bt_conn *conn,
                                     uint8_t flags);
 static void wifi_start_work_handler(struct k_work *work)
 {
-    mic_pause();
-    wifi_turn_on();
+    power_request(POWER_ACTIVITY_WIFI_SYNC);
+}
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+static void wifi_live_start_work_handler(struct k_work *work)
+{
+    power_request(POWER_ACTIVITY_WIFI_LIVE);
+}
+#endif
+
+// In live mode the hub on the TCP link takes audio frames, so a sync goes over BLE
+static bool wifi_sync_ready(void)
+{
+    return is_wifi_on() && !wifi_is_live();
 }
 #endif
 
@@ -65,12 +103,42 @@ static struct bt_uuid_128 storage_read_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x30295782, 0x4301, 0xEABD, 0x2904, 0x2849ADFEAE43));
 static struct bt_uuid_128 storage_wifi_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x30295783, 0x4301, 0xEABD, 0x2904, 0x2849ADFEAE43));
+#ifdef CONFIG_OMI_ENABLE_STORAGE_L2CAP
+static struct bt_uuid_128 storage_l2cap_psm_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x30295784, 0x4301, 0xEABD, 0x2904, 0x2849ADFEAE43));
+static ssize_t storage_l2cap_psm_read(struct bt_conn *conn,
+                                      const struct bt_gatt_attr *attr,
+                                      void *buf,
+                                      uint16_t len,
+                                      uint16_t offset);
+#endif
 static ssize_t storage_read_characteristic(struct bt_conn *conn,
                                            const struct bt_gatt_attr *attr,
                                            void *buf,
                                            uint16_t len,
                                            uint16_t offset);
 static struct k_work wifi_start_work;
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+static enum sync_plan sync_plan_get(void);
+static bool sync_wifi_cheaper(uint32_t bytes);
+static uint32_t sync_backlog(void);
+static uint32_t ble_sync_bps;
+#endif
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+static struct k_work wifi_live_start_work;
+#endif
+#ifdef CONFIG_OMI_ENABLE_WIFI_BENCHMARK
+#define WIFI_BENCH_SOURCE_PATTERN 0 // the socket and the nRF7002 alone
+#define WIFI_BENCH_SOURCE_SD 1      // stored audio through the sync read-ahead, what a sync gets
+static atomic_t wifi_bench_requested;
+static uint8_t wifi_bench_source;
+static uint8_t wifi_bench_duration_s;
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+static atomic_t wifi_firmware_requested;
+static uint32_t wifi_firmware_size;
+static uint32_t wifi_firmware_crc;
+#endif
 
 K_THREAD_STACK_DEFINE(storage_stack, 4096);
 static struct k_thread storage_thread;
@@ -102,16 +170,30 @@ static struct bt_gatt_attr storage_service_attr[] = {
                            NULL),
     BT_GATT_CCC(storage_config_changed_handler, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
 #endif
+#ifdef CONFIG_OMI_ENABLE_STORAGE_L2CAP
+    BT_GATT_CHARACTERISTIC(&storage_l2cap_psm_uuid.uuid,
+                           BT_GATT_CHRC_READ,
+                           BT_GATT_PERM_READ,
+                           storage_l2cap_psm_read,
+                           NULL,
+                           NULL),
+#endif
 };
 
 struct bt_gatt_service storage_service = BT_GATT_SERVICE(storage_service_attr);
 
 bool storage_is_on = false;
 
+static struct subscription storage_subscription = SUBSCRIPTION_INIT;
+
 static void storage_config_changed_handler(const struct bt_gatt_attr *attr, uint16_t value)
 {
 
     storage_is_on = true;
+    // Shared by all storage CCCs; audio data goes out on the first characteristic (CCC at attrs[3])
+    if (attr == &storage_service.attrs[3]) {
+        subscription_update(&storage_subscription, value);
+    }
     if (value == BT_GATT_CCC_NOTIFY) {
         LOG_INF("Client subscribed for notifications");
     } else if (value == 0) {
@@ -121,6 +203,8 @@ static void storage_config_changed_handler(const struct bt_gatt_attr *attr, uint
     }
 }
 
+uint32_t remaining_length = 0;
+
 static ssize_t storage_read_characteristic(struct bt_conn *conn,
                                            const struct bt_gatt_attr *attr,
                                            void *buf,
@@ -128,18 +212,94 @@ static ssize_t storage_read_characteristic(struct bt_conn *conn,
                                            uint16_t offset)
 {
     k_msleep(10);
-    uint32_t amount[2] = {0};
-    amount[0] = get_file_size();
-    amount[1] = get_offset();
-    LOG_INF("Storage read requested: file size %u, offset %u", amount[0], amount[1]);
-    ssize_t result = bt_gatt_attr_read(conn, attr, buf, len, offset, amount, 2 * sizeof(uint32_t));
+    // Stored size, saved offset and bytes left in the running sync (progress), all over every
+    // segment, then the oldest and newest segment id, and last the card's capacity
+    struct {
+        uint32_t file_size;
+        uint32_t offset;
+        uint32_t remaining_length;
+        uint8_t first_segment;
+        uint8_t last_segment;
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+        uint8_t sync_plan;     // enum sync_plan for the backlog
+        uint32_t ble_sync_bps; // measured BLE sync throughput, bytes/s
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+        uint32_t evicted_segments; // segments evicted since boot to keep recording
+        uint32_t evicted_bytes;
+#endif
+        uint32_t card_kb;    // file system size, 0 until mounted
+        uint32_t free_kb;    // free on the card (estimate)
+        uint32_t room_bytes; // audio that still fits, the app syncs before this runs out
+    } __packed amount;
+    amount.file_size = get_file_size();
+    amount.offset = get_offset();
+    amount.remaining_length = remaining_length;
+    get_segment_range(&amount.first_segment, &amount.last_segment);
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+    amount.sync_plan = sync_plan_get();
+    amount.ble_sync_bps = ble_sync_bps;
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+    struct sd_evictions evictions;
+    sd_get_evictions(&evictions);
+    amount.evicted_segments = evictions.segments;
+    amount.evicted_bytes = evictions.bytes;
+#endif
+    struct sd_capacity capacity;
+    sd_get_capacity(&capacity);
+    amount.card_kb = capacity.card_kb;
+    amount.free_kb = capacity.free_kb;
+    amount.room_bytes = capacity.room_bytes;
+    LOG_INF("Storage read requested: file size %u, offset %u, room %u", amount.file_size, amount.offset,
+            amount.room_bytes);
+    ssize_t result = bt_gatt_attr_read(conn, attr, buf, len, offset, &amount, sizeof(amount));
     return result;
 }
 
 uint8_t transport_started = 0;
 static uint16_t packet_next_index = 0;
 #define SD_BLE_SIZE 440
-static uint8_t storage_write_buffer[SD_BLE_SIZE * 10];
+// Each chunk is half the scratch arena in whole blocks, the arena is held for the length of a sync
+#define READ_AHEAD_SIZE ((SCRATCH_ARENA_SIZE / 2) / SD_BLE_SIZE * SD_BLE_SIZE)
+BUILD_ASSERT(READ_AHEAD_SIZE >= SD_BLE_SIZE * STORAGE_READ_AHEAD_BLOCKS, "Read-ahead chunks don't fit the arena");
+
+// While one chunk is being sent, the SD worker fills the other with what comes after it
+struct read_ahead_chunk {
+    uint8_t *data; // in the scratch arena, word aligned
+    uint32_t offset;
+    uint32_t length; // requested, and what was read once ready
+    bool pending;    // owned by the SD worker until resp.sem is given
+    bool ready;
+    struct read_resp resp;
+};
+static struct read_ahead_chunk read_ahead[2];
+static enum scratch_mode sync_scratch = SCRATCH_FREE;
+
+// Set by FRAMING_COMMAND: every notification, SDU or TCP chunk starts with this header, so the app
+// can verify what it got and RESUME_COMMAND exactly after the last good chunk
+struct sync_frame_header {
+    uint32_t seq;    // counts up from 0 for each sync
+    uint32_t offset; // stream offset of the first data byte
+    uint16_t length; // data bytes after the header
+    uint32_t crc32;  // IEEE CRC32 of the data bytes
+} __packed;
+
+static bool sync_framing = false;
+static uint32_t sync_seq = 0;
+
+static void sync_frame_header_fill(struct sync_frame_header *header, uint32_t from, uint16_t length, uint32_t crc)
+{
+    header->seq = sync_seq++;
+    header->offset = from;
+    header->length = length;
+    header->crc32 = crc;
+}
+
+static inline size_t sync_frame_header_size(void)
+{
+    return sync_framing ? sizeof(struct sync_frame_header) : 0;
+}
 
 static uint32_t offset = 0;
 static uint8_t index = 0;
@@ -147,14 +307,138 @@ static uint8_t current_packet_size = 0;
 static uint8_t tx_buffer_size = 0;
 static uint8_t stop_started = 0;
 static uint8_t delete_started = 0;
-uint32_t remaining_length = 0;
+static uint8_t delete_segment_started = 0;
+
+// Set by AUTO_SYNC_COMMAND: drain the backlog without waiting for READ_COMMAND
+static bool auto_sync_enabled = false;
+static int64_t auto_sync_checked_at = 0;
+
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+//
+// Sync planner
+//
+// Estimates the charge a sync of the backlog takes over each path, in the units of the energy
+// ledger (uA x ms = nC). BLE: CPU and SD busy for the backlog at the measured throughput, plus a
+// radio burst per notification. Wi-Fi: the nRF7002 and CPU up for the bring-up and the transfer,
+// the SD for the transfer. Auto sync waits for a burst worth waking the card for, and leaves a
+// backlog that Wi-Fi moves for less to the app, for SYNC_PLAN_MAX_WAIT_MS at most either way.
+static uint32_t ble_sync_bps = SYNC_PLAN_BLE_BPS;
+static int64_t backlog_seen_at = 0; // when auto sync first found the backlog, 0 while there is none
+static int64_t sync_started_at = 0;
+static uint32_t sync_started_length = 0;
+static bool sync_over_ble = false;
+
+static uint32_t sync_backlog(void)
+{
+    uint32_t file_size = get_file_size();
+    return file_size > offset ? file_size - offset : 0;
+}
+
+static uint64_t sync_cost_ble_nc(uint32_t bytes)
+{
+    uint64_t ms = (uint64_t) bytes * 1000 / ble_sync_bps;
+    return ms * (ENERGY_CPU_UA + ENERGY_SD_ACCESS_UA) +
+           (uint64_t) DIV_ROUND_UP(bytes, SD_BLE_SIZE) * ENERGY_RADIO_NOTIFY_NC;
+}
+
+static bool sync_wifi_cheaper(uint32_t bytes)
+{
+#ifdef CONFIG_OMI_ENABLE_WIFI
+    uint64_t ms = (uint64_t) bytes * 1000 / SYNC_PLAN_WIFI_BPS;
+    uint64_t wifi_nc = (wifi_bringup_ms() + ms) * (ENERGY_WIFI_UA + ENERGY_CPU_UA) + ms * ENERGY_SD_ACCESS_UA;
+    return wifi_is_hw_available() && wifi_nc < sync_cost_ble_nc(bytes);
+#else
+    return false;
+#endif
+}
+
+static enum sync_plan sync_plan_get(void)
+{
+    uint32_t backlog = sync_backlog();
+    if (backlog == 0) {
+        return SYNC_PLAN_NONE;
+    }
+
+    bool overdue = backlog_seen_at && k_uptime_get() - backlog_seen_at >= SYNC_PLAN_MAX_WAIT_MS;
+    if (!overdue && sync_wifi_cheaper(backlog)) {
+        return SYNC_PLAN_WIFI;
+    }
+    // A card close to full can't wait for a cheaper burst
+    bool card_filling = sd_get_room() < SYNC_PLAN_LOW_ROOM_BYTES;
+    if (!overdue && !card_filling && backlog < SYNC_PLAN_BURST_BYTES) {
+        return SYNC_PLAN_WAIT;
+    }
+    return SYNC_PLAN_BLE;
+}
+
+static void sync_meter_start(void)
+{
+    sync_started_at = k_uptime_get();
+    sync_started_length = remaining_length;
+#ifdef CONFIG_OMI_ENABLE_WIFI
+    sync_over_ble = !wifi_sync_ready();
+#else
+    sync_over_ble = true;
+#endif
+}
+
+// A completed BLE sync updates the throughput estimate, live audio's share of the link included
+static void sync_meter_finish(void)
+{
+    int64_t took = k_uptime_get() - sync_started_at;
+    if (!sync_over_ble || sync_started_length < SYNC_PLAN_SAMPLE_BYTES || took <= 0) {
+        return;
+    }
+    uint32_t bps = (uint64_t) sync_started_length * 1000 / took;
+    ble_sync_bps = MAX((3 * ble_sync_bps + bps) / 4, 1);
+    LOG_INF("BLE sync at %u bytes/s (average %u)", bps, ble_sync_bps);
+}
+#endif
+
+// Set by TIME_RANGE_COMMAND: sync only [offset, sync_end) and go back to range_return_offset after
+static bool time_range_started = false;
+static uint32_t time_range_start_utc_s = 0;
+static uint32_t time_range_end_utc_s = 0;
+static bool range_sync = false;
+static uint32_t range_return_offset = 0;
+static uint32_t sync_end = 0; // 0 syncs up to the end of the stored audio
+
+// Storage packets get their own, smaller share of the controller buffers than live audio
+K_SEM_DEFINE(storage_notify_credits, STORAGE_NOTIFY_CREDITS, STORAGE_NOTIFY_CREDITS);
+#ifdef CONFIG_BT_CONN_TX_MAX
+BUILD_ASSERT(AUDIO_NOTIFY_CREDITS + STORAGE_NOTIFY_CREDITS + CONTROL_NOTIFY_CREDITS <= CONFIG_BT_CONN_TX_MAX,
+             "Audio, storage and control credits exceed the connection TX contexts");
+#endif
+
+static bool sync_powered; // POWER_ACTIVITY_SYNC held, only touched by the storage thread
+
+bool storage_sync_active(void)
+{
+    return remaining_length > 0;
+}
 
 static int setup_storage_tx()
 {
     transport_started = (uint8_t) 0;
-    LOG_INF("about to transmit storage\n");
     k_msleep(1000);
 
+    // A speaker clip holds the arena for a few seconds at most, try again on the next pass
+    if (sync_scratch == SCRATCH_FREE) {
+#ifdef CONFIG_OMI_ENABLE_WIFI
+        enum scratch_mode mode = wifi_sync_ready() ? SCRATCH_WIFI_SYNC : SCRATCH_SYNC;
+#else
+        enum scratch_mode mode = SCRATCH_SYNC;
+#endif
+        uint8_t *arena = scratch_acquire(mode);
+        if (!arena) {
+            transport_started = 1;
+            return -EBUSY;
+        }
+        sync_scratch = mode;
+        read_ahead[0].data = arena;
+        read_ahead[1].data = arena + READ_AHEAD_SIZE;
+    }
+
     uint32_t file_size = get_file_size();
 
     // Validate offset against file size
@@ -163,41 +447,158 @@ static int setup_storage_tx()
         offset = 0; // Reset to start
     }
 
-    remaining_length = file_size - offset;
+    uint32_t end = (sync_end > offset && sync_end < file_size) ? sync_end : file_size;
+    sync_end = 0;
+    remaining_length = end - offset;
+    sync_seq = 0;
 
-    LOG_INF("remaining length: %d", remaining_length);
-    LOG_INF("offset: %d", offset);
-    LOG_INF("file size: %d", file_size);
+    LOG_INF("Sync of %u bytes from offset %u, file size %u", remaining_length, offset, file_size);
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+    sync_meter_start();
+#endif
 
     return 0;
 }
+// Offset the app has synced up to; a time range sync doesn't move it
+static void save_sync_offset(void)
+{
+    save_offset(range_sync ? range_return_offset : offset);
+}
+
+static void end_range_sync(void)
+{
+    if (range_sync) {
+        offset = range_return_offset;
+        range_sync = false;
+    }
+}
+
+static void start_range_sync(void)
+{
+    uint32_t start, end;
+    time_range_started = false;
+    if (find_audio_time_range(time_range_start_utc_s, time_range_end_utc_s, &start, &end)) {
+        return;
+    }
+    LOG_INF("time range %u..%u is at %u..%u", time_range_start_utc_s, time_range_end_utc_s, start, end);
+    if (start >= end) {
+        return;
+    }
+
+    if (!range_sync) {
+        range_return_offset = offset;
+        range_sync = true;
+    }
+    offset = start - (start % SD_BLE_SIZE);
+    sync_end = end;
+    transport_started = 1;
+}
+
+// Commands written to the storage characteristic, parsed on the storage thread
+struct storage_cmd {
+    uint8_t len;
+    uint8_t data[10];
+    bool from_usb; // sent by a host on the USB sync port
+};
+K_MSGQ_DEFINE(storage_cmd_q, sizeof(struct storage_cmd), STORAGE_CMD_QUEUE_LEN, 1);
+
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+// Results and the sync itself go back the way the last command came
+static bool reply_usb = false;
+
+// From the USB interrupt, queued like a write to the storage characteristic
+static void usb_sync_cmd(const uint8_t *data, uint8_t len)
+{
+    struct storage_cmd cmd = {.len = len, .from_usb = true};
+    memcpy(cmd.data, data, MIN(len, sizeof(cmd.data)));
+    if (k_msgq_put(&storage_cmd_q, &cmd, K_NO_WAIT) != 0) {
+        LOG_WRN("storage command queue full");
+    }
+}
+#endif
+
+static void storage_reply(struct bt_conn *conn, uint8_t result)
+{
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+    if (reply_usb) {
+        usb_send(USB_SYNC_MSG_RESULT, NULL, 0, &result, 1);
+        return;
+    }
+#endif
+    if (conn) {
+        transport_notify(conn, &storage_service.attrs[1], &result, 1);
+    }
+}
+
 uint8_t delete_num = 0;
 uint8_t nuke_started = 0;
-static uint8_t heartbeat_count = 0;
+static uint16_t heartbeat_count = 0;
 static uint8_t parse_storage_command(void *buf, uint16_t len)
 {
 
-    if (len != 6 && len != 2) {
+    if (len != 6 && len != 2 && len != 10) {
         LOG_INF("invalid command");
         return INVALID_COMMAND;
     }
     const uint8_t command = ((uint8_t *) buf)[0];
     const uint8_t file_num = ((uint8_t *) buf)[1];
+
+    // [AUTO_SYNC_COMMAND][1 = on, 0 = off]
+    if (command == AUTO_SYNC_COMMAND && len == 2) {
+        auto_sync_enabled = file_num != 0;
+        auto_sync_checked_at = 0;
+        LOG_INF("auto sync %s", auto_sync_enabled ? "on" : "off");
+        return 0;
+    }
+
+    // [FRAMING_COMMAND][1 = on, 0 = off], applies from the next sync
+    if (command == FRAMING_COMMAND && len == 2) {
+        if (remaining_length > 0) {
+            LOG_WRN("sync already running");
+            return INVALID_COMMAND;
+        }
+        sync_framing = file_num != 0;
+        LOG_INF("sync framing %s", sync_framing ? "on" : "off");
+        return 0;
+    }
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+    // [RETENTION_COMMAND][enum sd_retention], what a full card gives up
+    if (command == RETENTION_COMMAND && len == 2) {
+        return sd_set_retention(file_num) ? INVALID_COMMAND : 0;
+    }
+#endif
+
+    // [TIME_RANGE_COMMAND][0][start UTC seconds][end UTC seconds], both big endian
+    if (command == TIME_RANGE_COMMAND && len == 10) {
+        if (remaining_length > 0 || time_range_started) {
+            LOG_WRN("sync already running");
+            return INVALID_COMMAND;
+        }
+        uint8_t *args = (uint8_t *) buf + 2;
+        time_range_start_utc_s = args[0] << 24 | args[1] << 16 | args[2] << 8 | args[3];
+        time_range_end_utc_s = args[4] << 24 | args[5] << 16 | args[6] << 8 | args[7];
+        time_range_started = true;
+        return 0;
+    }
+
     uint32_t request_offset = 0;
     if (len == 6) {
         request_offset =
             ((uint8_t *) buf)[2] << 24 | ((uint8_t *) buf)[3] << 16 | ((uint8_t *) buf)[4] << 8 | ((uint8_t *) buf)[5];
     }
-    LOG_INF("command successful: command: %d file: %d offset: %d \n", command, file_num, request_offset);
-
-    // only support file 1 for now
-    if (file_num != 1) {
-        LOG_INF("invalid file count 0");
-        return INVALID_FILE_SIZE;
-    }
+    LOG_HOT("Storage command %d file %d offset %d", command, file_num, request_offset);
 
     if (command == READ_COMMAND) // read
     {
+        // The offset is relative to the start of the requested segment
+        uint32_t segment_start;
+        if (get_segment_start(file_num, &segment_start)) {
+            LOG_INF("segment %d is not stored", file_num);
+            return INVALID_FILE_SIZE;
+        }
+        request_offset += segment_start;
+
         uint32_t file_size = get_file_size();
         if (request_offset >= file_size) {
             LOG_WRN("requested offset is too large");
@@ -206,12 +607,25 @@ static uint8_t parse_storage_command(void *buf, uint16_t len)
             LOG_WRN("file size is 0");
             return ZERO_FILE_SIZE;
         } else {
+            end_range_sync();
             offset = request_offset - (request_offset % SD_BLE_SIZE);
             transport_started = 1;
         }
+    } else if (command == RESUME_COMMAND) {
+        // [RESUME_COMMAND][0][stream offset]: carries on right after the last verified byte
+        if (request_offset >= get_file_size()) {
+            LOG_WRN("resume offset is too large");
+            return INVALID_FILE_SIZE;
+        }
+        end_range_sync();
+        offset = request_offset;
+        transport_started = 1;
     } else if (command == DELETE_COMMAND) {
-        delete_num = file_num;
         delete_started = 1;
+    } else if (command == DELETE_SEGMENT_COMMAND) {
+        // [DELETE_SEGMENT_COMMAND][segment]: unlinks the oldest segment, which must be the one given
+        delete_num = file_num;
+        delete_segment_started = 1;
     } else if (command == NUKE) {
         nuke_started = 1;
     } else if (command == STOP_COMMAND) // should be no explicit stop command, send heartbeats to keep connection alive
@@ -233,16 +647,20 @@ static ssize_t storage_write_handler(struct bt_conn *conn,
                                      uint16_t offset,
                                      uint8_t flags)
 {
-    LOG_INF("about to schedule the storage");
-    LOG_INF("was sent %d  ", ((uint8_t *) buf)[0]);
+    LOG_HOT("Storage command %d, %u bytes", len ? ((uint8_t *) buf)[0] : -1, len);
 
-    uint8_t result_buffer[1] = {0};
-    uint8_t result = parse_storage_command(buf, len);
-    result_buffer[0] = result;
-    LOG_INF("length of storage write: %d", len);
-    LOG_INF("result: %d ", result);
-    bt_gatt_notify(conn, &storage_service.attrs[1], &result_buffer, 1);
-    k_msleep(500);
+    // Handled by the storage thread, which notifies the result; never block the BT RX thread here
+    struct storage_cmd cmd = {.len = len};
+    if (len > sizeof(cmd.data)) {
+        uint8_t result_buffer[1] = {INVALID_COMMAND};
+        transport_notify(conn, &storage_service.attrs[1], &result_buffer, 1);
+        return len;
+    }
+    memcpy(cmd.data, buf, len);
+    if (k_msgq_put(&storage_cmd_q, &cmd, K_NO_WAIT) != 0) {
+        LOG_WRN("storage command queue full");
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
     return len;
 }
 
@@ -259,14 +677,14 @@ static ssize_t storage_wifi_handler(struct bt_conn *conn,
 
     if (len < 1) {
         result_buffer[0] = 1; // error: invalid length
-        bt_gatt_notify(conn, &storage_service.attrs[8], &result_buffer, 1);
+        transport_notify(conn, &storage_service.attrs[8], &result_buffer, 1);
         return len;
     }
 
     if (wifi_is_hw_available() == false) {
         LOG_ERR("Wi-Fi hardware not available");
         result_buffer[0] = 0xFE; // error: hardware not available
-        bt_gatt_notify(conn, &storage_service.attrs[8], &result_buffer, 1);
+        transport_notify(conn, &storage_service.attrs[8], &result_buffer, 1);
         return len;
     }
 
@@ -315,6 +733,15 @@ static ssize_t storage_wifi_handler(struct bt_conn *conn,
                 result_buffer[0] = 5; // wait for next session
                 break;
             }
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+            // Bringing Wi-Fi up would cost more than BLE takes for this backlog
+            if (!sync_wifi_cheaper(sync_backlog())) {
+                LOG_INF("WIFI_START declined, BLE is cheaper for the backlog");
+                result_buffer[0] = 6; // use BLE
+                break;
+            }
+#endif
+            wifi_set_live(false);
             k_work_submit(&wifi_start_work);
             result_buffer[0] = 0;
             break;
@@ -322,70 +749,685 @@ static ssize_t storage_wifi_handler(struct bt_conn *conn,
         case 0x03: // WIFI_SHUTDOWN
             LOG_INF("WIFI_SHUTDOWN command received");
             storage_stop_transfer();
-            wifi_turn_off();
-            mic_resume();
+            power_release(POWER_ACTIVITY_WIFI_SYNC);
+            power_release(POWER_ACTIVITY_WIFI_LIVE);
             result_buffer[0] = 0;
             break;
 
+#ifdef CONFIG_OMI_ENABLE_WIFI_BENCHMARK
+        case 0x05: // WIFI_BENCH
+            // Format: [cmd][source][duration_s], streamed over the hub connection
+            if (len < 3 || ((const uint8_t *) buf)[1] > WIFI_BENCH_SOURCE_SD || ((const uint8_t *) buf)[2] == 0 ||
+                ((const uint8_t *) buf)[2] > WIFI_BENCH_MAX_S) {
+                result_buffer[0] = 8; // error: invalid arguments
+                break;
+            }
+            if (!is_wifi_transport_ready() || wifi_is_live() || remaining_length > 0 || transport_started ||
+                atomic_get(&wifi_bench_requested)) {
+                result_buffer[0] = 7; // error: no idle hub connection
+                break;
+            }
+            wifi_bench_source = ((const uint8_t *) buf)[1];
+            wifi_bench_duration_s = ((const uint8_t *) buf)[2];
+            atomic_set(&wifi_bench_requested, 1);
+            result_buffer[0] = 0; // results follow once the run is over
+            break;
+
+        case 0x06: // WIFI_TUNE
+            // Format: [cmd][sndbuf 4 bytes, big endian, 0 keeps it][nodelay 0/1, 0xFF for the default]
+            if (len < 6) {
+                result_buffer[0] = 8; // error: invalid arguments
+                break;
+            }
+            const uint8_t *args = (const uint8_t *) buf + 1;
+            uint32_t sndbuf = args[0] << 24 | args[1] << 16 | args[2] << 8 | args[3];
+            int nodelay = args[4] == 0xFF ? -1 : args[4];
+            result_buffer[0] = wifi_tune_socket(sndbuf, nodelay) == 0 ? 0 : 8;
+            break;
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+        case 0x07: // WIFI_FIRMWARE
+            // Format: [cmd][size 4 bytes, big endian][IEEE CRC32 4 bytes, big endian], then the
+            // image follows over the hub connection
+            if (len < 9) {
+                result_buffer[0] = 8; // error: invalid arguments
+                break;
+            }
+            if (!is_wifi_transport_ready() || wifi_is_live() || remaining_length > 0 || transport_started ||
+                atomic_get(&wifi_firmware_requested)) {
+                result_buffer[0] = 7; // error: no idle hub connection
+                break;
+            }
+            const uint8_t *image = (const uint8_t *) buf + 1;
+            wifi_firmware_size = image[0] << 24 | image[1] << 16 | image[2] << 8 | image[3];
+            wifi_firmware_crc = image[4] << 24 | image[5] << 16 | image[6] << 8 | image[7];
+            atomic_set(&wifi_firmware_requested, 1);
+            result_buffer[0] = 0; // the result follows once the image is on the card
+            break;
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+        case 0x04: // WIFI_START_LIVE
+            LOG_INF("WIFI_START_LIVE command received");
+            if (is_wifi_on()) {
+                LOG_INF("Wi-Fi already on - wait for next session");
+                result_buffer[0] = 5; // wait for next session
+                break;
+            }
+            wifi_set_live(true);
+            k_work_submit(&wifi_live_start_work);
+            result_buffer[0] = 0;
+            break;
+#endif
+
         default:
             LOG_WRN("Unknown WIFI command: %d", cmd);
             result_buffer[0] = 0xFF; // unknown command
             break;
     }
 
-    bt_gatt_notify(conn, &storage_service.attrs[8], &result_buffer, 1);
+    transport_notify(conn, &storage_service.attrs[8], &result_buffer, 1);
     return len;
 }
 #endif
 
-static void write_to_gatt(struct bt_conn *conn)
+static void storage_notify_sent(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&storage_notify_credits);
+}
+
+static void reset_storage_notify_credits(void)
+{
+    k_sem_reset(&storage_notify_credits);
+    for (int i = 0; i < STORAGE_NOTIFY_CREDITS; i++) {
+        k_sem_give(&storage_notify_credits);
+    }
+}
+
+static int read_ahead_wait(struct read_ahead_chunk *chunk)
 {
+    if (chunk->pending) {
+        if (k_sem_take(&chunk->resp.sem, K_MSEC(5000)) != 0) {
+            LOG_ERR("Timeout waiting for read-ahead at %u", chunk->offset);
+            return -ETIMEDOUT;
+        }
+        chunk->pending = false;
+        chunk->ready = chunk->resp.res == 0 && chunk->resp.read_bytes > 0;
+        chunk->length = chunk->ready ? chunk->resp.read_bytes : 0;
+        if (!chunk->ready) {
+            LOG_ERR("Read-ahead at %u failed: %d", chunk->offset, chunk->resp.res);
+        }
+    }
+    return chunk->ready ? 0 : -EIO;
+}
 
-    uint32_t packet_size = MIN(remaining_length, SD_BLE_SIZE);
+static void read_ahead_start(struct read_ahead_chunk *chunk, uint32_t from, uint32_t length)
+{
+    chunk->offset = from;
+    chunk->length = MIN(length, READ_AHEAD_SIZE);
+    chunk->ready = false;
+    chunk->pending = read_audio_data_async(chunk->data, chunk->length, from, &chunk->resp) == 0;
+}
 
-    int r = read_audio_data(storage_write_buffer, packet_size, offset);
-    if (r < 0) {
-        LOG_ERR("Failed to read audio data: %d", r);
-        remaining_length = 0; // Stop transfer on error
+// Forget all chunks, e.g. once offsets moved; waits for reads still in the SD worker
+static void read_ahead_reset(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(read_ahead); i++) {
+        if (read_ahead[i].pending && read_ahead_wait(&read_ahead[i]) == -ETIMEDOUT) {
+            // The worker still writes into the chunk, it can't be reused or released before it's done
+            LOG_WRN("Waiting for read-ahead at %u to finish", read_ahead[i].offset);
+            k_sem_take(&read_ahead[i].resp.sem, K_FOREVER);
+        }
+        read_ahead[i].pending = false;
+        read_ahead[i].ready = false;
+    }
+}
+
+// Everything after removed bytes moved to the front of the stream, a sync inside them ends
+static void stream_moved_back(uint32_t removed)
+{
+    if (removed > offset) {
+        offset = 0;
+        remaining_length = 0;
+    } else {
+        offset -= removed;
+    }
+    range_return_offset = removed > range_return_offset ? 0 : range_return_offset - removed;
+}
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+// A full card in ring mode evicts its oldest segment, which moves the stream like a delete
+static void check_evictions(void)
+{
+    static uint32_t seen_bytes = 0;
+    struct sd_evictions evictions;
+    sd_get_evictions(&evictions);
+    if (evictions.bytes != seen_bytes) {
+        read_ahead_reset();
+        stream_moved_back(evictions.bytes - seen_bytes);
+        seen_bytes = evictions.bytes;
+    }
+}
+#endif
+
+// The arena goes back once a sync is over and the SD worker is done with both chunks
+static void sync_scratch_put(void)
+{
+    if (sync_scratch == SCRATCH_FREE || remaining_length > 0 || transport_started) {
         return;
     }
+    read_ahead_reset();
+    read_ahead[0].data = NULL;
+    read_ahead[1].data = NULL;
+    scratch_release(sync_scratch);
+    sync_scratch = SCRATCH_FREE;
+}
+
+// Point data at up to length bytes of the sync at offset, prefetching the chunk after them
+static int read_ahead_get(uint32_t from, uint32_t length, const uint8_t **data)
+{
+    struct read_ahead_chunk *chunk = NULL;
+    struct read_ahead_chunk *other = NULL;
 
-    offset = offset + packet_size;
-    int err = bt_gatt_notify(conn, &storage_service.attrs[1], &storage_write_buffer, packet_size);
+    for (size_t i = 0; i < ARRAY_SIZE(read_ahead); i++) {
+        struct read_ahead_chunk *c = &read_ahead[i];
+        if ((c->pending || c->ready) && from >= c->offset && from < c->offset + c->length) {
+            chunk = c;
+            other = &read_ahead[1 - i];
+            break;
+        }
+    }
+    if (!chunk) {
+        // Not read ahead (first read, or the sync jumped), read it now
+        read_ahead_reset();
+        chunk = &read_ahead[0];
+        other = &read_ahead[1];
+        read_ahead_start(chunk, from, remaining_length);
+    }
+
+    int err = read_ahead_wait(chunk);
     if (err) {
-        LOG_PRINTK("error writing to gatt: %d\n", err);
-    } else {
-        remaining_length = remaining_length - packet_size; // FIX: Use packet_size, not SD_BLE_SIZE
+        read_ahead_reset();
+        return err;
+    }
+
+    // The other chunk is free once it's behind us
+    uint32_t chunk_end = chunk->offset + chunk->length;
+    uint32_t left_after = remaining_length - MIN(remaining_length, chunk_end - from);
+    if (!other->pending && !(other->ready && other->offset == chunk_end) && left_after > 0) {
+        read_ahead_start(other, chunk_end, left_after);
+    }
+
+    *data = chunk->data + (from - chunk->offset);
+    return MIN(length, chunk_end - from);
+}
+
+#ifdef CONFIG_OMI_ENABLE_STORAGE_L2CAP
+// Once the app opens this channel, sync data goes over it instead of notifications. Commands and
+// status stay on the GATT service. The channel's credits pace us, and so does the small SDU pool.
+#define STORAGE_L2CAP_SDU_SIZE (SD_BLE_SIZE * STORAGE_L2CAP_SDU_BLOCKS)
+
+NET_BUF_POOL_FIXED_DEFINE(storage_l2cap_pool,
+                          STORAGE_L2CAP_BUFS,
+                          BT_L2CAP_SDU_BUF_SIZE(STORAGE_L2CAP_SDU_SIZE),
+                          CONFIG_BT_CONN_TX_USER_DATA_SIZE,
+                          NULL);
+
+static struct bt_l2cap_le_chan storage_l2cap_chan;
+static atomic_t storage_l2cap_connected = ATOMIC_INIT(0);
+
+static ssize_t storage_l2cap_psm_read(struct bt_conn *conn,
+                                      const struct bt_gatt_attr *attr,
+                                      void *buf,
+                                      uint16_t len,
+                                      uint16_t offset)
+{
+    uint16_t psm = STORAGE_L2CAP_PSM;
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &psm, sizeof(psm));
+}
+
+static void storage_l2cap_connected_cb(struct bt_l2cap_chan *chan)
+{
+    LOG_INF("Storage L2CAP channel connected, tx mtu %u", storage_l2cap_chan.tx.mtu);
+    atomic_set(&storage_l2cap_connected, 1);
+}
+
+static void storage_l2cap_disconnected_cb(struct bt_l2cap_chan *chan)
+{
+    LOG_INF("Storage L2CAP channel disconnected");
+    atomic_set(&storage_l2cap_connected, 0);
+}
+
+static int storage_l2cap_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+    // Data only flows from the device; commands use the storage characteristic
+    return 0;
+}
+
+static const struct bt_l2cap_chan_ops storage_l2cap_ops = {
+    .connected = storage_l2cap_connected_cb,
+    .disconnected = storage_l2cap_disconnected_cb,
+    .recv = storage_l2cap_recv,
+};
+
+static int storage_l2cap_accept(struct bt_conn *conn, struct bt_l2cap_server *server, struct bt_l2cap_chan **chan)
+{
+    if (storage_l2cap_chan.chan.conn) {
+        LOG_WRN("Storage L2CAP channel already in use");
+        return -ENOMEM;
+    }
+    memset(&storage_l2cap_chan, 0, sizeof(storage_l2cap_chan));
+    storage_l2cap_chan.chan.ops = &storage_l2cap_ops;
+    *chan = &storage_l2cap_chan.chan;
+    return 0;
+}
+
+static struct bt_l2cap_server storage_l2cap_server = {
+    .psm = STORAGE_L2CAP_PSM,
+    .sec_level = BT_SECURITY_L1,
+    .accept = storage_l2cap_accept,
+};
+
+static void write_to_l2cap(void)
+{
+    // Live audio goes first, as on GATT
+    if (transport_audio_pending()) {
+        k_msleep(1);
+        return;
+    }
+
+    struct net_buf *buf = net_buf_alloc(&storage_l2cap_pool, K_MSEC(100));
+    if (!buf) {
+        return;
+    }
+    net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+    struct sync_frame_header *header = sync_framing ? net_buf_add(buf, sizeof(*header)) : NULL;
+
+    // An SDU may take the end of one read-ahead chunk and the start of the next
+    uint32_t sdu_size = MIN(STORAGE_L2CAP_SDU_SIZE, storage_l2cap_chan.tx.mtu);
+    uint32_t start_offset = offset;
+    uint32_t start_remaining = remaining_length;
+    uint32_t crc = 0;
+    while (buf->len < sdu_size && remaining_length > 0) {
+        const uint8_t *data;
+        int r = read_ahead_get(offset, MIN(remaining_length, sdu_size - buf->len), &data);
+        if (r < 0) {
+            LOG_ERR("Failed to read audio data: %d", r);
+            net_buf_unref(buf);
+            remaining_length = 0; // Stop transfer on error
+            return;
+        }
+        net_buf_add_mem(buf, data, r);
+        crc = crc32_ieee_update(crc, data, r);
+        offset += r;
+        remaining_length -= r;
+    }
+    if (header) {
+        sync_frame_header_fill(header, start_offset, offset - start_offset, crc);
+    }
+
+    int err = bt_l2cap_chan_send(&storage_l2cap_chan.chan, buf);
+    if (err < 0) {
+        // Not sent, so read the same data again next time
+        LOG_ERR("Storage L2CAP send failed: %d", err);
+        net_buf_unref(buf);
+        offset = start_offset;
+        remaining_length = start_remaining;
+        if (header) {
+            sync_seq--;
+        }
+        k_msleep(10);
+    }
+}
+#endif
+
+static void write_to_gatt(struct bt_conn *conn)
+{
+    // Don't read (and skip over) SD data the client would never receive; wait for it to subscribe
+    if (!subscription_is_notifying(&storage_subscription)) {
+        k_msleep(10);
+        return;
+    }
+
+    // Live audio goes first, the backlog only gets the airtime the pusher leaves over
+    if (transport_audio_pending()) {
+        k_msleep(1);
+        return;
+    }
+    if (k_sem_take(&storage_notify_credits, K_MSEC(100)) != 0) {
+        return;
+    }
+
+    // Whole blocks as before when they fit, smaller pieces of the same stream on a shorter MTU
+    size_t header_size = sync_frame_header_size();
+    uint32_t max_packet = MIN(SD_BLE_SIZE, bt_gatt_get_mtu(conn) - 3 - header_size);
+    static uint8_t frame[sizeof(struct sync_frame_header) + SD_BLE_SIZE];
+
+    // Fill every free credit; the completion callback hands them back as packets leave
+    do {
+        const uint8_t *data;
+        int r = read_ahead_get(offset, MIN(remaining_length, max_packet), &data);
+        if (r < 0) {
+            LOG_ERR("Failed to read audio data: %d", r);
+            k_sem_give(&storage_notify_credits);
+            remaining_length = 0; // Stop transfer on error
+            return;
+        }
+        uint32_t packet_size = r;
+
+        if (header_size) {
+            // The stack copies the notification, so one staging buffer is enough
+            sync_frame_header_fill((struct sync_frame_header *) frame, offset, packet_size,
+                                   crc32_ieee(data, packet_size));
+            memcpy(frame + header_size, data, packet_size);
+            data = frame;
+        }
+
+        struct bt_gatt_notify_params params = {
+            .attr = &storage_service.attrs[1],
+            .data = data,
+            .len = header_size + packet_size,
+            .func = storage_notify_sent,
+        };
+        int err = bt_gatt_notify_cb(conn, &params);
+        if (err) {
+            // Not sent, so read the same chunk again next time
+            k_sem_give(&storage_notify_credits);
+            if (header_size) {
+                sync_seq--;
+            }
+            LOG_HOT("Sync notify failed: %d", err);
+            return;
+        }
+        offset = offset + packet_size;
+        remaining_length = remaining_length - packet_size;
+    } while (remaining_length > 0 && !transport_audio_pending() &&
+             k_sem_take(&storage_notify_credits, K_NO_WAIT) == 0);
+}
+
+// Start draining on our own once the app has opted in and a backlog is waiting
+static void check_auto_sync(struct bt_conn *conn)
+{
+    if (!auto_sync_enabled || remaining_length > 0 || transport_started || stop_started || !conn ||
+        !subscription_is_notifying(&storage_subscription)) {
+        return;
+    }
+    if (k_uptime_get() - auto_sync_checked_at < STORAGE_AUTO_SYNC_CHECK_MS) {
+        return;
+    }
+    auto_sync_checked_at = k_uptime_get();
+
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+    if (get_file_size() <= offset) {
+        backlog_seen_at = 0;
+        return;
+    }
+    if (!backlog_seen_at) {
+        backlog_seen_at = k_uptime_get();
+    }
+    if (sync_plan_get() != SYNC_PLAN_BLE) {
+        return;
+    }
+    backlog_seen_at = 0;
+#endif
+    if (get_file_size() > offset) {
+        LOG_INF("auto sync from offset %u", offset);
+        offset = offset - (offset % SD_BLE_SIZE);
+        transport_started = 1;
     }
 }
 
 #ifdef CONFIG_OMI_ENABLE_WIFI
 static void write_to_tcp()
 {
-    
-    uint32_t to_read = MIN(remaining_length, SD_BLE_SIZE * 10);
-    int ret = read_audio_data(storage_write_buffer, to_read, offset);
-    if (ret > 0) {
-        offset += to_read;
-        remaining_length -= to_read;
-        size_t sent = 0;
-        while ((sent < to_read) && is_wifi_on()) {
-            int n = wifi_send_data(storage_write_buffer + sent, to_read - sent);
-            if (n <= 0) {
-                // wait and retry
-                k_msleep(10);
-            } else {
-                sent += n;
-                k_yield();
-            }
+    // The SD worker reads the next chunk while this one is being sent
+    const uint8_t *data;
+    int ret = read_ahead_get(offset, MIN(remaining_length, READ_AHEAD_SIZE), &data);
+    if (ret <= 0) {
+        LOG_ERR("Failed to read audio data: %d", ret);
+        remaining_length = 0; // Stop transfer on error
+        return;
+    }
+
+    int sent = 0;
+    size_t progress = 0;
+    if (sync_framing) {
+        struct sync_frame_header header;
+        sync_frame_header_fill(&header, offset, ret, crc32_ieee(data, ret));
+        sent = wifi_send_all((const uint8_t *) &header, sizeof(header));
+    }
+    if (sent >= 0) {
+        sent = wifi_send_all_progress(data, ret, &progress);
+    }
+    if (sent < 0) {
+        if (sync_framing) {
+            // The peer drops a cut frame, the whole chunk goes out again under the same sequence number
+            sync_seq--;
+        } else {
+            // The raw stream is appended as it arrives, resume after the bytes that made it
+            offset += progress;
+            remaining_length -= progress;
         }
-    } else {
+        LOG_ERR("Failed to send audio data: %d", sent);
+        k_msleep(10);
+        return;
+    }
+    offset += ret;
+    remaining_length -= ret;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+// Always framed, so the host can check each chunk and RESUME_COMMAND after the last good one
+static void write_to_usb(void)
+{
+    const uint8_t *data;
+    int ret = read_ahead_get(offset, MIN(remaining_length, READ_AHEAD_SIZE), &data);
+    if (ret <= 0) {
         LOG_ERR("Failed to read audio data: %d", ret);
         remaining_length = 0; // Stop transfer on error
+        return;
     }
+
+    struct sync_frame_header header;
+    sync_frame_header_fill(&header, offset, ret, crc32_ieee(data, ret));
+    int err = usb_send(USB_SYNC_MSG_DATA, &header, sizeof(header), data, ret);
+    if (err) {
+        // The host closed the port or stopped reading, it resumes at this chunk's offset and sequence
+        sync_seq--;
+        LOG_ERR("Failed to send audio data over USB: %d", err);
+        storage_stop_transfer();
+        return;
+    }
+    offset += ret;
+    remaining_length -= ret;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_WIFI_BENCHMARK
+// Notified on the Wi-Fi characteristic after a WIFI_BENCH run; its size tells it from a result byte
+struct wifi_bench_results {
+    uint8_t cmd; // 0x05
+    uint8_t source;
+    int8_t error; // 0, or the negative errno that ended the run early
+    uint32_t duration_ms;
+    uint32_t bytes_sent;
+    uint32_t throughput_bps; // bytes/s
+    uint32_t sd_wait_us;     // waiting for the read-ahead, i.e. reads the sends didn't hide
+    uint32_t send_us;        // in wifi_send_all()
+    uint32_t eagain;         // from struct wifi_send_stats
+    uint32_t polls;
+    uint32_t poll_ms;
+    uint8_t recording;       // 1 if the mic captured through the whole run, as in a sync during a meeting
+    uint32_t recorded_bytes; // stored audio added during the run
+    uint32_t audio_drops;    // audio frames dropped during the run, 0 without CONFIG_OMI_ENABLE_MONITOR
+    uint32_t target_bps;     // SYNC_PLAN_WIFI_BPS
+    uint32_t sd_read_ms;     // card busy with reads during the run, 0 without CONFIG_OMI_ENABLE_MONITOR
+    uint32_t sd_write_ms;    // card busy with writes, capture's share of the card while the sync reads
+    uint8_t meets_target;    // 1 if recording went on throughout, nothing dropped and the target was met
+} __packed;
+
+static uint32_t cycles_to_us(uint32_t since)
+{
+    return k_cyc_to_us_floor32(k_cycle_get_32() - since);
 }
+
+struct wifi_bench_counters {
+    uint32_t drops;
+    uint32_t sd_read_ms;
+    uint32_t sd_write_ms;
+};
+
+static void wifi_bench_counters(struct wifi_bench_counters *counters)
+{
+    memset(counters, 0, sizeof(*counters));
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    struct monitor_snapshot snapshot;
+    monitor_get_snapshot(&snapshot);
+    for (int i = 0; i < MONITOR_DROP_COUNT; i++) {
+        counters->drops += snapshot.drops[i];
+    }
+    counters->sd_read_ms = snapshot.sd_busy_ms[MONITOR_SD_READ];
+    counters->sd_write_ms = snapshot.sd_busy_ms[MONITOR_SD_WRITE];
 #endif
+}
 
+// Reads the stored audio from the start in read-ahead chunks, wrapping around, the way a sync does
+static int wifi_bench_run(struct wifi_bench_results *res, uint8_t *arena)
+{
+    uint32_t file_size = get_file_size();
+    if (wifi_bench_source == WIFI_BENCH_SOURCE_SD && file_size == 0) {
+        return -ENODATA;
+    }
+    for (uint32_t i = 0; i < READ_AHEAD_SIZE; i++) {
+        arena[i] = (uint8_t) i;
+    }
+
+    int cur = 0;
+    if (wifi_bench_source == WIFI_BENCH_SOURCE_SD) {
+        read_ahead_start(&read_ahead[0], 0, file_size);
+    }
+
+    int64_t started_at = k_uptime_get();
+    while (k_uptime_get() - started_at < wifi_bench_duration_s * 1000) {
+        const uint8_t *data = arena;
+        uint32_t length = READ_AHEAD_SIZE;
+        if (wifi_bench_source == WIFI_BENCH_SOURCE_SD) {
+            struct read_ahead_chunk *chunk = &read_ahead[cur];
+            uint32_t waited_at = k_cycle_get_32();
+            int err = read_ahead_wait(chunk);
+            res->sd_wait_us += cycles_to_us(waited_at);
+            if (err) {
+                return err;
+            }
+            data = chunk->data;
+            length = chunk->length;
+            uint32_t next = chunk->offset + length < file_size ? chunk->offset + length : 0;
+            cur = 1 - cur;
+            read_ahead_start(&read_ahead[cur], next, file_size - next);
+        }
+
+        uint32_t sent_at = k_cycle_get_32();
+        int sent = wifi_send_all(data, length);
+        res->send_us += cycles_to_us(sent_at);
+        if (sent < 0) {
+            return sent;
+        }
+        res->bytes_sent += sent;
+        res->duration_ms = k_uptime_get() - started_at;
+    }
+    return 0;
+}
+
+static void wifi_bench(struct bt_conn *conn)
+{
+    struct wifi_bench_results res = {.cmd = 0x05, .source = wifi_bench_source, .target_bps = SYNC_PLAN_WIFI_BPS};
+
+    // The arena is free whenever no sync is running, short of a speaker clip
+    uint8_t *arena = sync_scratch == SCRATCH_FREE ? scratch_acquire(SCRATCH_WIFI_SYNC) : NULL;
+    if (!arena) {
+        res.error = -EBUSY;
+    } else {
+        read_ahead[0].data = arena;
+        read_ahead[1].data = arena + READ_AHEAD_SIZE;
+        wifi_send_stats_reset();
+        LOG_INF("Wi-Fi benchmark: %s for %u s", res.source == WIFI_BENCH_SOURCE_SD ? "SD" : "pattern",
+                wifi_bench_duration_s);
+
+        // Recording goes on under a sync, so the run measures the sends against capture's SD writes
+        bool recording = mic_is_running();
+        uint32_t stored_before = get_file_size();
+        struct wifi_bench_counters before, after;
+        wifi_bench_counters(&before);
+
+        res.error = wifi_bench_run(&res, arena);
+
+        uint32_t stored_after = get_file_size();
+        res.recording = recording && mic_is_running();
+        res.recorded_bytes = stored_after > stored_before ? stored_after - stored_before : 0;
+        wifi_bench_counters(&after);
+        res.audio_drops = after.drops - before.drops;
+        res.sd_read_ms = after.sd_read_ms - before.sd_read_ms;
+        res.sd_write_ms = after.sd_write_ms - before.sd_write_ms;
+
+        // A run that ended on a read timeout may leave reads in the SD worker, wait them out first
+        read_ahead_reset();
+        read_ahead[0].data = NULL;
+        read_ahead[1].data = NULL;
+        scratch_release(SCRATCH_WIFI_SYNC);
+
+        struct wifi_send_stats stats;
+        wifi_send_stats_get(&stats);
+        res.eagain = stats.eagain;
+        res.polls = stats.polls;
+        res.poll_ms = stats.poll_ms;
+        res.throughput_bps = res.duration_ms ? (uint64_t) res.bytes_sent * 1000 / res.duration_ms : 0;
+        // Only the SD source under recording is what a sync in a meeting gets
+        res.meets_target = res.error == 0 && res.source == WIFI_BENCH_SOURCE_SD && res.recording &&
+                           res.recorded_bytes > 0 && res.audio_drops == 0 && res.throughput_bps >= res.target_bps;
+    }
+
+    LOG_INF("Wi-Fi benchmark: %u bytes in %u ms (%u B/s), SD wait %u us, send %u us, eagain %u, polls %u (%u ms), "
+            "err %d",
+            res.bytes_sent, res.duration_ms, res.throughput_bps, res.sd_wait_us, res.send_us, res.eagain,
+            res.polls, res.poll_ms, res.error);
+    LOG_INF("Wi-Fi benchmark: %s, %u bytes recorded, %u audio drops, SD busy read %u ms write %u ms",
+            res.recording ? "recording" : "not recording", res.recorded_bytes, res.audio_drops, res.sd_read_ms,
+            res.sd_write_ms);
+    LOG_INF("Wi-Fi benchmark: %s the %u B/s sync target while recording", res.meets_target ? "meets" : "misses",
+            res.target_bps);
+    if (conn) {
+        transport_notify(conn, &storage_service.attrs[8], &res, sizeof(res));
+    }
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+static void wifi_firmware(struct bt_conn *conn)
+{
+    struct sd_dfu_result res = {.cmd = 0x07};
+    res.error = sd_dfu_download(wifi_firmware_size, wifi_firmware_crc, &res);
+    if (conn) {
+        transport_notify(conn, &storage_service.attrs[8], &res, sizeof(res));
+    }
+    if (res.error == 0) {
+        LOG_INF("Firmware staged on the SD card, rebooting into MCUboot");
+        k_sleep(K_MSEC(SD_DFU_REBOOT_DELAY_MS));
+        sys_reboot(SYS_REBOOT_WARM);
+    }
+}
+#endif
+
+static void handle_storage_cmd(struct bt_conn *conn, struct storage_cmd *cmd)
+{
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+    reply_usb = cmd->from_usb;
+#endif
+    uint8_t result = parse_storage_command(cmd->data, cmd->len);
+    LOG_HOT("Storage command result %d", result);
+    storage_reply(conn, result);
+}
 
 void storage_stop_transfer()
 {
@@ -395,78 +1437,144 @@ void storage_stop_transfer()
 
 void storage_write(void)
 {
-    static uint8_t tmp_buffer[SD_BLE_SIZE]; // 440 bytes temporary buffer
-
     uint32_t total_sent = 0;
     uint32_t consecutive_errors = 0;
 
     while (1) {
         struct bt_conn *conn = get_current_connection();
 
+        // Completions owed by a dropped link never arrive
+        if (!conn) {
+            reset_storage_notify_credits();
+        }
+
+        struct storage_cmd cmd;
+        while (k_msgq_get(&storage_cmd_q, &cmd, K_NO_WAIT) == 0) {
+            handle_storage_cmd(conn, &cmd);
+        }
+        sync_scratch_put();
+        if (storage_sync_active() != sync_powered) {
+            sync_powered = !sync_powered;
+            if (sync_powered) {
+                power_request(POWER_ACTIVITY_SYNC);
+            } else {
+                power_release(POWER_ACTIVITY_SYNC);
+            }
+        }
+#ifdef CONFIG_OMI_ENABLE_WIFI_BENCHMARK
+        if (atomic_get(&wifi_bench_requested)) {
+            wifi_bench(conn);
+            atomic_clear(&wifi_bench_requested);
+        }
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+        if (atomic_get(&wifi_firmware_requested)) {
+            wifi_firmware(conn);
+            atomic_clear(&wifi_firmware_requested);
+        }
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+        check_evictions();
+#endif
+        check_auto_sync(conn);
+        if (time_range_started) {
+            start_range_sync();
+        }
         if (transport_started) {
-            LOG_INF("transport started in side : %d", transport_started);
             setup_storage_tx();
         }
         // probably prefer to implement using work orders for delete,nuke,etc...
         if (delete_started) {
-            LOG_INF("delete:%d\n", delete_started);
-            int err = clear_audio_directory();
-
-            if (err) {
+            LOG_INF("delete all audio");
+            read_ahead_reset();
+            if (clear_audio_directory()) {
                 LOG_PRINTK("error clearing\n");
             } else {
                 offset = 0;
-                uint8_t result_buffer[1] = {200};
-                if (conn) {
-                    bt_gatt_notify(get_current_connection(), &storage_service.attrs[1], &result_buffer, 1);
-                }
+                range_sync = false;
+                storage_reply(conn, 200);
             }
             delete_started = 0;
             k_msleep(10);
         }
+        if (delete_segment_started) {
+            LOG_INF("delete segment:%d\n", delete_num);
+            read_ahead_reset();
+            int removed = delete_audio_segment(delete_num);
+
+            if (removed < 0) {
+                LOG_PRINTK("error deleting segment\n");
+            } else {
+                stream_moved_back(removed);
+                storage_reply(conn, 200);
+            }
+            delete_segment_started = 0;
+            k_msleep(10);
+        }
         if (nuke_started) {
+            read_ahead_reset();
             clear_audio_directory();
             offset = 0;
+            range_sync = false;
             nuke_started = 0;
         }
         if (stop_started) {
             remaining_length = 0;
+            transport_started = 0;
             stop_started = 0;
+            end_range_sync();
             save_offset(offset);
         }
-        if (heartbeat_count == MAX_HEARTBEAT_FRAMES) {
-            LOG_INF("no heartbeat sent\n");
-            save_offset(offset);
+        if (heartbeat_count >= heartbeat_frames) {
+            LOG_HOT("Sync heartbeat, saving the offset");
+            save_sync_offset();
             // ensure heartbeat count resets
             heartbeat_count = 0;
         }
 
         if (remaining_length > 0) {
             if (conn == NULL
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+                && !reply_usb
+#endif
 #ifdef CONFIG_OMI_ENABLE_WIFI
-                && !is_wifi_on()
+                && !wifi_sync_ready()
 #endif
             ) {
                 LOG_ERR("invalid connection");
                 remaining_length = 0;
+                end_range_sync();
                 save_offset(offset);
                 // save offset to flash
                 continue;
                 // k_yield();
             }
 
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+            if (reply_usb) {
+                write_to_usb();
+                heartbeat_count++;
+            } else
+#endif
 #ifdef CONFIG_OMI_ENABLE_WIFI
             // Send data over TCP if WiFi is ready, otherwise over GATT
-            if (is_wifi_on()) {
+            if (wifi_sync_ready()) {
                 if (is_wifi_transport_ready()) {
                     write_to_tcp();
-                    heartbeat_count = (heartbeat_count + 1) % (MAX_HEARTBEAT_FRAMES + 1);
+                    heartbeat_count++;
                 }
             } else
+#endif
+#ifdef CONFIG_OMI_ENABLE_STORAGE_L2CAP
+            if (atomic_get(&storage_l2cap_connected)) {
+                write_to_l2cap();
+                heartbeat_count++;
+            } else
 #endif
             {
                 write_to_gatt(conn);
-                heartbeat_count = (heartbeat_count + 1) % (MAX_HEARTBEAT_FRAMES + 1);
+                heartbeat_count++;
             }
 
             transport_started = 0;
@@ -474,19 +1582,26 @@ void storage_write(void)
                 if (stop_started) {
                     stop_started = 0;
                 } else {
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+                    sync_meter_finish();
+#endif
+                    end_range_sync();
                     save_offset(offset);
                     LOG_PRINTK("done. attempting to download more files\n");
-                    uint8_t stop_result[1] = {100};
-
-                    int err = bt_gatt_notify(get_current_connection(), &storage_service.attrs[1], &stop_result, 1);
+                    storage_reply(get_current_connection(), 100);
                     k_msleep(10);
                 }
             }
         }
 
-        // Sleep when there's no work
-        if (remaining_length == 0 && !delete_started && !nuke_started && !stop_started) {
-            k_msleep(10);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_progress(MONITOR_WORKER_STORAGE, MONITOR_STEP_SYNC_PASS);
+#endif
+        // Sleep when there's no work, but wake up for the next command right away
+        if (remaining_length == 0 && !delete_started && !delete_segment_started && !nuke_started && !stop_started) {
+            if (k_msgq_get(&storage_cmd_q, &cmd, K_MSEC(10)) == 0) {
+                handle_storage_cmd(conn, &cmd);
+            }
         } else {
             k_yield();
         }
@@ -495,8 +1610,14 @@ void storage_write(void)
 
 int storage_init()
 {
+#ifdef CONFIG_OMI_ENABLE_TUNING
+    tune_register("heartbeat_frames", &heartbeat_frames, 1, 1000, "sync packets between saved offsets");
+#endif
 #ifdef CONFIG_OMI_ENABLE_WIFI
     k_work_init(&wifi_start_work, wifi_start_work_handler);
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+    k_work_init(&wifi_live_start_work, wifi_live_start_work_handler);
+#endif
 #endif
     k_thread_create(&storage_thread,
                     storage_stack,
@@ -505,8 +1626,18 @@ int storage_init()
                     NULL,
                     NULL,
                     NULL,
-                    K_PRIO_PREEMPT(7),
+                    K_PRIO_PREEMPT(THREAD_PRIO_STORAGE),
                     0,
                     K_NO_WAIT);
+    k_thread_name_set(&storage_thread, "storage");
+#ifdef CONFIG_OMI_ENABLE_STORAGE_L2CAP
+    int err = bt_l2cap_server_register(&storage_l2cap_server);
+    if (err) {
+        LOG_ERR("Failed to register storage L2CAP server: %d", err);
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+    usb_sync_set_cmd_handler(usb_sync_cmd);
+#endif
     return 0;
 }
@@ -21,6 +21,23 @@ int storage_init();
  */
 void storage_stop_transfer();
 
+/**
+ * @brief Check whether an offline sync to the app is in progress
+ *
+ * @return true while stored audio is still being transferred
+ */
+bool storage_sync_active(void);
+
+#ifdef CONFIG_OMI_ENABLE_SYNC_PLANNER
+// What the planner recommends for the backlog, read from the storage read characteristic
+enum sync_plan {
+    SYNC_PLAN_NONE = 0, // nothing to sync
+    SYNC_PLAN_WAIT = 1, // too small to be worth a sync yet
+    SYNC_PLAN_BLE = 2,  // cheapest over BLE
+    SYNC_PLAN_WIFI = 3, // cheaper to bring Wi-Fi up for (WIFI_START)
+};
+#endif
+
 #endif // CONFIG_OMI_ENABLE_OFFLINE_STORAGE
 
 #endif // STORAGE_H
@@ -0,0 +1,29 @@
+#include "storage_record.h"
+
+#include <zephyr/sys/util.h>
+
+#include "config.h"
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "monitor.h"
+#endif
+
+// The tags of sd_card.h are the shared ones
+BUILD_ASSERT(STORAGE_RECORD_IMU_VARINT == PIPE_RECORD_TAG_MIN, "storage tags must match the shared record format");
+
+const struct pipe_record_format storage_record_format = {
+    .block_size = MAX_WRITE_SIZE,
+    .max_frame = CODEC_OUTPUT_MAX_BYTES + FRAME_TIMESTAMP_SIZE, // frames are stored as queued
+};
+
+bool storage_packer_append(struct pipe_record_packer *packer, const uint8_t *head, uint8_t head_len,
+                           const uint8_t *data, uint16_t size)
+{
+    if (!pipe_record_append(packer, head, head_len, data, size)) {
+        // The SD worker is behind on every block we have
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_SD_QUEUE_FULL, 1);
+#endif
+        return false;
+    }
+    return true;
+}
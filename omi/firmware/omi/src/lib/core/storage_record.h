@@ -0,0 +1,44 @@
+#ifndef STORAGE_RECORD_H
+#define STORAGE_RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pipe_record.h"
+#include "sd_card.h"
+
+/* The pendant's binding of the shared record format (lib/pipeline/pipe_record.h): MAX_WRITE_SIZE
+ * blocks in the format described in sd_card.h, audio records up to CODEC_OUTPUT_MAX_BYTES plus
+ * FRAME_TIMESTAMP_SIZE, as the frames are queued.
+ */
+extern const struct pipe_record_format storage_record_format;
+
+/**
+ * @brief Append one record, submitting the open block when it is full
+ *
+ * Same as pipe_record_append(), a record lost for want of a block is counted as an SD queue drop.
+ *
+ * @param packer Packer state, its format storage_record_format
+ * @param head The record's [length] or [tag][length]
+ * @param head_len 1 or 2
+ * @param data Payload
+ * @param size Payload length, the length in the head
+ * @return true if appended, false if no block could be allocated
+ */
+bool storage_packer_append(struct pipe_record_packer *packer, const uint8_t *head, uint8_t head_len,
+                           const uint8_t *data, uint16_t size);
+
+/**
+ * @brief Parse the record at pos of a full block
+ *
+ * @param block Block of MAX_WRITE_SIZE bytes
+ * @param pos Offset of the record, advanced past it
+ * @param record Filled with the record
+ * @return 1 for a record, 0 at the end of the block, -EINVAL if the block is malformed
+ */
+static inline int storage_record_next(const uint8_t *block, uint16_t *pos, struct pipe_record *record)
+{
+    return pipe_record_next(&storage_record_format, block, pos, record);
+}
+
+#endif // STORAGE_RECORD_H
@@ -0,0 +1,22 @@
+#include "subscription.h"
+
+#include <zephyr/bluetooth/gatt.h>
+
+static atomic_t connection_generation = ATOMIC_INIT(0);
+
+void subscription_update(struct subscription *sub, uint16_t ccc_value)
+{
+    atomic_set(&sub->value, ccc_value);
+    atomic_set(&sub->generation, atomic_get(&connection_generation));
+}
+
+bool subscription_is_notifying(struct subscription *sub)
+{
+    return (atomic_get(&sub->value) & BT_GATT_CCC_NOTIFY) &&
+           atomic_get(&sub->generation) == atomic_get(&connection_generation);
+}
+
+void subscription_connection_closed(void)
+{
+    atomic_inc(&connection_generation);
+}
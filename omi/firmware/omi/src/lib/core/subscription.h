@@ -0,0 +1,38 @@
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/sys/atomic.h>
+
+/**
+ * Cached CCC state of one notify characteristic.
+ *
+ * Updated from the characteristic's CCC changed handler, so hot paths can check it
+ * with two atomic loads instead of walking the CCC table with bt_gatt_is_subscribed().
+ * Every disconnect bumps a shared generation counter, which invalidates subscriptions
+ * made on the previous link even if no CCC callback reported the change.
+ */
+struct subscription {
+    atomic_t value;
+    atomic_t generation;
+};
+
+#define SUBSCRIPTION_INIT {ATOMIC_INIT(0), ATOMIC_INIT(-1)}
+
+/**
+ * @brief Record a CCC change, call from the CCC changed handler
+ */
+void subscription_update(struct subscription *sub, uint16_t ccc_value);
+
+/**
+ * @brief Check whether the peer on the current link has notifications enabled
+ */
+bool subscription_is_notifying(struct subscription *sub);
+
+/**
+ * @brief Invalidate all subscriptions, call when the connection goes away
+ */
+void subscription_connection_closed(void);
+
+#endif // SUBSCRIPTION_H
@@ -1,11 +1,17 @@
 #include "transport.h"
 
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+#include <bluetooth/radio_notification_cb.h>
+#endif
 #include <hal/nrf_power.h>
 #include <math.h> // For float conversion in logs
 #include <stdint.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/bluetooth/hci.h>
+#ifdef CONFIG_OMI_ENABLE_ISO_AUDIO
+#include <zephyr/bluetooth/iso.h>
+#endif
 #include <zephyr/bluetooth/l2cap.h>
 #include <zephyr/bluetooth/services/bas.h>
 #include <zephyr/bluetooth/uuid.h>
@@ -14,22 +20,57 @@
 #include <zephyr/dt-bindings/gpio/nordic-nrf-gpio.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#ifdef CONFIG_OMI_ENABLE_FAST_RECONNECT
+#include <zephyr/settings/settings.h>
+#endif
 #include <zephyr/sys/atomic.h>
-#include <zephyr/sys/ring_buffer.h>
+#include <zephyr/sys/byteorder.h>
 
 #include "accel.h"
+#include "benchmark.h"
 #include "button.h"
+#include "codec.h"
 #include "config.h"
+#include "delta_dfu.h"
 #include "features.h"
+#include "flight_rec.h"
+#include "frame_queue.h"
 #include "haptic.h"
+#include "housekeeping.h"
+#ifdef CONFIG_OMI_ENABLE_GOVERNOR
+#include "governor.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_KWS
+#include "kws.h"
+#endif
+#include "lib/battery/battery.h"
 #include "mic.h"
+#ifdef CONFIG_OMI_ENABLE_SMP_DFU
+#include "smp_dfu.h"
+#endif
 #ifdef CONFIG_OMI_ENABLE_MONITOR
 #include "monitor.h"
 #endif
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+#include "nfc.h"
+#endif
+#include "pipe_frame.h"
 #include "sd_card.h"
 #include "settings.h"
 #include "storage.h"
+#include "storage_record.h"
+#include "subscription.h"
+#include "tune.h"
 #include "rtc.h"
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+#include "usb.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+#include "warm_resume.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+#include "wifi.h"
+#endif
 LOG_MODULE_REGISTER(transport, CONFIG_LOG_DEFAULT_LEVEL);
 
 #ifdef CONFIG_OMI_ENABLE_RFSW_CTRL
@@ -45,10 +86,99 @@ static bool storage_full_warned = false;
 extern bool is_connected;
 static atomic_t pusher_stop_flag;
 
+// One credit per audio notification the controller may hold at once, per central. Every other
+// service notifies through transport_notify(), which draws on its own smaller pool, so a battery or
+// IMU update can never take the TX context the next audio packet needs.
+K_SEM_DEFINE(control_notify_credits, CONTROL_NOTIFY_CREDITS, CONTROL_NOTIFY_CREDITS);
+#ifdef CONFIG_BT_CONN_TX_MAX
+BUILD_ASSERT(AUDIO_NOTIFY_CREDITS + CONTROL_NOTIFY_CREDITS <= CONFIG_BT_CONN_TX_MAX,
+             "Audio and control credits exceed the connection TX contexts");
+#endif
+
+// Given whenever the pusher may have work: a queued frame, a new subscription or shutdown
+K_SEM_DEFINE(pusher_wake, 0, 1);
+
+// Audio transmit statistics, see transport_get_tx_stats()
+static atomic_t tx_queue_drops = ATOMIC_INIT(0);
+static atomic_t tx_notify_failures = ATOMIC_INIT(0);
+static atomic_t tx_frames_sent = ATOMIC_INIT(0);
+static atomic_t tx_frames_lost = ATOMIC_INIT(0);
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+// Pipeline benchmark, see transport_bench_sink(). Counted from the codec and pusher threads.
+#define PIPELINE_BENCH_MTU 247
+static atomic_t bench_sink = ATOMIC_INIT(0);
+static bool bench_pusher_active = false; // the pusher's view of bench_sink, switched between frames
+static atomic_t bench_frames;
+static atomic_t bench_packets;
+static atomic_t bench_copies;
+static atomic_t bench_copied_bytes;
+static atomic_t bench_queue_claims;
+static atomic_t bench_queue_drops;
+static atomic_t bench_storage_blocks;
+#define BENCH_COUNT(counter) atomic_inc(&(counter))
+#define BENCH_COPY(bytes)                                                                                              \
+    do {                                                                                                               \
+        atomic_inc(&bench_copies);                                                                                     \
+        atomic_add(&bench_copied_bytes, (bytes));                                                                      \
+    } while (0)
+#else
+#define BENCH_COUNT(counter)
+#define BENCH_COPY(bytes)
+#endif
+
 struct bt_conn *current_connection = NULL;
 uint16_t current_mtu = 0;
 uint16_t current_package_index = 0;
 
+// Connection setup runs per central, see conn_setup_start()
+enum conn_setup_step {
+    CONN_SETUP_PHY,      // 2M PHY requested
+    CONN_SETUP_DATA_LEN, // maximum data length requested
+    CONN_SETUP_DONE,
+};
+
+// Every connected central has a slot with its own audio subscription, MTU, notify credits and
+// connection setup. current_connection and current_mtu follow the first of them, which is the
+// link the other services and modules talk to.
+struct central {
+    struct bt_conn *conn; // NULL for a free slot
+    uint16_t mtu;
+    atomic_t audio_notifying;    // audio data CCC of this central has notifications on
+    struct k_sem notify_credits; // AUDIO_NOTIFY_CREDITS, returned by notification completions
+    struct bt_gatt_exchange_params exchange_params;
+    struct k_work_delayable setup_work;
+    enum conn_setup_step setup_step;
+    int64_t setup_started_at;
+    uint32_t modes;      // omi_mode_t negotiated through the capabilities characteristic
+    uint16_t max_notify; // notification payload limit the app asked for, 0 for none
+};
+
+void conn_setup_next(struct k_work *work_item);
+
+static struct central centrals[CONFIG_BT_MAX_CONN];
+static struct k_spinlock centrals_lock; // slot assignment, against the pusher taking references
+
+// The slot of conn, or a free slot for NULL
+static struct central *central_find(struct bt_conn *conn)
+{
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        if (centrals[i].conn == conn) {
+            return &centrals[i];
+        }
+    }
+    return NULL;
+}
+
+static int central_count(void)
+{
+    int count = 0;
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        count += centrals[i].conn != NULL;
+    }
+    return count;
+}
+
 static ssize_t audio_data_write_handler(struct bt_conn *conn,
                                         const struct bt_gatt_attr *attr,
                                         const void *buf,
@@ -58,6 +188,7 @@ static ssize_t audio_data_write_handler(struct bt_conn *conn,
 
 static struct bt_conn_cb _callback_references;
 static void audio_ccc_config_changed_handler(const struct bt_gatt_attr *attr, uint16_t value);
+static ssize_t audio_ccc_write_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, uint16_t value);
 static ssize_t audio_data_read_characteristic(struct bt_conn *conn,
                                               const struct bt_gatt_attr *attr,
                                               void *buf,
@@ -90,18 +221,47 @@ static ssize_t settings_mic_gain_read_handler(struct bt_conn *conn,
                                               void *buf,
                                               uint16_t len,
                                               uint16_t offset);
+static ssize_t settings_codec_profile_write_handler(struct bt_conn *conn,
+                                                   const struct bt_gatt_attr *attr,
+                                                   const void *buf,
+                                                   uint16_t len,
+                                                   uint16_t offset,
+                                                   uint8_t flags);
+static ssize_t settings_codec_profile_read_handler(struct bt_conn *conn,
+                                                  const struct bt_gatt_attr *attr,
+                                                  void *buf,
+                                                  uint16_t len,
+                                                  uint16_t offset);
+#ifdef CONFIG_OMI_ENABLE_KWS
+static ssize_t settings_wake_phrase_write_handler(struct bt_conn *conn,
+                                                  const struct bt_gatt_attr *attr,
+                                                  const void *buf,
+                                                  uint16_t len,
+                                                  uint16_t offset,
+                                                  uint8_t flags);
+static ssize_t settings_wake_phrase_read_handler(struct bt_conn *conn,
+                                                 const struct bt_gatt_attr *attr,
+                                                 void *buf,
+                                                 uint16_t len,
+                                                 uint16_t offset);
+#endif
 static ssize_t
 features_read_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t
+caps_read_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset);
+static ssize_t caps_write_handler(struct bt_conn *conn,
+                                  const struct bt_gatt_attr *attr,
+                                  const void *buf,
+                                  uint16_t len,
+                                  uint16_t offset,
+                                  uint8_t flags);
 
 // Forward declarations for update functions and callbacks
-static void update_phy(struct bt_conn *conn);
-static void update_data_length(struct bt_conn *conn);
-static void update_mtu(struct bt_conn *conn);
+static int update_phy(struct bt_conn *conn);
+static int update_data_length(struct bt_conn *conn);
+static void update_mtu(struct central *central);
 static void exchange_func(struct bt_conn *conn, uint8_t att_err, struct bt_gatt_exchange_params *params);
 
-// --- GATT Exchange MTU Params ---
-static struct bt_gatt_exchange_params exchange_params;
-
 //
 // Service and Characteristic
 //
@@ -120,6 +280,10 @@ static struct bt_uuid_128 audio_characteristic_format_uuid =
 static struct bt_uuid_128 audio_characteristic_speaker_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10003, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
 
+// Managed, so writes tell which central (un)subscribed while another one keeps the aggregate value
+static struct _bt_gatt_ccc audio_data_ccc =
+    BT_GATT_CCC_INITIALIZER(audio_ccc_config_changed_handler, audio_ccc_write_handler, NULL);
+
 static struct bt_gatt_attr audio_service_attr[] = {
     BT_GATT_PRIMARY_SERVICE(&audio_service_uuid),
     BT_GATT_CHARACTERISTIC(&audio_characteristic_data_uuid.uuid,
@@ -128,7 +292,7 @@ static struct bt_gatt_attr audio_service_attr[] = {
                            audio_data_read_characteristic,
                            NULL,
                            NULL),
-    BT_GATT_CCC(audio_ccc_config_changed_handler, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CCC_MANAGED(&audio_data_ccc, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
     BT_GATT_CHARACTERISTIC(&audio_characteristic_format_uuid.uuid,
                            BT_GATT_CHRC_READ,
                            BT_GATT_PERM_READ,
@@ -156,6 +320,12 @@ static struct bt_uuid_128 settings_dim_ratio_characteristic_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10011, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
 static struct bt_uuid_128 settings_mic_gain_characteristic_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10012, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+static struct bt_uuid_128 settings_codec_profile_characteristic_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10013, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+#ifdef CONFIG_OMI_ENABLE_KWS
+static struct bt_uuid_128 settings_wake_phrase_characteristic_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10014, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+#endif
 
 static struct bt_gatt_attr settings_service_attr[] = {
     BT_GATT_PRIMARY_SERVICE(&settings_service_uuid),
@@ -171,6 +341,20 @@ static struct bt_gatt_attr settings_service_attr[] = {
                            settings_mic_gain_read_handler,
                            settings_mic_gain_write_handler,
                            NULL),
+    BT_GATT_CHARACTERISTIC(&settings_codec_profile_characteristic_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+                           settings_codec_profile_read_handler,
+                           settings_codec_profile_write_handler,
+                           NULL),
+#ifdef CONFIG_OMI_ENABLE_KWS
+    BT_GATT_CHARACTERISTIC(&settings_wake_phrase_characteristic_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+                           settings_wake_phrase_read_handler,
+                           settings_wake_phrase_write_handler,
+                           NULL),
+#endif
 };
 
 static struct bt_gatt_service settings_service = BT_GATT_SERVICE(settings_service_attr);
@@ -180,6 +364,9 @@ static struct bt_uuid_128 features_service_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10020, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
 static struct bt_uuid_128 features_characteristic_uuid =
     BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10021, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
+// struct omi_caps to read, struct omi_caps_request to write
+static struct bt_uuid_128 features_caps_characteristic_uuid =
+    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x19B10022, 0xE8F2, 0x537E, 0x4F6C, 0xD104768A1214));
 
 static struct bt_gatt_attr features_service_attr[] = {
     BT_GATT_PRIMARY_SERVICE(&features_service_uuid),
@@ -189,6 +376,12 @@ static struct bt_gatt_attr features_service_attr[] = {
                            features_read_handler,
                            NULL,
                            NULL),
+    BT_GATT_CHARACTERISTIC(&features_caps_characteristic_uuid.uuid,
+                           BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                           BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+                           caps_read_handler,
+                           caps_write_handler,
+                           NULL),
 };
 
 static struct bt_gatt_service features_service = BT_GATT_SERVICE(features_service_attr);
@@ -277,10 +470,38 @@ static const struct bt_data bt_sd[] = {
 // State and Characteristics
 //
 
+// Re-read every central's audio CCC, for changes no write reported (CCCs restored for a bond)
+static void central_refresh_subscriptions(void)
+{
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        struct bt_conn *conn = centrals[i].conn;
+        if (conn) {
+            atomic_set(&centrals[i].audio_notifying,
+                       bt_gatt_is_subscribed(conn, &audio_service.attrs[1], BT_GATT_CCC_NOTIFY));
+        }
+    }
+}
+
+// Called before the CCC stores the value, with the central that wrote it
+static ssize_t audio_ccc_write_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, uint16_t value)
+{
+    struct central *central = central_find(conn);
+    if (central) {
+        atomic_set(&central->audio_notifying, (value & BT_GATT_CCC_NOTIFY) != 0);
+        k_sem_give(&pusher_wake);
+    }
+    return sizeof(value);
+}
+
 static void audio_ccc_config_changed_handler(const struct bt_gatt_attr *attr, uint16_t value)
 {
+    // The speaker characteristic shares this handler; only track the audio data CCC (attrs[3])
+    if (attr == &audio_service.attrs[3]) {
+        central_refresh_subscriptions();
+    }
     if (value == BT_GATT_CCC_NOTIFY) {
         LOG_INF("Client subscribed for notifications");
+        k_sem_give(&pusher_wake);
     } else if (value == 0) {
         LOG_INF("Client unsubscribed from notifications");
     } else {
@@ -319,7 +540,7 @@ static ssize_t audio_data_write_handler(struct bt_conn *conn,
     uint16_t amount = 400;
     int16_t *int16_buf = (int16_t *) buf;
     uint8_t *data = (uint8_t *) buf;
-    bt_gatt_notify(conn, attr, &amount, sizeof(amount));
+    transport_notify(conn, attr, &amount, sizeof(amount));
     amount = speak(len, buf);
     return len;
 }
@@ -401,14 +622,88 @@ static ssize_t settings_mic_gain_read_handler(struct bt_conn *conn,
     return bt_gatt_attr_read(conn, attr, buf, len, offset, &current_gain, sizeof(current_gain));
 }
 
-static ssize_t
-features_read_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+static ssize_t settings_codec_profile_write_handler(struct bt_conn *conn,
+                                                   const struct bt_gatt_attr *attr,
+                                                   const void *buf,
+                                                   uint16_t len,
+                                                   uint16_t offset,
+                                                   uint8_t flags)
+{
+    if (len != 1) {
+        LOG_WRN("Invalid length for codec profile write: %u", len);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    uint8_t new_profile = ((uint8_t *) buf)[0];
+    if (codec_set_profile(new_profile)) {
+        LOG_WRN("Unknown codec profile: %u", new_profile);
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    LOG_INF("Received new codec profile: %u", new_profile);
+    int err = app_settings_save_codec_profile(new_profile);
+    if (err) {
+        LOG_ERR("Failed to save codec profile setting: %d", err);
+    }
+
+    return len;
+}
+
+static ssize_t settings_codec_profile_read_handler(struct bt_conn *conn,
+                                                  const struct bt_gatt_attr *attr,
+                                                  void *buf,
+                                                  uint16_t len,
+                                                  uint16_t offset)
+{
+    uint8_t current_profile = codec_get_profile();
+    LOG_INF("Reading codec profile: %u", current_profile);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &current_profile, sizeof(current_profile));
+}
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+// Write 1 to enroll the next utterance as the wake phrase, 0 to forget it; read a KWS_STATE_* value
+static ssize_t settings_wake_phrase_write_handler(struct bt_conn *conn,
+                                                  const struct bt_gatt_attr *attr,
+                                                  const void *buf,
+                                                  uint16_t len,
+                                                  uint16_t offset,
+                                                  uint8_t flags)
+{
+    if (len != 1) {
+        LOG_WRN("Invalid length for wake phrase write: %u", len);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    uint8_t enroll = ((uint8_t *) buf)[0];
+    if (enroll > 1) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+    LOG_INF("Wake phrase %s", enroll ? "enrollment" : "removal");
+    kws_enroll(enroll);
+    return len;
+}
+
+static ssize_t settings_wake_phrase_read_handler(struct bt_conn *conn,
+                                                 const struct bt_gatt_attr *attr,
+                                                 void *buf,
+                                                 uint16_t len,
+                                                 uint16_t offset)
+{
+    uint8_t state = kws_get_state();
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &state, sizeof(state));
+}
+#endif
+
+static uint32_t omi_features(void)
 {
     uint32_t features = 0;
 
 #ifdef CONFIG_OMI_ENABLE_SPEAKER
     features |= OMI_FEATURE_SPEAKER;
 #endif
+#ifdef CONFIG_OMI_ENABLE_SPEAKER_OPUS
+    features |= OMI_FEATURE_SPEAKER_OPUS;
+#endif
 #ifdef CONFIG_OMI_ENABLE_ACCELEROMETER
     features |= OMI_FEATURE_ACCELEROMETER;
 #endif
@@ -426,18 +721,163 @@ features_read_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, voi
 #endif
 #ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
     features |= OMI_FEATURE_OFFLINE_STORAGE;
+    features |= OMI_FEATURE_STORAGE_TIME_RANGE;
+#endif
+#ifdef CONFIG_OMI_ENABLE_STORAGE_L2CAP
+    features |= OMI_FEATURE_STORAGE_L2CAP;
 #endif
 #ifdef CONFIG_OMI_ENABLE_WIFI
     features |= OMI_FEATURE_WIFI;
+#endif
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+    features |= OMI_FEATURE_WIFI_LIVE_AUDIO;
+#endif
+#ifdef CONFIG_OMI_ENABLE_DELTA_DFU
+    features |= OMI_FEATURE_DELTA_DFU;
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+    features |= OMI_FEATURE_SD_DFU;
+#endif
+#ifdef CONFIG_OMI_ENABLE_SMP_DFU
+    features |= OMI_FEATURE_SMP_DFU;
+#endif
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+    features |= OMI_FEATURE_USB_SYNC;
+#endif
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+    features |= OMI_FEATURE_NFC_PAIRING;
+#endif
+#ifdef CONFIG_OMI_ENABLE_ISO_AUDIO
+    features |= OMI_FEATURE_ISO_AUDIO;
+#endif
+#ifdef CONFIG_OMI_ENABLE_KWS
+    features |= OMI_FEATURE_KWS;
+#endif
+#ifdef CONFIG_OMI_ENABLE_PLAYBACK_GATE
+    features |= OMI_FEATURE_PLAYBACK_GATE;
+#endif
+#if CODEC_OPUS && CODEC_OFFLINE_FRAME_MS > 20
+    // Stored audio, and pre-roll sent after a reconnect, may hold 40 or 60ms per Opus packet
+    features |= OMI_FEATURE_LONG_OFFLINE_FRAMES;
 #endif
     // LED dimming is always enabled now with PWM.
     features |= OMI_FEATURE_LED_DIMMING;
     // Mic gain control is always enabled.
     features |= OMI_FEATURE_MIC_GAIN;
+    // Codec profiles are always selectable.
+    features |= OMI_FEATURE_CODEC_PROFILES;
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+    features |= OMI_FEATURE_AUDIO_PACKING;
+#endif
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+    features |= OMI_FEATURE_FRAME_TIMESTAMPS;
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    features |= OMI_FEATURE_METRICS;
+#endif
+    return features;
+}
 
+static ssize_t
+features_read_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    uint32_t features = omi_features();
     return bt_gatt_attr_read(conn, attr, buf, len, offset, &features, sizeof(features));
 }
 
+#define ATT_NOTIFY_HEADER_SIZE 3
+
+static uint32_t omi_modes_supported(void)
+{
+    uint32_t modes = 0;
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+    modes |= OMI_MODE_AUDIO_PACKING;
+#endif
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+    modes |= OMI_MODE_FRAME_TIMESTAMPS;
+#endif
+#ifdef CONFIG_OMI_ENABLE_ACCEL_FIFO
+    modes |= OMI_MODE_IMU_DELTA;
+#endif
+    return modes;
+}
+
+uint32_t transport_get_modes(struct bt_conn *conn)
+{
+    struct central *central = conn ? central_find(conn) : NULL;
+    return central ? central->modes : 0;
+}
+
+static ssize_t
+caps_read_handler(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    struct central *central = central_find(conn);
+    uint16_t max_notify = bt_gatt_get_mtu(conn) - ATT_NOTIFY_HEADER_SIZE;
+    if (central && central->max_notify) {
+        max_notify = MIN(max_notify, central->max_notify);
+    }
+    struct omi_caps caps = {
+        .version = OMI_CAPS_VERSION,
+        .codec_id = CODEC_ID,
+        .storage_format = STORAGE_FORMAT_VERSION,
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+        .pack_max_frames = AUDIO_PACK_MAX_FRAMES,
+#endif
+        .max_notify = sys_cpu_to_le16(max_notify),
+        .features = sys_cpu_to_le32(omi_features()),
+        .modes = sys_cpu_to_le32(omi_modes_supported()),
+        .enabled = sys_cpu_to_le32(central ? central->modes : 0),
+    };
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &caps, sizeof(caps));
+}
+
+static ssize_t caps_write_handler(struct bt_conn *conn,
+                                  const struct bt_gatt_attr *attr,
+                                  const void *buf,
+                                  uint16_t len,
+                                  uint16_t offset,
+                                  uint8_t flags)
+{
+    if (offset != 0 || len < sizeof(struct omi_caps_request)) {
+        LOG_WRN("Invalid length for capabilities write: %u", len);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+    struct omi_caps_request request;
+    memcpy(&request, buf, sizeof(request));
+    if (request.version == 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+    struct central *central = central_find(conn);
+    if (!central) {
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
+    uint16_t max_notify = sys_le16_to_cpu(request.max_notify);
+    if (max_notify && max_notify + ATT_NOTIFY_HEADER_SIZE < MINIMAL_PACKET_SIZE) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+    central->modes = sys_le32_to_cpu(request.modes) & omi_modes_supported();
+    central->max_notify = max_notify;
+    LOG_INF("Negotiated stream modes 0x%x, notify limit %u (app version %u)",
+            central->modes, max_notify, request.version);
+    return len;
+}
+
+// Note: bt_gatt_get_mtu includes the ATT header (3 bytes), the full MTU size is stored
+static void central_update_mtu(struct bt_conn *conn)
+{
+    struct central *central = central_find(conn);
+    if (!central) {
+        return;
+    }
+    central->mtu = bt_gatt_get_mtu(conn);
+    if (conn == current_connection) {
+        current_mtu = central->mtu;
+    }
+    // Audio waiting in the queue (or the pre-roll) goes out now
+    k_sem_give(&pusher_wake);
+}
+
 // --- MTU Update Callback ---
 static void exchange_func(struct bt_conn *conn, uint8_t att_err, struct bt_gatt_exchange_params *params)
 {
@@ -446,19 +886,26 @@ static void exchange_func(struct bt_conn *conn, uint8_t att_err, struct bt_gatt_
     } else {
         uint16_t mtu = bt_gatt_get_mtu(conn);
         LOG_INF("MTU exchange successful. New MTU: %u (Payload: %u)", mtu, mtu - 3);
-        // Update current_mtu based on the negotiated value, considering header
-        // Note: bt_gatt_get_mtu includes the ATT header (3 bytes)
-        current_mtu = mtu; // Store the full MTU size
+        central_update_mtu(conn);
     }
 }
 
+// Either side may start the exchange, the phone often does before our request goes out
+static void att_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
+{
+    LOG_INF("ATT MTU updated: TX %u, RX %u", tx, rx);
+    central_update_mtu(conn);
+}
+
+static struct bt_gatt_cb _gatt_callback_references = {
+    .att_mtu_updated = att_mtu_updated,
+};
+
 //
 // Battery Service Handlers
 //
 
 #ifdef CONFIG_OMI_ENABLE_BATTERY
-#define BATTERY_REFRESH_INTERVAL        10000 // 10 seconds
-#define CONFIG_OMI_BATTERY_CRITICAL_MV  3500  // mV
 uint8_t battery_percentage = 0;
 void broadcast_battery_level(struct k_work *work_item);
 
@@ -486,7 +933,7 @@ void broadcast_battery_level(struct k_work *work_item)
         LOG_ERR("Failed to read battery level");
     }
 
-    k_work_reschedule(&battery_work, K_MSEC(BATTERY_REFRESH_INTERVAL));
+    k_work_reschedule_for_queue(&housekeeping_work_q, &battery_work, K_MSEC(battery_refresh_interval_ms()));
 }
 #endif
 
@@ -494,127 +941,512 @@ void broadcast_battery_level(struct k_work *work_item)
 // Connection Callbacks
 //
 
-static void _transport_connected(struct bt_conn *conn, uint8_t err)
-{
-    struct bt_conn_info info = {0};
-#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
-    storage_is_on = true;
-#endif
-
-    err = bt_conn_get_info(conn, &info);
-    if (err) {
-        LOG_ERR("Failed to get connection info (err %d)", err);
-        bt_conn_unref(conn);
-        return;
-    }
-
-    LOG_INF("bluetooth activated");
-    current_connection = bt_conn_ref(conn);
-    uint16_t mtu = bt_gatt_get_mtu(conn);
-    current_mtu = MAX(mtu, CONFIG_BT_L2CAP_TX_MTU);
+//
+// Link policy
+//
 
-    LOG_INF("Transport connected");
+// Connection parameters follow what the link is used for, instead of staying at whatever was
+// negotiated on connect: long intervals with latency while idle, short ones while audio is live,
+// the shortest while an offline sync drains storage or a firmware image is uploaded.
+enum link_workload {
+    LINK_WORKLOAD_IDLE,
+    LINK_WORKLOAD_STREAMING,
+    LINK_WORKLOAD_SYNC,
+    LINK_WORKLOAD_DFU,
+    LINK_WORKLOAD_COUNT,
+};
 
-    // Log initial connection parameters
-    double connection_interval = info.le.interval * 1.25; // in ms
-    uint16_t supervision_timeout = info.le.timeout * 10;  // in ms
-    LOG_INF("Initial conn params: interval %.2f ms, latency %d intervals, timeout %d ms",
-            connection_interval,
-            info.le.latency,
-            supervision_timeout);
-    LOG_INF("Initial MTU: %u", mtu);
+struct link_policy {
+    const char *name;
+    uint16_t interval_min; // 1.25 ms units
+    uint16_t interval_max; // 1.25 ms units
+    uint16_t latency;      // connection events
+    uint16_t timeout;      // 10 ms units
+    uint8_t phy;           // BT_GAP_LE_PHY_*
+};
 
-    // Initiate PHY, Data Length, and MTU updates
-    update_phy(current_connection);
+static const struct link_policy link_policies[LINK_WORKLOAD_COUNT] = {
+    [LINK_WORKLOAD_IDLE] = {"idle", 80, 160, 4, 600, BT_GAP_LE_PHY_1M},      // 100-200 ms
+    // 15 ms up to AUDIO_STREAM_INTERVAL_MS, which AUDIO_NOTIFY_CREDITS is sized for
+    [LINK_WORKLOAD_STREAMING] = {"streaming", 12, AUDIO_STREAM_INTERVAL_MS * 4 / 5, 0, 400, BT_GAP_LE_PHY_2M},
+    [LINK_WORKLOAD_SYNC] = {"sync", 6, 12, 0, 400, BT_GAP_LE_PHY_2M},         // 7.5-15 ms
+    [LINK_WORKLOAD_DFU] = {"dfu", 6, 6, 0, 400, BT_GAP_LE_PHY_2M},            // 7.5 ms
+};
 
-    // Add a delay before data length and MTU updates as per Nordic example
-    k_sleep(K_MSEC(1000));
-    update_data_length(current_connection);
-    update_mtu(current_connection);
+static uint8_t link_workload = LINK_WORKLOAD_COUNT; // nothing requested yet
+static uint8_t link_quiet_ticks = 0;
+static uint32_t link_last_frames_sent = 0;
 
-    is_connected = true;
-}
+void link_policy_update(struct k_work *work_item);
+K_WORK_DELAYABLE_DEFINE(link_policy_work, link_policy_update);
 
-static void _transport_disconnected(struct bt_conn *conn, uint8_t err)
+static enum link_workload link_current_workload(void)
 {
-    is_connected = false;
+#ifdef CONFIG_OMI_ENABLE_SMP_DFU
+    if (smp_dfu_active()) {
+        link_quiet_ticks = 0;
+        return LINK_WORKLOAD_DFU;
+    }
+#endif
 #ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
-    storage_is_on = false;
+    if (storage_sync_active()) {
+        link_quiet_ticks = 0;
+        return LINK_WORKLOAD_SYNC;
+    }
 #endif
 
-    LOG_INF("Transport disconnected");
+    uint32_t frames_sent = (uint32_t) atomic_get(&tx_frames_sent);
+    bool streaming = frames_sent != link_last_frames_sent;
+    link_last_frames_sent = frames_sent;
+    if (streaming) {
+        link_quiet_ticks = 0;
+        return LINK_WORKLOAD_STREAMING;
+    }
 
-    if (current_connection != NULL) {
-        bt_conn_unref(current_connection);
-        current_connection = NULL;
+    // Only relax once the link has been quiet for a while, so short pauses don't flap the parameters
+    if (link_workload != LINK_WORKLOAD_IDLE && link_workload != LINK_WORKLOAD_COUNT &&
+        ++link_quiet_ticks < LINK_POLICY_IDLE_TICKS) {
+        return link_workload;
     }
-    current_mtu = 0;
+    return LINK_WORKLOAD_IDLE;
 }
 
-static bool _le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+static void link_apply_policy(struct bt_conn *conn, enum link_workload workload)
 {
-    LOG_INF("Transport connection parameters update request received.");
-    LOG_DBG("Minimum interval: %d, Maximum interval: %d", param->interval_min, param->interval_max);
-    LOG_DBG("Latency: %d, Timeout: %d", param->latency, param->timeout);
+    const struct link_policy *p = &link_policies[workload];
+    struct bt_le_conn_param param = {
+        .interval_min = p->interval_min,
+        .interval_max = p->interval_max,
+        .latency = p->latency,
+        .timeout = p->timeout,
+    };
+    const struct bt_conn_le_phy_param phy = {
+        .options = BT_CONN_LE_PHY_OPT_NONE,
+        .pref_rx_phy = p->phy,
+        .pref_tx_phy = p->phy,
+    };
 
-    return true;
+    LOG_INF("Link policy %s", p->name);
+    int err = bt_conn_le_param_update(conn, &param);
+    if (err && err != -EALREADY) {
+        LOG_WRN("Connection parameter update failed (err %d)", err);
+    }
+    err = bt_conn_le_phy_update(conn, &phy);
+    if (err && err != -EALREADY) {
+        LOG_WRN("PHY update failed (err %d)", err);
+    }
 }
 
-static void _le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+static bool warm_link_resumed = false;
+
+// The first connection after a warm wake starts on the policy the last one ended with, the usual
+// hysteresis then relaxes it if the workload doesn't come back
+static void warm_link_resume(struct bt_conn *conn)
 {
-    double connection_interval = interval * 1.25; // in ms
-    uint16_t supervision_timeout = timeout * 10;  // in ms
-    LOG_INF("Connection parameters updated: interval %.2f ms, latency %d intervals, timeout %d ms",
-            connection_interval,
-            latency,
-            supervision_timeout);
+    const struct warm_state *warm = warm_resume_get();
+    if (warm_link_resumed || !warm) {
+        return;
+    }
+    warm_link_resumed = true;
+    uint8_t workload = warm->link.workload;
+    if (workload >= LINK_WORKLOAD_COUNT || workload == LINK_WORKLOAD_DFU || workload == LINK_WORKLOAD_IDLE) {
+        return;
+    }
+    link_workload = workload;
+    link_apply_policy(conn, workload);
 }
 
-static void _le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+void transport_warm_save(struct warm_link *link)
 {
-    LOG_INF("PHY updated: TX PHY %u, RX PHY %u", param->tx_phy, param->rx_phy);
-    // Detailed logging based on PHY type
-    if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_1M) {
-        LOG_INF("PHY updated. New PHY: 1M");
-    } else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_2M) {
-        LOG_INF("PHY updated. New PHY: 2M");
-    } else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_CODED_S8) {
-        LOG_INF("PHY updated. New PHY: Coded S8 (Long Range)");
-    } else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_CODED_S2) {
-        LOG_INF("PHY updated. New PHY: Coded S2 (Long Range)");
-    } else {
-        LOG_INF("PHY updated. New PHY: Unknown (%u)", param->tx_phy);
-    }
+    // An upload doesn't survive system off
+    link->workload = link_workload == LINK_WORKLOAD_DFU ? LINK_WORKLOAD_COUNT : link_workload;
 }
+#endif
 
-static void _le_data_length_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+void link_policy_update(struct k_work *work_item)
 {
-    LOG_INF("Data length updated: TX %u bytes/%u us, RX %u bytes/%u us",
-            info->tx_max_len,
-            info->tx_max_time,
-            info->rx_max_len,
-            info->rx_max_time);
-    // Note: current_mtu is updated in exchange_func after MTU negotiation
+    if (!current_connection) {
+        return;
+    }
+
+    // Audio goes to every central alike, so they all get the same policy
+    enum link_workload workload = link_current_workload();
+    if (workload != link_workload) {
+        link_workload = workload;
+        for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+            if (centrals[i].conn && centrals[i].setup_step == CONN_SETUP_DONE) {
+                link_apply_policy(centrals[i].conn, workload);
+            }
+        }
+    }
+
+    k_work_reschedule(&link_policy_work, K_MSEC(LINK_POLICY_INTERVAL_MS));
 }
 
-static struct bt_conn_cb _callback_references = {
-    .connected = _transport_connected,
-    .disconnected = _transport_disconnected,
-    .le_param_req = _le_param_req,
-    .le_param_updated = _le_param_updated,
-    .le_phy_updated = _le_phy_updated,
-    .le_data_len_updated = _le_data_length_updated,
-};
+//
+// Connection setup
+//
 
-// --- Update Request Functions ---
+// Each link procedure is requested from the completion callback of the one before, so the connected
+// callback returns at once. A peer that answers neither way holds up the next step for
+// CONN_SETUP_STEP_TIMEOUT_MS. The MTU exchange is an ATT transaction rather than a link layer
+// procedure, so it goes out with the first step and audio starts as soon as it completes.
+static void conn_setup_start(struct central *central)
+{
+    central->setup_started_at = k_uptime_get();
+    central->setup_step = CONN_SETUP_PHY;
+    update_mtu(central);
+    k_work_reschedule(&central->setup_work,
+                      update_phy(central->conn) ? K_NO_WAIT : K_MSEC(CONN_SETUP_STEP_TIMEOUT_MS));
+}
 
-static void update_phy(struct bt_conn *conn)
+// A completion callback of conn, move on if it finishes the current step
+static void conn_setup_step_done(struct bt_conn *conn, enum conn_setup_step step)
 {
-    int err;
-    // Prefer 2M PHY for higher throughput
-    const struct bt_conn_le_phy_param preferred_phy = {
-        .options = BT_CONN_LE_PHY_OPT_NONE,
-        .pref_rx_phy = BT_GAP_LE_PHY_2M,
+    struct central *central = central_find(conn);
+    if (central && central->setup_step == step) {
+        k_work_reschedule(&central->setup_work, K_NO_WAIT);
+    }
+}
+
+// Runs when the current step completed or timed out
+void conn_setup_next(struct k_work *work_item)
+{
+    struct central *central = CONTAINER_OF(k_work_delayable_from_work(work_item), struct central, setup_work);
+    if (!central->conn || central->setup_step == CONN_SETUP_DONE) {
+        return;
+    }
+
+    if (central->setup_step == CONN_SETUP_PHY) {
+        central->setup_step = CONN_SETUP_DATA_LEN;
+        int err = update_data_length(central->conn);
+        k_work_reschedule(&central->setup_work, err ? K_NO_WAIT : K_MSEC(CONN_SETUP_STEP_TIMEOUT_MS));
+        return;
+    }
+
+    central->setup_step = CONN_SETUP_DONE;
+    LOG_INF("Connection setup done in %d ms, MTU %u",
+            (int) (k_uptime_get() - central->setup_started_at),
+            central->mtu);
+
+    // The link policy takes over the connection parameters from here, its PHY and parameter
+    // requests would collide with the setup procedures before
+    link_workload = LINK_WORKLOAD_COUNT;
+    link_quiet_ticks = 0;
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+    warm_link_resume(central->conn);
+#endif
+    k_work_reschedule(&link_policy_work, K_MSEC(LINK_POLICY_INTERVAL_MS));
+}
+
+//
+// Advertising
+//
+
+// Advertising steps down through the stages below after boot, after every disconnect and on a
+// button press: fast while a phone is most likely to come back, then the standard interval, then a
+// slow one that keeps an idle device discoverable for a fraction of the radio time. Each stage is
+// a new one-shot advertising start, so the interval can change and nothing restarts behind our back.
+struct adv_stage {
+    const char *name;
+    uint16_t interval_min; // 0.625 ms units
+    uint16_t interval_max; // 0.625 ms units
+    uint32_t duration_ms;  // 0 for the last stage, which holds until the next restart
+};
+
+static const struct adv_stage adv_stages[] = {
+    {"fast", BT_GAP_ADV_FAST_INT_MIN_1, BT_GAP_ADV_FAST_INT_MAX_1, ADV_FAST_DURATION_MS},         // 30-60 ms
+    {"standard", BT_GAP_ADV_FAST_INT_MIN_2, BT_GAP_ADV_FAST_INT_MAX_2, ADV_STANDARD_DURATION_MS}, // 100-150 ms
+    {"slow", BT_GAP_ADV_SLOW_INT_MIN, BT_GAP_ADV_SLOW_INT_MAX, 0},                                // 1-1.2 s
+};
+BUILD_ASSERT(ARRAY_SIZE(adv_stages) == TRANSPORT_ADV_SLOW + 1, "adv_stages must follow enum transport_adv_stage");
+
+static bool adv_enabled = false;
+static uint8_t adv_stage = 0;
+static atomic_t adv_floor = ATOMIC_INIT(TRANSPORT_ADV_FAST);
+
+void adv_update(struct k_work *work_item);
+K_WORK_DELAYABLE_DEFINE(adv_work, adv_update);
+
+void adv_update(struct k_work *work_item)
+{
+    if (!adv_enabled || central_count() >= CONFIG_BT_MAX_CONN) {
+        return;
+    }
+
+    adv_stage = MAX(adv_stage, (uint8_t) atomic_get(&adv_floor));
+    const struct adv_stage *stage = &adv_stages[adv_stage];
+    const struct bt_le_adv_param param = BT_LE_ADV_PARAM_INIT(
+        BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_ONE_TIME, stage->interval_min, stage->interval_max, NULL);
+    bt_le_adv_stop();
+    int err = bt_le_adv_start(&param, bt_ad, ARRAY_SIZE(bt_ad), bt_sd, ARRAY_SIZE(bt_sd));
+    if (err) {
+        // Usually the old connection object is not released yet
+        LOG_WRN("Advertising failed to start (err %d)", err);
+        k_work_reschedule(&adv_work, K_MSEC(ADV_RETRY_MS));
+        return;
+    }
+
+    LOG_INF("Advertising %s", stage->name);
+    if (stage->duration_ms) {
+        adv_stage++;
+        k_work_reschedule(&adv_work, K_MSEC(stage->duration_ms));
+    }
+}
+
+static int adv_start_fast(void)
+{
+    adv_stage = 0;
+    return k_work_reschedule(&adv_work, K_NO_WAIT) < 0 ? -EIO : 0;
+}
+
+void transport_advertise_fast(void)
+{
+    if (adv_enabled && central_count() < CONFIG_BT_MAX_CONN) {
+        adv_start_fast();
+    }
+}
+
+void transport_set_adv_floor(enum transport_adv_stage stage)
+{
+    stage = MIN(stage, TRANSPORT_ADV_SLOW);
+    if (atomic_set(&adv_floor, stage) == stage) {
+        return;
+    }
+    LOG_INF("Advertising floor %s", adv_stages[stage].name);
+    // Restart at the floor if the schedule is somewhere faster, a lifted floor waits for the next restart
+    if (adv_enabled && central_count() < CONFIG_BT_MAX_CONN && adv_stage < stage) {
+        k_work_reschedule(&adv_work, K_NO_WAIT);
+    }
+}
+
+#ifdef CONFIG_OMI_ENABLE_FAST_RECONNECT
+static void _security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
+{
+    if (err) {
+        LOG_WRN("Security failed: level %d (err %d)", level, err);
+    } else {
+        LOG_INF("Security level %d", level);
+        // A bonded central gets its stored CCCs back once the link is encrypted
+        central_refresh_subscriptions();
+        k_sem_give(&pusher_wake);
+    }
+}
+#endif
+
+static void _transport_connected(struct bt_conn *conn, uint8_t err)
+{
+    struct bt_conn_info info = {0};
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    storage_is_on = true;
+#endif
+
+    FLIGHT_REC(FLIGHT_REC_CONN, 1, err);
+    err = bt_conn_get_info(conn, &info);
+    if (err) {
+        LOG_ERR("Failed to get connection info (err %d)", err);
+        bt_conn_unref(conn);
+        return;
+    }
+
+    LOG_INF("bluetooth activated");
+    // The default ATT MTU until the exchange completes, too small for the pusher to send audio
+    uint16_t mtu = bt_gatt_get_mtu(conn);
+
+    k_spinlock_key_t key = k_spin_lock(&centrals_lock);
+    struct central *central = central_find(NULL);
+    if (central) {
+        central->conn = bt_conn_ref(conn);
+        central->mtu = mtu;
+        central->modes = OMI_MODES_LEGACY & omi_modes_supported();
+        central->max_notify = 0;
+        atomic_clear(&central->audio_notifying);
+        // Completions still owed by an earlier link in this slot may never arrive
+        k_sem_reset(&central->notify_credits);
+        for (int i = 0; i < AUDIO_NOTIFY_CREDITS; i++) {
+            k_sem_give(&central->notify_credits);
+        }
+        if (current_connection == NULL) {
+            current_connection = bt_conn_ref(conn);
+            current_mtu = mtu;
+        }
+    }
+    k_spin_unlock(&centrals_lock, key);
+    if (!central) {
+        // Nothing was set up for it, so its disconnect only restarts advertising if a slot is free
+        LOG_ERR("No central slot free, check CONFIG_BT_MAX_CONN");
+        int dc_err = bt_conn_disconnect(conn, BT_HCI_ERR_CONN_LIMIT_EXCEEDED);
+        if (dc_err) {
+            LOG_ERR("Failed to reject the central (err %d)", dc_err);
+        }
+        return;
+    }
+
+    LOG_INF("Transport connected (%d of %d centrals)", central_count(), CONFIG_BT_MAX_CONN);
+
+    // Log initial connection parameters
+    double connection_interval = info.le.interval * 1.25; // in ms
+    uint16_t supervision_timeout = info.le.timeout * 10;  // in ms
+    LOG_INF("Initial conn params: interval %.2f ms, latency %d intervals, timeout %d ms",
+            connection_interval,
+            info.le.latency,
+            supervision_timeout);
+    LOG_INF("Initial MTU: %u", mtu);
+
+    // PHY, data length and MTU are negotiated from their completion callbacks, the pusher starts on the MTU
+    is_connected = true;
+    conn_setup_start(central);
+
+    // One-shot advertising stopped with this connection, start over while another central may join
+    if (central_count() < CONFIG_BT_MAX_CONN) {
+        adv_start_fast();
+    } else {
+        k_work_cancel_delayable(&adv_work);
+    }
+#ifdef CONFIG_OMI_ENABLE_FAST_RECONNECT
+    // A bonded phone just re-encrypts with the stored keys and keeps its cached GATT database,
+    // a new one is asked to pair (Just Works)
+    int security_err = bt_conn_set_security(conn, BT_SECURITY_L2);
+    if (security_err) {
+        LOG_WRN("Failed to request security (err %d)", security_err);
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_RADIO, true);
+#endif
+}
+
+static void _transport_disconnected(struct bt_conn *conn, uint8_t err)
+{
+    FLIGHT_REC(FLIGHT_REC_CONN, 0, err);
+
+    k_spinlock_key_t key = k_spin_lock(&centrals_lock);
+    struct central *central = central_find(conn);
+    if (central) {
+        central->conn = NULL;
+        central->setup_step = CONN_SETUP_DONE;
+        atomic_clear(&central->audio_notifying);
+    }
+    struct bt_conn *old_primary = NULL;
+    if (conn == current_connection) {
+        // The next central, if any, becomes the one the other services talk to
+        struct central *next = NULL;
+        for (int i = 0; i < CONFIG_BT_MAX_CONN && !next; i++) {
+            next = centrals[i].conn ? &centrals[i] : NULL;
+        }
+        old_primary = current_connection;
+        current_connection = next ? bt_conn_ref(next->conn) : NULL;
+        current_mtu = next ? next->mtu : 0;
+    }
+    k_spin_unlock(&centrals_lock, key);
+
+    if (central) {
+        k_work_cancel_delayable(&central->setup_work);
+        bt_conn_unref(conn);
+    }
+    if (old_primary) {
+        bt_conn_unref(old_primary);
+    }
+    if (central_count() < CONFIG_BT_MAX_CONN) {
+        adv_start_fast();
+    }
+
+    LOG_INF("Transport disconnected (%d centrals left)", central_count());
+    if (current_connection != NULL) {
+        return;
+    }
+
+    is_connected = false;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_RADIO, false);
+#endif
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    storage_is_on = false;
+#endif
+    // Invalidates every subscription, so only once no central is left
+    subscription_connection_closed();
+    k_work_cancel_delayable(&link_policy_work);
+}
+
+static bool _le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+    LOG_INF("Transport connection parameters update request received.");
+    LOG_DBG("Minimum interval: %d, Maximum interval: %d", param->interval_min, param->interval_max);
+    LOG_DBG("Latency: %d, Timeout: %d", param->latency, param->timeout);
+
+    // While audio, a sync or an upload is flowing, keep the central from stretching the interval past what it needs
+    if ((link_workload == LINK_WORKLOAD_STREAMING || link_workload == LINK_WORKLOAD_SYNC ||
+         link_workload == LINK_WORKLOAD_DFU) &&
+        param->interval_min > link_policies[link_workload].interval_max) {
+        LOG_INF("Rejecting interval %d while %s", param->interval_min, link_policies[link_workload].name);
+        return false;
+    }
+
+    return true;
+}
+
+static void _le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+    FLIGHT_REC(FLIGHT_REC_CONN_PARAMS, MIN(latency, UINT8_MAX), interval);
+    double connection_interval = interval * 1.25; // in ms
+    uint16_t supervision_timeout = timeout * 10;  // in ms
+    LOG_INF("Connection parameters updated: interval %.2f ms, latency %d intervals, timeout %d ms",
+            connection_interval,
+            latency,
+            supervision_timeout);
+}
+
+static void _le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    LOG_INF("PHY updated: TX PHY %u, RX PHY %u", param->tx_phy, param->rx_phy);
+    // Detailed logging based on PHY type
+    if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_1M) {
+        LOG_INF("PHY updated. New PHY: 1M");
+    } else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_2M) {
+        LOG_INF("PHY updated. New PHY: 2M");
+    } else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_CODED_S8) {
+        LOG_INF("PHY updated. New PHY: Coded S8 (Long Range)");
+    } else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_CODED_S2) {
+        LOG_INF("PHY updated. New PHY: Coded S2 (Long Range)");
+    } else {
+        LOG_INF("PHY updated. New PHY: Unknown (%u)", param->tx_phy);
+    }
+    conn_setup_step_done(conn, CONN_SETUP_PHY);
+}
+
+static void _le_data_length_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+    LOG_INF("Data length updated: TX %u bytes/%u us, RX %u bytes/%u us",
+            info->tx_max_len,
+            info->tx_max_time,
+            info->rx_max_len,
+            info->rx_max_time);
+    // Note: current_mtu is updated in exchange_func after MTU negotiation
+    conn_setup_step_done(conn, CONN_SETUP_DATA_LEN);
+}
+
+static struct bt_conn_cb _callback_references = {
+    .connected = _transport_connected,
+    .disconnected = _transport_disconnected,
+    .le_param_req = _le_param_req,
+    .le_param_updated = _le_param_updated,
+    .le_phy_updated = _le_phy_updated,
+    .le_data_len_updated = _le_data_length_updated,
+#ifdef CONFIG_OMI_ENABLE_FAST_RECONNECT
+    .security_changed = _security_changed,
+#endif
+};
+
+// --- Update Request Functions ---
+
+static int update_phy(struct bt_conn *conn)
+{
+    int err;
+    // Prefer 2M PHY for higher throughput
+    const struct bt_conn_le_phy_param preferred_phy = {
+        .options = BT_CONN_LE_PHY_OPT_NONE,
+        .pref_rx_phy = BT_GAP_LE_PHY_2M,
         .pref_tx_phy = BT_GAP_LE_PHY_2M,
     };
     LOG_INF("Requesting PHY update...");
@@ -622,287 +1454,1145 @@ static void update_phy(struct bt_conn *conn)
     if (err) {
         LOG_ERR("bt_conn_le_phy_update() failed (err %d)", err);
     }
+    return err;
+}
+
+static int update_data_length(struct bt_conn *conn)
+{
+    int err;
+    // Request maximum data length
+    struct bt_conn_le_data_len_param data_len_param = {
+        .tx_max_len = BT_GAP_DATA_LEN_MAX,
+        .tx_max_time = BT_GAP_DATA_TIME_MAX,
+    };
+    LOG_INF("Requesting data length update...");
+    err = bt_conn_le_data_len_update(conn, &data_len_param);
+    if (err) {
+        LOG_ERR("bt_conn_le_data_len_update() failed (err %d)", err);
+    }
+    return err;
+}
+
+static void update_mtu(struct central *central)
+{
+    int err;
+    central->exchange_params.func = exchange_func; // Set the callback function
+
+    LOG_INF("Requesting MTU exchange...");
+    err = bt_gatt_exchange_mtu(central->conn, &central->exchange_params);
+    if (err == -EALREADY) {
+        // The phone already ran the exchange, att_mtu_updated has the result
+        central_update_mtu(central->conn);
+    } else if (err) {
+        LOG_ERR("bt_gatt_exchange_mtu() failed (err %d)", err);
+    }
+}
+
+//
+// Ring Buffer
+//
+
+// Frames are stored at their exact length behind a 2-byte header, and read in place by the pusher
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+// When the frame went in, stored after it so the pusher always reads the stamp of the frame it claimed
+#define TX_TRACE_STAMP_SIZE 4
+#else
+#define TX_TRACE_STAMP_SIZE 0
+#endif
+#define TX_QUEUE_SLOT_SIZE (CODEC_OUTPUT_MAX_BYTES + FRAME_TIMESTAMP_SIZE + TX_TRACE_STAMP_SIZE + 2)
+static uint8_t tx_queue_buf[NETWORK_RING_BUF_SIZE * TX_QUEUE_SLOT_SIZE];
+static struct frame_queue tx_queue;
+
+// Tunable depth in full-size frames, the buffer stays allocated at NETWORK_RING_BUF_SIZE
+TUNABLE uint32_t tx_queue_frames = NETWORK_RING_BUF_SIZE;
+TUNABLE uint32_t notify_max_retries = AUDIO_NOTIFY_RETRIES;
+// Length of the last frame queued, what transport_audio_wanted() expects the next one to need
+static atomic_t tx_last_frame_size = ATOMIC_INIT(0);
+
+static inline uint32_t tx_queue_capacity(void)
+{
+    return tx_queue_frames * TX_QUEUE_SLOT_SIZE;
+}
+
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+#ifndef CONFIG_BT_RADIO_NOTIFICATION_CONN_CB
+#error "CONFIG_OMI_ENABLE_CONN_EVENT_SYNC needs the connection event hook, CONFIG_BT_RADIO_NOTIFICATION_CONN_CB"
+#endif
+// While audio goes out as notifications, the pusher runs just before each connection event of a
+// subscribed central rather than on every queued frame. Whatever is queued then, packed, makes that
+// event, and the radio isn't woken for an event half the frames missed. Any other sink, or a link
+// whose event hooks went quiet, wakes the pusher per frame as before.
+static atomic_t conn_event_at;   // uptime ms of the last prepare of a subscribed central
+static atomic_t conn_event_gatt; // the pusher's last frame went to GATT
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+static atomic_t conn_event_due; // set by the prepare, taken by the idle pusher to flush the pack
+#endif
+
+static bool conn_event_paced(void)
+{
+    return atomic_get(&conn_event_gatt) &&
+           k_uptime_get_32() - (uint32_t) atomic_get(&conn_event_at) < CONN_EVENT_SYNC_STALE_MS;
+}
+
+// Called CONN_EVENT_PREPARE_US ahead of every connection event, possibly in interrupt context
+static void conn_event_prepare(struct bt_conn *conn)
+{
+    struct central *central = central_find(conn);
+    if (!central || !atomic_get(&central->audio_notifying)) {
+        return;
+    }
+    atomic_set(&conn_event_at, (atomic_val_t) k_uptime_get_32());
+    if (frame_queue_used(&tx_queue) == 0) {
+        return;
+    }
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+    atomic_set(&conn_event_due, 1);
+#endif
+    k_sem_give(&pusher_wake);
+}
+
+static const struct bt_radio_notification_conn_cb conn_event_cb = {
+    .prepare = conn_event_prepare,
+};
+#endif
+
+BUILD_ASSERT(!STORAGE_RECORD_IS_TAGGED(CODEC_OUTPUT_MAX_BYTES + FRAME_TIMESTAMP_SIZE),
+             "Audio record lengths must stay clear of the record tags");
+
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+// Tagged records waiting for the pusher to write them next to the audio, [tag][payload] each
+#define IMU_RECORD_QUEUE_BYTES 1024
+static uint8_t imu_record_buf[IMU_RECORD_QUEUE_BYTES];
+static struct frame_queue imu_record_queue;
+
+bool write_record_to_storage(uint8_t tag, const uint8_t *data, uint8_t size)
+{
+    uint8_t *slot = frame_queue_put_claim(&imu_record_queue, size + 1);
+    if (!slot) {
+        return false;
+    }
+    slot[0] = tag;
+    memcpy(slot + 1, data, size);
+    frame_queue_put_finish(&imu_record_queue, size + 1);
+    return true;
+}
+#endif
+
+void transport_queue_init(void)
+{
+    static bool initialized;
+
+    if (!initialized) {
+        frame_queue_init(&tx_queue, tx_queue_buf, sizeof(tx_queue_buf));
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+        frame_queue_init(&imu_record_queue, imu_record_buf, sizeof(imu_record_buf));
+#endif
+        initialized = true;
+    }
+}
+
+static bool write_to_tx_queue(uint8_t *data, size_t size, uint32_t capture_ms)
+{
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    // Increment the counter
+    monitor_inc_tx_queue_write();
+#endif
+
+    if (size > CODEC_OUTPUT_MAX_BYTES) {
+        return false;
+    }
+
+    uint8_t *slot = NULL;
+#ifdef CONFIG_OMI_ENABLE_TUNING
+    if (frame_queue_used(&tx_queue) + size + FRAME_TIMESTAMP_SIZE + TX_TRACE_STAMP_SIZE + 2 <= tx_queue_capacity())
+#endif
+    {
+        slot = frame_queue_put_claim(&tx_queue, size + FRAME_TIMESTAMP_SIZE + TX_TRACE_STAMP_SIZE);
+    }
+    BENCH_COUNT(bench_queue_claims);
+    if (!slot) {
+        atomic_inc(&tx_queue_drops);
+        BENCH_COUNT(bench_queue_drops);
+        FLIGHT_REC(FLIGHT_REC_TX_ENQUEUE, 0, frame_queue_used(&tx_queue) * 100 / tx_queue_capacity());
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_TX_QUEUE_FULL, 1);
+#endif
+        return false;
+    }
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+    sys_put_le32(capture_ms, slot);
+#endif
+    memcpy(slot + FRAME_TIMESTAMP_SIZE, data, size);
+    BENCH_COPY(size);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    sys_put_le32(monitor_trace_now(), slot + FRAME_TIMESTAMP_SIZE + size);
+#endif
+    frame_queue_put_finish(&tx_queue, size + FRAME_TIMESTAMP_SIZE + TX_TRACE_STAMP_SIZE);
+    atomic_set(&tx_last_frame_size, (atomic_val_t) size);
+    FLIGHT_REC(FLIGHT_REC_TX_ENQUEUE, 1, frame_queue_used(&tx_queue) * 100 / tx_queue_capacity());
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_queue_level(MONITOR_QUEUE_TX, frame_queue_used(&tx_queue), tx_queue_capacity());
+#endif
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+    // The next connection event wakes the pusher, unless the queue is filling up meanwhile
+    if (conn_event_paced() && frame_queue_used(&tx_queue) * 2 < tx_queue_capacity()) {
+        return true;
+    }
+#endif
+    k_sem_give(&pusher_wake);
+    return true;
+}
+
+//
+// Pusher
+//
+
+// Thread
+K_THREAD_STACK_DEFINE(pusher_stack, 4096);
+static struct k_thread pusher_thread;
+static uint16_t packet_next_index = 0;
+
+// Define buffer sizes based on configuration and potential MTU
+#define MAX_POSSIBLE_MTU 517
+static uint8_t pusher_temp_data[MAX_POSSIBLE_MTU];
+
+// Live audio is framed once and notified to every central that subscribed to it (the sinks),
+// sized for the smallest MTU among them, so each packet is built once whatever the number of
+// centrals. The pusher collects the sinks per frame and holds a reference to each meanwhile.
+struct audio_sink {
+    struct bt_conn *conn;
+    struct central *central;
+    bool failed; // missed a packet of this frame, skipped for the rest of it
+};
+
+static struct audio_sink audio_sinks[CONFIG_BT_MAX_CONN];
+static uint8_t audio_sink_count = 0;
+static uint16_t audio_sink_mtu = 0;
+static uint32_t audio_sink_modes = 0; // omi_mode_t every sink enabled
+
+static int audio_sinks_collect(void)
+{
+    audio_sink_count = 0;
+    audio_sink_mtu = MAX_POSSIBLE_MTU;
+    audio_sink_modes = omi_modes_supported();
+
+    k_spinlock_key_t key = k_spin_lock(&centrals_lock);
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        struct central *central = &centrals[i];
+        if (central->conn && central->mtu >= MINIMAL_PACKET_SIZE && atomic_get(&central->audio_notifying)) {
+            audio_sinks[audio_sink_count++] = (struct audio_sink) {bt_conn_ref(central->conn), central, false};
+            audio_sink_mtu = MIN(audio_sink_mtu, central->mtu);
+            if (central->max_notify) {
+                audio_sink_mtu = MIN(audio_sink_mtu, central->max_notify + ATT_NOTIFY_HEADER_SIZE);
+            }
+            audio_sink_modes &= central->modes;
+        }
+    }
+    k_spin_unlock(&centrals_lock, key);
+    return audio_sink_count;
+}
+
+static void audio_sinks_release(void)
+{
+    for (int i = 0; i < audio_sink_count; i++) {
+        bt_conn_unref(audio_sinks[i].conn);
+    }
+    audio_sink_count = 0;
+}
+
+static uint16_t audio_mtu(void)
+{
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+    if (bench_pusher_active) {
+        return PIPELINE_BENCH_MTU;
+    }
+#endif
+    return audio_sink_mtu;
+}
+
+static uint32_t audio_modes(void)
+{
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+    if (bench_pusher_active) {
+        return omi_modes_supported();
+    }
+#endif
+    return audio_sink_modes;
+}
+
+// Frames are queued with their timestamp, which only goes to sinks that enabled it.
+// Returns the index byte of the frame's first fragment.
+static uint8_t gatt_frame_timestamp(const uint8_t **buffer, uint16_t *size, uint32_t modes)
+{
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+    if (!(modes & OMI_MODE_FRAME_TIMESTAMPS)) {
+        *buffer += FRAME_TIMESTAMP_SIZE;
+        *size -= FRAME_TIMESTAMP_SIZE;
+        return 0;
+    }
+    return PIPE_FRAME_TIMESTAMP_FLAG;
+#else
+    return 0;
+#endif
+}
+
+static void control_notify_sent(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&control_notify_credits);
+}
+
+static int control_notify_one(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *data, uint16_t len)
+{
+    struct bt_gatt_notify_params params = {
+        .attr = attr,
+        .data = data,
+        .len = len,
+        .func = control_notify_sent,
+    };
+
+    // Status updates are superseded by the next one, so none is worth waiting for
+    if (k_sem_take(&control_notify_credits, K_NO_WAIT) != 0) {
+        return -ENOMEM;
+    }
+    int err = bt_gatt_notify_cb(conn, &params);
+    if (err) {
+        k_sem_give(&control_notify_credits);
+    }
+    return err;
+}
+
+struct control_notify_all {
+    const struct bt_gatt_attr *attr;
+    const void *data;
+    uint16_t len;
+    int err;
+};
+
+static void control_notify_each(struct bt_conn *conn, void *user_data)
+{
+    struct control_notify_all *all = user_data;
+    struct bt_conn_info info;
+
+    if (bt_conn_get_info(conn, &info) || info.state != BT_CONN_STATE_CONNECTED ||
+        !bt_gatt_is_subscribed(conn, all->attr, BT_GATT_CCC_NOTIFY)) {
+        return;
+    }
+    int err = control_notify_one(conn, all->attr, all->data, all->len);
+    if (err) {
+        all->err = err;
+    }
+}
+
+int transport_notify(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *data, uint16_t len)
+{
+    if (conn) {
+        return control_notify_one(conn, attr, data, len);
+    }
+
+    // One credit and one completion per link, which a NULL bt_gatt_notify_cb() would not give
+    struct control_notify_all all = {.attr = attr, .data = data, .len = len, .err = 0};
+    bt_conn_foreach(BT_CONN_TYPE_LE, control_notify_each, &all);
+    return all.err;
+}
+
+static void audio_notify_sent(struct bt_conn *conn, void *user_data)
+{
+    struct central *central = user_data;
+    k_sem_give(&central->notify_credits);
+}
+
+// Send one audio notification to one sink once its controller buffers have room for it.
+// Completions return credits, so up to AUDIO_NOTIFY_CREDITS packets stay in flight without polling.
+static bool notify_audio_sink(struct audio_sink *sink, const uint8_t *data, uint16_t size)
+{
+    struct bt_gatt_notify_params params = {
+        .attr = &audio_service.attrs[1],
+        .data = data,
+        .len = size,
+        .func = audio_notify_sent,
+        .user_data = sink->central,
+    };
+    struct k_sem *credits = &sink->central->notify_credits;
+    struct bt_conn *conn = sink->conn;
+    uint32_t retry_count = 0;
+    __maybe_unused int err = 0;
+
+    while (retry_count < notify_max_retries) {
+        // Wait for an earlier notification to complete; a stalled link loses the packet
+        if (k_sem_take(credits, K_MSEC(AUDIO_NOTIFY_TIMEOUT_MS)) != 0) {
+            atomic_inc(&tx_notify_failures);
+            LOG_HOT("No notify credit within %d ms", AUDIO_NOTIFY_TIMEOUT_MS);
+            err = -EAGAIN;
+            break;
+        }
+
+        err = bt_gatt_notify_cb(conn, &params);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_inc_gatt_notify();
+#endif
+
+        // Break if success
+        if (!err) {
+            FLIGHT_REC(FLIGHT_REC_NOTIFY, 1, 0);
+            return true;
+        }
+
+        // Not queued, so no completion will return the credit. Other services have their own
+        // credits, so this takes ATT buffers configured below the credit totals; back off briefly.
+        k_sem_give(credits);
+        atomic_inc(&tx_notify_failures);
+        LOG_HOT("bt_gatt_notify_cb failed (err %d), MTU %d, packet %d", err, sink->central->mtu, size);
+        k_sleep(K_MSEC(1));
+        retry_count++;
+    }
+
+    // Counted in tx_notify_failures and the notify drops, a congested link would log every frame
+    LOG_HOT("Failed to send packet after %u retries", retry_count);
+    FLIGHT_REC(FLIGHT_REC_NOTIFY, 0, (uint16_t) -err);
+    return false;
+}
+
+// The same packet to every sink still in the frame, sent if any of them took it
+static bool notify_audio(const uint8_t *data, uint16_t size)
+{
+    bool sent = false;
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+    // Mocked GATT layer: the packet is framed, then goes nowhere
+    if (bench_pusher_active) {
+        BENCH_COUNT(bench_packets);
+        return true;
+    }
+#endif
+
+    for (int i = 0; i < audio_sink_count; i++) {
+        struct audio_sink *sink = &audio_sinks[i];
+        if (!sink->failed && notify_audio_sink(sink, data, size)) {
+            sent = true;
+        } else {
+            // A lagging central must not hold the others up on every remaining fragment
+            sink->failed = true;
+        }
+    }
+    return sent;
+}
+
+static bool push_to_gatt(const uint8_t *buffer, uint16_t size)
+{
+    uint32_t offset = 0;
+    uint8_t index = 0;
+    uint8_t first_index = gatt_frame_timestamp(&buffer, &size, audio_modes());
+
+    while (offset < size) {
+        uint16_t packet_size = pipe_frame_fragment(pusher_temp_data, audio_mtu(), packet_next_index++,
+                                                   index == 0 ? first_index : index, buffer + offset, size - offset);
+        BENCH_COPY(packet_size);
+
+        offset += packet_size;
+        index++;
+
+        if (!notify_audio(pusher_temp_data, packet_size + PIPE_FRAME_HEADER_SIZE)) {
+            atomic_inc(&tx_frames_lost);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+            monitor_add_drops(MONITOR_DROP_NOTIFY_FAILED, 1);
+#endif
+            return false;
+        }
+    }
+
+    atomic_inc(&tx_frames_sent);
+    return true;
+}
+
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+// Packed notifications carry several whole frames instead of one frame fragment, see pipe_frame.h
+BUILD_ASSERT(AUDIO_PACK_MAX_FRAMES <= PIPE_FRAME_PACK_MAX, "Pack count must stay below the flag bits");
+static struct pipe_frame_pack pack = {.packet = pusher_temp_data, .size = PIPE_FRAME_HEADER_SIZE};
+static int64_t pack_started_at = 0;
+
+static uint16_t pack_capacity(void)
+{
+    return MIN(audio_mtu() - ATT_NOTIFY_HEADER_SIZE, sizeof(pusher_temp_data));
+}
+
+static bool flush_packed(void)
+{
+    uint8_t count = pack.count;
+    if (count == 0) {
+        return true;
+    }
+
+    bool sent = notify_audio(pusher_temp_data, pipe_frame_pack_finish(&pack, packet_next_index++));
+
+    atomic_add(sent ? &tx_frames_sent : &tx_frames_lost, count);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    if (!sent) {
+        monitor_add_drops(MONITOR_DROP_NOTIFY_FAILED, count);
+    }
+#endif
+    return sent;
+}
+
+static void drop_packed(void)
+{
+    pipe_frame_pack_init(&pack, pusher_temp_data);
+}
+
+// Append the frame to the pending notification, sending it once it is full
+static bool push_packed_to_gatt(const uint8_t *buffer, uint16_t size)
+{
+    uint32_t modes = audio_modes();
+    const uint8_t *entry = buffer;
+    uint16_t entry_len = size;
+    uint8_t timestamp_flag = gatt_frame_timestamp(&entry, &entry_len, modes);
+    uint16_t capacity = pack_capacity();
+
+    // A frame that can never share a notification, or a sink without packing, gets it fragmented as before
+    if (!(modes & OMI_MODE_AUDIO_PACKING) || PIPE_FRAME_HEADER_SIZE + 1 + entry_len > capacity) {
+        flush_packed();
+        return push_to_gatt(buffer, size);
+    }
+
+    if (!pipe_frame_pack_fits(&pack, capacity, entry_len, timestamp_flag) && !flush_packed()) {
+        return false;
+    }
+
+    if (pack.count == 0) {
+        pack_started_at = k_uptime_get();
+    }
+    pipe_frame_pack_add(&pack, entry, entry_len, timestamp_flag);
+    BENCH_COPY(entry_len);
+
+    if (pack.count >= AUDIO_PACK_MAX_FRAMES) {
+        return flush_packed();
+    }
+    return true;
+}
+
+// Called while the queue is empty, so a partial pack never waits longer than the latency bound
+static void flush_packed_if_due(void)
+{
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+    // Woken for a connection event, whatever is packed goes into it
+    bool event_due = atomic_cas(&conn_event_due, 1, 0);
+#else
+    bool event_due = false;
+#endif
+    if (pack.count == 0 || (!event_due && k_uptime_get() - pack_started_at < AUDIO_PACK_MAX_LATENCY_MS)) {
+        return;
+    }
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+    if (bench_pusher_active) {
+        flush_packed();
+        return;
+    }
+#endif
+
+    if (!audio_sinks_collect()) {
+        drop_packed();
+        return;
+    }
+    flush_packed();
+    audio_sinks_release();
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_ISO_AUDIO
+// Once the phone sets up a Connected Isochronous Stream, live audio goes over it instead of
+// notifications: one whole queued frame (timestamp included) per SDU, no fragment header, sent in
+// the interval the central scheduled. A late SDU is worthless on an isochronous link, so a frame
+// that finds no free buffer is dropped rather than retried.
+#define ISO_AUDIO_SDU_SIZE (CODEC_OUTPUT_MAX_BYTES + FRAME_TIMESTAMP_SIZE)
+
+NET_BUF_POOL_FIXED_DEFINE(iso_audio_pool,
+                          AUDIO_ISO_BUFS,
+                          BT_ISO_SDU_BUF_SIZE(ISO_AUDIO_SDU_SIZE),
+                          CONFIG_BT_CONN_TX_USER_DATA_SIZE,
+                          NULL);
+
+static struct bt_iso_chan iso_audio_chan;
+static struct bt_iso_chan_io_qos iso_audio_tx_qos;
+static struct bt_iso_chan_qos iso_audio_qos = {.tx = &iso_audio_tx_qos};
+static atomic_t iso_audio_connected = ATOMIC_INIT(0);
+static uint16_t iso_audio_seq = 0;
+
+static void iso_audio_connected_cb(struct bt_iso_chan *chan)
+{
+    LOG_INF("Audio CIS connected, max SDU %u", iso_audio_tx_qos.sdu);
+    iso_audio_seq = 0;
+    atomic_set(&iso_audio_connected, 1);
+}
+
+static void iso_audio_disconnected_cb(struct bt_iso_chan *chan, uint8_t reason)
+{
+    LOG_INF("Audio CIS disconnected (reason 0x%02x), back to GATT", reason);
+    atomic_set(&iso_audio_connected, 0);
+}
+
+static struct bt_iso_chan_ops iso_audio_ops = {
+    .connected = iso_audio_connected_cb,
+    .disconnected = iso_audio_disconnected_cb,
+};
+
+static int iso_audio_accept(const struct bt_iso_accept_info *info, struct bt_iso_chan **chan)
+{
+    if (iso_audio_chan.iso) {
+        LOG_WRN("Audio CIS already in use");
+        return -ENOMEM;
+    }
+    iso_audio_chan.ops = &iso_audio_ops;
+    iso_audio_chan.qos = &iso_audio_qos;
+    *chan = &iso_audio_chan;
+    return 0;
+}
+
+static struct bt_iso_server iso_audio_server = {
+#ifdef CONFIG_BT_SMP
+    .sec_level = BT_SECURITY_L1,
+#endif
+    .accept = iso_audio_accept,
+};
+
+static bool push_to_iso(const uint8_t *buffer, uint16_t size)
+{
+    struct net_buf *buf = size <= iso_audio_tx_qos.sdu ? net_buf_alloc(&iso_audio_pool, K_NO_WAIT) : NULL;
+    if (buf) {
+        net_buf_reserve(buf, BT_ISO_CHAN_SEND_RESERVE);
+        net_buf_add_mem(buf, buffer, size);
+        int err = bt_iso_chan_send(&iso_audio_chan, buf, iso_audio_seq++);
+        if (!err) {
+            atomic_inc(&tx_frames_sent);
+            return true;
+        }
+        LOG_DBG("bt_iso_chan_send failed (err %d)", err);
+        net_buf_unref(buf);
+    }
+
+    atomic_inc(&tx_frames_lost);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_add_drops(MONITOR_DROP_NOTIFY_FAILED, 1);
+#endif
+    return false;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+// In Wi-Fi live mode frames go to the hub over the TCP link, each one whole behind a header,
+// little endian: [len lo][len hi][seq 0..3][ms 0..3] then len bytes of encoded frame. seq counts
+// every frame offered to the link, so a gap is a frame that went over BLE instead; ms is the
+// capture time with CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS and the send time otherwise. A frame the
+// link can't take within WIFI_LIVE_SEND_TIMEOUT_MS (or a link that is down) falls back to BLE.
+// After one such timeout the link counts as stalled: later frames only try a send that doesn't
+// wait, so a stall costs one timeout instead of one per frame, until a frame goes through again.
+#define WIFI_LIVE_HEADER_SIZE 10
+static uint8_t wifi_live_buf[WIFI_LIVE_HEADER_SIZE + CODEC_OUTPUT_MAX_BYTES];
+static uint32_t wifi_live_seq = 0;
+static bool wifi_live_stalled = false; // pusher only
+
+static bool push_to_wifi(const uint8_t *buffer, uint16_t size)
+{
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+    uint32_t ms = sys_get_le32(buffer);
+    buffer += FRAME_TIMESTAMP_SIZE;
+    size -= FRAME_TIMESTAMP_SIZE;
+#else
+    uint32_t ms = k_uptime_get_32();
+#endif
+
+    sys_put_le16(size, wifi_live_buf);
+    sys_put_le32(wifi_live_seq++, wifi_live_buf + 2);
+    sys_put_le32(ms, wifi_live_buf + 6);
+    memcpy(wifi_live_buf + WIFI_LIVE_HEADER_SIZE, buffer, size);
+    BENCH_COPY(size);
+
+    uint32_t timeout_ms = wifi_live_stalled ? 0 : WIFI_LIVE_SEND_TIMEOUT_MS;
+    int ret = wifi_send_all_timeout(wifi_live_buf, WIFI_LIVE_HEADER_SIZE + size, timeout_ms);
+    if (ret < 0) {
+        if (ret == -EAGAIN && !wifi_live_stalled) {
+            LOG_WRN("Wi-Fi live link stalled, frames go over BLE until it takes one again");
+        }
+        // A link that is down isn't stalled, the first frame after a reconnect gets the full timeout
+        wifi_live_stalled = ret == -EAGAIN;
+        LOG_DBG("Live frame not sent over Wi-Fi (err %d)", ret);
+        return false;
+    }
+    wifi_live_stalled = false;
+    atomic_inc(&tx_frames_sent);
+    return true;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+static uint32_t usb_stream_seq = 0;
+
+static void push_to_usb_stream(const uint8_t *buffer, uint16_t size)
+{
+    struct usb_stream_frame header = {
+        .seq = usb_stream_seq++,
+        .cycles = k_cycle_get_32(),
+    };
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+    header.capture_ms = sys_get_le32(buffer);
+    buffer += FRAME_TIMESTAMP_SIZE;
+    size -= FRAME_TIMESTAMP_SIZE;
+#endif
+    header.dropped = usb_stream_take_dropped();
+    usb_stream_send(USB_STREAM_MSG_FRAME, &header, sizeof(header), buffer, size);
+}
+#endif
+
+#define OPUS_PREFIX_LENGTH 1
+#define OPUS_PADDED_LENGTH 80
+#define MAX_WRITE_SIZE 440
+static uint32_t offset = 0;
+
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+static void submit_file_block(uint8_t *block)
+{
+    write_block_to_file(block, MAX_WRITE_SIZE);
 }
 
-static void update_data_length(struct bt_conn *conn)
+// Frames are packed straight into an SD write block, which goes to the SD worker once full
+static struct pipe_record_packer storage_packer = {
+    .format = &storage_record_format,
+    .alloc = alloc_audio_block,
+    .submit = submit_file_block,
+};
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+// The benchmark packs into a block of its own, so a recording block in progress is left alone
+static uint8_t bench_block[MAX_WRITE_SIZE];
+
+static uint8_t *bench_block_alloc(void)
 {
-    int err;
-    // Request maximum data length
-    struct bt_conn_le_data_len_param data_len_param = {
-        .tx_max_len = BT_GAP_DATA_LEN_MAX,
-        .tx_max_time = BT_GAP_DATA_TIME_MAX,
-    };
-    LOG_INF("Requesting data length update...");
-    err = bt_conn_le_data_len_update(conn, &data_len_param);
-    if (err) {
-        LOG_ERR("bt_conn_le_data_len_update() failed (err %d)", err);
-    }
+    return bench_block;
 }
 
-static void update_mtu(struct bt_conn *conn)
+static void bench_block_submit(uint8_t *block)
 {
-    int err;
-    exchange_params.func = exchange_func; // Set the callback function
+    BENCH_COUNT(bench_storage_blocks);
+}
 
-    LOG_INF("Requesting MTU exchange...");
-    err = bt_gatt_exchange_mtu(conn, &exchange_params);
-    if (err) {
-        LOG_ERR("bt_gatt_exchange_mtu() failed (err %d)", err);
+static struct pipe_record_packer bench_packer = {
+    .format = &storage_record_format,
+    .alloc = bench_block_alloc,
+    .submit = bench_block_submit,
+};
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+static void flush_records_to_storage(void)
+{
+    uint8_t *record;
+    uint16_t size;
+
+    while ((size = frame_queue_get_claim(&imu_record_queue, &record)) > 0) {
+        uint8_t head[2] = {record[0], (uint8_t) (size - 1)};
+        bool written = storage_packer_append(&storage_packer, head, sizeof(head), record + 1, size - 1);
+        frame_queue_get_finish(&imu_record_queue);
+        if (!written) {
+            break;
+        }
     }
 }
 
-//
-// Ring Buffer
-//
+// Nothing to store them in, but the next recording shouldn't start with stale context
+static void discard_records(void)
+{
+    uint8_t *record;
 
-#define NET_BUFFER_HEADER_SIZE 3
-#define RING_BUFFER_HEADER_SIZE 2
-static uint8_t tx_queue[NETWORK_RING_BUF_SIZE * (CODEC_OUTPUT_MAX_BYTES + RING_BUFFER_HEADER_SIZE)];
-static uint8_t tx_buffer[CODEC_OUTPUT_MAX_BYTES + RING_BUFFER_HEADER_SIZE];
-static uint8_t tx_buffer_2[CODEC_OUTPUT_MAX_BYTES + RING_BUFFER_HEADER_SIZE];
-static uint32_t tx_buffer_size = 0;
-static struct ring_buf ring_buf;
+    while (frame_queue_get_claim(&imu_record_queue, &record) > 0) {
+        frame_queue_get_finish(&imu_record_queue);
+    }
+}
+#endif
 
-static bool write_to_tx_queue(uint8_t *data, size_t size)
+bool write_to_storage(const uint8_t *buffer, uint16_t size)
 {
-#ifdef CONFIG_OMI_ENABLE_MONITOR
-    // Increment the counter
-    monitor_inc_tx_queue_write();
-#endif
+    uint8_t head = (uint8_t) size;
 
-    if (size > CODEC_OUTPUT_MAX_BYTES) {
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+    // Same blocks, so IMU context costs no extra SD writes
+    flush_records_to_storage();
+#endif
+    if (!storage_packer_append(&storage_packer, &head, OPUS_PREFIX_LENGTH, buffer, size)) {
         return false;
     }
 
-    // Copy data (TODO: Avoid this copy)
-    tx_buffer_2[0] = size & 0xFF;
-    tx_buffer_2[1] = (size >> 8) & 0xFF;
-    memcpy(tx_buffer_2 + RING_BUFFER_HEADER_SIZE, data, size);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_inc_storage_write();
+#endif
+    return true;
+}
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+// Same packing as write_to_storage()
+static void bench_pack_frame(const uint8_t *buffer, uint16_t size)
+{
+    uint8_t head = (uint8_t) size;
 
-    // Write to ring buffer
-    int written =
-        ring_buf_put(&ring_buf,
-                     tx_buffer_2,
-                     (CODEC_OUTPUT_MAX_BYTES + RING_BUFFER_HEADER_SIZE)); // It always fits completely or not at all
-    if (written != CODEC_OUTPUT_MAX_BYTES + RING_BUFFER_HEADER_SIZE) {
-        return false;
-    } else {
-        return true;
+    if (storage_packer_append(&bench_packer, &head, OPUS_PREFIX_LENGTH, buffer, size)) {
+        BENCH_COPY(size);
     }
 }
+#endif
+#endif
 
-static bool read_from_tx_queue()
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+// Frames that find no sink (phone not subscribed, SD card not mounted yet) wait here, the newest
+// PREROLL_MS of them, and go out oldest first once GATT or storage takes audio again. Speech that
+// starts with the button press isn't lost while the link or the card comes up. Only the pusher
+// touches it, so it is both producer and consumer of the queue.
+#define PREROLL_FRAMES (PREROLL_MS * AUDIO_SAMPLE_RATE / 1000 / CODEC_PACKAGE_SAMPLES)
+static uint8_t preroll_buf[PREROLL_FRAMES * (PREROLL_FRAME_BYTES + FRAME_TIMESTAMP_SIZE + 2)];
+static struct frame_queue preroll_queue;
+static uint16_t preroll_frames = 0;
+
+static bool preroll_drop_oldest(void)
 {
-
-    // Read from ring buffer
-    // memset(tx_buffer, 0, sizeof(tx_buffer));
-    uint32_t package_size = CODEC_OUTPUT_MAX_BYTES + RING_BUFFER_HEADER_SIZE;
-    tx_buffer_size = ring_buf_get(&ring_buf, tx_buffer, package_size); // It always fits completely or not at all
-    if (tx_buffer_size != package_size) {
-        // LOG_ERR("Failed to read from ring buffer. not enough data %d", tx_buffer_size);
+    uint8_t *frame;
+    if (frame_queue_get_claim(&preroll_queue, &frame) == 0) {
         return false;
     }
-
-    // Adjust size
-    tx_buffer_size = tx_buffer[0] + (tx_buffer[1] << 8);
-
+    frame_queue_get_finish(&preroll_queue);
+    preroll_frames--;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_add_drops(MONITOR_DROP_STORAGE_FULL, 1);
+#endif
     return true;
 }
 
-//
-// Pusher
-//
-
-// Thread
-K_THREAD_STACK_DEFINE(pusher_stack, 4096);
-static struct k_thread pusher_thread;
-static uint16_t packet_next_index = 0;
+static void preroll_put(const uint8_t *frame, uint16_t size)
+{
+    uint8_t *slot = NULL;
 
-// Define buffer sizes based on configuration and potential MTU
-#define MAX_POSSIBLE_MTU 517
-static uint8_t pusher_temp_data[MAX_POSSIBLE_MTU];
+    // Age out the oldest frames until this one fits, by count and by bytes
+    while (preroll_frames >= PREROLL_FRAMES || !(slot = frame_queue_put_claim(&preroll_queue, size))) {
+        if (!preroll_drop_oldest()) {
+            return;
+        }
+    }
+    memcpy(slot, frame, size);
+    frame_queue_put_finish(&preroll_queue, size);
+    preroll_frames++;
+}
 
-static bool push_to_gatt(struct bt_conn *conn)
+static void preroll_discard(void)
 {
-    uint8_t *buffer = tx_buffer + RING_BUFFER_HEADER_SIZE;
-    uint32_t offset = 0;
-    uint8_t index = 0;
-    int retry_count = 0;
-    const int max_retries = 3;
-
-    while (offset < tx_buffer_size) {
-        uint32_t id = packet_next_index++;
-        uint32_t packet_size = MIN(current_mtu - NET_BUFFER_HEADER_SIZE, tx_buffer_size - offset);
-        pusher_temp_data[0] = id & 0xFF;
-        pusher_temp_data[1] = (id >> 8) & 0xFF;
-        pusher_temp_data[2] = index;
-        memcpy(pusher_temp_data + NET_BUFFER_HEADER_SIZE, buffer + offset, packet_size);
+    while (preroll_drop_oldest()) {
+    }
+}
 
-        offset += packet_size;
-        index++;
+// A failed notification stops the flush so a dying link doesn't stall the pusher on every frame
+static void preroll_flush_to_gatt(void)
+{
+    uint8_t *frame;
+    uint16_t size;
 
-        retry_count = 0;
-        while (retry_count < max_retries) {
-            // Try send notification
-            int err =
-                bt_gatt_notify(conn, &audio_service.attrs[1], pusher_temp_data, packet_size + NET_BUFFER_HEADER_SIZE);
-#ifdef CONFIG_OMI_ENABLE_MONITOR
-            monitor_inc_gatt_notify();
+    if (preroll_frames > 0) {
+        LOG_INF("Sending %u pre-roll frames", preroll_frames);
+    }
+    while ((size = frame_queue_get_claim(&preroll_queue, &frame)) > 0) {
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+        bool sent = push_packed_to_gatt(frame, size);
+#else
+        bool sent = push_to_gatt(frame, size);
 #endif
-
-            // Log failure
-            if (err) {
-                LOG_DBG("bt_gatt_notify failed (err %d)", err);
-                LOG_DBG("MTU: %d, packet_size: %d", current_mtu, packet_size + NET_BUFFER_HEADER_SIZE);
-                k_sleep(K_MSEC(1));
-                retry_count++;
-                continue;
-            }
-
-            // Try to send more data if possible
-            if (err == -EAGAIN || err == -ENOMEM) {
-                retry_count++;
-                continue;
-            }
-
-            // Break if success
+        frame_queue_get_finish(&preroll_queue);
+        preroll_frames--;
+        if (!sent) {
             break;
         }
+    }
+}
 
-        if (retry_count >= max_retries) {
-            LOG_ERR("Failed to send packet after %d retries", max_retries);
-            return false;
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+static void preroll_flush_to_wifi(void)
+{
+    uint8_t *frame;
+    uint16_t size;
+
+    while ((size = frame_queue_get_claim(&preroll_queue, &frame)) > 0) {
+        bool sent = push_to_wifi(frame, size);
+        frame_queue_get_finish(&preroll_queue);
+        preroll_frames--;
+        if (!sent) {
+            break;
         }
     }
+}
+#endif
 
-    return true;
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+static void preroll_flush_to_storage(void)
+{
+    uint8_t *frame;
+    uint16_t size;
+
+    while ((size = frame_queue_get_claim(&preroll_queue, &frame)) > 0) {
+        bool written = write_to_storage(frame, size);
+        frame_queue_get_finish(&preroll_queue);
+        preroll_frames--;
+        if (!written) {
+            break;
+        }
+    }
 }
+#endif
+#endif
 
-#define OPUS_PREFIX_LENGTH 1
-#define OPUS_PADDED_LENGTH 80
-#define MAX_WRITE_SIZE 440
-static uint32_t offset = 0;
-static uint16_t buffer_offset = 0;
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+// Called by the pusher; whatever is packed belongs to the side being switched away from
+static void bench_switch(bool active)
+{
+    bench_pusher_active = active;
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+    drop_packed();
+#endif
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    bench_packer.block = NULL;
+    bench_packer.offset = 0;
+#endif
+}
 
+static void bench_consume(const uint8_t *frame, uint16_t size)
+{
+    BENCH_COUNT(bench_frames);
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+    push_packed_to_gatt(frame, size);
+#else
+    push_to_gatt(frame, size);
+#endif
 #ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
-static uint8_t storage_temp_data[MAX_WRITE_SIZE];
-bool write_to_storage(void)
-{
-    uint8_t *buffer = tx_buffer + 2;
-    uint8_t packet_size = (uint8_t) (tx_buffer_size + OPUS_PREFIX_LENGTH);
-
-    // buffer_offset = buffer_offset+amount_to_fill;
-    // check if adding the new packet will cause a overflow
-    if (buffer_offset + packet_size > MAX_WRITE_SIZE - 1) {
-
-        storage_temp_data[buffer_offset] = tx_buffer_size;
-        uint8_t *write_ptr = storage_temp_data;
-        write_to_file(write_ptr, MAX_WRITE_SIZE);
-
-        buffer_offset = packet_size;
-        storage_temp_data[0] = tx_buffer_size;
-        memcpy(storage_temp_data + 1, buffer, tx_buffer_size);
-
-    } else if (buffer_offset + packet_size == MAX_WRITE_SIZE - 1) {
-        // exact frame needed
-        storage_temp_data[buffer_offset] = tx_buffer_size;
-        memcpy(storage_temp_data + buffer_offset + 1, buffer, tx_buffer_size);
-        buffer_offset = 0;
-        uint8_t *write_ptr = (uint8_t *) storage_temp_data;
-        write_to_file(write_ptr, MAX_WRITE_SIZE);
-    } else {
-        storage_temp_data[buffer_offset] = tx_buffer_size;
-        memcpy(storage_temp_data + buffer_offset + 1, buffer, tx_buffer_size);
-        buffer_offset = buffer_offset + packet_size;
+    bench_pack_frame(frame, size);
+#endif
+}
+
+void transport_bench_sink(bool on)
+{
+    if (on) {
+        atomic_clear(&bench_frames);
+        atomic_clear(&bench_packets);
+        atomic_clear(&bench_copies);
+        atomic_clear(&bench_copied_bytes);
+        atomic_clear(&bench_queue_claims);
+        atomic_clear(&bench_queue_drops);
+        atomic_clear(&bench_storage_blocks);
     }
+    atomic_set(&bench_sink, on);
+    k_sem_give(&pusher_wake);
+}
 
-#ifdef CONFIG_OMI_ENABLE_MONITOR
-    monitor_inc_storage_write();
-#endif
-    return true;
+void transport_bench_get(struct transport_bench_stats *stats)
+{
+    stats->frames = (uint32_t) atomic_get(&bench_frames);
+    stats->packets = (uint32_t) atomic_get(&bench_packets);
+    stats->copies = (uint32_t) atomic_get(&bench_copies);
+    stats->copied_bytes = (uint32_t) atomic_get(&bench_copied_bytes);
+    stats->queue_claims = (uint32_t) atomic_get(&bench_queue_claims);
+    stats->queue_drops = (uint32_t) atomic_get(&bench_queue_drops);
+    stats->storage_blocks = (uint32_t) atomic_get(&bench_storage_blocks);
 }
 #endif
 
+// How long the idle pusher may sleep
+static k_timeout_t pusher_idle_timeout(void)
+{
+    int64_t timeout_ms = -1; // until woken
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+    // Until the pending pack is due
+    if (pack.count > 0) {
+        timeout_ms = MAX(pack_started_at + AUDIO_PACK_MAX_LATENCY_MS - k_uptime_get(), 0);
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+    // Frames queued without a wake are picked up even if the events stop coming
+    if (conn_event_paced() && (timeout_ms < 0 || timeout_ms > CONN_EVENT_SYNC_STALE_MS)) {
+        timeout_ms = CONN_EVENT_SYNC_STALE_MS;
+    }
+#endif
+    return timeout_ms < 0 ? K_FOREVER : K_MSEC(timeout_ms);
+}
+
 static bool use_storage = true;
 #define MAX_FILES 10
 #define MAX_AUDIO_FILE_SIZE 300000
 static int recent_file_size_updated = 0;
 static uint8_t heartbeat_count = 0;
 
-void test_pusher(void)
+void pusher(void)
 {
-    uint32_t runs_count = 0;
-    while (1) {
-        k_sleep(K_MSEC(1));
-        struct bt_conn *conn = current_connection;
-        if (conn) {
-            conn = bt_conn_ref(conn);
+    while (!atomic_get(&pusher_stop_flag)) {
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+        if (bench_pusher_active != (bool) atomic_get(&bench_sink)) {
+            bench_switch(!bench_pusher_active);
         }
-        bool valid = true;
-        if (current_mtu < MINIMAL_PACKET_SIZE) {
-            valid = false;
-        } else if (!conn) {
-            valid = false;
-        } else if (runs_count % 100 == 0) {
-            valid = bt_gatt_is_subscribed(conn, &audio_service.attrs[1], BT_GATT_CCC_NOTIFY); // Check if subscribed
+#endif
+
+        // Check if there is a new frame
+        uint8_t *frame;
+        uint16_t frame_size = frame_queue_get_claim(&tx_queue, &frame);
+        if (frame_size == 0) {
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+            flush_packed_if_due();
+#endif
+            k_sem_take(&pusher_wake, pusher_idle_timeout());
+            continue;
         }
-        if (valid) {
-            // Expected 100 packages per seconds
-            bool sent = push_to_gatt(conn);
-            if (!sent) {
-                // k_sleep(K_MSEC(50));
-            }
+        FLIGHT_REC(FLIGHT_REC_TX_DEQUEUE, 0, frame_size);
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+        // Set again below if the frame goes out as a notification
+        atomic_clear(&conn_event_gatt);
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_progress(MONITOR_WORKER_PUSHER, MONITOR_STEP_DEQUEUED);
+#endif
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+        // Bench profiling sees every encoded frame, whichever link takes it below
+        if (usb_stream_active()) {
+            push_to_usb_stream(frame, frame_size);
         }
-        if (conn) {
-            bt_conn_unref(conn);
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        __maybe_unused uint32_t claimed_at = monitor_trace_now();
+        frame_size -= TX_TRACE_STAMP_SIZE;
+        uint32_t queued_at = sys_get_le32(frame + frame_size);
+        monitor_trace_stage(MONITOR_STAGE_TX_WAIT, queued_at);
+        monitor_deadline_check(MONITOR_DEADLINE_PUSH, queued_at);
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+        if (bench_pusher_active) {
+            bench_consume(frame, frame_size);
+            frame_queue_get_finish(&tx_queue);
+            continue;
         }
-        runs_count++;
-        k_yield();
-    }
-}
+#endif
 
-void pusher(void)
-{
-    k_msleep(500);
-    while (!atomic_get(&pusher_stop_flag)) {
-        // Check if there is a new buffer
-        if (!read_from_tx_queue()) {
-            k_sleep(K_MSEC(10));
+#ifdef CONFIG_OMI_ENABLE_ISO_AUDIO
+        // The CIS takes precedence; without one the GATT path below carries on as before
+        if (atomic_get(&iso_audio_connected)) {
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+            codec_set_offline(false);
+#endif
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+            drop_packed();
+#endif
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+            // A burst of old SDUs would only crowd out the live ones
+            preroll_discard();
+#endif
+            __maybe_unused bool iso_sent = push_to_iso(frame, frame_size);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+            if (iso_sent) {
+                monitor_trace_stage(MONITOR_STAGE_NOTIFY, claimed_at);
+            }
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+            monitor_progress(MONITOR_WORKER_PUSHER, MONITOR_STEP_SENT);
+#endif
+            frame_queue_get_finish(&tx_queue);
             continue;
         }
+#endif
 
-        // Check BT connection and subscription
-        struct bt_conn *conn = current_connection;
-        bool is_subscribed = false;
-        if (conn) {
-            conn = bt_conn_ref(conn);
-            if (current_mtu >= MINIMAL_PACKET_SIZE) {
-                is_subscribed = bt_gatt_is_subscribed(conn, &audio_service.attrs[1], BT_GATT_CCC_NOTIFY);
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+        // The Wi-Fi link comes next; a frame it doesn't take carries on to GATT or storage below
+        if (wifi_is_live() && is_wifi_transport_ready()) {
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+            codec_set_offline(false);
+#endif
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+            // Frames packed for GATT are dropped, as when the CIS takes over
+            drop_packed();
+#endif
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+            preroll_flush_to_wifi();
+#endif
+            if (push_to_wifi(frame, frame_size)) {
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+                monitor_trace_stage(MONITOR_STAGE_NOTIFY, claimed_at);
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+                monitor_progress(MONITOR_WORKER_PUSHER, MONITOR_STEP_SENT);
+#endif
+                frame_queue_get_finish(&tx_queue);
+                continue;
             }
         }
+#endif
 
-        if (conn && is_subscribed) {
-            // Push to GATT if connected and subscribed
-            push_to_gatt(conn);
-            bt_conn_unref(conn);
-        } else if (!conn) {
+        // Check BT connections and subscriptions
+        bool is_connected_now = current_connection != NULL;
+        if (is_connected_now && audio_sinks_collect()) {
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+            codec_set_offline(false);
+#endif
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+            atomic_set(&conn_event_gatt, 1);
+#endif
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+            preroll_flush_to_gatt();
+#endif
+            // Push to GATT, once for every subscribed central
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+            push_packed_to_gatt(frame, frame_size);
+#else
+            __maybe_unused bool sent = push_to_gatt(frame, frame_size);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+            if (sent) {
+                monitor_trace_stage(MONITOR_STAGE_NOTIFY, claimed_at);
+            }
+#endif
+#endif
+            audio_sinks_release();
+        } else if (!is_connected_now) {
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+            drop_packed();
+#endif
 #ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
-            // No BT connection, write to storage
-            if (get_file_size() < MAX_STORAGE_BYTES && is_sd_on()) {
+            // No BT connection, write to storage (encoded with the offline profile from here on)
+            codec_set_offline(true);
+            if (sd_get_room() >= frame_size && sd_accepts_writes()) {
                 storage_full_warned = false;
-                write_to_storage();
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+                preroll_flush_to_storage();
+#endif
+                write_to_storage(frame, frame_size);
             } else {
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+                discard_records();
+#endif
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+                // Keep the latest seconds until the card is mounted or the phone is back
+                preroll_put(frame, frame_size);
+#elif defined(CONFIG_OMI_ENABLE_MONITOR)
+                monitor_add_drops(MONITOR_DROP_STORAGE_FULL, 1);
+#endif
                 if (!storage_full_warned) {
                     LOG_WRN("Storage full, stopping offline storage");
                     storage_full_warned = true;
                 }
             }
+#elif defined(CONFIG_OMI_ENABLE_PREROLL)
+            preroll_put(frame, frame_size);
 #endif
         } else {
-            // Connected but not subscribed, just sleep (buffer will be retried)
-            if (conn) bt_conn_unref(conn);
-            k_sleep(K_MSEC(10));
+            // Connected but not subscribed, drop or hold the frame (the CCC handler wakes us on subscribe)
+#ifdef CONFIG_OMI_ENABLE_AUDIO_PACKING
+            drop_packed();
+#endif
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+            preroll_put(frame, frame_size);
+#endif
         }
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_progress(MONITOR_WORKER_PUSHER, MONITOR_STEP_SENT);
+#endif
+        frame_queue_get_finish(&tx_queue);
     }
 }
 
@@ -910,19 +2600,26 @@ int transport_off()
 {
     // Stop pusher thread when transport is turned off
     atomic_set(&pusher_stop_flag, 1);
+    k_sem_give(&pusher_wake);
     int ret = k_thread_join(&pusher_thread, K_MSEC(500));
     if (ret != 0) {
         LOG_WRN("Pusher thread did not terminate in time (err %d)", ret);
     }
 
     // First disconnect any active connections
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        if (centrals[i].conn != NULL) {
+            bt_conn_disconnect(centrals[i].conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        }
+    }
     if (current_connection != NULL) {
-        bt_conn_disconnect(current_connection, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
         bt_conn_unref(current_connection);
         current_connection = NULL;
     }
 
     // Stop advertising
+    adv_enabled = false;
+    k_work_cancel_delayable(&adv_work);
     int err = bt_le_adv_stop();
     if (err) {
         LOG_ERR("Failed to stop Bluetooth advertising %d", err);
@@ -971,8 +2668,20 @@ int transport_start()
     }
 #endif
 
+#ifdef CONFIG_OMI_ENABLE_TUNING
+    tune_register("tx_queue_frames", &tx_queue_frames, 4, NETWORK_RING_BUF_SIZE, "live audio queue depth, frames");
+    tune_register("notify_retries", &notify_max_retries, 1, 10, "tries per audio notification");
+#endif
+
+    for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+        k_sem_init(&centrals[i].notify_credits, AUDIO_NOTIFY_CREDITS, AUDIO_NOTIFY_CREDITS);
+        k_work_init_delayable(&centrals[i].setup_work, conn_setup_next);
+        centrals[i].setup_step = CONN_SETUP_DONE;
+    }
+
     // Configure callbacks
     bt_conn_cb_register(&_callback_references);
+    bt_gatt_cb_register(&_gatt_callback_references);
 
     // Enable Bluetooth
     err = bt_enable(NULL);
@@ -980,7 +2689,17 @@ int transport_start()
         LOG_ERR("Transport bluetooth init failed (err %d)", err);
         return err;
     }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_BT_ENABLE);
+#endif
     LOG_INF("Transport bluetooth initialized");
+#ifdef CONFIG_OMI_ENABLE_CONN_EVENT_SYNC
+    err = bt_radio_notification_conn_cb_register(&conn_event_cb, CONN_EVENT_PREPARE_US);
+    if (err) {
+        // Not fatal, the pusher then runs on every queued frame
+        LOG_ERR("Failed to hook the connection events (err %d)", err);
+    }
+#endif
     //  Enable accelerometer
 #ifdef CONFIG_OMI_ENABLE_ACCELEROMETER
     err = accel_start();
@@ -1021,13 +2740,49 @@ int transport_start()
     bt_gatt_service_register(&settings_service);
     bt_gatt_service_register(&features_service);
     bt_gatt_service_register(&time_sync_service);
+#ifdef CONFIG_OMI_ENABLE_BENCHMARK
+    benchmark_init();
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_service_init();
+#endif
+#ifdef CONFIG_OMI_ENABLE_GOVERNOR
+    governor_service_init();
+#endif
+#ifdef CONFIG_OMI_ENABLE_DELTA_DFU
+    delta_dfu_init();
+#endif
+#ifdef CONFIG_OMI_ENABLE_SMP_DFU
+    smp_dfu_init();
+#endif
 
 #ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
     // Register storage service for offline audio
-    memset(storage_temp_data, 0, OPUS_PADDED_LENGTH * 4);
     bt_gatt_service_register(&storage_service);
 #endif
-    err = bt_le_adv_start(BT_LE_ADV_CONN, bt_ad, ARRAY_SIZE(bt_ad), bt_sd, ARRAY_SIZE(bt_sd));
+#ifdef CONFIG_OMI_ENABLE_ISO_AUDIO
+    err = bt_iso_server_register(&iso_audio_server);
+    if (err) {
+        LOG_ERR("Failed to register audio ISO server (err %d)", err);
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_FAST_RECONNECT
+    // Bonds, the GATT database hash and the CCCs of bonded phones. Loaded once every service is
+    // registered, so the restored subscriptions find their attributes
+    err = settings_load_subtree("bt");
+    if (err) {
+        LOG_ERR("Failed to load Bluetooth settings (err %d)", err);
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_NFC_PAIRING
+    // After the identity is loaded, the tag carries the address phones will connect to
+    err = nfc_init();
+    if (err) {
+        LOG_ERR("NFC pairing unavailable (err %d)", err);
+    }
+#endif
+    adv_enabled = true;
+    err = adv_start_fast();
     if (err) {
         LOG_ERR("Transport advertising failed to start (err %d)", err);
         return err;
@@ -1044,17 +2799,14 @@ int transport_start()
         LOG_INF("Battery initialized");
     }
 
-    k_work_schedule(&battery_work, K_MSEC(3000));
+    k_work_schedule_for_queue(&housekeeping_work_q, &battery_work, K_MSEC(3000));
 #endif
 
-    // Start pusher
-    ring_buf_init(&ring_buf, sizeof(tx_queue), tx_queue);
-    if (ring_buf_is_empty(&ring_buf)) {
-        LOG_INF("Ring buffer successfully initialized");
-    } else {
-        LOG_ERR("Ring buffer initialization failed");
-        return -1;
-    }
+    // Start pusher, which sends or stores whatever was captured while Bluetooth came up
+    transport_queue_init();
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+    frame_queue_init(&preroll_queue, preroll_buf, sizeof(preroll_buf));
+#endif
 
     struct k_thread *thread = k_thread_create(&pusher_thread,
                                               pusher_stack,
@@ -1063,13 +2815,17 @@ int transport_start()
                                               NULL,
                                               NULL,
                                               NULL,
-                                              K_PRIO_PREEMPT(7),
+                                              K_PRIO_PREEMPT(THREAD_PRIO_PUSHER),
                                               0,
                                               K_NO_WAIT);
     if (thread == NULL) {
         LOG_ERR("Failed to create pusher thread");
         return -1;
     }
+    k_thread_name_set(thread, "pusher");
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_TRANSPORT);
+#endif
 
     LOG_INF("Pusher successfully started");
 
@@ -1081,9 +2837,77 @@ struct bt_conn *get_current_connection()
     return current_connection;
 }
 
-int broadcast_audio_packets(uint8_t *buffer, size_t size)
+void transport_get_tx_stats(struct transport_tx_stats *stats)
+{
+    // Above 100 only right after the depth was tuned down
+    stats->queue_usage = (uint8_t) MIN(frame_queue_used(&tx_queue) * 100 / tx_queue_capacity(), 100);
+    stats->notify_failures = (uint32_t) atomic_get(&tx_notify_failures);
+    stats->queue_drops = (uint32_t) atomic_get(&tx_queue_drops);
+    stats->frames_sent = (uint32_t) atomic_get(&tx_frames_sent);
+    stats->frames_lost = (uint32_t) atomic_get(&tx_frames_lost);
+}
+
+bool transport_audio_pending(void)
+{
+    return frame_queue_used(&tx_queue) > 0;
+}
+
+bool transport_audio_wanted(void)
+{
+    // Would be rejected by write_to_tx_queue() whichever sink is up. Frames run far below the worst
+    // case at the usual bitrates, so the room is checked for one as long as the last.
+    uint32_t expected = (uint32_t) atomic_get(&tx_last_frame_size) + FRAME_TIMESTAMP_SIZE + TX_TRACE_STAMP_SIZE + 2;
+    if (frame_queue_used(&tx_queue) + expected > tx_queue_capacity()) {
+        atomic_inc(&tx_queue_drops);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_TX_QUEUE_FULL, 1);
+#endif
+        return false;
+    }
+#ifdef CONFIG_OMI_ENABLE_PREROLL
+    // Every frame may be the start of what the next sink gets
+    return true;
+#else
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+    if (atomic_get(&bench_sink)) {
+        return true;
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+    if (usb_stream_active()) {
+        return true;
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_ISO_AUDIO
+    if (atomic_get(&iso_audio_connected)) {
+        return true;
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_WIFI_LIVE_AUDIO
+    if (wifi_is_live() && is_wifi_transport_ready()) {
+        return true;
+    }
+#endif
+    if (current_connection != NULL) {
+        // As the pusher's sinks, without taking references; a central (un)subscribing races harmlessly
+        for (int i = 0; i < CONFIG_BT_MAX_CONN; i++) {
+            if (centrals[i].conn && atomic_get(&centrals[i].audio_notifying)) {
+                return true;
+            }
+        }
+        return false;
+    }
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    return sd_accepts_writes() && sd_get_room() >= CODEC_OUTPUT_MAX_BYTES;
+#else
+    return false;
+#endif
+#endif
+}
+
+int broadcast_audio_packets(uint8_t *buffer, size_t size, uint32_t capture_ms)
 {
-    if (!write_to_tx_queue(buffer, size)) {
+    if (!write_to_tx_queue(buffer, size, capture_ms)) {
         return -1;
     }
     return 0;
@@ -1,6 +1,9 @@
 #ifndef TRANSPORT_H
 #define TRANSPORT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/bluetooth/gatt.h>
 #include <zephyr/drivers/sensor.h>
 #ifdef CONFIG_OMI_ENABLE_BATTERY
 extern uint8_t battery_percentage;
@@ -14,6 +17,14 @@ extern uint8_t battery_percentage;
  */
 int transport_start();
 
+/**
+ * @brief Prepare the audio TX queue
+ *
+ * Lets the codec queue frames before transport_start(), so capture can begin while
+ * Bluetooth is still coming up. Called by transport_start() if not done before.
+ */
+void transport_queue_init(void);
+
 /**
  * @brief Turn off the BLE transport
  *
@@ -21,14 +32,142 @@ int transport_start();
  */
 int transport_off();
 
+/**
+ * @brief Restart the advertising schedule at the fast interval
+ *
+ * For user activity that suggests a phone is about to connect, such as a button press.
+ * Does nothing while connected or after transport_off().
+ */
+void transport_advertise_fast(void);
+
+/**
+ * @brief Advertising stages, in the order the schedule steps through them
+ */
+enum transport_adv_stage {
+    TRANSPORT_ADV_FAST,
+    TRANSPORT_ADV_STANDARD,
+    TRANSPORT_ADV_SLOW,
+};
+
+/**
+ * @brief Skip the advertising stages faster than stage, for the performance governor
+ *
+ * A running schedule moves to the floor straight away, TRANSPORT_ADV_FAST lifts it.
+ */
+void transport_set_adv_floor(enum transport_adv_stage stage);
+
 /**
  * @brief Broadcast audio packets over BLE
  *
  * @param buffer Buffer containing audio data
  * @param size Size of the audio data
+ * @param capture_ms Capture timestamp of the frame, sent along with CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
  * @return 0 if successful, negative errno code if error
  */
-int broadcast_audio_packets(uint8_t *buffer, size_t size);
+int broadcast_audio_packets(uint8_t *buffer, size_t size, uint32_t capture_ms);
+
+struct transport_tx_stats {
+    uint8_t queue_usage;      // Fill level of the audio tx queue in percent
+    uint32_t notify_failures; // Failed audio notifications since boot, including retries
+    uint32_t queue_drops;     // Frames rejected by a full tx queue since boot
+    uint32_t frames_sent;     // Audio frames fully delivered to the controller since boot
+    uint32_t frames_lost;     // Audio frames abandoned after all notify retries since boot
+};
+
+/**
+ * @brief Get a snapshot of the audio transmit path
+ *
+ * Counters are monotonic, so callers detect new failures by comparing snapshots.
+ *
+ * @param stats Filled with the current values
+ */
+void transport_get_tx_stats(struct transport_tx_stats *stats);
+
+/**
+ * @brief Send a notification from any service other than audio and offline sync
+ *
+ * Draws on CONTROL_NOTIFY_CREDITS TX contexts of its own, so these notifications never take the
+ * ones reserved for audio. Never blocks: a notification that finds the pool empty is not sent.
+ *
+ * @param conn Connection, or NULL for every subscribed connection
+ * @param attr Characteristic value attribute
+ * @param data Value, copied before returning
+ * @param len Its length
+ * @return 0 if successful, -ENOMEM if the pool is empty, other negative errno code if error
+ */
+int transport_notify(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *data, uint16_t len);
+
+/**
+ * @brief Check whether live audio is waiting to be sent
+ *
+ * Bulk transfers should back off while this is true, so live frames always go first.
+ *
+ * @return true if the audio tx queue is not empty
+ */
+bool transport_audio_pending(void);
+
+/**
+ * @brief Check whether an encoded frame would reach any sink right now
+ *
+ * The codec skips encoding while this is false: connected with nobody subscribed, storage full
+ * or unmounted while disconnected, or the tx queue too full for a frame as long as the last one
+ * queued (counted as a tx queue drop here). Always true with CONFIG_OMI_ENABLE_PREROLL unless the queue is full, the
+ * pre-roll holds frames for whichever sink comes next.
+ *
+ * @return true if a frame queued now would be sent, stored or held
+ */
+bool transport_audio_wanted(void);
+
+/**
+ * @brief Get the stream modes a central enabled through the capabilities characteristic
+ *
+ * @param conn Connection
+ * @return omi_mode_t bits, 0 for an unknown connection
+ */
+uint32_t transport_get_modes(struct bt_conn *conn);
+
+#ifdef CONFIG_OMI_ENABLE_PIPELINE_BENCHMARK
+struct transport_bench_stats {
+    uint32_t frames;         // Frames the pusher took off the tx queue
+    uint32_t packets;        // Notifications framed for the mocked GATT layer
+    uint32_t copies;         // Payload memcpy calls from the codec output to the notification / storage block
+    uint32_t copied_bytes;   // Bytes moved by those copies
+    uint32_t queue_claims;   // Slots claimed in the tx queue
+    uint32_t queue_drops;    // Frames rejected by a full tx queue
+    uint32_t storage_blocks; // Storage blocks filled by the packing (not written to the card)
+};
+
+/**
+ * @brief Divert the pusher into the pipeline benchmark
+ *
+ * While on, every queued frame is framed for GATT as if a phone was subscribed with a
+ * PIPELINE_BENCH_MTU link, and packed into storage blocks as offline storage would, but nothing
+ * is notified or written to the card. Turning it on resets the counters.
+ *
+ * @param on true to divert, false to restore the live sinks
+ */
+void transport_bench_sink(bool on);
+
+/**
+ * @brief Get the counters of the current (or last) benchmark run
+ */
+void transport_bench_get(struct transport_bench_stats *stats);
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_IMU_RECORDING
+/**
+ * @brief Queue a tagged record for the offline recording
+ *
+ * The pusher writes it into the same storage blocks as the audio, ahead of the next frame.
+ * Call from one thread only.
+ *
+ * @param tag STORAGE_RECORD_* tag
+ * @param data Record payload
+ * @param size Payload length, 1 to 255 bytes
+ * @return true if queued, false if the queue is full
+ */
+bool write_record_to_storage(uint8_t tag, const uint8_t *data, uint8_t size);
+#endif
 
 /**
  * @brief Get the current BLE connection
@@ -37,4 +176,13 @@ int broadcast_audio_packets(uint8_t *buffer, size_t size);
  */
 struct bt_conn *get_current_connection();
 
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+struct warm_link;
+
+/**
+ * @brief Copy the link policy of the last connection for the next warm wake
+ */
+void transport_warm_save(struct warm_link *link);
+#endif
+
 #endif // TRANSPORT_H
@@ -0,0 +1,159 @@
+#include "tune.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#ifdef CONFIG_SHELL
+#include <zephyr/shell/shell.h>
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "monitor.h"
+#endif
+
+LOG_MODULE_REGISTER(tune, CONFIG_LOG_DEFAULT_LEVEL);
+
+struct tune_param {
+    const char *name;
+    volatile uint32_t *value;
+    uint32_t def;
+    uint32_t min;
+    uint32_t max;
+    const char *help;
+};
+
+// Filled once at startup by the owning modules, read-only afterwards
+static struct tune_param params[TUNE_MAX_PARAMS];
+static uint8_t param_count = 0;
+static K_MUTEX_DEFINE(tune_lock);
+
+static struct tune_param *tune_find(const char *name)
+{
+    for (int i = 0; i < param_count; i++) {
+        if (!strcmp(params[i].name, name)) {
+            return &params[i];
+        }
+    }
+    return NULL;
+}
+
+int tune_register(const char *name, volatile uint32_t *value, uint32_t min, uint32_t max, const char *help)
+{
+    if (*value < min || *value > max) {
+        LOG_ERR("Tunable %s default %u outside %u..%u", name, *value, min, max);
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&tune_lock, K_FOREVER);
+    if (param_count == TUNE_MAX_PARAMS) {
+        k_mutex_unlock(&tune_lock);
+        LOG_ERR("No room for tunable %s", name);
+        return -ENOMEM;
+    }
+    params[param_count++] = (struct tune_param) {
+        .name = name,
+        .value = value,
+        .def = *value,
+        .min = min,
+        .max = max,
+        .help = help,
+    };
+    k_mutex_unlock(&tune_lock);
+    return 0;
+}
+
+int tune_set(const char *name, uint32_t value)
+{
+    struct tune_param *param = tune_find(name);
+    if (!param) {
+        return -ENOENT;
+    }
+    if (value < param->min || value > param->max) {
+        return -ERANGE;
+    }
+
+    *param->value = value;
+    LOG_INF("Tunable %s = %u", name, value);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    // The next "monitor metrics" then covers the new value only
+    monitor_reset();
+#endif
+    return 0;
+}
+
+void tune_reset(void)
+{
+    for (int i = 0; i < param_count; i++) {
+        *params[i].value = params[i].def;
+    }
+    LOG_INF("Tunables reset to defaults");
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_reset();
+#endif
+}
+
+#ifdef CONFIG_SHELL
+static void tune_print(const struct shell *sh, const struct tune_param *param)
+{
+    shell_print(sh, "%-22s %8u  (%u..%u, default %u)  %s", param->name, *param->value, param->min, param->max,
+                param->def, param->help);
+}
+
+static int cmd_tune_list(const struct shell *sh, size_t argc, char **argv)
+{
+    for (int i = 0; i < param_count; i++) {
+        tune_print(sh, &params[i]);
+    }
+    return 0;
+}
+
+static int cmd_tune_get(const struct shell *sh, size_t argc, char **argv)
+{
+    struct tune_param *param = tune_find(argv[1]);
+    if (!param) {
+        shell_error(sh, "Unknown tunable %s", argv[1]);
+        return -ENOENT;
+    }
+    tune_print(sh, param);
+    return 0;
+}
+
+static int cmd_tune_set(const struct shell *sh, size_t argc, char **argv)
+{
+    char *end;
+    uint32_t value = (uint32_t) strtoul(argv[2], &end, 0);
+    if (*end != '\0') {
+        shell_error(sh, "Not a number: %s", argv[2]);
+        return -EINVAL;
+    }
+
+    int err = tune_set(argv[1], value);
+    if (err == -ENOENT) {
+        shell_error(sh, "Unknown tunable %s", argv[1]);
+    } else if (err == -ERANGE) {
+        struct tune_param *param = tune_find(argv[1]);
+        shell_error(sh, "%s takes %u..%u", param->name, param->min, param->max);
+    } else {
+        shell_print(sh, "%s = %u", argv[1], value);
+    }
+    return err;
+}
+
+static int cmd_tune_reset(const struct shell *sh, size_t argc, char **argv)
+{
+    tune_reset();
+    shell_print(sh, "All tunables back to their defaults");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(tune_cmds,
+                               SHELL_CMD(list, NULL, "Show every tunable with its bounds", cmd_tune_list),
+                               SHELL_CMD_ARG(get, NULL, "Show <name>", cmd_tune_get, 2, 0),
+                               SHELL_CMD_ARG(set, NULL, "Set <name> <value> and reset the metrics", cmd_tune_set, 3,
+                                             0),
+                               SHELL_CMD(reset, NULL, "Restore the defaults", cmd_tune_reset),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(tune, &tune_cmds, "Runtime pipeline tunables", NULL);
+#endif
@@ -0,0 +1,49 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdint.h>
+
+/*
+ * Runtime tunables: pipeline parameters that can be changed from the shell without a reflash.
+ *
+ * A module keeps each parameter in its own variable, declared with TUNABLE and initialized to the
+ * compile-time default, and registers it once at startup. Without CONFIG_OMI_ENABLE_TUNING the
+ * variable is const, so the compiler folds it back into the constant it replaced.
+ *
+ * Values are single words, written by the shell and read by their owner once per use, so a change
+ * takes effect at the next batch, frame or window. The bounds are whatever the owner can take at
+ * any moment, buffers sized by a default are never grown past it.
+ */
+#ifdef CONFIG_OMI_ENABLE_TUNING
+#define TUNABLE static volatile
+#else
+#define TUNABLE static const
+#endif
+
+#define TUNE_MAX_PARAMS 16
+
+/**
+ * @brief Register a tunable, its current value becomes the default restored by "tune reset"
+ *
+ * @param name Shell name, a string literal
+ * @param value The module's TUNABLE variable
+ * @param min Lowest accepted value
+ * @param max Highest accepted value
+ * @param help One line for "tune list", a string literal
+ * @return 0 on success, -ENOMEM if the registry is full, -EINVAL if the default is out of bounds
+ */
+int tune_register(const char *name, volatile uint32_t *value, uint32_t min, uint32_t max, const char *help);
+
+/**
+ * @brief Set a tunable by name
+ *
+ * @return 0 on success, -ENOENT for an unknown name, -ERANGE if the value is out of bounds
+ */
+int tune_set(const char *name, uint32_t value);
+
+/**
+ * @brief Restore every tunable to its default
+ */
+void tune_reset(void);
+
+#endif // TUNE_H
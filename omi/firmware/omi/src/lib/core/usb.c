@@ -0,0 +1,259 @@
+#include "usb.h"
+
+#include <errno.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/ring_buffer.h>
+#include <zephyr/usb/usb_device.h>
+
+#include "config.h"
+#if defined(CONFIG_OMI_ENABLE_USB_STREAM) && defined(CONFIG_OMI_ENABLE_MONITOR)
+#include "monitor.h"
+#endif
+
+LOG_MODULE_REGISTER(usb, CONFIG_LOG_DEFAULT_LEVEL);
+
+#ifndef CONFIG_OMI_ENABLE_USB
+#error "CONFIG_OMI_ENABLE_USB_SYNC and CONFIG_OMI_ENABLE_USB_STREAM need CONFIG_OMI_ENABLE_USB"
+#endif
+#if defined(CONFIG_OMI_ENABLE_USB_SYNC) && !defined(CONFIG_OMI_ENABLE_OFFLINE_STORAGE)
+#error "CONFIG_OMI_ENABLE_USB_SYNC needs CONFIG_OMI_ENABLE_OFFLINE_STORAGE"
+#endif
+#if !defined(CONFIG_USB_CDC_ACM) || !defined(CONFIG_UART_INTERRUPT_DRIVEN) || !defined(CONFIG_UART_LINE_CTRL)
+#error "The USB port needs CONFIG_USB_CDC_ACM, CONFIG_UART_INTERRUPT_DRIVEN and CONFIG_UART_LINE_CTRL"
+#endif
+
+#define USB_CMD_MAX 10 // longest storage command
+#define USB_MSG_HEADER 3
+
+static const struct device *const cdc_dev = DEVICE_DT_GET(DT_NODELABEL(cdc_acm_uart0));
+
+RING_BUF_DECLARE(tx_ring, USB_TX_RING_BYTES);
+static K_SEM_DEFINE(tx_space, 0, 1);
+// Held for a whole message, so a sync chunk and a stream message never interleave
+static K_MUTEX_DEFINE(tx_lock);
+
+static uint8_t rx_cmd[USB_CMD_MAX];
+static uint8_t rx_len = 0; // length byte of the command being received, 0 while waiting for one
+static uint8_t rx_got = 0;
+
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+static usb_sync_cmd_cb_t cmd_cb;
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+static atomic_t stream_on = ATOMIC_INIT(0);
+static atomic_t stream_dropped = ATOMIC_INIT(0);
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+static void stream_metrics_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(stream_metrics_work, stream_metrics_handler);
+#endif
+#endif
+
+static bool port_open(void)
+{
+    // The host raises DTR when it opens the port, which it can only do once the device is configured
+    uint32_t dtr = 0;
+    return uart_line_ctrl_get(cdc_dev, UART_LINE_CTRL_DTR, &dtr) == 0 && dtr;
+}
+
+static void handle_cmd(const uint8_t *cmd, uint8_t len)
+{
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+    if (cmd[0] == USB_STREAM_COMMAND && len == 2) {
+        atomic_set(&stream_on, cmd[1] != 0);
+        atomic_clear(&stream_dropped);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        k_work_reschedule(&stream_metrics_work, K_NO_WAIT);
+#endif
+        return;
+    }
+#endif
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+    if (cmd_cb) {
+        cmd_cb(cmd, len);
+    }
+#endif
+}
+
+// Commands arrive as [length][command], a length out of range is skipped byte by byte
+static void rx_byte(uint8_t byte)
+{
+    if (rx_len == 0) {
+        if (byte > 0 && byte <= USB_CMD_MAX) {
+            rx_len = byte;
+            rx_got = 0;
+        }
+        return;
+    }
+    rx_cmd[rx_got++] = byte;
+    if (rx_got == rx_len) {
+        handle_cmd(rx_cmd, rx_len);
+        rx_len = 0;
+    }
+}
+
+static void cdc_isr(const struct device *dev, void *user_data)
+{
+    while (uart_irq_update(dev) && uart_irq_is_pending(dev)) {
+        if (uart_irq_rx_ready(dev)) {
+            uint8_t buf[64];
+            int n = uart_fifo_read(dev, buf, sizeof(buf));
+            for (int i = 0; i < n; i++) {
+                rx_byte(buf[i]);
+            }
+        }
+        if (uart_irq_tx_ready(dev)) {
+            uint8_t *data;
+            uint32_t n = ring_buf_get_claim(&tx_ring, &data, USB_TX_RING_BYTES);
+            if (n == 0) {
+                uart_irq_tx_disable(dev);
+                continue;
+            }
+            int sent = uart_fifo_fill(dev, data, n);
+            ring_buf_get_finish(&tx_ring, sent > 0 ? sent : 0);
+            k_sem_give(&tx_space);
+        }
+    }
+}
+
+static int tx_put(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        uint32_t n = ring_buf_put(&tx_ring, data, len);
+        if (n > 0) {
+            uart_irq_tx_enable(cdc_dev);
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (!port_open()) {
+            ring_buf_reset(&tx_ring);
+            return -ENOTCONN;
+        }
+        if (k_sem_take(&tx_space, K_MSEC(USB_TX_TIMEOUT_MS)) != 0 && ring_buf_space_get(&tx_ring) == 0) {
+            return -ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+int usb_send(uint8_t type, const void *head, size_t head_len, const void *data, size_t len)
+{
+    if (!port_open()) {
+        return -ENOTCONN;
+    }
+    uint8_t header[USB_MSG_HEADER] = {type};
+    sys_put_le16(head_len + len, &header[1]);
+
+    k_mutex_lock(&tx_lock, K_FOREVER);
+    int err = tx_put(header, sizeof(header));
+    if (!err && head_len) {
+        err = tx_put(head, head_len);
+    }
+    if (!err) {
+        err = tx_put(data, len);
+    }
+    k_mutex_unlock(&tx_lock);
+    return err;
+}
+
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+void usb_sync_set_cmd_handler(usb_sync_cmd_cb_t cb)
+{
+    cmd_cb = cb;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+bool usb_stream_active(void)
+{
+    if (!atomic_get(&stream_on)) {
+        return false;
+    }
+    // Closing the port ends the stream, the next host starts it again
+    if (!port_open()) {
+        atomic_clear(&stream_on);
+        return false;
+    }
+    return true;
+}
+
+bool usb_stream_send(uint8_t type, const void *head, size_t head_len, const void *data, size_t len)
+{
+    bool queued = false;
+    if (k_mutex_lock(&tx_lock, K_NO_WAIT) == 0) {
+        // Only messages that fit whole go in, the ISR only ever makes more room meanwhile
+        if (ring_buf_space_get(&tx_ring) >= USB_MSG_HEADER + head_len + len) {
+            uint8_t header[USB_MSG_HEADER] = {type};
+            sys_put_le16(head_len + len, &header[1]);
+            ring_buf_put(&tx_ring, header, sizeof(header));
+            if (head_len) {
+                ring_buf_put(&tx_ring, head, head_len);
+            }
+            ring_buf_put(&tx_ring, data, len);
+            uart_irq_tx_enable(cdc_dev);
+            queued = true;
+        }
+        k_mutex_unlock(&tx_lock);
+    }
+    if (!queued) {
+        atomic_inc(&stream_dropped);
+    }
+    return queued;
+}
+
+uint16_t usb_stream_take_dropped(void)
+{
+    atomic_val_t dropped = atomic_clear(&stream_dropped);
+    return (uint16_t) MIN(dropped, UINT16_MAX);
+}
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+static void stream_metrics_handler(struct k_work *work)
+{
+    if (!usb_stream_active()) {
+        return;
+    }
+    struct monitor_snapshot snapshot;
+    monitor_get_snapshot(&snapshot);
+    usb_stream_send(USB_STREAM_MSG_METRICS, NULL, 0, &snapshot, sizeof(snapshot));
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    struct monitor_stage_stats stages[MONITOR_STAGE_COUNT];
+    for (int stage = 0; stage < MONITOR_STAGE_COUNT; stage++) {
+        monitor_get_stage_stats(stage, &stages[stage]);
+    }
+    struct usb_stream_stages head = {
+        .version = USB_STREAM_STAGES_VERSION,
+        .count = MONITOR_STAGE_COUNT,
+        .stage_size = sizeof(struct monitor_stage_stats),
+    };
+    usb_stream_send(USB_STREAM_MSG_STAGES, &head, sizeof(head), stages, sizeof(stages));
+#endif
+    k_work_schedule(&stream_metrics_work, K_MSEC(USB_STREAM_METRICS_MS));
+}
+#endif
+#endif
+
+int init_usb()
+{
+    if (!device_is_ready(cdc_dev)) {
+        LOG_ERR("USB CDC ACM port not ready");
+        return -ENODEV;
+    }
+    uart_irq_callback_set(cdc_dev, cdc_isr);
+
+    // Enumerates whenever the charging cable is plugged into a host
+    int err = usb_enable(NULL);
+    if (err && err != -EALREADY) {
+        LOG_ERR("Failed to enable USB (%d)", err);
+        return err;
+    }
+    uart_irq_rx_enable(cdc_dev);
+    LOG_INF("USB port ready");
+    return 0;
+}
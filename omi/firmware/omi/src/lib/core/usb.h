@@ -1,6 +1,105 @@
 #ifndef USB_H
 #define USB_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 int init_usb();
 
-#endif
\ No newline at end of file
+#if defined(CONFIG_OMI_ENABLE_USB_SYNC) || defined(CONFIG_OMI_ENABLE_USB_STREAM)
+
+/*
+ * USB CDC ACM port, for offline sync while the device charges on its cable and for bench profiling.
+ *
+ * Host to device: [length u8][command]. Storage commands are as written to the storage
+ * characteristic; [USB_STREAM_COMMAND][1 = on, 0 = off] switches the profiling stream.
+ * Device to host: [type u8][length u16 LE][payload] messages, whole messages never interleave.
+ */
+#define USB_SYNC_MSG_RESULT 0x01    // the result byte the storage characteristic would notify
+#define USB_SYNC_MSG_DATA 0x02      // the sync frame header (FRAMING_COMMAND layout), then the audio bytes
+#define USB_STREAM_MSG_FRAME 0x03   // struct usb_stream_frame, then the encoded frame
+#define USB_STREAM_MSG_TRACE 0x04   // struct flight_rec_header, then struct flight_rec_event entries
+#define USB_STREAM_MSG_METRICS 0x05 // struct monitor_snapshot
+#define USB_STREAM_MSG_STAGES 0x06  // struct usb_stream_stages, then struct monitor_stage_stats per stage
+
+#define USB_STREAM_COMMAND 0xF0
+
+/**
+ * @brief Send one message to the host
+ *
+ * Blocks until the message is queued for the USB endpoint, head and data are sent back to back.
+ *
+ * @param type Message type
+ * @param head Start of the payload, may be NULL if head_len is 0
+ * @param head_len Its length
+ * @param data Rest of the payload
+ * @param len Its length
+ * @return 0 if successful, -ENOTCONN if the host closed the port, -ETIMEDOUT if it stopped reading
+ */
+int usb_send(uint8_t type, const void *head, size_t head_len, const void *data, size_t len);
+
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_USB_SYNC
+
+/**
+ * @brief Called from the USB interrupt with each storage command the host sent
+ */
+typedef void (*usb_sync_cmd_cb_t)(const uint8_t *cmd, uint8_t len);
+
+/**
+ * @brief Set the handler for storage commands from the host
+ */
+void usb_sync_set_cmd_handler(usb_sync_cmd_cb_t cb);
+
+#endif // CONFIG_OMI_ENABLE_USB_SYNC
+
+#ifdef CONFIG_OMI_ENABLE_USB_STREAM
+
+/**
+ * @brief Precedes each encoded frame mirrored by the pusher, little endian
+ */
+struct usb_stream_frame {
+    uint32_t seq;        // counts every frame the pusher took off the TX queue since the stream started
+    uint32_t cycles;     // k_cycle_get_32() when it did, the clock of the trace events
+    uint32_t capture_ms; // capture time with CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS, 0 otherwise
+    uint16_t dropped;    // stream messages lost to a full endpoint since the previous frame
+} __attribute__((packed));
+
+#define USB_STREAM_STAGES_VERSION 1
+
+/**
+ * @brief Precedes the latency stages (CONFIG_OMI_ENABLE_LATENCY_TRACE)
+ *
+ * Stages are in enum monitor_stage order. New stages only ever go at the end, so a host reads the
+ * ones it knows and skips the rest; the version changes when a stage or the stats layout does.
+ */
+struct usb_stream_stages {
+    uint8_t version;    // USB_STREAM_STAGES_VERSION
+    uint8_t count;      // stages that follow
+    uint8_t stage_size; // sizeof(struct monitor_stage_stats)
+} __attribute__((packed));
+
+/**
+ * @brief Check whether a host has turned the profiling stream on
+ */
+bool usb_stream_active(void);
+
+/**
+ * @brief Send one stream message if it fits right away, otherwise drop it
+ *
+ * Never blocks, so the pusher and the flight recorder can call it on their hot paths.
+ *
+ * @return true if the message was queued
+ */
+bool usb_stream_send(uint8_t type, const void *head, size_t head_len, const void *data, size_t len);
+
+/**
+ * @brief Stream messages dropped since the last call, for struct usb_stream_frame
+ */
+uint16_t usb_stream_take_dropped(void);
+
+#endif // CONFIG_OMI_ENABLE_USB_STREAM
+
+#endif
@@ -0,0 +1,82 @@
+#include "warm_resume.h"
+
+#include <hal/nrf_reset.h>
+#include <helpers/nrfx_ram_ctrl.h>
+#include <stddef.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/crc.h>
+
+#include "sd_card.h"
+#include "settings.h"
+#include "transport.h"
+
+LOG_MODULE_REGISTER(warm_resume, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define WARM_MAGIC 0x4D524157 // "WARM"
+
+// Kept through system off like the monitor's boot log, valid only with the magic and the checksum
+static struct warm_state retained __noinit;
+static bool warm_valid;
+static struct warm_time time_base;
+
+static uint32_t warm_crc(const struct warm_state *state)
+{
+    return crc32_ieee((const uint8_t *) state, offsetof(struct warm_state, crc));
+}
+
+// On a warm wake storage.first_segment is 0 unless the card was unmounted cleanly
+void warm_resume_init(void)
+{
+    bool woke = nrf_reset_resetreas_get(NRF_RESET) & NRF_RESET_RESETREAS_OFF_MASK;
+    warm_valid = woke && retained.magic == WARM_MAGIC && retained.size == sizeof(retained) &&
+                 retained.crc == warm_crc(&retained);
+
+    // Only good for this boot
+    retained.magic = 0;
+    nrfx_ram_ctrl_retention_enable_set(&retained, sizeof(retained), false);
+
+    if (warm_valid) {
+        LOG_INF("Warm wake from system off");
+    } else if (woke) {
+        LOG_WRN("Woke from system off without valid retained state, booting cold");
+    }
+}
+
+const struct warm_state *warm_resume_get(void)
+{
+    return warm_valid ? &retained : NULL;
+}
+
+void warm_resume_set_time_base(uint64_t epoch_s, uint32_t imu_ts)
+{
+    time_base.epoch_s = epoch_s;
+    time_base.imu_ts = imu_ts;
+}
+
+void warm_resume_save(void)
+{
+    struct warm_state *state = &retained;
+
+    warm_valid = false;
+    memset(state, 0, sizeof(*state));
+    state->settings.dim_ratio = app_settings_get_dim_ratio();
+    state->settings.mic_gain = app_settings_get_mic_gain();
+    state->settings.codec_profile = app_settings_get_codec_profile();
+    state->settings.rtc_epoch = app_settings_get_rtc_epoch();
+#ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
+    if (!sd_warm_save(&state->storage)) {
+        LOG_WRN("Card not unmounted cleanly, the next wake rescans it");
+        state->storage.first_segment = 0;
+    }
+#endif
+    transport_warm_save(&state->link);
+    state->time = time_base;
+
+    state->magic = WARM_MAGIC;
+    state->size = sizeof(*state);
+    state->crc = warm_crc(state);
+    nrfx_ram_ctrl_retention_enable_set(state, sizeof(*state), true);
+    LOG_INF("Retained %u bytes for the next wake", (unsigned) sizeof(*state));
+}
@@ -0,0 +1,92 @@
+#ifndef WARM_RESUME_H
+#define WARM_RESUME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+
+#define WARM_SEGMENT_IDS 256 // SD segment ids, as in sd_card.c
+
+/**
+ * @brief Settings as loaded at boot, so a warm wake doesn't walk the settings partition
+ */
+struct warm_settings {
+    uint8_t dim_ratio;
+    uint8_t mic_gain;
+    uint8_t codec_profile;
+    uint8_t reserved;
+    uint64_t rtc_epoch;
+};
+
+/**
+ * @brief Audio stream on the card, taken after a clean unmount
+ */
+struct warm_storage {
+    uint8_t first_segment;
+    uint8_t last_segment;
+    uint16_t reserved;
+    uint32_t file_size;     // newest segment
+    uint32_t offset;        // sync offset
+    uint32_t storage_limit;
+    uint32_t segment_sizes[WARM_SEGMENT_IDS]; // closed segments
+};
+
+/**
+ * @brief Link policy the last connection ran, picked up by the first connection after the wake
+ */
+struct warm_link {
+    uint8_t workload; // transport.c's link workload, out of range if there was no connection
+    uint8_t reserved[3];
+};
+
+/**
+ * @brief UTC at power off and the IMU timestamp counter (which keeps running in system off) then
+ */
+struct warm_time {
+    uint64_t epoch_s; // 0 if the RTC wasn't valid
+    uint32_t imu_ts;
+    uint32_t reserved;
+};
+
+struct warm_state {
+    uint32_t magic;
+    uint32_t size;
+    struct warm_settings settings;
+    struct warm_storage storage;
+    struct warm_link link;
+    struct warm_time time;
+    uint32_t crc; // CRC32 of everything above
+};
+
+/**
+ * @brief Check the state kept in retained RAM across system off
+ *
+ * Call first thing in main(), before the reset reason is cleared. The state only counts on a wake
+ * from system off and with a good checksum; it is dropped either way, so a crash later on boots
+ * cold.
+ */
+void warm_resume_init(void);
+
+/**
+ * @brief Get the state saved before system off
+ *
+ * @return The state, or NULL on a cold boot
+ */
+const struct warm_state *warm_resume_get(void);
+
+/**
+ * @brief Keep the IMU time base for the next wake, called while preparing system off
+ */
+void warm_resume_set_time_base(uint64_t epoch_s, uint32_t imu_ts);
+
+/**
+ * @brief Gather the state, checksum it and retain its RAM through system off
+ *
+ * Call right before sys_poweroff(), after the card is unmounted and the settings flushed.
+ */
+void warm_resume_save(void);
+
+#endif // CONFIG_OMI_ENABLE_WARM_RESUME
+
+#endif // WARM_RESUME_H
@@ -7,24 +7,37 @@
 #include "lib/core/codec.h"
 #include "lib/core/config.h"
 #include "lib/core/feedback.h"
+#ifdef CONFIG_OMI_ENABLE_GOVERNOR
+#include "lib/core/governor.h"
+#endif
 #include "lib/core/haptic.h"
+#include "lib/core/housekeeping.h"
+#ifdef CONFIG_OMI_ENABLE_IDLE_LISTEN
+#include "lib/core/idle_listen.h"
+#endif
 #include "lib/core/led.h"
 #include "lib/core/lib/battery/battery.h"
 #include "lib/core/mic.h"
 #ifdef CONFIG_OMI_ENABLE_MONITOR
 #include "lib/core/monitor.h"
 #endif
+#include "lib/core/power.h"
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+#include "lib/core/warm_resume.h"
+#endif
 #include "lib/core/settings.h"
 #include "lib/core/transport.h"
 #ifdef CONFIG_OMI_ENABLE_OFFLINE_STORAGE
 #include "lib/core/storage.h"
 #endif
+#if defined(CONFIG_OMI_ENABLE_USB_SYNC) || defined(CONFIG_OMI_ENABLE_USB_STREAM)
+#include "lib/core/usb.h"
+#endif
 #include <hal/nrf_reset.h>
 #include "rtc.h"
 #include "imu.h"
 
 #include "lib/core/sd_card.h"
-#include "spi_flash.h"
 #include "wdog_facade.h"
 
 LOG_MODULE_REGISTER(main, CONFIG_LOG_DEFAULT_LEVEL);
@@ -62,12 +75,13 @@ static void print_reset_reason(void)
     }
 }
 
-static void codec_handler(uint8_t *data, size_t len)
+static void codec_handler(uint8_t *data, size_t len, uint32_t capture_ms)
 {
 #ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_FIRST_FRAME);
     monitor_inc_broadcast_audio();
 #endif
-    int err = broadcast_audio_packets(data, len);
+    int err = broadcast_audio_packets(data, len, capture_ms);
     if (err) {
 #ifdef CONFIG_OMI_ENABLE_MONITOR
         monitor_inc_broadcast_audio_failed();
@@ -75,14 +89,15 @@ static void codec_handler(uint8_t *data, size_t len)
     }
 }
 
-static void mic_handler(int16_t *buffer)
+static void mic_handler(int16_t *frame, uint32_t capture_ms)
 {
 #ifdef CONFIG_OMI_ENABLE_MONITOR
-    // Track total bytes processed (each sample is 2 bytes)
+    // Track total frames processed
     monitor_inc_mic_buffer();
 #endif
 
-    int err = codec_receive_pcm(buffer, MIC_BUFFER_SAMPLES);
+    // The codec owns the frame from here on
+    int err = codec_submit_frame(frame, capture_ms);
     if (err) {
         LOG_ERR("Failed to process PCM data: %d", err);
     }
@@ -91,40 +106,13 @@ static void mic_handler(int16_t *buffer)
 static void boot_led_sequence(void)
 {
     // Quick blue pulse = "I'm alive, booting..."
-    set_led_blue(true);
-    k_msleep(300);
-    led_off();
+    led_pattern_play(&led_pattern_boot);
 }
 
 static void boot_ready_sequence(void)
 {
-    const int steps = 50;
-    const int delay_ms = 10;
-
-    // Smooth green fade in/out 2 times = "Ready!"
-    for (int cycle = 0; cycle < 2; cycle++) {
-        // Fade in: ease-in-out
-        for (int i = 0; i <= steps; i++) {
-            float t = (float) i / steps;
-            // Ease-in-out quadratic
-            float eased = t < 0.5f ? 2.0f * t * t : 1.0f - 2.0f * (1.0f - t) * (1.0f - t);
-            uint8_t level = (uint8_t) (eased * 50.0f);
-            set_led_pwm(LED_GREEN, level);
-            k_msleep(delay_ms);
-        }
-
-        // Fade out: ease-in-out
-        for (int i = 0; i <= steps; i++) {
-            float t = (float) i / steps;
-            float eased = t < 0.5f ? 2.0f * t * t : 1.0f - 2.0f * (1.0f - t) * (1.0f - t);
-            uint8_t level = (uint8_t) ((1.0f - eased) * 70.0f);
-            set_led_pwm(LED_GREEN, level);
-            k_msleep(delay_ms);
-        }
-    }
-    k_msleep(10);
-    led_off();
-    k_msleep(10);
+    // Smooth green fade in/out 2 times = "Ready!", played without holding up the boot
+    led_pattern_play(&led_pattern_ready);
 }
 
 void set_led_state()
@@ -135,6 +123,11 @@ void set_led_state()
         return;
     }
 
+    // An animation is playing, the status shows again once it ends
+    if (led_pattern_active()) {
+        return;
+    }
+
     bool green = false;
     bool blue = false;
     bool red = false;
@@ -162,29 +155,30 @@ void set_led_state()
     set_led_red(red);
 }
 
-static int suspend_unused_modules(void)
-{
-    int err = flash_off();
-    if (err) {
-        LOG_ERR("Can not suspend the spi flash module: %d", err);
-    }
-
-    return 0;
-}
-
 int main(void)
 {
     int ret;
     printk("Starting omi ...\n");
 
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+    // Needs the reset reason, which print_reset_reason() clears
+    warm_resume_init();
+#endif
+
     // print reset reason at startup
     print_reset_reason();
 
+    // Before anything defers work to it
+    housekeeping_start();
+
     // Initialize watchdog first to catch any early freezes
     ret = watchdog_init();
     if (ret) {
         LOG_WRN("Watchdog init failed (err %d), continuing without watchdog", ret);
     }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_WATCHDOG);
+#endif
 
     // Initialize Haptic driver first; this is building up for future of omi turn on sequence - long press to turn on
     // instead of short press
@@ -209,11 +203,12 @@ int main(void)
         error_led_driver();
         return ret;
     }
+    boot_led_sequence();
 
-    // Suspend unused modules
+    // Peripherals stay off until an activity needs them
     LOG_PRINTK("\n");
     LOG_INF("Suspending unused modules...\n");
-    ret = suspend_unused_modules();
+    ret = power_init();
     if (ret) {
         LOG_ERR("Failed to suspend unused modules (err %d)", ret);
         ret = 0;
@@ -225,9 +220,15 @@ int main(void)
     if (setting_ret) {
         LOG_ERR("Failed to initialize settings (err %d)", setting_ret);
     }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_SETTINGS);
+#endif
 
     // Initialize RTC from saved epoch
     init_rtc();
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_RTC);
+#endif
     if (!rtc_is_valid()) {
         LOG_WRN("UTC time not synchronized yet");
     }
@@ -248,6 +249,41 @@ int main(void)
         app_settings_save_dim_ratio(30);
     }
 
+    // Initialize codec
+    LOG_INF("Initializing codec...\n");
+
+    // Capture starts before SD and Bluetooth, frames wait in the TX queue until the pusher runs
+    transport_queue_init();
+    set_codec_callback(codec_handler);
+    ret = codec_start();
+    if (ret) {
+        LOG_ERR("Failed to start codec: %d", ret);
+        error_codec();
+        return ret;
+    }
+
+    // Initialize microphone
+    LOG_INF("Initializing microphone...\n");
+    set_mic_frame_allocator(codec_alloc_frame);
+    set_mic_callback(mic_handler);
+    ret = mic_start();
+    if (ret) {
+        LOG_ERR("Failed to start microphone: %d", ret);
+        error_microphone();
+        return ret;
+    }
+    power_request(POWER_ACTIVITY_CAPTURE);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_MIC);
+#endif
+#ifdef CONFIG_OMI_ENABLE_IDLE_LISTEN
+    // Not fatal, the mic just stays on
+    ret = idle_listen_start();
+    if (ret) {
+        LOG_ERR("Motion-gated listening unavailable (err %d)", ret);
+    }
+#endif
+
     // Initialize battery
 #ifdef CONFIG_OMI_ENABLE_BATTERY
     ret = battery_init();
@@ -298,6 +334,14 @@ int main(void)
     }
 #endif
 
+#if defined(CONFIG_OMI_ENABLE_USB_SYNC) || defined(CONFIG_OMI_ENABLE_USB_STREAM)
+    ret = init_usb();
+    if (ret) {
+        LOG_ERR("Failed to initialize USB (err %d)", ret);
+        // Non-critical, continue boot
+    }
+#endif
+
     // Indicate transport initialization
     LOG_PRINTK("\n");
     LOG_INF("Initializing transport...\n");
@@ -310,33 +354,16 @@ int main(void)
         error_transport();
         return transportErr;
     }
+#ifdef CONFIG_OMI_ENABLE_GOVERNOR
+    governor_start();
+#endif
 
-    // Initialize codec
-    LOG_INF("Initializing codec...\n");
-
-    // Set codec callback
-    set_codec_callback(codec_handler);
-    ret = codec_start();
-    if (ret) {
-        LOG_ERR("Failed to start codec: %d", ret);
-        error_codec();
-        return ret;
-    }
-
-    // Initialize microphone
-    LOG_INF("Initializing microphone...\n");
-    set_mic_callback(mic_handler);
-    ret = mic_start();
-    if (ret) {
-        LOG_ERR("Failed to start microphone: %d", ret);
-        error_microphone();
-        return ret;
-    }
 #ifdef CONFIG_OMI_ENABLE_WIFI
     // Initialize wifi
     wifi_init();
 #endif
     LOG_INF("Device initialized successfully\n");
+    boot_ready_sequence();
 
     while (1) {
         watchdog_feed();
@@ -31,6 +31,14 @@
 #include <zephyr/storage/disk_access.h>
 #include <zephyr/pm/device.h>
 #define DISK_DRIVE_NAME "SDMMC"
+#if defined(CONFIG_FAT_FILESYSTEM_ELM)
+#include <ff.h>
+#include <string.h>
+#include <zephyr/fs/fs.h>
+#include "sysflash/sysflash.h"
+#define SD_UPDATE_PATH "/SD:/update/app.bin" // staged by the app, see SD_UPDATE_PATH in sd_card.h
+#define SD_UPDATE_CHUNK_SIZE 4096
+#endif
 
 #if defined(CONFIG_BOOT_DISABLE_CACHES)
 #include <zephyr/cache.h>
@@ -147,6 +155,23 @@ K_SEM_DEFINE(boot_log_sem, 1, 1);
 #include <pm_config.h>
 #endif
 
+// OMI
+#if defined(CONFIG_OMI_BOOT_VALIDATION_CACHE)
+#if !(USE_PARTITION_MANAGER && CONFIG_FPROTECT) || defined(PM_S1_ADDRESS) || defined(CONFIG_BOOT_VALIDATE_SLOT0)
+#error "CONFIG_OMI_BOOT_VALIDATION_CACHE needs PM, CONFIG_FPROTECT, one MCUboot and BOOT_VALIDATE_SLOT0=n"
+#endif
+#include <string.h>
+#include <zephyr/sys/util.h>
+#if defined(CONFIG_HWINFO)
+#include <zephyr/drivers/hwinfo.h>
+#endif
+#include "bootutil/image.h"
+#include "sysflash/sysflash.h"
+#define OMI_MARKER_MAGIC 0x4F4D4956 // "VIMO"
+#define OMI_MARKER_PAGE_SIZE 0x1000
+#define OMI_MARKER_OFF (PM_MCUBOOT_SIZE - OMI_MARKER_PAGE_SIZE) // last page of the bootloader partition
+#endif
+
 #if CONFIG_MCUBOOT_NRF_CLEANUP_PERIPHERAL || CONFIG_MCUBOOT_NRF_CLEANUP_NONSECURE_RAM
 #include <nrf_cleanup.h>
 #endif
@@ -479,6 +504,219 @@ static void boot_serial_enter()
 static const struct gpio_dt_spec sd_en = GPIO_DT_SPEC_GET_OR(DT_NODELABEL(sdcard_en_pin), gpios, {0});
 static const struct device *const sdcard = DEVICE_DT_GET(DT_NODELABEL(sdhc0));
 
+#if defined(CONFIG_OMI_BOOT_VALIDATION_CACHE)
+/* Hashing and checking the signature of the whole primary image on every boot delays each power-on
+ * and watchdog recovery. The first boot of an image still validates it in full and records a marker
+ * bound to its header and hash TLV in the last page of the bootloader partition. Both that page and
+ * the image are fprotect'ed before the jump, so nothing the application runs can change either
+ * until the next reset, and a later boot with a matching marker skips the check. A swap, any other
+ * image, a debugger reset or a marker that doesn't match means a full validation again.
+ */
+struct omi_boot_marker {
+    uint32_t magic;
+    uint32_t img_size;
+    uint16_t hdr_size;
+    uint16_t protect_tlv_size;
+    struct image_version ver;
+    uint8_t hash[32];
+};
+
+static uint32_t omi_image_protect_size;
+
+static int omi_read_marker(const struct image_header *hdr, const struct flash_area *fa, struct omi_boot_marker *m,
+                           uint32_t *image_end)
+{
+    struct image_tlv_iter it;
+    struct image_tlv_info info;
+    uint32_t off;
+    uint16_t len;
+    int rc;
+
+    memset(m, 0, sizeof(*m));
+    m->magic = OMI_MARKER_MAGIC;
+    m->img_size = hdr->ih_img_size;
+    m->hdr_size = hdr->ih_hdr_size;
+    m->protect_tlv_size = hdr->ih_protect_tlv_size;
+    m->ver = hdr->ih_ver;
+
+    rc = bootutil_tlv_iter_begin(&it, hdr, fa, IMAGE_TLV_SHA256, false);
+    if (rc == 0) {
+        rc = bootutil_tlv_iter_next(&it, &off, &len, NULL);
+    }
+    if (rc != 0 || len != sizeof(m->hash) || flash_area_read(fa, off, m->hash, sizeof(m->hash)) != 0) {
+        return -1;
+    }
+
+    /* Unprotected TLVs (signature, hash) follow the protected ones */
+    off = hdr->ih_hdr_size + hdr->ih_img_size + hdr->ih_protect_tlv_size;
+    if (flash_area_read(fa, off, &info, sizeof(info)) != 0 || info.it_magic != IMAGE_TLV_INFO_MAGIC) {
+        return -1;
+    }
+    *image_end = off + info.it_tlv_tot;
+    return 0;
+}
+
+static bool omi_debug_reset(void)
+{
+#if defined(CONFIG_HWINFO)
+    uint32_t cause = 0;
+
+    /* Left for the application, which reads and clears it itself */
+    return hwinfo_get_reset_cause(&cause) == 0 && (cause & RESET_DEBUG);
+#else
+    return false;
+#endif
+}
+
+/* Check the image boot_go() picked, in full unless the marker vouches for it */
+static bool omi_primary_valid(struct boot_rsp *rsp)
+{
+    static uint8_t tmp_buf[1024];
+    const struct flash_area *fa = NULL;
+    const struct flash_area *mfa = NULL;
+    struct omi_boot_marker want;
+    struct omi_boot_marker stored;
+    uint32_t image_end = 0;
+    bool valid = false;
+
+    FIH_DECLARE(fih_rc, FIH_FAILURE);
+
+    if (flash_area_open(FLASH_AREA_IMAGE_PRIMARY(0), &fa) != 0 || flash_area_open(PM_MCUBOOT_ID, &mfa) != 0) {
+        goto out;
+    }
+    /* The marker page must hold no bootloader code */
+    bool cache_usable = (uintptr_t)__rom_region_end <= PM_MCUBOOT_ADDRESS + OMI_MARKER_OFF &&
+                        omi_read_marker(rsp->br_hdr, fa, &want, &image_end) == 0;
+    uint32_t protect_size = ROUND_UP(image_end, CONFIG_FPROTECT_BLOCK_SIZE);
+    /* The trailer in the last block stays writable for the application */
+    cache_usable = cache_usable && protect_size < flash_area_get_size(fa);
+
+    if (cache_usable && !omi_debug_reset() &&
+        flash_area_read(mfa, OMI_MARKER_OFF, &stored, sizeof(stored)) == 0 &&
+        memcmp(&stored, &want, sizeof(want)) == 0) {
+        BOOT_LOG_INF("Primary image validated before, skipping the check");
+        omi_image_protect_size = protect_size;
+        valid = true;
+        goto out;
+    }
+
+    FIH_CALL(bootutil_img_validate, fih_rc, NULL, 0, rsp->br_hdr, fa, tmp_buf, sizeof(tmp_buf), NULL, 0, NULL);
+    valid = FIH_EQ(fih_rc, FIH_SUCCESS);
+    if (!cache_usable) {
+        goto out;
+    }
+    bool recorded = flash_area_read(mfa, OMI_MARKER_OFF, &stored, sizeof(stored)) == 0 &&
+                    memcmp(&stored, &want, sizeof(want)) == 0;
+    if (!valid || !recorded) {
+        flash_area_erase(mfa, OMI_MARKER_OFF, OMI_MARKER_PAGE_SIZE);
+    }
+    if (valid && !recorded && flash_area_write(mfa, OMI_MARKER_OFF, &want, sizeof(want)) != 0) {
+        BOOT_LOG_WRN("Couldn't record the validated image");
+    }
+    if (valid) {
+        omi_image_protect_size = protect_size;
+    }
+
+out:
+    if (mfa) {
+        flash_area_close(mfa);
+    }
+    if (fa) {
+        flash_area_close(fa);
+    }
+    return valid;
+}
+#endif
+
+#if defined(CONFIG_FAT_FILESYSTEM_ELM)
+/* A full image downloaded over Wi-Fi is left on the SD card by the app. Copy it into the
+ * secondary slot and request a permanent upgrade; boot_go() then validates its signature and
+ * swaps it in like any other DFU. The file is deleted before the upgrade is requested, so a
+ * reset later on never copies it over a swap in progress, at worst the update is lost.
+ */
+static void omi_stage_sd_update(void)
+{
+    static FATFS fat_fs;
+    static struct fs_mount_t mp = {
+        .type = FS_FATFS,
+        .fs_data = &fat_fs,
+        .flags = FS_MOUNT_FLAG_NO_FORMAT | FS_MOUNT_FLAG_USE_DISK_ACCESS,
+        .storage_dev = (void *)DISK_DRIVE_NAME,
+        .mnt_point = "/SD:",
+    };
+    static uint8_t buf[SD_UPDATE_CHUNK_SIZE];
+    const struct flash_area *fa = NULL;
+    struct fs_file_t file;
+    struct fs_dirent entry;
+    bool opened = false;
+    int rc;
+
+    if (fs_mount(&mp) != 0) {
+        return;
+    }
+    if (fs_stat(SD_UPDATE_PATH, &entry) != 0 || entry.type != FS_DIR_ENTRY_FILE) {
+        goto out;
+    }
+
+    rc = flash_area_open(FLASH_AREA_IMAGE_SECONDARY(0), &fa);
+    if (rc != 0 || entry.size == 0 || entry.size > flash_area_get_size(fa)) {
+        BOOT_LOG_ERR("SD update of %u bytes doesn't fit the secondary slot", (unsigned)entry.size);
+        fs_unlink(SD_UPDATE_PATH);
+        goto out;
+    }
+    BOOT_LOG_INF("Copying a %u byte update from the SD card", (unsigned)entry.size);
+
+    fs_file_t_init(&file);
+    rc = fs_open(&file, SD_UPDATE_PATH, FS_O_READ);
+    if (rc != 0) {
+        goto out;
+    }
+    opened = true;
+    rc = flash_area_erase(fa, 0, flash_area_get_size(fa));
+    if (rc != 0) {
+        BOOT_LOG_ERR("Secondary slot erase failed: %d", rc);
+        goto out;
+    }
+
+    uint32_t align = flash_area_align(fa);
+    for (uint32_t off = 0; off < entry.size;) {
+        ssize_t n = fs_read(&file, buf, MIN(sizeof(buf), entry.size - off));
+        if (n <= 0) {
+            BOOT_LOG_ERR("SD update read failed at %u: %d", off, (int)n);
+            goto out;
+        }
+        /* Only the last chunk can end off the write alignment, padded as erased flash */
+        uint32_t len = ROUND_UP(n, align);
+        memset(buf + n, flash_area_erased_val(fa), len - n);
+        rc = flash_area_write(fa, off, buf, len);
+        if (rc != 0) {
+            BOOT_LOG_ERR("Secondary slot write failed at %u: %d", off, rc);
+            goto out;
+        }
+        off += n;
+    }
+
+    fs_close(&file);
+    opened = false;
+    if (fs_unlink(SD_UPDATE_PATH) != 0) {
+        /* Requesting the upgrade anyway would copy it again on every boot */
+        BOOT_LOG_ERR("Couldn't remove the SD update, not installing it");
+        goto out;
+    }
+    rc = boot_set_pending(1);
+    BOOT_LOG_INF("SD update copied, upgrade %s", rc == 0 ? "requested" : "request failed");
+
+out:
+    if (opened) {
+        fs_close(&file);
+    }
+    if (fa) {
+        flash_area_close(fa);
+    }
+    fs_unmount(&mp);
+}
+#endif
+
 int main(void)
 {
     struct boot_rsp rsp;
@@ -501,6 +739,9 @@ int main(void)
     pm_device_action_run(sdcard, PM_DEVICE_ACTION_RESUME);
     disk_access_ioctl(disk_pdrv, DISK_IOCTL_CTRL_INIT, NULL);
     k_sleep(K_MSEC(1000));
+#if defined(CONFIG_FAT_FILESYSTEM_ELM)
+    omi_stage_sd_update();
+#endif
 
     disk_access_ioctl(disk_pdrv, DISK_IOCTL_CTRL_DEINIT, NULL);
     pm_device_action_run(sdcard, PM_DEVICE_ACTION_SUSPEND);
@@ -633,6 +874,17 @@ int main(void)
         FIH_PANIC;
     }
 
+#if defined(CONFIG_OMI_BOOT_VALIDATION_CACHE)
+    // OMI
+    if (!omi_primary_valid(&rsp)) {
+        BOOT_LOG_ERR("Primary image failed validation");
+
+        mcuboot_status_change(MCUBOOT_STATUS_NO_BOOTABLE_IMAGE_FOUND);
+
+        FIH_PANIC;
+    }
+#endif
+
 #ifdef CONFIG_BOOT_RAM_LOAD
     BOOT_LOG_INF("Bootloader chainload address offset: 0x%x",
                  rsp.br_hdr->ih_load_addr);
@@ -669,6 +921,19 @@ int main(void)
             ;
     }
 
+#if defined(CONFIG_OMI_BOOT_VALIDATION_CACHE)
+    // OMI
+    /* The marker in the bootloader partition only holds while the image can't change either */
+    if (omi_image_protect_size) {
+        rc = fprotect_area(PM_MCUBOOT_PRIMARY_ADDRESS, omi_image_protect_size);
+        if (rc != 0) {
+            BOOT_LOG_ERR("Protect primary image failed, cancel startup.");
+            while (1)
+                ;
+        }
+    }
+#endif
+
 #if defined(CONFIG_SOC_NRF5340_CPUAPP) && defined(PM_CPUNET_B0N_ADDRESS) && defined(CONFIG_PCD_APP)
 #if defined(PM_TFM_SECURE_ADDRESS)
     pcd_lock_ram(false);
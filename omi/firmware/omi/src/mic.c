@@ -6,61 +6,403 @@
 
 #include "lib/core/mic.h"
 
+#include <cmsis_core.h>
 #include <nrfx_pdm.h>
+#include <string.h>
 #include <zephyr/audio/dmic.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
 
+#include "lib/core/config.h"
+#include "lib/core/flight_rec.h"
+#if defined(CONFIG_OMI_ENABLE_LATENCY_TRACE) || defined(CONFIG_OMI_ENABLE_MONITOR)
+#include "lib/core/monitor.h"
+#endif
 #include "lib/core/settings.h"
+#include "rtc.h"
 
 LOG_MODULE_REGISTER(mic, CONFIG_LOG_DEFAULT_LEVEL);
 
+/* PDM always runs at 16kHz: the nRF52840 decimator can't go below 12.5kHz.
+ * Lower AUDIO_SAMPLE_RATEs are decimated in software during the downmix. */
 #define MAX_SAMPLE_RATE 16000
+#define MIC_DECIMATION (MAX_SAMPLE_RATE / AUDIO_SAMPLE_RATE)
+BUILD_ASSERT(MIC_DECIMATION == 1 || MIC_DECIMATION == 2, "Only 16kHz and 8kHz output are supported");
 #define SAMPLE_BIT_WIDTH 16
 #define BYTES_PER_SAMPLE sizeof(int16_t)
-#define CHANNELS 2
+#define CHANNELS MIC_CHANNELS
 
 /* Milliseconds to wait for a block to be read. */
 #define READ_TIMEOUT 1000
 
-/* Size of a block for 100 ms of audio data. */
-#define BLOCK_SIZE(sample_rate, number_of_channels) (BYTES_PER_SAMPLE * (sample_rate / 10) * number_of_channels)
+/* Frames in a block of MIC_BLOCK_MS. A frame waits up to a block for the codec to see it, so
+ * shorter blocks take latency off the live path for more PDM interrupts and mic thread wakeups. */
+#define BLOCK_FRAMES(sample_rate) ((sample_rate) * MIC_BLOCK_MS / 1000)
+
+/* Size of a block of MIC_BLOCK_MS of audio data. */
+#define BLOCK_SIZE(sample_rate, number_of_channels) (BYTES_PER_SAMPLE * BLOCK_FRAMES(sample_rate) * number_of_channels)
 
 /* Driver will allocate blocks from this slab to receive audio data into them.
  * Application, after getting a given block from the driver and processing its
  * data, needs to free that block.
  */
-#define MAX_BLOCK_SIZE BLOCK_SIZE(MAX_SAMPLE_RATE, 2)
-#define BLOCK_COUNT 4
+#define MAX_BLOCK_SIZE BLOCK_SIZE(MAX_SAMPLE_RATE, CHANNELS)
+/* MIC_SLAB_MS whatever the block length, and never fewer blocks than the driver likes queued */
+#define BLOCK_COUNT MAX(4, MIC_SLAB_MS / MIC_BLOCK_MS)
 
 K_MEM_SLAB_DEFINE_STATIC(mem_slab, MAX_BLOCK_SIZE, BLOCK_COUNT, 4);
 
 static const struct device *dmic_dev;
 static volatile mix_handler callback_func = NULL;
+static volatile mic_frame_alloc_handler frame_alloc_func = NULL;
 static volatile bool mic_running = false;
 
-#define MAX_FRAMES (MAX_SAMPLE_RATE / 10)
-static int16_t mono_buffer[MAX_FRAMES];
+static void set_mic_running(bool running)
+{
+    mic_running = running;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_MIC, running);
+#endif
+}
+
+#define MAX_FRAMES BLOCK_FRAMES(MAX_SAMPLE_RATE)
+#define PDM_FRAME_SAMPLES (MIC_FRAME_SAMPLES * MIC_DECIMATION) /* PDM samples per codec frame */
+BUILD_ASSERT(MAX_FRAMES >= PDM_FRAME_SAMPLES && MAX_FRAMES % PDM_FRAME_SAMPLES == 0,
+             "MIC_BLOCK_MS must be a whole number of codec frames");
+
+/* Uncomment to log a cycle-count comparison of the downmix kernels at startup */
+// #define MIC_DOWNMIX_BENCHMARK
+
+#if defined(__ARM_FEATURE_DSP) && (__ARM_FEATURE_DSP == 1)
+#define MIC_DOWNMIX_SIMD 1
+#else
+#define MIC_DOWNMIX_SIMD 0
+#endif
 
 static inline void
-interleaved_stereo_to_mono(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
+stereo_to_mono_scalar(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
+{
+    /* Mix L and R channels directly from interleaved format: L0, R0, L1, R1, ...
+     * (L + R) >> 1 always fits in int16, so no clamping is needed. */
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        int32_t sum = (int32_t) interleaved[j + 0] + (int32_t) interleaved[j + 1];
+        mono_out[i] = (int16_t) (sum >> 1);
+    }
+}
+
+#if MIC_DOWNMIX_SIMD
+static inline void
+stereo_to_mono_simd(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
+{
+    /* Two frames per iteration. Each word holds R:L, so repack the pair into
+     * L1:L0 and R1:R0 and let SHADD16 average both lanes at once. The halving
+     * add floors exactly like the scalar shift, so the output is bit-identical. */
+    const uint32_t *in = (const uint32_t *) interleaved;
+    uint32_t *out = (uint32_t *) mono_out;
+    size_t pairs = frames / 2;
+
+    for (size_t i = 0; i < pairs; ++i) {
+        uint32_t f0 = in[2 * i];
+        uint32_t f1 = in[2 * i + 1];
+        uint32_t left = __PKHBT(f0, f1, 16);
+        uint32_t right = __PKHTB(f1, f0, 16);
+        out[i] = __SHADD16(left, right);
+    }
+
+    if (frames & 1) {
+        stereo_to_mono_scalar(interleaved + pairs * 4, 1, mono_out + pairs * 2);
+    }
+}
+#endif
+
+#ifdef CONFIG_OMI_MIC_DC_BLOCK
+/* DC blocker state, carried across frames and blocks */
+static int32_t dc_prev_in;
+static int32_t dc_out_q8;
+
+/* One-pole high-pass y[n] = x[n] - x[n-1] + a * y[n-1]. The output is kept
+ * with 8 fractional bits so the feedback term doesn't truncate into a
+ * limit cycle, and saturated on the way back to int16. */
+static inline int16_t dc_block(int32_t x)
+{
+    dc_out_q8 = ((x - dc_prev_in) << 8) + (int32_t) (((int64_t) dc_out_q8 * MIC_DC_BLOCK_POLE_Q15) >> 15);
+    dc_prev_in = x;
+    return (int16_t) __SSAT(dc_out_q8 >> 8, 16);
+}
+
+static inline void
+stereo_to_mono_dc_block(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
+{
+    /* Same mix as stereo_to_mono_scalar(), filtered before the store so the
+     * block is still read and the frame written exactly once. The recursion
+     * is serial, so the SIMD kernel has nothing to gain here. */
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        int32_t sum = (int32_t) interleaved[j + 0] + (int32_t) interleaved[j + 1];
+        mono_out[i] = dc_block(sum >> 1);
+    }
+}
+
+static inline void mono_dc_block(const int16_t *restrict in, size_t frames, int16_t *restrict mono_out)
+{
+    for (size_t i = 0; i < frames; ++i) {
+        mono_out[i] = dc_block(in[i]);
+    }
+}
+#endif
+
+#ifdef CONFIG_OMI_MIC_BEAMFORM
+#if CHANNELS == 1
+#error "CONFIG_OMI_MIC_BEAMFORM needs both mics, drop CONFIG_OMI_MIC_MONO"
+#endif
+/* Endfire delay-and-sum: speech reaches the front mic MIC_BEAMFORM_SPACING_UM / c
+ * before the rear one, so the front channel is delayed by that much and the two
+ * are averaged. Speech adds in phase, sound from the sides and behind doesn't.
+ *
+ * The delay is a fraction of a sample, so the front channel goes through a
+ * 4-tap third-order Lagrange fractional delay of 1 + tau samples (the middle of
+ * the taps, where Lagrange is flattest) and the rear one is delayed by a whole
+ * sample to match. Coefficients are Q14 since the inner taps reach 1.0. */
+#define BEAMFORM_TAPS 4
+#define BEAMFORM_Q 14
+#define SPEED_OF_SOUND_MM_S 343000
+BUILD_ASSERT((uint64_t) MIC_BEAMFORM_SPACING_UM * MAX_SAMPLE_RATE <= (uint64_t) SPEED_OF_SOUND_MM_S * 1000,
+             "Mic spacing must be at most one PDM sample of travel");
+
+#if MIC_BEAMFORM_FRONT == 0
+#define FRONT(j) (j)
+#define REAR(j) ((j) + 1)
+#else
+#define FRONT(j) ((j) + 1)
+#define REAR(j) (j)
+#endif
+
+static int16_t bf_h[BEAMFORM_TAPS];
+/* Front history, newest first, and the previous rear sample; carried across frames and blocks */
+static int16_t bf_front[BEAMFORM_TAPS - 1];
+static int16_t bf_rear;
+
+static void beamform_init(void)
+{
+    float tau = (float) MIC_BEAMFORM_SPACING_UM * MAX_SAMPLE_RATE / ((float) SPEED_OF_SOUND_MM_S * 1000.0f);
+    float d = 1.0f + tau;
+    int32_t sum = 0;
+
+    for (int k = 0; k < BEAMFORM_TAPS; k++) {
+        float h = 1.0f;
+        for (int j = 0; j < BEAMFORM_TAPS; j++) {
+            if (j != k) {
+                h *= (d - j) / (float) (k - j);
+            }
+        }
+        bf_h[k] = (int16_t) (h * (1 << BEAMFORM_Q) + (h >= 0 ? 0.5f : -0.5f));
+        sum += bf_h[k];
+    }
+    /* Unity gain at DC whatever the rounding did */
+    bf_h[1] += (1 << BEAMFORM_Q) - sum;
+
+    memset(bf_front, 0, sizeof(bf_front));
+    bf_rear = 0;
+}
+
+static inline int16_t beamform_mix(int32_t acc, int16_t rear)
+{
+    int32_t front = __SSAT(acc >> BEAMFORM_Q, 16);
+    return (int16_t) ((front + rear) >> 1);
+}
+
+static inline void
+stereo_beamform_scalar(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
 {
-    /* Mix L and R channels directly from interleaved format: L0, R0, L1, R1, ... */
+    int16_t f1 = bf_front[0], f2 = bf_front[1], f3 = bf_front[2];
+    int16_t r1 = bf_rear;
+
     for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
-        int32_t left = (int32_t) interleaved[j + 0];
-        int32_t right = (int32_t) interleaved[j + 1];
-        int32_t sum = left + right;
-        sum >>= 1; /* divide by 2 to avoid clipping */
-        if (sum > 32767)
-            sum = 32767;
-        if (sum < -32768)
-            sum = -32768;
-        mono_out[i] = (int16_t) sum;
+        int16_t f0 = interleaved[FRONT(j)];
+        int32_t acc = bf_h[0] * f0 + bf_h[1] * f1 + bf_h[2] * f2 + bf_h[3] * f3;
+#ifdef CONFIG_OMI_MIC_DC_BLOCK
+        mono_out[i] = dc_block(beamform_mix(acc, r1));
+#else
+        mono_out[i] = beamform_mix(acc, r1);
+#endif
+        f3 = f2;
+        f2 = f1;
+        f1 = f0;
+        r1 = interleaved[REAR(j)];
+    }
+
+    bf_front[0] = f1;
+    bf_front[1] = f2;
+    bf_front[2] = f3;
+    bf_rear = r1;
+}
+
+#if MIC_DOWNMIX_SIMD
+static inline void
+stereo_beamform_simd(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
+{
+    /* Two frames per iteration. cur holds front samples n+1:n, p1 n-1:n-2 and
+     * p2 n-3:n-4, so each output is two SMLADs over neighbouring sample pairs
+     * and only the outer taps of the even output need a repack. The mix
+     * saturates and floors exactly like beamform_mix(), so the output is
+     * bit-identical to the scalar kernel. */
+    const uint32_t *in = (const uint32_t *) interleaved;
+    uint32_t *out = (uint32_t *) mono_out;
+    size_t pairs = frames / 2;
+
+    const uint32_t c01 = ((uint32_t) bf_h[0] << 16) | (uint16_t) bf_h[1];
+    const uint32_t c12 = ((uint32_t) bf_h[1] << 16) | (uint16_t) bf_h[2];
+    const uint32_t c23 = ((uint32_t) bf_h[2] << 16) | (uint16_t) bf_h[3];
+    const uint32_t c30 = ((uint32_t) bf_h[3] << 16) | (uint16_t) bf_h[0];
+
+    uint32_t p1 = ((uint32_t) bf_front[0] << 16) | (uint16_t) bf_front[1];
+    uint32_t p2 = (uint32_t) bf_front[2] << 16;
+    uint32_t rear_prev = (uint32_t) bf_rear << 16;
+
+    for (size_t i = 0; i < pairs; ++i) {
+        uint32_t w0 = in[2 * i];
+        uint32_t w1 = in[2 * i + 1];
+#if MIC_BEAMFORM_FRONT == 0
+        uint32_t cur = __PKHBT(w0, w1, 16);
+        uint32_t rear = __PKHTB(w1, w0, 16);
+#else
+        uint32_t cur = __PKHTB(w1, w0, 16);
+        uint32_t rear = __PKHBT(w0, w1, 16);
+#endif
+        int32_t acc0 = __SMLAD(p1, c12, __SMLAD(__PKHTB(p2, cur, 0), c30, 0));
+        int32_t acc1 = __SMLAD(cur, c01, __SMLAD(p1, c23, 0));
+        uint32_t front = __PKHBT(__SSAT(acc0 >> BEAMFORM_Q, 16), __SSAT(acc1 >> BEAMFORM_Q, 16), 16);
+        out[i] = __SHADD16(front, __PKHBT(rear_prev >> 16, rear, 16));
+        p2 = p1;
+        p1 = cur;
+        rear_prev = rear;
+    }
+
+    bf_front[0] = (int16_t) (p1 >> 16);
+    bf_front[1] = (int16_t) p1;
+    bf_front[2] = (int16_t) (p2 >> 16);
+    bf_rear = (int16_t) (rear_prev >> 16);
+
+    if (frames & 1) {
+        stereo_beamform_scalar(interleaved + pairs * 4, 1, mono_out + pairs * 2);
+    }
+}
+#endif
+#endif
+
+static inline void
+interleaved_stereo_to_mono(const int16_t *restrict interleaved, size_t frames, int16_t *restrict mono_out)
+{
+#if defined(CONFIG_OMI_MIC_BEAMFORM) && MIC_DOWNMIX_SIMD && !defined(CONFIG_OMI_MIC_DC_BLOCK)
+    stereo_beamform_simd(interleaved, frames, mono_out);
+#elif defined(CONFIG_OMI_MIC_BEAMFORM)
+    /* The DC blocker is serial, so with it the beamformer runs scalar too */
+    stereo_beamform_scalar(interleaved, frames, mono_out);
+#elif defined(CONFIG_OMI_MIC_DC_BLOCK)
+    stereo_to_mono_dc_block(interleaved, frames, mono_out);
+#elif MIC_DOWNMIX_SIMD
+    stereo_to_mono_simd(interleaved, frames, mono_out);
+#else
+    stereo_to_mono_scalar(interleaved, frames, mono_out);
+#endif
+}
+
+#if MIC_DECIMATION == 2
+/* 11-tap half-band low-pass (3, 0, -25, 0, 150, 256, 150, 0, -25, 0, 3) / 512
+ * in front of the 2:1 decimation. Every other tap is zero, so an output sample
+ * costs four symmetric pairs plus the centre tap. */
+#define DECIMATOR_HISTORY 10
+
+/* 16kHz mono, the tail of the previous frame first */
+static int16_t decimator_buf[DECIMATOR_HISTORY + PDM_FRAME_SAMPLES];
+
+static void downmix_decimate(const int16_t *restrict in, int16_t *restrict mono_out)
+{
+    int16_t *x = decimator_buf + DECIMATOR_HISTORY;
+
+    /* Mix (and DC block) into the 16kHz staging buffer */
+#if CHANNELS == 1
+#ifdef CONFIG_OMI_MIC_DC_BLOCK
+    mono_dc_block(in, PDM_FRAME_SAMPLES, x);
+#else
+    memcpy(x, in, PDM_FRAME_SAMPLES * BYTES_PER_SAMPLE);
+#endif
+#else
+    interleaved_stereo_to_mono(in, PDM_FRAME_SAMPLES, x);
+#endif
+
+    const int16_t *b = decimator_buf;
+    for (size_t i = 0; i < MIC_FRAME_SAMPLES; ++i, b += 2) {
+        int32_t acc = 3 * ((int32_t) b[0] + b[10]) - 25 * ((int32_t) b[2] + b[8]) + 150 * ((int32_t) b[4] + b[6]) +
+                      256 * (int32_t) b[5];
+        mono_out[i] = (int16_t) __SSAT(acc >> 9, 16);
     }
+
+    memcpy(decimator_buf, &decimator_buf[PDM_FRAME_SAMPLES], DECIMATOR_HISTORY * BYTES_PER_SAMPLE);
 }
+#endif
+
+#ifdef MIC_DOWNMIX_BENCHMARK
+static void downmix_benchmark(void)
+{
+    static int16_t bench_in[MAX_FRAMES * 2];
+    static int16_t bench_out_scalar[MAX_FRAMES];
+    static int16_t bench_out_fast[MAX_FRAMES];
+    uint32_t start, scalar_cycles, fast_cycles;
+
+    /* Full-scale pseudo-random pattern to exercise both halves of the lanes */
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < ARRAY_SIZE(bench_in); i++) {
+        seed = seed * 1664525u + 1013904223u;
+        bench_in[i] = (int16_t) (seed >> 16);
+    }
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    unsigned int key = irq_lock();
+    start = DWT->CYCCNT;
+#ifdef CONFIG_OMI_MIC_BEAMFORM
+    /* Both kernels start from the same filter history */
+    stereo_beamform_scalar(bench_in, MAX_FRAMES, bench_out_scalar);
+    scalar_cycles = DWT->CYCCNT - start;
+    beamform_init();
+#else
+    stereo_to_mono_scalar(bench_in, MAX_FRAMES, bench_out_scalar);
+    scalar_cycles = DWT->CYCCNT - start;
+#endif
+
+    start = DWT->CYCCNT;
+    interleaved_stereo_to_mono(bench_in, MAX_FRAMES, bench_out_fast);
+    fast_cycles = DWT->CYCCNT - start;
+    irq_unlock(key);
+
+#ifdef CONFIG_OMI_MIC_BEAMFORM
+    beamform_init();
+#endif
+#ifdef CONFIG_OMI_MIC_DC_BLOCK
+    /* Filtered output can't match the plain mix; start the mic from a clean filter */
+    dc_prev_in = 0;
+    dc_out_q8 = 0;
+    LOG_INF("Downmix %d frames: scalar %u cycles, dc block %u cycles", MAX_FRAMES, scalar_cycles, fast_cycles);
+#else
+    bool match = memcmp(bench_out_scalar, bench_out_fast, sizeof(bench_out_fast)) == 0;
+    LOG_INF("Downmix %d frames: scalar %u cycles, %s %u cycles, output %s",
+            MAX_FRAMES,
+            scalar_cycles,
+            MIC_DOWNMIX_SIMD ? "simd" : "scalar",
+            fast_cycles,
+            match ? "identical" : "MISMATCH");
+#endif
+}
+#endif
 
 static void process_audio_buffer(void *buffer, uint32_t size)
 {
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+    uint32_t trace_start = monitor_trace_now();
+#endif
     /* size is total interleaved stereo size: frames * 2ch * 2bytes */
     __ASSERT_NO_MSG((size % (BYTES_PER_SAMPLE * CHANNELS)) == 0);
     size_t frames = size / (BYTES_PER_SAMPLE * CHANNELS);
@@ -73,15 +415,165 @@ static void process_audio_buffer(void *buffer, uint32_t size)
         return;
     }
 
-    interleaved_stereo_to_mono(inter, frames, mono_buffer);
+    /* The block ends now; each frame started (frames - pos) samples earlier */
+    uint64_t block_end_ms = rtc_get_utc_time_ms();
+
+    /* A frame is only taken for a consumer, nothing else would hand it back to the allocator */
+    mix_handler callback = callback_func;
+    /* A dropped frame still runs through the filters, their history must stay in step with the input */
+    static int16_t dropped_frame[MIC_FRAME_SAMPLES];
 
-    if (callback_func) {
-        callback_func(mono_buffer);
+    /* Downmix directly into codec-sized frames, no intermediate mono copy */
+    for (size_t pos = 0; pos + PDM_FRAME_SAMPLES <= frames; pos += PDM_FRAME_SAMPLES) {
+        int16_t *frame = callback && frame_alloc_func ? frame_alloc_func() : NULL;
+        if (frame == NULL && callback) {
+            LOG_WRN("No free frame, dropping %d samples", MIC_FRAME_SAMPLES);
+        }
+        int16_t *out = frame ? frame : dropped_frame;
+
+#if MIC_DECIMATION > 1
+        downmix_decimate(inter + pos * CHANNELS, out);
+#elif CHANNELS == 1
+        /* Single populated mic: the block is already mono, skip the mixing stage */
+#ifdef CONFIG_OMI_MIC_DC_BLOCK
+        mono_dc_block(inter + pos, MIC_FRAME_SAMPLES, out);
+#else
+        memcpy(out, inter + pos, MIC_FRAME_SAMPLES * BYTES_PER_SAMPLE);
+#endif
+#else
+        interleaved_stereo_to_mono(inter + pos * CHANNELS, MIC_FRAME_SAMPLES, out);
+#endif
+        if (frame == NULL) {
+            continue;
+        }
+
+        uint32_t capture_ms = 0;
+        if (block_end_ms) {
+            capture_ms = (uint32_t) (block_end_ms - (frames - pos) * 1000 / MAX_SAMPLE_RATE);
+        }
+        callback(frame, capture_ms);
+#ifdef CONFIG_OMI_ENABLE_LATENCY_TRACE
+        monitor_trace_stage(MONITOR_STAGE_MIC, trace_start);
+#endif
     }
 
     k_mem_slab_free(&mem_slab, buffer);
 }
 
+#ifdef NRF_PDM0_S
+#define MIC_PDM_REG NRF_PDM0_S
+#else
+#define MIC_PDM_REG NRF_PDM0_NS
+#endif
+
+static const uint8_t pdm_profile_ratio[CODEC_PROFILE_COUNT + 1] = {
+    [CODEC_PROFILE_LOW_POWER] = MIC_PDM_RATIO_LOW_POWER,
+    [CODEC_PROFILE_BALANCED] = MIC_PDM_RATIO_BALANCED,
+    [CODEC_PROFILE_HIGH_FIDELITY] = MIC_PDM_RATIO_HIGH_FIDELITY,
+    [CODEC_PROFILE_OFFLINE] = MIC_PDM_RATIO_OFFLINE,
+};
+static atomic_t pdm_ratio_requested = ATOMIC_INIT(pdm_profile_ratio[CODEC_PROFILE_DEFAULT]);
+static uint8_t pdm_ratio_active; /* mic thread, or mic_start() before it runs */
+/* The requested ratio last tried, whether it took or fell back; the thread only retries on a new request */
+static uint8_t pdm_ratio_applied;
+
+static void log_pdm_clock(void)
+{
+    /* PDMCLKCTRL is 2^32 * clock / 32MHz on the default 32MHz source */
+    uint32_t clk_hz = (uint32_t) (((uint64_t) MIC_PDM_REG->PDMCLKCTRL * 32000000) >> 32);
+    uint32_t ratio = 64;
+#if NRF_PDM_HAS_RATIO_CONFIG
+    ratio = MIC_PDM_REG->RATIO == NRF_PDM_RATIO_80X ? 80 : 64;
+#endif
+    LOG_INF("PDM clock %u Hz, ratio %u, %u Hz PCM", clk_hz, ratio, clk_hz / ratio);
+}
+
+/* ratio 0 leaves the clock to the driver */
+static int mic_configure(uint8_t ratio)
+{
+    struct pcm_stream_cfg stream = {
+        .pcm_width = SAMPLE_BIT_WIDTH,
+        .mem_slab = &mem_slab,
+        .pcm_rate = MAX_SAMPLE_RATE,
+        .block_size = BLOCK_SIZE(MAX_SAMPLE_RATE, CHANNELS),
+    };
+    uint32_t target = MAX_SAMPLE_RATE * ratio;
+    uint32_t tolerance = target / 100 * MIC_PDM_CLK_TOLERANCE_PERCENT;
+
+    struct dmic_cfg cfg = {
+        .io =
+            {
+                .min_pdm_clk_freq = ratio ? target - tolerance : 512000,
+                .max_pdm_clk_freq = ratio ? target + tolerance : 3500000,
+                .min_pdm_clk_dc = 48,
+                .max_pdm_clk_dc = 52,
+            },
+        .streams = &stream,
+        .channel =
+            {
+                .req_num_streams = 1,
+                .req_num_chan = CHANNELS,
+#if CHANNELS == 1
+                .req_chan_map_lo = dmic_build_channel_map(0, 0, PDM_CHAN_LEFT),
+#else
+                .req_chan_map_lo =
+                    dmic_build_channel_map(0, 0, PDM_CHAN_LEFT) | dmic_build_channel_map(1, 0, PDM_CHAN_RIGHT),
+#endif
+            },
+
+    };
+
+    int ret = dmic_configure(dmic_dev, &cfg);
+    if (ret < 0 && ratio) {
+        LOG_WRN("No PDM clock near %u Hz (err %d), letting the driver choose", target, ret);
+        return mic_configure(0);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    pdm_ratio_active = ratio;
+    log_pdm_clock();
+    return 0;
+}
+
+void mic_set_pdm_profile(uint8_t profile)
+{
+    if (profile < ARRAY_SIZE(pdm_profile_ratio)) {
+        atomic_set(&pdm_ratio_requested, pdm_profile_ratio[profile]);
+    }
+}
+
+/* Called by the mic thread between blocks: the PDM only takes a new clock while it is stopped */
+static void apply_pdm_ratio(uint8_t ratio)
+{
+    pdm_ratio_applied = ratio;
+    int ret = dmic_trigger(dmic_dev, DMIC_TRIGGER_STOP);
+    if (ret < 0) {
+        LOG_ERR("STOP trigger failed: %d", ret);
+        return;
+    }
+
+    /* The driver is busy until the STOPPED event */
+    for (int tries = 0; tries < 10; tries++) {
+        ret = mic_configure(ratio);
+        if (ret != -EBUSY) {
+            break;
+        }
+        k_msleep(1);
+    }
+    if (ret < 0) {
+        LOG_ERR("Failed to configure the driver: %d", ret);
+    }
+
+    /* A stopped PDM picks its gain up from the driver again */
+    mic_set_gain(app_settings_get_mic_gain());
+    ret = dmic_trigger(dmic_dev, DMIC_TRIGGER_START);
+    if (ret < 0) {
+        LOG_ERR("START trigger failed: %d", ret);
+    }
+}
+
 static void mic_thread_function(void *p1, void *p2, void *p3)
 {
     ARG_UNUSED(p1);
@@ -90,6 +582,11 @@ static void mic_thread_function(void *p1, void *p2, void *p3)
 
     while (true) {
         if (mic_running) {
+            uint8_t ratio = (uint8_t) atomic_get(&pdm_ratio_requested);
+            if (ratio != pdm_ratio_applied) {
+                apply_pdm_ratio(ratio);
+            }
+
             void *buffer;
             uint32_t size;
     
@@ -100,7 +597,11 @@ static void mic_thread_function(void *p1, void *p2, void *p3)
             }
     
             LOG_DBG("Got buffer %p of %u bytes", buffer, size);
+            FLIGHT_REC(FLIGHT_REC_MIC_BLOCK, 0, size / BYTES_PER_SAMPLE);
             process_audio_buffer(buffer, size);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+            monitor_progress(MONITOR_WORKER_MIC, MONITOR_STEP_MIC_BLOCK);
+#endif
         } else {
             k_sleep(K_MSEC(100));
         }
@@ -108,7 +609,7 @@ static void mic_thread_function(void *p1, void *p2, void *p3)
 }
 
 #define MIC_THREAD_STACK_SIZE 2048
-#define MIC_THREAD_PRIORITY 5
+#define MIC_THREAD_PRIORITY THREAD_PRIO_MIC
 K_THREAD_DEFINE(mic_thread_id,
                 MIC_THREAD_STACK_SIZE,
                 mic_thread_function,
@@ -123,41 +624,25 @@ int mic_start()
 {
     int ret;
 
+#ifdef CONFIG_OMI_MIC_BEAMFORM
+    beamform_init();
+#endif
+
+#ifdef MIC_DOWNMIX_BENCHMARK
+    downmix_benchmark();
+#endif
+
     dmic_dev = DEVICE_DT_GET(DT_ALIAS(dmic0));
     if (!device_is_ready(dmic_dev)) {
         LOG_ERR("%s is not ready", dmic_dev->name);
         return -ENODEV;
     }
 
-    struct pcm_stream_cfg stream = {
-        .pcm_width = SAMPLE_BIT_WIDTH,
-        .mem_slab = &mem_slab,
-        .pcm_rate = MAX_SAMPLE_RATE,
-        .block_size = BLOCK_SIZE(MAX_SAMPLE_RATE, CHANNELS),
-    };
-
-    struct dmic_cfg cfg = {
-        .io =
-            {
-                .min_pdm_clk_freq = 512000,
-                .max_pdm_clk_freq = 3500000,
-                .min_pdm_clk_dc = 48,
-                .max_pdm_clk_dc = 52,
-            },
-        .streams = &stream,
-        .channel =
-            {
-                .req_num_streams = 1,
-                .req_num_chan = CHANNELS,
-                .req_chan_map_lo =
-                    dmic_build_channel_map(0, 0, PDM_CHAN_LEFT) | dmic_build_channel_map(1, 0, PDM_CHAN_RIGHT),
-            },
+    LOG_INF("PCM output rate: %u, channels: %u, %d ms blocks (%d in the slab)", MAX_SAMPLE_RATE, CHANNELS,
+            MIC_BLOCK_MS, BLOCK_COUNT);
 
-    };
-
-    LOG_INF("PCM output rate: %u, channels: %u", cfg.streams[0].pcm_rate, cfg.channel.req_num_chan);
-
-    ret = dmic_configure(dmic_dev, &cfg);
+    pdm_ratio_applied = (uint8_t) atomic_get(&pdm_ratio_requested);
+    ret = mic_configure(pdm_ratio_applied);
     if (ret < 0) {
         LOG_ERR("Failed to configure the driver: %d", ret);
         return ret;
@@ -173,7 +658,7 @@ int mic_start()
         return ret;
     }
 
-    mic_running = true;
+    set_mic_running(true);
     k_thread_start(mic_thread_id);
 
     LOG_INF("Microphone started");
@@ -185,6 +670,11 @@ void set_mic_callback(mix_handler callback)
     callback_func = callback;
 }
 
+void set_mic_frame_allocator(mic_frame_alloc_handler allocator)
+{
+    frame_alloc_func = allocator;
+}
+
 void mic_pause()
 {
     LOG_INF("Pausing microphone");
@@ -194,7 +684,7 @@ void mic_pause()
             LOG_ERR("STOP trigger failed: %d", ret);
             return;
         }
-        mic_running = false;
+        set_mic_running(false);
     }
 }
 
@@ -207,7 +697,7 @@ void mic_resume()
             LOG_ERR("START trigger failed: %d", ret);
             return;
         }
-        mic_running = true;
+        set_mic_running(true);
     }
 }
 
@@ -219,7 +709,7 @@ bool mic_is_running()
 void mic_off()
 {
     if (mic_running) {
-        mic_running = false;
+        set_mic_running(false);
         k_thread_abort(mic_thread_id);
 
         int ret = dmic_trigger(dmic_dev, DMIC_TRIGGER_STOP);
@@ -240,7 +730,7 @@ void mic_on()
             return;
         }
 
-        mic_running = true;
+        set_mic_running(true);
         k_thread_start(mic_thread_id);
 
         LOG_INF("Microphone restarted");
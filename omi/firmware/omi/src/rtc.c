@@ -9,11 +9,25 @@
 
 LOG_MODULE_REGISTER(rtc, CONFIG_LOG_DEFAULT_LEVEL);
 
-static uint64_t base_epoch_ms;
-static int64_t base_uptime_ms;
+// Drift is only estimated over long spans, the app syncs with whole seconds
+#define RTC_DRIFT_MIN_SPAN_US (4ULL * 3600 * USEC_PER_SEC) // +-70ppm resolution
+#define RTC_DRIFT_MAX_PPB 100000                           // 100ppm, well beyond any working 32kHz crystal
+
+/*
+ * UTC is the base plus the monotonic time since it, stretched by the drift estimate.
+ * A spinlock rather than a mutex so timestamps can be taken from interrupts.
+ */
+static uint64_t base_utc_us;
+static uint64_t base_mono_us;
+static int32_t drift_ppb;
 static bool utc_valid;
 
-static struct k_mutex rtc_lock;
+// First app sync of this boot, the drift is measured against it
+static uint64_t ref_utc_us;
+static uint64_t ref_mono_us;
+static bool ref_valid;
+
+static struct k_spinlock rtc_lock;
 
 // Debug functions to format UTC datetime strings
 #ifdef CONFIG_LOG
@@ -89,27 +103,86 @@ int rtc_format_now_utc_datetime(char *out, size_t out_len)
 
 bool rtc_is_valid(void)
 {
-    k_mutex_lock(&rtc_lock, K_FOREVER);
+    k_spinlock_key_t key = k_spin_lock(&rtc_lock);
     bool valid = utc_valid;
-    k_mutex_unlock(&rtc_lock);
+    k_spin_unlock(&rtc_lock, key);
     return valid;
 }
 
+static uint64_t utc_at_locked(uint64_t mono_us)
+{
+    /* Stamps from before the last sync are placed at it, keeping UTC monotonic */
+    uint64_t elapsed = mono_us > base_mono_us ? mono_us - base_mono_us : 0;
+    int64_t correction = ((int64_t)elapsed * drift_ppb) / 1000000000LL;
+    return base_utc_us + elapsed + correction;
+}
+
+uint64_t rtc_utc_us_at(uint64_t mono_us)
+{
+    k_spinlock_key_t key = k_spin_lock(&rtc_lock);
+    uint64_t utc_us = utc_valid ? utc_at_locked(mono_us) : 0;
+    k_spin_unlock(&rtc_lock, key);
+    return utc_us;
+}
+
+int32_t rtc_get_drift_ppb(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&rtc_lock);
+    int32_t ppb = drift_ppb;
+    k_spin_unlock(&rtc_lock, key);
+    return ppb;
+}
+
 uint64_t rtc_get_utc_time_ms(void)
 {
-    k_mutex_lock(&rtc_lock, K_FOREVER);
-    if (!utc_valid) {
-        k_mutex_unlock(&rtc_lock);
-        return 0;
+    return rtc_utc_us_at(rtc_now_us()) / USEC_PER_MSEC;
+}
+
+/* How far the local clock ran off the app's since the reference sync */
+static void update_drift_locked(uint64_t utc_us, uint64_t mono_us)
+{
+    if (!ref_valid) {
+        ref_utc_us = utc_us;
+        ref_mono_us = mono_us;
+        ref_valid = true;
+        return;
+    }
+
+    uint64_t span_us = mono_us - ref_mono_us;
+    if (span_us < RTC_DRIFT_MIN_SPAN_US) {
+        return;
     }
-    int64_t now_uptime_ms = k_uptime_get();
-    int64_t delta_ms = now_uptime_ms - base_uptime_ms;
-    if (delta_ms < 0) {
-        delta_ms = 0;
+
+    int64_t error_us = (int64_t)(utc_us - ref_utc_us) - (int64_t)span_us;
+    int64_t ppb = error_us * 1000000000LL / (int64_t)span_us;
+    if (ppb > RTC_DRIFT_MAX_PPB || ppb < -RTC_DRIFT_MAX_PPB) {
+        /* Most likely the phone's clock was changed, start measuring again */
+        LOG_WRN("Implausible clock drift %lld ppb, restarting the estimate", ppb);
+        ref_utc_us = utc_us;
+        ref_mono_us = mono_us;
+        drift_ppb = 0;
+        return;
+    }
+    drift_ppb = (int32_t)ppb;
+}
+
+static void set_base(uint64_t utc_us, bool reference)
+{
+    uint64_t now_us = rtc_now_us();
+
+    k_spinlock_key_t key = k_spin_lock(&rtc_lock);
+    if (reference) {
+        update_drift_locked(utc_us, now_us);
+    }
+    base_utc_us = utc_us;
+    base_mono_us = now_us;
+    utc_valid = true;
+    int32_t ppb = drift_ppb;
+    k_spin_unlock(&rtc_lock, key);
+
+    if (reference) {
+        LOG_INF("RTC synchronized, drift estimate %d ppb", ppb);
     }
-    uint64_t now_ms = base_epoch_ms + (uint64_t)delta_ms;
-    k_mutex_unlock(&rtc_lock);
-    return now_ms;
 }
 
 int rtc_set_utc_time(uint64_t utc_epoch_s)
@@ -118,10 +191,7 @@ int rtc_set_utc_time(uint64_t utc_epoch_s)
         return -EINVAL;
     }
 
-    int err = rtc_set_utc_time_ms(utc_epoch_s * 1000ULL);
-    if (err) {
-        return err;
-    }
+    set_base(utc_epoch_s * USEC_PER_SEC, true);
 
     /* Persist seconds for compatibility. */
     return app_settings_save_rtc_epoch(utc_epoch_s);
@@ -133,12 +203,8 @@ int rtc_set_utc_time_ms(uint64_t utc_epoch_ms)
         return -EINVAL;
     }
 
-    k_mutex_lock(&rtc_lock, K_FOREVER);
-    base_epoch_ms = utc_epoch_ms;
-    base_uptime_ms = k_uptime_get();
-    utc_valid = true;
-    k_mutex_unlock(&rtc_lock);
-
+    /* Estimates (e.g. restored across system off) say nothing about the drift */
+    set_base(utc_epoch_ms * USEC_PER_MSEC, false);
     return 0;
 }
 
@@ -159,26 +225,16 @@ uint32_t get_utc_time(void)
 
 void init_rtc(void)
 {
-    static bool initialized;
-    if (!initialized) {
-        k_mutex_init(&rtc_lock);
-        initialized = true;
-    }
-
     uint64_t saved_epoch_s = app_settings_get_rtc_epoch();
     LOG_INF("RTC init: persisted rtc_epoch=%llu", saved_epoch_s);
     if (saved_epoch_s == 0) {
-        k_mutex_lock(&rtc_lock, K_FOREVER);
+        k_spinlock_key_t key = k_spin_lock(&rtc_lock);
         utc_valid = false;
-        k_mutex_unlock(&rtc_lock);
+        k_spin_unlock(&rtc_lock, key);
         LOG_WRN("RTC not synchronized yet (no persisted epoch)");
         return;
     }
 
-    k_mutex_lock(&rtc_lock, K_FOREVER);
-    base_epoch_ms = saved_epoch_s * 1000ULL;
-    base_uptime_ms = k_uptime_get();
-    utc_valid = true;
-    k_mutex_unlock(&rtc_lock);
+    set_base(saved_epoch_s * USEC_PER_SEC, false);
     LOG_INF("RTC restored from persisted epoch");
 }
\ No newline at end of file
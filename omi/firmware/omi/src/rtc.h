@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <zephyr/kernel.h>
 
 /**
  * @brief Minimum buffer size for formatted UTC datetime strings.
@@ -35,7 +36,8 @@ bool rtc_is_valid(void);
  * @brief Set/synchronize UTC epoch seconds.
  *
  * Persists a base value to settings and uses monotonic uptime to produce a
- * stable increasing time while running.
+ * stable increasing time while running. Syncs from the app also feed the drift
+ * estimate, rtc_set_utc_time_ms() does not.
  */
 int rtc_set_utc_time(uint64_t utc_epoch_s);
 
@@ -46,6 +48,34 @@ int rtc_set_utc_time(uint64_t utc_epoch_s);
  */
 int rtc_set_utc_time_ms(uint64_t utc_epoch_ms);
 
+/**
+ * @brief Monotonic microseconds since boot, the timestamp for frames and samples.
+ *
+ * Reads the system RTC counter (30.5us steps on the 32768Hz clock). Cheap and safe in
+ * interrupts; convert to UTC later with rtc_utc_us_at(), which is not needed on the hot path.
+ */
+static inline uint64_t rtc_now_us(void)
+{
+    return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+/**
+ * @brief Convert an rtc_now_us() stamp to UTC epoch microseconds.
+ *
+ * Applies the drift measured between app time syncs. Safe in interrupts.
+ *
+ * @return UTC epoch microseconds, or 0 if unsynchronized.
+ */
+uint64_t rtc_utc_us_at(uint64_t mono_us);
+
+/**
+ * @brief Current drift estimate of the local clock against the app's.
+ *
+ * @return Parts per billion the local clock runs slow (positive) or fast, 0 until
+ *         enough time has passed between syncs.
+ */
+int32_t rtc_get_drift_ppb(void);
+
 /**
  * @brief Get UTC epoch milliseconds.
  *
@@ -1,32 +1,97 @@
 #include "lib/core/sd_card.h"
+#include "lib/core/config.h"
+#include "lib/core/flight_rec.h"
+#include "lib/core/settings.h"
+#include "lib/core/storage_record.h"
+#include "lib/core/tune.h"
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+#include "lib/core/warm_resume.h"
+#endif
+#include "rtc.h"
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+#include "flash_cache.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "lib/core/monitor.h"
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+#include "lib/core/sd_crypt.h"
+#endif
+#include <errno.h>
 #include <ff.h>
+#include <stdio.h>
 #include <zephyr/fs/fs.h>
 #include <string.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/sdhc.h>
 #include <zephyr/fs/fs.h>
 #include <zephyr/fs/fs_sys.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/pm/device.h>
+#include <zephyr/sd/sd.h>
+#include <zephyr/sd/sd_spec.h>
 #include <zephyr/storage/disk_access.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/check.h>
 
 LOG_MODULE_REGISTER(sd_card, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define DISK_DRIVE_NAME "SD"        // Disk drive name
 #define DISK_MOUNT_PT "/SD:"        // Mount point path
-#define SD_REQ_QUEUE_MSGS  25       // Number of messages in the SD request queue
+#define SD_WRITE_BLOCKS    8        // Write blocks between the pusher and the worker, ~0.9s of audio
+#define SD_CTRL_QUEUE_MSGS 8        // Offsets, deletes, lookups and updates waiting for the worker
+#define SD_READ_QUEUE_MSGS 8        // Sync reads waiting for the worker
+#define SD_SPILL_BLOCKS    8        // RAM blocks audio spills into once every write block is queued, ~0.9s more
+#define SD_QUEUE_FAIR_TURNS 8       // A waiting queue passed over this many times in a row goes next
+#define SD_READ_SLICE_BYTES 2048    // Reads go in slices this big, queued writes are taken in between
 #define SD_FSYNC_THRESHOLD 20000    // Threshold in bytes to trigger fsync
 #define WRITE_BATCH_COUNT 10        // Number of writes to batch before writing to SD card
 #define ERROR_THRESHOLD 5           // Maximum allowed write errors before taking action
+#define SD_RECOVERY_SCAN_BLOCKS 64  // Tail blocks checked at boot, more than SD_FSYNC_THRESHOLD holds
+
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+// Blocks go to the SPI flash log first. The card is powered up to drain the log once this many
+// blocks are waiting (~2 min of audio), and cut again when nobody reads from it. The drain runs
+// FLASH_CACHE_DRAIN_STEP blocks at a time between requests, so appends never wait behind it.
+#define FLASH_CACHE_DRAIN_BLOCKS 1024
+#define FLASH_CACHE_DRAIN_STEP 16
+static bool flash_cache_ready = false;
+static bool flash_drain_active = false;
+#endif
+
+// The card is unmounted and its rail cut after SD_IDLE_OFF_MS without requests (while live audio
+// goes to the phone nothing is written), and mounted again by the next request. Writes arriving
+// meanwhile wait in the write blocks, which hold more audio than a mount takes.
+static bool sd_started = false; // startup done, sd_sleep() and sd_wake() may cycle the card
+static bool sd_awake = false;
+static int64_t sd_last_use = 0;
 
 // batch write buffer
+#ifdef CONFIG_OMI_ENABLE_SD_ALIGNED_WRITES
+// Batches are cut at sector boundaries of the data file, so FatFs writes whole sectors straight
+// from the batch instead of read-modify-writing a partial one. The tail of the last block waits
+// in the buffer for the next flush; get_file_size() only counts complete blocks.
+#define SD_SECTOR_SIZE 512
+#define SD_ALIGNED_FLUSH_BYTES (8 * SD_SECTOR_SIZE)
+static uint8_t write_batch_buffer[SD_ALIGNED_FLUSH_BYTES + MAX_WRITE_SIZE];
+#else
 static uint8_t write_batch_buffer[WRITE_BATCH_COUNT * MAX_WRITE_SIZE];
+#endif
 static size_t write_batch_offset = 0;
 static int write_batch_counter = 0;
 static uint8_t writing_error_counter = 0;
 
+// Tunable below their defaults only: the batch buffer is sized for WRITE_BATCH_COUNT, and the boot
+// recovery scan has to reach back past everything written since the last sync
+#define SD_FSYNC_MAX_BYTES ((SD_RECOVERY_SCAN_BLOCKS - WRITE_BATCH_COUNT) * MAX_WRITE_SIZE)
+BUILD_ASSERT(SD_FSYNC_THRESHOLD <= SD_FSYNC_MAX_BYTES, "SD_RECOVERY_SCAN_BLOCKS must cover SD_FSYNC_THRESHOLD");
+#ifndef CONFIG_OMI_ENABLE_SD_ALIGNED_WRITES
+TUNABLE uint32_t write_batch_count = WRITE_BATCH_COUNT;
+#endif
+TUNABLE uint32_t fsync_threshold = SD_FSYNC_THRESHOLD;
+
 static FATFS fat_fs;
 
 static struct fs_mount_t mp = {
@@ -38,11 +103,82 @@ static struct fs_mount_t mp = {
 };
 
 #define FILE_DATA_DIR "/SD:/audio"
-#define FILE_DATA_PATH "/SD:/audio/a01.txt"
 #define FILE_INFO_PATH "/SD:/info.txt"
 
-static struct fs_file_t fil_data;
+// Audio is kept in a chain of segment files a01.txt, a02.txt, ... (ids wrap from 255 to 1).
+// Only the newest segment grows; once full it is closed and the next id is started. Readers
+// see the chain as one stream starting at the oldest segment, and acknowledged segments are
+// unlinked from the front one at a time, so reclaiming space never rewrites anything.
+#define SEGMENT_BYTES (8192 * MAX_WRITE_SIZE) // ~15 min at 32 kbps, a multiple of 512 as well
+#define SEGMENT_MAX_ID 255
+#define SEGMENT_PATH_LEN 24
+#define MANIFEST_VERSION 1
+
+// The storage limit follows the free space on the card. Stream offsets (in info.txt and on the
+// wire) are 32-bit but only count from the oldest segment, so they only bound unsynced audio.
+#define SD_RESERVED_BYTES (4 * 1024 * 1024) // left free for the file system and the index files
+#define SD_STREAM_MAX_BYTES 0xF0000000u     // ~12 days at 32 kbps, well clear of the offset wrap
+static uint32_t storage_limit = MAX_STORAGE_BYTES;
+
+// Capacity model: fs_statvfs walks the FAT, so the card is only measured when a segment is started
+// or deleted; in between, the free space is the last measurement less what the stream grew since
+static uint32_t card_kb = 0;        // file system size, 0 until mounted
+static uint32_t measured_free_kb = 0;
+static uint32_t measured_stream = 0; // get_file_size() plus pending bytes at that measurement
+static uint32_t sd_pending_bytes(void);
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+// Ring mode: a full card unlinks its oldest segment to make room, which costs one delete
+static uint8_t retention = SD_RING_RETENTION;
+static atomic_t evicted_segments = ATOMIC_INIT(0);
+static atomic_t evicted_bytes = ATOMIC_INIT(0);
+// A sync read queued or running addresses the stream as it was, an eviction would move the data under
+// it; evictions wait until no read is left (worker only)
+static bool sd_read_running = false;
+static bool ring_evict_deferred = false;
+static void ring_make_room(void);
+static bool ring_evict_first(void);
+#endif
+
+// Each segment aNN.txt has a sparse time index iNN.txt next to it, which goes away with it
+#define INDEX_INTERVAL_S 10
+
+struct sd_index_entry {
+    uint32_t utc_s;
+    uint32_t offset; // within the segment, always the start of a block
+} __packed;
+
+// info.txt: the stream offset saved for the app (as in the single-file layout), then the chain
+struct sd_manifest {
+    uint32_t offset;
+    uint8_t version;
+    uint8_t first_segment;
+    uint8_t last_segment;
+    uint8_t reserved;
+} __packed;
+
+static struct fs_file_t fil_data; // newest segment, appended to
+static struct fs_file_t fil_read; // older segment being synced
 static struct fs_file_t fil_info;
+static uint8_t fil_read_segment = 0; // 0 if fil_read is closed
+
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+// Segments are encrypted as they are flushed and decrypted as they are read, with the salt of
+// each aNN.txt in kNN.txt. A segment without one predates encryption and stays plaintext.
+static struct sd_crypt write_crypt; // last_segment
+static struct sd_crypt read_crypt;  // fil_read_segment
+static int write_crypt_err = 0;     // the newest segment takes no writes while its key is missing or used up
+#endif
+
+static uint8_t first_segment = 1;
+static uint8_t last_segment = 1;
+static uint32_t segment_sizes[SEGMENT_MAX_ID + 1]; // closed segments only
+static uint32_t closed_segments_size = 0;
+
+// Index entry for a block that is still in the write batch
+static struct sd_index_entry index_pending;
+static bool index_pending_valid = false;
+static uint32_t index_last_utc_s = 0;
 
 static bool is_mounted = false;
 static bool sd_enabled = false;
@@ -52,9 +188,201 @@ static size_t bytes_since_sync = 0;
 
 // Get the device pointer for the SDHC SPI slot from the device tree
 static const struct device *const sd_dev = DEVICE_DT_GET(DT_NODELABEL(sdhc0));
+// The SD disk under it; its driver data starts with the stack's struct sd_card
+static const struct device *const sd_disk_dev = DEVICE_DT_GET(DT_COMPAT_GET_ANY_STATUS_OKAY(zephyr_sdmmc_disk));
 static const struct gpio_dt_spec sd_en = GPIO_DT_SPEC_GET_OR(DT_NODELABEL(sdcard_en_pin), gpios, {0});
 
-K_MSGQ_DEFINE(sd_msgq, sizeof(sd_req_t), SD_REQ_QUEUE_MSGS, 4);
+// Requests wait in one queue per class, served in priority order: recording writes, then control,
+// then sync reads. The write queue holds every write block, so a write never waits to be queued.
+K_MSGQ_DEFINE(sd_write_q, sizeof(sd_req_t), SD_WRITE_BLOCKS, 4);
+K_MSGQ_DEFINE(sd_ctrl_q, sizeof(sd_req_t), SD_CTRL_QUEUE_MSGS, 4);
+K_MSGQ_DEFINE(sd_read_q, sizeof(sd_req_t), SD_READ_QUEUE_MSGS, 4);
+#define SD_QUEUE_MSGS (SD_WRITE_BLOCKS + SD_CTRL_QUEUE_MSGS + SD_READ_QUEUE_MSGS)
+// Given once per queued request or spilled block; the worker sleeps on it instead of on any one queue
+K_SEM_DEFINE(sd_req_sem, 0, SD_QUEUE_MSGS + SD_SPILL_BLOCKS);
+K_MEM_SLAB_DEFINE_STATIC(sd_write_slab, MAX_WRITE_SIZE, SD_WRITE_BLOCKS, 4);
+
+// Audio the worker is behind on once every write block is queued, so the pusher never waits. Slots are
+// handed out and written in order, after the queued writes (which are older) and before anything else.
+// While any slot is in use new audio spills too, and nothing else takes a write block, so the stream
+// stays in order.
+static uint8_t sd_spill[SD_SPILL_BLOCKS][MAX_WRITE_SIZE] __aligned(4);
+#define SD_SPILL_FILLING UINT16_MAX              // sd_spill_len of a slot handed out and not written yet
+static uint16_t sd_spill_len[SD_SPILL_BLOCKS]; // 0 for a slot given back empty, released unwritten
+static uint32_t sd_spill_seq[SD_SPILL_BLOCKS]; // sd_req_t.seq of a filled slot
+static uint8_t sd_spill_head;                  // next slot handed out
+static uint8_t sd_spill_tail;                  // oldest slot in use
+static uint8_t sd_spill_used;
+static struct k_spinlock sd_spill_lock;
+
+enum sd_queue {
+    SD_QUEUE_WRITE,
+    SD_QUEUE_CTRL,
+    SD_QUEUE_READ,
+    SD_QUEUE_COUNT,
+};
+static struct k_msgq *const sd_queues[SD_QUEUE_COUNT] = {&sd_write_q, &sd_ctrl_q, &sd_read_q};
+static atomic_t sd_req_seq = ATOMIC_INIT(0);
+static uint8_t sd_passed_over[SD_QUEUE_COUNT]; // worker only
+
+static __maybe_unused uint32_t sd_queued(void)
+{
+    uint32_t used = 0;
+    for (int i = 0; i < SD_QUEUE_COUNT; i++) {
+        used += k_msgq_num_used_get(sd_queues[i]);
+    }
+    return used;
+}
+
+static bool is_spill_block(const uint8_t *block)
+{
+    return block >= sd_spill[0] && block < sd_spill[SD_SPILL_BLOCKS];
+}
+
+static inline void sd_report_level(void)
+{
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_queue_level(MONITOR_QUEUE_SD, sd_queued() + sd_spill_used, SD_QUEUE_MSGS + SD_SPILL_BLOCKS);
+#endif
+}
+
+// The oldest spilled block, once it has been filled
+static bool spill_take(sd_req_t *req)
+{
+    k_spinlock_key_t key = k_spin_lock(&sd_spill_lock);
+    // Slots given back empty hold nothing to write
+    while (sd_spill_used > 0 && sd_spill_len[sd_spill_tail] == 0) {
+        sd_spill_tail = (sd_spill_tail + 1) % SD_SPILL_BLOCKS;
+        sd_spill_used--;
+    }
+    bool ready = sd_spill_used > 0 && sd_spill_len[sd_spill_tail] != SD_SPILL_FILLING;
+    if (ready) {
+        req->type = REQ_WRITE_DATA;
+        req->u.write.buf = sd_spill[sd_spill_tail];
+        req->u.write.len = sd_spill_len[sd_spill_tail];
+    }
+    k_spin_unlock(&sd_spill_lock, key);
+    return ready;
+}
+
+// Free the block spill_take() gave out
+static void spill_release(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&sd_spill_lock);
+    sd_spill_tail = (sd_spill_tail + 1) % SD_SPILL_BLOCKS;
+    sd_spill_used--;
+    // A later slot filled before this one had its wake-up spent while it had to wait
+    bool next_ready = sd_spill_used > 0 && sd_spill_len[sd_spill_tail] != SD_SPILL_FILLING;
+    k_spin_unlock(&sd_spill_lock, key);
+    if (next_ready) {
+        k_sem_give(&sd_req_sem);
+    }
+}
+
+static int sd_queue_request(sd_req_t *req)
+{
+    enum sd_queue queue = req->type == REQ_WRITE_DATA ? SD_QUEUE_WRITE
+                          : req->type == REQ_READ_DATA ? SD_QUEUE_READ
+                                                       : SD_QUEUE_CTRL;
+    int ret;
+    if (queue == SD_QUEUE_WRITE) {
+        // A write always has room (one entry per write block), the pusher must not wait on it. Writes
+        // and spilled blocks take their sequence numbers under the spill lock, in the order they're served.
+        k_spinlock_key_t key = k_spin_lock(&sd_spill_lock);
+        req->seq = (uint32_t) atomic_inc(&sd_req_seq);
+        ret = k_msgq_put(&sd_write_q, req, K_NO_WAIT);
+        k_spin_unlock(&sd_spill_lock, key);
+    } else {
+        req->seq = (uint32_t) atomic_inc(&sd_req_seq);
+        ret = k_msgq_put(sd_queues[queue], req, K_MSEC(100));
+    }
+    if (ret == 0) {
+        k_sem_give(&sd_req_sem);
+    }
+    sd_report_level();
+    return ret;
+}
+
+// The next write in order, a queued block before the spilled ones
+static bool sd_peek_write_seq(uint32_t *seq)
+{
+    sd_req_t write;
+    if (k_msgq_peek(&sd_write_q, &write) == 0) {
+        *seq = write.seq;
+        return true;
+    }
+    k_spinlock_key_t key = k_spin_lock(&sd_spill_lock);
+    bool ready = sd_spill_used > 0 && sd_spill_len[sd_spill_tail] != SD_SPILL_FILLING;
+    *seq = sd_spill_seq[sd_spill_tail];
+    k_spin_unlock(&sd_spill_lock, key);
+    return ready;
+}
+
+// Barrier: a write queued after the oldest control request waits until that one is done, so e.g.
+// audio recorded after a delete isn't deleted with the rest
+static bool sd_write_ready(void)
+{
+    uint32_t seq;
+    if (!sd_peek_write_seq(&seq)) {
+        return false;
+    }
+    sd_req_t ctrl;
+    return k_msgq_peek(&sd_ctrl_q, &ctrl) != 0 || (int32_t) (seq - ctrl.seq) < 0;
+}
+
+static bool sd_queue_waiting(enum sd_queue queue)
+{
+    if (queue == SD_QUEUE_WRITE) {
+        return sd_write_ready();
+    }
+    return k_msgq_num_used_get(sd_queues[queue]) > 0;
+}
+
+// A queued write block, else the oldest spilled block, unless a control request goes first
+static bool sd_take_write(sd_req_t *req)
+{
+    if (!sd_write_ready()) {
+        return false;
+    }
+    return k_msgq_get(&sd_write_q, req, K_NO_WAIT) == 0 || spill_take(req);
+}
+
+// Take the next request by priority. A queue kept waiting SD_QUEUE_FAIR_TURNS times in a row goes
+// first, so a sync still moves under recording and a control op under a sync.
+static bool sd_next_request(sd_req_t *req, k_timeout_t wait)
+{
+    if (k_sem_take(&sd_req_sem, wait) != 0) {
+        return false;
+    }
+    int pick = -1;
+    for (int i = 0; i < SD_QUEUE_COUNT; i++) {
+        if (!sd_queue_waiting(i)) {
+            continue;
+        }
+        if (pick < 0) {
+            pick = i;
+        } else if (sd_passed_over[i] >= SD_QUEUE_FAIR_TURNS) {
+            pick = i;
+            break;
+        }
+    }
+    // A write taken between read slices may leave its give behind, with nothing queued for it
+    if (pick < 0) {
+        return false;
+    }
+    for (int i = 0; i < SD_QUEUE_COUNT; i++) {
+        bool waiting = i != pick && sd_queue_waiting(i);
+        sd_passed_over[i] = waiting ? MIN(sd_passed_over[i] + 1, UINT8_MAX) : 0;
+    }
+    if (pick == SD_QUEUE_WRITE) {
+        if (sd_take_write(req)) {
+            return true;
+        }
+        // A control request queued ahead of the write just now, its give is the one taken
+        pick = SD_QUEUE_CTRL;
+    }
+    return k_msgq_get(sd_queues[pick], req, K_NO_WAIT) == 0;
+}
 
 void sd_worker_thread(void);
 
@@ -72,6 +400,9 @@ static int sd_enable_power(bool enable)
             pm_device_action_run(sd_dev, PM_DEVICE_ACTION_RESUME);
         }
         sd_enabled = true;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_energy_set(MONITOR_ENERGY_SD, true);
+#endif
     } else {
         if (device_is_ready(spi_dev)) {
             /* Suspend SPI and SD devices to save power */
@@ -83,13 +414,25 @@ static int sd_enable_power(bool enable)
         gpio_pin_configure(DEVICE_DT_GET(DT_NODELABEL(gpio1)), 11, GPIO_DISCONNECTED);
         ret = gpio_pin_set_dt(&sd_en, 0);
         sd_enabled = false;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_energy_set(MONITOR_ENERGY_SD, false);
+#endif
     }
     return ret;
 }
 
+static void close_read_segment(void);
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+static void close_update_file(void);
+#endif
+
 static int sd_unmount()
 {
     // Ensure files are closed before unmounting
+    close_read_segment();
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+    close_update_file();
+#endif
     fs_close(&fil_data);
     fs_close(&fil_info);
     int ret;
@@ -105,6 +448,51 @@ static int sd_unmount()
     return 0;
 }
 
+static uint32_t sd_card_sectors = 0;
+static bool sd_clock_pending = false; // mounted at the identification clock, the worker raises it
+
+// The card is identified at 400 kHz. Run it at the fastest clock both the card (25 MHz default
+// speed in SPI mode) and the slot's spi-max-frequency allow; FatFs then moves the aligned batches
+// and sync reads as multi-block CMD25/CMD18 transfers. Less bus time, less time with the rail on.
+// The SD stack has no call for this after init, so the worker changes it between requests, once
+// the stack reports the card idle, starting from the stack's own bus settings and storing the new
+// clock back in them so the stack and the host agree. Every mount runs the stack's init again,
+// which drops back to 400 kHz, and raises it again.
+static void sd_raise_clock(void)
+{
+    uint32_t clock_hz = 0;
+    struct sdhc_host_props props = {0};
+    struct sd_card *card = sd_disk_dev->data;
+    sd_clock_pending = false;
+    int ret = disk_access_ioctl(DISK_DRIVE_NAME, DISK_IOCTL_CTRL_SYNC, NULL);
+    if (ret != 0) {
+        LOG_WRN("SD card not idle, keeping the identification clock (%d)", ret);
+    } else if (sdhc_get_host_props(sd_dev, &props) == 0) {
+        struct sdhc_io io = card->bus_io;
+        io.clock = MIN(props.f_max, SD_SPI_CLOCK_HZ);
+        ret = sdhc_set_io(sd_dev, &io);
+        if (ret == 0) {
+            card->bus_io.clock = io.clock;
+            clock_hz = io.clock;
+        } else {
+            LOG_WRN("Unable to set the SD clock to %u Hz (%d)", (unsigned) io.clock, ret);
+        }
+    }
+    LOG_INF("SD clock %u kHz, slot max %u kHz", clock_hz / 1000, (unsigned) (props.f_max / 1000));
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    uint32_t capacity_mb = sd_card_sectors / (1024 * 1024 / 512);
+    struct monitor_sd_card card = {
+        .type = capacity_mb <= 2048    ? MONITOR_SD_CARD_SDSC
+                : capacity_mb <= 32768 ? MONITOR_SD_CARD_SDHC
+                                       : MONITOR_SD_CARD_SDXC,
+        .capacity_mb = capacity_mb,
+        .clock_khz = clock_hz / 1000,
+    };
+    monitor_sd_card(&card);
+#endif
+}
+
 static int sd_mount()
 {
     int ret;
@@ -132,6 +520,7 @@ static int sd_mount()
             break;
         }
         LOG_INF("Block count %u", block_count);
+        sd_card_sectors = block_count;
 
         if (disk_access_ioctl(disk_pdrv, DISK_IOCTL_GET_SECTOR_SIZE, &block_size)) {
             LOG_ERR("Unable to get sector size");
@@ -156,6 +545,7 @@ static int sd_mount()
 
     if (fs_mount(&mp)) {
         LOG_INF("File system not found, creating file system...");
+        // FatFs picks exFAT for large cards when CONFIG_FS_FATFS_EXFAT is set
         ret = fs_mkfs(FS_FATFS, (uintptr_t) mp.storage_dev, NULL, 0);
         if (ret != 0) {
             LOG_ERR("Error formatting filesystem [%d]", ret);
@@ -173,18 +563,25 @@ static int sd_mount()
 
     LOG_INF("Disk mounted.");
     is_mounted = true;
+    sd_clock_pending = true;
 
     return ret;
 }
 
 #define SD_WORKER_STACK_SIZE 4096
-#define SD_WORKER_PRIORITY 7
+#define SD_WORKER_PRIORITY THREAD_PRIO_SD_WORKER
 K_THREAD_STACK_DEFINE(sd_worker_stack, SD_WORKER_STACK_SIZE);
 static struct k_thread sd_worker_thread_data;
 static k_tid_t sd_worker_tid = NULL;
 
 int app_sd_init(void)
 {
+#ifdef CONFIG_OMI_ENABLE_TUNING
+#ifndef CONFIG_OMI_ENABLE_SD_ALIGNED_WRITES
+    tune_register("sd_write_batch", &write_batch_count, 1, WRITE_BATCH_COUNT, "blocks per SD write");
+#endif
+    tune_register("sd_fsync_bytes", &fsync_threshold, MAX_WRITE_SIZE, SD_FSYNC_MAX_BYTES, "bytes between fs_sync");
+#endif
     if (!sd_worker_tid) {
         sd_worker_tid = k_thread_create(&sd_worker_thread_data, sd_worker_stack, SD_WORKER_STACK_SIZE,
                                         (k_thread_entry_t)sd_worker_thread, NULL, NULL, NULL,
@@ -194,27 +591,84 @@ int app_sd_init(void)
     return 0;
 }
 
+static inline uint8_t next_segment(uint8_t segment)
+{
+    return segment == SEGMENT_MAX_ID ? 1 : segment + 1;
+}
+
+static void segment_path(char *path, size_t size, uint8_t segment)
+{
+    snprintf(path, size, "%s/a%02u.txt", FILE_DATA_DIR, segment);
+}
+
+static void index_path(char *path, size_t size, uint8_t segment)
+{
+    snprintf(path, size, "%s/i%02u.txt", FILE_DATA_DIR, segment);
+}
+
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+static void key_path(char *path, size_t size, uint8_t segment)
+{
+    snprintf(path, size, "%s/k%02u.txt", FILE_DATA_DIR, segment);
+}
+#endif
+
 uint32_t get_file_size()
 {
-    return current_file_size;
+    // A block only becomes readable once all of it is on the card
+    uint32_t size = closed_segments_size + current_file_size - current_file_size % MAX_WRITE_SIZE;
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+    // Cached blocks are drained before any read, so they are part of the stream already
+    size += flash_cache_bytes();
+#endif
+    return size;
 }
 
-int read_audio_data(uint8_t *buf, int amount, int offset)
+void get_segment_range(uint8_t *first, uint8_t *last)
 {
-    struct read_resp resp;
-    k_sem_init(&resp.sem, 0, 1);
+    *first = first_segment;
+    *last = last_segment;
+}
+
+int get_segment_start(uint8_t segment, uint32_t *start)
+{
+    uint32_t position = 0;
+    for (uint8_t s = first_segment;; s = next_segment(s)) {
+        if (s == segment) {
+            *start = position;
+            return 0;
+        }
+        if (s == last_segment) {
+            return -ENOENT;
+        }
+        position += segment_sizes[s];
+    }
+}
+
+int read_audio_data_async(uint8_t *buf, int amount, int offset, struct read_resp *resp)
+{
+    k_sem_init(&resp->sem, 0, 1);
 
     sd_req_t req = {0};
     req.type = REQ_READ_DATA;
     req.u.read.out_buf = buf;
     req.u.read.length = amount;
     req.u.read.offset = offset;
-    req.u.read.resp = &resp;
+    req.u.read.resp = resp;
 
-    int ret = k_msgq_put(&sd_msgq, &req, K_MSEC(100));
+    int ret = sd_queue_request(&req);
     if (ret) {
         LOG_ERR("Failed to queue read_audio_data request: %d", ret);
-        return ret;
+    }
+    return ret;
+}
+
+int read_audio_data(uint8_t *buf, int amount, int offset)
+{
+    struct read_resp resp;
+
+    if (read_audio_data_async(buf, amount, offset, &resp)) {
+        return -1;
     }
 
     if (k_sem_take(&resp.sem, K_MSEC(5000)) != 0) {
@@ -228,23 +682,95 @@ int read_audio_data(uint8_t *buf, int amount, int offset)
     return resp.read_bytes;
 }
 
+uint8_t *alloc_file_block(void)
+{
+    void *block;
+    // Would land ahead of the older audio still spilled
+    if (sd_spill_used > 0 || k_mem_slab_alloc(&sd_write_slab, &block, K_NO_WAIT) != 0) {
+        return NULL;
+    }
+    return (uint8_t *) block;
+}
 
-uint32_t write_to_file(uint8_t *data, uint32_t length)
+uint8_t *alloc_audio_block(void)
+{
+    uint8_t *block = alloc_file_block();
+    if (block) {
+        return block;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&sd_spill_lock);
+    if (sd_spill_used < SD_SPILL_BLOCKS) {
+        block = sd_spill[sd_spill_head];
+        sd_spill_len[sd_spill_head] = SD_SPILL_FILLING;
+        sd_spill_head = (sd_spill_head + 1) % SD_SPILL_BLOCKS;
+        sd_spill_used++;
+    }
+    k_spin_unlock(&sd_spill_lock, key);
+    return block;
+}
+
+uint32_t write_block_to_file(uint8_t *block, uint32_t length)
 {
+    // An empty block would be written as nothing, one over the block size past it
+    bool valid = length > 0 && length <= MAX_WRITE_SIZE;
+    if (!valid) {
+        LOG_ERR("Write block of %u bytes dropped", length);
+    }
+
+    if (is_spill_block(block)) {
+        k_spinlock_key_t key = k_spin_lock(&sd_spill_lock);
+        size_t slot = (block - sd_spill[0]) / MAX_WRITE_SIZE;
+        // The slot must still be given back, the ones behind it wait for it
+        sd_spill_len[slot] = valid ? length : 0;
+        sd_spill_seq[slot] = (uint32_t) atomic_inc(&sd_req_seq);
+        k_spin_unlock(&sd_spill_lock, key);
+        k_sem_give(&sd_req_sem);
+        sd_report_level();
+        return valid ? length : 0;
+    }
+    if (!valid) {
+        k_mem_slab_free(&sd_write_slab, (void *) block);
+        return 0;
+    }
+
     sd_req_t req = {0};
     req.type = REQ_WRITE_DATA;
-    memcpy(req.u.write.buf, data, length);
+    req.u.write.buf = block;
     req.u.write.len = length;
 
-    int ret = k_msgq_put(&sd_msgq, &req, K_MSEC(100));
+    int ret = sd_queue_request(&req);
     if (ret) {
         LOG_ERR("Failed to queue write_to_file request: %d", ret);
+        k_mem_slab_free(&sd_write_slab, (void *) block);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_SD_QUEUE_FULL, 1);
+#endif
         return 0;
     }
 
     return length;
 }
 
+uint32_t write_to_file(uint8_t *data, uint32_t length)
+{
+    if (length > MAX_WRITE_SIZE) {
+        LOG_ERR("write_to_file of %u bytes exceeds the %d byte block", length, MAX_WRITE_SIZE);
+        return 0;
+    }
+
+    uint8_t *block = alloc_file_block();
+    if (!block) {
+        LOG_ERR("No free SD write block");
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_add_drops(MONITOR_DROP_SD_QUEUE_FULL, 1);
+#endif
+        return 0;
+    }
+    memcpy(block, data, length);
+    return write_block_to_file(block, length);
+}
+
 int clear_audio_directory(void)
 {
     struct read_resp resp;
@@ -254,7 +780,7 @@ int clear_audio_directory(void)
     req.type = REQ_CLEAR_AUDIO_DIR;
     req.u.clear_dir.resp = &resp;
 
-    int ret = k_msgq_put(&sd_msgq, &req, K_MSEC(100));
+    int ret = sd_queue_request(&req);
     if (ret) {
         LOG_ERR("Failed to queue clear_audio_directory request: %d", ret);
         return -1;
@@ -275,13 +801,109 @@ int clear_audio_directory(void)
     return 0;
 }
 
+int delete_audio_segment(uint8_t segment)
+{
+    struct read_resp resp;
+    k_sem_init(&resp.sem, 0, 1);
+
+    sd_req_t req = {0};
+    req.type = REQ_DELETE_SEGMENT;
+    req.u.delete_segment.segment = segment;
+    req.u.delete_segment.resp = &resp;
+
+    int ret = sd_queue_request(&req);
+    if (ret) {
+        LOG_ERR("Failed to queue delete_audio_segment request: %d", ret);
+        return ret;
+    }
+
+    if (k_sem_take(&resp.sem, K_MSEC(5000)) != 0) {
+        LOG_ERR("Timeout waiting for delete_audio_segment response");
+        return -ETIMEDOUT;
+    }
+    if (resp.res) {
+        LOG_ERR("Failed to delete segment %u: %d", segment, resp.res);
+        return resp.res;
+    }
+    return resp.read_bytes;
+}
+
+int find_audio_time_range(uint32_t start_utc_s, uint32_t end_utc_s, uint32_t *start, uint32_t *end)
+{
+    struct read_resp resp;
+    k_sem_init(&resp.sem, 0, 1);
+
+    sd_req_t req = {0};
+    req.type = REQ_FIND_TIME_RANGE;
+    req.u.time_range.start_utc_s = start_utc_s;
+    req.u.time_range.end_utc_s = end_utc_s;
+    req.u.time_range.start = start;
+    req.u.time_range.end = end;
+    req.u.time_range.resp = &resp;
+
+    int ret = sd_queue_request(&req);
+    if (ret) {
+        LOG_ERR("Failed to queue find_audio_time_range request: %d", ret);
+        return ret;
+    }
+
+    if (k_sem_take(&resp.sem, K_MSEC(5000)) != 0) {
+        LOG_ERR("Timeout waiting for find_audio_time_range response");
+        return -ETIMEDOUT;
+    }
+    return resp.res;
+}
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+int sd_update_write_async(uint32_t offset, const uint8_t *buf, uint32_t length, struct read_resp *resp)
+{
+    k_sem_init(&resp->sem, 0, 1);
+
+    sd_req_t req = {0};
+    req.type = REQ_UPDATE_WRITE;
+    req.u.update.buf = buf;
+    req.u.update.offset = offset;
+    req.u.update.length = length;
+    req.u.update.resp = resp;
+
+    int ret = sd_queue_request(&req);
+    if (ret) {
+        LOG_ERR("Failed to queue sd_update_write request: %d", ret);
+    }
+    return ret;
+}
+
+int sd_update_finish(uint32_t size)
+{
+    struct read_resp resp;
+    k_sem_init(&resp.sem, 0, 1);
+
+    sd_req_t req = {0};
+    req.type = REQ_UPDATE_FINISH;
+    req.u.update.length = size;
+    req.u.update.resp = &resp;
+
+    int ret = sd_queue_request(&req);
+    if (ret) {
+        LOG_ERR("Failed to queue sd_update_finish request: %d", ret);
+        return ret;
+    }
+
+    if (k_sem_take(&resp.sem, K_MSEC(5000)) != 0) {
+        LOG_ERR("Timeout waiting for sd_update_finish response");
+        return -ETIMEDOUT;
+    }
+    return resp.res;
+}
+#endif
+
 int save_offset(uint32_t offset)
 {
     sd_req_t req = {0};
     req.type = REQ_SAVE_OFFSET;
     req.u.info.offset_value = offset;
 
-    int ret = k_msgq_put(&sd_msgq, &req, K_MSEC(100));
+    int ret = sd_queue_request(&req);
     if (ret) {
         LOG_ERR("Failed to queue save_offset request: %d", ret);
         return -1;
@@ -294,6 +916,30 @@ uint32_t get_offset(void)
     return current_file_offset;
 }
 
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+int sd_set_retention(enum sd_retention mode)
+{
+    if (mode >= SD_RETENTION_COUNT) {
+        return -EINVAL;
+    }
+
+    sd_req_t req = {0};
+    req.type = REQ_SET_RETENTION;
+    req.u.retention.mode = mode;
+    int ret = sd_queue_request(&req);
+    if (ret) {
+        LOG_ERR("Failed to queue sd_set_retention request: %d", ret);
+    }
+    return ret;
+}
+
+void sd_get_evictions(struct sd_evictions *evictions)
+{
+    evictions->segments = atomic_get(&evicted_segments);
+    evictions->bytes = atomic_get(&evicted_bytes);
+}
+#endif
+
 int app_sd_off(void)
 {
     if (is_mounted) {
@@ -305,234 +951,1370 @@ int app_sd_off(void)
     return 0;
 }
 
+uint32_t get_storage_limit(void)
+{
+    return storage_limit;
+}
+
+// Accepted for the card but not counted by get_file_size() yet: queued and spilled blocks, the
+// write batch and the partial block at the end of the newest segment. Racy reads, an estimate.
+static uint32_t sd_pending_bytes(void)
+{
+    uint32_t blocks = k_mem_slab_num_used_get(&sd_write_slab) + sd_spill_used;
+    return blocks * MAX_WRITE_SIZE + write_batch_offset + current_file_size % MAX_WRITE_SIZE;
+}
+
+uint32_t sd_get_room(void)
+{
+    uint32_t used = get_file_size() + sd_pending_bytes();
+    return used < storage_limit ? storage_limit - used : 0;
+}
+
+void sd_get_capacity(struct sd_capacity *capacity)
+{
+    uint32_t stored = get_file_size();
+    uint32_t pending = sd_pending_bytes();
+    uint32_t grown_kb = stored + pending > measured_stream ? (stored + pending - measured_stream) >> 10 : 0;
+
+    capacity->card_kb = card_kb;
+    capacity->free_kb = measured_free_kb > grown_kb ? measured_free_kb - grown_kb : 0;
+    capacity->stored_bytes = stored;
+    capacity->pending_bytes = pending;
+    capacity->limit_bytes = storage_limit;
+    capacity->room_bytes = stored + pending < storage_limit ? storage_limit - stored - pending : 0;
+}
+
 bool is_sd_on(void)
 {
     return sd_enabled;
 }
 
-/* SD worker thread */
-void sd_worker_thread(void)
+bool sd_accepts_writes(void)
 {
-    sd_req_t req;
-    int res;
-    ssize_t bw = 0, br = 0;
+    // Cut while idle, but the next write mounts the card again (or lands in the flash log)
+    return sd_started || sd_enabled;
+}
 
-    /* Attempt to mount FS - board-specific mount code may be needed */
-    res = sd_mount();
-    if (res != 0) {
-        LOG_ERR("[SD_WORK] mount failed: %d\n", res);
-        return;
+/* SD worker thread */
+static int write_manifest(void)
+{
+    struct sd_manifest manifest = {
+        .offset = current_file_offset,
+        .version = MANIFEST_VERSION,
+        .first_segment = first_segment,
+        .last_segment = last_segment,
+    };
+
+    int res = fs_seek(&fil_info, 0, FS_SEEK_SET);
+    if (res < 0) {
+        return res;
+    }
+    ssize_t bw = fs_write(&fil_info, &manifest, sizeof(manifest));
+    if (bw != sizeof(manifest)) {
+        LOG_ERR("[SD_WORK] info write err %d\n", (int)bw);
+        return bw < 0 ? bw : -EIO;
+    }
+    res = fs_sync(&fil_info);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] fs_sync of info file failed: %d", res);
+        return res;
     }
+    // Keep the journal in step, it takes precedence at boot
+    app_settings_save_sync_offset(current_file_offset, first_segment);
+    return 0;
+}
 
-    struct fs_dirent dirent;
-    int stat_res = fs_stat(FILE_DATA_DIR, &dirent);
-    if (stat_res < 0) {
-        int mk_res = fs_mkdir(FILE_DATA_DIR);
-        if (mk_res < 0) {
-            LOG_ERR("[SD_WORK] mkdir %s failed: %d\n", FILE_DATA_DIR, mk_res);
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+// Derive the key of segment from its salt; an empty segment gets a fresh salt first
+static int open_segment_crypt(uint8_t segment, bool empty, struct sd_crypt *crypt)
+{
+    char path[SEGMENT_PATH_LEN];
+    struct fs_file_t fil_key;
+    uint8_t salt[SD_CRYPT_SALT_SIZE];
+
+    key_path(path, sizeof(path), segment);
+    fs_file_t_init(&fil_key);
+    if (empty) {
+        int res = sd_crypt_new_salt(salt);
+        res = res ? res : fs_open(&fil_key, path, FS_O_CREATE | FS_O_RDWR | FS_O_TRUNC);
+        if (res < 0) {
+            LOG_ERR("[SD_WORK] cannot create %s: %d", path, res);
+            sd_crypt_close(crypt);
+            return res;
+        }
+        ssize_t bw = fs_write(&fil_key, salt, sizeof(salt));
+        res = bw == sizeof(salt) ? fs_sync(&fil_key) : -EIO;
+        fs_close(&fil_key);
+        if (res < 0) {
+            LOG_ERR("[SD_WORK] key write err %d", res);
+            sd_crypt_close(crypt);
+            return res;
         }
+        return sd_crypt_open(crypt, salt);
     }
 
-    /* Open data file (append) */
-    fs_file_t_init(&fil_data);
-    res = fs_open(&fil_data, FILE_DATA_PATH, FS_O_CREATE | FS_O_RDWR);
+    if (fs_open(&fil_key, path, FS_O_READ) < 0) {
+        return sd_crypt_open(crypt, NULL);
+    }
+    ssize_t br = fs_read(&fil_key, salt, sizeof(salt));
+    if (br != sizeof(salt)) {
+        fs_close(&fil_key);
+        LOG_ERR("[SD_WORK] %s is damaged", path);
+        sd_crypt_close(crypt);
+        return -EIO;
+    }
+    int res = sd_crypt_open(crypt, salt);
+    // The epochs after the first follow the salt; a start torn off by a reset was never used
+    uint8_t start[sizeof(uint32_t)];
+    while (res == 0 && fs_read(&fil_key, start, sizeof(start)) == sizeof(start)) {
+        res = sd_crypt_rekey(crypt, sys_get_le32(start));
+    }
+    fs_close(&fil_key);
     if (res < 0) {
-        LOG_ERR("[SD_WORK] open data failed: %d\n", res);
-        return;
-    } else {
-        /* move to end for append writes by default */
-        res = fs_seek(&fil_data, 0, FS_SEEK_END);
+        LOG_ERR("[SD_WORK] %s is damaged", path);
+        sd_crypt_close(crypt);
     }
+    return res;
+}
 
-    struct fs_dirent data_stat;
-    int stat_res_data = fs_stat(FILE_DATA_PATH, &data_stat);
-    if (stat_res_data == 0) {
-        current_file_size = data_stat.size;
-    } else {
-        current_file_size = 0;
+// Give the newest segment a fresh key stream from offset on, before anything is written over the
+// bytes already there. Once its epochs run out, the segment takes no more writes until it is rolled.
+static void rekey_write_segment(uint32_t offset)
+{
+    if (write_crypt_err || !write_crypt.active) {
+        return;
     }
-
-    /* Open info file (read/write, create if not exists) */
-    struct fs_dirent info_stat;
-    int info_exists = fs_stat(FILE_INFO_PATH, &info_stat);
-    fs_file_t_init(&fil_info);
-    res = fs_open(&fil_info, FILE_INFO_PATH, FS_O_CREATE | FS_O_RDWR);
-    if (res < 0) {
-        LOG_ERR("[SD_WORK] open info failed: %d\n", res);
+    if (write_crypt.epochs >= SD_CRYPT_MAX_EPOCHS) {
+        LOG_WRN("[SD_WORK] segment %u is out of key epochs, rolling it", last_segment);
+        write_crypt_err = -ENOSPC;
         return;
-    } else {
-        bool need_init_offset = false;
-        if (info_exists < 0) {
-            need_init_offset = true;
-        } else if (info_stat.size < sizeof(uint32_t)) {
-            need_init_offset = true;
-        }
-        if (need_init_offset) {
-            current_file_offset = 0;
-            uint32_t zero_offset = 0;
-            ssize_t bw = fs_write(&fil_info, &zero_offset, sizeof(zero_offset));
-            if (bw != sizeof(zero_offset)) {
-                LOG_ERR("[SD_WORK] init info.txt failed to write offset 0: %d\n", (int)bw);
-            } else {
-                fs_sync(&fil_info);
-            }
-        } else {
-            /* Read existing offset from info.txt */
-            fs_seek(&fil_info, 0, FS_SEEK_SET);
-            ssize_t rbytes = fs_read(&fil_info, &current_file_offset, sizeof(current_file_offset));
-            if (rbytes != sizeof(current_file_offset)) {
-                LOG_ERR("[SD_WORK] Failed to read offset at boot: %d\n", (int)rbytes);
-                current_file_offset = 0;
-            } else {
-                LOG_INF("[SD_WORK] Loaded offset from info.txt: %u\n", current_file_offset);
-            }
-        }
+    }
 
-        fs_seek(&fil_data, 0, FS_SEEK_END);
+    char path[SEGMENT_PATH_LEN];
+    struct fs_file_t fil_key;
+    uint8_t start[sizeof(uint32_t)];
+    key_path(path, sizeof(path), last_segment);
+    fs_file_t_init(&fil_key);
+    sys_put_le32(offset, start);
+    int res = fs_open(&fil_key, path, FS_O_WRITE | FS_O_APPEND);
+    if (res == 0) {
+        ssize_t bw = fs_write(&fil_key, start, sizeof(start));
+        res = bw == sizeof(start) ? fs_sync(&fil_key) : -EIO;
+        fs_close(&fil_key);
     }
+    res = res ? res : sd_crypt_rekey(&write_crypt, offset);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] cannot rekey segment %u at %u: %d", last_segment, offset, res);
+        write_crypt_err = res;
+    }
+}
+#endif
 
-    while (1) {
-        /* Wait for a request */
-        if (k_msgq_get(&sd_msgq, &req, K_FOREVER) == 0) {
-            switch (req.type) {
-            case REQ_WRITE_DATA:
-                LOG_DBG("[SD_WORK] Buffering %u bytes to batch write\n", (unsigned)req.u.write.len);
+static int open_write_segment(fs_mode_t flags)
+{
+    char path[SEGMENT_PATH_LEN];
+    segment_path(path, sizeof(path), last_segment);
 
-                memcpy(write_batch_buffer + write_batch_offset, req.u.write.buf, req.u.write.len);
-                write_batch_offset += req.u.write.len;
-                write_batch_counter++;
+    fs_file_t_init(&fil_data);
+    int res = fs_open(&fil_data, path, FS_O_CREATE | FS_O_RDWR | flags);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open %s failed: %d\n", path, res);
+        return res;
+    }
+    res = fs_seek(&fil_data, 0, FS_SEEK_END);
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+    if (res == 0) {
+        write_crypt_err = open_segment_crypt(last_segment, fs_tell(&fil_data) == 0, &write_crypt);
+    }
+#endif
+    return res;
+}
 
-                if (write_batch_counter >= WRITE_BATCH_COUNT) {
-                    LOG_INF("[SD_WORK] WRITE_BATCH_COUNT reached. Flushing batch write.");
-                    res = fs_seek(&fil_data, 0, FS_SEEK_END);
-                    if (res < 0) {
-                        LOG_ERR("[SD_WORK] seek end before write failed: %d\n", res);
-                    }
-                    bw = fs_write(&fil_data, write_batch_buffer, write_batch_offset);
-                    if (bw < 0 || (size_t)bw != write_batch_offset) {
-                        writing_error_counter++;
-
-                        LOG_ERR("[SD_WORK] batch write error %d bw=%d wanted=%u\n", (int)bw, (int)bw, (unsigned)write_batch_offset);
-                        if (bw > 0) {
-                            LOG_INF("Attempting to truncate to correct packet position");
-                            uint32_t truncate_offset = current_file_size + bw - bw % MAX_WRITE_SIZE;
-                            int ret = fs_truncate(&fil_data, truncate_offset);
-                            if (ret < 0) {
-                                LOG_ERR("Failed to truncate to next packet position: %d", ret);
-                                break;
-                            }
-                            LOG_INF("Shifted file pointer to correct packet position: %u", truncate_offset);
-                            current_file_size += bw - bw % MAX_WRITE_SIZE;
-                        }
-
-                        if (writing_error_counter >= ERROR_THRESHOLD) {
-                            LOG_ERR("[SD_WORK] Too many write errors (%d). Stopping SD worker.\n", writing_error_counter);
-                            fs_close(&fil_data);
-                            fs_file_t_init(&fil_data);
-                            LOG_INF("[SD_WORK] Re-opening data file after too many errors.\n");
-                            int reopen_res = fs_open(&fil_data, FILE_DATA_PATH, FS_O_CREATE | FS_O_RDWR);
-                            if (reopen_res == 0) {
-                                writing_error_counter = 0;
-                                fs_seek(&fil_data, 0, FS_SEEK_END);
-                            } else {
-                                LOG_ERR("[SD_WORK] open new data file failed: %d. Terminating operation", reopen_res);
-                            }
-                        }
-
-                        write_batch_offset = 0;
-                        write_batch_counter = 0;
-                        break;
-                    }
+static void close_read_segment(void)
+{
+    if (fil_read_segment) {
+        fs_close(&fil_read);
+        fil_read_segment = 0;
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+        sd_crypt_close(&read_crypt);
+#endif
+    }
+}
 
-                    bytes_since_sync += bw > 0 ? bw : 0;
-                    current_file_size += bw > 0 ? bw : 0;
-                    write_batch_offset = 0;
-                    write_batch_counter = 0;
-                }
+static struct fs_file_t *open_read_segment(uint8_t segment)
+{
+    if (segment == last_segment) {
+        return &fil_data;
+    }
+    if (fil_read_segment == segment) {
+        return &fil_read;
+    }
+
+    close_read_segment();
+    char path[SEGMENT_PATH_LEN];
+    segment_path(path, sizeof(path), segment);
+    fs_file_t_init(&fil_read);
+    int res = fs_open(&fil_read, path, FS_O_READ);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open %s for read failed: %d\n", path, res);
+        return NULL;
+    }
+    fil_read_segment = segment;
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+    if (open_segment_crypt(segment, false, &read_crypt) < 0) {
+        close_read_segment();
+        return NULL;
+    }
+#endif
+    return &fil_read;
+}
+
+// Read from the segment chain as if it was a single file
+static ssize_t read_stream(uint32_t offset, uint8_t *buf, size_t length)
+{
+    uint8_t segment = first_segment;
+    size_t done = 0;
 
-                if (bytes_since_sync >= SD_FSYNC_THRESHOLD) {
-                    LOG_INF("[SD_WORK] fs_sync triggered after %u bytes\n", (unsigned)bytes_since_sync);
-                    res = fs_sync(&fil_data);
-                    if (res < 0) {
-                        LOG_ERR("[SD_WORK] fs_sync data failed: %d\n", res);
+    while (done < length) {
+        uint32_t size = segment == last_segment ? current_file_size : segment_sizes[segment];
+        if (offset >= size) {
+            if (segment == last_segment) {
+                break;
+            }
+            offset -= size;
+            segment = next_segment(segment);
+            continue;
+        }
+
+        struct fs_file_t *file = open_read_segment(segment);
+        if (!file) {
+            return -EIO;
+        }
+        int res = fs_seek(file, offset, FS_SEEK_SET);
+        if (res < 0) {
+            LOG_ERR("[SD_WORK] lseek failed: %d\n", res);
+            return res;
+        }
+        ssize_t br = fs_read(file, buf + done, MIN(length - done, size - offset));
+        if (br <= 0) {
+            return done > 0 ? (ssize_t)done : br;
+        }
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+        if (segment == last_segment && write_crypt_err && !write_crypt.active) {
+            // Without its key the newest segment can't be told from plaintext, don't hand out ciphertext
+            return done > 0 ? (ssize_t)done : write_crypt_err;
+        }
+        res = sd_crypt_apply(segment == last_segment ? &write_crypt : &read_crypt, offset, buf + done, br);
+        if (res < 0) {
+            return res;
+        }
+#endif
+        done += br;
+        offset += br;
+    }
+    return done;
+}
+
+// Remember the block about to be buffered if the last index entry is INDEX_INTERVAL_S old
+static void mark_index_block(uint32_t now)
+{
+    if (now == 0 || index_pending_valid || (now >= index_last_utc_s && now - index_last_utc_s < INDEX_INTERVAL_S)) {
+        return;
+    }
+    // May be past the end of the segment, which rolling accounts for
+    index_pending.utc_s = now;
+    index_pending.offset = current_file_size + write_batch_offset;
+    index_pending_valid = true;
+    index_last_utc_s = now;
+}
+
+// Append the pending index entry once its block is in the newest segment
+static void commit_index_block(void)
+{
+    if (!index_pending_valid || index_pending.offset >= current_file_size) {
+        return;
+    }
+    index_pending_valid = false;
+
+    char path[SEGMENT_PATH_LEN];
+    struct fs_file_t fil_index;
+    index_path(path, sizeof(path), last_segment);
+    fs_file_t_init(&fil_index);
+    int res = fs_open(&fil_index, path, FS_O_CREATE | FS_O_RDWR | FS_O_APPEND);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open %s failed: %d\n", path, res);
+        return;
+    }
+    ssize_t bw = fs_write(&fil_index, &index_pending, sizeof(index_pending));
+    if (bw != sizeof(index_pending)) {
+        LOG_ERR("[SD_WORK] index write err %d\n", (int)bw);
+    }
+    fs_close(&fil_index);
+}
+
+static void unlink_segment(uint8_t segment)
+{
+    char path[SEGMENT_PATH_LEN];
+
+    segment_path(path, sizeof(path), segment);
+    int res = fs_unlink(path);
+    if (res != 0 && res != -ENOENT) {
+        LOG_ERR("[SD_WORK] Cannot unlink data file: %s, err: %d", path, res);
+    }
+    index_path(path, sizeof(path), segment);
+    fs_unlink(path);
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+    key_path(path, sizeof(path), segment);
+    fs_unlink(path);
+#endif
+}
+
+// Stream offsets of the indexed blocks around [start_utc_s, end_utc_s]: the last one at or before
+// the start and the first one after the end, so the whole range is covered
+static void find_time_range(uint32_t start_utc_s, uint32_t end_utc_s, uint32_t *start, uint32_t *end)
+{
+    uint32_t segment_start = 0;
+    bool found_end = false;
+
+    *start = 0;
+    *end = get_file_size();
+    for (uint8_t segment = first_segment; !found_end; segment = next_segment(segment)) {
+        char path[SEGMENT_PATH_LEN];
+        struct fs_file_t fil_index;
+        struct sd_index_entry entries[16];
+
+        index_path(path, sizeof(path), segment);
+        fs_file_t_init(&fil_index);
+        if (fs_open(&fil_index, path, FS_O_READ) == 0) {
+            ssize_t br;
+            while (!found_end && (br = fs_read(&fil_index, entries, sizeof(entries))) > 0) {
+                for (size_t i = 0; i < br / sizeof(entries[0]); i++) {
+                    if (entries[i].utc_s <= start_utc_s) {
+                        *start = segment_start + entries[i].offset;
+                    } else if (entries[i].utc_s > end_utc_s && segment_start + entries[i].offset > *start) {
+                        *end = segment_start + entries[i].offset;
+                        found_end = true;
+                        break;
                     }
-                    bytes_since_sync = 0;
                 }
+            }
+            fs_close(&fil_index);
+        }
+
+        if (segment == last_segment) {
+            break;
+        }
+        segment_start += segment_sizes[segment];
+    }
+}
+
+// Recompute how far the stream may grow from the space left on the card
+static void update_storage_limit(void)
+{
+    struct fs_statvfs stat;
+    int res = fs_statvfs(DISK_MOUNT_PT, &stat);
+    if (res != 0) {
+        LOG_WRN("[SD_WORK] statvfs failed: %d, keeping limit %u", res, storage_limit);
+        return;
+    }
+    uint64_t free_bytes = (uint64_t) stat.f_frsize * stat.f_bfree;
+    uint64_t limit = get_file_size() + (free_bytes > SD_RESERVED_BYTES ? free_bytes - SD_RESERVED_BYTES : 0);
+    storage_limit = (uint32_t) MIN(limit, SD_STREAM_MAX_BYTES);
+    card_kb = (uint32_t) MIN(((uint64_t) stat.f_frsize * stat.f_blocks) >> 10, UINT32_MAX);
+    measured_free_kb = (uint32_t) MIN(free_bytes >> 10, UINT32_MAX);
+    measured_stream = get_file_size() + sd_pending_bytes();
+    LOG_INF("[SD_WORK] %u MB free on the card, storage limit %u MB", (uint32_t) (free_bytes >> 20),
+            storage_limit >> 20);
+}
+
+// Close the full newest segment and continue in a fresh one
+static int roll_segment(void)
+{
+    uint8_t next = next_segment(last_segment);
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+    if (next == first_segment && ring_evict_first()) {
+        next = next_segment(last_segment);
+    }
+#endif
+    if (next == first_segment) {
+        LOG_ERR("[SD_WORK] All %d segment ids in use, growing segment %u", SEGMENT_MAX_ID, last_segment);
+        return 0;
+    }
+
+    fs_close(&fil_data);
+    segment_sizes[last_segment] = current_file_size;
+    closed_segments_size += current_file_size;
+    if (index_pending_valid) {
+        index_pending.offset -= current_file_size;
+    }
+    last_segment = next;
+    char path[SEGMENT_PATH_LEN];
+    index_path(path, sizeof(path), last_segment);
+    fs_unlink(path);
+    current_file_size = 0;
+    int res = open_write_segment(FS_O_TRUNC);
+    if (res < 0) {
+        // The manifest keeps the segments it had, the write error path reopens this one later
+        LOG_ERR("[SD_WORK] Failed to start audio segment %u: %d", last_segment, res);
+        return res;
+    }
+    write_manifest();
+    update_storage_limit();
+    LOG_INF("[SD_WORK] Started audio segment %u", last_segment);
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+    ring_make_room();
+#endif
+    return 0;
+}
+
+// Write the first len bytes of the batch to the end of the data file and keep the rest buffered
+static void flush_write_batch(size_t len)
+{
+    __maybe_unused int64_t write_start = k_uptime_get();
+    int res = fs_seek(&fil_data, 0, FS_SEEK_END);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] seek end before write failed: %d\n", res);
+    }
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+    // Audio never reaches the card in the clear, only a plaintext segment from before keeps growing
+    res = write_crypt_err ? write_crypt_err : sd_crypt_apply(&write_crypt, current_file_size, write_batch_buffer, len);
+    ssize_t bw = res < 0 ? res : fs_write(&fil_data, write_batch_buffer, len);
+#else
+    ssize_t bw = fs_write(&fil_data, write_batch_buffer, len);
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_sd_latency(MONITOR_SD_WRITE, (uint32_t) (k_uptime_get() - write_start));
+#endif
+
+    if (bw >= 0 && (size_t)bw == len) {
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_sd_bytes(MONITOR_SD_WRITE, bw);
+#endif
+        bytes_since_sync += bw;
+        current_file_size += bw;
+        write_batch_offset -= len;
+        memmove(write_batch_buffer, write_batch_buffer + len, write_batch_offset);
+        write_batch_counter = 0;
+        return;
+    }
+
+    writing_error_counter++;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_sd_error(MONITOR_SD_WRITE);
+#endif
+    LOG_ERR("[SD_WORK] batch write error %d bw=%d wanted=%u\n", (int)bw, (int)bw, (unsigned)len);
+
+    // Cut the file back to the last complete block, the rest of the batch is lost
+    uint32_t written_end = current_file_size + (bw > 0 ? bw : 0);
+    uint32_t truncate_offset = written_end - written_end % MAX_WRITE_SIZE;
+    current_file_size = written_end;
+    if (truncate_offset != written_end) {
+        LOG_INF("Attempting to truncate to correct packet position");
+        int ret = fs_truncate(&fil_data, truncate_offset);
+        if (ret < 0) {
+            LOG_ERR("Failed to truncate to next packet position: %d", ret);
+        } else {
+            LOG_INF("Shifted file pointer to correct packet position: %u", truncate_offset);
+            current_file_size = truncate_offset;
+        }
+    }
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+    // Part of the batch may be on the card past current_file_size, and gets written over next
+    rekey_write_segment(current_file_size);
+#endif
+
+    if (writing_error_counter >= ERROR_THRESHOLD) {
+        LOG_ERR("[SD_WORK] Too many write errors (%d). Stopping SD worker.\n", writing_error_counter);
+        fs_close(&fil_data);
+        fs_file_t_init(&fil_data);
+        LOG_INF("[SD_WORK] Re-opening data file after too many errors.\n");
+        int reopen_res = open_write_segment(0);
+        if (reopen_res == 0) {
+            writing_error_counter = 0;
+        } else {
+            LOG_ERR("[SD_WORK] open new data file failed: %d. Terminating operation", reopen_res);
+        }
+    }
+
+    write_batch_offset = 0;
+    write_batch_counter = 0;
+}
+
+// Flush len bytes of the batch, starting a new segment whenever the current one fills up
+static void flush_to_segments(size_t len)
+{
+    while (len > 0) {
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+        // A segment out of key epochs is closed early, the next one starts with a fresh salt
+        bool full = current_file_size >= SEGMENT_BYTES || write_crypt_err == -ENOSPC;
+#else
+        bool full = current_file_size >= SEGMENT_BYTES;
+#endif
+        if (full && roll_segment() < 0) {
+            // No segment to write into, the batch is lost as on a failed write
+            writing_error_counter++;
+            index_pending_valid = false;
+            write_batch_offset = 0;
+            write_batch_counter = 0;
+            return;
+        }
+        size_t chunk = current_file_size < SEGMENT_BYTES ? MIN(len, SEGMENT_BYTES - current_file_size) : len;
+        size_t buffered = write_batch_offset;
+        flush_write_batch(chunk);
+        if (write_batch_offset != buffered - chunk) {
+            index_pending_valid = false;
+            return; // failed, the batch was dropped
+        }
+        commit_index_block();
+        len -= chunk;
+    }
+}
+
+// The batch may start with the rest of a block whose beginning is already in the file
+static void drop_partial_block(void)
+{
+    size_t partial = current_file_size % MAX_WRITE_SIZE;
+    if (partial) {
+        size_t rest = MIN(MAX_WRITE_SIZE - partial, write_batch_offset);
+        write_batch_offset -= rest;
+        memmove(write_batch_buffer, write_batch_buffer + rest, write_batch_offset);
+    }
+}
+
+// Remove every segment and start over with an empty a01.txt
+static int clear_segments(void)
+{
+    close_read_segment();
+    fs_close(&fil_data);
+    for (uint8_t segment = first_segment;; segment = next_segment(segment)) {
+        unlink_segment(segment);
+        if (segment == last_segment) {
+            break;
+        }
+    }
+
+    // Only whole blocks may start the new file
+    drop_partial_block();
+    index_pending_valid = false;
+    first_segment = 1;
+    last_segment = 1;
+    closed_segments_size = 0;
+    current_file_size = 0;
+    current_file_offset = 0;
+    int res = open_write_segment(FS_O_TRUNC);
+    write_manifest();
+    update_storage_limit();
+    return res;
+}
+
+// Unlink the oldest segment once the app has it; returns how many bytes left the stream
+static int delete_first_segment(uint8_t segment)
+{
+    if (segment != first_segment) {
+        LOG_WRN("[SD_WORK] Segment %u is not the oldest (%u)", segment, first_segment);
+        return -EINVAL;
+    }
+    if (segment == last_segment) {
+        uint32_t removed = get_file_size();
+        int res = clear_segments();
+        return res < 0 ? res : (int)removed;
+    }
+
+    char path[SEGMENT_PATH_LEN];
+    segment_path(path, sizeof(path), segment);
+    if (fil_read_segment == segment) {
+        close_read_segment();
+    }
+    int res = fs_unlink(path);
+    if (res != 0 && res != -ENOENT) {
+        LOG_ERR("[SD_WORK] Cannot unlink data file: %s, err: %d", path, res);
+        return res;
+    }
+    index_path(path, sizeof(path), segment);
+    fs_unlink(path);
+
+    uint32_t removed = segment_sizes[segment];
+    closed_segments_size -= removed;
+    first_segment = next_segment(segment);
+    current_file_offset = current_file_offset > removed ? current_file_offset - removed : 0;
+    write_manifest();
+    update_storage_limit();
+    LOG_INF("[SD_WORK] Deleted audio segment %u (%u bytes)", segment, removed);
+    return removed;
+}
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+// Evict the oldest segment if the retention mode allows it, never the newest one
+static bool ring_evict_first(void)
+{
+    uint8_t segment = first_segment;
+    if (sd_read_running || k_msgq_num_used_get(&sd_read_q) > 0) {
+        ring_evict_deferred = true;
+        return false;
+    }
+    if (segment == last_segment || retention == SD_RETENTION_STOP ||
+        (retention == SD_RETENTION_SYNCED && current_file_offset < segment_sizes[segment])) {
+        return false;
+    }
+
+    int removed = delete_first_segment(segment);
+    if (removed < 0) {
+        return false;
+    }
+    atomic_inc(&evicted_segments);
+    atomic_add(&evicted_bytes, removed);
+    LOG_WRN("[SD_WORK] Card full, evicted audio segment %u (%d bytes)", segment, removed);
+    return true;
+}
+
+// Keep room for a whole segment after the newest one, so the pusher never finds the card full
+static void ring_make_room(void)
+{
+    while (get_file_size() + SEGMENT_BYTES > storage_limit && ring_evict_first()) {
+    }
+}
+#endif
+
+// Load the chain from info.txt (a bare 4-byte offset from the single-file layout means just a01.txt)
+static void load_manifest(void)
+{
+    struct sd_manifest manifest = {0};
+    struct fs_dirent info_stat;
+
+    first_segment = 1;
+    last_segment = 1;
+    current_file_offset = 0;
+    if (fs_stat(FILE_INFO_PATH, &info_stat) == 0 && info_stat.size >= sizeof(uint32_t)) {
+        fs_seek(&fil_info, 0, FS_SEEK_SET);
+        ssize_t rbytes = fs_read(&fil_info, &manifest, MIN(info_stat.size, sizeof(manifest)));
+        if (rbytes < (ssize_t)sizeof(uint32_t)) {
+            LOG_ERR("[SD_WORK] Failed to read offset at boot: %d\n", (int)rbytes);
+        } else {
+            current_file_offset = manifest.offset;
+            LOG_INF("[SD_WORK] Loaded offset from info.txt: %u\n", current_file_offset);
+            if (rbytes == sizeof(manifest) && manifest.version == MANIFEST_VERSION &&
+                manifest.first_segment >= 1 && manifest.last_segment >= 1) {
+                first_segment = manifest.first_segment;
+                last_segment = manifest.last_segment;
+            }
+        }
+    }
+
+    // Offsets saved since the last segment change only went to the journal
+    uint32_t journal_offset;
+    uint8_t journal_segment;
+    if (app_settings_get_sync_offset(&journal_offset, &journal_segment) == 0 && journal_segment == first_segment) {
+        current_file_offset = journal_offset;
+        LOG_INF("[SD_WORK] Loaded offset from journal: %u\n", current_file_offset);
+    }
+
+    closed_segments_size = 0;
+    for (uint8_t segment = first_segment; segment != last_segment; segment = next_segment(segment)) {
+        char path[SEGMENT_PATH_LEN];
+        struct fs_dirent segment_stat;
+        segment_path(path, sizeof(path), segment);
+        segment_sizes[segment] = fs_stat(path, &segment_stat) == 0 ? segment_stat.size : 0;
+        closed_segments_size += segment_sizes[segment];
+    }
+    LOG_INF("[SD_WORK] Audio segments %u..%u, %u bytes in closed segments", first_segment, last_segment,
+            closed_segments_size);
+}
+
+// Append one block to the write batch, flushing and syncing it to the newest segment as it fills
+static void buffer_write_block(const uint8_t *data, size_t len, uint32_t utc_s)
+{
+    mark_index_block(utc_s);
+    memcpy(write_batch_buffer + write_batch_offset, data, len);
+    write_batch_offset += len;
+    write_batch_counter++;
+
+#ifdef CONFIG_OMI_ENABLE_SD_ALIGNED_WRITES
+    if (write_batch_offset >= SD_ALIGNED_FLUSH_BYTES) {
+        LOG_HOT("[SD_WORK] %u bytes buffered. Flushing aligned batch write.", (unsigned)write_batch_offset);
+        size_t tail = (current_file_size + write_batch_offset) % SD_SECTOR_SIZE;
+        flush_to_segments(write_batch_offset - tail);
+    }
+#else
+    if ((uint32_t)write_batch_counter >= write_batch_count) {
+        LOG_HOT("[SD_WORK] %u blocks batched. Flushing batch write.", (unsigned)write_batch_counter);
+        flush_to_segments(write_batch_offset);
+    }
+#endif
+
+    if (bytes_since_sync >= fsync_threshold) {
+        LOG_HOT("[SD_WORK] fs_sync triggered after %u bytes", (unsigned)bytes_since_sync);
+        __maybe_unused int64_t sync_start = k_uptime_get();
+        int res = fs_sync(&fil_data);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        monitor_sd_latency(MONITOR_SD_SYNC, (uint32_t) (k_uptime_get() - sync_start));
+        if (res < 0) {
+            monitor_sd_error(MONITOR_SD_SYNC);
+        }
+#endif
+        if (res < 0) {
+            LOG_ERR("[SD_WORK] fs_sync data failed: %d\n", res);
+        }
+        bytes_since_sync = 0;
+    }
+}
+
+// Power the card up again after sd_sleep()
+static int sd_wake(void)
+{
+    if (sd_awake) {
+        return 0;
+    }
+    int res = sd_mount();
+    if (res != 0) {
+        LOG_ERR("[SD_WORK] mount failed: %d\n", res);
+        return res;
+    }
+    fs_file_t_init(&fil_info);
+    res = fs_open(&fil_info, FILE_INFO_PATH, FS_O_CREATE | FS_O_RDWR);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open info failed: %d\n", res);
+        return res;
+    }
+    res = open_write_segment(0);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open data failed: %d\n", res);
+        return res;
+    }
+    sd_awake = true;
+    return 0;
+}
+
+// Write out everything buffered and cut the card's power
+static void sd_sleep(void)
+{
+    if (!sd_awake) {
+        return;
+    }
+    // Aligned flushes leave the tail of a block behind, it has to go now as well
+    flush_to_segments(write_batch_offset);
+    fs_sync(&fil_data);
+    bytes_since_sync = 0;
+    sd_unmount();
+    sd_awake = false;
+    LOG_INF("[SD_WORK] SD card off until the next request");
+}
+
+#ifdef CONFIG_OMI_ENABLE_SD_PREERASE
+// A write that lands on flash the card still has to erase stalls for hundreds of ms. While the
+// queue is empty the worker erases the free clusters the data file grows into next, FatFs takes
+// them in order after the file's last cluster. Each one is checked free in the FAT (exFAT: the
+// allocation bitmap) right before, so nothing allocated is ever erased.
+static uint32_t preerase_next = 0; // first cluster after the write position not erased yet
+static int64_t preerase_last_at = 0;
+static bool preerase_failed = false;
+static LBA_t preerase_cached = (LBA_t) -1;
+static uint8_t preerase_sector[FF_MAX_SS] __aligned(4);
+
+// 1 if the cluster is free, 0 if allocated, negative errno code if the FAT couldn't be read
+static int cluster_is_free(uint32_t clst)
+{
+    LBA_t sector;
+    uint32_t index;
+#if FF_FS_EXFAT
+    if (fat_fs.fs_type == FS_EXFAT) {
+        sector = fat_fs.bitbase + (clst - 2) / (FF_MAX_SS * 8);
+        index = (clst - 2) % (FF_MAX_SS * 8);
+    } else
+#endif
+    {
+        sector = fat_fs.fatbase + clst / (FF_MAX_SS / 4);
+        index = clst % (FF_MAX_SS / 4);
+    }
+
+    // FatFs's window holds the newest copy of the sector it last touched, possibly not written yet
+    const uint8_t *buf = fat_fs.win;
+    if (fat_fs.winsect != sector) {
+        if (preerase_cached != sector) {
+            int res = disk_access_read(DISK_DRIVE_NAME, preerase_sector, sector, 1);
+            if (res) {
+                preerase_cached = (LBA_t) -1;
+                return res < 0 ? res : -EIO;
+            }
+            preerase_cached = sector;
+        }
+        buf = preerase_sector;
+    }
+#if FF_FS_EXFAT
+    if (fat_fs.fs_type == FS_EXFAT) {
+        return !(buf[index / 8] & BIT(index % 8));
+    }
+#endif
+    return (sys_get_le32(&buf[index * 4]) & 0x0FFFFFFF) == 0;
+}
+
+static int erase_sectors(LBA_t start, uint32_t count)
+{
+    // SDSC cards take byte addresses, SDHC and SDXC block addresses
+    bool block_addressed = sd_card_sectors > 2048u * 2048;
+    uint32_t scale = block_addressed ? 1 : FF_MAX_SS;
+    struct sdhc_command cmd = {
+        .opcode = SD_ERASE_BLOCK_START,
+        .arg = start * scale,
+        .response_type = SD_RSP_TYPE_R1 | SD_SPI_RSP_TYPE_R1,
+        .timeout_ms = CONFIG_SD_CMD_TIMEOUT,
+    };
+    int res = sdhc_request(sd_dev, &cmd, NULL);
+    if (res == 0) {
+        cmd.opcode = SD_ERASE_BLOCK_END;
+        cmd.arg = (start + count - 1) * scale;
+        res = sdhc_request(sd_dev, &cmd, NULL);
+    }
+    if (res == 0) {
+        cmd.opcode = SD_ERASE_BLOCK_OPERATION;
+        cmd.arg = 0;
+        cmd.response_type = SD_RSP_TYPE_R1b | SD_SPI_RSP_TYPE_R1b;
+        cmd.timeout_ms = SD_PREERASE_TIMEOUT_MS;
+        res = sdhc_request(sd_dev, &cmd, NULL);
+    }
+    return res;
+}
+
+// Erase the next few free clusters ahead of the data file, at most once per SD_PREERASE_INTERVAL_MS
+static void preerase_step(void)
+{
+    if (preerase_failed || !sd_awake || sd_queued() + sd_spill_used > 0 ||
+        k_uptime_get() - preerase_last_at < SD_PREERASE_INTERVAL_MS) {
+        return;
+    }
+    if (fat_fs.fs_type != FS_FAT32 && !(FF_FS_EXFAT && fat_fs.fs_type == FS_EXFAT)) {
+        return;
+    }
+    preerase_last_at = k_uptime_get();
+
+    // Reads may have left the data file anywhere
+    if (fs_seek(&fil_data, 0, FS_SEEK_END) < 0) {
+        return;
+    }
+    const FIL *fp = fil_data.filep;
+    // An empty file gets its first cluster after the last one FatFs allocated
+    uint32_t cursor = fp->obj.sclust ? fp->clust : fat_fs.last_clst;
+    if (cursor < 2 || cursor >= fat_fs.n_fatent) {
+        cursor = 1; // not known since the mount, allocation starts at the first cluster
+    }
+    uint32_t cluster_bytes = (uint32_t) fat_fs.csize * FF_MAX_SS;
+    uint32_t ahead_end = MIN(cursor + 1 + SD_PREERASE_AHEAD_BYTES / cluster_bytes, fat_fs.n_fatent);
+    if (preerase_next <= cursor || preerase_next > ahead_end) {
+        preerase_next = cursor + 1;
+    }
+
+    uint32_t max_run = MAX(SD_PREERASE_CHUNK_BYTES / cluster_bytes, 1);
+    uint32_t run = 0;
+    preerase_cached = (LBA_t) -1;
+    while (preerase_next + run < ahead_end && run < max_run) {
+        int is_free = cluster_is_free(preerase_next + run);
+        if (is_free < 0) {
+            return;
+        }
+        if (!is_free) {
+            break;
+        }
+        run++;
+    }
+    if (run == 0) {
+        // Allocated (or none left before the end), FatFs skips it as well
+        preerase_next = MIN(preerase_next + 1, ahead_end);
+        return;
+    }
+
+    LBA_t start = fat_fs.database + (LBA_t) (preerase_next - 2) * fat_fs.csize;
+    int res = erase_sectors(start, run * fat_fs.csize);
+    if (res) {
+        LOG_WRN("[SD_WORK] pre-erase failed (%d), writing without it", res);
+        preerase_failed = true;
+        return;
+    }
+    LOG_DBG("[SD_WORK] Pre-erased clusters %u..%u", preerase_next, preerase_next + run - 1);
+    preerase_next += run;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+
+// Move up to max_blocks of the flash log to the segments. A block leaves the log once it is in the
+// write batch, so a reset mid-drain can lose up to one batch, same as without the cache.
+static void drain_flash_cache_blocks(uint32_t max_blocks)
+{
+    static uint8_t block[MAX_WRITE_SIZE];
+    size_t len;
+    uint32_t utc_s;
+
+    if (flash_cache_blocks() == 0 || sd_wake() != 0) {
+        flash_drain_active = false;
+        return;
+    }
+    sd_last_use = k_uptime_get();
+    for (uint32_t i = 0; i < max_blocks && flash_cache_peek(block, &len, &utc_s) == 0; i++) {
+        buffer_write_block(block, len, utc_s);
+        if (flash_cache_pop() < 0) {
+            break;
+        }
+    }
+    flash_drain_active = flash_cache_blocks() > 0;
+}
+
+// All of it, for requests that must see the cached audio on the card. The background drain keeps
+// the log short while anyone is syncing, so this is a few steps at most.
+static void drain_flash_cache(void)
+{
+    if (flash_cache_blocks() > 0) {
+        LOG_INF("[SD_WORK] Draining %u blocks from the flash cache", flash_cache_blocks());
+    }
+    drain_flash_cache_blocks(UINT32_MAX);
+}
+
+// Starts the background drain, one step per pass of the worker loop
+static void start_flash_drain(void)
+{
+    if (!flash_drain_active && flash_cache_blocks() > 0) {
+        LOG_INF("[SD_WORK] Draining %u blocks from the flash cache in steps", flash_cache_blocks());
+        flash_drain_active = true;
+    }
+}
+
+static void cache_write_block(const uint8_t *data, size_t len)
+{
+    uint32_t utc_s = get_utc_time();
+    int res = flash_cache_append(data, len, utc_s);
+    if (res == -ENOSPC) {
+        // Room for this block now, the rest drains in the background
+        drain_flash_cache_blocks(FLASH_CACHE_DRAIN_STEP);
+        start_flash_drain();
+        res = flash_cache_append(data, len, utc_s);
+    }
+    if (res < 0) {
+        // The flash is misbehaving, don't lose the block over it (keeping the order)
+        if (sd_wake() == 0) {
+            drain_flash_cache();
+            buffer_write_block(data, len, utc_s);
+        }
+        return;
+    }
+    if (flash_cache_blocks() >= FLASH_CACHE_DRAIN_BLOCKS) {
+        start_flash_drain();
+    }
+}
+#endif
+
+// A full block parses up to its terminator, or to the end if the last record fit exactly
+static bool block_is_valid(const uint8_t *block)
+{
+    struct pipe_record record;
+    uint16_t pos = 0;
+    int ret;
+
+    while ((ret = storage_record_next(block, &pos, &record)) > 0) {
+    }
+    return ret == 0;
+}
+
+// After an unclean reset the newest segment may end in a partial block, or in blocks that never
+// made it to the card intact (erased or zeroed sectors). Only the tail is checked, so boot time
+// doesn't grow with the segment.
+static void recover_segment_tail(void)
+{
+    uint8_t *block = write_batch_buffer; // empty until the first write
+    uint32_t valid_size = current_file_size - current_file_size % MAX_WRITE_SIZE;
+
+    for (int i = 0; i < SD_RECOVERY_SCAN_BLOCKS && valid_size > 0; i++) {
+        if (fs_seek(&fil_data, valid_size - MAX_WRITE_SIZE, FS_SEEK_SET) < 0 ||
+            fs_read(&fil_data, block, MAX_WRITE_SIZE) != MAX_WRITE_SIZE) {
+            break;
+        }
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+        if (sd_crypt_apply(&write_crypt, valid_size - MAX_WRITE_SIZE, block, MAX_WRITE_SIZE) < 0) {
+            break;
+        }
+#endif
+        if (block_is_valid(block)) {
+            break;
+        }
+        valid_size -= MAX_WRITE_SIZE;
+    }
+
+    if (valid_size != current_file_size) {
+        LOG_WRN("[SD_WORK] Dropping %u bytes of damaged tail", current_file_size - valid_size);
+        if (fs_truncate(&fil_data, valid_size) == 0) {
+            current_file_size = valid_size;
+        }
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+        rekey_write_segment(current_file_size);
+#endif
+    }
+    fs_seek(&fil_data, 0, FS_SEEK_END);
+}
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+static struct fs_file_t fil_update;
+static bool fil_update_open = false;
+
+static void close_update_file(void)
+{
+    if (fil_update_open) {
+        fs_close(&fil_update);
+        fil_update_open = false;
+    }
+}
+
+// The image is only renamed to SD_UPDATE_PATH once complete, the bootloader never sees a partial one
+static int write_update(uint32_t offset, const uint8_t *buf, uint32_t length)
+{
+    int res;
+    if (offset == 0) {
+        close_update_file();
+        fs_mkdir(SD_UPDATE_DIR);
+        fs_unlink(SD_UPDATE_PATH); // an older staged image must not be installed instead
+        fs_unlink(SD_UPDATE_PART_PATH);
+    }
+    // Reopened after sd_sleep() unmounted the card in the middle of a download
+    if (!fil_update_open) {
+        fs_file_t_init(&fil_update);
+        res = fs_open(&fil_update, SD_UPDATE_PART_PATH, FS_O_CREATE | FS_O_WRITE);
+        if (res < 0) {
+            LOG_ERR("[SD_WORK] open update failed: %d", res);
+            return res;
+        }
+        fil_update_open = true;
+    }
+    res = fs_seek(&fil_update, offset, FS_SEEK_SET);
+    ssize_t bw = res < 0 ? res : fs_write(&fil_update, buf, length);
+    if (bw < 0 || (uint32_t) bw != length) {
+        LOG_ERR("[SD_WORK] update write at %u failed: %d", offset, (int) bw);
+        return bw < 0 ? (int) bw : -EIO;
+    }
+    return 0;
+}
+
+static int finish_update(uint32_t size)
+{
+    int res = 0;
+    if (fil_update_open) {
+        res = fs_sync(&fil_update);
+        close_update_file();
+    }
+    if (size == 0) {
+        fs_unlink(SD_UPDATE_PART_PATH);
+        return 0;
+    }
+
+    struct fs_dirent entry;
+    if (res == 0) {
+        res = fs_stat(SD_UPDATE_PART_PATH, &entry);
+    }
+    if (res == 0 && entry.size != size) {
+        LOG_ERR("[SD_WORK] update holds %u bytes, expected %u", (unsigned) entry.size, size);
+        res = -EIO;
+    }
+    if (res == 0) {
+        res = fs_rename(SD_UPDATE_PART_PATH, SD_UPDATE_PATH);
+    }
+    if (res < 0) {
+        fs_unlink(SD_UPDATE_PART_PATH);
+        return res;
+    }
+    LOG_INF("[SD_WORK] %u byte firmware image staged for the bootloader", size);
+    return 0;
+}
+#endif
+
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+BUILD_ASSERT(WARM_SEGMENT_IDS == SEGMENT_MAX_ID + 1, "Retained segment sizes don't cover the segment ids");
+
+static bool sd_state_ready = false; // startup done, the stream state below matches the card
+
+bool sd_warm_save(struct warm_storage *state)
+{
+    // Batched blocks that never made it to the card aren't counted in the sizes
+    if (!sd_state_ready || is_mounted) {
+        return false;
+    }
+    state->first_segment = first_segment;
+    state->last_segment = last_segment;
+    state->file_size = current_file_size;
+    state->offset = current_file_offset;
+    state->storage_limit = storage_limit;
+    memcpy(state->segment_sizes, segment_sizes, sizeof(segment_sizes));
+    return true;
+}
+
+// Take the stream state from before system off instead of rediscovering it on the card
+static bool sd_warm_restore(void)
+{
+    const struct warm_state *warm = warm_resume_get();
+    if (!warm || warm->storage.first_segment == 0) {
+        return false;
+    }
+    const struct warm_storage *state = &warm->storage;
+    first_segment = state->first_segment;
+    last_segment = state->last_segment;
+    current_file_size = state->file_size;
+    current_file_offset = state->offset;
+    storage_limit = state->storage_limit;
+    memcpy(segment_sizes, state->segment_sizes, sizeof(segment_sizes));
+    closed_segments_size = 0;
+    for (uint8_t segment = first_segment; segment != last_segment; segment = next_segment(segment)) {
+        closed_segments_size += segment_sizes[segment];
+    }
+    LOG_INF("[SD_WORK] Warm wake: segments %u..%u, offset %u", first_segment, last_segment, current_file_offset);
+    return true;
+}
+#endif
+
+static void release_write_block(uint8_t *block)
+{
+    if (is_spill_block(block)) {
+        spill_release();
+    } else {
+        k_mem_slab_free(&sd_write_slab, (void *) block);
+    }
+}
+
+static void handle_write(const sd_req_t *req)
+{
+    LOG_HOT("[SD_WORK] Buffering %u bytes to batch write", (unsigned)req->u.write.len);
+
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+    if (flash_cache_ready) {
+        cache_write_block(req->u.write.buf, req->u.write.len);
+        release_write_block(req->u.write.buf);
+        return;
+    }
+#endif
+    buffer_write_block(req->u.write.buf, req->u.write.len, get_utc_time());
+    release_write_block(req->u.write.buf);
+}
+
+// Read in slices, taking the audio writes queued meanwhile between them. A sync keeps reads queued
+// back to back while recording goes on, and the few write blocks must not wait out a whole chunk.
+static ssize_t read_interleaved(uint32_t offset, uint8_t *buf, size_t length)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t br = read_stream(offset + done, buf + done, MIN(length - done, SD_READ_SLICE_BYTES));
+        if (br <= 0) {
+            return done > 0 ? (ssize_t)done : br;
+        }
+        done += br;
+        if (done < length) {
+            // Appends only grow the stream past what is being read
+            sd_req_t next;
+            while (sd_take_write(&next)) {
+                k_sem_take(&sd_req_sem, K_NO_WAIT);
+                handle_write(&next);
+            }
+        }
+    }
+    return done;
+}
+
+void sd_worker_thread(void)
+{
+    sd_req_t req;
+    int res;
+    ssize_t br = 0;
+
+#ifdef CONFIG_OMI_ENABLE_SD_ENCRYPTION
+    // Without the device key new segments take no audio
+    res = sd_crypt_init();
+    if (res != 0) {
+        LOG_ERR("[SD_WORK] storage encryption unavailable: %d", res);
+    }
+#endif
+
+    /* Attempt to mount FS - board-specific mount code may be needed */
+    res = sd_mount();
+    if (res != 0) {
+        LOG_ERR("[SD_WORK] mount failed: %d\n", res);
+        return;
+    }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_boot_mark(MONITOR_BOOT_SD_MOUNT);
+#endif
+
+    struct fs_dirent dirent;
+    int stat_res = fs_stat(FILE_DATA_DIR, &dirent);
+    if (stat_res < 0) {
+        int mk_res = fs_mkdir(FILE_DATA_DIR);
+        if (mk_res < 0) {
+            LOG_ERR("[SD_WORK] mkdir %s failed: %d\n", FILE_DATA_DIR, mk_res);
+        }
+    }
+
+    /* Open info file (read/write, create if not exists) */
+    fs_file_t_init(&fil_info);
+    res = fs_open(&fil_info, FILE_INFO_PATH, FS_O_CREATE | FS_O_RDWR);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open info failed: %d\n", res);
+        return;
+    }
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+    bool warm = sd_warm_restore();
+#else
+    bool warm = false;
+#endif
+    if (!warm) {
+        load_manifest();
+    }
 
+    /* Open the newest segment (append) */
+    res = open_write_segment(0);
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] open data failed: %d\n", res);
+        return;
+    }
+
+    // The card was unmounted cleanly before a warm wake, its sizes and manifest are still right
+    if (!warm) {
+        char data_path[SEGMENT_PATH_LEN];
+        struct fs_dirent data_stat;
+        segment_path(data_path, sizeof(data_path), last_segment);
+        int stat_res_data = fs_stat(data_path, &data_stat);
+        if (stat_res_data == 0) {
+            current_file_size = data_stat.size;
+        } else {
+            current_file_size = 0;
+        }
+        recover_segment_tail();
+
+        // Upgrades a single-file info.txt in place
+        write_manifest();
+        update_storage_limit();
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+        ring_make_room();
+#endif
+    }
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+    sd_state_ready = true;
+#endif
+    sd_started = true;
+    sd_awake = true;
+    sd_last_use = k_uptime_get();
+
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+    res = flash_cache_init();
+    if (res < 0) {
+        LOG_ERR("[SD_WORK] flash cache unavailable (%d), writing straight to the card", res);
+    } else {
+        flash_cache_ready = true;
+        // Blocks still cached from before the reset
+        start_flash_drain();
+    }
+#endif
+
+    while (1) {
+        if (sd_clock_pending && is_mounted) {
+            sd_raise_clock();
+        }
+        k_timeout_t wait = K_FOREVER;
+        if (sd_awake && SD_IDLE_OFF_MS > 0) {
+            int64_t idle_left = sd_last_use + SD_IDLE_OFF_MS - k_uptime_get();
+            if (idle_left <= 0) {
+                sd_sleep();
+            } else {
+                wait = K_MSEC(idle_left);
+            }
+        }
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+        if (flash_drain_active) {
+            // Only look for a request, the next drain step follows it
+            wait = K_NO_WAIT;
+        }
+#endif
+        /* Wait for a request */
+        if (sd_next_request(&req, wait)) {
+            __maybe_unused int64_t req_start = k_uptime_get();
+            FLIGHT_REC(FLIGHT_REC_SD_START, req.type, 0);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+            monitor_sd_request(req.type);
+#endif
+            bool needs_card = true;
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+            if (flash_cache_ready) {
+                // Everything but an append needs the card, and must see the cached audio on it
+                needs_card = req.type != REQ_WRITE_DATA;
+                if (needs_card) {
+                    drain_flash_cache();
+                }
+            }
+#endif
+            if (needs_card) {
+                sd_wake();
+                sd_last_use = k_uptime_get();
+            }
+            switch (req.type) {
+            case REQ_WRITE_DATA:
+                handle_write(&req);
                 break;
 
             case REQ_READ_DATA:
                 LOG_DBG("[SD_WORK] Reading %u bytes from data file at offset %u\n",
                         (unsigned)req.u.read.length, (unsigned)req.u.read.offset);
-                if (&fil_data == NULL) {
-                    LOG_ERR("[SD_WORK] data file not open (read)\n");
-                    if (req.u.read.resp) {
-                        req.u.read.resp->res = -1;
-                        req.u.read.resp->read_bytes = 0;
-                        k_sem_give(&req.u.read.resp->sem);
-                    }
-                    break;
-                }
-
-                res = fs_seek(&fil_data, req.u.read.offset, FS_SEEK_SET);
-                if (res < 0) {
-                    LOG_ERR("[SD_WORK] lseek failed: %d\n", res);
-                    if (req.u.read.resp) {
-                        req.u.read.resp->res = res;
-                        req.u.read.resp->read_bytes = 0;
-                        k_sem_give(&req.u.read.resp->sem);
-                    }
-                    break;
+                __maybe_unused int64_t read_start = k_uptime_get();
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+                sd_read_running = true;
+#endif
+                br = read_interleaved(req.u.read.offset, req.u.read.out_buf, req.u.read.length);
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+                sd_read_running = false;
+#endif
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+                monitor_sd_latency(MONITOR_SD_READ, (uint32_t) (k_uptime_get() - read_start));
+                if (br < 0) {
+                    monitor_sd_error(MONITOR_SD_READ);
+                } else {
+                    monitor_sd_bytes(MONITOR_SD_READ, br);
                 }
-                br = fs_read(&fil_data, req.u.read.out_buf, req.u.read.length);
+#endif
                 if (req.u.read.resp) {
                     req.u.read.resp->res = (br < 0) ? br : 0;
                     req.u.read.resp->read_bytes = (br < 0) ? 0 : br;
                     k_sem_give(&req.u.read.resp->sem);
                 }
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+                // The last read of a burst lets the evictions it held back go ahead
+                if (ring_evict_deferred && k_msgq_num_used_get(&sd_read_q) == 0) {
+                    ring_evict_deferred = false;
+                    ring_make_room();
+                }
+#endif
                 break;
 
-            case REQ_SAVE_OFFSET:
+            case REQ_SAVE_OFFSET: {
                 LOG_DBG("[SD_WORK] Saving offset %u to info file\n", (unsigned)req.u.info.offset_value);
-                /* Overwrite info.txt with 4-byte offset value (binary) */
-                if (&fil_info == NULL) {
-                    LOG_ERR("[SD_WORK] info file not open\n");
-                    break;
-                }
-                res = fs_seek(&fil_info, 0, FS_SEEK_SET);
-                if (res == 0) {
-                    bw = fs_write(&fil_info, &req.u.info.offset_value, sizeof(req.u.info.offset_value));
-                    if (bw < 0 || bw != sizeof(req.u.info.offset_value)) {
-                        LOG_ERR("[SD_WORK] info write err %d\n", (int)bw);
-                    } else {
-                        res = fs_sync(&fil_info);
-                        if (res < 0) {
-                            LOG_ERR("[SD_WORK] fs_sync of info file failed: %d", res);
-                        } else {
-                            current_file_offset = req.u.info.offset_value;
-                        }
-                    }
+                uint32_t previous_offset = current_file_offset;
+                current_file_offset = req.u.info.offset_value;
+                // Journaled to the settings partition; info.txt only catches up on the next segment change
+                if (app_settings_save_sync_offset(current_file_offset, first_segment) < 0 &&
+                    write_manifest() < 0) {
+                    current_file_offset = previous_offset;
                 }
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+                // Segments synced just now may be the room a full card was waiting for
+                ring_make_room();
+#endif
+                break;
+            }
+
+#ifdef CONFIG_OMI_ENABLE_SD_RING
+            case REQ_SET_RETENTION:
+                retention = req.u.retention.mode;
+                LOG_INF("[SD_WORK] Retention mode %u", retention);
+                ring_make_room();
                 break;
+#endif
 
             case REQ_CLEAR_AUDIO_DIR:
                 LOG_DBG("[SD_WORK] Clearing audio directory (delete files only)");
-                // Close fil_data before clearing directory
-                fs_close(&fil_data);
-                int unlink_res = fs_unlink(FILE_DATA_PATH);
-                if (unlink_res != 0 && unlink_res != -2) {
-                    LOG_ERR("[SD_WORK] Cannot unlink data file: %s, err: %d", FILE_DATA_PATH, unlink_res);
-                }
-                fs_file_t_init(&fil_data);
-                int reopen_res = fs_open(&fil_data, FILE_DATA_PATH, FS_O_CREATE | FS_O_RDWR | FS_O_TRUNC);
-                if (reopen_res == 0) {
-                    fs_seek(&fil_data, 0, FS_SEEK_SET);
-                } else {
-                    LOG_ERR("[SD_WORK] open new data file failed: %d. Terminating operation", reopen_res);
+                res = clear_segments();
+                if (res < 0) {
+                    LOG_ERR("[SD_WORK] open new data file failed: %d. Terminating operation", res);
                     return;
                 }
-                current_file_size = 0;
-                current_file_offset = 0;
                 // Return result to resp if available
                 if (req.u.clear_dir.resp) {
                     req.u.clear_dir.resp->res = 0;
@@ -540,9 +2322,54 @@ void sd_worker_thread(void)
                 }
                 break;
 
+            case REQ_DELETE_SEGMENT:
+                res = delete_first_segment(req.u.delete_segment.segment);
+                if (req.u.delete_segment.resp) {
+                    req.u.delete_segment.resp->res = (res < 0) ? res : 0;
+                    req.u.delete_segment.resp->read_bytes = (res < 0) ? 0 : res;
+                    k_sem_give(&req.u.delete_segment.resp->sem);
+                }
+                break;
+
+            case REQ_FIND_TIME_RANGE:
+                find_time_range(req.u.time_range.start_utc_s, req.u.time_range.end_utc_s, req.u.time_range.start,
+                                req.u.time_range.end);
+                if (req.u.time_range.resp) {
+                    req.u.time_range.resp->res = 0;
+                    k_sem_give(&req.u.time_range.resp->sem);
+                }
+                break;
+
+#ifdef CONFIG_OMI_ENABLE_SD_DFU
+            case REQ_UPDATE_WRITE:
+                res = write_update(req.u.update.offset, req.u.update.buf, req.u.update.length);
+                req.u.update.resp->res = res;
+                k_sem_give(&req.u.update.resp->sem);
+                break;
+
+            case REQ_UPDATE_FINISH:
+                res = finish_update(req.u.update.length);
+                req.u.update.resp->res = res;
+                k_sem_give(&req.u.update.resp->sem);
+                break;
+#endif
+
             default:
                 LOG_ERR("[SD_WORK] unknown req type\n");
             }
+            FLIGHT_REC(FLIGHT_REC_SD_END, req.type, MIN(k_uptime_get() - req_start, UINT16_MAX));
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+            monitor_sd_request(MONITOR_SD_IDLE);
+            monitor_progress(MONITOR_WORKER_SD, MONITOR_STEP_SD_DONE);
+#endif
+        }
+#ifdef CONFIG_OMI_ENABLE_FLASH_CACHE
+        if (flash_drain_active) {
+            drain_flash_cache_blocks(FLASH_CACHE_DRAIN_STEP);
         }
+#endif
+#ifdef CONFIG_OMI_ENABLE_SD_PREERASE
+        preerase_step();
+#endif
     }
 }
\ No newline at end of file
@@ -1,18 +1,33 @@
 #include "lib/core/settings.h"
 
+#include "lib/core/config.h"
+#include "lib/core/housekeeping.h"
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+#include "lib/core/warm_resume.h"
+#endif
+
+#include <string.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/settings/settings.h>
+#include <zephyr/sys/atomic.h>
 
 LOG_MODULE_REGISTER(app_settings, CONFIG_LOG_DEFAULT_LEVEL);
 
 // Default values if not found in flash
 #define DEFAULT_DIM_LIGHT_RATIO 50
 #define DEFAULT_MIC_GAIN 6
+#define DEFAULT_CODEC_PROFILE CODEC_PROFILE_DEFAULT
+
+// User-tunable settings are written behind: the app drags sliders, so wait for it to settle
+#define SETTINGS_FLUSH_DELAY_MS 2000
+// A failed write is tried again this many times, a period apart, before it waits for the next change
+#define SETTINGS_FLUSH_RETRIES 5
 
 // In-memory cache for the settings
 static uint8_t dim_light_ratio = DEFAULT_DIM_LIGHT_RATIO;
 static uint8_t mic_gain = DEFAULT_MIC_GAIN;
+static uint8_t codec_profile = DEFAULT_CODEC_PROFILE;
 static struct rtc_time rtc_timestamp = {0};
 static uint64_t rtc_epoch = 0;
 
@@ -24,6 +39,65 @@ struct lsm6dsl_time_base {
 
 static struct lsm6dsl_time_base lsm6dsl_time_base = {0};
 
+struct sync_offset_record {
+    uint32_t offset;
+    uint8_t first_segment;
+    uint8_t reserved[3];
+};
+
+static struct sync_offset_record sync_offset = {0};
+static bool sync_offset_valid = false;
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+static uint8_t kws_template[KWS_TEMPLATE_MAX_BYTES];
+static size_t kws_template_len = 0;
+#endif
+
+// Write-behind settings changed in RAM but not in flash yet
+enum deferred_setting {
+    DEFERRED_DIM_RATIO,
+    DEFERRED_MIC_GAIN,
+    DEFERRED_CODEC_PROFILE,
+    DEFERRED_COUNT,
+};
+
+static const struct {
+    const char *key;
+    const uint8_t *value;
+} deferred_settings[DEFERRED_COUNT] = {
+    [DEFERRED_DIM_RATIO] = {"omi/dim_ratio", &dim_light_ratio},
+    [DEFERRED_MIC_GAIN] = {"omi/mic_gain", &mic_gain},
+    [DEFERRED_CODEC_PROFILE] = {"omi/codec_profile", &codec_profile},
+};
+
+static atomic_t deferred_dirty = ATOMIC_INIT(0);
+static atomic_t flush_retries = ATOMIC_INIT(0);
+
+static void settings_flush_work_handler(struct k_work *work);
+K_WORK_DELAYABLE_DEFINE(settings_flush_work, settings_flush_work_handler);
+
+static void settings_flush_work_handler(struct k_work *work)
+{
+    if (app_settings_flush() == 0) {
+        atomic_set(&flush_retries, 0);
+        return;
+    }
+    // The failed keys stay dirty; try them again a while later, a few times
+    if (atomic_inc(&flush_retries) < SETTINGS_FLUSH_RETRIES) {
+        k_work_reschedule_for_queue(&housekeeping_work_q, &settings_flush_work, K_MSEC(SETTINGS_FLUSH_DELAY_MS));
+    } else {
+        LOG_ERR("Giving up on saving settings until they change again");
+    }
+}
+
+// Every change restarts the quiet period, so a burst of writes costs one flash write
+static void defer_save(enum deferred_setting setting)
+{
+    atomic_set_bit(&deferred_dirty, setting);
+    atomic_set(&flush_retries, 0);
+    k_work_reschedule_for_queue(&housekeeping_work_q, &settings_flush_work, K_MSEC(SETTINGS_FLUSH_DELAY_MS));
+}
+
 static int settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
 {
     const char *next;
@@ -53,6 +127,18 @@ static int settings_set(const char *name, size_t len, settings_read_cb read_cb,
         return rc;
     }
 
+    if (settings_name_steq(name, "codec_profile", &next) && !next) {
+        if (len != sizeof(codec_profile)) {
+            return -EINVAL;
+        }
+        rc = read_cb(cb_arg, &codec_profile, sizeof(codec_profile));
+        if (rc >= 0) {
+            LOG_INF("Loaded codec_profile: %u", codec_profile);
+            return 0;
+        }
+        return rc;
+    }
+
     if (settings_name_steq(name, "rtc_timestamp", &next) && !next) {
         if (len != sizeof(rtc_timestamp)) {
             return -EINVAL;
@@ -125,6 +211,34 @@ static int settings_set(const char *name, size_t len, settings_read_cb read_cb,
         return -EINVAL;
     }
 
+    if (settings_name_steq(name, "sync_offset", &next) && !next) {
+        if (len != sizeof(sync_offset)) {
+            return -EINVAL;
+        }
+        rc = read_cb(cb_arg, &sync_offset, sizeof(sync_offset));
+        if (rc >= 0) {
+            sync_offset_valid = true;
+            LOG_INF("Loaded sync_offset: %u in segment %u", sync_offset.offset, sync_offset.first_segment);
+            return 0;
+        }
+        return rc;
+    }
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+    if (settings_name_steq(name, "kws_template", &next) && !next) {
+        if (len > sizeof(kws_template)) {
+            return -EINVAL;
+        }
+        rc = read_cb(cb_arg, kws_template, len);
+        if (rc >= 0) {
+            kws_template_len = rc;
+            LOG_INF("Loaded kws_template: %u bytes", (unsigned) kws_template_len);
+            return 0;
+        }
+        return rc;
+    }
+#endif
+
     return -ENOENT;
 }
 
@@ -187,6 +301,85 @@ int app_settings_get_lsm6dsl_time_base(uint64_t *epoch_s, uint32_t *imu_timestam
     return 0;
 }
 
+int app_settings_save_sync_offset(uint32_t offset, uint8_t first_segment)
+{
+    if (sync_offset_valid && sync_offset.offset == offset && sync_offset.first_segment == first_segment) {
+        return 0;
+    }
+    sync_offset.offset = offset;
+    sync_offset.first_segment = first_segment;
+    sync_offset_valid = true;
+
+    int err = settings_save_one("omi/sync_offset", &sync_offset, sizeof(sync_offset));
+    if (err) {
+        LOG_ERR("Failed to save sync_offset (err %d)", err);
+    }
+    return err;
+}
+
+int app_settings_get_sync_offset(uint32_t *offset, uint8_t *first_segment)
+{
+    if (offset == NULL || first_segment == NULL) {
+        return -EINVAL;
+    }
+    if (!sync_offset_valid) {
+        return -ENOENT;
+    }
+    *offset = sync_offset.offset;
+    *first_segment = sync_offset.first_segment;
+    return 0;
+}
+
+#ifdef CONFIG_OMI_ENABLE_KWS
+int app_settings_save_kws_template(const uint8_t *data, size_t len)
+{
+    if (len > sizeof(kws_template)) {
+        return -EINVAL;
+    }
+    memcpy(kws_template, data, len);
+    kws_template_len = len;
+
+    int err = settings_save_one("omi/kws_template", kws_template, kws_template_len);
+    if (err) {
+        LOG_ERR("Failed to save kws_template (err %d)", err);
+    }
+    return err;
+}
+
+int app_settings_get_kws_template(uint8_t *data, size_t size)
+{
+    if (kws_template_len == 0) {
+        return -ENOENT;
+    }
+    if (kws_template_len > size) {
+        return -ENOMEM;
+    }
+    memcpy(data, kws_template, kws_template_len);
+    return kws_template_len;
+}
+#endif
+
+int app_settings_flush(void)
+{
+    int result = 0;
+
+    for (int i = 0; i < DEFERRED_COUNT; i++) {
+        if (!atomic_test_and_clear_bit(&deferred_dirty, i)) {
+            continue;
+        }
+        // Saves the latest value, even if it changed again since it was marked
+        int err = settings_save_one(deferred_settings[i].key, deferred_settings[i].value, sizeof(uint8_t));
+        if (err) {
+            LOG_ERR("Failed to save %s (err %d)", deferred_settings[i].key, err);
+            atomic_set_bit(&deferred_dirty, i);
+            result = err;
+        } else {
+            LOG_INF("Saved %s: %u", deferred_settings[i].key, *deferred_settings[i].value);
+        }
+    }
+    return result;
+}
+
 SETTINGS_STATIC_HANDLER_DEFINE(app_settings, "omi", NULL, settings_set, NULL, NULL);
 
 int app_settings_init(void)
@@ -197,6 +390,25 @@ int app_settings_init(void)
         return err;
     }
 
+#ifdef CONFIG_OMI_ENABLE_WARM_RESUME
+    // Same values settings_load() would find, without walking the partition. The Bluetooth
+    // subtree is loaded by the transport either way
+    const struct warm_state *warm = warm_resume_get();
+    if (warm) {
+        dim_light_ratio = warm->settings.dim_ratio;
+        mic_gain = warm->settings.mic_gain;
+        codec_profile = warm->settings.codec_profile;
+        rtc_epoch = warm->settings.rtc_epoch;
+        LOG_INF("Settings restored from before system off. dim_ratio=%u mic_gain=%u codec_profile=%u",
+                dim_light_ratio, mic_gain, codec_profile);
+#ifdef CONFIG_OMI_ENABLE_KWS
+        // Too big for the retained state
+        settings_load_subtree("omi/kws_template");
+#endif
+        return 0;
+    }
+#endif
+
     err = settings_load();
     if (err) {
         LOG_ERR("Failed to load settings (err %d)", err);
@@ -210,13 +422,8 @@ int app_settings_init(void)
 int app_settings_save_dim_ratio(uint8_t new_ratio)
 {
     dim_light_ratio = new_ratio;
-    int err = settings_save_one("omi/dim_ratio", &dim_light_ratio, sizeof(dim_light_ratio));
-    if (err) {
-        LOG_ERR("Failed to save dim_ratio (err %d)", err);
-    } else {
-        LOG_INF("Saved dim_ratio: %u", dim_light_ratio);
-    }
-    return err;
+    defer_save(DEFERRED_DIM_RATIO);
+    return 0;
 }
 
 uint8_t app_settings_get_dim_ratio(void)
@@ -227,16 +434,23 @@ uint8_t app_settings_get_dim_ratio(void)
 int app_settings_save_mic_gain(uint8_t new_gain)
 {
     mic_gain = new_gain;
-    int err = settings_save_one("omi/mic_gain", &mic_gain, sizeof(mic_gain));
-    if (err) {
-        LOG_ERR("Failed to save mic_gain (err %d)", err);
-    } else {
-        LOG_INF("Saved mic_gain: %u", mic_gain);
-    }
-    return err;
+    defer_save(DEFERRED_MIC_GAIN);
+    return 0;
 }
 
 uint8_t app_settings_get_mic_gain(void)
 {
     return mic_gain;
 }
+
+int app_settings_save_codec_profile(uint8_t new_profile)
+{
+    codec_profile = new_profile;
+    defer_save(DEFERRED_CODEC_PROFILE);
+    return 0;
+}
+
+uint8_t app_settings_get_codec_profile(void)
+{
+    return codec_profile;
+}
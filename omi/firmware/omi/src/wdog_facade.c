@@ -1,18 +1,55 @@
 #include <zephyr/drivers/watchdog.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "lib/core/monitor.h"
+#endif
 
 LOG_MODULE_REGISTER(wdog_facade, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define WATCHDOG_TIMEOUT_MS 30000U  // 30 seconds
+#define WATCHDOG_PRETIMEOUT_MS 2000U // Snapshot the pipeline this long before the reset
 
 static const struct device *wdt_dev;
 static int wdt_channel_id;
 
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+// The nRF WDT has no early warning and resets two 32 kHz ticks after its interrupt, so a timer
+// restarted on every feed stands in for one
+static void watchdog_pretimeout(struct k_timer *timer);
+K_TIMER_DEFINE(pretimeout_timer, watchdog_pretimeout, NULL);
+static atomic_t pretimeout_fired;
+
+static void watchdog_pretimeout(struct k_timer *timer)
+{
+    monitor_forensics_capture(MONITOR_FORENSIC_WATCHDOG, 0);
+    atomic_set(&pretimeout_fired, 1);
+}
+
+// Last resort if the timer couldn't run, only a few stores fit before the reset
+static void watchdog_expired(const struct device *dev, int channel_id)
+{
+    if (!atomic_get(&pretimeout_fired)) {
+        monitor_forensics_capture(MONITOR_FORENSIC_WATCHDOG, 0);
+    }
+}
+#endif
+
 void watchdog_feed(void)
 {
     if (wdt_dev && device_is_ready(wdt_dev)) {
         wdt_feed(wdt_dev, wdt_channel_id);
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+        k_timer_start(&pretimeout_timer, K_MSEC(WATCHDOG_TIMEOUT_MS - WATCHDOG_PRETIMEOUT_MS), K_NO_WAIT);
+        if (atomic_cas(&pretimeout_fired, 1, 0)) {
+            // Fed just in time, the stall cleared without a reset
+            monitor_forensics_discard();
+            LOG_WRN("Watchdog fed less than %u ms before the reset", WATCHDOG_PRETIMEOUT_MS);
+        }
+        monitor_progress(MONITOR_WORKER_MAIN, MONITOR_STEP_FED);
+#endif
     }
 }
 
@@ -32,7 +69,11 @@ int watchdog_init(void)
     wdt_config.flags = WDT_FLAG_RESET_SOC;         // Reset entire SoC on timeout
     wdt_config.window.min = 0U;                    // No minimum window
     wdt_config.window.max = WATCHDOG_TIMEOUT_MS;   // 30 seconds timeout
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    wdt_config.callback = watchdog_expired;        // Snapshot the pipeline, then reset
+#else
     wdt_config.callback = NULL;                    // No callback, just reset
+#endif
 
     // Install watchdog timeout
     wdt_channel_id = wdt_install_timeout(wdt_dev, &wdt_config);
@@ -48,11 +89,18 @@ int watchdog_init(void)
         return ret;
     }
 
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    k_timer_start(&pretimeout_timer, K_MSEC(WATCHDOG_TIMEOUT_MS - WATCHDOG_PRETIMEOUT_MS), K_NO_WAIT);
+#endif
+
     LOG_INF("Watchdog initialized (timeout: 30s, channel: %d)", wdt_channel_id);
     return 0;
 }
 
 int watchdog_deinit(void)
 {
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    k_timer_stop(&pretimeout_timer);
+#endif
     return wdt_disable(wdt_dev);
 }
\ No newline at end of file
@@ -28,6 +28,11 @@ LOG_MODULE_REGISTER(wifi, CONFIG_LOG_DEFAULT_LEVEL);
 #include <net/wifi_ready.h>
 #include "wifi.h"
 #include "storage.h"
+#include "lib/core/config.h"
+#include "lib/core/power.h"
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+#include "lib/core/monitor.h"
+#endif
 
 #define WIFI_SAP_MGMT_EVENTS                                                                    \
 	(NET_EVENT_WIFI_AP_ENABLE_RESULT | NET_EVENT_WIFI_AP_DISABLE_RESULT |                     \
@@ -61,16 +66,34 @@ static char ap_password[WIFI_MAX_PASSWORD_LEN + 1] = "12345678";
 
 #define TCP_REMOTE_IP "192.168.1.2"
 #define TCP_REMOTE_PORT 12345
+#define TCP_SNDBUF_SIZE (16 * 1024) /* Keeps the link busy while the next chunk is read */
+#define TCP_SEND_POLL_MS 100
 
 static atomic_t tcp_connected_flag;
 static K_MUTEX_DEFINE(tcp_sock_lock);
 static int tcp_socket = -1;
 static atomic_t stop_tcp_traffic = ATOMIC_INIT(1);
+static atomic_t live_mode; /* Carrying live audio frames instead of a storage sync */
+static int tcp_sndbuf = TCP_SNDBUF_SIZE;
+static int tcp_nodelay = -1; /* set from WIFI_TUNE, negative for the mode's default */
+static struct wifi_send_stats send_stats; /* under tcp_sock_lock */
 static bool is_hardware_available = false;
 
 #define WIFI_CONNECTING_TIMEOUT_MS (60U * 1000U)
+#define WIFI_SESSION_LINGER_MS (60U * 1000U) /* AP kept up after a session, for the next sync */
+#define TCP_CONNECT_RETRY_MS 250
+#define WIFI_BRINGUP_DEFAULT_MS (8U * 1000U) /* until a session has been timed */
 static uint32_t connecting_started_ms;
 static bool connecting_timer_running;
+static uint32_t idle_started_ms;
+static uint32_t bringup_started_ms;
+static bool bringup_timing;
+static uint32_t bringup_avg_ms = WIFI_BRINGUP_DEFAULT_MS;
+/* Session changes are made by the state machine thread, which may be in the middle of a connect */
+static atomic_t session_end_requested;
+static atomic_t session_resume_requested;
+/* New credentials while the AP lingers: the phone can only join after the AP restarts with them */
+static atomic_t ap_restart_requested;
 
 static int stop_dhcp_server(void);
 
@@ -226,8 +249,16 @@ static int tcp_client_start(void)
 		return -errno;
 	}
 
-	int one = 1;
-	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* Sync writes are large, let Nagle merge the tail of one with the next instead of
+	 * sending a short segment after each of them. Live frames are small and late ones are
+	 * useless, so they go out as soon as they are written.
+	 */
+	int nodelay = tcp_nodelay >= 0 ? tcp_nodelay : (atomic_get(&live_mode) ? 1 : 0);
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	int sndbuf = tcp_sndbuf;
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+		LOG_WRN("tcp: SO_SNDBUF not applied: %d", errno);
+	}
 	struct timeval tv = {
 		.tv_sec = 0,
 		.tv_usec = 0,
@@ -266,6 +297,9 @@ void wifi_turn_off(void)
 	}
 	/* Stop new TCP sends immediately */
 	atomic_set(&stop_tcp_traffic, 1);
+	atomic_clear(&session_end_requested);
+	atomic_clear(&session_resume_requested);
+	atomic_clear(&ap_restart_requested);
 	current_wifi_state = WIFI_STATE_SHUTDOWN;
 
 	// wait for wifi to turn off (max 10s)
@@ -280,10 +314,18 @@ void wifi_turn_off(void)
     if (iface) {
         net_if_down(iface);
     }
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+    monitor_energy_set(MONITOR_ENERGY_WIFI, false);
+#endif
 }
 
 int wifi_turn_on(void)
 {
+	if (current_wifi_state == WIFI_STATE_IDLE || atomic_get(&session_end_requested)) {
+		/* AP, DHCP and the phone's association are still up, only TCP has to reconnect */
+		atomic_set(&session_resume_requested, 1);
+		return 0;
+	}
 	if (current_wifi_state != WIFI_STATE_OFF) {
 		return -EALREADY;
 	} else {
@@ -296,10 +338,28 @@ int wifi_turn_on(void)
 
 	current_wifi_state = WIFI_STATE_ON;
 	atomic_clear(&stop_tcp_traffic);
+	bringup_started_ms = k_uptime_get_32();
+	bringup_timing = true;
+#ifdef CONFIG_OMI_ENABLE_MONITOR
+	monitor_energy_set(MONITOR_ENERGY_WIFI, true);
+#endif
 
 	return 0;
 }
 
+void wifi_end_session(void)
+{
+	if (current_wifi_state != WIFI_STATE_CONNECTING && current_wifi_state != WIFI_STATE_CONNECT) {
+		wifi_turn_off();
+		return;
+	}
+	/* Stop new TCP sends immediately, the thread closes the socket */
+	atomic_set(&stop_tcp_traffic, 1);
+	atomic_clear(&live_mode);
+	atomic_clear(&session_resume_requested);
+	atomic_set(&session_end_requested, 1);
+}
+
 int setup_wifi_credentials(const char *ssid, const char *password)
 {
 	if (!ssid || !password) {
@@ -316,6 +376,10 @@ int setup_wifi_credentials(const char *ssid, const char *password)
 		return -EINVAL;
 	}
 
+	if (current_wifi_state != WIFI_STATE_OFF && current_wifi_state != WIFI_STATE_SHUTDOWN &&
+	    (strcmp(ap_ssid, ssid) != 0 || strcmp(ap_password, password) != 0)) {
+		atomic_set(&ap_restart_requested, 1);
+	}
 	strncpy(ap_ssid, ssid, sizeof(ap_ssid) - 1);
 	ap_ssid[sizeof(ap_ssid) - 1] = '\0';
 	strncpy(ap_password, password, sizeof(ap_password) - 1);
@@ -380,16 +444,216 @@ int wifi_send_data(const uint8_t *data, size_t len)
 	return -EAGAIN;
 }
 
+/* Sends data under a single socket lock until it is all out, an error, or deadline (uptime ms, 0 for none).
+ * A send that stops part way drops the connection: the peer would read the rest of the stream out of frame.
+ * *progress is set to the bytes that went out, also when it fails.
+ */
+static int wifi_send_until(const uint8_t *data, size_t len, int64_t deadline, size_t *progress)
+{
+	size_t sent = 0;
+	int ret = 0;
+
+	*progress = 0;
+	if (!data || len == 0) {
+		return 0;
+	}
+
+	if (atomic_get(&stop_tcp_traffic)) {
+		return -ECONNABORTED;
+	}
+
+	if (!atomic_get(&tcp_connected_flag)) {
+		return -ENOTCONN;
+	}
+
+	/* Held for the whole buffer; shutdown waits for us, and we check for it between sends */
+	k_mutex_lock(&tcp_sock_lock, K_FOREVER);
+	int fd = tcp_socket;
+
+	while (sent < len) {
+		if (fd < 0 || !atomic_get(&tcp_connected_flag)) {
+			ret = -ENOTCONN;
+			break;
+		}
+		if (atomic_get(&stop_tcp_traffic)) {
+			ret = -ECONNABORTED;
+			break;
+		}
+
+		ssize_t n = send(fd, data + sent, len - sent, ZSOCK_MSG_DONTWAIT);
+		if (n >= 0) {
+			sent += n;
+			continue;
+		}
+
+		int err = errno;
+		if (err == EINPROGRESS || err == EAGAIN || err == ENOBUFS) {
+			send_stats.eagain++;
+			int64_t left = deadline ? deadline - k_uptime_get() : TCP_SEND_POLL_MS;
+			if (left > 0) {
+				struct zsock_pollfd pfd = {
+					.fd = fd,
+					.events = ZSOCK_POLLOUT
+				};
+				int64_t poll_started = k_uptime_get();
+				(void)zsock_poll(&pfd, 1, MIN(TCP_SEND_POLL_MS, (int)left));
+				send_stats.polls++;
+				send_stats.poll_ms += (uint32_t)(k_uptime_get() - poll_started);
+				continue;
+			}
+			if (sent == 0) {
+				ret = -EAGAIN;
+				break;
+			}
+			LOG_WRN("TCP send timed out after %u of %u bytes", (unsigned)sent, (unsigned)len);
+			err = ETIMEDOUT;
+		}
+
+		LOG_ERR("TCP send failed with error: %d", err);
+		tcp_client_stop();
+		atomic_set(&stop_tcp_traffic, 1);
+		current_wifi_state = WIFI_STATE_CONNECTING;
+		ret = -err;
+		break;
+	}
+	k_mutex_unlock(&tcp_sock_lock);
+
+	*progress = sent;
+	return ret < 0 ? ret : (int)sent;
+}
+
+int wifi_send_all(const uint8_t *data, size_t len)
+{
+	size_t progress;
+
+	return wifi_send_until(data, len, 0, &progress);
+}
+
+int wifi_send_all_progress(const uint8_t *data, size_t len, size_t *sent)
+{
+	return wifi_send_until(data, len, 0, sent);
+}
+
+int wifi_send_all_timeout(const uint8_t *data, size_t len, uint32_t timeout_ms)
+{
+	size_t progress;
+
+	return wifi_send_until(data, len, k_uptime_get() + timeout_ms, &progress);
+}
+
+int wifi_recv(uint8_t *buf, size_t len, uint32_t timeout_ms)
+{
+	if (!buf || len == 0) {
+		return 0;
+	}
+
+	if (atomic_get(&stop_tcp_traffic)) {
+		return -ECONNABORTED;
+	}
+
+	if (!atomic_get(&tcp_connected_flag)) {
+		return -ENOTCONN;
+	}
+
+	k_mutex_lock(&tcp_sock_lock, K_FOREVER);
+	int fd = tcp_socket;
+	k_mutex_unlock(&tcp_sock_lock);
+	if (fd < 0) {
+		return -ENOTCONN;
+	}
+
+	struct zsock_pollfd pfd = {
+		.fd = fd,
+		.events = ZSOCK_POLLIN
+	};
+	int poll_ret = zsock_poll(&pfd, 1, timeout_ms);
+	if (poll_ret == 0) {
+		return -EAGAIN;
+	}
+
+	ssize_t n = poll_ret < 0 ? -1 : recv(fd, buf, len, ZSOCK_MSG_DONTWAIT);
+	if (n > 0) {
+		return n;
+	}
+	int err = n == 0 ? ECONNRESET : errno; /* 0 is the hub closing the connection */
+	if (err == EAGAIN) {
+		return -EAGAIN;
+	}
+
+	LOG_ERR("TCP recv failed with error: %d", err);
+	tcp_client_stop();
+	atomic_set(&stop_tcp_traffic, 1);
+	current_wifi_state = WIFI_STATE_CONNECTING;
+	return -err;
+}
+
+void wifi_send_stats_get(struct wifi_send_stats *stats)
+{
+	k_mutex_lock(&tcp_sock_lock, K_FOREVER);
+	*stats = send_stats;
+	k_mutex_unlock(&tcp_sock_lock);
+}
+
+void wifi_send_stats_reset(void)
+{
+	k_mutex_lock(&tcp_sock_lock, K_FOREVER);
+	memset(&send_stats, 0, sizeof(send_stats));
+	k_mutex_unlock(&tcp_sock_lock);
+}
+
+int wifi_tune_socket(uint32_t sndbuf, int nodelay)
+{
+	if (sndbuf > INT32_MAX || nodelay > 1) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&tcp_sock_lock, K_FOREVER);
+	if (sndbuf) {
+		tcp_sndbuf = (int)sndbuf;
+	}
+	tcp_nodelay = nodelay < 0 ? -1 : nodelay;
+
+	int ret = 0;
+	if (tcp_socket >= 0) {
+		int value = tcp_nodelay >= 0 ? tcp_nodelay : (atomic_get(&live_mode) ? 1 : 0);
+		(void)setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+		if (setsockopt(tcp_socket, SOL_SOCKET, SO_SNDBUF, &tcp_sndbuf, sizeof(tcp_sndbuf)) < 0) {
+			ret = -errno;
+		}
+	}
+	k_mutex_unlock(&tcp_sock_lock);
+
+	LOG_INF("tcp: SO_SNDBUF %d, TCP_NODELAY %d (%d)", tcp_sndbuf, tcp_nodelay, ret);
+	return ret;
+}
+
+void wifi_set_live(bool live)
+{
+	atomic_set(&live_mode, live);
+}
+
+bool wifi_is_live(void)
+{
+	return atomic_get(&live_mode);
+}
+
 bool is_wifi_transport_ready(void)
 {
 	return atomic_get(&tcp_connected_flag);
 }
 
+uint32_t wifi_bringup_ms(void)
+{
+	return current_wifi_state == WIFI_STATE_IDLE ? 0 : bringup_avg_ms;
+}
+
 bool is_wifi_on(void)
 {
-	/* Treat SHUTDOWN as off for data-path loops so they can exit quickly. */
+	/* Treat SHUTDOWN and an ended session as off for data-path loops so they can exit quickly. */
 	return (current_wifi_state != WIFI_STATE_OFF) &&
-	       (current_wifi_state != WIFI_STATE_SHUTDOWN);
+	       (current_wifi_state != WIFI_STATE_SHUTDOWN) &&
+	       (current_wifi_state != WIFI_STATE_IDLE) &&
+	       !atomic_get(&session_end_requested);
 }
 
 static void wifi_ap_stations_unlocked(void)
@@ -669,6 +933,34 @@ out:
 
 }
 
+/* Disable the AP and wait for the actual result callback */
+static int wifi_softap_disable(struct net_if *iface)
+{
+	atomic_clear(&wifi_ap_disable_seen);
+	wifi_ap_disable_status = -1;
+	k_sem_reset(&wifi_ap_disable_result_sem);
+
+	LOG_INF("Requesting AP disable...");
+	int ret = net_mgmt(NET_REQUEST_WIFI_AP_DISABLE, iface, NULL, 0);
+	if (ret) {
+		LOG_ERR("AP disable request call failed: %d", ret);
+		return -1;
+	}
+
+	/* Wait for NET_EVENT_WIFI_AP_DISABLE_RESULT. If this times out, wpa_supp is stuck. */
+	ret = k_sem_take(&wifi_ap_disable_result_sem, K_SECONDS(8));
+	if (ret) {
+		LOG_ERR("AP disable result timeout -> WPA supplicant likely stuck");
+		return -1;
+	}
+
+	if (!atomic_get(&wifi_ap_disable_seen) || wifi_ap_disable_status != 0) {
+		LOG_ERR("AP disable failed (status=%d)", wifi_ap_disable_status);
+		return -1;
+	}
+	return 0;
+}
+
 static void handle_wifi_shutdown(void)
 {
 	LOG_INF("Wi-Fi state: SHUTDOWN");
@@ -697,29 +989,7 @@ static void handle_wifi_shutdown(void)
 		return;
 	}
 	
-	/* Step: Disable AP and wait for the actual result callback. */
-	atomic_clear(&wifi_ap_disable_seen);
-	wifi_ap_disable_status = -1;
-	k_sem_reset(&wifi_ap_disable_result_sem);
-
-	LOG_INF("Requesting AP disable...");
-	int ret = net_mgmt(NET_REQUEST_WIFI_AP_DISABLE, iface, NULL, 0);
-	if (ret) {
-		LOG_ERR("AP disable request call failed: %d", ret);
-		k_sleep(K_SECONDS(2));
-		return; /* stay in SHUTDOWN */
-	}
-
-	/* Wait for NET_EVENT_WIFI_AP_DISABLE_RESULT. If this times out, wpa_supp is stuck. */
-	ret = k_sem_take(&wifi_ap_disable_result_sem, K_SECONDS(8));
-	if (ret) {
-		LOG_ERR("AP disable result timeout -> WPA supplicant likely stuck");
-		k_sleep(K_SECONDS(2));
-		return; /* stay in SHUTDOWN */
-	}
-
-	if (!atomic_get(&wifi_ap_disable_seen) || wifi_ap_disable_status != 0) {
-		LOG_ERR("AP disable failed (status=%d)", wifi_ap_disable_status);
+	if (wifi_softap_disable(iface) != 0) {
 		k_sleep(K_SECONDS(2));
 		return; /* stay in SHUTDOWN */
 	}
@@ -774,10 +1044,20 @@ static int stop_dhcp_server(void)
 	return ret;
 }
 
+static void wifi_enter_idle(void)
+{
+	LOG_INF("Wi-Fi state: IDLE (AP kept for %u ms)", WIFI_SESSION_LINGER_MS);
+	tcp_client_stop();
+	wifi_connecting_timer_reset();
+	idle_started_ms = k_uptime_get_32();
+	current_wifi_state = WIFI_STATE_IDLE;
+	atomic_clear(&session_end_requested);
+}
+
 void start_wifi_thread(void);
 K_THREAD_DEFINE(start_wifi_thread_id, 4096,
 		start_wifi_thread, NULL, NULL, NULL,
-		6, 0, -1);
+		THREAD_PRIO_WIFI, 0, -1);
 
 void start_wifi_thread(void)
 {
@@ -798,12 +1078,11 @@ void start_wifi_thread(void)
 			break;
 
 		case WIFI_STATE_SHUTDOWN:
-			// Ensure mic is resumed
-			if(!mic_is_running()) {
-				LOG_INF("Microphone resumed when Wi-Fi shuts down");
-				mic_resume();
-			}
+			// Releases the Wi-Fi activities, the SD card goes off too unless capture still needs it
+			power_wifi_stopped();
 			wifi_connecting_timer_reset();
+			atomic_clear(&live_mode);
+			bringup_timing = false;
 			handle_wifi_shutdown();
 			break;
 
@@ -824,6 +1103,10 @@ void start_wifi_thread(void)
 			break;
 
 		case WIFI_STATE_CONNECTING:
+			if (atomic_get(&session_end_requested)) {
+				wifi_enter_idle();
+				break;
+			}
 			LOG_INF("Wi-Fi state: CONNECTING (TCP)");
 			wifi_connecting_timer_start_once();
 			if (wifi_connecting_timer_expired(WIFI_CONNECTING_TIMEOUT_MS)) {
@@ -839,13 +1122,27 @@ void start_wifi_thread(void)
 			if (tcp_client_start() == 0) {
 				current_wifi_state = WIFI_STATE_CONNECT;
 				wifi_connecting_timer_reset();
+				if (bringup_timing) {
+					uint32_t took = k_uptime_get_32() - bringup_started_ms;
+					bringup_avg_ms = (3 * bringup_avg_ms + took) / 4;
+					bringup_timing = false;
+					LOG_INF("Wi-Fi up in %u ms (average %u ms)", took, bringup_avg_ms);
+				}
+				/* A sync can't continue on a new connection, but a live stream can */
+				if (atomic_get(&live_mode)) {
+					atomic_clear(&stop_tcp_traffic);
+				}
 			} else {
-				k_msleep(1000);
+				k_msleep(TCP_CONNECT_RETRY_MS);
 			}
 			break;
 
 		case WIFI_STATE_CONNECT:
 			wifi_connecting_timer_reset();
+			if (atomic_get(&session_end_requested)) {
+				wifi_enter_idle();
+				break;
+			}
 			/* Keep the connection; if it drops, retry connect. */
 			if (!wifi_ready_status) {
 				current_wifi_state = WIFI_STATE_SHUTDOWN;
@@ -861,6 +1158,33 @@ void start_wifi_thread(void)
 			k_sleep(K_MSEC(1000));
 			break;
 
+		case WIFI_STATE_IDLE:
+			if (atomic_cas(&session_resume_requested, 1, 0)) {
+				atomic_clear(&stop_tcp_traffic);
+				if (atomic_cas(&ap_restart_requested, 1, 0)) {
+					/* ON starts the AP again, with the new credentials */
+					LOG_INF("Wi-Fi credentials changed, restarting the AP");
+					stop_dhcp_server();
+					struct net_if *iface = net_if_get_first_wifi();
+					if (iface && wifi_softap_disable(iface) == 0) {
+						current_wifi_state = WIFI_STATE_ON;
+					} else {
+						current_wifi_state = WIFI_STATE_SHUTDOWN;
+					}
+					break;
+				}
+				LOG_INF("Wi-Fi session resumed");
+				current_wifi_state = WIFI_STATE_CONNECTING;
+				break;
+			}
+			if (!wifi_ready_status ||
+			    (uint32_t)(k_uptime_get_32() - idle_started_ms) > WIFI_SESSION_LINGER_MS) {
+				current_wifi_state = WIFI_STATE_SHUTDOWN;
+				break;
+			}
+			k_msleep(100);
+			break;
+
 		default:
 			/* Unknown state: reset state machine. */
 			tcp_client_stop();
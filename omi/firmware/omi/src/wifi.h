@@ -16,17 +16,52 @@ typedef enum {
 	WIFI_STATE_SHUTDOWN,   /* Try to shut down WiFi */
 	WIFI_STATE_ON,         /* WiFi is on in AP mode */
 	WIFI_STATE_CONNECTING, /* Trying to connect to TCP server */
-	WIFI_STATE_CONNECT     /* Connected to TCP server */
+	WIFI_STATE_CONNECT,    /* Connected to TCP server */
+	WIFI_STATE_IDLE        /* Session ended, AP kept up for the next one */
 } wifi_state_t;
 
 /* API functions */
 int wifi_init(void);
 void wifi_turn_off(void);
 int wifi_turn_on(void);
+/* Ends the session but keeps the AP and DHCP leases up for a while, so a wifi_turn_on() soon after
+ * only has to wait for the hub to reconnect. Falls back to wifi_turn_off() if no session is up yet.
+ */
+void wifi_end_session(void);
 bool wifi_is_hw_available(void);
 int setup_wifi_credentials(const char *ssid, const char *password);
 int wifi_send_data(const uint8_t *data, size_t len);
+/* Sends all of data under a single socket lock, returns len or a negative errno */
+int wifi_send_all(const uint8_t *data, size_t len);
+/* As wifi_send_all, and sets *sent to the bytes of data that went out before any error */
+int wifi_send_all_progress(const uint8_t *data, size_t len, size_t *sent);
+/* As wifi_send_all, but gives up after timeout_ms (0 tries once without waiting): -EAGAIN if nothing
+ * was sent, otherwise the connection is dropped (the rest of the stream would be out of frame) and a
+ * negative errno returned
+ */
+int wifi_send_all_timeout(const uint8_t *data, size_t len, uint32_t timeout_ms);
+/* Receives up to len bytes from the hub, waiting at most timeout_ms for the first: returns the number
+ * received, -EAGAIN if none arrived in time, or a negative errno once the connection is gone
+ */
+int wifi_recv(uint8_t *buf, size_t len, uint32_t timeout_ms);
+/* Live mode carries audio frames from the pusher instead of a storage sync; cleared on shutdown */
+void wifi_set_live(bool live);
+bool wifi_is_live(void);
 bool is_wifi_transport_ready(void);
+/* What the TCP send path waited on since the last reset, for the Wi-Fi benchmark */
+struct wifi_send_stats {
+	uint32_t eagain;  /* sends the stack turned away for lack of buffers or window */
+	uint32_t polls;   /* waits for the socket to take more */
+	uint32_t poll_ms; /* time spent in them */
+};
+void wifi_send_stats_get(struct wifi_send_stats *stats);
+void wifi_send_stats_reset(void);
+/* Socket options for this and later connections: SO_SNDBUF in bytes (0 keeps the current one) and
+ * TCP_NODELAY (0 or 1, negative for the default: on in live mode, off for syncs)
+ */
+int wifi_tune_socket(uint32_t sndbuf, int nodelay);
+/* Time from wifi_turn_on() to a hub connection, averaged over past sessions; 0 while one lingers */
+uint32_t wifi_bringup_ms(void);
 bool is_wifi_on(void);
 bool wifi_is_hw_available(void);
 #endif
\ No newline at end of file
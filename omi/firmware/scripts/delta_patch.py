@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""Make and check delta firmware patches for the pendant and the glasses.
+
+A patch rebuilds a new firmware image from the image the device is running, so an update that
+changes a few functions transfers a few kilobytes instead of the whole image. The device applies
+it straight into the update slot and only swaps in the result when it has the expected CRC. Both
+firmwares read the same format:
+
+    header, 24 bytes, little endian
+        magic        u32  0x544C4544 ("DELT")
+        version      u8   1
+        reserved     u8[3]
+        source_size  u32  bytes of the running image the patch was made against
+        source_crc   u32  IEEE CRC32 of those bytes, a device running anything else refuses the patch
+        target_size  u32  bytes of the new image
+        target_crc   u32  IEEE CRC32 of the new image
+    operations, until target_size bytes have been produced
+        0x01 COPY    [source_offset u32][length u32]   bytes of the running image
+        0x02 INSERT  [length u16][length bytes]        new bytes
+
+The pendant patches the signed MCUboot image (zephyr.signed.bin / app_update.bin of the running
+build against the new one), delivered with the delta DFU service. The glasses patch the
+application .bin, downloaded from the OTA URL like a full image.
+
+    delta_patch.py make old.bin new.bin -o update.delta
+    delta_patch.py apply old.bin update.delta -o rebuilt.bin
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MAGIC = 0x544C4544
+VERSION = 1
+HEADER = struct.Struct("<IB3xIIII")
+OP_COPY = 0x01
+OP_INSERT = 0x02
+MAX_INSERT = 0xFFFF
+
+BLOCK = 16      # bytes hashed per index entry
+INDEX_STEP = 4  # source offsets indexed, any match of BLOCK + INDEX_STEP bytes is found
+MIN_COPY = 24   # shorter matches cost more as a COPY than as part of an INSERT
+MAX_CANDIDATES = 32
+
+
+def match_forward(a, ai, b, bi):
+    n = 0
+    limit = min(len(a) - ai, len(b) - bi)
+    step = 256
+    while n < limit:
+        step = min(step, limit - n)
+        if a[ai + n:ai + n + step] == b[bi + n:bi + n + step]:
+            n += step
+        elif step > 1:
+            step //= 2
+        else:
+            break
+    return n
+
+
+def match_backward(a, ai, b, bi, limit):
+    n = 0
+    while n < limit and ai - n > 0 and a[ai - n - 1] == b[bi - n - 1]:
+        n += 1
+    return n
+
+
+def make_patch(old, new):
+    index = {}
+    for off in range(0, len(old) - BLOCK + 1, INDEX_STEP):
+        index.setdefault(old[off:off + BLOCK], []).append(off)
+
+    ops = []
+    literal_start = 0
+    i = 0
+    while i + BLOCK <= len(new):
+        best = None
+        for off in index.get(new[i:i + BLOCK], ())[:MAX_CANDIDATES]:
+            forward = match_forward(old, off, new, i)
+            back = match_backward(old, off, new, i, i - literal_start)
+            if best is None or back + forward > best[1] + best[2]:
+                best = (off, back, forward)
+        if best is None or best[1] + best[2] < MIN_COPY:
+            i += 1
+            continue
+        off, back, forward = best
+        if i - back > literal_start:
+            ops.append((OP_INSERT, new[literal_start:i - back]))
+        ops.append((OP_COPY, off - back, back + forward))
+        i += forward
+        literal_start = i
+    if literal_start < len(new):
+        ops.append((OP_INSERT, new[literal_start:]))
+
+    out = bytearray(HEADER.pack(MAGIC, VERSION, len(old), zlib.crc32(old), len(new), zlib.crc32(new)))
+    for op in ops:
+        if op[0] == OP_COPY:
+            out += struct.pack("<BII", OP_COPY, op[1], op[2])
+            continue
+        data = op[1]
+        for start in range(0, len(data), MAX_INSERT):
+            chunk = data[start:start + MAX_INSERT]
+            out += struct.pack("<BH", OP_INSERT, len(chunk)) + chunk
+    return bytes(out)
+
+
+def apply_patch(old, patch):
+    if len(patch) < HEADER.size:
+        raise ValueError("patch is shorter than its header")
+    magic, version, source_size, source_crc, target_size, target_crc = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a version %d delta patch" % VERSION)
+    if len(old) < source_size or zlib.crc32(old[:source_size]) != source_crc:
+        raise ValueError("patch was made against a different image")
+
+    out = bytearray()
+    pos = HEADER.size
+    while len(out) < target_size:
+        op = patch[pos]
+        if op == OP_COPY:
+            off, length = struct.unpack_from("<II", patch, pos + 1)
+            if off + length > source_size:
+                raise ValueError("COPY past the end of the source at patch offset %d" % pos)
+            out += old[off:off + length]
+            pos += 9
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<H", patch, pos + 1)
+            out += patch[pos + 3:pos + 3 + length]
+            pos += 3 + length
+        else:
+            raise ValueError("unknown operation 0x%02x at patch offset %d" % (op, pos))
+    if len(out) != target_size or pos != len(patch):
+        raise ValueError("operations don't add up to the target size")
+    if zlib.crc32(out) != target_crc:
+        raise ValueError("rebuilt image has the wrong CRC")
+    return bytes(out)
+
+
+def read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+    make = sub.add_parser("make", help="make a patch from the running image to the new one")
+    make.add_argument("old")
+    make.add_argument("new")
+    make.add_argument("-o", "--output", required=True)
+    apply = sub.add_parser("apply", help="rebuild the new image from the old one and a patch")
+    apply.add_argument("old")
+    apply.add_argument("patch")
+    apply.add_argument("-o", "--output", required=True)
+    args = parser.parse_args()
+
+    old = read(args.old)
+    if args.command == "make":
+        new = read(args.new)
+        patch = make_patch(old, new)
+        if apply_patch(old, patch) != new:
+            sys.exit("patch does not rebuild %s" % args.new)
+        with open(args.output, "wb") as f:
+            f.write(patch)
+        print("%s: %d bytes, %.1f%% of the %d byte image" % (args.output, len(patch), 100.0 * len(patch) / len(new),
+                                                           len(new)))
+    else:
+        try:
+            new = apply_patch(old, read(args.patch))
+        except ValueError as e:
+            sys.exit("%s: %s" % (args.patch, e))
+        with open(args.output, "wb") as f:
+            f.write(new)
+        print("%s: %d bytes" % (args.output, len(new)))
+
+
+if __name__ == "__main__":
+    main()
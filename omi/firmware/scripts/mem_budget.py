@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""Report where the static RAM and flash of a build go and check them against budgets.
+
+RAM and flash are broken down per module: a source file of the app, a library directory under it, or a
+Zephyr / nRF Connect SDK subsystem, found from the debug line info of each symbol. Thread stacks are
+listed on their own, every RAM symbol with "stack" in its name. The totals come from the section
+headers, so they also count padding and anything without debug info.
+
+Budgets are read from a file of "<name> <bytes>" lines:
+
+    ram <bytes>      all of RAM, defaults to CONFIG_SRAM_SIZE
+    flash <bytes>    the image in flash, defaults to CONFIG_FLASH_LOAD_SIZE (or CONFIG_FLASH_SIZE)
+    stacks <bytes>   all thread stacks together
+    <module> <bytes> RAM of one module, named as in the report
+
+The omi CMake project runs it as the mem_budget target, which fails when a budget is exceeded:
+
+    west build -d build/omi -t mem_budget
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+from collections import defaultdict
+
+# nRF52840 memory map
+FLASH_END = 0x00100000
+RAM_START = 0x20000000
+RAM_END = 0x20040000
+
+# Libraries kept in the app tree, reported as one module each
+LIBRARY_DIRS = ("src/lib/core/lib", "src/lib")
+
+
+def run(tool, *args):
+    return subprocess.run([tool, *args], check=True, capture_output=True, text=True).stdout
+
+
+def read_config(path):
+    config = {}
+    if path and os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                m = re.match(r"^(CONFIG_\w+)=(.*)$", line.strip())
+                if m:
+                    config[m.group(1)] = m.group(2).strip('"')
+    return config
+
+
+def read_budgets(path):
+    budgets = {}
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            fields = line.split("#", 1)[0].split()
+            if not fields:
+                continue
+            if len(fields) != 2 or not fields[1].isdigit():
+                sys.exit(f"{path}:{number}: expected '<name> <bytes>'")
+            budgets[fields[0]] = int(fields[1])
+    return budgets
+
+
+def section_totals(objdump, elf):
+    """RAM taken and flash written by the allocated sections"""
+    ram = flash = 0
+    for line in run(objdump, "-h", "-w", elf).splitlines():
+        fields = line.split()
+        if len(fields) < 7 or not fields[0].isdigit():
+            continue
+        size, vma, lma = int(fields[2], 16), int(fields[3], 16), int(fields[4], 16)
+        flags = " ".join(fields[7:])
+        if "ALLOC" not in flags or size == 0:
+            continue
+        if RAM_START <= vma < RAM_END:
+            ram += size
+        # .data and RAM code are loaded from flash too
+        if "LOAD" in flags and lma < FLASH_END:
+            flash += size
+    return ram, flash
+
+
+def module_of(location, root, workspace):
+    if not location:
+        return "(no debug info)"
+    path = os.path.realpath(location.rsplit(":", 1)[0])
+    if path.startswith(root + os.sep):
+        rel = os.path.relpath(path, root)
+        for lib in LIBRARY_DIRS:
+            if rel.startswith(lib + "/"):
+                parts = rel.split("/")
+                return "/".join(parts[: len(lib.split("/")) + 1])
+        return rel
+    if workspace and path.startswith(workspace + os.sep):
+        # e.g. zephyr/subsys/bluetooth, nrf/drivers/mpsl
+        return "/".join(os.path.relpath(path, workspace).split("/")[:3])
+    return "(toolchain)"
+
+
+def symbol_usage(nm, elf, root, workspace):
+    ram = defaultdict(int)
+    flash = defaultdict(int)
+    stacks = []
+    for line in run(nm, "--defined-only", "-S", "-l", elf).splitlines():
+        location = None
+        if "\t" in line:
+            line, location = line.split("\t", 1)
+        fields = line.split()
+        if len(fields) != 4:
+            continue
+        addr, size, kind, name = int(fields[0], 16), int(fields[1], 16), fields[2].lower(), fields[3]
+        if size == 0:
+            continue
+        module = module_of(location, root, workspace)
+        if RAM_START <= addr < RAM_END and kind in "bdt":
+            ram[module] += size
+            if "stack" in name:
+                stacks.append((size, name, module))
+        elif addr < FLASH_END and kind in "trd":
+            flash[module] += size
+    stacks.sort(reverse=True)
+    return ram, flash, stacks
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--elf", required=True, help="zephyr.elf of the build")
+    parser.add_argument("--config", help="zephyr/.config of the build, for the default RAM and flash sizes")
+    parser.add_argument("--budget", help="budget file, without one the report is only printed")
+    parser.add_argument("--root", default=os.path.join(os.path.dirname(__file__), "..", "omi"),
+                        help="app directory the module names are relative to")
+    parser.add_argument("--zephyr-base", default=os.environ.get("ZEPHYR_BASE"),
+                        help="Zephyr tree, its parent names the SDK modules")
+    parser.add_argument("--nm", default="arm-zephyr-eabi-nm", help="nm of the toolchain")
+    parser.add_argument("--objdump", default="arm-zephyr-eabi-objdump", help="objdump of the toolchain")
+    parser.add_argument("--top", type=int, default=25, help="modules listed, the rest are summed up")
+    args = parser.parse_args()
+
+    root = os.path.realpath(args.root)
+    workspace = os.path.dirname(os.path.realpath(args.zephyr_base)) if args.zephyr_base else None
+    config = read_config(args.config)
+    budgets = read_budgets(args.budget) if args.budget else {}
+
+    ram_total, flash_total = section_totals(args.objdump, args.elf)
+    ram, flash, stacks = symbol_usage(args.nm, args.elf, root, workspace)
+
+    ram_size = int(config.get("CONFIG_SRAM_SIZE", 0)) * 1024
+    flash_size = int(config.get("CONFIG_FLASH_LOAD_SIZE", "0"), 0) or int(config.get("CONFIG_FLASH_SIZE", 0)) * 1024
+    budgets.setdefault("ram", ram_size)
+    budgets.setdefault("flash", flash_size)
+
+    print(f"{'Module':<48} {'RAM':>8} {'Flash':>8}")
+    modules = sorted(set(ram) | set(flash), key=lambda m: (ram[m], flash[m]), reverse=True)
+    for module in modules[: args.top]:
+        print(f"{module:<48} {ram[module]:>8} {flash[module]:>8}")
+    rest = modules[args.top:]
+    if rest:
+        label = f"({len(rest)} more)"
+        print(f"{label:<48} {sum(ram[m] for m in rest):>8} {sum(flash[m] for m in rest):>8}")
+    print(f"{'Total (sections)':<48} {ram_total:>8} {flash_total:>8}")
+
+    print()
+    print(f"{'Stack':<40} {'Bytes':>8}  Module")
+    for size, name, module in stacks:
+        print(f"{name:<40} {size:>8}  {module}")
+    stack_total = sum(size for size, _, _ in stacks)
+    print(f"{'Total':<40} {stack_total:>8}")
+
+    used = {"ram": ram_total, "flash": flash_total, "stacks": stack_total}
+    over = []
+    print()
+    for name, budget in budgets.items():
+        if budget == 0:
+            continue
+        value = used[name] if name in used else ram.get(name)
+        if value is None:
+            print(f"warning: budget for {name}, which uses no RAM", file=sys.stderr)
+            continue
+        print(f"{name:<48} {value:>8} of {budget:>8} ({100.0 * value / budget:5.1f}%)")
+        if value > budget:
+            over.append(f"{name} uses {value} bytes, {value - budget} over its budget of {budget}")
+    for line in over:
+        print(f"error: {line}", file=sys.stderr)
+    return 1 if over else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
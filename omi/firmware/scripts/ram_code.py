@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""Pick the functions to run from RAM out of an on-target profile.
+
+The profile is a list of program counter samples, one hex address per line, optionally followed by a
+hit count. Any debug probe that can sample the PC works, e.g. J-Link / pyOCD DWT PC sampling, or a gdb
+loop of "monitor halt; p/x $pc; continue" while audio is streaming.
+
+Functions are ranked by samples and taken until they cover --coverage of the samples that fall in
+relocatable code, or until the next one would exceed --budget bytes of RAM. The result is written in
+the format omi/CMakeLists.txt reads for CONFIG_OMI_ENABLE_RAM_CODE:
+
+    python3 scripts/ram_code.py --elf build/omi/zephyr/zephyr.elf --samples pcs.txt > omi/ram_code.txt
+"""
+
+import argparse
+import bisect
+import os
+import subprocess
+import sys
+from collections import Counter
+
+# Code below this address is in the nRF52840 internal flash
+FLASH_END = 0x00100000
+
+
+def load_functions(nm, elf, root):
+    out = subprocess.run([nm, "--defined-only", "-S", "-l", elf], check=True, capture_output=True, text=True).stdout
+    functions = []
+    for line in out.splitlines():
+        location = None
+        if "\t" in line:
+            line, location = line.split("\t", 1)
+        fields = line.split()
+        if len(fields) != 4 or fields[2] not in ("t", "T"):
+            continue
+        addr = int(fields[0], 16) & ~1  # Thumb bit
+        size = int(fields[1], 16)
+        if addr >= FLASH_END or size == 0:
+            continue
+        source = None
+        if location:
+            path = os.path.realpath(location.rsplit(":", 1)[0])
+            if path.startswith(root + os.sep):
+                source = os.path.relpath(path, root)
+        functions.append((addr, size, fields[3], source))
+    functions.sort()
+    return functions
+
+
+def load_samples(path):
+    samples = Counter()
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if not fields or fields[0].startswith("#"):
+                continue
+            samples[int(fields[0], 16) & ~1] += int(fields[1]) if len(fields) > 1 else 1
+    return samples
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--elf", required=True, help="zephyr.elf of the profiled build")
+    parser.add_argument("--samples", required=True, help="PC samples, one hex address [count] per line")
+    parser.add_argument("--root", default=os.path.join(os.path.dirname(__file__), "..", "omi"),
+                        help="app directory the source paths are relative to")
+    parser.add_argument("--nm", default="arm-zephyr-eabi-nm", help="nm of the toolchain")
+    parser.add_argument("--budget", type=int, default=16384, help="RAM to spend on code, bytes")
+    parser.add_argument("--coverage", type=float, default=0.9, help="share of relocatable samples to cover")
+    args = parser.parse_args()
+
+    root = os.path.realpath(args.root)
+    functions = load_functions(args.nm, args.elf, root)
+    starts = [f[0] for f in functions]
+
+    hits = Counter()
+    total = 0
+    for pc, count in load_samples(args.samples).items():
+        total += count
+        i = bisect.bisect_right(starts, pc) - 1
+        if i >= 0 and pc < functions[i][0] + functions[i][1]:
+            hits[i] += count
+    if not total:
+        sys.exit("no samples")
+
+    # Kernel, driver and libc code isn't ours to move
+    movable = sum(count for i, count in hits.items() if functions[i][3])
+    if not movable:
+        sys.exit("no samples in app or Opus code")
+
+    print(f"# Generated by scripts/ram_code.py from {total} PC samples of {os.path.basename(args.elf)}")
+    picked = used = 0
+    for i, count in hits.most_common():
+        addr, size, name, source = functions[i]
+        if not source:
+            continue
+        if picked >= args.coverage * movable or used + size > args.budget:
+            break
+        print(f"# {100.0 * count / total:5.1f}% of samples, {size} bytes")
+        # Assembly has no per-function sections, move the whole file
+        print(source if source.endswith((".s", ".S")) else f"{source} {name}")
+        picked += count
+        used += size
+    print(f"# {100.0 * picked / total:.1f}% of samples in {used} bytes of RAM")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,285 @@
+#ifndef OMI_SD_AUDIO_H
+#define OMI_SD_AUDIO_H
+
+/* Reader for the offline audio written to the SD card, for host tools (C99 or C++).
+ *
+ * Header only and allocation free: the reader walks a buffer in place, typically a memory-mapped
+ * segment aNN.txt or a chunk of one read from a stream, and every frame points into that buffer.
+ *
+ * The format is the one of lib/core/storage_record.c and sd_card.h in the firmware: a segment is
+ * a run of 440-byte blocks, and a block a run of records. An audio record is [length][frame], any
+ * other record [tag][length][payload] with a tag above every frame length. The head of the record
+ * that did not fit ends the block; a record that fills it up to the last byte leaves none. With
+ * CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS every frame starts with its capture time (little-endian,
+ * low 32 bits of the UTC time in ms), then the Opus packet.
+ *
+ * Each segment has a sparse time index iNN.txt of { uint32 utc_s, uint32 offset } entries, the
+ * offset of a block within the segment. With the index, frames carry the time of the last
+ * indexed block at or before them.
+ *
+ *     struct omi_sd_reader reader;
+ *     struct omi_sd_frame frame;
+ *     omi_sd_reader_init(&reader, data, size, 0, OMI_SD_FRAME_TIMESTAMPS);
+ *     while (omi_sd_next(&reader, &frame) > 0) {
+ *         if (frame.tag == OMI_SD_TAG_AUDIO) decode(frame.data, frame.size);
+ *     }
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OMI_SD_BLOCK_SIZE 440
+#define OMI_SD_TAG_AUDIO 0x00
+#define OMI_SD_TAG_IMU 0xFF        // payload: accel batch header, then raw samples
+#define OMI_SD_TAG_IMU_DELTA 0xFE  // same, after the first sample int8 deltas per axis (storage format 2)
+#define OMI_SD_TAG_TRACE 0xFD      // flight recorder events, see lib/core/flight_rec.h
+#define OMI_SD_TAG_IMU_VARINT 0xFC // same as IMU, after the first sample varint deltas per axis (format 3)
+#define OMI_SD_FRAME_MAX 160       // CODEC_OUTPUT_MAX_BYTES, longest Opus packet of an audio record
+#define OMI_SD_TIMESTAMP_SIZE 4
+#define OMI_SD_IMU_HEADER_SIZE 12 // struct accel_batch_header, the sample count in its last byte
+#define OMI_SD_IMU_AXES 6         // gyro X, Y, Z then accel X, Y, Z
+
+// Reader flags
+#define OMI_SD_FRAME_TIMESTAMPS 0x01 // audio records start with the capture time
+
+struct omi_sd_index_entry {
+    uint32_t utc_s;
+    uint32_t offset; // within the segment, always the start of a block
+};
+
+struct omi_sd_frame {
+    uint64_t offset;     // of the record head, from the start of the buffer plus the base offset
+    uint8_t tag;         // OMI_SD_TAG_*
+    uint16_t size;       // of data
+    const uint8_t *data; // Opus packet for audio (after the capture time), the payload otherwise
+    uint32_t capture_ms; // with OMI_SD_FRAME_TIMESTAMPS, 0 if the clock was unsynced
+    uint32_t utc_s;      // from the index, 0 before the first entry or without one
+};
+
+struct omi_sd_reader {
+    const uint8_t *data;
+    size_t size;
+    uint64_t base_offset;
+    unsigned flags;
+    size_t block; // offset of the current block in data
+    uint16_t pos; // within the current block
+    const struct omi_sd_index_entry *index;
+    size_t index_count;
+    size_t index_next;
+    uint32_t utc_s;
+    // Counted while reading
+    uint64_t frames;
+    uint64_t bad_blocks; // skipped, e.g. erased or zeroed sectors after an unclean reset
+    size_t trailing;     // bytes after the last whole block, not read
+};
+
+/**
+ * Start reading data, which holds whole blocks from base_offset on (a multiple of the block size).
+ */
+static inline void omi_sd_reader_init(struct omi_sd_reader *reader, const uint8_t *data, size_t size,
+                                      uint64_t base_offset, unsigned flags)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->data = data;
+    reader->size = size - size % OMI_SD_BLOCK_SIZE;
+    reader->trailing = size % OMI_SD_BLOCK_SIZE;
+    reader->base_offset = base_offset;
+    reader->flags = flags;
+}
+
+/**
+ * Attach the segment's index, entries sorted by offset as the firmware writes them.
+ */
+static inline void omi_sd_reader_set_index(struct omi_sd_reader *reader, const struct omi_sd_index_entry *index,
+                                           size_t count)
+{
+    reader->index = index;
+    reader->index_count = count;
+    reader->index_next = 0;
+}
+
+/**
+ * Parse the record at *pos of a block, as storage_record_next() in the firmware. An audio record
+ * longer than the firmware ever writes, OMI_SD_FRAME_MAX plus the capture time with
+ * OMI_SD_FRAME_TIMESTAMPS in flags, makes the block malformed.
+ *
+ * @return 1 for a record (pos advanced past it), 0 at the end of the block, -1 if it is malformed
+ */
+static inline int omi_sd_block_next(const uint8_t *block, uint16_t *pos, unsigned flags, uint8_t *tag,
+                                    uint8_t *size)
+{
+    if (*pos >= OMI_SD_BLOCK_SIZE - 1) {
+        return 0;
+    }
+    uint16_t head = 1;
+    uint8_t len = block[*pos];
+    *tag = OMI_SD_TAG_AUDIO;
+    if (len >= OMI_SD_TAG_IMU_VARINT) {
+        head = 2;
+        *tag = len;
+        len = block[*pos + 1];
+    } else if (len > OMI_SD_FRAME_MAX + ((flags & OMI_SD_FRAME_TIMESTAMPS) ? OMI_SD_TIMESTAMP_SIZE : 0)) {
+        return -1;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    if (*pos + head + len > OMI_SD_BLOCK_SIZE - 1) {
+        // The terminator, a block that starts with one was never filled
+        return *pos > 0 ? 0 : -1;
+    }
+    *size = len;
+    *pos += head + len;
+    return 1;
+}
+
+// A block is only read if it parses to the end, so a damaged one yields no frames at all
+static inline int omi_sd_block_is_valid(const uint8_t *block, unsigned flags)
+{
+    uint16_t pos = 0;
+    uint8_t tag, size;
+    int ret;
+    while ((ret = omi_sd_block_next(block, &pos, flags, &tag, &size)) > 0) {
+    }
+    return ret == 0;
+}
+
+/**
+ * Get the next record.
+ *
+ * @return 1 for a record, 0 at the end of the buffer
+ */
+static inline int omi_sd_next(struct omi_sd_reader *reader, struct omi_sd_frame *frame)
+{
+    while (reader->block < reader->size) {
+        const uint8_t *block = reader->data + reader->block;
+        if (reader->pos == 0) {
+            uint64_t block_offset = reader->base_offset + reader->block;
+            while (reader->index_next < reader->index_count &&
+                   reader->index[reader->index_next].offset <= block_offset) {
+                reader->utc_s = reader->index[reader->index_next++].utc_s;
+            }
+            if (!omi_sd_block_is_valid(block, reader->flags)) {
+                reader->bad_blocks++;
+                reader->block += OMI_SD_BLOCK_SIZE;
+                continue;
+            }
+        }
+
+        uint16_t start = reader->pos;
+        uint8_t tag, size;
+        if (omi_sd_block_next(block, &reader->pos, reader->flags, &tag, &size) <= 0) {
+            reader->block += OMI_SD_BLOCK_SIZE;
+            reader->pos = 0;
+            continue;
+        }
+
+        const uint8_t *data = block + reader->pos - size;
+        frame->offset = reader->base_offset + reader->block + start;
+        frame->tag = tag;
+        frame->data = data;
+        frame->size = size;
+        frame->capture_ms = 0;
+        frame->utc_s = reader->utc_s;
+        if (tag == OMI_SD_TAG_AUDIO && (reader->flags & OMI_SD_FRAME_TIMESTAMPS) && size >= OMI_SD_TIMESTAMP_SIZE) {
+            frame->capture_ms = (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 |
+                                (uint32_t) data[3] << 24;
+            frame->data = data + OMI_SD_TIMESTAMP_SIZE;
+            frame->size = size - OMI_SD_TIMESTAMP_SIZE;
+        }
+        reader->frames++;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Duration of an Opus packet from its TOC byte (RFC 6716, 3.1). Live audio is stored as 20 ms
+ * packets; from storage format 4 the offline profile can write 40 or 60 ms ones, so decoders
+ * should size their output by this rather than assume a fixed frame length.
+ *
+ * @return duration in microseconds, 0 if the packet is malformed
+ */
+static inline uint32_t omi_sd_opus_duration_us(const uint8_t *packet, uint16_t size)
+{
+    static const uint32_t silk_us[4] = {10000, 20000, 40000, 60000};
+    static const uint32_t celt_us[4] = {2500, 5000, 10000, 20000};
+    if (size < 1) {
+        return 0;
+    }
+    uint8_t config = packet[0] >> 3;
+    uint32_t frame_us = config < 12 ? silk_us[config & 3] : config < 16 ? 10000u << (config & 1) : celt_us[config & 3];
+    switch (packet[0] & 3) {
+    case 0:
+        return frame_us;
+    case 1:
+    case 2:
+        return 2 * frame_us;
+    default:
+        return size < 2 ? 0 : (packet[1] & 0x3F) * frame_us;
+    }
+}
+
+/**
+ * Decode the samples of an OMI_SD_TAG_IMU, OMI_SD_TAG_IMU_DELTA or OMI_SD_TAG_IMU_VARINT record
+ * into raw counts. After the first sample, delta records hold each axis as its int8 difference to
+ * the previous sample; varint records as the zigzag varint of the int16 difference, as struct
+ * accel_batch_header in lib/core/accel.h.
+ *
+ * @return samples decoded, at most max, or -1 if the record is malformed
+ */
+static inline int omi_sd_imu_decode(const struct omi_sd_frame *frame, int16_t (*samples)[OMI_SD_IMU_AXES], int max)
+{
+    if ((frame->tag != OMI_SD_TAG_IMU && frame->tag != OMI_SD_TAG_IMU_DELTA && frame->tag != OMI_SD_TAG_IMU_VARINT) ||
+        frame->size < OMI_SD_IMU_HEADER_SIZE) {
+        return -1;
+    }
+    int count = frame->data[OMI_SD_IMU_HEADER_SIZE - 1];
+    const uint8_t *in = frame->data + OMI_SD_IMU_HEADER_SIZE;
+    const uint8_t *end = frame->data + frame->size;
+    int n;
+    for (n = 0; n < count && n < max; n++) {
+        for (int axis = 0; axis < OMI_SD_IMU_AXES; axis++) {
+            if (frame->tag == OMI_SD_TAG_IMU || n == 0) {
+                if (end - in < 2) {
+                    return -1;
+                }
+                samples[n][axis] = (int16_t) (in[0] | in[1] << 8);
+                in += 2;
+                continue;
+            }
+            if (frame->tag == OMI_SD_TAG_IMU_DELTA) {
+                if (in == end) {
+                    return -1;
+                }
+                samples[n][axis] = (int16_t) (samples[n - 1][axis] + (int8_t) *in++);
+                continue;
+            }
+            uint32_t zigzag = 0;
+            for (int shift = 0;; shift += 7) {
+                if (in == end || shift > 14) {
+                    return -1;
+                }
+                uint8_t byte = *in++;
+                zigzag |= (uint32_t) (byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            int16_t delta = (int16_t) ((zigzag >> 1) ^ (0u - (zigzag & 1)));
+            samples[n][axis] = (int16_t) (samples[n - 1][axis] + delta);
+        }
+    }
+    return n;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OMI_SD_AUDIO_H
@@ -0,0 +1,184 @@
+/* List or extract the Opus frames of an offline audio segment pulled from a card.
+ *
+ *     cc -O2 -o sd_audio_dump scripts/sd_audio/sd_audio_dump.c
+ *     sd_audio_dump [-t] [-i iNN.txt] [-o frames.bin] [-q] aNN.txt|-
+ *
+ *     -t  frames start with a capture time (CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS)
+ *     -i  the segment's time index, for the utc_s column
+ *     -o  write the audio frames as [uint16 le length][Opus packet] instead of listing them
+ *     -q  only print the summary
+ *
+ * Files are memory mapped, "-" reads a stream through a fixed buffer. The summary goes to stderr.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "omi_sd_audio.h"
+
+#define STREAM_BLOCKS 1024
+#define INDEX_MAX_ENTRIES 65536 // a full segment holds ~15 min, indexed every 10 s
+
+static struct omi_sd_index_entry index_entries[INDEX_MAX_ENTRIES];
+static size_t index_count = 0;
+static uint8_t stream_buf[STREAM_BLOCKS * OMI_SD_BLOCK_SIZE];
+
+struct totals {
+    uint64_t audio;
+    uint64_t records;
+    uint64_t opus_bytes;
+    uint64_t audio_us;
+    uint64_t bad_blocks;
+    uint64_t bytes;
+};
+
+static int load_index(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t raw[8];
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (index_count < INDEX_MAX_ENTRIES && fread(raw, sizeof(raw), 1, f) == 1) {
+        index_entries[index_count].utc_s = raw[0] | raw[1] << 8 | raw[2] << 16 | (uint32_t) raw[3] << 24;
+        index_entries[index_count].offset = raw[4] | raw[5] << 8 | raw[6] << 16 | (uint32_t) raw[7] << 24;
+        index_count++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static void read_frames(struct omi_sd_reader *reader, FILE *out, int quiet, struct totals *totals)
+{
+    struct omi_sd_frame frame;
+
+    while (omi_sd_next(reader, &frame) > 0) {
+        if (frame.tag != OMI_SD_TAG_AUDIO) {
+            totals->records++;
+            continue;
+        }
+        totals->audio++;
+        totals->opus_bytes += frame.size;
+        totals->audio_us += omi_sd_opus_duration_us(frame.data, frame.size);
+        if (out) {
+            uint8_t len[2] = {(uint8_t) frame.size, (uint8_t) (frame.size >> 8)};
+            fwrite(len, sizeof(len), 1, out);
+            fwrite(frame.data, frame.size, 1, out);
+        } else if (!quiet) {
+            printf("%llu %u %u %u\n", (unsigned long long) frame.offset, frame.size, frame.capture_ms, frame.utc_s);
+        }
+    }
+    totals->bad_blocks += reader->bad_blocks;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned flags = 0;
+    const char *out_path = NULL;
+    int quiet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ti:o:q")) != -1) {
+        switch (opt) {
+        case 't':
+            flags |= OMI_SD_FRAME_TIMESTAMPS;
+            break;
+        case 'i':
+            if (load_index(optarg)) {
+                return 1;
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-i iNN.txt] [-o frames.bin] [-q] aNN.txt|-\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t] [-i iNN.txt] [-o frames.bin] [-q] aNN.txt|-\n", argv[0]);
+        return 2;
+    }
+
+    FILE *out = NULL;
+    if (out_path && !(out = fopen(out_path, "wb"))) {
+        perror(out_path);
+        return 1;
+    }
+
+    struct totals totals = {0};
+    struct omi_sd_reader reader;
+    struct timespec start, end;
+    size_t trailing = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (strcmp(argv[optind], "-") == 0) {
+        // Whole blocks per chunk, the reader never needs to look across one
+        size_t used = 0, n;
+        while ((n = fread(stream_buf + used, 1, sizeof(stream_buf) - used, stdin)) > 0) {
+            used += n;
+            if (used < sizeof(stream_buf)) {
+                continue;
+            }
+            omi_sd_reader_init(&reader, stream_buf, used, totals.bytes, flags);
+            omi_sd_reader_set_index(&reader, index_entries, index_count);
+            read_frames(&reader, out, quiet, &totals);
+            totals.bytes += used;
+            used = 0;
+        }
+        omi_sd_reader_init(&reader, stream_buf, used, totals.bytes, flags);
+        omi_sd_reader_set_index(&reader, index_entries, index_count);
+        read_frames(&reader, out, quiet, &totals);
+        totals.bytes += used;
+        trailing = reader.trailing;
+    } else {
+        int fd = open(argv[optind], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+        if (st.st_size > 0) {
+            const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                perror(argv[optind]);
+                return 1;
+            }
+            posix_madvise((void *) map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            omi_sd_reader_init(&reader, map, st.st_size, 0, flags);
+            omi_sd_reader_set_index(&reader, index_entries, index_count);
+            read_frames(&reader, out, quiet, &totals);
+            totals.bytes = st.st_size;
+            trailing = reader.trailing;
+            munmap((void *) map, st.st_size);
+        }
+        close(fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%llu audio frames (%llu Opus bytes, %.1f s), %llu other records, %llu bad blocks, "
+            "%zu trailing bytes\n",
+            (unsigned long long) totals.audio, (unsigned long long) totals.opus_bytes, totals.audio_us / 1e6,
+            (unsigned long long) totals.records, (unsigned long long) totals.bad_blocks, trailing);
+    fprintf(stderr, "%llu bytes in %.3f s, %.0f MB/s\n", (unsigned long long) totals.bytes, seconds,
+            seconds > 0 ? totals.bytes / seconds / 1e6 : 0);
+    if (out && fclose(out)) {
+        perror(out_path);
+        return 1;
+    }
+    return 0;
+}
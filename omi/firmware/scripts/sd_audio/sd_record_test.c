@@ -0,0 +1,250 @@
+/* Round-trip and fuzz test of the offline storage record format, on the host.
+ *
+ *     make -C scripts/sd_audio test
+ *     sd_record_test [records] [seed]
+ *
+ * Builds the firmware's own lib/core/storage_record.c and lib/pipeline/pipe_record.c, with the
+ * few Zephyr headers they need from shim/. Two checks:
+ *
+ *  - round trip: random record sequences go through storage_packer_append(), biased towards the
+ *    exact-fit and overflow cases, and every full block is parsed back by the firmware parser
+ *    (storage_record_next()) and by the reader of omi_sd_audio.h. Both must return each record's
+ *    tag, length and payload. Fresh blocks are filled with random bytes, so stale data past a
+ *    terminator is never taken for records.
+ *  - fuzz: random and mutated blocks go through both parsers, which must agree on where each
+ *    record starts and ends and on whether the block is malformed.
+ *
+ * The Makefile runs it with and without CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS, whose audio records
+ * are 4 bytes longer. Pack and parse throughput go to stdout; the exit status is 1 on a mismatch.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "omi_sd_audio.h"
+#include "storage_record.h"
+
+#define DEFAULT_RECORDS 2000000
+#define FUZZ_BLOCKS 200000
+#define PENDING (MAX_WRITE_SIZE / 2) // records of one block at most
+
+#ifdef CONFIG_OMI_ENABLE_FRAME_TIMESTAMPS
+#define READER_FLAGS OMI_SD_FRAME_TIMESTAMPS
+#else
+#define READER_FLAGS 0
+#endif
+
+_Static_assert(MAX_WRITE_SIZE == OMI_SD_BLOCK_SIZE, "the host reader must use the firmware's block size");
+_Static_assert(STORAGE_RECORD_IMU_VARINT == OMI_SD_TAG_IMU_VARINT, "the host reader must know every tag");
+
+struct expect {
+    uint8_t tag;
+    uint8_t size;
+};
+
+static const uint8_t tags[] = {STORAGE_RECORD_IMU, STORAGE_RECORD_IMU_DELTA, STORAGE_RECORD_TRACE,
+                               STORAGE_RECORD_IMU_VARINT};
+
+static uint32_t rng;
+static uint8_t block[MAX_WRITE_SIZE];
+static uint8_t payload[UINT8_MAX];
+static struct expect pending[PENDING];
+static uint64_t appended;
+static uint64_t parsed;
+static uint64_t blocks;
+static uint64_t failures;
+static double parse_s;
+static double fill_s;
+
+// xorshift32, never seeded with 0
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static uint8_t record_byte(uint64_t record, uint16_t i)
+{
+    return (uint8_t) (record * 131 + i * 7 + (record >> 8));
+}
+
+static double now_s(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void fill_random(uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t) next_random();
+    }
+}
+
+static void fail(const char *what, uint16_t pos)
+{
+    if (failures++ < 10) {
+        printf("FAIL: block %llu at %u: %s\n", (unsigned long long) blocks, pos, what);
+    }
+}
+
+static uint8_t *test_alloc(void)
+{
+    double start = now_s();
+    fill_random(block, sizeof(block));
+    fill_s += now_s() - start;
+    return block;
+}
+
+// Both parsers over one full block, against the records appended into it
+static void test_submit(uint8_t *full)
+{
+    double start = now_s();
+    uint16_t pos = 0;
+    uint16_t host_pos = 0;
+    struct pipe_record record;
+    uint8_t tag, size;
+    int ret;
+
+    blocks++;
+    if (!omi_sd_block_is_valid(full, READER_FLAGS)) {
+        fail("the host reader takes the block for malformed", 0);
+    }
+    while ((ret = storage_record_next(full, &pos, &record)) > 0) {
+        const struct expect *expect = &pending[parsed % PENDING];
+        int host_ret = omi_sd_block_next(full, &host_pos, READER_FLAGS, &tag, &size);
+        if (parsed >= appended || record.tag != expect->tag || record.size != expect->size) {
+            fail("record differs from the appended one", pos - record.size);
+        } else if (host_ret != 1 || host_pos != pos || tag != record.tag || size != record.size) {
+            fail("the host reader parses the record differently", pos - record.size);
+        } else {
+            for (uint16_t i = 0; i < record.size; i++) {
+                if (record.data[i] != record_byte(parsed, i)) {
+                    fail("payload differs", pos - record.size + i);
+                    break;
+                }
+            }
+        }
+        parsed++;
+    }
+    if (ret < 0) {
+        fail("the firmware parser takes the block for malformed", pos);
+    } else if (omi_sd_block_next(full, &host_pos, READER_FLAGS, &tag, &size) != 0) {
+        fail("the host reader doesn't end the block with the firmware parser", host_pos);
+    }
+    parse_s += now_s() - start;
+}
+
+static void round_trip(uint64_t records)
+{
+    struct pipe_record_packer packer = {.format = &storage_record_format, .alloc = test_alloc, .submit = test_submit};
+    uint16_t end = MAX_WRITE_SIZE - 1;
+    uint8_t max_frame = storage_record_format.max_frame;
+    uint64_t bytes = 0;
+    double pack_s = 0;
+
+    for (uint64_t n = 0; n < records && failures == 0; n++) {
+        uint32_t r = next_random();
+        uint16_t space = packer.block ? end - packer.offset : end;
+        struct expect expect = {0, 0};
+        if ((r & 0xF) == 0) {
+            expect.tag = tags[(r >> 4) % sizeof(tags)];
+            expect.size = 1 + (r >> 8) % UINT8_MAX;
+        } else if ((r & 0xF) == 1 && space > 1 && space - 1 <= max_frame) {
+            // Fill the block up to the last byte
+            expect.size = space - 1;
+        } else if ((r & 0xF) == 2 && space > 1 && space <= max_frame) {
+            // One byte too long, the head becomes the terminator
+            expect.size = space;
+        } else {
+            expect.size = 1 + (r >> 8) % max_frame;
+        }
+        uint8_t head[2] = {expect.tag, expect.size};
+        for (uint16_t i = 0; i < expect.size; i++) {
+            payload[i] = record_byte(appended, i);
+        }
+        pending[appended % PENDING] = expect;
+        appended++;
+
+        double start = now_s();
+        if (!storage_packer_append(&packer, expect.tag ? head : head + 1, expect.tag ? 2 : 1, payload, expect.size)) {
+            fail("no block allocated", 0);
+        }
+        pack_s += now_s() - start;
+        bytes += (expect.tag ? 2 : 1) + expect.size;
+    }
+
+    // Filling the fresh blocks and parsing them run from within the appends
+    pack_s -= parse_s + fill_s;
+    printf("Round trip: %llu records in %llu blocks, %llu parsed back, %llu failures\n",
+           (unsigned long long) appended, (unsigned long long) blocks, (unsigned long long) parsed,
+           (unsigned long long) failures);
+    printf("  pack %.1f MB/s, parse %.1f MB/s (both parsers) over %.1f MB\n",
+           bytes / 1e6 / (pack_s > 0 ? pack_s : 1e-9), bytes / 1e6 / (parse_s > 0 ? parse_s : 1e-9), bytes / 1e6);
+}
+
+// Random blocks rarely parse, so most are valid blocks with a few bytes changed
+static void fuzz(uint32_t count)
+{
+    uint8_t data[MAX_WRITE_SIZE];
+    uint64_t valid = 0;
+    uint64_t start_failures = failures;
+
+    for (uint32_t n = 0; n < count; n++) {
+        uint16_t pos = 0;
+        uint16_t host_pos = 0;
+        uint8_t tag, size;
+        struct pipe_record record;
+
+        fill_random(data, sizeof(data));
+        if (n % 4 != 0) {
+            // A plausible block: records of random lengths up to the terminator, then mutations
+            uint16_t at = 0;
+            while (at < MAX_WRITE_SIZE - 1) {
+                uint32_t r = next_random();
+                uint16_t len = 1 + r % (storage_record_format.max_frame + 8);
+                data[at] = (r >> 16) % 8 == 0 ? tags[(r >> 8) % sizeof(tags)] : (uint8_t) len;
+                at += 1 + len;
+            }
+            for (uint32_t m = next_random() % 4; m > 0; m--) {
+                data[next_random() % MAX_WRITE_SIZE] = (uint8_t) next_random();
+            }
+        }
+
+        int ret, host_ret;
+        do {
+            ret = storage_record_next(data, &pos, &record);
+            host_ret = omi_sd_block_next(data, &host_pos, READER_FLAGS, &tag, &size);
+            if ((ret > 0) != (host_ret > 0) || (ret < 0) != (host_ret < 0) ||
+                (ret > 0 && (pos != host_pos || tag != record.tag || size != record.size))) {
+                blocks = n;
+                fail("the parsers disagree", pos);
+                break;
+            }
+        } while (ret > 0);
+        valid += ret == 0;
+    }
+    printf("Fuzz: %u blocks, %llu valid, %llu failures\n", count, (unsigned long long) valid,
+           (unsigned long long) (failures - start_failures));
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t records = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_RECORDS;
+    uint32_t seed = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : 1;
+
+    printf("Storage records: %u-byte blocks, audio up to %u bytes, seed %u\n", MAX_WRITE_SIZE,
+           storage_record_format.max_frame, seed);
+    rng = seed ? seed : 1;
+    round_trip(records);
+    fuzz(FUZZ_BLOCKS);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
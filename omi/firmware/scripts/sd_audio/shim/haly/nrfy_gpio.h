@@ -0,0 +1 @@
+/* Host stand-in for the nRF GPIO HAL that config.h includes; the host tests use none of it. */
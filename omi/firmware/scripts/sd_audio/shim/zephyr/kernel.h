@@ -0,0 +1,9 @@
+/* Host stand-in for the Zephyr kernel header, only the types the storage headers declare with. */
+#ifndef SHIM_ZEPHYR_KERNEL_H
+#define SHIM_ZEPHYR_KERNEL_H
+
+struct k_sem {
+    unsigned int count;
+};
+
+#endif // SHIM_ZEPHYR_KERNEL_H
@@ -0,0 +1,7 @@
+/* Host stand-in for zephyr/sys/util.h, as much as storage_record.c uses. */
+#ifndef SHIM_ZEPHYR_SYS_UTIL_H
+#define SHIM_ZEPHYR_SYS_UTIL_H
+
+#define BUILD_ASSERT(expr, msg) _Static_assert(expr, msg)
+
+#endif // SHIM_ZEPHYR_SYS_UTIL_H
@@ -0,0 +1,18 @@
+/**
+ * 音频基准测试的主机入口 - 在Linux上用系统libopus运行同一个基准测试
+ *
+ * 结果和PASS/FAIL打印到标准输出,失败时返回非零值,可以直接作为ctest测试运行
+ */
+#include <Arduino.h>
+
+#include "audio_bench.h"
+#include "opus_encoder.h"
+
+int main()
+{
+    if (!opus_encoder_init()) {
+        Serial.println("Audio bench: encoder init failed");
+        return 1;
+    }
+    return audio_bench_run() ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/**
+ * 差分补丁的主机测试 - 用桩替代Update和正在运行的分区,检查delta_patch.cpp能否用delta_patch.py做的补丁重建新固件
+ *
+ *     delta_patch_test images <目录>  写入测试用的old.bin和new.bin
+ *     delta_patch_test check <目录>   用old.bin和update.delta重建new.bin
+ *
+ * ctest在两步之间运行delta_patch.py make。补丁每次喂7字节,让补丁头和操作跨越写入边界。
+ * 结果打印到标准输出,失败时返回1
+ */
+#include <Arduino.h>
+#include <Update.h>
+
+#include <string>
+#include <vector>
+
+#include "delta_patch.h"
+#include "esp_ota_ops.h"
+
+#define IMAGE_SIZE (200 * 1024)
+#define PIECE_SIZE 7
+
+HostUpdate Update;
+static esp_partition_t running = {nullptr, 0};
+static bool runningSet = false;
+static int failures = 0;
+
+/**
+ * check - 条件不成立时记录失败
+ */
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        Serial.printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+bool HostUpdate::begin(size_t newSize)
+{
+    size = newSize;
+    image.clear();
+    return true;
+}
+
+size_t HostUpdate::write(uint8_t *data, size_t len)
+{
+    if (size == 0 || image.size() + len > size) {
+        return 0;
+    }
+    image.insert(image.end(), data, data + len);
+    return len;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (src_offset > partition->size || size > partition->size - src_offset) {
+        return ESP_FAIL;
+    }
+    memcpy(dst, partition->data + src_offset, size);
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+    return runningSet ? &running : nullptr;
+}
+
+/**
+ * read_file - 读取整个文件
+ *
+ * @param {const std::string&} path - 文件路径
+ * @param {std::vector<uint8_t>&} data - 文件内容
+ * @returns {bool} 读取成功返回true
+ */
+static bool read_file(const std::string &path, std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        Serial.printf("Delta patch: can't read %s\n", path.c_str());
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    data.clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    return true;
+}
+
+/**
+ * write_file - 写入整个文件
+ */
+static bool write_file(const std::string &path, const std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    bool ok = f != nullptr && fwrite(data.data(), 1, data.size(), f) == data.size();
+    if (f != nullptr) {
+        ok = fclose(f) == 0 && ok;
+    }
+    if (!ok) {
+        Serial.printf("Delta patch: can't write %s\n", path.c_str());
+    }
+    return ok;
+}
+
+/**
+ * write_images - 生成旧固件, 新固件是它改了一段、插入一段、删掉一段再加长的版本
+ *
+ * @returns {int} 进程返回值
+ */
+static int write_images(const std::string &dir)
+{
+    std::vector<uint8_t> oldImage(IMAGE_SIZE);
+    uint32_t rng = 1;
+    for (uint8_t &b : oldImage) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        b = (uint8_t) rng;
+    }
+
+    std::vector<uint8_t> newImage(oldImage);
+    for (size_t i = 0; i < 300; i++) {
+        newImage[IMAGE_SIZE / 2 + i] ^= 0x5A;
+    }
+    newImage.erase(newImage.end() - 8192, newImage.end() - 7168);
+    std::vector<uint8_t> inserted(4096);
+    for (size_t i = 0; i < inserted.size(); i++) {
+        inserted[i] = (uint8_t) (i * 7);
+    }
+    newImage.insert(newImage.begin() + 10000, inserted.begin(), inserted.end());
+    newImage.insert(newImage.end(), inserted.begin(), inserted.begin() + 2048);
+
+    return write_file(dir + "/old.bin", oldImage) && write_file(dir + "/new.bin", newImage) ? 0 : 1;
+}
+
+/**
+ * apply - 在给定的正在运行的固件上应用补丁
+ *
+ * @param {const std::vector<uint8_t>&} source - 正在运行的固件
+ * @param {const std::vector<uint8_t>&} patch - 补丁
+ * @param {size_t} piece - 每次写入的字节数
+ * @returns {bool} 补丁被接受并且重建的固件CRC正确时返回true
+ */
+static bool apply(const std::vector<uint8_t> &source, const std::vector<uint8_t> &patch, size_t piece)
+{
+    running = {source.data(), (uint32_t) source.size()};
+    runningSet = true;
+    Update.size = 0;
+    Update.image.clear();
+
+    if (!delta_patch_detect(patch.data(), patch.size())) {
+        return false;
+    }
+    delta_patch_begin();
+    for (size_t offset = 0; offset < patch.size(); offset += piece) {
+        if (!delta_patch_write(&patch[offset], min(piece, patch.size() - offset))) {
+            return false;
+        }
+    }
+    return delta_patch_finish();
+}
+
+/**
+ * check_patch - 检查补丁能重建新固件, 被改动过的补丁和不对应的正在运行的固件都会被拒绝
+ *
+ * @returns {int} 进程返回值
+ */
+static int check_patch(const std::string &dir)
+{
+    std::vector<uint8_t> oldImage, newImage, patch;
+    if (!read_file(dir + "/old.bin", oldImage) || !read_file(dir + "/new.bin", newImage) ||
+        !read_file(dir + "/update.delta", patch)) {
+        return 1;
+    }
+    Serial.printf("Delta patch: %zu byte patch for a %zu byte image from %zu bytes\n", patch.size(),
+                  newImage.size(), oldImage.size());
+    check(patch.size() < newImage.size() / 10, "the patch is not much smaller than the image");
+
+    check(apply(oldImage, patch, PIECE_SIZE) && Update.image == newImage, "7-byte pieces don't rebuild the image");
+    check(apply(oldImage, patch, patch.size()) && Update.image == newImage, "one write doesn't rebuild the image");
+
+    std::vector<uint8_t> otherSource(oldImage);
+    otherSource[IMAGE_SIZE / 3] ^= 1;
+    check(!apply(otherSource, patch, PIECE_SIZE) && Update.size == 0,
+          "a patch for other firmware is applied, or Update began before the source check");
+
+    std::vector<uint8_t> truncated(patch.begin(), patch.end() - 1);
+    check(!apply(oldImage, truncated, PIECE_SIZE), "a truncated patch is accepted");
+
+    std::vector<uint8_t> corrupted(patch);
+    corrupted.back() ^= 0x80;
+    check(!apply(oldImage, corrupted, PIECE_SIZE), "a corrupted patch is accepted");
+
+    runningSet = false;
+    delta_patch_begin();
+    check(!delta_patch_write(patch.data(), patch.size()), "a patch is applied without a running partition");
+
+    Serial.printf("Delta patch: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "images") == 0) {
+        return write_images(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "check") == 0) {
+        return check_patch(argv[2]);
+    }
+    Serial.println("usage: delta_patch_test images|check <dir>");
+    return 2;
+}
@@ -0,0 +1,41 @@
+/**
+ * 主机构建的桩函数 - 代替基准测试用到但主机上没有的固件模块
+ *
+ * 主机上没有麦克风,AUDIO_BENCH_SOURCE_MIC为0时基准测试使用合成语音,不会调用麦克风函数
+ */
+#include "metrics.h"
+#include "mic.h"
+
+/**
+ * mic_set_callback - 主机上没有麦克风,忽略回调
+ */
+void mic_set_callback(mic_data_handler callback)
+{
+    (void) callback;
+}
+
+/**
+ * mic_process - 主机上没有麦克风数据
+ *
+ * @returns {size_t} 总是0
+ */
+size_t mic_process()
+{
+    return 0;
+}
+
+/**
+ * metrics_add_encode_us - 主机上不统计编码时间(基准测试自己记录)
+ */
+void metrics_add_encode_us(uint32_t us)
+{
+    (void) us;
+}
+
+/**
+ * metrics_add_pcm_overwrite - 主机上不统计PCM覆盖
+ */
+void metrics_add_pcm_overwrite(uint32_t samples)
+{
+    (void) samples;
+}
@@ -0,0 +1,54 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// The little of the Arduino core the host builds use: Serial output, millis(), min() and the CPU clock.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+// The core's min() takes both arguments of one type, as std::min does
+using std::min;
+
+class HostSerial
+{
+  public:
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, format);
+        int n = vprintf(format, args);
+        va_end(args);
+        return n;
+    }
+    void println(const char *text) { puts(text); }
+    void println() { putchar('\n'); }
+};
+
+inline HostSerial Serial;
+
+static inline uint32_t millis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static inline void delay(uint32_t ms)
+{
+    struct timespec wait = {(time_t) (ms / 1000), (long) (ms % 1000) * 1000000};
+    nanosleep(&wait, nullptr);
+}
+
+// Reported in the results only; the host runs at whatever clock it has
+static inline uint32_t getCpuFrequencyMhz()
+{
+    return 0;
+}
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,24 @@
+#ifndef HOST_UPDATE_H
+#define HOST_UPDATE_H
+
+// The Update calls the OTA modules make, writing into a buffer the host test checks afterwards
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+class HostUpdate
+{
+  public:
+    bool begin(size_t size);
+    size_t write(uint8_t *data, size_t len);
+    const char *errorString() { return "host update full"; }
+
+    std::vector<uint8_t> image; // written so far
+    size_t size = 0;            // from begin(), 0 before
+};
+
+extern HostUpdate Update;
+
+#endif // HOST_UPDATE_H
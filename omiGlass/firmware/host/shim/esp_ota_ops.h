@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_OTA_OPS_H
+#define HOST_ESP_OTA_OPS_H
+
+#include "esp_partition.h"
+
+// The partition the host test runs from, nullptr if it set none
+const esp_partition_t *esp_ota_get_running_partition();
+
+#endif // HOST_ESP_OTA_OPS_H
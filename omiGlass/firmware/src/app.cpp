@@ -9,34 +9,57 @@
  * - 按钮和LED控制
  * - OTA固件升级
  *
+ * 任务划分(ESP32-S3双核):
+ * - 核心1: 音频采集+编码(高优先级), Arduino loop做按钮/LED/OTA/电源/电池(低优先级)
+ * - 核心0: 音频BLE发送、照片拍摄上传和离线音频, 与BLE协议栈同核
+ * - 音频帧经无锁环形缓冲区(pipe_ring)从编码任务交给发送任务
+ *
  * 硬件平台: XIAO ESP32-S3 Sense
  * 固件版本: 2.3.2
  */
 #include "app.h"
 
-// BLE库
-#include <BLE2902.h>
-#include <BLEAdvertisedDevice.h>
-#include <BLEDevice.h>
-#include <BLEScan.h>
-#include <BLEUtils.h>
+// BLE库(Bluedroid或NimBLE,由BLE_NIMBLE选择)
+#include "ble_backend.h"
 
 // 系统库
+#include <atomic>
+
+#include "audio_bench.h"   // 启动时测量音频链路(AUDIO_BENCH)
+#include "audio_store.h"   // 没有客户端接收时的离线音频存储
+#include "ble_tx.h"        // BLE发送调度(音频、控制、照片、离线音频)
+#include "camera_power.h"  // 照片之间的相机温待机和断电
+#include "camera_preview.h" // 通过WiFi的相机实时预览(MJPEG)
 #include "config.h"        // 所有配置参数
+#include "esp_bt.h"        // BLE控制器(调制解调器睡眠)
 #include "esp_camera.h"    // ESP32相机驱动
 #include "esp_sleep.h"     // 电源管理(睡眠模式)
+#include "esp_timer.h"     // 微秒计时(轻度睡眠统计)
+#include "governor.h"      // 按电池电量分档的性能调节
+#include "mem_placement.h" // 缓冲区放置策略(内部DRAM/PSRAM)
+#include "metrics.h"       // 性能遥测计数器
 #include "mic.h"           // 麦克风I2S驱动
 #include "opus_encoder.h"  // Opus音频编码器
 #include "ota.h"           // OTA固件升级
+#include "photo_adapt.h"   // 按链路吞吐量选择照片分辨率和质量
+#include "photo_offload.h" // 离线照片通过WiFi批量上传
+#include "photo_store.h"   // 断开连接时的离线照片存储
+#include "photo_thumb.h"   // 渐进式照片传输的缩略图
+#include "pipeline.h"      // 与吊坠共用的帧格式和环形缓冲区
+#include "power_mgmt.h"    // 按负载调节CPU频率(电源管理锁)
+#include "scene_change.h"  // 跳过场景没有变化的间隔照片
 
 // ============================================================================
 // 全局状态变量
 // ============================================================================
 
-// 电池状态
-float batteryVoltage = 0.0f;           // 当前电池电压(V)
+// 电池状态(启动后只由电池任务写入)
+float batteryVoltage = 0.0f;           // 当前电池电压(V,已平滑)
 int batteryPercentage = 0;             // 当前电池电量百分比(0-100)
-unsigned long lastBatteryCheck = 0;    // 上次电池检查时间戳(ms)
+static float batterySlopeRefVoltage = 0.0f; // 放电斜率的参考电压(V)
+static unsigned long batterySlopeRefAt = 0; // 参考电压的时间戳(ms), 0表示尚未记录
+static float batterySlopeMvPerMin = 0.0f;   // 放电斜率(mV/分钟), 0表示未知或平稳
+static TaskHandle_t batteryTaskHandle = nullptr; // 电池任务(连接时通知它立即读取)
 
 // 设备电源状态
 bool deviceActive = true;                    // 设备是否活跃
@@ -72,11 +95,21 @@ static BLEUUID photoDataUUID(PHOTO_DATA_UUID);      // 照片数据特性
 static BLEUUID photoControlUUID(PHOTO_CONTROL_UUID); // 照片控制特性
 static BLEUUID audioDataUUID(AUDIO_DATA_UUID);      // 音频数据特性
 static BLEUUID audioCodecUUID(AUDIO_CODEC_UUID);    // 音频编解码器ID特性
+static BLEUUID audioStoredUUID(AUDIO_STORED_UUID);  // 离线音频特性
 
 // OTA服务UUID
 static BLEUUID otaServiceUUID(OTA_SERVICE_UUID);    // OTA服务
 static BLEUUID otaControlUUID(OTA_CONTROL_UUID);    // OTA控制特性
 static BLEUUID otaDataUUID(OTA_DATA_UUID);          // OTA数据特性
+static BLEUUID otaBleDataUUID(OTA_BLE_DATA_UUID);    // BLE OTA固件数据特性
+
+// 性能遥测服务UUID
+static BLEUUID metricsServiceUUID(METRICS_SERVICE_UUID); // 遥测服务
+static BLEUUID metricsDataUUID(METRICS_DATA_UUID);       // 遥测数据特性
+
+// 性能调节服务UUID
+static BLEUUID governorServiceUUID(GOVERNOR_SERVICE_UUID); // 调节服务
+static BLEUUID governorTierUUID(GOVERNOR_TIER_UUID);       // 档位特性
 
 // BLE特性指针(用于读写和通知)
 BLECharacteristic *photoDataCharacteristic;      // 照片数据
@@ -84,13 +117,22 @@ BLECharacteristic *photoControlCharacteristic;   // 照片控制
 BLECharacteristic *batteryLevelCharacteristic;   // 电池电量
 BLECharacteristic *audioDataCharacteristic;      // 音频数据
 BLECharacteristic *audioCodecCharacteristic;     // 音频编解码器
+BLECharacteristic *audioStoredCharacteristic;    // 离线音频
 BLECharacteristic *otaControlCharacteristic;     // OTA控制
 BLECharacteristic *otaDataCharacteristic;        // OTA数据
+BLECharacteristic *otaBleDataCharacteristic;     // BLE OTA固件数据
+BLECharacteristic *metricsCharacteristic;        // 性能遥测
+BLECharacteristic *governorCharacteristic = nullptr; // 性能调节档位(GOVERNOR)
+#if !BLE_NIMBLE
+static BLE2902 *metricsCcc = nullptr;            // 遥测订阅状态
+static BLE2902 *governorCcc = nullptr;           // 档位订阅状态
+static BLE2902 *audioStoredCcc = nullptr;        // 离线音频订阅状态
+#endif
 
 // ============================================================================
 // 音频状态
 // ============================================================================
-bool audioEnabled = true;              // 音频功能是否启用
+volatile bool audioEnabled = true;     // 音频功能是否启用
 volatile bool audioSubscribed = false; // 客户端是否订阅了音频通知
 uint16_t audioPacketIndex = 0;         // 音频包序号(用于重组)
 
@@ -98,18 +140,25 @@ uint16_t audioPacketIndex = 0;         // 音频包序号(用于重组)
 // 连接和拍照状态
 // ============================================================================
 bool connected = false;           // BLE是否已连接
+static volatile bool advertisingFast = false;        // 是否在快速广播窗口中
+static volatile unsigned long advertisingSince = 0;  // 快速广播开始的时间
+static SemaphoreHandle_t advertisingLock = nullptr;  // 连接状态和广播的改变(BLE回调和主循环)
 bool isCapturingPhotos = false;   // 是否正在拍照
 int captureInterval = 0;          // 拍照间隔(ms), 0表示单次拍照
 unsigned long lastCaptureTime = 0; // 上次拍照时间戳
 
+/**
+ * photoInterval - 当前生效的拍照间隔: 客户端选择的间隔按性能调节档位拉长
+ */
+static unsigned long photoInterval()
+{
+    return governor_photo_interval(captureInterval);
+}
+
 // ============================================================================
-// 音频传输环形缓冲区
+// 音频传输
 // ============================================================================
-// 用于存储已编码的Opus音频包,等待BLE传输
-#define AUDIO_TX_BUFFER_SIZE (AUDIO_TX_RING_BUFFER_SIZE * (OPUS_OUTPUT_MAX_BYTES + 2))
-static uint8_t audio_tx_buffer[AUDIO_TX_BUFFER_SIZE];        // 环形缓冲区
-static volatile size_t audio_tx_write_pos = 0;               // 写入位置
-static volatile size_t audio_tx_read_pos = 0;                // 读取位置
+static_assert(AUDIO_PACKET_HEADER_SIZE == PIPE_FRAME_HEADER_SIZE, "the app parses the pendant's audio framing");
 static uint8_t audio_packet_buffer[OPUS_OUTPUT_MAX_BYTES + AUDIO_PACKET_HEADER_SIZE]; // 打包缓冲区
 
 // ============================================================================
@@ -117,12 +166,39 @@ static uint8_t audio_packet_buffer[OPUS_OUTPUT_MAX_BYTES + AUDIO_PACKET_HEADER_S
 // ============================================================================
 size_t sent_photo_bytes = 0;    // 已发送的照片字节数
 size_t sent_photo_frames = 0;   // 已发送的照片帧数
-bool photoDataUploading = false; // 照片是否正在上传
+volatile size_t photo_frame_size = BLE_ATT_DEFAULT_MTU - 3; // 照片帧大小(含帧头),随协商的MTU变化
+std::atomic<bool> photoDataUploading(false); // 照片是否正在上传(BLE回调任务和相机任务都会读写)
 
 // ============================================================================
 // 相机帧缓冲区
 // ============================================================================
-camera_fb_t *fb = nullptr;  // 当前相机帧缓冲区指针
+typedef struct {
+    camera_fb_t *frame; // 相机帧缓冲区
+    uint8_t level;      // 拍摄时的照片档位(photo_adapt)
+    uint16_t id;        // 照片ID(断点续传)
+} queued_photo_t;
+
+// 应用请求的断点续传: 照片ID和字节偏移
+typedef struct {
+    uint16_t id;
+    uint32_t offset;
+} photo_resume_t;
+
+camera_fb_t *fb = nullptr;  // 正在上传的相机帧缓冲区指针(上传任务独占),上传离线照片时为nullptr
+static const uint8_t *upload_data = nullptr; // 正在上传的JPEG数据(相机帧或离线存储)
+static size_t upload_len = 0;                // 正在上传的JPEG大小
+static uint8_t fb_level = 0;                 // 正在上传的照片的档位
+static unsigned long fb_upload_start = 0;    // 开始上传的时间,用于统计吞吐量
+static uint8_t *thumb_data = nullptr;        // 正在上传的缩略图(之后上传fb),没有时为nullptr
+static uint16_t upload_id = 0;               // 正在上传的照片ID
+static size_t upload_offset = 0;             // 本次传输开始的字节偏移(续传时非0)
+static uint32_t upload_generation = 0;       // 开始上传时的连接编号(ble_tx_link_generation)
+static bool delivery_pending = false;        // 离线照片的结束标记已排队,等待协议栈确认发出
+static unsigned long delivery_start = 0;     // 开始等待确认的时间
+static uint16_t nextPhotoId = 0;             // 下一张照片的ID(只由拍摄任务写入,启动时随机起点)
+static volatile bool photoIdHeaders = false; // 应用是否开启了照片ID(第一块带ID和偏移)
+static QueueHandle_t resumeQueue = nullptr;  // 应用的续传请求(最新的覆盖旧的)
+static QueueHandle_t photoQueue = nullptr; // 已拍摄、等待上传的帧(最多PHOTO_QUEUE_DEPTH帧)
 image_orientation_t current_photo_orientation = ORIENTATION_0_DEGREES; // 照片旋转角度
 
 // ============================================================================
@@ -133,6 +209,7 @@ image_orientation_t current_photo_orientation = ORIENTATION_0_DEGREES; // 照片
 void handlePhotoControl(int8_t controlValue); // 处理照片控制命令
 void readBatteryLevel();                      // 读取电池电量
 void updateBatteryService();                  // 更新BLE电池服务
+static void startAdvertising(bool fast);      // 按快速或省电间隔开始广播
 
 // 按钮和LED相关
 void IRAM_ATTR buttonISR();      // 按钮中断服务程序
@@ -149,9 +226,20 @@ void enableLightSleep(); // 启用轻度睡眠
 // 音频相关回调和处理
 void onMicData(int16_t *data, size_t samples);       // 麦克风数据回调
 void onOpusEncoded(uint8_t *data, size_t len);       // Opus编码完成回调
-void processAudioTx();                               // 处理音频发送队列
 void broadcastAudioPacket(uint8_t *data, size_t len); // 通过BLE广播音频包
 
+// 任务
+void start_audio_task();             // 创建音频采集任务
+void start_tasks();                  // 创建其余任务
+static void audioCaptureTask(void *); // 音频采集+编码任务(核心1)
+static void photoCaptureTask(void *); // 照片拍摄任务(核心0)
+static void audioStoreTask(void *);   // 离线音频转存和发送任务(核心0)
+static void photoUploadTask(void *);  // 照片上传任务(核心0)
+static void batteryTask(void *);      // 电池电量监控任务(核心1,低优先级)
+static void wakeAudioTask();          // 唤醒空闲的音频采集任务
+static void stopAudioCapture();       // 关机时等采集任务停止麦克风
+static void wakePhotoTask();          // 拍照命令后唤醒拍照任务
+
 // ============================================================================
 // 按钮中断服务程序 (ISR)
 // ============================================================================
@@ -328,12 +416,13 @@ void handleButton()
  * enterPowerSave - 进入省电模式
  *
  * 降低CPU频率到40MHz以节省功耗
- * 在长时间无活动时自动调用
+ * 在长时间无活动时自动调用; 电源管理生效时频率按负载锁调节,不手动切换
  */
 void enterPowerSave()
 {
-    if (!powerSaveMode) {
+    if (!powerSaveMode && !power_pm_active()) {
         setCpuFrequencyMhz(MIN_CPU_FREQ_MHZ); // 降频到40MHz
+        power_note_frequency();
         powerSaveMode = true;
     }
 }
@@ -346,8 +435,9 @@ void enterPowerSave()
  */
 void exitPowerSave()
 {
-    if (powerSaveMode) {
+    if (powerSaveMode && !power_pm_active()) {
         setCpuFrequencyMhz(NORMAL_CPU_FREQ_MHZ); // 恢复到80MHz
+        power_note_frequency();
         powerSaveMode = false;
     }
 }
@@ -363,11 +453,12 @@ void exitPowerSave()
  *
  * 轻度睡眠可节省约15mA电流,增加3-4小时续航
  * 睡眠时会自动唤醒处理BLE事件和定时器
+ * 电源管理启用自动轻度睡眠时,空闲时已自动睡眠,这里不再手动进入
  */
 void enableLightSleep()
 {
     // 检查是否允许睡眠
-    if (!lightSleepEnabled || !connected || photoDataUploading) {
+    if (!lightSleepEnabled || !connected || photoDataUploading || power_auto_light_sleep()) {
         return; // 未启用/未连接/正在上传时不睡眠
     }
 
@@ -383,8 +474,8 @@ void enableLightSleep()
     // 计算距离下次拍照的时间
     if (isCapturingPhotos && captureInterval > 0) {
         unsigned long timeSinceLastPhoto = now - lastCaptureTime;
-        if (timeSinceLastPhoto < captureInterval) {
-            timeUntilNextPhoto = captureInterval - timeSinceLastPhoto;
+        if (timeSinceLastPhoto < photoInterval()) {
+            timeUntilNextPhoto = photoInterval() - timeSinceLastPhoto;
         }
     }
 
@@ -395,7 +486,9 @@ void enableLightSleep()
         if (sleepTime > 15000)
             sleepTime = 15000;                           // 最多睡15秒
         esp_sleep_enable_timer_wakeup(sleepTime * 1000); // 设置唤醒定时器(微秒)
+        int64_t sleepStart = esp_timer_get_time();       // 睡眠期间esp_timer继续计时
         esp_light_sleep_start();                         // 进入轻度睡眠
+        power_add_light_sleep_us(esp_timer_get_time() - sleepStart);
         lastActivity = millis();                         // 唤醒后更新活动时间
     }
 }
@@ -416,8 +509,8 @@ void shutdownDevice()
 {
     Serial.println("Shutting down device...");
 
-    // 停止音频子系统
-    mic_stop();
+    // 停止音频子系统: 由采集任务自己在两次读取之间卸载驱动,这里等它完成
+    stopAudioCapture();
 
     // 停止照片拍摄
     isCapturingPhotos = false;
@@ -463,10 +556,8 @@ void onMicData(int16_t *data, size_t samples)
  * @param {uint8_t*} data - 编码后的Opus数据
  * @param {size_t} len - 数据长度(字节)
  *
- * 当Opus编码器完成一帧编码时调用
- * 将编码数据存入发送环形缓冲区,等待BLE传输
- *
- * 环形缓冲区格式: [长度(2字节), 数据(len字节)]
+ * 当Opus编码器完成一帧编码时调用(在音频采集任务中)
+ * 打包后放入BLE发送调度的音频队列
  */
 void onOpusEncoded(uint8_t *data, size_t len)
 {
@@ -475,29 +566,7 @@ void onOpusEncoded(uint8_t *data, size_t len)
         return; // 数据过大,丢弃
     }
 
-    // 计算包大小: 长度字段(2字节) + 数据
-    size_t packet_size = len + 2;
-    size_t next_write = (audio_tx_write_pos + packet_size) % AUDIO_TX_BUFFER_SIZE;
-
-    // 检查环形缓冲区是否会溢出
-    if ((audio_tx_write_pos < audio_tx_read_pos && next_write >= audio_tx_read_pos) ||
-        (audio_tx_write_pos >= audio_tx_read_pos && next_write < audio_tx_write_pos &&
-         next_write >= audio_tx_read_pos)) {
-        // 缓冲区满,丢弃此包(实时音频可以容忍丢包)
-        return;
-    }
-
-    // 写入数据长度(小端格式,2字节)
-    audio_tx_buffer[audio_tx_write_pos] = len & 0xFF;
-    audio_tx_buffer[(audio_tx_write_pos + 1) % AUDIO_TX_BUFFER_SIZE] = (len >> 8) & 0xFF;
-
-    // 写入编码数据
-    for (size_t i = 0; i < len; i++) {
-        audio_tx_buffer[(audio_tx_write_pos + 2 + i) % AUDIO_TX_BUFFER_SIZE] = data[i];
-    }
-
-    // 更新写入位置
-    audio_tx_write_pos = next_write;
+    broadcastAudioPacket(data, len);
 }
 
 /**
@@ -506,88 +575,82 @@ void onOpusEncoded(uint8_t *data, size_t len)
  * @param {uint8_t*} data - Opus编码数据
  * @param {size_t} len - 数据长度
  *
- * 将音频数据打包并通过BLE通知发送给客户端
- * 包格式: [包序号(2字节), 子序号(1字节), Opus数据]
+ * 将音频数据打包并放入BLE发送调度的音频队列(优先级最高)
+ * 队列满时丢弃此包,不阻塞采集(实时音频可以容忍丢包)
+ * 未连接或未订阅时存入离线音频存储(AUDIO_STORE_ENABLE),重新连接后由audioStoreTask发送
+ * 包格式: [包序号(2字节), 子序号(1字节), Opus数据]; 离线的包同样编号,应用可以排序和发现丢包
  */
 void broadcastAudioPacket(uint8_t *data, size_t len)
 {
     // 检查连接状态和订阅状态
-    if (!connected || !audioSubscribed || audioDataCharacteristic == nullptr) {
+    bool streaming = connected && audioSubscribed && audioDataCharacteristic != nullptr;
+    if (!streaming && !(AUDIO_STORE_ENABLE && audio_store_available())) {
         return; // 未连接或未订阅,不发送
     }
 
-    // 构建音频包: 包序号(2字节) + 子序号(1字节) + 数据
-    audio_packet_buffer[0] = audioPacketIndex & 0xFF;        // 包序号低字节
-    audio_packet_buffer[1] = (audioPacketIndex >> 8) & 0xFF; // 包序号高字节
-    audio_packet_buffer[2] = 0;                              // 子序号(用于分片,当前未使用)
+    // 构建音频包: 包序号(2字节) + 子序号(1字节,不分片时为0) + 数据,与吊坠的格式相同
+    pipe_frame_header(audio_packet_buffer, audioPacketIndex, 0);
 
     // 复制音频数据
     memcpy(audio_packet_buffer + AUDIO_PACKET_HEADER_SIZE, data, len);
 
-    // 发送BLE通知
-    audioDataCharacteristic->setValue(audio_packet_buffer, len + AUDIO_PACKET_HEADER_SIZE);
-    audioDataCharacteristic->notify();
+    if (!streaming) {
+        // 没有客户端接收: 存入离线音频存储(两级都满时丢弃)
+        if (!audio_store_put(audio_packet_buffer, len + AUDIO_PACKET_HEADER_SIZE)) {
+            metrics_add_audio_drop();
+        }
+    } else if (!ble_tx_send(BLE_TX_AUDIO, audioDataCharacteristic, audio_packet_buffer,
+                            len + AUDIO_PACKET_HEADER_SIZE, 0)) {
+        // 放入发送队列(不等待)
+        metrics_add_audio_drop();
+    }
 
     // 递增包序号
     audioPacketIndex++;
 }
 
+// ============================================================================
+// BLE服务器回调类
+// ============================================================================
+
 /**
- * processAudioTx - 处理音频发送队列
+ * updateMicCapture - 按订阅状态暂停或恢复麦克风
  *
- * 从发送环形缓冲区读取已编码的音频包,并通过BLE发送
- * 应在主循环中定期调用,优先级高于照片传输
- *
- * 功能说明:
- * 1. 从环形缓冲区读取长度字段
- * 2. 读取对应长度的数据
- * 3. 调用broadcastAudioPacket发送
- * 4. 每次发送后延迟1ms防止BLE拥塞
+ * 没有客户端订阅音频时停止I2S时钟(MIC_PAUSE_UNSUBSCRIBED),芯片可以在BLE事件之间自动轻度睡眠
+ * 有离线音频存储时一直采集: 这段时间的音频存起来,重新连接后发送
  */
-void processAudioTx()
+static void updateMicCapture()
 {
-    // 检查连接和订阅状态
-    if (!connected || !audioSubscribed) {
-        return;
+    if (MIC_PAUSE_UNSUBSCRIBED && !(AUDIO_STORE_ENABLE && audio_store_available())) {
+        mic_set_paused(!(connected && audioSubscribed));
+        wakeAudioTask(); // 恢复时立即开始读取
     }
+}
 
-    if (audioDataCharacteristic == nullptr) {
-        return;
-    }
-
-    // 循环处理环形缓冲区中的所有数据
-    while (audio_tx_read_pos != audio_tx_write_pos) {
-        // 读取数据长度(小端格式,2字节)
-        uint16_t len =
-            audio_tx_buffer[audio_tx_read_pos] | (audio_tx_buffer[(audio_tx_read_pos + 1) % AUDIO_TX_BUFFER_SIZE] << 8);
-
-        // 检查长度是否有效
-        if (len == 0 || len > OPUS_OUTPUT_MAX_BYTES) {
-            // 无效包,跳过长度字段
-            audio_tx_read_pos = (audio_tx_read_pos + 2) % AUDIO_TX_BUFFER_SIZE;
-            continue;
-        }
-
-        // 读取数据到临时缓冲区
-        static uint8_t temp_data[OPUS_OUTPUT_MAX_BYTES];
-        for (size_t i = 0; i < len; i++) {
-            temp_data[i] = audio_tx_buffer[(audio_tx_read_pos + 2 + i) % AUDIO_TX_BUFFER_SIZE];
-        }
-
-        // 更新读取位置
-        audio_tx_read_pos = (audio_tx_read_pos + 2 + len) % AUDIO_TX_BUFFER_SIZE;
-
-        // 发送音频包
-        broadcastAudioPacket(temp_data, len);
-
-        // 小延迟防止BLE拥塞
-        delay(1);
+/**
+ * setPhotoFrameSize - MTU交换完成
+ *
+ * 照片帧按协商的MTU分块: 一次通知最多携带MTU-3字节(ATT头占3字节)
+ */
+static void setPhotoFrameSize(uint16_t mtu)
+{
+    size_t frame_size = mtu - 3;
+    if (frame_size > PHOTO_FRAME_MAX_SIZE) {
+        frame_size = PHOTO_FRAME_MAX_SIZE;
     }
+    photo_frame_size = frame_size;
+    Serial.printf("MTU %u, photo frames of %u bytes\n", mtu, (unsigned) frame_size);
 }
 
-// ============================================================================
-// BLE服务器回调类
-// ============================================================================
+/**
+ * setAudioSubscribed - 客户端启用或关闭音频通知
+ */
+static void setAudioSubscribed(bool subscribed)
+{
+    audioSubscribed = subscribed;
+    Serial.println(subscribed ? "Audio notifications enabled" : "Audio notifications disabled");
+    updateMicCapture();
+}
 
 /**
  * ServerHandler - BLE服务器事件处理器
@@ -604,29 +667,75 @@ class ServerHandler : public BLEServerCallbacks
      */
     void onConnect(BLEServer *server) override
     {
+        xSemaphoreTake(advertisingLock, portMAX_DELAY);
+        advertisingFast = false;
         connected = true;
+        // A back-off restart may have come between the connection and this callback
+        BLEDevice::getAdvertising()->stop();
+        xSemaphoreGive(advertisingLock);
+        photo_frame_size = BLE_ATT_DEFAULT_MTU - 3; // MTU交换前按默认MTU
+        scene_change_reset();                       // 新连接的第一张照片总是发送
+        ble_tx_set_connected(true);
         audioSubscribed = false;
+        updateMicCapture();
         lastActivity = millis(); // 注册活动,防止睡眠
         Serial.println(">>> BLE Client connected.");
         // 连接时发送当前电池电量
         updateBatteryService();
+        if (batteryTaskHandle != nullptr) {
+            xTaskNotifyGive(batteryTaskHandle); // 连接后重新读取一次
+        }
+    }
+
+#if BLE_BONDING
+    /**
+     * onConnect - 连接后请求加密: 已绑定的手机直接用保存的密钥,否则Just Works配对并绑定
+     */
+#if BLE_NIMBLE
+    void onConnect(BLEServer *server, ble_gap_conn_desc *desc) override
+    {
+        NimBLEDevice::startSecurity(desc->conn_handle);
+    }
+#else
+    void onConnect(BLEServer *server, esp_ble_gatts_cb_param_t *param) override
+    {
+        esp_ble_set_encryption(param->connect.remote_bda, ESP_BLE_SEC_ENCRYPT);
     }
+#endif
+#endif
 
     /**
      * onDisconnect - 客户端断开事件
      *
      * 当客户端断开连接时调用
-     * 重新开始广播以便重新连接
+     * 以快速间隔重新开始广播,手机回到范围内时尽快重新连接
      */
     void onDisconnect(BLEServer *server) override
     {
-        connected = false;
+        ble_tx_set_connected(false);
         audioSubscribed = false;
+        updateMicCapture();
         Serial.println("<<< BLE Client disconnected. Restarting advertising.");
-        BLEDevice::startAdvertising(); // 重新开始广播
+        xSemaphoreTake(advertisingLock, portMAX_DELAY);
+        connected = false;
+        startAdvertising(true); // 重新开始广播
+        xSemaphoreGive(advertisingLock);
+    }
+
+#if BLE_NIMBLE
+    void onMTUChange(uint16_t mtu, ble_gap_conn_desc *desc) override
+    {
+        setPhotoFrameSize(mtu);
+    }
+#else
+    void onMtuChanged(BLEServer *server, esp_ble_gatts_cb_param_t *param) override
+    {
+        setPhotoFrameSize(param->mtu.mtu);
     }
+#endif
 };
 
+#if !BLE_NIMBLE
 /**
  * AudioCCCDCallback - 音频订阅状态回调
  *
@@ -644,17 +753,11 @@ class AudioCCCDCallback : public BLEDescriptorCallbacks
     {
         uint8_t *value = pDescriptor->getValue();
         if (value && pDescriptor->getLength() >= 2) {
-            // 检查通知位(bit 0)
-            if (value[0] & 0x01) {
-                audioSubscribed = true;
-                Serial.println("Audio notifications enabled");
-            } else {
-                audioSubscribed = false;
-                Serial.println("Audio notifications disabled");
-            }
+            setAudioSubscribed(value[0] & 0x01); // 通知位(bit 0)
         }
     }
 };
+#endif
 
 /**
  * AudioDataCallback - 音频数据特性回调
@@ -663,6 +766,17 @@ class AudioCCCDCallback : public BLEDescriptorCallbacks
  */
 class AudioDataCallback : public BLECharacteristicCallbacks
 {
+#if BLE_NIMBLE
+    /**
+     * onSubscribe - 客户端写入CCCD时调用(NimBLE自己管理CCCD)
+     *
+     * 检查客户端是否启用了通知(bit 0)
+     */
+    void onSubscribe(BLECharacteristic *pCharacteristic, ble_gap_conn_desc *desc, uint16_t subValue) override
+    {
+        setAudioSubscribed(subValue & 0x01);
+    }
+#else
     /**
      * onStatus - 通知发送状态回调
      *
@@ -674,6 +788,7 @@ class AudioDataCallback : public BLECharacteristicCallbacks
             // 通知发送成功(可在此处添加统计逻辑)
         }
     }
+#endif
 
     /**
      * onRead - 客户端读取特性时调用
@@ -686,6 +801,32 @@ class AudioDataCallback : public BLECharacteristicCallbacks
     }
 };
 
+/**
+ * AudioCodecCallback - 音频编解码器特性回调
+ *
+ * 应用写入单字节编解码器ID切换编码方式:
+ *   AUDIO_CODEC_ID (21): Opus
+ *   AUDIO_CODEC_ID_MULAW (10): mu-law,码率高一倍但几乎不占CPU(电量低、CPU需要保持40MHz时)
+ * 读取返回当前编解码器ID
+ */
+class AudioCodecCallback : public BLECharacteristicCallbacks
+{
+    /**
+     * onWrite - 客户端写入编解码器ID时调用
+     *
+     * 无效ID保持当前编解码器,特性值始终更新为当前ID
+     */
+    void onWrite(BLECharacteristic *characteristic) override
+    {
+        std::string value = characteristic->getValue();
+        if (value.length() == 1 && !opus_set_codec_id((uint8_t) value[0])) {
+            Serial.println("AudioCodec: unknown codec ID");
+        }
+        uint8_t codecId = opus_get_codec_id();
+        characteristic->setValue(&codecId, 1);
+    }
+};
+
 /**
  * PhotoControlCallback - 照片控制特性回调
  *
@@ -694,6 +835,11 @@ class AudioDataCallback : public BLECharacteristicCallbacks
  *   -1: 拍摄单张照片
  *    0: 停止拍照
  *  5-300: 设置间隔拍照(秒数)
+ * 或3字节 [PHOTO_CMD_SET_QUALITY_BOUNDS, 最好档位, 最差档位]: 限制自适应的照片档位
+ * 或2字节 [PHOTO_CMD_SET_THUMBNAIL, 0/1]: 关闭/开启新照片之前的缩略图
+ * 或2字节 [PHOTO_CMD_SET_PHOTO_IDS, 0/1]: 关闭/开启第一块中的照片ID和偏移
+ * 或7字节 [PHOTO_CMD_RESUME, 照片ID(2字节), 字节偏移(4字节)]: 从偏移处重新发送该照片(小端)
+ * 读取返回照片协议版本(PHOTO_PROTOCOL_VERSION)
  */
 class PhotoControlCallback : public BLECharacteristicCallbacks
 {
@@ -704,13 +850,38 @@ class PhotoControlCallback : public BLECharacteristicCallbacks
      */
     void onWrite(BLECharacteristic *characteristic) override
     {
-        if (characteristic->getLength() == 1) {
-            int8_t received = characteristic->getData()[0];
+        std::string value = characteristic->getValue();
+        if (value.length() == 1) {
+            int8_t received = (int8_t) value[0];
             Serial.print("PhotoControl received: ");
             Serial.println(received);
             lastActivity = millis(); // 注册活动,防止睡眠
             handlePhotoControl(received); // 处理照片控制命令
+        } else if (value.length() == 3 && (uint8_t) value[0] == PHOTO_CMD_SET_QUALITY_BOUNDS) {
+            const uint8_t *data = (const uint8_t *) value.data();
+            lastActivity = millis();
+            if (!photo_adapt_set_bounds(data[1], data[2])) {
+                Serial.println("PhotoControl: invalid quality bounds");
+            }
+        } else if (value.length() == 2 && (uint8_t) value[0] == PHOTO_CMD_SET_THUMBNAIL) {
+            lastActivity = millis();
+            photo_thumb_set_enabled(value[1] != 0);
+        } else if (value.length() == 2 && (uint8_t) value[0] == PHOTO_CMD_SET_PHOTO_IDS) {
+            lastActivity = millis();
+            photoIdHeaders = value[1] != 0;
+        } else if (value.length() == 7 && (uint8_t) value[0] == PHOTO_CMD_RESUME) {
+            const uint8_t *data = (const uint8_t *) value.data();
+            photo_resume_t resume;
+            resume.id = data[1] | (data[2] << 8);
+            resume.offset = data[3] | (data[4] << 8) | (data[5] << 16) | ((uint32_t) data[6] << 24);
+            lastActivity = millis();
+            if (resumeQueue) {
+                xQueueOverwrite(resumeQueue, &resume); // 由上传任务处理
+            }
         }
+        // 读取时始终返回照片协议版本
+        uint8_t version = PHOTO_PROTOCOL_VERSION;
+        characteristic->setValue(&version, 1);
     }
 };
 
@@ -752,19 +923,193 @@ class OTAControlCallback : public BLECharacteristicCallbacks
     }
 };
 
+/**
+ * OTABleDataCallback - BLE OTA固件数据特性回调
+ *
+ * 客户端以无响应写发送[偏移, 固件数据],交给ota模块的接收缓冲区(不阻塞BLE任务)
+ */
+class OTABleDataCallback : public BLECharacteristicCallbacks
+{
+    void onWrite(BLECharacteristic *pChar) override
+    {
+        std::string value = pChar->getValue();
+        ota_ble_data((const uint8_t *) value.data(), value.length());
+    }
+};
+
+/**
+ * MetricsCallback - 性能遥测特性回调
+ *
+ * 读取时返回最新的计数器快照(metrics_snapshot_t)
+ */
+class MetricsCallback : public BLECharacteristicCallbacks
+{
+    void onRead(BLECharacteristic *pChar) override
+    {
+        metrics_snapshot_t snapshot;
+        metrics_snapshot(&snapshot);
+        pChar->setValue((uint8_t *) &snapshot, sizeof(snapshot));
+    }
+};
+
+/**
+ * AudioStoredCallback - 离线音频特性回调
+ *
+ * 读取时返回存储的字节数(4字节,小端),应用据此显示进度
+ */
+/**
+ * GovernorCallback - 性能调节档位特性回调
+ *
+ * 读取时返回当前档位和选择它的读数(governor_state_t)
+ */
+class GovernorCallback : public BLECharacteristicCallbacks
+{
+    void onRead(BLECharacteristic *pChar) override
+    {
+        governor_state_t state;
+        governor_get_state(&state);
+        pChar->setValue((uint8_t *) &state, sizeof(state));
+    }
+};
+
+class AudioStoredCallback : public BLECharacteristicCallbacks
+{
+    void onRead(BLECharacteristic *pChar) override
+    {
+        uint32_t bytes = audio_store_bytes();
+        pChar->setValue((uint8_t *) &bytes, sizeof(bytes));
+    }
+};
+
+/**
+ * updateMetrics - 结束一个遥测周期,客户端订阅时通知快照
+ */
+static void updateMetrics()
+{
+    metrics_roll();
+#if BLE_NIMBLE
+    bool subscribed = metricsCharacteristic != nullptr && metricsCharacteristic->getSubscribedCount() > 0;
+#else
+    bool subscribed = metricsCcc != nullptr && metricsCcc->getNotifications();
+#endif
+    if (connected && subscribed) {
+        metrics_snapshot_t snapshot;
+        metrics_snapshot(&snapshot);
+        ble_tx_send(BLE_TX_CONTROL, metricsCharacteristic, (const uint8_t *) &snapshot, sizeof(snapshot), 0);
+    }
+}
+
+/**
+ * updateGovernor - 按新的电池读数选择性能档位,档位变化且客户端订阅时通知
+ *
+ * 剩余时间由放电斜率估计(到BATTERY_MIN_VOLTAGE),斜率未知时为GOVERNOR_RUNTIME_UNKNOWN
+ */
+static void updateGovernor()
+{
+    uint16_t runtime = GOVERNOR_RUNTIME_UNKNOWN;
+    if (batterySlopeMvPerMin > 0) {
+        float minutes = (batteryVoltage - BATTERY_MIN_VOLTAGE) * 1000.0f / batterySlopeMvPerMin;
+        runtime = minutes <= 0 ? 0 : (minutes >= GOVERNOR_RUNTIME_UNKNOWN ? GOVERNOR_RUNTIME_UNKNOWN - 1 : minutes);
+    }
+    if (!governor_update(batteryPercentage, runtime) || governorCharacteristic == nullptr) {
+        return;
+    }
+#if BLE_NIMBLE
+    bool subscribed = governorCharacteristic->getSubscribedCount() > 0;
+#else
+    bool subscribed = governorCcc != nullptr && governorCcc->getNotifications();
+#endif
+    if (connected && subscribed) {
+        governor_state_t state;
+        governor_get_state(&state);
+        ble_tx_send(BLE_TX_CONTROL, governorCharacteristic, (const uint8_t *) &state, sizeof(state), 0);
+    }
+}
+
 // ============================================================================
 // 电池管理函数
 // ============================================================================
 
+/**
+ * sampleBatteryAdc - 采样电池ADC
+ *
+ * 采样BATTERY_ADC_SAMPLES次,每次之间让出CPU BATTERY_ADC_SAMPLE_GAP_MS
+ * 排序后去掉最低和最高各四分之一再取平均,滤掉射频和负载突变造成的尖峰
+ *
+ * @return ADC读数(12位,0-4095)
+ */
+static float sampleBatteryAdc()
+{
+    int samples[BATTERY_ADC_SAMPLES];
+    for (int i = 0; i < BATTERY_ADC_SAMPLES; i++) {
+        int value = analogRead(BATTERY_ADC_PIN); // GPIO2/A1
+        int j = i;
+        for (; j > 0 && samples[j - 1] > value; j--) {
+            samples[j] = samples[j - 1]; // 插入排序
+        }
+        samples[j] = value;
+        delay(BATTERY_ADC_SAMPLE_GAP_MS);
+    }
+
+    int sum = 0;
+    for (int i = BATTERY_ADC_SAMPLES / 4; i < BATTERY_ADC_SAMPLES - BATTERY_ADC_SAMPLES / 4; i++) {
+        sum += samples[i];
+    }
+    return (float) sum / (BATTERY_ADC_SAMPLES - 2 * (BATTERY_ADC_SAMPLES / 4));
+}
+
+/**
+ * trackBatterySlope - 记录放电斜率(相隔至少BATTERY_SLOPE_SPAN_MS的两次读数之间)
+ */
+static void trackBatterySlope()
+{
+    unsigned long now = millis();
+    if (batterySlopeRefAt == 0) {
+        batterySlopeRefVoltage = batteryVoltage;
+        batterySlopeRefAt = now;
+        return;
+    }
+    unsigned long span = now - batterySlopeRefAt;
+    if (span < BATTERY_SLOPE_SPAN_MS) {
+        return;
+    }
+    float drop_mv = (batterySlopeRefVoltage - batteryVoltage) * 1000.0f;
+    batterySlopeMvPerMin = drop_mv > 0 ? drop_mv * 60000.0f / span : 0.0f;
+    batterySlopeRefVoltage = batteryVoltage;
+    batterySlopeRefAt = now;
+}
+
+/**
+ * batteryRefreshIntervalMs - 下次读取电池电量的间隔
+ *
+ * 斜率未知、放电平缓尚未测出或接近低电量时按BATTERY_REFRESH_MIN_MS读取,
+ * 稳定放电时按每BATTERY_REFRESH_STEP_MV的变化读取一次,最长BATTERY_REFRESH_MAX_MS
+ */
+static uint32_t batteryRefreshIntervalMs()
+{
+    if (batteryVoltage < BATTERY_LOW_VOLTAGE + 0.1f) {
+        return BATTERY_REFRESH_MIN_MS;
+    }
+    if (batterySlopeMvPerMin <= 0.0f) {
+        // 尚未测出斜率,或电压平稳: 足够频繁地读取,一个测量跨度内就能得到斜率
+        bool measured = batterySlopeRefAt != 0 && millis() - batterySlopeRefAt >= BATTERY_SLOPE_SPAN_MS;
+        return measured ? BATTERY_REFRESH_MAX_MS : BATTERY_REFRESH_MIN_MS;
+    }
+    float step = BATTERY_REFRESH_STEP_MV * 60000.0f / batterySlopeMvPerMin;
+    if (step < BATTERY_REFRESH_MIN_MS) {
+        return BATTERY_REFRESH_MIN_MS;
+    }
+    return step > BATTERY_REFRESH_MAX_MS ? BATTERY_REFRESH_MAX_MS : (uint32_t) step;
+}
+
 /**
  * readBatteryLevel - 读取电池电量
  *
  * 功能说明:
- * 1. 通过ADC读取电池电压(GPIO2)
- * 2. 采样10次取平均,提高稳定性
- * 3. 使用电压分压器计算实际电池电压
- * 4. 考虑负载补偿,计算电量百分比
- * 5. 平滑处理,避免电量跳变
+ * 1. 通过ADC读取电池电压(GPIO2),去掉极值后取平均(sampleBatteryAdc)
+ * 2. 使用电压分压器计算实际电池电压,再与之前的读数做指数平滑(BATTERY_FILTER_ALPHA)
+ * 3. 考虑负载补偿,计算电量百分比
+ * 4. 平滑处理,避免电量跳变
  *
  * 电压范围:
  * - 最大电压: 4.2V (满电)
@@ -775,29 +1120,29 @@ class OTAControlCallback : public BLECharacteristicCallbacks
  * - 使用分压器读取双电池总电压(500mAh总容量)
  * - 负载补偿:考虑负载下的电压降
  * - 平滑算法:变化>5%时渐进调整(±2%/次)
+ * - 启动后由电池任务调用(batteryTask),不阻塞Arduino loop和音频任务
  */
 void readBatteryLevel()
 {
-    // 采样10次取平均值,提高稳定性
-    int adcSum = 0;
-    for (int i = 0; i < 10; i++) {
-        int value = analogRead(BATTERY_ADC_PIN); // GPIO2/A1
-        adcSum += value;
-        delay(10); // 每次采样间隔10ms
-    }
-    int adcValue = adcSum / 10;
+    float adcValue = sampleBatteryAdc();
 
     // ESP32-S3 ADC: 12位(0-4095), 参考电压约3.3V
     float adcVoltage = (adcValue / 4095.0f) * 3.3f;
 
     // 应用分压器比例计算实际电池电压
-    batteryVoltage = adcVoltage * VOLTAGE_DIVIDER_RATIO; // 6.086倍
+    float voltage = adcVoltage * VOLTAGE_DIVIDER_RATIO; // 6.086倍
 
     // 限制电压到合理范围(防止异常读数)
-    if (batteryVoltage > 5.0f)
-        batteryVoltage = 5.0f;
-    if (batteryVoltage < 2.5f)
-        batteryVoltage = 2.5f;
+    if (voltage > 5.0f)
+        voltage = 5.0f;
+    if (voltage < 2.5f)
+        voltage = 2.5f;
+
+    // 指数平滑(第一次读数直接使用)
+    static bool firstReading = true;
+    batteryVoltage = firstReading ? voltage : batteryVoltage + BATTERY_FILTER_ALPHA * (voltage - batteryVoltage);
+    firstReading = false;
+    trackBatterySlope();
 
     // 负载补偿电池计算(考虑负载下的电压降)
     float loadCompensatedMax = BATTERY_MAX_VOLTAGE; // 4.2V
@@ -852,9 +1197,9 @@ void updateBatteryService()
         uint8_t batteryLevel = (uint8_t) batteryPercentage;
         batteryLevelCharacteristic->setValue(&batteryLevel, 1);
 
-        // 如果已连接,发送通知给客户端
+        // 如果已连接,通过发送调度通知客户端
         if (connected) {
-            batteryLevelCharacteristic->notify();
+            ble_tx_send(BLE_TX_CONTROL, batteryLevelCharacteristic, &batteryLevel, 1, 0);
         }
     }
 }
@@ -877,7 +1222,8 @@ void updateBatteryService()
  * BLE架构:
  * - 设备名称: "OMI Glass"
  * - MTU: 517字节
- * - 广播间隔: 200-400ms(省电优化)
+ * - 广播间隔: 启动和断开后BLE_ADV_FAST_WINDOW_MS内20-30ms,之后200-400ms(省电优化)
+ * - 绑定(BLE_BONDING): 重新连接时手机使用缓存的GATT表,不再发现服务
  * - 传输功率: 0dBm(低功耗)
  */
 void configure_ble()
@@ -885,8 +1231,38 @@ void configure_ble()
     Serial.println("Initializing BLE...");
     // 初始化BLE设备
     BLEDevice::init(BLE_DEVICE_NAME); // "OMI Glass"
+    advertisingLock = xSemaphoreCreateMutex();
+    BLEDevice::setMTU(BLE_MTU_SIZE);  // 本地支持的最大MTU,实际值由客户端交换决定
+#if BLE_BONDING
+    // Just Works绑定(眼镜没有输入输出),密钥保存在NVS中,重启后仍然有效
+#if BLE_NIMBLE
+    NimBLEDevice::setSecurityAuth(true, false, true); // 绑定, 无MITM, LE安全连接
+    NimBLEDevice::setSecurityIOCap(BLE_HS_IO_NO_INPUT_OUTPUT);
+#else
+    BLESecurity *security = new BLESecurity();
+    security->setAuthenticationMode(ESP_LE_AUTH_REQ_SC_BOND);
+    security->setCapability(ESP_IO_CAP_NONE);
+    security->setInitEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+    security->setRespEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+#endif
+#endif
+#if BLE_NIMBLE
+    static ble_gap_event_listener txListener;
+    ble_gap_event_listener_register(&txListener, ble_tx_gap_event, nullptr); // 连接和通知完成事件(照片流控)
+#else
+    BLEDevice::setCustomGattsHandler(ble_tx_gatts_event); // 通知完成和拥塞事件(照片流控)
+#endif
+#if CONFIG_BT_CTRL_MODEM_SLEEP
+    // 控制器调制解调器睡眠: 连接事件之间关闭射频,配合电源管理的自动轻度睡眠
+    if (esp_bt_sleep_enable() != ESP_OK) {
+        Serial.println("BLE modem sleep unavailable");
+    }
+#endif
     BLEServer *server = BLEDevice::createServer();
     server->setCallbacks(new ServerHandler()); // 设置连接/断开回调
+#if BLE_NIMBLE
+    server->advertiseOnDisconnect(false); // 断开后由onDisconnect按快速间隔重新广播
+#endif
 
     // ========================================================================
     // OMI主服务 - 照片和音频传输
@@ -894,44 +1270,61 @@ void configure_ble()
     BLEService *service = server->createService(serviceUUID);
 
     // 音频数据特性(用于流式传输音频到应用)
-    audioDataCharacteristic = service->createCharacteristic(
-        audioDataUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY);
-    BLE2902 *audioCcc = new BLE2902(); // CCCD描述符(客户端配置描述符)
+    audioDataCharacteristic =
+        service->createCharacteristic(audioDataUUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY);
+#if !BLE_NIMBLE
+    BLE2902 *audioCcc = new BLE2902(); // CCCD描述符(客户端配置描述符), NimBLE自动创建
     audioCcc->setNotifications(true);
     audioCcc->setCallbacks(new AudioCCCDCallback()); // 监听订阅状态变化
     audioDataCharacteristic->addDescriptor(audioCcc);
+#endif
     audioDataCharacteristic->setCallbacks(new AudioDataCallback());
 
-    // 音频编解码器特性(告知应用使用的编解码器)
-    audioCodecCharacteristic = service->createCharacteristic(audioCodecUUID, BLECharacteristic::PROPERTY_READ);
+    // 音频编解码器特性(告知应用使用的编解码器,应用写入编解码器ID切换)
+    audioCodecCharacteristic =
+        service->createCharacteristic(audioCodecUUID, BLE_PROPERTY_READ | BLE_PROPERTY_WRITE);
+    audioCodecCharacteristic->setCallbacks(new AudioCodecCallback());
     uint8_t codecId = opus_get_codec_id(); // 获取Opus编解码器ID(21)
     audioCodecCharacteristic->setValue(&codecId, 1);
 
+    // 离线音频特性(通知存储的音频包,读取返回存储的字节数)
+    audioStoredCharacteristic =
+        service->createCharacteristic(audioStoredUUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY);
+#if !BLE_NIMBLE
+    audioStoredCcc = new BLE2902(); // 客户端订阅后才发送
+    audioStoredCharacteristic->addDescriptor(audioStoredCcc);
+#endif
+    audioStoredCharacteristic->setCallbacks(new AudioStoredCallback());
+
     // 照片数据特性(用于传输JPEG照片)
-    photoDataCharacteristic = service->createCharacteristic(
-        photoDataUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY);
+    photoDataCharacteristic =
+        service->createCharacteristic(photoDataUUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY);
+#if !BLE_NIMBLE
     BLE2902 *ccc = new BLE2902();
     ccc->setNotifications(true);
     photoDataCharacteristic->addDescriptor(ccc);
+#endif
 
-    // 照片控制特性(接收拍照命令)
-    photoControlCharacteristic = service->createCharacteristic(photoControlUUID, BLECharacteristic::PROPERTY_WRITE);
+    // 照片控制特性(接收拍照命令,读取返回照片协议版本)
+    photoControlCharacteristic =
+        service->createCharacteristic(photoControlUUID, BLE_PROPERTY_READ | BLE_PROPERTY_WRITE);
     photoControlCharacteristic->setCallbacks(new PhotoControlCallback());
-    uint8_t controlValue = 0;
-    photoControlCharacteristic->setValue(&controlValue, 1);
+    uint8_t photoProtocolVersion = PHOTO_PROTOCOL_VERSION;
+    photoControlCharacteristic->setValue(&photoProtocolVersion, 1);
 
     // ========================================================================
     // 标准电池服务(Bluetooth SIG定义)
     // ========================================================================
     BLEService *batteryService = server->createService(BATTERY_SERVICE_UUID); // 0x180F
-    batteryLevelCharacteristic = batteryService->createCharacteristic(
-        BATTERY_LEVEL_UUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY); // 0x2A19
+    batteryLevelCharacteristic =
+        batteryService->createCharacteristic(BATTERY_LEVEL_UUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY); // 0x2A19
+#if !BLE_NIMBLE
     BLE2902 *batteryCcc = new BLE2902();
     batteryCcc->setNotifications(true);
     batteryLevelCharacteristic->addDescriptor(batteryCcc);
+#endif
 
-    // 设置初始电池电量
-    readBatteryLevel();
+    // 设置初始电池电量(启动时电池任务立即读取一次,随后更新)
     uint8_t initialBatteryLevel = (uint8_t) batteryPercentage;
     batteryLevelCharacteristic->setValue(&initialBatteryLevel, 1);
 
@@ -942,31 +1335,32 @@ void configure_ble()
 
     // 制造商名称
     BLECharacteristic *manufacturerNameCharacteristic =
-        deviceInfoService->createCharacteristic(MANUFACTURER_NAME_STRING_CHAR_UUID, BLECharacteristic::PROPERTY_READ);
+        deviceInfoService->createCharacteristic(MANUFACTURER_NAME_STRING_CHAR_UUID, BLE_PROPERTY_READ);
     // 型号
     BLECharacteristic *modelNumberCharacteristic =
-        deviceInfoService->createCharacteristic(MODEL_NUMBER_STRING_CHAR_UUID, BLECharacteristic::PROPERTY_READ);
+        deviceInfoService->createCharacteristic(MODEL_NUMBER_STRING_CHAR_UUID, BLE_PROPERTY_READ);
     // 固件版本
     BLECharacteristic *firmwareRevisionCharacteristic =
-        deviceInfoService->createCharacteristic(FIRMWARE_REVISION_STRING_CHAR_UUID, BLECharacteristic::PROPERTY_READ);
+        deviceInfoService->createCharacteristic(FIRMWARE_REVISION_STRING_CHAR_UUID, BLE_PROPERTY_READ);
     // 硬件版本
     BLECharacteristic *hardwareRevisionCharacteristic =
-        deviceInfoService->createCharacteristic(HARDWARE_REVISION_STRING_CHAR_UUID, BLECharacteristic::PROPERTY_READ);
+        deviceInfoService->createCharacteristic(HARDWARE_REVISION_STRING_CHAR_UUID, BLE_PROPERTY_READ);
     // 序列号
     BLECharacteristic *serialNumberCharacteristic =
-        deviceInfoService->createCharacteristic(SERIAL_NUMBER_STRING_CHAR_UUID, BLECharacteristic::PROPERTY_READ);
+        deviceInfoService->createCharacteristic(SERIAL_NUMBER_STRING_CHAR_UUID, BLE_PROPERTY_READ);
 
     // 设置设备信息值(从config.h获取)
-    manufacturerNameCharacteristic->setValue(MANUFACTURER_NAME);       // "Based Hardware"
-    modelNumberCharacteristic->setValue(BLE_DEVICE_NAME);              // "OMI Glass"
-    firmwareRevisionCharacteristic->setValue(FIRMWARE_VERSION_STRING); // "2.3.2"
-    hardwareRevisionCharacteristic->setValue(HARDWARE_REVISION);       // "ESP32-S3-v1.0"
+    // 按std::string设置: NimBLE会把字符数组连同结尾的0一起作为值
+    manufacturerNameCharacteristic->setValue(std::string(MANUFACTURER_NAME));       // "Based Hardware"
+    modelNumberCharacteristic->setValue(std::string(BLE_DEVICE_NAME));              // "OMI Glass"
+    firmwareRevisionCharacteristic->setValue(std::string(FIRMWARE_VERSION_STRING)); // "2.3.2"
+    hardwareRevisionCharacteristic->setValue(std::string(HARDWARE_REVISION));       // "ESP32-S3-v1.0"
 
     // 从ESP32芯片ID生成唯一序列号
     uint64_t chipId = ESP.getEfuseMac(); // 获取芯片唯一ID
     char serialNumber[17];
     snprintf(serialNumber, sizeof(serialNumber), "%04X%08X", (uint16_t) (chipId >> 32), (uint32_t) chipId);
-    serialNumberCharacteristic->setValue(serialNumber);
+    serialNumberCharacteristic->setValue(std::string(serialNumber));
 
     // ========================================================================
     // OTA升级服务
@@ -974,20 +1368,51 @@ void configure_ble()
     BLEService *otaService = server->createService(otaServiceUUID);
 
     // OTA控制特性(用于接收命令和读取状态)
-    otaControlCharacteristic = otaService->createCharacteristic(
-        otaControlUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE);
+    otaControlCharacteristic =
+        otaService->createCharacteristic(otaControlUUID, BLE_PROPERTY_READ | BLE_PROPERTY_WRITE);
     otaControlCharacteristic->setCallbacks(new OTAControlCallback());
 
     // OTA数据特性(用于进度通知)
-    otaDataCharacteristic = otaService->createCharacteristic(
-        otaDataUUID, BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY);
+    otaDataCharacteristic = otaService->createCharacteristic(otaDataUUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY);
+#if !BLE_NIMBLE
     BLE2902 *otaCcc = new BLE2902();
     otaCcc->setNotifications(true);
     otaDataCharacteristic->addDescriptor(otaCcc);
+#endif
+
+    // BLE OTA固件数据特性(没有WiFi时通过BLE升级,OTA_CMD_BLE_BEGIN之后写入)
+    otaBleDataCharacteristic = otaService->createCharacteristic(otaBleDataUUID, BLE_PROPERTY_WRITE_NR);
+    otaBleDataCharacteristic->setCallbacks(new OTABleDataCallback());
 
     // 将OTA特性传递给OTA模块
     ota_set_characteristics(otaControlCharacteristic, otaDataCharacteristic);
 
+    // ========================================================================
+    // 性能遥测服务(与omi吊坠相同的UUID)
+    // ========================================================================
+    BLEService *metricsService = server->createService(metricsServiceUUID);
+    metricsCharacteristic =
+        metricsService->createCharacteristic(metricsDataUUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY);
+#if !BLE_NIMBLE
+    metricsCcc = new BLE2902(); // 客户端订阅后才通知
+    metricsCharacteristic->addDescriptor(metricsCcc);
+#endif
+    metricsCharacteristic->setCallbacks(new MetricsCallback());
+
+#if GOVERNOR
+    // ========================================================================
+    // 性能调节服务(与omi吊坠相同的UUID)
+    // ========================================================================
+    BLEService *governorService = server->createService(governorServiceUUID);
+    governorCharacteristic =
+        governorService->createCharacteristic(governorTierUUID, BLE_PROPERTY_READ | BLE_PROPERTY_NOTIFY);
+#if !BLE_NIMBLE
+    governorCcc = new BLE2902(); // 客户端订阅后才通知档位变化
+    governorCharacteristic->addDescriptor(governorCcc);
+#endif
+    governorCharacteristic->setCallbacks(new GovernorCallback());
+#endif
+
     // ========================================================================
     // 启动所有服务
     // ========================================================================
@@ -995,6 +1420,10 @@ void configure_ble()
     batteryService->start();  // 电池服务
     deviceInfoService->start(); // 设备信息服务
     otaService->start();      // OTA服务
+    metricsService->start();  // 性能遥测服务
+#if GOVERNOR
+    governorService->start(); // 性能调节服务
+#endif
 
     // ========================================================================
     // 开始BLE广播
@@ -1002,13 +1431,47 @@ void configure_ble()
     BLEAdvertising *advertising = BLEDevice::getAdvertising();
     advertising->addServiceUUID(service->getUUID()); // 广播OMI服务UUID(适配31字节限制)
     advertising->setScanResponse(true);              // 启用扫描响应
-    advertising->setMinPreferred(BLE_ADV_MIN_INTERVAL); // 最小广播间隔200ms
-    advertising->setMaxPreferred(BLE_ADV_MAX_INTERVAL); // 最大广播间隔400ms
-    BLEDevice::startAdvertising();
+    startAdvertising(true);
 
     Serial.println("BLE initialized and advertising started.");
 }
 
+/**
+ * startAdvertising - 设置广播间隔并开始广播
+ *
+ * 快速间隔只持续BLE_ADV_FAST_WINDOW_MS,之后主循环退回省电间隔(updateAdvertising)
+ * 调用者持有advertisingLock(configure_ble除外,那时还不会有连接)
+ * setMinPreferred/setMaxPreferred是广播数据中的首选连接间隔,不是广播间隔,这里不设置
+ */
+static void startAdvertising(bool fast)
+{
+    BLEAdvertising *advertising = BLEDevice::getAdvertising();
+    advertising->setMinInterval(fast ? BLE_ADV_FAST_MIN_INTERVAL : BLE_ADV_MIN_INTERVAL);
+    advertising->setMaxInterval(fast ? BLE_ADV_FAST_MAX_INTERVAL : BLE_ADV_MAX_INTERVAL);
+    advertisingSince = millis();
+    advertisingFast = fast;
+    BLEDevice::startAdvertising();
+}
+
+/**
+ * updateAdvertising - 快速广播窗口结束后退回省电间隔(主循环中调用)
+ *
+ * 检查和重新广播都在advertisingLock内: onConnect在两者之间到来时会等待,之后不会再广播
+ */
+static void updateAdvertising()
+{
+    if (!advertisingFast || millis() - advertisingSince < BLE_ADV_FAST_WINDOW_MS) {
+        return;
+    }
+    xSemaphoreTake(advertisingLock, portMAX_DELAY);
+    if (!connected && advertisingFast) {
+        Serial.println("Advertising backed off to the power saving interval.");
+        BLEDevice::getAdvertising()->stop();
+        startAdvertising(false);
+    }
+    xSemaphoreGive(advertisingLock);
+}
+
 // ============================================================================
 // 相机函数
 // ============================================================================
@@ -1016,38 +1479,30 @@ void configure_ble()
 /**
  * take_photo - 拍摄照片
  *
- * @returns {bool} 成功返回true,失败返回false
+ * @returns {camera_fb_t*} 新的帧缓冲区,失败返回nullptr; 上传后由上传任务归还
  *
  * 功能说明:
- * 1. 释放之前的帧缓冲区(如果有)
- * 2. 从相机获取新的JPEG图像
- * 3. 设置照片旋转角度(固定180度)
- * 4. 注册活动时间戳
+ * 1. 从相机获取唤醒后拍摄的JPEG图像(另一个帧缓冲区可能仍在上传)
+ * 2. 设置照片旋转角度(固定180度)
+ * 3. 注册活动时间戳
  *
- * 照片参数(从config.h):
+ * 照片参数(从config.h, 由photo_adapt按链路吞吐量下调):
  * - 分辨率: VGA 640x480
  * - JPEG质量: 25
  * - 平均大小: ~10KB
  * - 旋转角度: 180度(因为相机安装是倒置的)
  */
-bool take_photo()
+camera_fb_t *take_photo()
 {
-    // 释放之前的帧缓冲区(防止内存泄漏)
-    if (fb) {
-        Serial.println("Releasing previous camera buffer...");
-        esp_camera_fb_return(fb);
-        fb = nullptr;
-    }
-
     Serial.println("Capturing photo...");
     // 从相机获取帧缓冲区(硬件JPEG编码)
-    fb = esp_camera_fb_get();
-    if (!fb) {
+    camera_fb_t *frame = camera_power_grab();
+    if (!frame) {
         Serial.println("Failed to get camera frame buffer!");
-        return false;
+        return nullptr;
     }
     Serial.print("Photo captured: ");
-    Serial.print(fb->len);
+    Serial.print(frame->len);
     Serial.println(" bytes.");
 
     // 设置固定的照片旋转角度(180度)
@@ -1055,7 +1510,7 @@ bool take_photo()
     Serial.println("Photo orientation set to 180 degrees (fixed).");
 
     lastActivity = millis(); // 注册活动
-    return true;
+    return frame;
 }
 
 /**
@@ -1098,8 +1553,9 @@ void handlePhotoControl(int8_t controlValue)
         Serial.println(" seconds");
 
         isCapturingPhotos = true;
-        lastCaptureTime = millis() - captureInterval; // 立即触发第一次拍照
+        lastCaptureTime = millis() - photoInterval(); // 立即触发第一次拍照
     }
+    wakePhotoTask(); // 不等拍照任务的下一次轮询
 }
 
 // ============================================================================
@@ -1117,12 +1573,11 @@ void handlePhotoControl(int8_t controlValue)
  * - 帧缓冲: PSRAM(节省内部RAM)
  *
  * 相机引脚配置从camera_pins.h获取
+ * 配置交给camera_power保存; 驱动在第一次拍照时初始化(拍照任务中),断电后重新初始化时同样使用
  */
 // -------------------------------------------------------------------------
 void configure_camera()
 {
-    Serial.println("Initializing camera...");
-
     // 配置相机参数结构体
     camera_config_t config;
     config.ledc_channel = LEDC_CHANNEL_0;
@@ -1152,40 +1607,544 @@ void configure_camera()
     // 使用config.h中优化的相机设置(针对电池寿命优化)
     config.frame_size = CAMERA_FRAME_SIZE;     // VGA 640x480
     config.pixel_format = PIXFORMAT_JPEG;      // JPEG格式
-    config.fb_count = 1;                       // 单帧缓冲
+    config.fb_count = CAMERA_FB_COUNT;         // 双帧缓冲(一帧上传时拍摄下一帧)
     config.jpeg_quality = CAMERA_JPEG_QUALITY; // JPEG质量25
     config.fb_location = CAMERA_FB_IN_PSRAM;   // 帧缓冲在PSRAM
     config.grab_mode = CAMERA_GRAB_LATEST;     // 获取最新帧
 
-    // 初始化相机
-    esp_err_t err = esp_camera_init(&config);
-    if (err != ESP_OK) {
-        Serial.printf("Camera init failed with error 0x%x\n", err);
-    } else {
-        Serial.println("Camera initialized successfully.");
-    }
+    camera_power_init(&config);
 }
 
 // ============================================================================
-// 主初始化和循环函数
+// 任务
 // ============================================================================
 
 // 照片分块传输缓冲区(全局静态变量)
 static uint8_t *s_compressed_frame_2 = nullptr;
 
+static TaskHandle_t audioCaptureTaskHandle = nullptr;
+static TaskHandle_t photoCaptureTaskHandle = nullptr;
+static TaskHandle_t photoUploadTaskHandle = nullptr;
+static SemaphoreHandle_t audioStopped = nullptr; // 采集任务停止麦克风后给出
+
+/**
+ * audioCaptureTask - 音频采集和编码任务
+ *
+ * 运行在核心1,优先级高于Arduino loop
+ * 由I2S驱动的DMA完成事件唤醒,每次得到一帧20ms的PCM数据,立即编码
+ * 等待期间让出CPU给低优先级任务; 编码完成的帧通过onOpusEncoded放入发送队列
+ */
+static void audioCaptureTask(void *param)
+{
+    while (true) {
+        if (!audioEnabled && mic_is_running()) {
+            // 关机: 不在读取中途卸载驱动
+            mic_stop();
+            xSemaphoreGive(audioStopped);
+        }
+        if (!audioEnabled || !mic_is_running() || mic_is_paused()) {
+            // 等待恢复采集或关机(wakeAudioTask)
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // 等待并读取一帧PCM数据(超时或溢出时返回0,重新等待)
+        if (mic_process() == 0) {
+            continue;
+        }
+        power_lock(POWER_LOCK_AUDIO);
+        opus_process(); // 编码(Opus或mu-law)
+        power_unlock(POWER_LOCK_AUDIO);
+    }
+}
+
+/**
+ * photoUploadPending - 是否还有照片等待上传(拍摄队列或已连接时的离线存储)
+ */
+static bool photoUploadPending()
+{
+    return uxQueueMessagesWaiting(photoQueue) > 0 || (connected && photo_store_count() > 0);
+}
+
+/**
+ * sendPhotoChunk - 发送一块照片数据
+ *
+ * 第一块包含旋转元数据(3字节头,缩略图另有PHOTO_META_THUMBNAIL标志),后续块只有帧序号(2字节头)
+ * 开启照片ID时第一块再加照片ID和本次传输的字节偏移(9字节头,PHOTO_META_ID标志)
+ * 每帧(含帧头)按协商的MTU填满,最多PHOTO_FRAME_MAX_SIZE字节
+ * 全部发送后发送结束标记(0xFF 0xFF)并释放相机帧缓冲区; 离线照片等协议栈确认发出后才从存储中删除
+ * (photoDeliveryCheck); 缩略图发完后接着发送完整照片
+ * 每帧放入BLE发送调度的照片队列,队列满时最多等待PHOTO_NOTIFY_TIMEOUT_MS,仍然满时下次重发同一帧
+ */
+static void sendPhotoChunk()
+{
+    size_t remaining = upload_len - sent_photo_bytes;
+    if (remaining > 0) {
+        size_t bytes_to_copy;
+        size_t frame_len;
+        size_t frame_size = photo_frame_size;
+
+        if (sent_photo_frames == 0) {
+            // 第一块: 包含旋转元数据(3字节头)
+            s_compressed_frame_2[0] = 0; // 帧序号低字节(固定为0)
+            s_compressed_frame_2[1] = 0; // 帧序号高字节(固定为0)
+            s_compressed_frame_2[2] = (uint8_t) current_photo_orientation; // 旋转角度
+            if (thumb_data) {
+                s_compressed_frame_2[2] |= PHOTO_META_THUMBNAIL;
+            }
+            size_t header = 3;
+            if (photoIdHeaders) {
+                // 照片ID和偏移: 应用断开重连后可以从收到的位置续传
+                s_compressed_frame_2[2] |= PHOTO_META_ID;
+                s_compressed_frame_2[3] = (uint8_t) (upload_id & 0xFF);
+                s_compressed_frame_2[4] = (uint8_t) (upload_id >> 8);
+                for (int i = 0; i < 4; i++) {
+                    s_compressed_frame_2[5 + i] = (uint8_t) (sent_photo_bytes >> (8 * i));
+                }
+                header = 9;
+            }
+            bytes_to_copy = (remaining > frame_size - header) ? frame_size - header : remaining; // 数据最多帧大小减帧头
+            memcpy(&s_compressed_frame_2[header], &upload_data[sent_photo_bytes], bytes_to_copy);
+            frame_len = bytes_to_copy + header;
+        } else {
+            // 后续块: 不包含元数据(2字节头)
+            s_compressed_frame_2[0] = (uint8_t) (sent_photo_frames & 0xFF);        // 帧序号低字节
+            s_compressed_frame_2[1] = (uint8_t) ((sent_photo_frames >> 8) & 0xFF); // 帧序号高字节
+            bytes_to_copy = (remaining > frame_size - 2) ? frame_size - 2 : remaining; // 数据最多帧大小-2字节
+            memcpy(&s_compressed_frame_2[2], &upload_data[sent_photo_bytes], bytes_to_copy);
+            frame_len = bytes_to_copy + 2;
+        }
+        if (!ble_tx_send(BLE_TX_PHOTO, photoDataCharacteristic, s_compressed_frame_2, frame_len,
+                         pdMS_TO_TICKS(PHOTO_NOTIFY_TIMEOUT_MS))) {
+            return; // 队列仍然满,下次重发
+        }
+
+        sent_photo_bytes += bytes_to_copy;
+        sent_photo_frames++;
+
+        lastActivity = millis(); // 注册活动
+    } else {
+        // 照片传输完成: 发送结束标记(0xFF 0xFF)
+        s_compressed_frame_2[0] = 0xFF;
+        s_compressed_frame_2[1] = 0xFF;
+        if (!ble_tx_send(BLE_TX_PHOTO, photoDataCharacteristic, s_compressed_frame_2, 2,
+                         pdMS_TO_TICKS(PHOTO_NOTIFY_TIMEOUT_MS))) {
+            return;
+        }
+        if (thumb_data) {
+            // 缩略图已发送: 接着上传完整照片
+            Serial.printf("Thumbnail sent: %u bytes in %u ms.\n", (unsigned) upload_len,
+                          (unsigned) (millis() - fb_upload_start));
+            photo_thumb_free(thumb_data);
+            thumb_data = nullptr;
+            upload_data = fb->buf;
+            upload_len = fb->len;
+            sent_photo_bytes = 0;
+            sent_photo_frames = 0;
+            fb_upload_start = millis();
+            return;
+        }
+        uint32_t upload_ms = millis() - fb_upload_start;
+        size_t sent_len = upload_len - upload_offset; // 续传时只统计本次发送的部分
+        Serial.printf("Photo %u upload complete: %u bytes in %u ms, %u chunks.\n", (unsigned) upload_id,
+                      (unsigned) sent_len, (unsigned) upload_ms, (unsigned) sent_photo_frames);
+        metrics_photo_uploaded(sent_len, upload_ms);
+
+        // 按本张照片的上传耗时调整下一张的分辨率和质量(续传的吞吐量同样有效,大小按整张照片)
+        if (upload_offset == 0) {
+            photo_adapt_upload_done(fb_level, upload_len, upload_ms);
+        }
+
+        if (!fb) {
+            // 结束标记只是排入了发送队列,确认发出之前照片留在存储中
+            delivery_pending = true;
+            delivery_start = millis();
+            return;
+        }
+        // 释放相机帧缓冲区,相机可以继续拍摄下一帧
+        camera_power_release(fb);
+        fb = nullptr;
+        Serial.println("Camera frame buffer freed.");
+        upload_data = nullptr;
+        power_unlock(POWER_LOCK_UPLOAD);
+        photoDataUploading = photoUploadPending();
+    }
+}
+
+/**
+ * photoCaptureTask - 照片拍摄任务
+ *
+ * 运行在核心0: 到达拍照间隔且照片队列有空位时拍摄
+ * 相机有CAMERA_FB_COUNT个帧缓冲区,上一张照片上传时可以拍摄和JPEG编码下一张
+ * 队列满时等待,正在上传的帧加上排队的帧不会超过帧缓冲区数量
+ * 间隔模式下场景没有变化的照片不上传(scene_change)
+ * 照片之间相机按拍照间隔温待机或断电(camera_power)
+ * 未连接时间隔拍照照常进行,照片存入离线存储(photo_store),连接后由上传任务上传
+ * WiFi相机预览期间相机只为视频流取帧,暂停拍照(camera_preview)
+ */
+static void photoCaptureTask(void *param)
+{
+    while (true) {
+        if (camera_preview_step()) {
+            vTaskDelay(pdMS_TO_TICKS(PREVIEW_POLL_MS));
+            continue;
+        }
+        unsigned long now = millis();
+
+        // 照片拍摄检查(间隔触发)
+        bool canCapture = connected ? uxQueueSpacesAvailable(photoQueue) > 0 : captureInterval > 0;
+        if (isCapturingPhotos && canCapture) {
+            // 检查是否到达拍照间隔
+            if ((captureInterval == 0) || (now - lastCaptureTime >= photoInterval())) {
+                bool singleShot = captureInterval == 0;
+                if (singleShot) {
+                    // 单次拍照模式: 拍完后停止
+                    isCapturingPhotos = false;
+                }
+                Serial.println("Interval reached. Capturing photo...");
+                power_lock(POWER_LOCK_CAMERA); // 拍摄、场景比较和离线存储期间提高频率
+                queued_photo_t photo;
+                camera_power_wake();               // 从温待机恢复只需一帧的时间
+                photo.level = photo_adapt_apply(); // 档位变化时先设置传感器
+                photo.frame = take_photo();
+                photo.id = nextPhotoId;
+                if (photo.frame && PHOTO_SCENE_DETECTION && !singleShot && !scene_change_check(photo.frame)) {
+                    // 场景没有变化: 不上传,等下一个间隔
+                    camera_power_release(photo.frame);
+                    lastCaptureTime = now;
+                } else if (photo.frame && !connected) {
+                    // 未连接: 存入离线存储,释放帧缓冲区
+                    lastCaptureTime = now;
+                    nextPhotoId++;
+                    if (photo_store_put(photo.frame->buf, photo.frame->len, photo.level, photo.id)) {
+                        Serial.printf("Photo stored offline (%u stored).\n", (unsigned) photo_store_count());
+                    } else {
+                        Serial.println("Photo could not be stored offline.");
+                    }
+                    camera_power_release(photo.frame);
+                } else if (photo.frame) {
+                    Serial.println("Photo capture successful. Queued for upload...");
+                    lastCaptureTime = now;
+                    nextPhotoId++;
+                    xQueueSend(photoQueue, &photo, 0); // 只有本任务写入,已确认有空位
+                    photoDataUploading = true;
+                }
+                power_unlock(POWER_LOCK_CAMERA);
+            }
+        }
+
+        // 空闲时温待机,长时间没有拍照时断电
+        camera_power_idle(isCapturingPhotos ? photoInterval() : 0);
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PHOTO_TASK_IDLE_MS)); // 拍照命令立即唤醒(wakePhotoTask)
+    }
+}
+
+/**
+ * applyPhotoResume - 处理应用的续传请求
+ *
+ * 请求的照片正在上传时立即从偏移处重新开始(跳过缩略图),否则保留到该照片开始上传
+ * 断开连接时丢弃: 重连后应用本来就会重新发送
+ */
+static void applyPhotoResume()
+{
+    static photo_resume_t resume;
+    static bool pending = false;
+
+    if (xQueueReceive(resumeQueue, &resume, 0) == pdTRUE) {
+        pending = true;
+    }
+    if (!connected) {
+        pending = false;
+    }
+    if (!pending || upload_data == nullptr || resume.id != upload_id) {
+        return;
+    }
+    pending = false;
+    delivery_pending = false; // 从偏移处重发,包括结束标记
+
+    if (thumb_data) {
+        photo_thumb_free(thumb_data);
+        thumb_data = nullptr;
+        upload_data = fb->buf;
+        upload_len = fb->len;
+    }
+    upload_offset = resume.offset < upload_len ? resume.offset : upload_len;
+    sent_photo_bytes = upload_offset;
+    sent_photo_frames = 0;
+    fb_upload_start = millis();
+    Serial.printf("Resuming photo %u at %u of %u bytes.\n", (unsigned) upload_id, (unsigned) upload_offset,
+                  (unsigned) upload_len);
+}
+
+/**
+ * photoDeliveryCheck - 离线照片的结束标记确认发出后从存储中删除
+ *
+ * 同一连接中照片的所有通知都回报发出时删除; PHOTO_DELIVERY_TIMEOUT_MS内没有确认时留在存储中,之后重新上传
+ * @return 是否仍在等待确认
+ */
+static bool photoDeliveryCheck()
+{
+    bool delivered = ble_tx_photo_flushed(upload_generation);
+    if (!delivered && millis() - delivery_start < PHOTO_DELIVERY_TIMEOUT_MS) {
+        return true;
+    }
+    delivery_pending = false;
+    photo_store_release(delivered);
+    if (!delivered) {
+        Serial.println("Stored photo not confirmed sent, kept for the next upload.");
+    }
+    upload_data = nullptr;
+    power_unlock(POWER_LOCK_UPLOAD);
+    photoDataUploading = photoUploadPending();
+    return false;
+}
+
+/**
+ * photoUploadTask - 照片上传任务
+ *
+ * 运行在核心0,优先级低于BLE发送调度任务:
+ * 分块上传再慢也只会被音频包抢占,不会让音频断续
+ * 照片帧经过BLE发送调度(ble_tx),通知窗口中始终为音频保留AUDIO_AIRTIME_RESERVE_PERCENT
+ * 断开连接时未传完的照片留在离线存储中,重连后应用可以按照片ID和字节偏移续传(applyPhotoResume)
+ */
+static void photoUploadTask(void *param)
+{
+    while (true) {
+        if (upload_data == nullptr) {
+            // 等待下一张照片: 先上传刚拍摄的,再上传离线存储中的
+            queued_photo_t photo;
+            if (xQueueReceive(photoQueue, &photo, pdMS_TO_TICKS(PHOTO_TASK_IDLE_MS)) == pdTRUE) {
+                fb = photo.frame;
+                upload_data = fb->buf;
+                upload_len = fb->len;
+                fb_level = photo.level;
+                upload_id = photo.id;
+                if (photo_thumb_enabled()) {
+                    // 渐进式传输: 先上传缩略图,应用可以提前显示和处理
+                    size_t thumb_len = 0;
+                    power_lock(POWER_LOCK_CAMERA);
+                    thumb_data = photo_thumb_make(fb, &thumb_len);
+                    power_unlock(POWER_LOCK_CAMERA);
+                    if (thumb_data) {
+                        upload_data = thumb_data;
+                        upload_len = thumb_len;
+                    }
+                }
+            } else if (connected && !photo_offload_is_busy() &&
+                       photo_store_peek(&upload_data, &upload_len, &fb_level, &upload_id)) {
+                fb = nullptr;
+                Serial.printf("Uploading stored photo (%u stored)...\n", (unsigned) photo_store_count());
+            } else {
+                continue;
+            }
+            fb_upload_start = millis();
+            power_lock(POWER_LOCK_UPLOAD); // 上传结束时释放
+            upload_generation = ble_tx_link_generation();
+            upload_offset = 0;
+            sent_photo_bytes = 0;
+            sent_photo_frames = 0;
+            photoDataUploading = true;
+            Serial.println("Starting upload...");
+        }
+        applyPhotoResume();
+
+        if (fb == nullptr && !connected) {
+            // 离线照片上传中(或等待确认时)断开连接: 留在存储中,下次连接重新上传
+            delivery_pending = false;
+            photo_store_release(false);
+            upload_data = nullptr;
+            power_unlock(POWER_LOCK_UPLOAD);
+            photoDataUploading = photoUploadPending();
+            continue;
+        }
+        if (fb != nullptr && !connected) {
+            // 新照片上传中断开连接: 存入离线存储,下次连接重新上传(缩略图可能已经送达)
+            if (photo_store_put(fb->buf, fb->len, fb_level, upload_id)) {
+                Serial.println("Upload interrupted, photo stored offline.");
+            }
+            photo_thumb_free(thumb_data);
+            thumb_data = nullptr;
+            camera_power_release(fb);
+            fb = nullptr;
+            upload_data = nullptr;
+            power_unlock(POWER_LOCK_UPLOAD);
+            photoDataUploading = photoUploadPending();
+            continue;
+        }
+
+        if (delivery_pending) {
+            if (photoDeliveryCheck()) {
+                vTaskDelay(pdMS_TO_TICKS(BLE_TX_RETRY_MS));
+            }
+            continue;
+        }
+
+        // 照片分块传输(发送调度按通知完成情况流控,链路允许多快就发多快)
+        if (s_compressed_frame_2) {
+            sendPhotoChunk();
+        } else {
+            photo_thumb_free(thumb_data);
+            thumb_data = nullptr;
+            if (fb) {
+                camera_power_release(fb);
+                fb = nullptr;
+            } else {
+                photo_store_release(false);
+            }
+            upload_data = nullptr;
+            power_unlock(POWER_LOCK_UPLOAD);
+            photoDataUploading = false;
+        }
+    }
+}
+
+/**
+ * audioStoreTask - 离线音频转存和发送任务
+ *
+ * 运行在核心0,优先级低于照片任务; 存储的音频经过BLE发送调度的BLE_TX_STORED类别,排在实时音频之后
+ * PSRAM超过一半时把最旧的音频转存到flash; 客户端订阅离线音频特性后从最旧的包开始发送
+ * 发送失败的包留在packet中下次重发
+ */
+static void audioStoreTask(void *param)
+{
+    static uint8_t packet[OPUS_OUTPUT_MAX_BYTES + AUDIO_PACKET_HEADER_SIZE];
+    uint16_t packet_len = 0;
+
+    while (true) {
+        audio_store_spill();
+
+#if BLE_NIMBLE
+        bool subscribed = audioStoredCharacteristic->getSubscribedCount() > 0;
+#else
+        bool subscribed = audioStoredCcc->getNotifications();
+#endif
+        if (!connected || !subscribed) {
+            vTaskDelay(pdMS_TO_TICKS(AUDIO_STORE_IDLE_MS));
+            continue;
+        }
+        if (packet_len == 0) {
+            packet_len = audio_store_get(packet, sizeof(packet));
+            if (packet_len == 0) {
+                vTaskDelay(pdMS_TO_TICKS(AUDIO_STORE_IDLE_MS));
+                continue;
+            }
+        }
+        if (ble_tx_send(BLE_TX_STORED, audioStoredCharacteristic, packet, packet_len,
+                        pdMS_TO_TICKS(AUDIO_STORE_SEND_WAIT_MS)) &&
+            connected) {
+            packet_len = 0;
+        }
+    }
+}
+
+/**
+ * batteryTask - 电池电量监控任务
+ *
+ * 运行在核心1,优先级与Arduino loop相同,低于音频采集: ADC采样期间音频随时可以抢占
+ * 读取间隔按放电斜率自适应(batteryRefreshIntervalMs),客户端连接时立即读取一次
+ */
+static void batteryTask(void *param)
+{
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(batteryRefreshIntervalMs()));
+        readBatteryLevel();
+        updateBatteryService(); // 通过BLE通知客户端
+        updateGovernor();
+    }
+}
+
+/**
+ * wakeAudioTask - 采集状态变化(恢复、关机)后唤醒空闲的采集任务
+ */
+static void wakeAudioTask()
+{
+    if (audioCaptureTaskHandle != nullptr) {
+        xTaskNotifyGive(audioCaptureTaskHandle);
+    }
+}
+
+/**
+ * wakePhotoTask - 拍照命令后唤醒拍照任务,单张拍照不用等下一次轮询
+ */
+static void wakePhotoTask()
+{
+    if (photoCaptureTaskHandle != nullptr) {
+        xTaskNotifyGive(photoCaptureTaskHandle);
+    }
+}
+
+/**
+ * stopAudioCapture - 关机时停止音频采集
+ *
+ * 采集任务看到audioEnabled为false后在两次读取之间停止麦克风,这里等到它完成
+ * (最多AUDIO_STOP_TIMEOUT_MS); 没有采集任务时直接停止
+ */
+static void stopAudioCapture()
+{
+    audioEnabled = false;
+    if (audioCaptureTaskHandle == nullptr) {
+        mic_stop();
+        return;
+    }
+    wakeAudioTask();
+    if (xSemaphoreTake(audioStopped, pdMS_TO_TICKS(AUDIO_STOP_TIMEOUT_MS)) != pdTRUE) {
+        Serial.println("Audio capture did not stop, sleeping anyway");
+    }
+}
+
+/**
+ * start_audio_task - 创建音频采集任务
+ *
+ * 启动时最先调用,不等BLE和相机; 连接前编码的音频进入离线存储
+ */
+void start_audio_task()
+{
+    audioStopped = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(audioCaptureTask, "audio_capture", AUDIO_TASK_STACK_SIZE, NULL, AUDIO_TASK_PRIORITY,
+                            &audioCaptureTaskHandle, AUDIO_TASK_CORE);
+}
+
+/**
+ * start_tasks - 创建照片队列、BLE发送调度和其余任务
+ *
+ * 音频采集和电池监控固定在核心1,BLE发送调度、照片和离线音频固定在核心0
+ * Arduino loop(核心1,优先级1)只做低优先级的周期性工作
+ */
+void start_tasks()
+{
+    photoQueue = xQueueCreate(PHOTO_QUEUE_DEPTH, sizeof(queued_photo_t));
+    resumeQueue = xQueueCreate(1, sizeof(photo_resume_t));
+    // 离线存储和应用的续传状态跨越重启保留照片ID; 每次启动从0开始会和上次的照片重复
+    nextPhotoId = (uint16_t) esp_random();
+
+    ble_tx_init(); // BLE发送调度任务
+    xTaskCreatePinnedToCore(photoCaptureTask, "photo_capture", CAMERA_TASK_STACK_SIZE, NULL, CAMERA_TASK_PRIORITY,
+                            &photoCaptureTaskHandle, CAMERA_TASK_CORE);
+    xTaskCreatePinnedToCore(photoUploadTask, "photo_upload", CAMERA_TASK_STACK_SIZE, NULL, CAMERA_TASK_PRIORITY,
+                            &photoUploadTaskHandle, CAMERA_TASK_CORE);
+    if (AUDIO_STORE_ENABLE && audio_store_available()) {
+        xTaskCreatePinnedToCore(audioStoreTask, "audio_store", AUDIO_STORE_TASK_STACK_SIZE, NULL,
+                                AUDIO_STORE_TASK_PRIORITY, NULL, AUDIO_STORE_TASK_CORE);
+    }
+    xTaskCreatePinnedToCore(batteryTask, "battery", BATTERY_TASK_STACK_SIZE, NULL, BATTERY_TASK_PRIORITY,
+                            &batteryTaskHandle, BATTERY_TASK_CORE);
+    xTaskNotifyGive(batteryTaskHandle); // 第一次读数不等读取间隔
+}
+
+// ============================================================================
+// 主初始化和循环函数
+// ============================================================================
+
 /**
  * setup_app - 应用初始化函数
  *
- * 在系统启动时调用一次,初始化所有硬件和软件模块:
- * 1. 串口通信(921600波特率)
- * 2. GPIO配置(按钮、LED)
- * 3. 按钮中断
- * 4. CPU频率设置(80MHz)
- * 5. BLE服务
- * 6. 相机模块
- * 7. 照片传输缓冲区
- * 8. 电池监控ADC
- * 9. 音频子系统(麦克风+Opus编码)
+ * 在系统启动时调用一次,按产生音频的先后排列,按钮唤醒后尽快有音频:
+ * 1. 串口通信(921600波特率)、GPIO、按钮中断
+ * 2. CPU频率设置(80MHz)
+ * 3. 音频子系统(麦克风+Opus编码)和音频采集任务
+ * 4. BLE服务和广播
+ * 5. 相机配置(驱动在拍照任务第一次拍照时初始化)、照片传输缓冲区
+ * 6. BLE发送调度、照片和电池任务(电池任务立即读取一次)
  *
  * 初始化完成后,设备进入正常运行状态
  */
@@ -1213,84 +2172,82 @@ void setup_app()
     // 电源优化配置
     // ========================================================================
     setCpuFrequencyMhz(NORMAL_CPU_FREQ_MHZ); // 设置CPU频率为80MHz
+    power_init();                            // 支持时改为按负载锁调频
     lastActivity = millis();
 
     // ========================================================================
-    // 初始化BLE和相机
+    // 音频最先启动: 按钮唤醒后尽快开始采集(连接前的音频进入离线存储)
     // ========================================================================
-    configure_ble();    // 配置BLE服务和特性
-    configure_camera(); // 配置相机模块
+    if (AUDIO_STORE_ENABLE) {
+        audio_store_init(); // 没有客户端接收时的离线音频存储
+    }
+    if (opus_encoder_init()) {
+        opus_set_callback(onOpusEncoded); // 设置Opus编码完成回调
+        if (mic_start()) {
+#if AUDIO_BENCH
+            audio_bench_run();                // 先用同一段录音测量增益、编码和发送队列,结果打印到串口
+            opus_set_callback(onOpusEncoded); // 测量时换成了测量自己的回调
+#endif
+            mic_set_callback(onMicData); // 设置麦克风数据回调
+            updateMicCapture();          // 没有离线存储时客户端订阅前暂停
+            start_audio_task();
+            Serial.printf("Audio capture started %u ms after boot.\n", (unsigned) millis());
+        } else {
+            Serial.println("Failed to start microphone!");
+        }
+    } else {
+        Serial.println("Failed to initialize Opus encoder!");
+    }
+
+    // ========================================================================
+    // 然后是BLE广播
+    // ========================================================================
+    analogReadResolution(12);                           // 电池ADC: 12位(0-4095)
+    analogSetPinAttenuation(BATTERY_ADC_PIN, ADC_11db); // 11dB衰减(0-3.3V范围),第一次读数在电池任务中
+    configure_ble(); // 配置BLE服务和特性,开始广播
 
     // ========================================================================
-    // 分配照片传输缓冲区
+    // 相机和照片: 相机在拍照任务第一次拍照时才初始化
     // ========================================================================
-    // 200字节数据 + 2字节帧序号 = 202字节
-    s_compressed_frame_2 = (uint8_t *) ps_calloc(202, sizeof(uint8_t));
+    configure_camera(); // 只保存相机配置
+    photo_adapt_init(); // 照片档位从最好开始,按上传吞吐量调整
+    photo_store_init(); // 断开连接时的离线照片存储
+
+    // 照片分块传输缓冲区: 最多PHOTO_FRAME_MAX_SIZE字节(含帧头)
+    // 每块照片数据都经过此缓冲区,放在内部DRAM; 照片本身在PSRAM的相机帧缓冲区中
+    s_compressed_frame_2 = (uint8_t *) mem_alloc_hot(PHOTO_FRAME_MAX_SIZE, "Photo chunk buffer");
     if (!s_compressed_frame_2) {
         Serial.println("Failed to allocate chunk buffer!");
     } else {
-        Serial.println("Chunk buffer allocated successfully.");
+        memset(s_compressed_frame_2, 0, PHOTO_FRAME_MAX_SIZE);
     }
 
-    // ========================================================================
-    // 设置默认拍照间隔
-    // ========================================================================
+    // 默认间隔拍照,立即触发第一次拍照
     isCapturingPhotos = true;
     captureInterval = PHOTO_CAPTURE_INTERVAL_MS; // 30秒
-    lastCaptureTime = millis() - captureInterval; // 立即触发第一次拍照
-    Serial.print("Default capture interval set to ");
-    Serial.print(PHOTO_CAPTURE_INTERVAL_MS / 1000);
-    Serial.println(" seconds.");
-
-    // ========================================================================
-    // 配置电池电压分压器ADC
-    // ========================================================================
-    analogReadResolution(12);                           // 12位ADC分辨率(0-4095)
-    analogSetPinAttenuation(BATTERY_ADC_PIN, ADC_11db); // 11dB衰减(0-3.3V范围)
-
-    // 初始电池读数
-    readBatteryLevel();
+    lastCaptureTime = millis() - captureInterval;
     deviceState = DEVICE_ACTIVE; // 设备进入活跃状态
 
     // ========================================================================
-    // 初始化音频子系统
+    // 启动BLE发送调度、照片和电池任务
     // ========================================================================
-    Serial.println("Initializing audio subsystem...");
-    if (opus_encoder_init()) {
-        // 设置Opus编码完成回调
-        opus_set_callback(onOpusEncoded);
+    start_tasks();
 
-        // 启动麦克风
-        if (mic_start()) {
-            // 设置麦克风数据回调
-            mic_set_callback(onMicData);
-            Serial.println("Audio subsystem initialized successfully.");
-        } else {
-            Serial.println("Failed to start microphone!");
-        }
-    } else {
-        Serial.println("Failed to initialize Opus encoder!");
-    }
-
-    Serial.println("Setup complete.");
-    Serial.println("Light sleep optimization enabled for extended battery life.");
+    Serial.printf("Setup complete in %u ms.\n", (unsigned) millis());
 }
 
 /**
- * loop_app - 应用主循环
+ * loop_app - 应用主循环(低优先级周期性工作)
  *
- * 在setup_app()完成后持续循环执行
- * 任务优先级(从高到低):
+ * 在setup_app()完成后持续循环执行,运行在核心1,优先级低于音频采集任务
+ * 音频和照片在各自的任务中处理,这里只做:
  * 1. 按钮处理(用户交互)
  * 2. LED更新(视觉反馈)
- * 3. OTA升级(安全优先)
- * 4. 音频处理(实时性要求高)
- * 5. 音频传输(优先于照片)
- * 6. 电源管理(省电优化)
- * 7. 电池监控(每20秒)
- * 8. 照片拍摄(每30秒)
- * 9. 照片传输(分块,与音频交错)
- * 10. 轻度睡眠(空闲时)
+ * 3. OTA升级(安全优先)和离线照片WiFi上传
+ * 4. 电源管理(省电优化)
+ * 5. 性能遥测(周期统计和通知)
+ * 6. 轻度睡眠(空闲时)
+ * 电池监控在电池任务中,间隔按放电斜率自适应
  *
  * 电源管理策略:
  * - 活跃时: 80MHz CPU
@@ -1310,146 +2267,44 @@ void loop_app()
     // 2. LED状态更新
     // ========================================================================
     updateLED();
+    updateAdvertising(); // 断开后的快速广播窗口结束时退回省电间隔
 
     // ========================================================================
-    // 3. OTA升级处理
+    // 3. OTA升级和离线照片WiFi上传
     // ========================================================================
     ota_loop();
-
-    // ========================================================================
-    // 4. 音频数据处理(实时性要求高,总是运行)
-    // ========================================================================
-    if (audioEnabled && mic_is_running()) {
-        mic_process();   // 从I2S读取PCM数据
-        opus_process();  // Opus编码
+    if (governor_offload_allowed()) {
+        photo_offload_loop(); // 离线照片较多时通过WiFi上传,低电量档位不自动上传
     }
 
     // ========================================================================
-    // 5. 音频传输(优先于照片传输)
-    // ========================================================================
-    if (connected && audioSubscribed) {
-        processAudioTx(); // 发送音频包
-    }
-
-    // ========================================================================
-    // 6. 电源管理(省电模式切换)
+    // 4. 电源管理(省电模式切换)
     // ========================================================================
     // 未连接且45秒无活动: 进入省电模式(40MHz)
-    if (!connected && !photoDataUploading && (now - lastActivity > IDLE_THRESHOLD_MS)) {
+    bool uploading = photoDataUploading || photo_offload_is_busy() || camera_preview_is_busy(); // WiFi需要80MHz
+    if (!connected && !uploading && (now - lastActivity > IDLE_THRESHOLD_MS)) {
         enterPowerSave();
     }
     // 已连接或正在上传: 退出省电模式(80MHz)
-    else if (connected || photoDataUploading) {
+    else if (connected || uploading) {
         if (powerSaveMode)
             exitPowerSave();
         lastActivity = now;
     }
 
-    // ========================================================================
-    // 7. 电池电量监控(每20秒检查一次)
-    // ========================================================================
-    if (now - lastBatteryCheck >= BATTERY_TASK_INTERVAL_MS) {
-        readBatteryLevel();
-        updateBatteryService(); // 通过BLE通知客户端
-        lastBatteryCheck = now;
-    }
-
-    // 首次连接时强制更新电池电量
-    static bool firstBatteryUpdate = true;
-    if (connected && firstBatteryUpdate) {
-        readBatteryLevel();
-        updateBatteryService();
-        firstBatteryUpdate = false;
-    }
+    // 电池电量监控在电池任务中(batteryTask)
 
     // ========================================================================
-    // 8. 照片拍摄检查(间隔触发)
+    // 5. 性能遥测(每METRICS_PERIOD_MS一个周期)
     // ========================================================================
-    if (isCapturingPhotos && !photoDataUploading && connected) {
-        // 检查是否到达拍照间隔
-        if ((captureInterval == 0) || (now - lastCaptureTime >= (unsigned long) captureInterval)) {
-            if (captureInterval == 0) {
-                // 单次拍照模式: 拍完后停止
-                isCapturingPhotos = false;
-            }
-            Serial.println("Interval reached. Capturing photo...");
-            if (take_photo()) {
-                Serial.println("Photo capture successful. Starting upload...");
-                photoDataUploading = true;
-                sent_photo_bytes = 0;
-                sent_photo_frames = 0;
-                lastCaptureTime = now;
-            }
-        }
+    static unsigned long lastMetrics = 0;
+    if (now - lastMetrics >= METRICS_PERIOD_MS) {
+        updateMetrics();
+        lastMetrics = now;
     }
 
     // ========================================================================
-    // 9. 照片分块传输(与音频交错,每次循环最多发2块)
-    // ========================================================================
-    static int photo_chunks_this_loop = 0;
-    if (photoDataUploading && fb && photo_chunks_this_loop < 2) {
-        // 如果音频缓冲区有数据,优先发送音频
-        if (audioSubscribed && audio_tx_read_pos != audio_tx_write_pos) {
-            photo_chunks_this_loop = 0; // 本次循环重置,下次继续
-        } else {
-            photo_chunks_this_loop++; // 计数本次循环发送的块数
-        }
-
-        size_t remaining = fb->len - sent_photo_bytes;
-        if (remaining > 0) {
-            size_t bytes_to_copy;
-
-            if (sent_photo_frames == 0) {
-                // 第一块: 包含旋转元数据(3字节头)
-                s_compressed_frame_2[0] = 0; // 帧序号低字节(固定为0)
-                s_compressed_frame_2[1] = 0; // 帧序号高字节(固定为0)
-                s_compressed_frame_2[2] = (uint8_t) current_photo_orientation; // 旋转角度
-                bytes_to_copy = (remaining > 199) ? 199 : remaining; // 数据最多199字节
-                memcpy(&s_compressed_frame_2[3], &fb->buf[sent_photo_bytes], bytes_to_copy);
-                photoDataCharacteristic->setValue(s_compressed_frame_2, bytes_to_copy + 3);
-            } else {
-                // 后续块: 不包含元数据(2字节头)
-                s_compressed_frame_2[0] = (uint8_t) (sent_photo_frames & 0xFF);        // 帧序号低字节
-                s_compressed_frame_2[1] = (uint8_t) ((sent_photo_frames >> 8) & 0xFF); // 帧序号高字节
-                bytes_to_copy = (remaining > 200) ? 200 : remaining; // 数据最多200字节
-                memcpy(&s_compressed_frame_2[2], &fb->buf[sent_photo_bytes], bytes_to_copy);
-                photoDataCharacteristic->setValue(s_compressed_frame_2, bytes_to_copy + 2);
-            }
-            photoDataCharacteristic->notify(); // 发送BLE通知
-
-            sent_photo_bytes += bytes_to_copy;
-            sent_photo_frames++;
-
-            Serial.print("Uploading chunk ");
-            Serial.print(sent_photo_frames);
-            Serial.print(" (");
-            Serial.print(bytes_to_copy);
-            Serial.print(" bytes), ");
-            Serial.print(remaining - bytes_to_copy);
-            Serial.println(" bytes remaining.");
-
-            lastActivity = now; // 注册活动
-        } else {
-            // 照片传输完成: 发送结束标记(0xFF 0xFF)
-            s_compressed_frame_2[0] = 0xFF;
-            s_compressed_frame_2[1] = 0xFF;
-            photoDataCharacteristic->setValue(s_compressed_frame_2, 2);
-            photoDataCharacteristic->notify();
-            Serial.println("Photo upload complete.");
-
-            photoDataUploading = false;
-            // 释放相机帧缓冲区
-            esp_camera_fb_return(fb);
-            fb = nullptr;
-            Serial.println("Camera frame buffer freed.");
-            photo_chunks_this_loop = 0; // 重置计数器
-        }
-    } else {
-        photo_chunks_this_loop = 0; // 未上传时重置
-    }
-
-    // ========================================================================
-    // 10. 轻度睡眠优化(空闲时节省功耗)
+    // 6. 轻度睡眠优化(空闲时节省功耗)
     // ========================================================================
     // 当没有照片上传且没有音频订阅时启用轻度睡眠
     if (!photoDataUploading && !audioSubscribed) {
@@ -1457,13 +2312,7 @@ void loop_app()
     }
 
     // ========================================================================
-    // 循环延迟(根据任务状态自适应)
+    // 循环延迟(音频和照片在各自的任务中,不受此延迟影响)
     // ========================================================================
-    if (photoDataUploading || audioSubscribed) {
-        delay(5); // 上传或音频活跃时: 快速循环(5ms)
-    } else if (powerSaveMode) {
-        delay(50); // 省电模式: 减少循环频率(50ms)
-    } else {
-        delay(50); // 正常模式: 减少循环频率(50ms)
-    }
+    delay(HOUSEKEEPING_INTERVAL_MS);
 }
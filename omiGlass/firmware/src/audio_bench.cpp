@@ -0,0 +1,225 @@
+/**
+ * 音频链路测量模块 - 在板上回放同一段PCM,测量增益、编码和发送环形缓冲区
+ *
+ * 主要功能:
+ * 1. 录制AUDIO_BENCH_RECORD_MS的麦克风PCM到PSRAM(或生成可重复的合成语音)
+ * 2. 回放: opus_receive_pcm(增益和去直流) -> opus_process(编码) -> 音频发送环形缓冲区
+ *    模拟的BLE链路每帧取走AUDIO_BENCH_DRAIN_PER_FRAME个包,并周期性停顿(拍照占用空口)
+ * 3. 环形缓冲区分别放在内部DRAM和PSRAM各跑一次,比较内存位置的影响
+ * 4. 打印每帧编码时间(平均/p50/p99/最长)、环形缓冲区吞吐量和丢包数,以及PASS/FAIL
+ *
+ * 只在AUDIO_BENCH构建中启动时运行一次,测量期间没有其他任务使用编码器
+ */
+#include "audio_bench.h"
+
+#include <esp_timer.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "mem_placement.h"
+#include "mic.h"
+#include "opus_encoder.h"
+#include "pipeline.h"
+
+#if AUDIO_BENCH
+
+#define BENCH_FRAME_US (OPUS_FRAME_SAMPLES * 1000000ULL / MIC_SAMPLE_RATE)
+#define BENCH_FRAMES (AUDIO_BENCH_RECORD_MS * MIC_SAMPLE_RATE / 1000 / OPUS_FRAME_SAMPLES)
+#define BENCH_TWO_PI 6.2831853f
+
+static_assert((AUDIO_TX_RING_BYTES & (AUDIO_TX_RING_BYTES - 1)) == 0, "AUDIO_TX_RING_BYTES must be a power of two");
+
+static int16_t *pcm = nullptr;         // 录音(PSRAM)
+static volatile size_t pcm_len = 0;    // 已录制的采样点数
+static struct pipe_ring ring;          // 模拟的音频发送队列
+static uint16_t *encode_us = nullptr;  // 本轮每帧的编码时间
+static uint32_t frame_count = 0;       // 本轮已编码的帧数
+static uint64_t ring_us = 0;           // 本轮环形缓冲区存取的总时间
+static uint64_t ring_bytes = 0;        // 本轮存取的字节数
+static uint32_t packet_index = 0;      // 包序号,格式同broadcastAudioPacket
+
+/**
+ * bench_record - 录音回调,把原始麦克风数据追加到录音缓冲区
+ */
+static void bench_record(int16_t *data, size_t samples)
+{
+    size_t room = BENCH_FRAMES * OPUS_FRAME_SAMPLES - pcm_len;
+    if (samples > room) {
+        samples = room;
+    }
+    memcpy(pcm + pcm_len, data, samples * sizeof(int16_t));
+    pcm_len += samples;
+}
+
+/**
+ * bench_synthesize - 生成合成语音: 基频滑动的谐波加音节包络和少量噪声,每次运行都相同
+ */
+static void bench_synthesize()
+{
+    uint32_t noise = 0x12345678;
+    for (size_t i = 0; i < BENCH_FRAMES * OPUS_FRAME_SAMPLES; i++) {
+        float t = (float) i / MIC_SAMPLE_RATE;
+        float f0 = 140.0f + 40.0f * sinf(BENCH_TWO_PI * 0.7f * t);
+        float envelope = 0.5f + 0.5f * sinf(BENCH_TWO_PI * 4.0f * t);
+        float voiced = 0;
+        for (int h = 1; h <= 6; h++) {
+            voiced += sinf(BENCH_TWO_PI * f0 * h * t) / h;
+        }
+        noise = noise * 1664525u + 1013904223u;
+        // 原始麦克风电平: MIC_GAIN在回放时由opus_receive_pcm施加
+        pcm[i] = (int16_t) (envelope * voiced * 3000.0f / MIC_GAIN + (int16_t) (noise >> 16) / 64);
+    }
+    pcm_len = BENCH_FRAMES * OPUS_FRAME_SAMPLES;
+}
+
+/**
+ * bench_encoded - 编码回调,加上包头放入环形缓冲区(同broadcastAudioPacket)
+ */
+static void bench_encoded(uint8_t *data, size_t len)
+{
+    uint8_t header[AUDIO_PACKET_HEADER_SIZE];
+    pipe_frame_header(header, (uint16_t) packet_index++, 0);
+    int64_t start = esp_timer_get_time();
+    if (pipe_ring_put_parts(&ring, header, sizeof(header), data, len)) {
+        ring_bytes += sizeof(header) + len;
+    }
+    ring_us += esp_timer_get_time() - start;
+}
+
+/**
+ * bench_drain - 模拟的BLE链路取走最多count个包
+ */
+static void bench_drain(uint32_t count)
+{
+    uint8_t packet[OPUS_OUTPUT_MAX_BYTES + AUDIO_PACKET_HEADER_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        int64_t start = esp_timer_get_time();
+        uint16_t len = pipe_ring_get(&ring, packet, sizeof(packet));
+        ring_us += esp_timer_get_time() - start;
+        if (len == 0) {
+            break;
+        }
+        ring_bytes += len;
+    }
+}
+
+static int compare_u16(const void *a, const void *b)
+{
+    return (int) *(const uint16_t *) a - (int) *(const uint16_t *) b;
+}
+
+/**
+ * bench_pass - 环形缓冲区放在ring_buf上回放录音AUDIO_BENCH_PASSES遍
+ *
+ * 开始前重置编码器: 否则后一种位置从前一种预热过的编码器历史和自适应复杂度开始,两者没有可比性
+ *
+ * @returns {bool} 编码时间和丢包数都在AUDIO_BENCH_GATE_*范围内返回true
+ */
+static bool bench_pass(uint8_t *ring_buf, const char *placement)
+{
+    opus_encoder_reset(); // 每种位置都从同样的编码器状态开始
+    packet_index = 0;
+    pipe_ring_init(&ring, ring_buf, AUDIO_TX_RING_BYTES);
+    frame_count = 0;
+    ring_us = 0;
+    ring_bytes = 0;
+    uint64_t gain_us = 0;
+    uint64_t encode_total_us = 0;
+
+    for (uint32_t pass = 0; pass < AUDIO_BENCH_PASSES; pass++) {
+        for (uint32_t f = 0; f < BENCH_FRAMES; f++) {
+            int64_t start = esp_timer_get_time();
+            opus_receive_pcm(pcm + f * OPUS_FRAME_SAMPLES, OPUS_FRAME_SAMPLES);
+            int64_t received = esp_timer_get_time();
+            uint64_t ring_before = ring_us;
+            opus_process();
+            int64_t done = esp_timer_get_time();
+
+            gain_us += received - start;
+            uint32_t us = (uint32_t) (done - received - (ring_us - ring_before));
+            if (frame_count < BENCH_FRAMES * AUDIO_BENCH_PASSES) {
+                encode_us[frame_count++] = (uint16_t) (us > UINT16_MAX ? UINT16_MAX : us);
+            }
+            encode_total_us += us;
+
+            // 每AUDIO_BENCH_STALL_EVERY帧链路停顿AUDIO_BENCH_STALL_FRAMES帧
+            uint32_t n = pass * BENCH_FRAMES + f;
+            if (n % AUDIO_BENCH_STALL_EVERY >= AUDIO_BENCH_STALL_FRAMES) {
+                bench_drain(AUDIO_BENCH_DRAIN_PER_FRAME);
+            }
+        }
+    }
+    bench_drain(UINT32_MAX); // 最后全部取走
+
+    qsort(encode_us, frame_count, sizeof(encode_us[0]), compare_u16);
+    uint32_t p50 = encode_us[frame_count / 2];
+    uint32_t p99 = encode_us[frame_count * 99 / 100];
+    uint32_t max = encode_us[frame_count - 1];
+    uint32_t drops = ring.dropped; // 生产者已停止写入
+    uint32_t samples = frame_count * OPUS_FRAME_SAMPLES;
+
+    Serial.printf("Audio bench [%s ring]: %u frames at %u MHz, budget %u us per frame\n", placement,
+                  (unsigned) frame_count, (unsigned) getCpuFrequencyMhz(), (unsigned) BENCH_FRAME_US);
+    Serial.printf("  gain: %u ns per sample\n", (unsigned) (gain_us * 1000 / samples));
+    Serial.printf("  encode: avg %u us, p50 %u us, p99 %u us, max %u us per frame (%u%% of budget at p99)\n",
+                  (unsigned) (encode_total_us / frame_count), (unsigned) p50, (unsigned) p99,
+                  (unsigned) max, (unsigned) (p99 * 100 / BENCH_FRAME_US));
+    Serial.printf("  ring: %u bytes in %u us (%u kB/s), %u drops\n", (unsigned) ring_bytes, (unsigned) ring_us,
+                  (unsigned) (ring_us ? ring_bytes * 1000 / ring_us : 0), (unsigned) drops);
+
+    return p99 * 100 <= BENCH_FRAME_US * AUDIO_BENCH_GATE_ENCODE_PERCENT && drops <= AUDIO_BENCH_GATE_DROPS;
+}
+
+/**
+ * audio_bench_run - 录音(或合成),然后在两种环形缓冲区位置上回放测量
+ *
+ * @returns {bool} 全部通过返回true
+ */
+bool audio_bench_run()
+{
+    pcm = (int16_t *) mem_alloc_bulk(BENCH_FRAMES * OPUS_FRAME_SAMPLES * sizeof(int16_t), "Bench PCM");
+    encode_us = (uint16_t *) mem_alloc_hot(BENCH_FRAMES * AUDIO_BENCH_PASSES * sizeof(uint16_t), "Bench times");
+    uint8_t *hot_ring = (uint8_t *) mem_alloc_hot(AUDIO_TX_RING_BYTES, "Bench DRAM ring");
+    uint8_t *bulk_ring = (uint8_t *) mem_alloc_bulk(AUDIO_TX_RING_BYTES, "Bench PSRAM ring");
+    bool pass = pcm != nullptr && encode_us != nullptr && hot_ring != nullptr && bulk_ring != nullptr;
+    if (!pass) {
+        Serial.println("Audio bench: not enough memory");
+    }
+
+    if (pass && AUDIO_BENCH_SOURCE_MIC) {
+        Serial.printf("Audio bench: recording %u ms from the microphone...\n", (unsigned) AUDIO_BENCH_RECORD_MS);
+        pcm_len = 0;
+        mic_set_callback(bench_record);
+        uint32_t started = millis();
+        while (pcm_len < BENCH_FRAMES * OPUS_FRAME_SAMPLES && millis() - started < 2 * AUDIO_BENCH_RECORD_MS) {
+            mic_process();
+        }
+        mic_set_callback(nullptr);
+        if (pcm_len < BENCH_FRAMES * OPUS_FRAME_SAMPLES) {
+            Serial.printf("Audio bench: only %u samples recorded, using the synthetic signal\n", (unsigned) pcm_len);
+            bench_synthesize();
+        }
+    } else if (pass) {
+        bench_synthesize();
+    }
+
+    if (pass) {
+        opus_set_callback(bench_encoded);
+        pass = bench_pass(hot_ring, "DRAM");
+        pass = bench_pass(bulk_ring, "PSRAM") && pass;
+        opus_set_callback(nullptr);
+        Serial.printf("Audio bench: %s (p99 encode <= %u%% of the frame, <= %u drops)\n", pass ? "PASS" : "FAIL",
+                      (unsigned) AUDIO_BENCH_GATE_ENCODE_PERCENT, (unsigned) AUDIO_BENCH_GATE_DROPS);
+    }
+
+    mem_free(pcm);
+    mem_free(encode_us);
+    mem_free(hot_ring);
+    mem_free(bulk_ring);
+    pcm = nullptr;
+    encode_us = nullptr;
+    return pass;
+}
+
+#endif // AUDIO_BENCH
@@ -0,0 +1,19 @@
+#ifndef AUDIO_BENCH_H
+#define AUDIO_BENCH_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Audio path benchmark (AUDIO_BENCH): a few seconds of microphone PCM are recorded to PSRAM once,
+// then replayed through the real gain loop, encoder and an audio TX ring drained at a fixed rate.
+// The same recording runs with the ring in internal DRAM and in PSRAM, so placement and ring
+// changes can be compared on one board. Results and a PASS/FAIL line go to Serial.
+
+/**
+ * @brief Run the benchmark, the microphone must be started and nothing else may use the encoder
+ *        (call from setup, before the audio task). Replaces the mic and encoder callbacks.
+ * @return true if every run stayed within the AUDIO_BENCH_GATE_* limits
+ */
+bool audio_bench_run();
+
+#endif // AUDIO_BENCH_H
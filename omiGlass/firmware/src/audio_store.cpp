@@ -0,0 +1,214 @@
+/**
+ * 离线音频存储模块 - 没有客户端接收音频时保存音频包,重新连接后发送
+ *
+ * 主要功能:
+ * 1. PSRAM中的帧环形缓冲区(pipe_ring),音频任务写入,存储任务读出,无锁
+ * 2. 环形缓冲区超过一半时存储任务把最旧的包按扇区转存到flash分区(AUDIO_STORE_PARTITION)
+ *    flash是扇区的环; 没有该分区时只用PSRAM
+ * 3. 两者都满时丢弃新的音频包
+ * 4. 从最旧的包开始取出: flash中的扇区, 正在拼接的扇区, PSRAM环形缓冲区
+ *
+ * 扇区格式: 若干个[长度(2字节,小端), 音频包], 剩余部分为0xFF(长度0xFFFF表示扇区结束)
+ * 索引只在内存中,重启后flash中的音频不再读取
+ * 转存和取出都在存储任务中,擦写flash不会阻塞音频任务
+ */
+#include "audio_store.h"
+
+#include "config.h"
+#include "esp_partition.h"
+#include "mem_placement.h"
+#include "pipeline.h"
+
+static_assert((AUDIO_STORE_RAM_BYTES & (AUDIO_STORE_RAM_BYTES - 1)) == 0,
+              "AUDIO_STORE_RAM_BYTES must be a power of two");
+
+#define SECTOR_LEN_SIZE 2     // 扇区中每个包的长度字段
+#define SECTOR_END 0xFFFF     // 擦除后的长度字段,表示扇区结束
+
+static struct pipe_ring ram_ring;                  // PSRAM中的音频包(最新)
+static const esp_partition_t *partition = nullptr; // 转存分区,nullptr表示只用PSRAM
+static uint8_t *write_sector = nullptr;            // 正在拼接的扇区(比flash中的新,比PSRAM中的旧)
+static uint8_t *read_sector = nullptr;             // 正在取出的flash扇区
+static uint32_t write_len = 0;                     // write_sector中已拼接的字节数
+static uint32_t write_read = 0;                    // write_sector中已取出的字节数
+static uint32_t read_pos = 0;                      // read_sector中已取出的字节数
+static bool read_loaded = false;                   // 最旧的flash扇区是否已读到read_sector
+static uint16_t flash_sectors = 0;                 // 扇区数
+static uint16_t flash_head = 0;                    // 下一个写入的扇区
+static volatile uint16_t flash_count = 0;          // 已写入的扇区数
+
+/**
+ * audio_store_init - 分配PSRAM环形缓冲区并查找flash分区
+ */
+void audio_store_init()
+{
+    uint8_t *buf = (uint8_t *) mem_alloc_bulk(AUDIO_STORE_RAM_BYTES, "Audio store");
+    if (buf == nullptr) {
+        Serial.println("Audio store unavailable, offline audio is dropped");
+        return;
+    }
+    pipe_ring_init(&ram_ring, buf, AUDIO_STORE_RAM_BYTES);
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, AUDIO_STORE_PARTITION);
+    if (partition != nullptr) {
+        write_sector = (uint8_t *) mem_alloc_bulk(AUDIO_STORE_SECTOR_BYTES, "Audio store write");
+        read_sector = (uint8_t *) mem_alloc_bulk(AUDIO_STORE_SECTOR_BYTES, "Audio store read");
+        size_t sectors = partition->size / AUDIO_STORE_SECTOR_BYTES;
+        flash_sectors = sectors > 0xFFFF ? 0xFFFF : sectors;
+        if (write_sector == nullptr || read_sector == nullptr || flash_sectors == 0) {
+            partition = nullptr;
+            flash_sectors = 0;
+        }
+    }
+    Serial.printf("Audio store: %u KB in PSRAM, %u KB in flash\n", (unsigned) (AUDIO_STORE_RAM_BYTES / 1024),
+                  (unsigned) (flash_sectors * (AUDIO_STORE_SECTOR_BYTES / 1024)));
+}
+
+/**
+ * audio_store_available - PSRAM环形缓冲区是否可用
+ */
+bool audio_store_available()
+{
+    return ram_ring.buf != nullptr;
+}
+
+/**
+ * audio_store_put - 保存一个音频包
+ *
+ * @param {const uint8_t*} packet - 音频包(包头和编码数据)
+ * @param {size_t} len - 包长度
+ * @returns {bool} 保存成功返回true
+ */
+bool audio_store_put(const uint8_t *packet, size_t len)
+{
+    if (ram_ring.buf == nullptr || len == 0 || len > AUDIO_STORE_SECTOR_BYTES - SECTOR_LEN_SIZE) {
+        return false;
+    }
+    return pipe_ring_put(&ram_ring, packet, len);
+}
+
+/**
+ * audio_store_bytes - 已存储的字节数(包括长度字段,flash按整个扇区)
+ */
+uint32_t audio_store_bytes()
+{
+    if (ram_ring.buf == nullptr) {
+        return 0;
+    }
+    uint32_t ram = ram_ring.head.load(std::memory_order_relaxed) - ram_ring.tail.load(std::memory_order_relaxed);
+    return ram + (write_len - write_read) + (uint32_t) flash_count * AUDIO_STORE_SECTOR_BYTES;
+}
+
+/**
+ * flush_sector - 把拼接好的扇区写入flash
+ *
+ * flash满时覆盖最旧的扇区; 写入失败时丢弃这个扇区
+ */
+static void flush_sector()
+{
+    memset(write_sector + write_len, 0xFF, AUDIO_STORE_SECTOR_BYTES - write_len);
+    if (flash_count == flash_sectors) {
+        flash_count--; // 最旧的扇区被覆盖
+        read_loaded = false;
+        Serial.println("Audio store full, oldest audio dropped");
+    }
+    size_t offset = (size_t) flash_head * AUDIO_STORE_SECTOR_BYTES;
+    esp_err_t err = esp_partition_erase_range(partition, offset, AUDIO_STORE_SECTOR_BYTES);
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, offset, write_sector, AUDIO_STORE_SECTOR_BYTES);
+    }
+    if (err == ESP_OK) {
+        flash_head = (flash_head + 1) % flash_sectors;
+        flash_count++;
+    } else {
+        Serial.printf("Audio store flash write failed: 0x%x\n", err);
+    }
+    write_len = 0;
+    write_read = 0;
+}
+
+/**
+ * audio_store_spill - PSRAM环形缓冲区超过一半时把最旧的包转存到flash
+ *
+ * 包按顺序拼接到write_sector,下一个包放不下时写入一个扇区; 其中有已取出的包时不转存
+ */
+void audio_store_spill()
+{
+    if (partition == nullptr || write_read > 0) {
+        return;
+    }
+    while (ram_ring.head.load(std::memory_order_acquire) - ram_ring.tail.load(std::memory_order_relaxed) >
+           AUDIO_STORE_RAM_BYTES / 2) {
+        uint8_t unused;
+        struct pipe_ring_span span[2];
+        uint16_t len = pipe_ring_peek(&ram_ring, &unused, 0, span);
+        if (write_len + SECTOR_LEN_SIZE + len > AUDIO_STORE_SECTOR_BYTES) {
+            flush_sector();
+        }
+        write_sector[write_len] = len & 0xFF;
+        write_sector[write_len + 1] = len >> 8;
+        pipe_ring_get(&ram_ring, write_sector + write_len + SECTOR_LEN_SIZE, len);
+        write_len += SECTOR_LEN_SIZE + len;
+    }
+}
+
+/**
+ * sector_next - 从扇区中取出下一个包
+ *
+ * @returns {uint16_t} 包长度, 0表示扇区中没有更多的包
+ */
+static uint16_t sector_next(const uint8_t *sector, uint32_t end, uint32_t *pos, uint8_t *out, uint16_t max)
+{
+    while (*pos + SECTOR_LEN_SIZE <= end) {
+        uint16_t len = sector[*pos] | (sector[*pos + 1] << 8);
+        if (len == SECTOR_END || *pos + SECTOR_LEN_SIZE + len > end) {
+            break;
+        }
+        *pos += SECTOR_LEN_SIZE + len;
+        if (len > 0 && len <= max) {
+            memcpy(out, sector + *pos - len, len);
+            return len;
+        }
+    }
+    *pos = end;
+    return 0;
+}
+
+/**
+ * audio_store_get - 取出最旧的音频包
+ *
+ * @returns {uint16_t} 包长度, 0表示没有存储的包
+ */
+uint16_t audio_store_get(uint8_t *out, uint16_t max)
+{
+    if (ram_ring.buf == nullptr) {
+        return 0;
+    }
+    while (flash_count > 0) {
+        uint16_t tail = (flash_head + flash_sectors - flash_count) % flash_sectors;
+        if (!read_loaded) {
+            read_pos = 0;
+            read_loaded = true;
+            if (esp_partition_read(partition, (size_t) tail * AUDIO_STORE_SECTOR_BYTES, read_sector,
+                                   AUDIO_STORE_SECTOR_BYTES) != ESP_OK) {
+                Serial.println("Audio store flash read failed, sector dropped");
+                read_pos = AUDIO_STORE_SECTOR_BYTES;
+            }
+        }
+        uint16_t len = sector_next(read_sector, AUDIO_STORE_SECTOR_BYTES, &read_pos, out, max);
+        if (len > 0) {
+            return len;
+        }
+        flash_count--;
+        read_loaded = false;
+    }
+    if (write_read < write_len) {
+        uint16_t len = sector_next(write_sector, write_len, &write_read, out, max);
+        if (len > 0) {
+            return len;
+        }
+    }
+    write_len = 0;
+    write_read = 0;
+    return pipe_ring_get(&ram_ring, out, max);
+}
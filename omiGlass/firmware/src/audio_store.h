@@ -0,0 +1,30 @@
+#ifndef AUDIO_STORE_H
+#define AUDIO_STORE_H
+
+#include <Arduino.h>
+
+// Audio packets encoded while no central streams audio, sent after the next connection. A frame
+// ring in PSRAM filled by the audio task; the store task moves the oldest packets to the
+// AUDIO_STORE_PARTITION flash partition in sector-sized blocks once the ring is half full (PSRAM
+// only without the partition). New packets are dropped when both are full. Packets come back
+// oldest first. The index is only kept in memory, a reboot forgets what is in flash.
+
+// Allocate the PSRAM ring and find the flash partition
+void audio_store_init();
+
+// Check whether the PSRAM ring could be allocated
+bool audio_store_available();
+
+// Store one audio packet (audio task only), returns false if the store is full
+bool audio_store_put(const uint8_t *packet, size_t len);
+
+// Approximate number of bytes stored
+uint32_t audio_store_bytes();
+
+// Move the oldest packets to flash while the PSRAM ring is more than half full (store task only)
+void audio_store_spill();
+
+// Take the oldest stored packet into out (store task only), returns its length, 0 if none is stored
+uint16_t audio_store_get(uint8_t *out, uint16_t max);
+
+#endif // AUDIO_STORE_H
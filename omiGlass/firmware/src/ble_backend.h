@@ -0,0 +1,43 @@
+#ifndef BLE_BACKEND_H
+#define BLE_BACKEND_H
+
+#include "config.h"
+
+// BLE host selected by BLE_NIMBLE. The NimBLE-Arduino classes mirror the Bluedroid wrapper, so code
+// uses the Bluedroid names for both and checks BLE_NIMBLE only where the APIs really differ:
+// NimBLE creates every CCCD itself (no BLE2902) and reports subscriptions to the characteristic.
+
+#if BLE_NIMBLE
+
+#include <NimBLEDevice.h>
+
+using BLEDevice = NimBLEDevice;
+using BLEServer = NimBLEServer;
+using BLEServerCallbacks = NimBLEServerCallbacks;
+using BLEService = NimBLEService;
+using BLECharacteristic = NimBLECharacteristic;
+using BLECharacteristicCallbacks = NimBLECharacteristicCallbacks;
+using BLEAdvertising = NimBLEAdvertising;
+using BLEUUID = NimBLEUUID;
+
+#define BLE_PROPERTY_READ NIMBLE_PROPERTY::READ
+#define BLE_PROPERTY_WRITE NIMBLE_PROPERTY::WRITE
+#define BLE_PROPERTY_NOTIFY NIMBLE_PROPERTY::NOTIFY
+#define BLE_PROPERTY_WRITE_NR NIMBLE_PROPERTY::WRITE_NR
+
+#else
+
+#include <BLE2902.h>
+#include <BLECharacteristic.h>
+#include <BLEDevice.h>
+#include <BLESecurity.h>
+#include <BLEUtils.h>
+
+#define BLE_PROPERTY_READ BLECharacteristic::PROPERTY_READ
+#define BLE_PROPERTY_WRITE BLECharacteristic::PROPERTY_WRITE
+#define BLE_PROPERTY_NOTIFY BLECharacteristic::PROPERTY_NOTIFY
+#define BLE_PROPERTY_WRITE_NR BLECharacteristic::PROPERTY_WRITE_NR
+
+#endif // BLE_NIMBLE
+
+#endif // BLE_BACKEND_H
@@ -0,0 +1,505 @@
+/**
+ * BLE发送调度模块 - 所有BLE通知由一个任务按类别优先级和空口时间配额发送
+ *
+ * 主要功能:
+ * 1. 每个类别(音频、控制、照片、离线音频)一个帧环形缓冲区,帧格式: [特性指针, 通知数据]
+ * 2. 加权差额轮询: 每轮每个类别最多发送BLE_TX_QUANTUM_*字节的空口时间
+ *    (通知数据加上每个通知的协议开销BLE_TX_PACKET_OVERHEAD)
+ *    有剩余配额的类别中优先级高的先发; 空闲类别的配额保持满额,
+ *    所以音频到达后立即发送,最多等待一帧已经开始发送的照片
+ * 3. 照片同时在途的通知最多PHOTO_NOTIFY_CREDITS帧,通知窗口的其余部分留给音频和控制
+ * 4. 协议栈报告拥塞时所有类别暂停; 未连接时丢弃所有待发数据
+ * 5. NimBLE(BLE_NIMBLE)时通知数据从环形缓冲区直接拷入协议栈的mbuf,没有中间缓冲区;
+ *    mbuf用完即拥塞,这一帧留在队列中稍后重试
+ * 6. 连接参数跟随批量数据: 照片或离线音频排队时请求短连接间隔和2M PHY(突发),
+ *    BLE_CONN_BURST_HOLD_MS没有批量数据后请求长间隔和从机延迟(空闲),实时音频在两种参数下都放得下
+ *
+ * 任意任务都可以调用ble_tx_send(同一类别的生产者之间用互斥锁串行),只有调度任务调用notify()
+ */
+#include "ble_tx.h"
+
+#include "config.h"
+#include "pipeline.h"
+
+#if BLE_NIMBLE
+#include <host/ble_hs.h>
+#else
+#include "esp_gap_ble_api.h"
+#endif
+
+#define BLE_TX_MAX_BYTES (BLE_MTU_SIZE - 3) // 最长的通知数据
+#define BLE_TX_RETRY_MS 2                   // 拥塞或没有照片额度时的重试间隔
+
+static_assert((AUDIO_TX_RING_BYTES & (AUDIO_TX_RING_BYTES - 1)) == 0, "AUDIO_TX_RING_BYTES must be a power of two");
+static_assert(AUDIO_TX_RING_BYTES >=
+                  16 * (OPUS_OUTPUT_MAX_BYTES + AUDIO_PACKET_HEADER_SIZE + sizeof(BLECharacteristic *) + 2),
+              "Room for at least 16 full-size audio packets");
+static_assert((BLE_TX_CONTROL_RING_BYTES & (BLE_TX_CONTROL_RING_BYTES - 1)) == 0,
+              "BLE_TX_CONTROL_RING_BYTES must be a power of two");
+static_assert((BLE_TX_PHOTO_RING_BYTES & (BLE_TX_PHOTO_RING_BYTES - 1)) == 0,
+              "BLE_TX_PHOTO_RING_BYTES must be a power of two");
+static_assert(BLE_TX_PHOTO_RING_BYTES >= 2 * (PHOTO_FRAME_MAX_SIZE + sizeof(BLECharacteristic *) + 2),
+              "Room for at least two full-size photo frames");
+static_assert((BLE_TX_STORED_RING_BYTES & (BLE_TX_STORED_RING_BYTES - 1)) == 0,
+              "BLE_TX_STORED_RING_BYTES must be a power of two");
+
+// 请求过的连接参数
+typedef enum {
+    LINK_UNSET, // 连接后还没有请求,按中心设备的参数
+    LINK_IDLE,
+    LINK_BURST
+} link_mode_t;
+
+typedef struct {
+    struct pipe_ring ring;
+    SemaphoreHandle_t producer_mutex; // 同一类别的多个生产者串行写入
+    int32_t quantum;                  // 每轮的空口时间配额(字节)
+    int32_t deficit;                  // 本轮剩余配额,发送后可以为负
+} tx_class_t;
+
+static uint8_t audio_storage[AUDIO_TX_RING_BYTES];
+static uint8_t control_storage[BLE_TX_CONTROL_RING_BYTES];
+static uint8_t photo_storage[BLE_TX_PHOTO_RING_BYTES];
+static uint8_t stored_storage[BLE_TX_STORED_RING_BYTES];
+static tx_class_t classes[BLE_TX_CLASS_COUNT];
+
+static TaskHandle_t tx_task_handle = nullptr;
+static SemaphoreHandle_t photo_credits = nullptr; // 照片在途通知额度,通知完成时归还
+static volatile uint16_t photo_handle = 0;         // 照片特性句柄(匹配通知完成事件)
+static unsigned long last_photo_ms = 0;            // 上一帧照片的发送时间
+static volatile bool link_connected = false;       // 是否有已连接的客户端(由应用设置)
+static volatile link_mode_t link_mode = LINK_UNSET; // 当前请求的连接参数
+static unsigned long last_bulk_ms = 0;             // 上一次有照片或离线音频排队的时间
+static volatile bool bulk_rx = false;              // 客户端正在写入批量数据(BLE OTA)
+static volatile uint32_t link_generation = 0;      // 每次断开加一(在补满照片额度之前)
+#if BLE_NIMBLE
+static volatile uint16_t conn_handle = BLE_HS_CONN_HANDLE_NONE; // 通知发往的连接
+#else
+static volatile bool link_congested = false;       // 协议栈报告的拥塞状态
+static esp_bd_addr_t peer_bda;                     // 已连接的中心设备(请求连接参数用)
+static uint8_t tx_buffer[sizeof(BLECharacteristic *) + BLE_TX_MAX_BYTES]; // 调度任务取出的一帧
+#endif
+
+/**
+ * photo_slot - 照片是否可以发送下一帧(取得一个在途额度)
+ *
+ * @param {bool*} took_credit - 返回是否真的取得了额度
+ *
+ * 协议栈超过PHOTO_NOTIFY_TIMEOUT_MS没有回报时不取额度照常发送,避免额度丢失后上传卡死
+ */
+static bool photo_slot(bool *took_credit)
+{
+    *took_credit = xSemaphoreTake(photo_credits, 0) == pdTRUE;
+    return *took_credit || millis() - last_photo_ms >= PHOTO_NOTIFY_TIMEOUT_MS;
+}
+
+/**
+ * pick_class - 选出下一个发送的类别
+ *
+ * @param {bool*} blocked - 返回是否有数据因为照片额度暂时不能发送
+ * @param {bool*} took_credit - 返回为选出的照片帧取得了额度(超时发送时为false)
+ * @return 类别, -1表示没有可以发送的数据
+ *
+ * 所有有数据的类别都用完本轮配额时开始新一轮,每个类别的配额最多补到一轮的量
+ */
+static int pick_class(bool *blocked, bool *took_credit)
+{
+    *blocked = false;
+    *took_credit = false;
+    for (int round = 0; round < 2; round++) {
+        bool backlogged = false;
+        for (int cls = 0; cls < BLE_TX_CLASS_COUNT; cls++) {
+            tx_class_t *c = &classes[cls];
+            if (pipe_ring_empty(&c->ring)) {
+                c->deficit = c->quantum; // 空闲时保持满额
+                continue;
+            }
+            if (c->deficit <= 0) {
+                backlogged = true;
+                continue;
+            }
+            if (cls == BLE_TX_PHOTO && !photo_slot(took_credit)) {
+                *blocked = true;
+                continue;
+            }
+            return cls;
+        }
+        if (!backlogged) {
+            break;
+        }
+        for (int cls = 0; cls < BLE_TX_CLASS_COUNT; cls++) {
+            tx_class_t *c = &classes[cls];
+            c->deficit = c->deficit + c->quantum > c->quantum ? c->quantum : c->deficit + c->quantum;
+        }
+    }
+    return -1;
+}
+
+/**
+ * send_frame - 取出一帧并作为通知发送
+ *
+ * @return false表示协议栈暂时没有缓冲区,这一帧留在队列中
+ */
+#if BLE_NIMBLE
+static bool send_frame(int cls)
+{
+    tx_class_t *c = &classes[cls];
+    BLECharacteristic *characteristic;
+    struct pipe_ring_span span[2];
+    uint16_t len = pipe_ring_peek(&c->ring, (uint8_t *) &characteristic, sizeof(characteristic), span);
+    if (len <= sizeof(characteristic)) {
+        pipe_ring_skip(&c->ring); // 无效帧,跳过
+        return true;
+    }
+    len -= sizeof(characteristic);
+
+    // 环形缓冲区中的数据(跨越末尾时两段)直接追加到预留了ATT头空间的mbuf
+    struct os_mbuf *om = ble_hs_mbuf_att_pkt();
+    if (om == nullptr) {
+        return false;
+    }
+    if (os_mbuf_append(om, span[0].data, span[0].len) != 0 || os_mbuf_append(om, span[1].data, span[1].len) != 0) {
+        os_mbuf_free_chain(om);
+        return false;
+    }
+    uint16_t handle = characteristic->getHandle();
+    if (cls == BLE_TX_PHOTO) {
+        photo_handle = handle; // 完成事件可能在notify返回前到达
+    }
+    // 协议栈总会接管mbuf; 只有缓冲区不足时保留这一帧,其他错误(连接已断开)丢弃
+    if (ble_gatts_notify_custom(conn_handle, handle, om) == BLE_HS_ENOMEM) {
+        return false;
+    }
+    pipe_ring_skip(&c->ring);
+
+    c->deficit -= len + BLE_TX_PACKET_OVERHEAD;
+    if (cls == BLE_TX_PHOTO) {
+        last_photo_ms = millis();
+    }
+    return true;
+}
+#else
+static bool send_frame(int cls)
+{
+    tx_class_t *c = &classes[cls];
+    uint16_t len = pipe_ring_get(&c->ring, tx_buffer, sizeof(tx_buffer));
+    if (len <= sizeof(BLECharacteristic *)) {
+        return true; // 无效帧,已跳过
+    }
+
+    BLECharacteristic *characteristic;
+    memcpy(&characteristic, tx_buffer, sizeof(characteristic));
+    len -= sizeof(characteristic);
+    characteristic->setValue(tx_buffer + sizeof(characteristic), len);
+    characteristic->notify();
+
+    c->deficit -= len + BLE_TX_PACKET_OVERHEAD;
+    if (cls == BLE_TX_PHOTO) {
+        photo_handle = characteristic->getHandle();
+        last_photo_ms = millis();
+    }
+    return true;
+}
+#endif
+
+/**
+ * request_link - 请求突发或空闲的连接参数和PHY
+ *
+ * 由中心设备决定是否接受; 拒绝时照常发送,只是没有省下功耗或时间
+ */
+static void request_link(link_mode_t mode)
+{
+    bool burst = mode == LINK_BURST;
+    uint16_t min_int = burst ? BLE_CONN_BURST_MIN_INTERVAL : BLE_CONN_IDLE_MIN_INTERVAL;
+    uint16_t max_int = burst ? BLE_CONN_BURST_MAX_INTERVAL : BLE_CONN_IDLE_MAX_INTERVAL;
+    uint16_t latency = burst ? BLE_CONN_BURST_LATENCY : BLE_CONN_IDLE_LATENCY;
+    link_mode = mode;
+#if BLE_NIMBLE
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+        return;
+    }
+    struct ble_gap_upd_params params = {};
+    params.itvl_min = min_int;
+    params.itvl_max = max_int;
+    params.latency = latency;
+    params.supervision_timeout = BLE_CONN_TIMEOUT;
+    ble_gap_update_params(conn_handle, &params);
+    if (BLE_CONN_BURST_2M_PHY) {
+        uint8_t phy = burst ? BLE_GAP_LE_PHY_2M_MASK : BLE_GAP_LE_PHY_1M_MASK;
+        ble_gap_set_prefered_le_phy(conn_handle, phy, phy, BLE_GAP_LE_PHY_CODED_ANY);
+    }
+#else
+    esp_ble_conn_update_params_t params = {};
+    memcpy(params.bda, peer_bda, sizeof(esp_bd_addr_t));
+    params.min_int = min_int;
+    params.max_int = max_int;
+    params.latency = latency;
+    params.timeout = BLE_CONN_TIMEOUT;
+    esp_ble_gap_update_conn_params(&params);
+    if (BLE_CONN_BURST_2M_PHY) {
+        esp_ble_gap_phy_mask_t phy = burst ? ESP_BLE_GAP_PHY_2M_PREF_MASK : ESP_BLE_GAP_PHY_1M_PREF_MASK;
+        esp_ble_gap_set_preferred_phy(peer_bda, 0, phy, phy, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+    }
+#endif
+    Serial.printf("BLE link %s: %u-%u ms interval, latency %u\n", burst ? "burst" : "idle", min_int * 5 / 4,
+                  max_int * 5 / 4, latency);
+}
+
+/**
+ * update_link - 按照片和离线音频队列(以及客户端写入的批量数据)切换连接参数
+ *
+ * @return 没有数据可发时最多等待的tick数,突发结束时需要醒来切换到空闲参数
+ */
+static TickType_t update_link()
+{
+    unsigned long now = millis();
+    bool rx = bulk_rx;
+    bulk_rx = false;
+    if (rx || !pipe_ring_empty(&classes[BLE_TX_PHOTO].ring) || !pipe_ring_empty(&classes[BLE_TX_STORED].ring)) {
+        last_bulk_ms = now;
+        if (link_mode != LINK_BURST) {
+            request_link(LINK_BURST);
+        }
+        // 只有客户端写入的数据时没有发送完成来唤醒任务,保持时间到期后醒来
+        return rx ? pdMS_TO_TICKS(BLE_CONN_BURST_HOLD_MS) : portMAX_DELAY;
+    }
+    if (link_mode == LINK_IDLE) {
+        return portMAX_DELAY;
+    }
+    unsigned long quiet_ms = now - last_bulk_ms;
+    if (quiet_ms >= BLE_CONN_BURST_HOLD_MS) {
+        request_link(LINK_IDLE);
+        return portMAX_DELAY;
+    }
+    return pdMS_TO_TICKS(BLE_CONN_BURST_HOLD_MS - quiet_ms);
+}
+
+/**
+ * discard_all - 丢弃所有待发数据(未连接时)
+ */
+static void discard_all()
+{
+    for (int cls = 0; cls < BLE_TX_CLASS_COUNT; cls++) {
+        while (!pipe_ring_empty(&classes[cls].ring)) {
+            pipe_ring_skip(&classes[cls].ring);
+        }
+        classes[cls].deficit = classes[cls].quantum;
+    }
+}
+
+/**
+ * bleTxTask - BLE发送调度任务
+ *
+ * 运行在核心0(与BLE协议栈同核),优先级高于照片任务
+ * 由生产者和GATT事件的任务通知唤醒; 拥塞或等待照片额度时每BLE_TX_RETRY_MS重试
+ * 突发参数下没有数据时在BLE_CONN_BURST_HOLD_MS到期时醒来请求空闲参数
+ */
+static void bleTxTask(void *param)
+{
+    while (true) {
+        if (!link_connected) {
+            discard_all();
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+#if !BLE_NIMBLE
+        if (link_congested) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLE_TX_RETRY_MS));
+            continue;
+        }
+#endif
+
+        TickType_t idle_wait = update_link();
+        bool blocked, took_credit;
+        int cls = pick_class(&blocked, &took_credit);
+        if (cls < 0) {
+            ulTaskNotifyTake(pdTRUE, blocked ? pdMS_TO_TICKS(BLE_TX_RETRY_MS) : idle_wait);
+            continue;
+        }
+        if (!send_frame(cls)) {
+            if (took_credit) {
+                xSemaphoreGive(photo_credits); // 这一帧没有发出,额度还回去; 超时发送时没有取额度
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLE_TX_RETRY_MS));
+        }
+    }
+}
+
+/**
+ * ble_tx_init - 创建各类别的队列并启动调度任务
+ */
+void ble_tx_init()
+{
+    static uint8_t *const storage[BLE_TX_CLASS_COUNT] = {audio_storage, control_storage, photo_storage,
+                                                         stored_storage};
+    static const uint32_t storage_size[BLE_TX_CLASS_COUNT] = {sizeof(audio_storage), sizeof(control_storage),
+                                                              sizeof(photo_storage), sizeof(stored_storage)};
+    static const int32_t quantum[BLE_TX_CLASS_COUNT] = {BLE_TX_QUANTUM_AUDIO, BLE_TX_QUANTUM_CONTROL,
+                                                        BLE_TX_QUANTUM_PHOTO, BLE_TX_QUANTUM_STORED};
+
+    for (int cls = 0; cls < BLE_TX_CLASS_COUNT; cls++) {
+        pipe_ring_init(&classes[cls].ring, storage[cls], storage_size[cls]);
+        classes[cls].producer_mutex = xSemaphoreCreateMutex();
+        classes[cls].quantum = quantum[cls];
+        classes[cls].deficit = quantum[cls];
+    }
+    photo_credits = xSemaphoreCreateCounting(PHOTO_NOTIFY_CREDITS, PHOTO_NOTIFY_CREDITS);
+
+    xTaskCreatePinnedToCore(bleTxTask, "ble_tx", BLE_TX_TASK_STACK_SIZE, NULL, BLE_TX_TASK_PRIORITY, &tx_task_handle,
+                            BLE_TX_TASK_CORE);
+}
+
+/**
+ * ble_tx_send - 把一个通知放入类别队列
+ *
+ * 队列满时每个tick重试一次,最多等待wait; 未连接时直接丢弃(没有接收方)
+ */
+bool ble_tx_send(ble_tx_class_t cls, BLECharacteristic *characteristic, const uint8_t *data, size_t len,
+                 TickType_t wait)
+{
+    if (tx_task_handle == nullptr || characteristic == nullptr || len == 0 || len > BLE_TX_MAX_BYTES) {
+        return false;
+    }
+    if (!link_connected) {
+        return true;
+    }
+
+    tx_class_t *c = &classes[cls];
+    TickType_t start = xTaskGetTickCount();
+    bool queued;
+    xSemaphoreTake(c->producer_mutex, portMAX_DELAY);
+    while (!(queued = pipe_ring_put_parts(&c->ring, (const uint8_t *) &characteristic, sizeof(characteristic),
+                                           data, len)) &&
+           link_connected && xTaskGetTickCount() - start < wait) {
+        vTaskDelay(1);
+    }
+    xSemaphoreGive(c->producer_mutex);
+
+    if (queued) {
+        xTaskNotifyGive(tx_task_handle);
+    }
+    return queued || !link_connected;
+}
+
+/**
+ * ble_tx_photo_flushed - 照片类别是否已全部发出
+ *
+ * 队列为空,协议栈回报了所有在途的照片通知(额度全部归还),并且从generation以来没有断开过
+ * (断开时额度同样补满,但未完成的通知已经丢失)
+ */
+bool ble_tx_photo_flushed(uint32_t generation)
+{
+    bool flushed =
+        pipe_ring_empty(&classes[BLE_TX_PHOTO].ring) && uxSemaphoreGetCount(photo_credits) == PHOTO_NOTIFY_CREDITS;
+    return flushed && link_generation == generation;
+}
+
+/**
+ * ble_tx_link_generation - 当前连接的编号,每次断开加一
+ */
+uint32_t ble_tx_link_generation()
+{
+    return link_generation;
+}
+
+/**
+ * ble_tx_note_bulk - 客户端正在写入批量数据,发送任务保持或切换到突发连接参数
+ */
+void ble_tx_note_bulk()
+{
+    bulk_rx = true;
+    if (tx_task_handle != nullptr) {
+        xTaskNotifyGive(tx_task_handle);
+    }
+}
+
+/**
+ * ble_tx_set_connected - 更新连接状态(在BLE服务器的连接/断开回调中调用)
+ */
+void ble_tx_set_connected(bool connected)
+{
+    link_mode = LINK_UNSET; // 新连接在BLE_CONN_BURST_HOLD_MS内没有批量数据时请求空闲参数
+    last_bulk_ms = millis();
+    link_connected = connected;
+    if (tx_task_handle != nullptr) {
+        xTaskNotifyGive(tx_task_handle);
+    }
+}
+
+#if BLE_NIMBLE
+/**
+ * ble_tx_gap_event - GAP事件监听(与NimBLE-Arduino自身的处理并行)
+ *
+ * - BLE_GAP_EVENT_CONNECT: 记录通知发往的连接
+ * - BLE_GAP_EVENT_DISCONNECT: 未完成的通知不会再有回报,补满照片额度
+ * - BLE_GAP_EVENT_NOTIFY_TX: 一个通知已交给控制器或被丢弃; 照片帧归还额度,mbuf释放后可以重试
+ *   (BLE_HS_ENOMEM时这一帧留在队列里重发,额度由调度任务归还,这里不再归还)
+ */
+int ble_tx_gap_event(struct ble_gap_event *event, void *arg)
+{
+    if (tx_task_handle == nullptr) {
+        return 0;
+    }
+    switch (event->type) {
+    case BLE_GAP_EVENT_CONNECT:
+        if (event->connect.status != 0) {
+            return 0;
+        }
+        conn_handle = event->connect.conn_handle;
+        break;
+    case BLE_GAP_EVENT_DISCONNECT:
+        conn_handle = BLE_HS_CONN_HANDLE_NONE;
+        link_generation = link_generation + 1;
+        while (xSemaphoreGive(photo_credits) == pdTRUE) {
+        }
+        break;
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (!event->notify_tx.indication && event->notify_tx.attr_handle == photo_handle &&
+            event->notify_tx.status != BLE_HS_ENOMEM) {
+            xSemaphoreGive(photo_credits);
+        }
+        break;
+    default:
+        return 0;
+    }
+    xTaskNotifyGive(tx_task_handle);
+    return 0;
+}
+#else
+/**
+ * ble_tx_gatts_event - GATT服务器事件(与BLE库自身的处理并行)
+ *
+ * - ESP_GATTS_CONNECT_EVT: 记录中心设备的地址(请求连接参数用)
+ * - ESP_GATTS_DISCONNECT_EVT: 未完成的通知不会再有回报,补满照片额度
+ * - ESP_GATTS_CONF_EVT: 一帧照片通知已发出,归还额度
+ * - ESP_GATTS_CONGEST_EVT: 协议栈缓冲区拥塞/恢复
+ */
+void ble_tx_gatts_event(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    if (tx_task_handle == nullptr) {
+        return;
+    }
+    switch (event) {
+    case ESP_GATTS_CONNECT_EVT:
+        memcpy(peer_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+        break;
+    case ESP_GATTS_DISCONNECT_EVT:
+        link_congested = false;
+        link_generation = link_generation + 1;
+        while (xSemaphoreGive(photo_credits) == pdTRUE) {
+        }
+        break;
+    case ESP_GATTS_CONF_EVT:
+        if (param->conf.handle == photo_handle) {
+            xSemaphoreGive(photo_credits);
+        }
+        break;
+    case ESP_GATTS_CONGEST_EVT:
+        link_congested = param->congest.congested;
+        break;
+    default:
+        return;
+    }
+    xTaskNotifyGive(tx_task_handle);
+}
+#endif
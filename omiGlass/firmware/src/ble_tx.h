@@ -0,0 +1,57 @@
+#ifndef BLE_TX_H
+#define BLE_TX_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "ble_backend.h"
+
+// Every BLE notification goes through one scheduler task on the BLE core. Each traffic class has
+// its own queue; the task serves the highest priority class that still has airtime budget in the
+// current round, so audio waits for at most one photo frame while photos use what audio leaves.
+// The task also picks the connection parameters: short interval and 2M PHY while photo or stored
+// audio frames are queued, long interval with peripheral latency otherwise.
+
+// Traffic classes, in priority order
+typedef enum {
+    BLE_TX_AUDIO = 0, // Audio packets, dropped when the queue is full
+    BLE_TX_CONTROL,   // Battery level, OTA and offload status
+    BLE_TX_PHOTO,     // Photo frames, paced on notification completions
+    BLE_TX_STORED,    // Audio recorded while disconnected (audio_store)
+    BLE_TX_CLASS_COUNT
+} ble_tx_class_t;
+
+// Create the queues and start the scheduler task
+void ble_tx_init();
+
+// Queue a notification of data on characteristic, waiting up to wait ticks for room. Packets sent
+// while no central is connected are discarded and count as sent. Returns false if the queue stayed
+// full (or the packet is longer than BLE_MTU_SIZE - 3)
+bool ble_tx_send(ble_tx_class_t cls, BLECharacteristic *characteristic, const uint8_t *data, size_t len,
+                 TickType_t wait);
+
+// Every queued photo frame went out and the stack reported each notification done, all within the
+// connection of generation (from ble_tx_link_generation())
+bool ble_tx_photo_flushed(uint32_t generation);
+
+// Counts disconnections, so a caller can tell the connection it queued on is still the same
+uint32_t ble_tx_link_generation();
+
+// Track the connection (call from the server's connect and disconnect callbacks, before queueing)
+void ble_tx_set_connected(bool connected);
+
+// Bulk data is arriving from the central (BLE OTA): keep the burst connection parameters for
+// another BLE_CONN_BURST_HOLD_MS, as queued photo frames do
+void ble_tx_note_bulk();
+
+#if BLE_NIMBLE
+// GAP events for flow control (connection, notification completions, disconnection), registered
+// with ble_gap_event_listener_register. Congestion shows as the stack running out of mbufs
+int ble_tx_gap_event(struct ble_gap_event *event, void *arg);
+#else
+// GATT server events for flow control (notification completions, congestion, disconnection),
+// registered with BLEDevice::setCustomGattsHandler
+void ble_tx_gatts_event(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+#endif
+
+#endif // BLE_TX_H
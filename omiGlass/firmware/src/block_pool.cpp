@@ -0,0 +1,180 @@
+/**
+ * 固定大小块池 - 会话中反复分配和释放的缓冲区,不经过堆
+ *
+ * 主要功能:
+ * 1. 每个池在启动时一次分配所有块(PSRAM),之后不再向堆申请或归还内存,堆不会碎片化
+ * 2. 可变大小的对象占一串块(块链),next数组记录下一块,空闲块也是一条链
+ * 3. 分配和释放只遍历对象自己的块链,用自旋锁保护,耗时只和对象大小有关
+ * 4. 统计: 空闲块数、启动以来最少的空闲块数、因空闲块不足拒绝的分配次数
+ *
+ * 块链是全有或全无的: 空闲块不够时不分配任何块
+ */
+#include "block_pool.h"
+
+#include "mem_placement.h"
+
+typedef struct {
+    uint8_t *buf;        // 所有块
+    uint16_t *next;      // 每块的下一块(块链或空闲链)
+    uint32_t block_size;
+    uint16_t blocks;
+    uint16_t free_head;  // 空闲链的第一块
+    uint16_t free_count;
+    uint16_t min_free;
+    uint32_t failures;
+    portMUX_TYPE lock;
+} pool_t;
+
+static pool_t pools[BLOCK_POOL_COUNT];
+
+/**
+ * block_pool_init - 分配池的所有块并串成空闲链
+ */
+bool block_pool_init(block_pool_id_t id, uint32_t block_size, uint16_t blocks, const char *name)
+{
+    pool_t *pool = &pools[id];
+    if (pool->blocks > 0) {
+        return true;
+    }
+    if (block_size == 0 || blocks == 0 || blocks == BLOCK_POOL_NONE) {
+        return false;
+    }
+    pool->buf = (uint8_t *) mem_alloc_bulk((size_t) block_size * blocks, name);
+    pool->next = (uint16_t *) mem_alloc_bulk(blocks * sizeof(uint16_t), name);
+    if (pool->buf == nullptr || pool->next == nullptr) {
+        mem_free(pool->buf);
+        mem_free(pool->next);
+        pool->buf = nullptr;
+        pool->next = nullptr;
+        return false;
+    }
+    for (uint16_t i = 0; i < blocks; i++) {
+        pool->next[i] = i + 1 < blocks ? i + 1 : BLOCK_POOL_NONE;
+    }
+    portMUX_INITIALIZE(&pool->lock);
+    pool->block_size = block_size;
+    pool->free_head = 0;
+    pool->free_count = blocks;
+    pool->min_free = blocks;
+    pool->failures = 0;
+    pool->blocks = blocks; // 最后设置: blocks非0表示池可用
+    return true;
+}
+
+/**
+ * block_pool_alloc - 从空闲链头部取下装得下len字节的一串块
+ */
+uint16_t block_pool_alloc(block_pool_id_t id, size_t len)
+{
+    pool_t *pool = &pools[id];
+    if (pool->blocks == 0 || len == 0) {
+        return BLOCK_POOL_NONE;
+    }
+    size_t needed = (len + pool->block_size - 1) / pool->block_size;
+
+    portENTER_CRITICAL(&pool->lock);
+    if (needed > pool->free_count) {
+        pool->failures++;
+        portEXIT_CRITICAL(&pool->lock);
+        return BLOCK_POOL_NONE;
+    }
+    uint16_t first = pool->free_head;
+    uint16_t last = first;
+    for (size_t i = 1; i < needed; i++) {
+        last = pool->next[last];
+    }
+    pool->free_head = pool->next[last];
+    pool->next[last] = BLOCK_POOL_NONE;
+    pool->free_count -= needed;
+    if (pool->free_count < pool->min_free) {
+        pool->min_free = pool->free_count;
+    }
+    portEXIT_CRITICAL(&pool->lock);
+    return first;
+}
+
+/**
+ * block_pool_free - 把一串块接回空闲链头部
+ */
+void block_pool_free(block_pool_id_t id, uint16_t first)
+{
+    pool_t *pool = &pools[id];
+    if (pool->blocks == 0 || first == BLOCK_POOL_NONE) {
+        return;
+    }
+
+    portENTER_CRITICAL(&pool->lock);
+    uint16_t last = first;
+    uint16_t count = 1;
+    while (pool->next[last] != BLOCK_POOL_NONE) {
+        last = pool->next[last];
+        count++;
+    }
+    pool->next[last] = pool->free_head;
+    pool->free_head = first;
+    pool->free_count += count;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+/**
+ * block_pool_data - 一块的数据
+ */
+uint8_t *block_pool_data(block_pool_id_t id, uint16_t block)
+{
+    return pools[id].buf + (size_t) block * pools[id].block_size;
+}
+
+/**
+ * block_pool_next - 块链中的下一块(已分配的块链只由持有者访问,不需要锁)
+ */
+uint16_t block_pool_next(block_pool_id_t id, uint16_t block)
+{
+    return pools[id].next[block];
+}
+
+/**
+ * block_pool_write - 从块链开头写入数据
+ */
+void block_pool_write(block_pool_id_t id, uint16_t first, const uint8_t *data, size_t len)
+{
+    uint32_t block_size = pools[id].block_size;
+    for (uint16_t block = first; block != BLOCK_POOL_NONE && len > 0; block = block_pool_next(id, block)) {
+        size_t n = len < block_size ? len : block_size;
+        memcpy(block_pool_data(id, block), data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * block_pool_read - 从块链开头读出数据
+ */
+void block_pool_read(block_pool_id_t id, uint16_t first, uint8_t *out, size_t len)
+{
+    uint32_t block_size = pools[id].block_size;
+    for (uint16_t block = first; block != BLOCK_POOL_NONE && len > 0; block = block_pool_next(id, block)) {
+        size_t n = len < block_size ? len : block_size;
+        memcpy(out, block_pool_data(id, block), n);
+        out += n;
+        len -= n;
+    }
+}
+
+/**
+ * block_pool_stats - 池的统计
+ */
+void block_pool_stats(block_pool_id_t id, block_pool_stats_t *stats)
+{
+    pool_t *pool = &pools[id];
+    if (pool->blocks == 0) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    portENTER_CRITICAL(&pool->lock);
+    stats->block_size = pool->block_size;
+    stats->blocks = pool->blocks;
+    stats->free = pool->free_count;
+    stats->min_free = pool->min_free;
+    stats->failures = pool->failures;
+    portEXIT_CRITICAL(&pool->lock);
+}
@@ -0,0 +1,81 @@
+#ifndef BLOCK_POOL_H
+#define BLOCK_POOL_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+/*
+ * Fixed-size block pools carved out of one PSRAM allocation each, for the buffers that come and go
+ * during a session. A variable-size object takes a chain of blocks, so any mix of sizes fits in the
+ * free blocks and nothing fragments the heap however long the session runs. Allocation and free
+ * walk only the chain, under a spinlock, so their time depends on the object size alone.
+ */
+
+// The pools, each with its own block size and statistics
+typedef enum {
+    BLOCK_POOL_PHOTO = 0, // Offline photo store in PSRAM (photo_store)
+    BLOCK_POOL_OTA,       // OTA download buffers, one block each
+    BLOCK_POOL_COUNT
+} block_pool_id_t;
+
+#define BLOCK_POOL_NONE 0xFFFF // No block: end of a chain, or a failed allocation
+
+typedef struct {
+    uint32_t block_size;
+    uint16_t blocks;    // 0 if the pool could not be allocated
+    uint16_t free;      // Free blocks now
+    uint16_t min_free;  // Fewest free blocks since boot
+    uint32_t failures;  // Allocations refused for lack of free blocks
+} block_pool_stats_t;
+
+/**
+ * @brief Allocate the blocks of a pool, once at boot (later calls leave the pool as it is)
+ * @param pool The pool
+ * @param block_size Bytes per block
+ * @param blocks Number of blocks, below BLOCK_POOL_NONE
+ * @param name For the placement log
+ * @return true if the pool has its blocks
+ */
+bool block_pool_init(block_pool_id_t pool, uint32_t block_size, uint16_t blocks, const char *name);
+
+/**
+ * @brief Take a chain of blocks for len bytes, all or nothing
+ * @param pool The pool
+ * @param len Bytes the chain must hold, at least 1
+ * @return First block of the chain, BLOCK_POOL_NONE if too few blocks are free
+ */
+uint16_t block_pool_alloc(block_pool_id_t pool, size_t len);
+
+/**
+ * @brief Return a chain to the pool
+ * @param pool The pool
+ * @param first First block of the chain, may be BLOCK_POOL_NONE
+ */
+void block_pool_free(block_pool_id_t pool, uint16_t first);
+
+/**
+ * @brief Data of one block (block_size bytes)
+ */
+uint8_t *block_pool_data(block_pool_id_t pool, uint16_t block);
+
+/**
+ * @brief Block after block in its chain, BLOCK_POOL_NONE at the end
+ */
+uint16_t block_pool_next(block_pool_id_t pool, uint16_t block);
+
+/**
+ * @brief Copy len bytes into a chain from its start
+ */
+void block_pool_write(block_pool_id_t pool, uint16_t first, const uint8_t *data, size_t len);
+
+/**
+ * @brief Copy len bytes out of a chain from its start
+ */
+void block_pool_read(block_pool_id_t pool, uint16_t first, uint8_t *out, size_t len);
+
+/**
+ * @brief Get the statistics of a pool
+ */
+void block_pool_stats(block_pool_id_t pool, block_pool_stats_t *stats);
+
+#endif // BLOCK_POOL_H
@@ -0,0 +1,271 @@
+/**
+ * 相机电源模块 - 照片之间让相机进入温待机或完全断电
+ *
+ * 主要功能:
+ * 1. 温待机: OV2640软件待机(COM2寄存器)并暂停XCLK, 传感器寄存器(曝光、增益、白平衡)和帧缓冲区保留
+ *    唤醒只需恢复时钟、写一个寄存器,再等一帧,不需要重新初始化和自动曝光收敛
+ * 2. 断电: 传感器先进入待机再反初始化驱动(本板没有PWDN引脚),下次拍照重新初始化
+ * 3. 策略: 取得一帧后或空闲CAMERA_STANDBY_DELAY_MS后待机; 没有间隔拍照(或间隔超过CAMERA_WARM_INTERVAL_MAX_MS)时
+ *    空闲CAMERA_POWER_DOWN_DELAY_MS后断电。间隔较短时重新初始化的代价高于待机电流,留在待机
+ * 4. 唤醒后丢弃待机前拍摄、还留在帧缓冲区中的旧帧
+ * 5. 拍摄窗口(唤醒到取得一帧)内XCLK提高到CAMERA_XCLK_CAPTURE_FREQ,读出更快,相机和PSRAM活动时间更短;
+ *    取得一帧后恢复CAMERA_XCLK_FREQ并立即待机。每张照片记录活动时间和按电流模型估算的能量,
+ *    CAMERA_XCLK_AB_TEST时两种时钟每CAMERA_XCLK_AB_RUN张轮换,遥测中分别累计,便于比较每张照片的能量;
+ *    曝光按行数计,换时钟后第一张的曝光还是另一种时钟下收敛的,不计入比较
+ *
+ * 6. 启动时只保存配置,第一次唤醒(拍照任务中)才初始化驱动,启动不等待传感器
+ * 7. 视频流(相机预览)期间唤醒不打开拍摄窗口,帧之间传感器保持运行
+ *
+ * 断电会释放帧缓冲区,所以所有帧都经过camera_power_grab/camera_power_release,有帧在外时不断电
+ */
+#include "camera_power.h"
+
+#include <atomic>
+
+#include "config.h"
+#include "driver/ledc.h"
+#include "esp_timer.h"
+#include "metrics.h"
+#include "photo_adapt.h"
+
+#define OV2640_COM2 0x109        // 传感器寄存器组(bank 1)的COM2
+#define OV2640_COM2_STANDBY 0x10 // 软件待机
+
+static camera_config_t camera_config;                 // 断电后重新初始化用
+static camera_power_state_t state = CAMERA_POWER_OFF;
+static bool standby_supported = false;                // 传感器是否支持软件待机
+static std::atomic<int> frames_out(0);                // 已取出未归还的帧
+static unsigned long last_use_ms = 0;                 // 上一次拍摄的时间
+static int64_t wake_us = 0;                           // 上一次唤醒的时间,之前的帧是旧帧
+static bool capturing = false;                        // 拍摄窗口是否打开
+static int64_t capture_start_us = 0;                  // 拍摄窗口打开的时间
+static uint32_t capture_xclk = CAMERA_XCLK_FREQ;      // 本次拍摄窗口的XCLK
+static uint32_t capture_count = 0;                    // 拍摄窗口计数(A/B测试轮换)
+static bool capture_settling = false;                 // A/B测试中换时钟后的第一张,曝光还没有收敛
+static bool streaming = false;                        // 视频流(相机预览)期间不打开拍摄窗口
+
+/**
+ * sensor_standby - 设置传感器的软件待机位
+ *
+ * 写寄存器需要XCLK在运行
+ */
+static bool sensor_standby(bool standby)
+{
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (sensor == nullptr || sensor->id.PID != OV2640_PID) {
+        return false;
+    }
+    return sensor->set_reg(sensor, OV2640_COM2, OV2640_COM2_STANDBY, standby ? OV2640_COM2_STANDBY : 0) == 0;
+}
+
+/**
+ * set_xclk - 重新配置XCLK(驱动的LEDC定时器),频率为整MHz
+ */
+static void set_xclk(uint32_t hz)
+{
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (sensor != nullptr && sensor->set_xclk != nullptr) {
+        sensor->set_xclk(sensor, camera_config.ledc_timer, hz / 1000000);
+    }
+}
+
+/**
+ * enter_standby - 进入温待机: 先让传感器待机,再暂停XCLK
+ */
+static void enter_standby()
+{
+    if (capturing) {
+        capturing = false; // 拍摄失败,窗口作废
+        set_xclk(CAMERA_XCLK_FREQ);
+    }
+    if (!sensor_standby(true)) {
+        standby_supported = false; // 不再尝试,空闲到期后直接断电
+        return;
+    }
+    ledc_timer_pause(LEDC_LOW_SPEED_MODE, camera_config.ledc_timer);
+    state = CAMERA_POWER_STANDBY;
+    Serial.println("Camera in warm standby.");
+}
+
+/**
+ * power_off - 反初始化驱动
+ *
+ * 正在运行时先让传感器待机: 没有PWDN引脚,断开时钟后它仍然上电
+ */
+static void power_off()
+{
+    capturing = false;
+    if (state == CAMERA_POWER_ON) {
+        sensor_standby(true);
+    }
+    esp_camera_deinit();
+    state = CAMERA_POWER_OFF;
+    Serial.println("Camera powered down.");
+}
+
+/**
+ * camera_power_init - 保存配置,驱动在第一次唤醒时初始化
+ */
+void camera_power_init(const camera_config_t *config)
+{
+    camera_config = *config;
+    state = CAMERA_POWER_OFF;
+}
+
+/**
+ * camera_power_wake - 拍照前恢复到运行状态
+ *
+ * 温待机: 恢复XCLK后清除待机位,传感器保留的设置立即生效
+ * 断电(或启动后还没有初始化): 初始化驱动,传感器回到档位0的设置(photo_adapt重新应用)
+ */
+bool camera_power_wake()
+{
+    int64_t start_us = esp_timer_get_time();
+    camera_power_state_t from = state;
+    if (state == CAMERA_POWER_STANDBY) {
+        ledc_timer_resume(LEDC_LOW_SPEED_MODE, camera_config.ledc_timer);
+        sensor_standby(false);
+    } else if (state == CAMERA_POWER_OFF) {
+        esp_err_t err = esp_camera_init(&camera_config);
+        if (err != ESP_OK) {
+            Serial.printf("Camera init failed with error 0x%x\n", err);
+            return false;
+        }
+        sensor_t *sensor = esp_camera_sensor_get();
+        standby_supported = sensor != nullptr && sensor->id.PID == OV2640_PID;
+        photo_adapt_sensor_reset();
+    }
+    state = CAMERA_POWER_ON;
+    if (from != CAMERA_POWER_ON) {
+        wake_us = start_us;
+    }
+    if (streaming) {
+        return true;
+    }
+
+    // 打开拍摄窗口; A/B测试时每CAMERA_XCLK_AB_RUN张换一次时钟
+    if (!capturing) {
+        bool run_b = CAMERA_XCLK_AB_TEST && ((capture_count / CAMERA_XCLK_AB_RUN) & 1);
+        bool boost = CAMERA_XCLK_CAPTURE_FREQ > CAMERA_XCLK_FREQ && !run_b;
+        capture_xclk = boost ? CAMERA_XCLK_CAPTURE_FREQ : CAMERA_XCLK_FREQ;
+        if (boost) {
+            set_xclk(capture_xclk);
+        }
+        capture_settling = CAMERA_XCLK_AB_TEST && capture_count % CAMERA_XCLK_AB_RUN == 0;
+        capture_count++;
+        capturing = true;
+        capture_start_us = start_us;
+    }
+    if (from != CAMERA_POWER_ON) {
+        Serial.printf("Camera awake from %s in %u ms.\n", from == CAMERA_POWER_STANDBY ? "standby" : "power down",
+                      (unsigned) ((esp_timer_get_time() - start_us) / 1000));
+    }
+    return true;
+}
+
+/**
+ * end_capture - 取得一帧后关闭拍摄窗口
+ *
+ * 记录活动时间和估算的能量,恢复基础时钟,支持时立即待机(下一次拍摄至少在一个间隔之后)
+ * 能量 = 电源电压 x (静态电流 + 每MHz电流 x XCLK) x 活动时间
+ */
+static void end_capture()
+{
+    capturing = false;
+    uint32_t active_us = (uint32_t) (esp_timer_get_time() - capture_start_us);
+    uint32_t mhz = capture_xclk / 1000000;
+    uint64_t uw = (uint64_t) CAMERA_SUPPLY_MV * (CAMERA_ACTIVE_UA_STATIC + CAMERA_ACTIVE_UA_PER_MHZ * mhz) / 1000;
+    uint32_t energy_uj = (uint32_t) (uw * active_us / 1000000);
+    bool boosted = capture_xclk != CAMERA_XCLK_FREQ;
+    if (!capture_settling) {
+        metrics_camera_capture(boosted, active_us, energy_uj);
+    }
+    Serial.printf("Capture at %u MHz XCLK: camera active %u ms, about %u uJ%s.\n", (unsigned) mhz,
+                  (unsigned) (active_us / 1000), (unsigned) energy_uj,
+                  capture_settling ? " (settling, not counted)" : "");
+
+    if (boosted) {
+        set_xclk(CAMERA_XCLK_FREQ);
+    }
+    if (standby_supported) {
+        enter_standby();
+    }
+}
+
+/**
+ * camera_power_grab - 取一帧唤醒后拍摄的照片
+ *
+ * CAMERA_GRAB_LATEST时帧缓冲区里可能还有待机前拍的帧,按时间戳丢弃
+ */
+camera_fb_t *camera_power_grab()
+{
+    for (int i = 0; i < CAMERA_WAKE_MAX_STALE_FRAMES; i++) {
+        camera_fb_t *frame = esp_camera_fb_get();
+        if (frame == nullptr) {
+            return nullptr;
+        }
+        int64_t captured_us = (int64_t) frame->timestamp.tv_sec * 1000000 + frame->timestamp.tv_usec;
+        if (captured_us >= wake_us) {
+            frames_out++;
+            last_use_ms = millis();
+            if (capturing) {
+                end_capture();
+            }
+            return frame;
+        }
+        esp_camera_fb_return(frame);
+    }
+    return nullptr;
+}
+
+/**
+ * camera_power_release - 归还一帧
+ */
+void camera_power_release(camera_fb_t *frame)
+{
+    if (frame == nullptr) {
+        return;
+    }
+    esp_camera_fb_return(frame);
+    frames_out--;
+}
+
+/**
+ * camera_power_idle - 空闲策略
+ */
+void camera_power_idle(uint32_t interval_ms)
+{
+    unsigned long idle_ms = millis() - last_use_ms;
+    if (state == CAMERA_POWER_ON && standby_supported && idle_ms >= CAMERA_STANDBY_DELAY_MS) {
+        enter_standby();
+    }
+
+    bool keep_warm = interval_ms > 0 && interval_ms <= CAMERA_WARM_INTERVAL_MAX_MS;
+    if (state != CAMERA_POWER_OFF && !keep_warm && idle_ms >= CAMERA_POWER_DOWN_DELAY_MS && frames_out == 0) {
+        power_off();
+    }
+}
+
+/**
+ * camera_power_set_streaming - 开始或结束视频流
+ */
+void camera_power_set_streaming(bool on)
+{
+    streaming = on;
+}
+
+/**
+ * camera_power_frames_out - 已取出未归还的帧数
+ */
+int camera_power_frames_out()
+{
+    return frames_out;
+}
+
+/**
+ * camera_power_state - 当前状态
+ */
+camera_power_state_t camera_power_state()
+{
+    return state;
+}
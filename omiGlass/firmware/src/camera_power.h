@@ -0,0 +1,50 @@
+#ifndef CAMERA_POWER_H
+#define CAMERA_POWER_H
+
+#include <Arduino.h>
+
+#include "esp_camera.h"
+
+// Camera power states between photos. Warm standby puts the sensor in software standby and gates
+// XCLK, keeping its registers (exposure, gain, white balance) and the frame buffers, so the next
+// frame is ready after one frame time. Off deinitializes the driver; the next photo pays the sensor
+// init and auto-exposure settling again. Frames must be taken and returned through this module.
+
+typedef enum {
+    CAMERA_POWER_ON,      // Streaming frames
+    CAMERA_POWER_STANDBY, // Warm standby
+    CAMERA_POWER_OFF      // Driver deinitialized
+} camera_power_state_t;
+
+// Keep config for the driver init, which is deferred to the first camera_power_wake() so that boot
+// does not wait for the sensor. The camera starts in CAMERA_POWER_OFF
+void camera_power_init(const camera_config_t *config);
+
+// Bring the camera back to streaming before a capture, returns false if it could not be initialized.
+// Opens the capture window: XCLK runs at CAMERA_XCLK_CAPTURE_FREQ until the frame is taken
+bool camera_power_wake();
+
+// Take a frame captured after the last wake, nullptr on failure. Closes the capture window: the
+// clock drops back to CAMERA_XCLK_FREQ, the sensor goes to standby and the capture is counted in
+// the metrics with its active time and estimated energy
+camera_fb_t *camera_power_grab();
+
+// Give a frame from camera_power_grab back to the driver
+void camera_power_release(camera_fb_t *frame);
+
+// Step the idle policy (call from the capture task while no photo is being taken). interval_ms is
+// the capture interval of interval mode, 0 if none: intervals up to CAMERA_WARM_INTERVAL_MAX_MS keep
+// the camera in standby between photos, otherwise it powers off after CAMERA_POWER_DOWN_DELAY_MS.
+void camera_power_idle(uint32_t interval_ms);
+
+// Streaming (camera preview): wakes open no capture window, so frames come at CAMERA_XCLK_FREQ, are
+// not counted in the capture metrics and the sensor stays on between them. Capture task only
+void camera_power_set_streaming(bool streaming);
+
+// Frames taken with camera_power_grab and not released yet
+int camera_power_frames_out();
+
+// Current state
+camera_power_state_t camera_power_state();
+
+#endif // CAMERA_POWER_H
@@ -0,0 +1,301 @@
+/**
+ * 相机实时预览模块 - 通过WiFi提供MJPEG视频流(设置和无障碍场景)
+ *
+ * BLE一次只能传一张照片,做不到实时预览
+ *
+ * 流程:
+ * 1. 客户端发送OTA_CMD_START_PREVIEW(帧率和JPEG质量),用OTA的WiFi凭据连接WiFi(ota_wifi_connect)
+ * 2. 启动HTTP服务器,通知OTA_STATUS_PREVIEW_READY和IP地址、端口、本次预览的随机令牌
+ * 3. 客户端打开/stream?token=<十六进制令牌>: multipart/x-mixed-replace,每个部分一帧JPEG,
+ *    同时只服务一个客户端;令牌只通过BLE发给App,没有令牌或令牌不对时拒绝,
+ *    同一网络中的其他设备看不到相机
+ * 4. 拍照任务按帧率取帧交给流(camera_preview_step),相机只由拍照任务操作;预览期间暂停拍照
+ * 5. 客户端发送OTA_CMD_STOP_PREVIEW,或PREVIEW_IDLE_TIMEOUT_MS内没有客户端时停止,关闭WiFi
+ *
+ * 相机驱动使用CAMERA_FB_COUNT个帧缓冲区和CAMERA_GRAB_LATEST: 发送一帧时下一帧已经在拍摄,
+ * 取到的总是最新的一帧,网络慢时丢帧而不是积累延迟
+ */
+#include "camera_preview.h"
+
+#include <WiFi.h>
+
+#include "camera_power.h"
+#include "config.h"
+#include "esp_http_server.h"
+#include "ota.h"
+#include "photo_adapt.h"
+#include "photo_offload.h"
+#include "power_mgmt.h"
+
+#define PART_BOUNDARY "omiglassframe"
+
+static_assert(6 + PREVIEW_TOKEN_SIZE <= OTA_NOTIFY_DATA_MAX, "Preview address and token must fit one notification");
+
+static volatile bool running = false;        // 预览任务是否正在运行
+static volatile bool stopRequested = false;  // 停止标志
+static volatile bool clientStreaming = false; // 是否有客户端正在接收视频流
+static volatile uint8_t previewFps = PREVIEW_DEFAULT_FPS;
+static volatile uint8_t previewQuality = PREVIEW_DEFAULT_QUALITY;
+static QueueHandle_t frameQueue = nullptr;   // 拍照任务交给视频流的一帧(camera_fb_t *)
+static uint8_t token[PREVIEW_TOKEN_SIZE];    // 本次预览的令牌,启动预览任务前生成
+
+static bool cameraStreaming = false;         // 以下只由拍照任务访问: 相机是否由预览使用
+static uint8_t appliedQuality = 0;           // 已设置到传感器的质量, 0表示未设置
+static unsigned long lastFrameMs = 0;        // 上一帧的时间
+
+/**
+ * drain_frames - 归还还没有发送的帧
+ */
+static void drain_frames()
+{
+    camera_fb_t *frame;
+    while (xQueueReceive(frameQueue, &frame, 0) == pdTRUE) {
+        camera_power_release(frame);
+    }
+}
+
+/**
+ * token_valid - 检查请求的token参数是否为本次预览的令牌
+ *
+ * 比较时间与令牌内容无关
+ *
+ * @param {httpd_req_t*} req - HTTP请求
+ * @returns {bool} 令牌正确返回true
+ */
+static bool token_valid(httpd_req_t *req)
+{
+    char query[16 + 2 * PREVIEW_TOKEN_SIZE];
+    char hex[2 * PREVIEW_TOKEN_SIZE + 1];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "token", hex, sizeof(hex)) != ESP_OK || strlen(hex) != 2 * PREVIEW_TOKEN_SIZE) {
+        return false;
+    }
+    uint8_t diff = 0;
+    for (int i = 0; i < 2 * PREVIEW_TOKEN_SIZE; i++) {
+        char c = hex[i];
+        int digit = -1;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        }
+        uint8_t expected = i % 2 == 0 ? token[i / 2] >> 4 : token[i / 2] & 0x0F;
+        diff |= (digit ^ expected) != 0;
+    }
+    return diff == 0;
+}
+
+/**
+ * stream_handler - /stream请求: 检查令牌后发送MJPEG视频流直到客户端断开或预览停止
+ *
+ * 在HTTP服务器任务中运行
+ */
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    if (!token_valid(req)) {
+        httpd_resp_set_status(req, "401 Unauthorized");
+        return httpd_resp_send(req, "Preview token required", HTTPD_RESP_USE_STRLEN);
+    }
+    if (clientStreaming) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, "Preview busy", HTTPD_RESP_USE_STRLEN);
+    }
+    clientStreaming = true;
+    Serial.println("Preview: Client streaming");
+    httpd_resp_set_type(req, "multipart/x-mixed-replace;boundary=" PART_BOUNDARY);
+
+    esp_err_t err = ESP_OK;
+    while (err == ESP_OK && !stopRequested) {
+        camera_fb_t *frame;
+        if (xQueueReceive(frameQueue, &frame, pdMS_TO_TICKS(PREVIEW_FRAME_WAIT_MS)) != pdTRUE) {
+            continue;
+        }
+        char part[96];
+        int len = snprintf(part, sizeof(part),
+                           "\r\n--" PART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n",
+                           (unsigned) frame->len);
+        err = httpd_resp_send_chunk(req, part, len);
+        if (err == ESP_OK) {
+            err = httpd_resp_send_chunk(req, (const char *) frame->buf, frame->len);
+        }
+        camera_power_release(frame);
+    }
+    if (err == ESP_OK) {
+        httpd_resp_send_chunk(req, nullptr, 0); // 预览停止: 结束响应
+    }
+    clientStreaming = false;
+    drain_frames();
+    Serial.println("Preview: Client stopped streaming");
+    return err;
+}
+
+/**
+ * start_server - 启动HTTP服务器并注册/stream
+ */
+static httpd_handle_t start_server()
+{
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = PREVIEW_HTTP_PORT;
+    config.core_id = PREVIEW_TASK_CORE;
+    config.lru_purge_enable = true; // 客户端异常断开后可以重新连接
+
+    httpd_handle_t server = nullptr;
+    if (httpd_start(&server, &config) != ESP_OK) {
+        return nullptr;
+    }
+    httpd_uri_t stream_uri = {};
+    stream_uri.uri = "/stream";
+    stream_uri.method = HTTP_GET;
+    stream_uri.handler = stream_handler;
+    httpd_register_uri_handler(server, &stream_uri);
+    return server;
+}
+
+/**
+ * preview_task - 预览任务: 连接WiFi、运行HTTP服务器直到停止,然后关闭WiFi
+ */
+static void preview_task(void *parameter)
+{
+    httpd_handle_t server = nullptr;
+    if (ota_wifi_connect()) {
+        server = start_server();
+    }
+    if (server == nullptr) {
+        Serial.println("Preview: Failed to start");
+        stopRequested = true;
+    } else {
+        uint32_t ip = (uint32_t) WiFi.localIP();
+        uint8_t ready[6 + PREVIEW_TOKEN_SIZE] = {(uint8_t) ip,         (uint8_t) (ip >> 8),
+                                                 (uint8_t) (ip >> 16), (uint8_t) (ip >> 24),
+                                                 PREVIEW_HTTP_PORT & 0xFF, PREVIEW_HTTP_PORT >> 8};
+        memcpy(ready + 6, token, sizeof(token));
+        ota_notify_status_data(OTA_STATUS_PREVIEW_READY, ready, sizeof(ready));
+        // 令牌不写进日志
+        Serial.printf("Preview: Streaming at http://%s:%u/stream\n", WiFi.localIP().toString().c_str(),
+                      (unsigned) PREVIEW_HTTP_PORT);
+    }
+
+    unsigned long idleSince = millis();
+    while (!stopRequested) {
+        if (clientStreaming) {
+            idleSince = millis();
+        } else if (millis() - idleSince >= PREVIEW_IDLE_TIMEOUT_MS) {
+            Serial.println("Preview: No client, stopping");
+            stopRequested = true;
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(PREVIEW_FRAME_WAIT_MS));
+    }
+
+    if (server != nullptr) {
+        httpd_stop(server); // 等待视频流处理函数看到停止标志后返回
+    }
+    ota_wifi_off();
+    ota_notify_status(server != nullptr ? OTA_STATUS_PREVIEW_STOPPED : OTA_STATUS_PREVIEW_FAILED);
+    running = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * camera_preview_start - 启动预览,已经在运行时只更新帧率和质量
+ *
+ * @returns {bool} 已启动返回true
+ */
+bool camera_preview_start(uint8_t fps, uint8_t quality)
+{
+    previewFps = fps == 0 ? PREVIEW_DEFAULT_FPS : (fps > PREVIEW_MAX_FPS ? PREVIEW_MAX_FPS : fps);
+    previewQuality = quality == 0 ? PREVIEW_DEFAULT_QUALITY : (quality > 63 ? 63 : quality);
+    Serial.printf("Preview: %u fps, JPEG quality %u\n", (unsigned) previewFps, (unsigned) previewQuality);
+    if (running) {
+        return !stopRequested;
+    }
+    if (ota_is_busy() || photo_offload_is_busy() || !ota_wifi_configured()) {
+        return false;
+    }
+    if (frameQueue == nullptr) {
+        frameQueue = xQueueCreate(1, sizeof(camera_fb_t *));
+        if (frameQueue == nullptr) {
+            return false;
+        }
+    }
+    esp_fill_random(token, sizeof(token)); // 每次预览一个新令牌,上一次的失效
+    stopRequested = false;
+    running = true;
+    if (xTaskCreatePinnedToCore(preview_task, "camera_preview", PREVIEW_TASK_STACK_SIZE, NULL, PREVIEW_TASK_PRIORITY,
+                                NULL, PREVIEW_TASK_CORE) != pdPASS) {
+        running = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * camera_preview_stop - 停止预览(预览任务随后关闭WiFi)
+ */
+void camera_preview_stop()
+{
+    if (running && !stopRequested) {
+        Serial.println("Preview: Stopping...");
+        stopRequested = true;
+    }
+}
+
+/**
+ * camera_preview_is_busy - 检查预览是否正在运行
+ */
+bool camera_preview_is_busy()
+{
+    return running;
+}
+
+/**
+ * camera_preview_step - 拍照任务中按帧率取一帧交给视频流
+ *
+ * 有帧在外(上一帧还没有发送,或BLE正在上传照片)时不取帧,帧缓冲区不会用尽;
+ * 这期间驱动继续拍摄到空闲的帧缓冲区(CAMERA_GRAB_LATEST),取到的仍是最新的一帧
+ * 预览结束时让照片档位重新设置传感器(预览改了JPEG质量)
+ *
+ * @returns {bool} 相机由预览使用时返回true
+ */
+bool camera_preview_step()
+{
+    bool active = running && !stopRequested;
+    if (active != cameraStreaming) {
+        cameraStreaming = active;
+        camera_power_set_streaming(active);
+        appliedQuality = 0;
+        if (active) {
+            power_lock(POWER_LOCK_CAMERA);
+        } else {
+            drain_frames();
+            photo_adapt_sensor_changed();
+            power_unlock(POWER_LOCK_CAMERA);
+        }
+    }
+    if (!active) {
+        return false;
+    }
+
+    unsigned long now = millis();
+    if (!clientStreaming || camera_power_frames_out() > 0 || now - lastFrameMs < 1000u / previewFps) {
+        return true;
+    }
+    if (!camera_power_wake()) {
+        return true;
+    }
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (sensor != nullptr && appliedQuality != previewQuality) {
+        sensor->set_quality(sensor, previewQuality);
+        appliedQuality = previewQuality;
+    }
+    camera_fb_t *frame = camera_power_grab();
+    if (frame != nullptr) {
+        lastFrameMs = now;
+        if (xQueueSend(frameQueue, &frame, 0) != pdTRUE) {
+            camera_power_release(frame);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef CAMERA_PREVIEW_H
+#define CAMERA_PREVIEW_H
+
+#include <Arduino.h>
+
+// Live camera preview over Wi-Fi for setup and accessibility, since BLE only carries one photo at a
+// time. The glasses join the network set for OTA (OTA_CMD_SET_WIFI) and serve an MJPEG stream
+// (multipart/x-mixed-replace) at http://<ip>:PREVIEW_HTTP_PORT/stream, one client at a time. Each
+// preview draws a random token that only goes to the app over BLE, with the address in
+// OTA_STATUS_PREVIEW_READY; the stream is refused without ?token=<the token in hex>. The capture
+// task feeds the stream at the frame rate and JPEG quality the app asked for; interval photos
+// pause while the preview runs. Wi-Fi goes off again when the app stops the preview or no
+// client has streamed for PREVIEW_IDLE_TIMEOUT_MS.
+
+// Start the preview (OTA_CMD_START_PREVIEW), or change the frame rate and quality of a running one.
+// fps and quality of 0 keep the defaults. Returns false without credentials or while an OTA update
+// or photo offload runs
+bool camera_preview_start(uint8_t fps, uint8_t quality);
+
+// Stop the preview (OTA_CMD_STOP_PREVIEW)
+void camera_preview_stop();
+
+// Check if the preview is running (Wi-Fi on)
+bool camera_preview_is_busy();
+
+// Feed the stream (capture task only, every iteration). Returns true while the preview owns the
+// camera, in which case the task takes no photos
+bool camera_preview_step();
+
+#endif // CAMERA_PREVIEW_H
@@ -23,6 +23,8 @@
 #define MAX_CPU_FREQ_MHZ 100   // Further reduced from 120MHz - still sufficient
 #define MIN_CPU_FREQ_MHZ 40    // Ultra-low power for idle states
 #define NORMAL_CPU_FREQ_MHZ 80 // Normal operation frequency (good balance)
+#define PM_MAX_CPU_FREQ_MHZ 160 // Held by camera work only (a valid PLL frequency, 100 is not)
+#define PM_AUTO_LIGHT_SLEEP 1   // Light sleep when no power lock is held, if the build supports it
 
 // Sleep Management
 #define LIGHT_SLEEP_DURATION_US 50000  // 50ms light sleep intervals
@@ -38,8 +40,15 @@
 
 // Battery Monitoring - Extended intervals for power savings
 #define BATTERY_REPORT_INTERVAL_MS 90000 // 1.5 minute reporting (was 60s)
-#define BATTERY_TASK_INTERVAL_MS 20000   // 20 second internal checks (was 15s)
 #define BATTERY_ADC_PIN 2                // GPIO2 (A1) - voltage divider connection
+#define BATTERY_ADC_SAMPLES 16           // Per reading, the lowest and highest quarter are dropped
+#define BATTERY_ADC_SAMPLE_GAP_MS 2      // Between samples, the battery task yields meanwhile
+#define BATTERY_FILTER_ALPHA 0.3f        // Smoothing of the voltage between readings
+// Adaptive reading cadence, from the discharge slope (as on the omi firmware)
+#define BATTERY_REFRESH_MIN_MS 10000     // Unknown slope or close to BATTERY_LOW_VOLTAGE
+#define BATTERY_REFRESH_MAX_MS 120000    // Steady discharge
+#define BATTERY_REFRESH_STEP_MV 10       // Aim for about this much change between readings (~5 mV per ADC step)
+#define BATTERY_SLOPE_SPAN_MS 300000     // Slope measured over at least this long, readings are noisy
 
 // =============================================================================
 // CAMERA CONFIGURATION - Power optimized for 6-8 hour battery life
@@ -47,17 +56,30 @@
 #define CAMERA_FRAME_SIZE FRAMESIZE_VGA // 640x480 - optimal balance
 #define CAMERA_JPEG_QUALITY 25          // Slightly higher quality for better compression efficiency
 #define CAMERA_XCLK_FREQ 6000000        // 6MHz - reduced from 8MHz for power savings
+#define CAMERA_XCLK_CAPTURE_FREQ 20000000 // From wake to the frame only: faster readout, shorter active time
+#define CAMERA_XCLK_AB_TEST 0           // 1: alternate runs of captures between the two clocks to compare energy
+#define CAMERA_XCLK_AB_RUN 8            // Captures per clock; the first after a switch is mis-exposed, not counted
+#define CAMERA_SUPPLY_MV 3300           // Per-capture energy estimate: supply x (static + per MHz) current
+#define CAMERA_ACTIVE_UA_STATIC 12000   // Sensor core, PSRAM and LCD_CAM while streaming (bench estimate)
+#define CAMERA_ACTIVE_UA_PER_MHZ 1500   // Sensor current that grows with XCLK (bench estimate)
 #define CAMERA_FB_IN_PSRAM CAMERA_FB_IN_PSRAM
 #define CAMERA_GRAB_LATEST CAMERA_GRAB_LATEST
+#define CAMERA_FB_COUNT 2               // One frame uploads while the next is captured
+#define PHOTO_QUEUE_DEPTH (CAMERA_FB_COUNT - 1) // Captured frames waiting behind the one uploading
 
 // Fixed Photo Capture Interval - Optimized for 6-8 hour operation
 #define PHOTO_CAPTURE_INTERVAL_MS 30000 // Fixed 30 second interval
 #define CAMERA_TASK_INTERVAL_MS 2000    // 2 second task check
-#define CAMERA_TASK_STACK_SIZE 3072     // Reduced stack size
-#define CAMERA_TASK_PRIORITY 2
+#define CAMERA_TASK_STACK_SIZE 4096     // Photo capture and chunked upload task
+#define CAMERA_TASK_PRIORITY 2          // Below BLE TX on the same core
+#define CAMERA_TASK_CORE 0              // With the BLE stack, away from audio capture
+#define PHOTO_TASK_IDLE_MS 50           // Poll interval while no photo is due or uploading, photo commands wake it
 
 // Camera Power Management - Reduce power cycling
-#define CAMERA_POWER_DOWN_DELAY_MS 60000 // Power down camera after 60s idle (was 8s)
+#define CAMERA_STANDBY_DELAY_MS 1000       // Warm standby (XCLK gated) after 1s idle, at once after a capture
+#define CAMERA_POWER_DOWN_DELAY_MS 60000   // Power down camera after 60s idle (was 8s)
+#define CAMERA_WARM_INTERVAL_MAX_MS 120000 // Capture intervals up to this stay in standby between photos
+#define CAMERA_WAKE_MAX_STALE_FRAMES (CAMERA_FB_COUNT + 1) // Pre-standby frames discarded after a wake
 
 // =============================================================================
 // IMAGE ORIENTATION
@@ -75,28 +97,104 @@ typedef enum {
 // =============================================================================
 // BLE CONFIGURATION - Power optimized for extended battery life
 // =============================================================================
+#define BLE_NIMBLE 0                // 1: NimBLE host (NimBLE-Arduino 1.4) instead of Bluedroid, less internal RAM
 #define BLE_MTU_SIZE 517            // Maximum MTU for efficiency
-#define BLE_CHUNK_SIZE 500          // Safe chunk size for photo transfer
-#define BLE_PHOTO_TRANSFER_DELAY 3  // Fast transfer for connection stability
+#define BLE_CHUNK_SIZE 500          // Max photo data bytes per notification
+#define BLE_ATT_DEFAULT_MTU 23      // Until the central exchanges the MTU
+#define PHOTO_FRAME_MAX_SIZE (BLE_CHUNK_SIZE + 2) // Photo frame with its 2-byte index
+
+// Photo protocol version, read from the photo control characteristic
+// 1: fixed 202-byte frames, 2: frames fill the negotiated MTU (MTU - 3, up to PHOTO_FRAME_MAX_SIZE)
+// 3: photo control also takes [PHOTO_CMD_SET_QUALITY_BOUNDS, best level, worst level]
+// 4: photo control also takes [PHOTO_CMD_SET_THUMBNAIL, 0 or 1]; when on, every new photo is preceded by a
+//    thumbnail transfer whose first frame has PHOTO_META_THUMBNAIL set in its orientation byte
+// 5: photo control also takes [PHOTO_CMD_SET_PHOTO_IDS, 0 or 1]; when on, the first frame of every transfer has
+//    PHOTO_META_ID set and [photo ID u16][byte offset u32] after its orientation byte, and
+//    [PHOTO_CMD_RESUME, photo ID u16, byte offset u32] sends that photo again from the offset (little endian)
+#define PHOTO_PROTOCOL_VERSION 5
+#define PHOTO_CMD_SET_QUALITY_BOUNDS 0x51 // 'Q', never a 1-byte command so it has its own length
+#define PHOTO_CMD_SET_THUMBNAIL 0x54      // 'T', two bytes
+#define PHOTO_CMD_SET_PHOTO_IDS 0x49      // 'I', two bytes
+#define PHOTO_CMD_RESUME 0x52             // 'R', seven bytes
+#define PHOTO_META_THUMBNAIL 0x80         // Orientation byte flag of a thumbnail transfer
+#define PHOTO_META_ID 0x40                // Orientation byte flag of a first frame with photo ID and offset
+
+// Progressive delivery - a small thumbnail uploads ahead of the full frame
+#define PHOTO_THUMB_SCALE JPG_SCALE_4X    // VGA decodes to 160x120
+#define PHOTO_THUMB_SCALE_DIV 4
+#define PHOTO_THUMB_QUALITY 40            // fmt2jpg quality (1-100), about 3 KB at 160x120
+#define PHOTO_THUMB_MAX_BYTES 8192        // Thumbnail buffer, allocated once; larger thumbnails are skipped
+
+// Link-adaptive photos - frame size and JPEG quality follow the measured upload throughput
+#define PHOTO_UPLOAD_TARGET_MS 4000 // Largest photo level expected to upload within this
+#define PHOTO_ADAPT_ALPHA 0.3f      // Weight of the latest photo in the throughput and size averages
+
+// Scene-change detection - interval photos of an unchanged scene are not uploaded
+#define PHOTO_SCENE_DETECTION 1     // 0 uploads every interval photo
+#define PHOTO_SCENE_GRID_W 16       // Luma thumbnail compared between photos
+#define PHOTO_SCENE_GRID_H 12
+#define PHOTO_SCENE_THRESHOLD 6     // Mean absolute luma difference (0-255) that counts as a change
+#define PHOTO_SCENE_MAX_SKIPS 9     // Send at least every 10th photo (5 minutes at 30 s)
+#define PHOTO_SCENE_DECODE_BYTES (80 * 60 * 2) // VGA decoded at 1/8 scale, RGB565
+
+// Offline photo store - interval photos taken while disconnected, uploaded after reconnecting
+#define PHOTO_STORE_SLOT_BYTES (24 * 1024) // Largest photo stored, a multiple of the flash sector
+#define PHOTO_STORE_BLOCK_BYTES 2048       // PSRAM block pool, a photo takes a chain of blocks
+#define PHOTO_STORE_RAM_BLOCKS 288         // 576 KB
+#define PHOTO_STORE_RAM_SLOTS 64           // Photos held in PSRAM at most
+#define PHOTO_STORE_PARTITION "photos"     // Data partition the oldest photos spill to, optional
+#define PHOTO_STORE_MAX_SLOTS 128          // Flash slots used at most (3 MB), and the PSRAM slot limit
+#define PHOTO_STORE_DRAIN_NEWEST_FIRST 0   // 1 uploads the newest stored photo first
+// Photo upload flow control - paced on notification completions instead of a fixed delay
+#define BLE_NOTIFY_WINDOW 8                 // Notifications the link keeps in flight
+#define AUDIO_AIRTIME_RESERVE_PERCENT 25    // Share of that window photos never take
+#define PHOTO_NOTIFY_CREDITS (BLE_NOTIFY_WINDOW * (100 - AUDIO_AIRTIME_RESERVE_PERCENT) / 100)
+#define PHOTO_NOTIFY_TIMEOUT_MS 50          // Send anyway if the stack reports no completion
+#define PHOTO_DELIVERY_TIMEOUT_MS 2000      // A stored photo stays stored if its end marker isn't reported sent
 #define BLE_TX_POWER ESP_PWR_LVL_N0 // Low power for 6+ hour battery life
 
-// Power-optimized BLE Advertising - Longer intervals for power savings
+// BLE TX scheduler - per-class queues, served by priority within weighted airtime shares
+#define BLE_TX_CONTROL_RING_BYTES 512       // Battery and status notifications, a power of two
+#define BLE_TX_PHOTO_RING_BYTES 2048        // Photo frames queued ahead, a power of two
+#define BLE_TX_PACKET_OVERHEAD 17           // ATT, L2CAP and link layer bytes per notification
+#define BLE_TX_QUANTUM_AUDIO 2048           // Airtime bytes per round when classes compete
+#define BLE_TX_QUANTUM_CONTROL 256
+#define BLE_TX_QUANTUM_PHOTO 768
+#define BLE_TX_STORED_RING_BYTES 1024       // Stored audio queued ahead, a power of two
+#define BLE_TX_QUANTUM_STORED 512
+
+// BLE Advertising (intervals in 0.625 ms units) - fast after boot and every disconnect so a phone
+// coming back in range finds the glasses at once, then backed off for power savings
+#define BLE_ADV_FAST_MIN_INTERVAL 0x0020 // 20ms
+#define BLE_ADV_FAST_MAX_INTERVAL 0x0030 // 30ms
+#define BLE_ADV_FAST_WINDOW_MS 30000     // Fast advertising after boot and each disconnect
 #define BLE_ADV_MIN_INTERVAL 0x0140  // 200ms minimum (was 160ms)
 #define BLE_ADV_MAX_INTERVAL 0x0280  // 400ms maximum (was 320ms)
 #define BLE_ADV_TIMEOUT_MS 0         // Never stop advertising (always discoverable)
 #define BLE_SLEEP_ADV_INTERVAL 45000 // Re-advertise every 45 seconds when not connected (was 30s)
 
+// Bonding - Just Works pairing started by the glasses on connect. A bonded phone keeps its GATT cache
+// (no service discovery on reconnect) and, with NimBLE, its notification subscriptions
+#define BLE_BONDING 1
+
 // Connection Management - Stable connections with power optimization
 #define BLE_CONNECTION_TIMEOUT_MS 0 // Never timeout connections (disable auto-disconnect)
 #define BLE_TASK_INTERVAL_MS 20000  // 20 second connection check (was 15s)
 #define BLE_TASK_STACK_SIZE 2048
 #define BLE_TASK_PRIORITY 1
 
-// Connection Parameters for Stable Connections with Power Optimization
-#define BLE_CONN_MIN_INTERVAL 20 // 25ms minimum connection interval (was 20ms)
-#define BLE_CONN_MAX_INTERVAL 40 // 50ms maximum connection interval (was 40ms)
-#define BLE_CONN_LATENCY 0       // No latency for immediate response
-#define BLE_CONN_TIMEOUT 800     // 8 second supervision timeout
+// Connection Parameters - the BLE TX scheduler asks for a short interval and the 2M PHY while photo
+// or stored audio frames are queued, and for a long interval with peripheral latency between bursts.
+// Intervals in 1.25ms units, chosen within the iOS accessory limits
+#define BLE_CONN_BURST_MIN_INTERVAL 12 // 15ms
+#define BLE_CONN_BURST_MAX_INTERVAL 24 // 30ms
+#define BLE_CONN_BURST_LATENCY 0
+#define BLE_CONN_BURST_2M_PHY 1        // 0 stays on the 1M PHY during bursts
+#define BLE_CONN_IDLE_MIN_INTERVAL 80  // 100ms, live audio still fits (about 5 packets per event)
+#define BLE_CONN_IDLE_MAX_INTERVAL 96  // 120ms
+#define BLE_CONN_IDLE_LATENCY 4        // Events the glasses may skip with nothing to send
+#define BLE_CONN_TIMEOUT 800           // 8 second supervision timeout
+#define BLE_CONN_BURST_HOLD_MS 2000    // Bulk traffic idle this long ends a burst (covers gaps between photos)
 
 // =============================================================================
 // POWER STATES
@@ -108,14 +206,40 @@ typedef enum {
     POWER_STATE_SLEEP        // Deep sleep mode
 } power_state_t;
 
+// =============================================================================
+// PERFORMANCE GOVERNOR - tiers by battery level, as on the omi pendant (governor.h)
+// =============================================================================
+#define GOVERNOR 1                    // 0: photo interval and Wi-Fi offload ignore the battery
+#define GOVERNOR_SAVER_PERCENT 40     // At or below, the saver tier (interval photos at half the rate)
+#define GOVERNOR_LOW_PERCENT 20       // At or below, the low tier (a quarter, no automatic Wi-Fi offload)
+#define GOVERNOR_CRITICAL_PERCENT 10  // At or below, the critical tier (an eighth)
+#define GOVERNOR_HYSTERESIS_PERCENT 5 // A tier is only left upward this far above where it was entered
+#define GOVERNOR_MIN_RUNTIME_MIN 120  // One tier lower while the discharge slope projects less
+
 // =============================================================================
 // TASK CONFIGURATION - Optimized stack sizes
 // =============================================================================
 #define BATTERY_TASK_STACK_SIZE 2048
-#define BATTERY_TASK_PRIORITY 1
+#define BATTERY_TASK_PRIORITY 1         // Below audio capture, next to the Arduino loop
+#define BATTERY_TASK_CORE 1
 #define POWER_MANAGEMENT_TASK_STACK_SIZE 2048
 #define POWER_MANAGEMENT_TASK_PRIORITY 0
 
+// Audio capture+encode on core 1, the BLE TX scheduler (ble_tx) on core 0 next to the BLE stack
+#define AUDIO_TASK_STACK_SIZE 8192    // Opus encoding, same as the Arduino loopTask stack
+#define AUDIO_TASK_PRIORITY 5         // Above loopTask (1) on core 1
+#define AUDIO_TASK_CORE 1
+#define AUDIO_STOP_TIMEOUT_MS 500     // Shutdown wait for the capture task to stop the mic
+#define BLE_TX_TASK_STACK_SIZE 4096
+#define BLE_TX_TASK_PRIORITY 4        // Above the photo task on core 0
+#define BLE_TX_TASK_CORE 0
+
+// Arduino loop: button, LED, OTA, power and battery housekeeping only
+#define HOUSEKEEPING_INTERVAL_MS 50
+
+// Memory placement - hot audio buffers go to internal DRAM while this much of it stays free
+#define MEM_INTERNAL_RESERVE_BYTES 32768 // For the BLE/WiFi stacks and task stacks
+
 // Status Reporting - Power optimized
 #define STATUS_REPORT_INTERVAL_MS 120000 // 2 minutes (was 30 seconds)
 
@@ -127,23 +251,67 @@ typedef enum {
 #define MIC_DATA_PIN 41 // PDM Data pin (GPIO41)
 
 #define MIC_SAMPLE_RATE 16000          // 16kHz sample rate
-#define MIC_BUFFER_SAMPLES 1600        // 100ms buffer (16000 * 0.1)
+#define MIC_BUFFER_SAMPLES OPUS_FRAME_SAMPLES // One DMA buffer, a 20ms Opus frame
+#define MIC_DMA_BUF_COUNT 8            // 160ms of DMA buffering while the capture task is busy
+#define MIC_EVENT_QUEUE_LEN 8          // I2S driver events, one per completed DMA buffer
+#define MIC_EVENT_TIMEOUT_MS 25        // Wait for a DMA buffer, so the capture task sees a stop request
+#define MIC_PAUSE_UNSUBSCRIBED 1       // Stop the I2S clock while nobody streams audio, so the chip can sleep
+                                       // (only without AUDIO_STORE_ENABLE, which records that audio instead)
 #define MIC_GAIN 2                     // Microphone gain multiplier
+#define MIC_DC_FILTER 1                // Remove the DC offset of the PDM microphone before the gain
+#define MIC_DC_FILTER_COEF_Q15 32604   // High-pass pole 0.995, about 13 Hz at 16 kHz
 #define AUDIO_RING_BUFFER_SAMPLES 8000 // 500ms of audio data
 
 // =============================================================================
 // OPUS CODEC CONFIGURATION
 // =============================================================================
 #define AUDIO_CODEC_ID 21              // Opus codec ID (matches Omi protocol)
+#define AUDIO_CODEC_ID_MULAW 10        // mu-law 16kHz codec ID, for a CPU-starved device (twice the bitrate)
+#define MULAW_PACKET_SAMPLES 160       // 10ms per packet, one byte per sample (fits OPUS_OUTPUT_MAX_BYTES)
 #define OPUS_FRAME_SAMPLES 320         // 20ms frame @ 16kHz
 #define OPUS_OUTPUT_MAX_BYTES 160      // Max encoded frame size
 #define OPUS_BITRATE 32000             // 32kbps
 #define OPUS_COMPLEXITY 3              // Encoding complexity (1-10)
 #define OPUS_VBR 1                     // Variable bitrate enabled
+#define OPUS_ENCODE_TIMING 0           // 1: log encode time per frame every OPUS_ENCODE_TIMING_FRAMES
+#define OPUS_ENCODE_TIMING_FRAMES 250  // 5 seconds of frames
+#define OPUS_ADAPTIVE_COMPLEXITY 1     // Lower the complexity when encoding eats the frame budget
+#define OPUS_COMPLEXITY_MIN 0
+#define OPUS_COMPLEXITY_MAX 5
+#define OPUS_ADAPT_WINDOW_FRAMES 50    // Decide once a second
+#define OPUS_ADAPT_HIGH_PERCENT 60     // Encode time of the frame budget above which complexity drops
+#define OPUS_ADAPT_LOW_PERCENT 25      // Below which it rises again (one step costs roughly 1.5x)
+
+// Audio path benchmark (audio_bench.h) - runs once at boot, before the audio task starts.
+// The host build (host/CMakeLists.txt) sets the first two on the command line.
+#ifndef AUDIO_BENCH
+#define AUDIO_BENCH 0                     // 1: record, replay and measure the audio path, results on Serial
+#endif
+#ifndef AUDIO_BENCH_SOURCE_MIC
+#define AUDIO_BENCH_SOURCE_MIC 1          // 0: a synthetic voiced signal, the same on every board
+#endif
+#define AUDIO_BENCH_RECORD_MS 10000       // PCM recorded once to PSRAM and replayed
+#define AUDIO_BENCH_PASSES 3              // Replays per ring placement (DRAM, then PSRAM)
+#define AUDIO_BENCH_DRAIN_PER_FRAME 2     // Packets the simulated link takes per 20ms frame (mu-law sends 2)
+#define AUDIO_BENCH_STALL_EVERY 250       // Every 5 seconds of frames...
+#define AUDIO_BENCH_STALL_FRAMES 25       // ...the link takes nothing for 500ms, as during a photo burst
+#define AUDIO_BENCH_GATE_ENCODE_PERCENT 50 // FAIL above this p99 encode time, of the frame duration
+#define AUDIO_BENCH_GATE_DROPS 0          // FAIL above this many ring drops
 
 // Audio BLE packet configuration
-#define AUDIO_PACKET_HEADER_SIZE 3     // 2 bytes index + 1 byte sub-index
-#define AUDIO_TX_RING_BUFFER_SIZE 16   // Number of encoded frames to buffer
+#define AUDIO_PACKET_HEADER_SIZE 3     // 2 bytes index + 1 byte sub-index, PIPE_FRAME_HEADER_SIZE
+#define AUDIO_TX_RING_BYTES 4096       // Audio queue of the BLE TX scheduler, a power of two (>= 16 packets)
+
+// Offline audio store - packets encoded while nobody streams audio, sent on AUDIO_STORED_UUID later
+#define AUDIO_STORE_ENABLE 1                      // 0 drops that audio
+#define AUDIO_STORE_RAM_BYTES (2 * 1024 * 1024)   // PSRAM ring, a power of two (about 8 minutes of Opus)
+#define AUDIO_STORE_PARTITION "audio"             // Data partition the oldest audio spills to, optional
+#define AUDIO_STORE_SECTOR_BYTES 4096             // Flash erase unit, packets never straddle one
+#define AUDIO_STORE_TASK_STACK_SIZE 4096
+#define AUDIO_STORE_TASK_PRIORITY 1               // Below the photo tasks on core 0
+#define AUDIO_STORE_TASK_CORE 0
+#define AUDIO_STORE_IDLE_MS 100                   // Spill and drain check interval while idle
+#define AUDIO_STORE_SEND_WAIT_MS 20               // Wait for room in the BLE_TX_STORED queue
 
 // =============================================================================
 // BLE UUID DEFINITIONS - OMI Protocol
@@ -151,6 +319,7 @@ typedef enum {
 #define OMI_SERVICE_UUID "19B10000-E8F2-537E-4F6C-D104768A1214"
 #define AUDIO_DATA_UUID "19B10001-E8F2-537E-4F6C-D104768A1214"
 #define AUDIO_CODEC_UUID "19B10002-E8F2-537E-4F6C-D104768A1214"
+#define AUDIO_STORED_UUID "19B10007-E8F2-537E-4F6C-D104768A1214" // Notify stored audio packets, read bytes stored
 #define PHOTO_DATA_UUID "19B10005-E8F2-537E-4F6C-D104768A1214"
 #define PHOTO_CONTROL_UUID "19B10006-E8F2-537E-4F6C-D104768A1214"
 
@@ -162,6 +331,16 @@ typedef enum {
 #define OTA_SERVICE_UUID "19B10010-E8F2-537E-4F6C-D104768A1214"
 #define OTA_CONTROL_UUID "19B10011-E8F2-537E-4F6C-D104768A1214"  // Write commands, read status
 #define OTA_DATA_UUID "19B10012-E8F2-537E-4F6C-D104768A1214"     // Notifications for progress
+#define OTA_BLE_DATA_UUID "19B10013-E8F2-537E-4F6C-D104768A1214" // Firmware over BLE, write without response
+
+// Metrics Service UUIDs - same as the omi pendant, the value is metrics_snapshot_t (metrics.h)
+#define METRICS_SERVICE_UUID "19B10050-E8F2-537E-4F6C-D104768A1214"
+#define METRICS_DATA_UUID "19B10051-E8F2-537E-4F6C-D104768A1214" // Read, notified every METRICS_PERIOD_MS
+#define METRICS_PERIOD_MS 10000 // Encode time period, and notification interval while subscribed
+
+// Governor Service UUIDs - same as the omi pendant, the value is governor_state_t (governor.h)
+#define GOVERNOR_SERVICE_UUID "19B10070-E8F2-537E-4F6C-D104768A1214"
+#define GOVERNOR_TIER_UUID "19B10071-E8F2-537E-4F6C-D104768A1214" // Read, notified on every tier change
 
 // OTA Commands (written to OTA_CONTROL_UUID)
 #define OTA_CMD_SET_WIFI 0x01       // Set WiFi credentials: [cmd, ssid_len, ssid..., pass_len, pass...]
@@ -169,6 +348,11 @@ typedef enum {
 #define OTA_CMD_CANCEL_OTA 0x03     // Cancel ongoing OTA
 #define OTA_CMD_GET_STATUS 0x04     // Request current status
 #define OTA_CMD_SET_URL 0x05        // Set firmware URL: [cmd, url_len, url...]
+#define OTA_CMD_SET_OFFLOAD_URL 0x06 // Set the URL offline photos are posted to: [cmd, url_len, url...]
+#define OTA_CMD_START_OFFLOAD 0x07  // Upload the offline photos over WiFi now
+#define OTA_CMD_START_PREVIEW 0x08  // Camera preview over WiFi: [cmd, fps, jpeg_quality], 0 for the defaults
+#define OTA_CMD_STOP_PREVIEW 0x09   // Stop the camera preview
+#define OTA_CMD_BLE_BEGIN 0x0A      // Firmware over BLE: [cmd, size u32 LE], the same size again resumes
 
 // OTA Status codes (notified via OTA_DATA_UUID)
 #define OTA_STATUS_IDLE 0x00
@@ -182,6 +366,13 @@ typedef enum {
 #define OTA_STATUS_INSTALL_COMPLETE 0x31
 #define OTA_STATUS_INSTALL_FAILED 0x32
 #define OTA_STATUS_REBOOTING 0x40
+#define OTA_STATUS_OFFLOADING 0x50       // Followed by progress byte (0-100)
+#define OTA_STATUS_OFFLOAD_COMPLETE 0x51
+#define OTA_STATUS_OFFLOAD_FAILED 0x52
+#define OTA_STATUS_PREVIEW_READY 0x60    // Followed by the IPv4 address (4 bytes), port (u16 LE) and token
+#define OTA_STATUS_PREVIEW_STOPPED 0x61
+#define OTA_STATUS_PREVIEW_FAILED 0x62
+#define OTA_STATUS_BLE_ACK 0x70          // Followed by the bytes written in order (u32 LE), resend from there
 #define OTA_STATUS_ERROR 0xFF
 
 // WiFi Configuration
@@ -189,6 +380,43 @@ typedef enum {
 #define WIFI_MAX_SSID_LEN 32
 #define WIFI_MAX_PASS_LEN 64
 #define OTA_MAX_URL_LEN 256
+#define OTA_NOTIFY_DATA_MAX 14           // Data bytes after the status code in one notification
+#define OTA_DOWNLOAD_BUFFER_SIZE 16384   // Per download buffer, in PSRAM
+#define OTA_DOWNLOAD_BUFFERS 2           // One fills from the network while the flash writer drains the other
+#define OTA_RESUME_ATTEMPTS 5            // Range requests after a dropped download before giving up
+#define OTA_RESUME_BACKOFF_MS 2000       // Wait before retry n is n times this
+#define OTA_STALL_TIMEOUT_MS 10000       // A download without data for this long counts as dropped
+#define OTA_WRITER_TASK_STACK_SIZE 4096
+
+// BLE OTA - packets of [offset u32 LE, data] written to OTA_BLE_DATA_UUID, received into one OTA buffer
+#define OTA_BLE_HEADER_SIZE 4
+#define OTA_BLE_PACKET_MAX (BLE_MTU_SIZE - 3) // One write without response at full MTU
+#define OTA_BLE_WINDOW_BYTES 8192        // Unacknowledged bytes the app may have in flight
+#define OTA_BLE_ACK_BYTES 2048           // Acknowledge at least this often, and whenever the ring empties
+#define OTA_BLE_WAIT_MS 100              // Receive task wait for the next packet
+#define OTA_BLE_STALL_TIMEOUT_MS 30000   // Give up without data for this long (the app may reconnect and resume)
+#define OTA_BLE_TASK_STACK_SIZE 4096     // As the flash writer, delta_patch runs in this task too
+
+// WiFi photo offload - the offline photo store is posted over WiFi instead of BLE
+#define PHOTO_OFFLOAD_THRESHOLD 12       // Stored photos that start an offload (6 minutes at 30 s)
+#define PHOTO_OFFLOAD_RETRY_MS 600000    // Wait after an automatic offload before the next one
+#define PHOTO_OFFLOAD_TIMEOUT_MS 15000   // Per photo POST
+#define PHOTO_OFFLOAD_TASK_STACK_SIZE 8192
+#define PHOTO_OFFLOAD_TASK_PRIORITY 1    // Below the audio and photo tasks
+#define PHOTO_OFFLOAD_TASK_CORE 0        // With the WiFi and BLE stacks
+
+// Camera preview - MJPEG stream over WiFi at http://<ip>:PREVIEW_HTTP_PORT/stream?token=<hex token>
+#define PREVIEW_HTTP_PORT 80
+#define PREVIEW_TOKEN_SIZE 8             // Random per preview, only ever sent over BLE (OTA_STATUS_PREVIEW_READY)
+#define PREVIEW_DEFAULT_FPS 10
+#define PREVIEW_MAX_FPS 15
+#define PREVIEW_DEFAULT_QUALITY 20       // OV2640 JPEG quality (lower is better, up to 63)
+#define PREVIEW_IDLE_TIMEOUT_MS 60000    // Stop when no client streams for this long
+#define PREVIEW_FRAME_WAIT_MS 100        // Stream handler wait for the next frame
+#define PREVIEW_POLL_MS 10               // Capture task poll interval while the preview runs
+#define PREVIEW_TASK_STACK_SIZE 4096
+#define PREVIEW_TASK_PRIORITY 1          // Below the audio and photo tasks
+#define PREVIEW_TASK_CORE 0              // With the WiFi and BLE stacks, also the HTTP server task
 
 // =============================================================================
 // PIN DEFINITIONS (from camera_pins.h integration)
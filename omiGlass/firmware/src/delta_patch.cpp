@@ -0,0 +1,230 @@
+/**
+ * 差分固件模块 - 用正在运行的固件和补丁重建新固件,写入OTA分区
+ *
+ * 补丁格式(小端,见omi/firmware/scripts/delta_patch.py):
+ * - 24字节头: magic "DELT", 版本, 源固件大小和CRC32, 新固件大小和CRC32
+ * - 操作, 直到写满新固件大小:
+ *   0x01 COPY   [源偏移 u32][长度 u32]  复制正在运行的固件
+ *   0x02 INSERT [长度 u16][数据]         新数据
+ *
+ * 安全检查:
+ * - 源固件CRC不符(补丁不是基于正在运行的版本)时拒绝补丁
+ * - 重建的固件CRC符合后才允许Update.end(), Update.end()再验证固件自身的SHA-256
+ */
+#include "delta_patch.h"
+
+#include <Update.h>
+
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#define DELTA_MAGIC 0x544C4544 // "DELT"
+#define DELTA_VERSION 1
+#define DELTA_HEADER_SIZE 24
+#define DELTA_OP_COPY 0x01
+#define DELTA_OP_INSERT 0x02
+#define DELTA_CHUNK_SIZE 1024 // 读取源固件的块大小
+
+static const esp_partition_t *source = nullptr; // 正在运行的应用分区
+static uint32_t sourceSize = 0;
+static uint32_t targetSize = 0;
+static uint32_t targetCrc = 0;
+static uint32_t written = 0;      // 已写入的新固件字节数
+static uint32_t writtenCrc = 0;   // 已写入数据的CRC32
+static bool headerDone = false;
+static uint8_t pending[DELTA_HEADER_SIZE]; // 正在解析的补丁头或操作
+static size_t pendingLen = 0;
+static uint32_t insertLeft = 0;            // 当前INSERT剩余的数据
+static uint8_t chunk[DELTA_CHUNK_SIZE];
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/**
+ * output - 写入新固件数据
+ */
+static bool output(const uint8_t *data, size_t len)
+{
+    if (Update.write((uint8_t *) data, len) != len) {
+        Serial.printf("OTA: Write failed: %s\n", Update.errorString());
+        return false;
+    }
+    writtenCrc = esp_rom_crc32_le(writtenCrc, data, len);
+    written += len;
+    return true;
+}
+
+/**
+ * copy_source - 复制正在运行的固件的一段
+ */
+static bool copy_source(uint32_t offset, uint32_t length)
+{
+    if (offset > sourceSize || length > sourceSize - offset) {
+        Serial.println("OTA: Delta COPY outside the running firmware");
+        return false;
+    }
+    while (length > 0) {
+        uint32_t n = min(length, (uint32_t) DELTA_CHUNK_SIZE);
+        if (esp_partition_read(source, offset, chunk, n) != ESP_OK) {
+            Serial.println("OTA: Failed to read the running firmware");
+            return false;
+        }
+        if (!output(chunk, n)) {
+            return false;
+        }
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * check_header - 检查补丁头,确认补丁基于正在运行的固件,然后开始Update
+ */
+static bool check_header()
+{
+    if (get_le32(&pending[0]) != DELTA_MAGIC || pending[4] != DELTA_VERSION) {
+        Serial.println("OTA: Unsupported delta patch version");
+        return false;
+    }
+    sourceSize = get_le32(&pending[8]);
+    uint32_t sourceCrc = get_le32(&pending[12]);
+    targetSize = get_le32(&pending[16]);
+    targetCrc = get_le32(&pending[20]);
+
+    source = esp_ota_get_running_partition();
+    if (source == nullptr || sourceSize > source->size || targetSize == 0) {
+        Serial.println("OTA: Delta patch doesn't fit the running partition");
+        return false;
+    }
+
+    uint32_t crc = 0;
+    for (uint32_t offset = 0; offset < sourceSize; offset += DELTA_CHUNK_SIZE) {
+        uint32_t n = min(sourceSize - offset, (uint32_t) DELTA_CHUNK_SIZE);
+        if (esp_partition_read(source, offset, chunk, n) != ESP_OK) {
+            Serial.println("OTA: Failed to read the running firmware");
+            return false;
+        }
+        crc = esp_rom_crc32_le(crc, chunk, n);
+    }
+    if (crc != sourceCrc) {
+        Serial.printf("OTA: Delta patch is for firmware CRC %08x, running %08x\n", sourceCrc, crc);
+        return false;
+    }
+
+    if (!Update.begin(targetSize)) {
+        Serial.println("OTA: Not enough space for update");
+        return false;
+    }
+    Serial.printf("OTA: Delta patch, %u byte firmware from %u bytes of the running one\n", targetSize, sourceSize);
+    return true;
+}
+
+/**
+ * pending_need - 补丁头或当前操作需要的字节数
+ */
+static size_t pending_need()
+{
+    if (!headerDone) {
+        return DELTA_HEADER_SIZE;
+    }
+    if (pendingLen == 0) {
+        return 1;
+    }
+    switch (pending[0]) {
+    case DELTA_OP_COPY:
+        return 9;
+    case DELTA_OP_INSERT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * run_pending - 执行解析完的补丁头或操作
+ */
+static bool run_pending()
+{
+    if (!headerDone) {
+        headerDone = true;
+        return check_header();
+    }
+
+    uint32_t length = 0;
+    if (pending[0] == DELTA_OP_COPY) {
+        length = get_le32(&pending[5]);
+    } else if (pending[0] == DELTA_OP_INSERT) {
+        length = pending[1] | (pending[2] << 8);
+    } else {
+        Serial.printf("OTA: Unknown delta operation 0x%02x\n", pending[0]);
+        return false;
+    }
+    if (written == targetSize || length > targetSize - written) {
+        Serial.println("OTA: Delta patch runs past the end of the firmware");
+        return false;
+    }
+    if (pending[0] == DELTA_OP_COPY) {
+        return copy_source(get_le32(&pending[1]), length);
+    }
+    insertLeft = length;
+    return true;
+}
+
+bool delta_patch_detect(const uint8_t *data, size_t len)
+{
+    return len >= DELTA_HEADER_SIZE && get_le32(data) == DELTA_MAGIC;
+}
+
+void delta_patch_begin()
+{
+    source = nullptr;
+    sourceSize = targetSize = targetCrc = 0;
+    written = writtenCrc = 0;
+    headerDone = false;
+    pendingLen = 0;
+    insertLeft = 0;
+}
+
+bool delta_patch_write(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        size_t n;
+        if (insertLeft > 0) {
+            n = min(len, (size_t) insertLeft);
+            if (!output(data, n)) {
+                return false;
+            }
+            insertLeft -= n;
+        } else {
+            n = min(len, pending_need() - pendingLen);
+            memcpy(&pending[pendingLen], data, n);
+            pendingLen += n;
+            if (pendingLen == pending_need()) {
+                pendingLen = 0;
+                if (!run_pending()) {
+                    return false;
+                }
+            }
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool delta_patch_finish()
+{
+    if (!headerDone || written != targetSize || insertLeft > 0 || pendingLen > 0) {
+        Serial.printf("OTA: Delta patch ended after %u of %u bytes\n", written, targetSize);
+        return false;
+    }
+    if (writtenCrc != targetCrc) {
+        Serial.printf("OTA: Rebuilt firmware CRC %08x, expected %08x\n", writtenCrc, targetCrc);
+        return false;
+    }
+    return true;
+}
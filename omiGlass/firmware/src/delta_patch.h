@@ -0,0 +1,22 @@
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <Arduino.h>
+
+// Delta firmware images (omi/firmware/scripts/delta_patch.py) rebuild the new application from the
+// one running, so a small fix downloads a patch of a few KB instead of the whole image. The OTA
+// writer hands a download to this module instead of Update when it starts with the patch magic.
+
+// Check whether a download starts with a delta patch
+bool delta_patch_detect(const uint8_t *data, size_t len);
+
+// Start applying a patch, Update.begin() is called once its header arrived
+void delta_patch_begin();
+
+// Apply the next patch bytes, returns false and logs why if the patch can't be applied
+bool delta_patch_write(const uint8_t *data, size_t len);
+
+// Check that the whole image was written and has the patch's target CRC (before Update.end())
+bool delta_patch_finish();
+
+#endif // DELTA_PATCH_H
@@ -0,0 +1,115 @@
+/**
+ * 性能调节模块 - 按电池电量分档,协调拍照间隔和WiFi上传
+ *
+ * 主要功能:
+ * 1. 每次电池读数后按GOVERNOR_*_PERCENT选择档位,向上恢复需要多出GOVERNOR_HYSTERESIS_PERCENT
+ * 2. 按放电斜率预计的剩余时间少于GOVERNOR_MIN_RUNTIME_MIN时再降一档
+ * 3. 每档拉长间隔拍照的周期,低电量档位不自动启动WiFi批量上传
+ *
+ * 档位变化由应用层通过调节特性通知客户端(与omi吊坠相同的服务)
+ */
+#include "governor.h"
+
+#include "config.h"
+
+// 每档的拍照间隔倍数
+static const uint8_t photo_interval_factor[GOVERNOR_TIER_COUNT] = {1, 2, 4, 8};
+
+// 进入每档的电量(小于等于)
+static const uint8_t tier_enter_percent[GOVERNOR_TIER_COUNT] = {
+    100,
+    GOVERNOR_SAVER_PERCENT,
+    GOVERNOR_LOW_PERCENT,
+    GOVERNOR_CRITICAL_PERCENT,
+};
+
+static const char *const tier_names[GOVERNOR_TIER_COUNT] = {"full", "saver", "low", "critical"};
+
+static governor_state_t state = {GOVERNOR_TIER_FULL, 0, 0, 0, GOVERNOR_RUNTIME_UNKNOWN};
+static uint8_t battery_tier = GOVERNOR_TIER_FULL; // 只按电量选择的档位(电池任务)
+static bool runtime_short = false;                // 预计剩余时间不足,再降一档
+static portMUX_TYPE state_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * tier_for_percent - 按电量选择档位,离开较低档位需要超过阈值GOVERNOR_HYSTERESIS_PERCENT
+ */
+static uint8_t tier_for_percent(int percent, uint8_t current)
+{
+    uint8_t tier = GOVERNOR_TIER_FULL;
+    for (uint8_t t = GOVERNOR_TIER_SAVER; t < GOVERNOR_TIER_COUNT; t++) {
+        if (percent <= tier_enter_percent[t]) {
+            tier = t;
+        }
+    }
+    if (tier >= current) {
+        return tier;
+    }
+    while (current > tier && percent > tier_enter_percent[current] + GOVERNOR_HYSTERESIS_PERCENT) {
+        current--;
+    }
+    return current;
+}
+
+/**
+ * governor_update - 新的电池读数后重新选择档位
+ *
+ * @returns {bool} 档位变化时返回true
+ */
+bool governor_update(int battery_percent, uint16_t runtime_min)
+{
+#if GOVERNOR
+    battery_tier = tier_for_percent(battery_percent, battery_tier);
+    if (runtime_min != GOVERNOR_RUNTIME_UNKNOWN) {
+        // 降档后放电变慢,恢复时留出余量
+        if (runtime_min < GOVERNOR_MIN_RUNTIME_MIN) {
+            runtime_short = true;
+        } else if (runtime_min >= GOVERNOR_MIN_RUNTIME_MIN * 3 / 2) {
+            runtime_short = false;
+        }
+    }
+    uint8_t tier = battery_tier;
+    if (runtime_short && tier < GOVERNOR_TIER_CRITICAL) {
+        tier++;
+    }
+
+    bool changed = tier != state.tier;
+    if (changed) {
+        Serial.printf("Governor: tier %s -> %s (battery %d%%, runtime %u min)\n", tier_names[state.tier],
+                      tier_names[tier], battery_percent, (unsigned) runtime_min);
+    }
+    portENTER_CRITICAL(&state_mux);
+    state.tier = tier;
+    state.battery_percent = (uint8_t) battery_percent;
+    state.runtime_min = runtime_min;
+    portEXIT_CRITICAL(&state_mux);
+    return changed;
+#else
+    return false;
+#endif
+}
+
+/**
+ * governor_get_state - 复制当前档位和选择它的读数
+ */
+void governor_get_state(governor_state_t *out)
+{
+    portENTER_CRITICAL(&state_mux);
+    *out = state;
+    portEXIT_CRITICAL(&state_mux);
+}
+
+/**
+ * governor_photo_interval - 当前档位下的间隔拍照周期
+ */
+uint32_t governor_photo_interval(uint32_t interval_ms)
+{
+    return interval_ms * photo_interval_factor[state.tier];
+}
+
+/**
+ * governor_offload_allowed - 离线照片是否可以自动通过WiFi上传
+ */
+bool governor_offload_allowed()
+{
+    return state.tier < GOVERNOR_TIER_LOW;
+}
@@ -0,0 +1,43 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Battery-aware performance governor (GOVERNOR): steps through the same tiers as the omi pendant
+// as the battery runs down, with hysteresis on the way back up. Each tier stretches the interval
+// photo period and the lower ones stop the automatic Wi-Fi offload. What the app asked for is
+// kept and comes back with the tier; an offload or preview the app starts itself still runs.
+
+typedef enum {
+    GOVERNOR_TIER_FULL,     // Everything as configured
+    GOVERNOR_TIER_SAVER,    // Interval photos at half the rate
+    GOVERNOR_TIER_LOW,      // A quarter of the rate, no automatic Wi-Fi offload
+    GOVERNOR_TIER_CRITICAL, // An eighth of the rate, no automatic Wi-Fi offload
+    GOVERNOR_TIER_COUNT,
+} governor_tier_t;
+
+#define GOVERNOR_RUNTIME_UNKNOWN 0xFFFF
+
+// Value of the tier characteristic, little endian, the same layout as on the omi pendant
+typedef struct __attribute__((packed)) {
+    uint8_t tier;            // governor_tier_t
+    uint8_t battery_percent; // The reading the tier was chosen on
+    uint8_t charging;        // Always 0, the glasses cannot tell
+    uint8_t forced;          // Always 0, there is no shell to hold a tier
+    uint16_t runtime_min;    // Projected from the discharge slope, GOVERNOR_RUNTIME_UNKNOWN until measured
+} governor_state_t;
+
+// Pick the tier from a new battery reading (call from the battery task), returns true if it changed
+bool governor_update(int battery_percent, uint16_t runtime_min);
+
+// Copy the current tier and what it was chosen on
+void governor_get_state(governor_state_t *state);
+
+// The interval photo period for the current tier, 0 (single photo) stays 0
+uint32_t governor_photo_interval(uint32_t interval_ms);
+
+// Check if the store may start a Wi-Fi offload on its own
+bool governor_offload_allowed();
+
+#endif // GOVERNOR_H
@@ -0,0 +1,71 @@
+/**
+ * 内存放置策略
+ *
+ * 音频路径每帧都要访问的缓冲区(输入帧、输出帧、编码器状态等)放在内部DRAM,
+ * 照片等大块数据放在PSRAM
+ * PSRAM走八线SPI总线,还要和相机帧缓冲区争用带宽,比内部RAM慢得多
+ */
+#include "mem_placement.h"
+
+#include <esp_heap_caps.h>
+
+#include "config.h"
+
+#define CAPS_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define CAPS_PSRAM (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+
+/**
+ * mem_alloc_hot - 分配热点缓冲区
+ *
+ * 内部DRAM分配后仍剩余MEM_INTERNAL_RESERVE_BYTES时放在内部DRAM,
+ * 否则放在PSRAM(保留空间给BLE/WiFi协议栈和任务栈)
+ */
+void *mem_alloc_hot(size_t size, const char *name)
+{
+    void *ptr = nullptr;
+    if (heap_caps_get_free_size(CAPS_INTERNAL) >= size + MEM_INTERNAL_RESERVE_BYTES) {
+        ptr = heap_caps_malloc(size, CAPS_INTERNAL);
+    }
+    if (ptr != nullptr) {
+        Serial.printf("%s: %u bytes in internal DRAM\n", name, (unsigned) size);
+        return ptr;
+    }
+
+    ptr = heap_caps_malloc(size, CAPS_PSRAM);
+    if (ptr != nullptr) {
+        Serial.printf("%s: %u bytes in PSRAM (internal DRAM full)\n", name, (unsigned) size);
+    } else {
+        Serial.printf("%s: failed to allocate %u bytes\n", name, (unsigned) size);
+    }
+    return ptr;
+}
+
+/**
+ * mem_alloc_bulk - 分配大块缓冲区
+ *
+ * 优先放在PSRAM,没有PSRAM时使用内部DRAM
+ */
+void *mem_alloc_bulk(size_t size, const char *name)
+{
+    void *ptr = heap_caps_malloc(size, CAPS_PSRAM);
+    if (ptr != nullptr) {
+        Serial.printf("%s: %u bytes in PSRAM\n", name, (unsigned) size);
+        return ptr;
+    }
+
+    ptr = heap_caps_malloc(size, CAPS_INTERNAL);
+    if (ptr != nullptr) {
+        Serial.printf("%s: %u bytes in internal DRAM (no PSRAM)\n", name, (unsigned) size);
+    } else {
+        Serial.printf("%s: failed to allocate %u bytes\n", name, (unsigned) size);
+    }
+    return ptr;
+}
+
+/**
+ * mem_free - 释放缓冲区(两种内存都用heap_caps_free)
+ */
+void mem_free(void *ptr)
+{
+    heap_caps_free(ptr);
+}
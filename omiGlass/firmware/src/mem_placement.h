@@ -0,0 +1,35 @@
+#ifndef MEM_PLACEMENT_H
+#define MEM_PLACEMENT_H
+
+#include <Arduino.h>
+#include <stddef.h>
+
+/*
+ * Where buffers go: internal DRAM for the per-frame working set of the audio path (touched at
+ * every frame, and PSRAM shares the octal SPI bus with the camera frame buffer), PSRAM for bulk
+ * data such as photos. Both fall back to the other memory rather than fail.
+ */
+
+/**
+ * @brief Allocate a hot buffer, in internal DRAM while MEM_INTERNAL_RESERVE_BYTES stay free
+ * @param size Bytes to allocate
+ * @param name For the placement log
+ * @return The buffer, or nullptr if neither memory has room
+ */
+void *mem_alloc_hot(size_t size, const char *name);
+
+/**
+ * @brief Allocate a bulk buffer, in PSRAM when available
+ * @param size Bytes to allocate
+ * @param name For the placement log
+ * @return The buffer, or nullptr if neither memory has room
+ */
+void *mem_alloc_bulk(size_t size, const char *name);
+
+/**
+ * @brief Free a buffer from mem_alloc_hot() or mem_alloc_bulk()
+ * @param ptr The buffer, may be nullptr
+ */
+void mem_free(void *ptr);
+
+#endif // MEM_PLACEMENT_H
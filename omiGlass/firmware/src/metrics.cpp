@@ -0,0 +1,132 @@
+/**
+ * 性能遥测模块 - 各模块的计数器,通过metrics特性读取或订阅
+ *
+ * 主要功能:
+ * 1. 编码时间: 每个统计周期(METRICS_PERIOD_MS)的平均和最大值
+ * 2. 丢失计数: 编码输入环形缓冲区覆盖的采样点,BLE发送队列满时丢弃的音频包
+ * 3. 照片上传: 数量,最近一张的大小、耗时和吞吐量
+ * 4. CPU频率驻留时间和轻度睡眠时间(来自power_mgmt)
+ * 5. 相机拍摄窗口: 按XCLK(基础/提高)分别累计次数、活动时间和估算能量
+ * 6. PSRAM块池: 空闲块数、最少空闲块数和分配失败次数(来自block_pool)
+ *
+ * 计数器由各任务更新(两个核心),用原子变量; 64位的相机计数器不能原子读写,和次数一起在锁内更新和读取
+ */
+#include "metrics.h"
+
+#include <atomic>
+
+#include <freertos/FreeRTOS.h>
+
+static std::atomic<uint32_t> encode_frames{0};
+static std::atomic<uint32_t> period_encode_frames{0}; // 本周期
+static std::atomic<uint32_t> period_encode_us{0};
+static std::atomic<uint32_t> period_encode_max_us{0};
+static uint16_t last_encode_avg_us = 0; // 上一个周期
+static uint16_t last_encode_max_us = 0;
+static std::atomic<uint32_t> pcm_overwrite_samples{0};
+static std::atomic<uint32_t> audio_tx_drops{0};
+static std::atomic<uint32_t> photos_uploaded{0};
+static uint32_t photo_last_bytes = 0; // 只由上传任务写入
+static uint32_t photo_last_ms = 0;
+static portMUX_TYPE camera_lock = portMUX_INITIALIZER_UNLOCKED; // 拍摄任务写入,读取快照的任务在另一个核心
+static uint32_t camera_captures[2] = {0, 0};
+static uint64_t camera_active_us[2] = {0, 0};
+static uint64_t camera_energy_uj[2] = {0, 0};
+
+// 饱和到uint16_t
+static uint16_t clamp_u16(uint32_t value)
+{
+    return value > 0xFFFF ? 0xFFFF : (uint16_t) value;
+}
+
+void metrics_add_encode_us(uint32_t us)
+{
+    encode_frames.fetch_add(1, std::memory_order_relaxed);
+    period_encode_frames.fetch_add(1, std::memory_order_relaxed);
+    period_encode_us.fetch_add(us, std::memory_order_relaxed);
+    uint32_t max = period_encode_max_us.load(std::memory_order_relaxed);
+    while (us > max && !period_encode_max_us.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    }
+}
+
+void metrics_add_pcm_overwrite(uint32_t samples)
+{
+    pcm_overwrite_samples.fetch_add(samples, std::memory_order_relaxed);
+}
+
+void metrics_add_audio_drop()
+{
+    audio_tx_drops.fetch_add(1, std::memory_order_relaxed);
+}
+
+void metrics_photo_uploaded(size_t bytes, uint32_t duration_ms)
+{
+    photo_last_bytes = bytes;
+    photo_last_ms = duration_ms;
+    photos_uploaded.fetch_add(1, std::memory_order_relaxed);
+}
+
+void metrics_camera_capture(bool boosted, uint32_t active_us, uint32_t energy_uj)
+{
+    portENTER_CRITICAL(&camera_lock);
+    camera_captures[boosted]++;
+    camera_active_us[boosted] += active_us;
+    camera_energy_uj[boosted] += energy_uj;
+    portEXIT_CRITICAL(&camera_lock);
+}
+
+/**
+ * metrics_roll - 结束当前统计周期,保存本周期的编码时间
+ */
+void metrics_roll()
+{
+    uint32_t frames = period_encode_frames.exchange(0, std::memory_order_relaxed);
+    uint32_t total_us = period_encode_us.exchange(0, std::memory_order_relaxed);
+    uint32_t max_us = period_encode_max_us.exchange(0, std::memory_order_relaxed);
+    last_encode_avg_us = frames > 0 ? clamp_u16(total_us / frames) : 0;
+    last_encode_max_us = clamp_u16(max_us);
+}
+
+/**
+ * metrics_snapshot - 填充所有计数器的快照
+ */
+void metrics_snapshot(metrics_snapshot_t *snapshot)
+{
+    snapshot->version = METRICS_SNAPSHOT_VERSION;
+    snapshot->uptime_ms = millis();
+    snapshot->encode_frames = encode_frames.load(std::memory_order_relaxed);
+    snapshot->encode_avg_us = last_encode_avg_us;
+    snapshot->encode_max_us = last_encode_max_us;
+    snapshot->pcm_overwrite_samples = pcm_overwrite_samples.load(std::memory_order_relaxed);
+    snapshot->audio_tx_drops = audio_tx_drops.load(std::memory_order_relaxed);
+    snapshot->photos_uploaded = photos_uploaded.load(std::memory_order_relaxed);
+    snapshot->photo_last_bytes = photo_last_bytes;
+    snapshot->photo_last_ms = photo_last_ms;
+    snapshot->photo_last_bytes_per_s =
+        photo_last_ms > 0 ? (uint32_t) ((uint64_t) photo_last_bytes * 1000 / photo_last_ms) : 0;
+
+    uint32_t residency[POWER_FREQ_COUNT];
+    power_residency_ms(residency);
+    memcpy(snapshot->cpu_freq_ms, residency, sizeof(residency));
+    snapshot->light_sleep_ms = power_light_sleep_ms();
+    uint32_t captures[2];
+    uint64_t active_us[2];
+    uint64_t energy_uj[2];
+    portENTER_CRITICAL(&camera_lock);
+    memcpy(captures, camera_captures, sizeof(captures));
+    memcpy(active_us, camera_active_us, sizeof(active_us));
+    memcpy(energy_uj, camera_energy_uj, sizeof(energy_uj));
+    portEXIT_CRITICAL(&camera_lock);
+    for (int i = 0; i < 2; i++) {
+        snapshot->camera_captures[i] = captures[i];
+        snapshot->camera_active_ms[i] = (uint32_t) (active_us[i] / 1000);
+        snapshot->camera_energy_mj[i] = (uint32_t) (energy_uj[i] / 1000);
+    }
+    for (int i = 0; i < BLOCK_POOL_COUNT; i++) {
+        block_pool_stats_t stats;
+        block_pool_stats((block_pool_id_t) i, &stats);
+        snapshot->pool_free[i] = stats.free;
+        snapshot->pool_min_free[i] = stats.min_free;
+        snapshot->pool_failures[i] = stats.failures;
+    }
+}
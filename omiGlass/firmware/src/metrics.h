@@ -0,0 +1,62 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "block_pool.h"
+#include "power_mgmt.h"
+
+// Performance counters, read by the app from the metrics characteristic (the same service UUID as
+// the omi pendant's). Counters run since boot; encode times cover the last metrics period.
+
+#define METRICS_SNAPSHOT_VERSION 3
+
+// Value of the metrics characteristic, little endian. Fields are only ever appended; bump
+// METRICS_SNAPSHOT_VERSION when they are.
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint32_t uptime_ms;
+    uint32_t encode_frames;                    // Opus frames encoded
+    uint16_t encode_avg_us;                    // Over the last period
+    uint16_t encode_max_us;                    // Over the last period
+    uint32_t pcm_overwrite_samples;            // Dropped by opus_receive_pcm when encoding fell behind
+    uint32_t audio_tx_drops;                   // Audio packets the BLE TX queue had no room for
+    uint32_t photos_uploaded;                  // Over BLE
+    uint32_t photo_last_bytes;                 // Last BLE photo upload
+    uint32_t photo_last_ms;
+    uint32_t photo_last_bytes_per_s;
+    uint32_t cpu_freq_ms[POWER_FREQ_COUNT];    // Residency at 40, 80, 160 and 240 MHz
+    uint32_t light_sleep_ms;                   // POWER_UNKNOWN if the build cannot report it
+    // Version 2: captures at CAMERA_XCLK_FREQ [0] and boosted to CAMERA_XCLK_CAPTURE_FREQ [1]
+    uint32_t camera_captures[2];
+    uint32_t camera_active_ms[2];              // Wake to frame, summed
+    uint32_t camera_energy_mj[2];              // Estimated from the CAMERA_ACTIVE_UA_* model, summed
+    // Version 3: PSRAM block pools, indexed by block_pool_id_t (all 0 for a pool not allocated yet)
+    uint16_t pool_free[BLOCK_POOL_COUNT];      // Free blocks now
+    uint16_t pool_min_free[BLOCK_POOL_COUNT];  // Fewest free blocks since boot
+    uint32_t pool_failures[BLOCK_POOL_COUNT];  // Allocations refused for lack of free blocks
+} metrics_snapshot_t;
+
+// Count one encoded frame and how long it took
+void metrics_add_encode_us(uint32_t us);
+
+// Count PCM samples overwritten in the encoder's input ring
+void metrics_add_pcm_overwrite(uint32_t samples);
+
+// Count an audio packet dropped because the BLE TX queue was full
+void metrics_add_audio_drop();
+
+// Record a finished BLE photo upload
+void metrics_photo_uploaded(size_t bytes, uint32_t duration_ms);
+
+// Record a capture window: whether XCLK was boosted, how long the camera streamed, estimated energy
+void metrics_camera_capture(bool boosted, uint32_t active_us, uint32_t energy_uj);
+
+// End the current period (call every METRICS_PERIOD_MS), the snapshot then reports its encode times
+void metrics_roll();
+
+// Fill a snapshot of all counters
+void metrics_snapshot(metrics_snapshot_t *snapshot);
+
+#endif // METRICS_H
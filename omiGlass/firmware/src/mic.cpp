@@ -4,7 +4,7 @@
  * 负责从XIAO ESP32S3 Sense板载PDM麦克风采集音频数据
  * 主要功能:
  * 1. 初始化I2S PDM麦克风
- * 2. 读取音频数据并应用增益
+ * 2. 读取音频数据(增益和去直流在写入编码器时应用,见pcm_kernels.h)
  * 3. 通过回调函数将音频数据传递给编码器
  */
 #include "mic.h"
@@ -12,14 +12,20 @@
 #include <driver/i2s.h>
 
 #include "config.h"
+#include "mem_placement.h"
 
 // I2S端口配置:使用I2S_NUM_0端口
 #define I2S_PORT I2S_NUM_0
 
 // 静态变量
 static volatile bool mic_running = false;          // 麦克风运行状态标志
+static volatile bool mic_paused = false;           // I2S时钟是否暂停(驱动保持安装)
 static mic_data_handler audio_callback = nullptr;  // 音频数据回调函数
-static int16_t *i2s_read_buffer = nullptr;         // I2S读取缓冲区
+static int16_t *i2s_read_buffer = nullptr;         // I2S读取缓冲区(一帧,20ms)
+static size_t fill_bytes = 0;                      // 读取缓冲区中还不满一帧的字节数
+static volatile bool resync = false;               // 恢复后由采集任务丢弃旧事件和不满一帧的数据
+static QueueHandle_t i2s_event_queue = nullptr;    // I2S驱动事件队列(DMA缓冲区完成)
+static uint32_t overruns = 0;                      // 事件队列溢出次数(采集任务没有及时读取)
 
 /**
  * mic_start - 启动麦克风
@@ -27,10 +33,10 @@ static int16_t *i2s_read_buffer = nullptr;         // I2S读取缓冲区
  * @returns {bool} 成功返回true,失败返回false
  *
  * 功能说明:
- * 1. 分配PSRAM缓冲区用于音频数据
- * 2. 配置I2S为PDM模式
+ * 1. 分配音频数据缓冲区(内部DRAM优先)
+ * 2. 配置I2S为PDM模式,每个DMA缓冲区正好一帧(MIC_BUFFER_SAMPLES)
  * 3. 设置麦克风引脚(CLK和DATA)
- * 4. 安装I2S驱动
+ * 4. 安装I2S驱动和事件队列
  * 5. 清空DMA缓冲区
  */
 bool mic_start()
@@ -45,20 +51,11 @@ bool mic_start()
     Serial.printf("  DATA Pin: GPIO%d\n", MIC_DATA_PIN);
     Serial.printf("  Sample Rate: %d Hz\n", MIC_SAMPLE_RATE);
 
-    // 分配缓冲区,优先使用PSRAM以节省内部RAM
+    // 分配缓冲区: 每次读取都会访问,放在内部DRAM(见mem_placement.h)
     if (i2s_read_buffer == nullptr) {
-        i2s_read_buffer = (int16_t *) ps_malloc(MIC_BUFFER_SAMPLES * sizeof(int16_t));
+        i2s_read_buffer = (int16_t *) mem_alloc_hot(MIC_BUFFER_SAMPLES * sizeof(int16_t), "Mic buffer");
         if (i2s_read_buffer == nullptr) {
-            Serial.println("Failed to allocate mic buffer in PSRAM!");
-            // PSRAM分配失败,尝试使用常规RAM
-            i2s_read_buffer = (int16_t *) malloc(MIC_BUFFER_SAMPLES * sizeof(int16_t));
-            if (i2s_read_buffer == nullptr) {
-                Serial.println("Failed to allocate mic buffer!");
-                return false;
-            }
-            Serial.println("Using regular RAM for mic buffer");
-        } else {
-            Serial.println("Using PSRAM for mic buffer");
+            return false;
         }
     }
 
@@ -70,8 +67,8 @@ bool mic_start()
         .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,                         // 单声道(左声道)
         .communication_format = I2S_COMM_FORMAT_STAND_I2S,                   // 标准I2S格式
         .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,                            // 中断优先级
-        .dma_buf_count = 8,                                                   // DMA缓冲区数量
-        .dma_buf_len = 256,                                                   // DMA缓冲区长度
+        .dma_buf_count = MIC_DMA_BUF_COUNT,                                   // DMA缓冲区数量
+        .dma_buf_len = MIC_BUFFER_SAMPLES,                                    // DMA缓冲区长度(一帧)
         .use_apll = false,                                                    // 不使用APLL
         .tx_desc_auto_clear = false,                                          // 不自动清除TX描述符
         .fixed_mclk = 0,                                                      // 不使用固定MCLK
@@ -85,8 +82,8 @@ bool mic_start()
         .data_in_num = MIC_DATA_PIN,        // 数据输入引脚(GPIO41)
     };
 
-    // 安装I2S驱动
-    esp_err_t err = i2s_driver_install(I2S_PORT, &i2s_config, 0, NULL);
+    // 安装I2S驱动,每完成一个DMA缓冲区发送一个事件
+    esp_err_t err = i2s_driver_install(I2S_PORT, &i2s_config, MIC_EVENT_QUEUE_LEN, &i2s_event_queue);
     if (err != ESP_OK) {
         Serial.printf("Failed to install I2S driver: %s\n", esp_err_to_name(err));
         return false;
@@ -122,7 +119,11 @@ void mic_stop()
     Serial.println("Stopping microphone...");
 
     i2s_stop(I2S_PORT);
-    i2s_driver_uninstall(I2S_PORT);
+    i2s_driver_uninstall(I2S_PORT); // 同时删除事件队列
+    i2s_event_queue = nullptr;
+    fill_bytes = 0;
+    resync = false;
+    mic_paused = false;
 
     mic_running = false;
     Serial.println("Microphone stopped");
@@ -138,6 +139,40 @@ bool mic_is_running()
     return mic_running;
 }
 
+/**
+ * mic_set_paused - 暂停或恢复I2S采集
+ *
+ * @param {bool} paused - true暂停
+ *
+ * 暂停时停止I2S时钟和DMA,驱动释放其电源管理锁,芯片可以自动进入轻度睡眠
+ * (I2S运行时外设时钟不能停,采集期间无法轻度睡眠)
+ */
+void mic_set_paused(bool paused)
+{
+    if (!mic_running || paused == mic_paused) {
+        return;
+    }
+    if (paused) {
+        i2s_stop(I2S_PORT);
+    } else {
+        i2s_zero_dma_buffer(I2S_PORT); // 丢弃暂停前的旧数据
+        resync = true;                 // 事件和不满一帧的数据由采集任务丢弃
+        i2s_start(I2S_PORT);
+    }
+    mic_paused = paused;
+    Serial.println(paused ? "Microphone paused" : "Microphone resumed");
+}
+
+/**
+ * mic_is_paused - 检查麦克风是否暂停
+ *
+ * @returns {bool} 暂停返回true
+ */
+bool mic_is_paused()
+{
+    return mic_paused;
+}
+
 /**
  * mic_set_callback - 设置音频数据回调函数
  *
@@ -153,43 +188,65 @@ void mic_set_callback(mic_data_handler callback)
 /**
  * mic_process - 处理麦克风数据
  *
- * 需要在主循环中定期调用此函数
+ * 在音频采集任务中循环调用,等待DMA完成事件期间让出CPU
+ *
+ * @returns {size_t} 交给回调的采样点数量,超时或没有完整的一帧时返回0
+ *
  * 功能说明:
- * 1. 从I2S读取音频数据
- * 2. 应用增益系数(MIC_GAIN)
- * 3. 限幅处理防止溢出
- * 4. 通过回调函数传递数据
+ * 1. 等待I2S驱动的DMA完成事件(最多MIC_EVENT_TIMEOUT_MS)
+ * 2. 不等待地读取所有已完成的数据,每满一帧(20ms)通过回调传递原始数据
+ *    (增益MIC_GAIN在opus_receive_pcm写入时应用)
+ *
+ * 事件只用来唤醒,不和DMA缓冲区一一对应: 驱动溢出时丢弃的缓冲区、上次已经读走的缓冲区都可能
+ * 还有事件在队列中,这时读不到数据,直接返回; 不满一帧的数据留在读取缓冲区,驱动记住DMA缓冲区中
+ * 的读取位置,下次接着读,帧边界不会错位
  */
-void mic_process()
+size_t mic_process()
 {
-    if (!mic_running || i2s_read_buffer == nullptr) {
-        return;
+    if (!mic_running || i2s_read_buffer == nullptr || i2s_event_queue == nullptr) {
+        return 0;
     }
 
-    size_t bytes_read = 0;
-    // 从I2S读取数据,超时时间20ms
-    esp_err_t err =
-        i2s_read(I2S_PORT, i2s_read_buffer, MIC_BUFFER_SAMPLES * sizeof(int16_t), &bytes_read, pdMS_TO_TICKS(20));
-
-    if (err == ESP_OK && bytes_read > 0) {
-        size_t samples_read = bytes_read / sizeof(int16_t);
-
-        // 应用增益(如果需要)
-        if (MIC_GAIN != 1) {
-            for (size_t i = 0; i < samples_read; i++) {
-                int32_t sample = (int32_t) i2s_read_buffer[i] * MIC_GAIN;
-                // 限幅到16位范围(-32768 ~ 32767)
-                if (sample > 32767)
-                    sample = 32767;
-                if (sample < -32768)
-                    sample = -32768;
-                i2s_read_buffer[i] = (int16_t) sample;
-            }
-        }
+    // 等待一个DMA缓冲区完成
+    i2s_event_t event;
+    if (xQueueReceive(i2s_event_queue, &event, pdMS_TO_TICKS(MIC_EVENT_TIMEOUT_MS)) != pdTRUE) {
+        return 0;
+    }
+    if (event.type == I2S_EVENT_RX_Q_OVF) {
+        // 驱动丢弃了最旧的DMA缓冲区,继续读取剩下的数据
+        overruns++;
+        Serial.printf("Mic: DMA overrun (%u)\n", (unsigned) overruns);
+    } else if (event.type != I2S_EVENT_RX_DONE) {
+        return 0;
+    }
+
+    if (resync) {
+        // 暂停前的事件和数据,恢复后的第一个事件之前的都不要
+        resync = false;
+        xQueueReset(i2s_event_queue);
+        fill_bytes = 0;
+        return 0;
+    }
 
-        // 通过回调函数传递音频数据
+    const size_t frame_bytes = MIC_BUFFER_SAMPLES * sizeof(int16_t);
+    size_t samples = 0;
+    while (true) {
+        size_t bytes_read = 0;
+        // 只读已完成的数据,没有时返回ESP_ERR_TIMEOUT
+        esp_err_t err =
+            i2s_read(I2S_PORT, (uint8_t *) i2s_read_buffer + fill_bytes, frame_bytes - fill_bytes, &bytes_read, 0);
+        fill_bytes += bytes_read;
+        if (fill_bytes < frame_bytes) {
+            break;
+        }
+        fill_bytes = 0;
         if (audio_callback != nullptr) {
-            audio_callback(i2s_read_buffer, samples_read);
+            audio_callback(i2s_read_buffer, MIC_BUFFER_SAMPLES);
+        }
+        samples += MIC_BUFFER_SAMPLES;
+        if (err != ESP_OK) {
+            break;
         }
     }
+    return samples;
 }
@@ -4,7 +4,7 @@
 #include <Arduino.h>
 #include <stdint.h>
 
-// Callback type for audio data
+// Callback type for audio data, raw samples (MIC_GAIN is applied by opus_receive_pcm)
 typedef void (*mic_data_handler)(int16_t *data, size_t samples);
 
 /**
@@ -24,6 +24,19 @@ void mic_stop();
  */
 bool mic_is_running();
 
+/**
+ * @brief Pause or resume the I2S clock while the driver stays installed. A paused mic releases
+ *        the driver's power management lock, so the chip can light sleep.
+ * @param paused true to pause
+ */
+void mic_set_paused(bool paused);
+
+/**
+ * @brief Check if mic is paused
+ * @return true if paused
+ */
+bool mic_is_paused();
+
 /**
  * @brief Set callback for mic data
  * @param callback Function to call when audio data is ready
@@ -31,8 +44,11 @@ bool mic_is_running();
 void mic_set_callback(mic_data_handler callback);
 
 /**
- * @brief Process mic data (call from main loop or task)
+ * @brief Process mic data (call from the audio task), waits up to MIC_EVENT_TIMEOUT_MS for a DMA
+ *        buffer to complete, then passes every whole 20 ms frame read so far to the callback.
+ *        The rest of a frame waits for the next call.
+ * @return Number of samples passed to the callback, 0 if none
  */
-void mic_process();
+size_t mic_process();
 
 #endif // MIC_H
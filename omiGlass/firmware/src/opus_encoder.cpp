@@ -11,23 +11,46 @@
 #include "opus_encoder.h"
 
 #include <opus.h>
-#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <string.h>
 
 #include "config.h"
+#include "mem_placement.h"
+#include "metrics.h"
+#include "mulaw.h"
+#include "pcm_kernels.h"
 
 // Opus编码器实例
 static OpusEncoder *encoder = nullptr;
 static opus_encoded_handler encoded_callback = nullptr;  // 编码数据回调函数
+static volatile uint8_t codec_id = AUDIO_CODEC_ID;       // 当前编解码器(Opus或mu-law)
 
 // PCM数据环形缓冲区 - 分配在PSRAM中
 static int16_t *pcm_ring_buffer = nullptr;
 static volatile size_t ring_write_pos = 0;  // 写入位置
 static volatile size_t ring_read_pos = 0;   // 读取位置
+static pcm_dc_state_t dc_state;             // 去直流滤波器状态(写入环形缓冲区时使用)
+static uint32_t overrun_samples = 0;        // 编码跟不上时被覆盖的采样点数(同一任务中读写)
 
 // 编码缓冲区 - 分配在PSRAM中
 static uint8_t *opus_output_buffer = nullptr;  // Opus编码输出缓冲区
 static int16_t *opus_input_buffer = nullptr;   // Opus编码输入缓冲区(一帧数据)
 
+/**
+ * opus_encoder_free - 释放编码器状态和所有缓冲区
+ */
+static void opus_encoder_free()
+{
+    mem_free(pcm_ring_buffer);
+    mem_free(opus_output_buffer);
+    mem_free(opus_input_buffer);
+    mem_free(encoder);
+    pcm_ring_buffer = nullptr;
+    opus_output_buffer = nullptr;
+    opus_input_buffer = nullptr;
+    encoder = nullptr;
+}
+
 /**
  * opus_encoder_init - 初始化Opus编码器
  *
@@ -48,47 +71,29 @@ bool opus_encoder_init()
 
     Serial.println("Initializing Opus encoder...");
 
-    // 在PSRAM中分配PCM环形缓冲区(500ms音频数据)
-    pcm_ring_buffer = (int16_t *)heap_caps_malloc(AUDIO_RING_BUFFER_SAMPLES * sizeof(int16_t), MALLOC_CAP_SPIRAM);
-    if (pcm_ring_buffer == nullptr) {
-        Serial.println("Failed to allocate PCM ring buffer in PSRAM");
-        return false;
-    }
-    Serial.println("PCM ring buffer allocated in PSRAM");
-
-    // 分配Opus输出缓冲区(编码后的数据)
-    opus_output_buffer = (uint8_t *)heap_caps_malloc(OPUS_OUTPUT_MAX_BYTES, MALLOC_CAP_SPIRAM);
-    if (opus_output_buffer == nullptr) {
-        Serial.println("Failed to allocate opus output buffer in PSRAM");
-        heap_caps_free(pcm_ring_buffer);
-        pcm_ring_buffer = nullptr;
-        return false;
-    }
+    // 每帧都要访问的缓冲区和编码器状态放在内部DRAM(见mem_placement.h)
+    // PCM环形缓冲区(500ms音频数据)
+    pcm_ring_buffer = (int16_t *) mem_alloc_hot(AUDIO_RING_BUFFER_SAMPLES * sizeof(int16_t), "PCM ring buffer");
+    // Opus输出缓冲区(编码后的数据)
+    opus_output_buffer = (uint8_t *) mem_alloc_hot(OPUS_OUTPUT_MAX_BYTES, "Opus output buffer");
+    // Opus输入缓冲区(一帧PCM数据:320个采样点)
+    opus_input_buffer = (int16_t *) mem_alloc_hot(OPUS_FRAME_SAMPLES * sizeof(int16_t), "Opus input buffer");
+    // Opus编码器状态(自行分配,opus_encoder_create()会用malloc,可能落在PSRAM)
+    encoder = (OpusEncoder *) mem_alloc_hot(opus_encoder_get_size(1), "Opus encoder state");
 
-    // 分配Opus输入缓冲区(一帧PCM数据:320个采样点)
-    opus_input_buffer = (int16_t *)heap_caps_malloc(OPUS_FRAME_SAMPLES * sizeof(int16_t), MALLOC_CAP_SPIRAM);
-    if (opus_input_buffer == nullptr) {
-        Serial.println("Failed to allocate opus input buffer in PSRAM");
-        heap_caps_free(pcm_ring_buffer);
-        heap_caps_free(opus_output_buffer);
-        pcm_ring_buffer = nullptr;
-        opus_output_buffer = nullptr;
+    if (pcm_ring_buffer == nullptr || opus_output_buffer == nullptr || opus_input_buffer == nullptr ||
+        encoder == nullptr) {
+        Serial.println("Failed to allocate Opus encoder buffers");
+        opus_encoder_free();
         return false;
     }
 
-    // 创建Opus编码器
+    // 在已分配的状态上初始化Opus编码器(libopus的opus_encoder_init)
     // 参数:采样率16kHz, 单声道, VOIP模式
-    int error;
-    encoder = opus_encoder_create(MIC_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &error);
-
-    if (error != OPUS_OK || encoder == nullptr) {
-        Serial.printf("Failed to create Opus encoder: %d\n", error);
-        heap_caps_free(pcm_ring_buffer);
-        heap_caps_free(opus_output_buffer);
-        heap_caps_free(opus_input_buffer);
-        pcm_ring_buffer = nullptr;
-        opus_output_buffer = nullptr;
-        opus_input_buffer = nullptr;
+    int error = opus_encoder_init(encoder, MIC_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP);
+    if (error != OPUS_OK) {
+        Serial.printf("Failed to initialize Opus encoder: %d\n", error);
+        opus_encoder_free();
         return false;
     }
 
@@ -115,6 +120,31 @@ bool opus_encoder_init()
     return true;
 }
 
+#if OPUS_ADAPTIVE_COMPLEXITY
+static void complexity_reset();
+#endif
+
+/**
+ * opus_encoder_reset - 恢复到刚初始化时的状态
+ *
+ * 清除编码器历史(OPUS_RESET_STATE,比特率等设置保留)、环形缓冲区中的PCM、去直流滤波器状态和自适应复杂度
+ * 两次测量之间调用,后一次不会从前一次预热过的状态开始
+ */
+void opus_encoder_reset()
+{
+    if (encoder == nullptr) {
+        return;
+    }
+    opus_encoder_ctl(encoder, OPUS_RESET_STATE);
+    ring_write_pos = 0;
+    ring_read_pos = 0;
+    dc_state = {};
+    overrun_samples = 0;
+#if OPUS_ADAPTIVE_COMPLEXITY
+    complexity_reset();
+#endif
+}
+
 /**
  * opus_set_callback - 设置编码数据回调函数
  *
@@ -127,6 +157,20 @@ void opus_set_callback(opus_encoded_handler callback)
     encoded_callback = callback;
 }
 
+/**
+ * ring_buffer_available - 获取环形缓冲区中可用的采样点数
+ *
+ * @returns {size_t} 可用的采样点数量
+ */
+static size_t ring_buffer_available()
+{
+    if (ring_write_pos >= ring_read_pos) {
+        return ring_write_pos - ring_read_pos;
+    } else {
+        return AUDIO_RING_BUFFER_SAMPLES - ring_read_pos + ring_write_pos;
+    }
+}
+
 /**
  * opus_receive_pcm - 接收PCM音频数据
  *
@@ -134,39 +178,127 @@ void opus_set_callback(opus_encoded_handler callback)
  * @param {size_t} samples - 采样点数量
  * @returns {int} 成功返回0,失败返回-1
  *
- * 将PCM数据写入环形缓冲区
- * 如果缓冲区满,会丢弃最旧的数据(覆盖策略)
+ * 将PCM数据整块写入环形缓冲区(跨越末尾时分两段)
+ * 写入时应用麦克风增益和去直流(pcm_gain_dc),不再单独遍历一次数据
+ * 如果缓冲区满,会丢弃最旧的数据(覆盖策略,每次调用只计算一次)
+ * 与opus_process()在同一个任务中调用
  */
 int opus_receive_pcm(int16_t *data, size_t samples)
 {
     if (pcm_ring_buffer == nullptr) {
         return -1;
     }
-    for (size_t i = 0; i < samples; i++) {
-        size_t next_write = (ring_write_pos + 1) % AUDIO_RING_BUFFER_SAMPLES;
-        if (next_write == ring_read_pos) {
-            // 缓冲区满,丢弃最旧的采样点
-            ring_read_pos = (ring_read_pos + 1) % AUDIO_RING_BUFFER_SAMPLES;
-        }
-        pcm_ring_buffer[ring_write_pos] = data[i];
-        ring_write_pos = next_write;
+
+    // 环形缓冲区最多保存AUDIO_RING_BUFFER_SAMPLES - 1个采样点(写入位置==读取位置表示空)
+    const size_t capacity = AUDIO_RING_BUFFER_SAMPLES - 1;
+    if (samples > capacity) {
+        // 比整个缓冲区还多: 只保留最新的部分
+        data += samples - capacity;
+        samples = capacity;
+    }
+
+    // 空间不足时,一次性丢弃最旧的采样点
+    size_t free_samples = capacity - ring_buffer_available();
+    if (samples > free_samples) {
+        ring_read_pos = (ring_read_pos + samples - free_samples) % AUDIO_RING_BUFFER_SAMPLES;
+        overrun_samples += samples - free_samples;
+        metrics_add_pcm_overwrite(samples - free_samples);
+    }
+
+    // 写入数据(最多两段)
+    size_t first = AUDIO_RING_BUFFER_SAMPLES - ring_write_pos;
+    if (first > samples) {
+        first = samples;
     }
+    pcm_gain_dc(&pcm_ring_buffer[ring_write_pos], data, first, MIC_GAIN, MIC_DC_FILTER ? &dc_state : nullptr);
+    pcm_gain_dc(pcm_ring_buffer, data + first, samples - first, MIC_GAIN, MIC_DC_FILTER ? &dc_state : nullptr);
+    ring_write_pos = (ring_write_pos + samples) % AUDIO_RING_BUFFER_SAMPLES;
     return 0;
 }
 
+#if OPUS_ADAPTIVE_COMPLEXITY
+static int complexity = OPUS_COMPLEXITY; // 当前编码复杂度
+static uint32_t adapt_frames = 0;        // 本统计周期的帧数
+static uint64_t adapt_total_us = 0;      // 本统计周期的总编码时间
+
 /**
- * ring_buffer_available - 获取环形缓冲区中可用的采样点数
+ * complexity_adapt - 按编码时间占帧时长的比例调整编码复杂度
  *
- * @returns {size_t} 可用的采样点数量
+ * 每OPUS_ADAPT_WINDOW_FRAMES帧判断一次:
+ * - 平均编码时间超过帧时长的OPUS_ADAPT_HIGH_PERCENT,或环形缓冲区发生覆盖: 降低一级
+ * - 低于OPUS_ADAPT_LOW_PERCENT且没有覆盖: 提高一级
+ * CPU降频(省电模式/电源管理)时自动降级,频率恢复后逐步回到较高质量
  */
-static size_t ring_buffer_available()
+static void complexity_adapt(uint32_t us)
 {
-    if (ring_write_pos >= ring_read_pos) {
-        return ring_write_pos - ring_read_pos;
-    } else {
-        return AUDIO_RING_BUFFER_SAMPLES - ring_read_pos + ring_write_pos;
+    adapt_frames++;
+    adapt_total_us += us;
+    if (adapt_frames < OPUS_ADAPT_WINDOW_FRAMES) {
+        return;
     }
+
+    const uint32_t budget_us = OPUS_FRAME_SAMPLES * 1000000ULL / MIC_SAMPLE_RATE;
+    uint32_t load = (uint32_t) (adapt_total_us / adapt_frames * 100 / budget_us);
+    uint32_t overruns = overrun_samples;
+    adapt_frames = 0;
+    adapt_total_us = 0;
+    overrun_samples = 0;
+
+    if (overruns > 0) {
+        Serial.printf("Opus encoder overrun: %u samples dropped\n", (unsigned) overruns);
+    }
+    int next = complexity;
+    if ((overruns > 0 || load > OPUS_ADAPT_HIGH_PERCENT) && complexity > OPUS_COMPLEXITY_MIN) {
+        next--;
+    } else if (overruns == 0 && load < OPUS_ADAPT_LOW_PERCENT && complexity < OPUS_COMPLEXITY_MAX) {
+        next++;
+    }
+    if (next != complexity) {
+        complexity = next;
+        opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(complexity));
+        Serial.printf("Opus complexity %d (encode load %u%%)\n", complexity, (unsigned) load);
+    }
+}
+
+/**
+ * complexity_reset - 回到初始复杂度,重新开始统计周期
+ */
+static void complexity_reset()
+{
+    complexity = OPUS_COMPLEXITY;
+    adapt_frames = 0;
+    adapt_total_us = 0;
+    opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(complexity));
 }
+#endif
+
+#if OPUS_ENCODE_TIMING
+static uint32_t timing_frames = 0;   // 本统计周期的帧数
+static uint64_t timing_total_us = 0; // 本统计周期的总编码时间
+static uint32_t timing_max_us = 0;   // 本统计周期的最长编码时间
+
+/**
+ * encode_timing_add - 记录一帧的编码时间
+ *
+ * 每OPUS_ENCODE_TIMING_FRAMES帧打印一次平均和最长编码时间
+ */
+static void encode_timing_add(uint32_t us)
+{
+    timing_frames++;
+    timing_total_us += us;
+    if (us > timing_max_us) {
+        timing_max_us = us;
+    }
+    if (timing_frames >= OPUS_ENCODE_TIMING_FRAMES) {
+        Serial.printf("Opus encode: avg %u us, max %u us per frame (%u frames, budget %u us)\n",
+                      (unsigned) (timing_total_us / timing_frames), (unsigned) timing_max_us,
+                      (unsigned) timing_frames, (unsigned) (OPUS_FRAME_SAMPLES * 1000000ULL / MIC_SAMPLE_RATE));
+        timing_frames = 0;
+        timing_total_us = 0;
+        timing_max_us = 0;
+    }
+}
+#endif
 
 /**
  * opus_encode_frame - 编码一帧音频
@@ -185,13 +317,22 @@ int opus_encode_frame(int16_t *pcm_data, size_t samples)
     }
 
     if (samples != OPUS_FRAME_SAMPLES) {
-        Serial.printf("Invalid frame size: %d (expected %d)\n", samples, OPUS_FRAME_SAMPLES);
+        Serial.printf("Invalid frame size: %d (expected %d)\n", (int) samples, OPUS_FRAME_SAMPLES);
         return -1;
     }
 
     // 调用Opus编码函数
+    int64_t start_us = esp_timer_get_time();
     opus_int32 encoded_bytes =
         opus_encode(encoder, pcm_data, OPUS_FRAME_SAMPLES, opus_output_buffer, OPUS_OUTPUT_MAX_BYTES);
+    uint32_t encode_us = (uint32_t) (esp_timer_get_time() - start_us);
+    metrics_add_encode_us(encode_us);
+#if OPUS_ENCODE_TIMING
+    encode_timing_add(encode_us);
+#endif
+#if OPUS_ADAPTIVE_COMPLEXITY
+    complexity_adapt(encode_us);
+#endif
 
     if (encoded_bytes < 0) {
         Serial.printf("Opus encoding error: %d\n", encoded_bytes);
@@ -208,7 +349,7 @@ int opus_encode_frame(int16_t *pcm_data, size_t samples)
  * 功能说明:
  * 1. 检查环形缓冲区是否有足够的数据(一帧)
  * 2. 从环形缓冲区读取一帧数据
- * 3. 编码该帧
+ * 3. 编码该帧(Opus,或mu-law分成MULAW_PACKET_SAMPLES一包)
  * 4. 通过回调函数传递编码后的数据
  */
 void opus_process()
@@ -219,10 +360,24 @@ void opus_process()
 
     // 循环处理所有可用的完整帧
     while (ring_buffer_available() >= OPUS_FRAME_SAMPLES) {
-        // 从环形缓冲区读取一帧数据(320个采样点)
-        for (size_t i = 0; i < OPUS_FRAME_SAMPLES; i++) {
-            opus_input_buffer[i] = pcm_ring_buffer[ring_read_pos];
-            ring_read_pos = (ring_read_pos + 1) % AUDIO_RING_BUFFER_SAMPLES;
+        // 从环形缓冲区读取一帧数据(320个采样点,跨越末尾时分两段)
+        size_t first = AUDIO_RING_BUFFER_SAMPLES - ring_read_pos;
+        if (first > OPUS_FRAME_SAMPLES) {
+            first = OPUS_FRAME_SAMPLES;
+        }
+        memcpy(opus_input_buffer, &pcm_ring_buffer[ring_read_pos], first * sizeof(int16_t));
+        memcpy(opus_input_buffer + first, pcm_ring_buffer, (OPUS_FRAME_SAMPLES - first) * sizeof(int16_t));
+        ring_read_pos = (ring_read_pos + OPUS_FRAME_SAMPLES) % AUDIO_RING_BUFFER_SAMPLES;
+
+        if (codec_id == AUDIO_CODEC_ID_MULAW) {
+            // mu-law: 每个采样点查表编码为一字节,不需要Opus编码器
+            for (size_t i = 0; i < OPUS_FRAME_SAMPLES; i += MULAW_PACKET_SAMPLES) {
+                mulaw_encode(opus_input_buffer + i, opus_output_buffer, MULAW_PACKET_SAMPLES);
+                if (encoded_callback != nullptr) {
+                    encoded_callback(opus_output_buffer, MULAW_PACKET_SAMPLES);
+                }
+            }
+            continue;
         }
 
         // 编码该帧
@@ -238,7 +393,7 @@ void opus_process()
 /**
  * opus_get_codec_id - 获取音频编解码器ID
  *
- * @returns {uint8_t} 编解码器ID(21 = Opus)
+ * @returns {uint8_t} 编解码器ID(21 = Opus, 10 = mu-law)
  *
  * 此ID用于BLE特性,告知客户端使用的编解码器类型
  */
@@ -246,5 +401,23 @@ uint8_t opus_get_codec_id()
 {
     // Codec ID 20 = Opus (匹配Omi协议)
     // 实际Omi使用CODEC_ID 21表示Opus
-    return AUDIO_CODEC_ID;
+    return codec_id;
+}
+
+/**
+ * opus_set_codec_id - 切换编解码器
+ *
+ * @param {uint8_t} id - AUDIO_CODEC_ID或AUDIO_CODEC_ID_MULAW
+ * @returns {bool} 未知的编解码器返回false
+ *
+ * 从下一帧开始生效; mu-law的每帧CPU开销只有Opus的零头,码率为128kbps
+ */
+bool opus_set_codec_id(uint8_t id)
+{
+    if (id != AUDIO_CODEC_ID && id != AUDIO_CODEC_ID_MULAW) {
+        return false;
+    }
+    codec_id = id;
+    Serial.printf("Audio codec set to %u\n", id);
+    return true;
 }
@@ -13,6 +13,12 @@ typedef void (*opus_encoded_handler)(uint8_t *data, size_t len);
  */
 bool opus_encoder_init();
 
+/**
+ * @brief Start over as a fresh encoder: clears the codec history, the queued PCM, the DC filter
+ *        and the adaptive complexity, keeping the buffers and settings
+ */
+void opus_encoder_reset();
+
 /**
  * @brief Encode PCM audio samples to Opus
  * @param pcm_data Input PCM samples (16-bit signed)
@@ -42,8 +48,15 @@ int opus_receive_pcm(int16_t *data, size_t samples);
 
 /**
  * @brief Get the codec ID
- * @return Codec ID (20 = Opus)
+ * @return Codec ID in use (AUDIO_CODEC_ID for Opus, AUDIO_CODEC_ID_MULAW)
  */
 uint8_t opus_get_codec_id();
 
+/**
+ * @brief Switch the codec of the following frames, e.g. to mu-law when the CPU must stay slow
+ * @param codec_id AUDIO_CODEC_ID or AUDIO_CODEC_ID_MULAW
+ * @return false for an unknown codec ID
+ */
+bool opus_set_codec_id(uint8_t codec_id);
+
 #endif // OPUS_ENCODER_H
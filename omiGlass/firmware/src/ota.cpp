@@ -1,12 +1,14 @@
 /**
  * OTA固件升级模块
  *
- * 负责通过WiFi下载和安装新固件
+ * 负责通过WiFi下载和安装新固件,没有WiFi时也可以直接通过BLE接收固件
  * 主要功能:
  * - 接收BLE命令配置WiFi和固件URL
  * - 连接WiFi网络
- * - 从HTTP/HTTPS下载固件
- * - 写入Flash并重启
+ * - 从HTTP/HTTPS下载固件(PSRAM缓冲区,连接中断时用Range请求续传)
+ * - 写入Flash(独立任务,与网络接收并行)并重启
+ * - 支持差分补丁(delta_patch): URL指向补丁时用正在运行的固件重建新固件
+ * - BLE数据通道: 固件分块写入OTA_BLE_DATA_UUID(无响应写),窗口确认,边接收边写入Flash
  * - 实时进度通知
  *
  * OTA流程:
@@ -15,19 +17,31 @@
  * 3. 客户端发送START命令启动OTA
  * 4. 固件连接WiFi → 下载固件 → 写入Flash → 重启
  *
+ * BLE OTA流程(不需要WiFi):
+ * 1. 客户端发送OTA_CMD_BLE_BEGIN和固件(或差分补丁)大小
+ * 2. 客户端把数据包[偏移(4字节,小端), 数据]写入OTA_BLE_DATA_UUID,未确认的数据不超过OTA_BLE_WINDOW_BYTES
+ * 3. 固件每OTA_BLE_ACK_BYTES通知一次OTA_STATUS_BLE_ACK和已写入的字节数; 偏移不连续时立即通知,
+ *    客户端从通知的偏移重新发送
+ * 4. 全部写入后验证、完成OTA更新并重启
+ *
  * 安全特性:
  * - 支持HTTPS(跳过证书验证,生产环境需添加证书)
  * - 分区表支持OTA(使用双分区切换)
  * - 可随时取消升级
  */
 #include "ota.h"
+#include "ble_tx.h"
+#include "block_pool.h"
+#include "camera_preview.h"
 #include "config.h"
+#include "delta_patch.h"
+#include "photo_offload.h"
+#include "pipeline.h"
 
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
 #include <Update.h>
-#include <BLE2902.h>
 
 // ============================================================================
 // 全局状态变量
@@ -55,12 +69,26 @@ static TaskHandle_t otaTaskHandle = NULL;        // OTA任务句柄
 static BLECharacteristic *otaControlCharacteristic = NULL;  // OTA控制特性
 static BLECharacteristic *otaDataCharacteristic = NULL;     // OTA数据特性(进度通知)
 
+// BLE OTA(接收缓冲区是BLOCK_POOL_OTA的一块,环形缓冲区要求大小是2的幂)
+static_assert((OTA_DOWNLOAD_BUFFER_SIZE & (OTA_DOWNLOAD_BUFFER_SIZE - 1)) == 0,
+              "OTA_DOWNLOAD_BUFFER_SIZE must be a power of two for the BLE OTA ring");
+static_assert(OTA_BLE_WINDOW_BYTES * 2 <= OTA_DOWNLOAD_BUFFER_SIZE, "BLE OTA window too large for the ring");
+static struct pipe_ring bleRing;                  // BLE回调写入的数据包,BLE OTA任务取出
+static uint16_t bleRingBlock = BLOCK_POOL_NONE;   // bleRing的缓冲区
+static volatile bool bleOtaActive = false;        // 是否正在接收BLE OTA(在bleOtaLock内改变)
+static SemaphoreHandle_t bleOtaLock = NULL;       // BLE回调写入bleRing期间持有,任务结束时借此等回调退出
+static volatile uint32_t bleOtaReceived = 0;      // 已按顺序写入的字节数
+static TaskHandle_t bleOtaTaskHandle = NULL;      // BLE OTA任务句柄
+
 // ============================================================================
 // 内部函数前向声明
 // ============================================================================
 static void ota_task(void *parameter);           // OTA任务主函数
 static bool connect_wifi();                      // 连接WiFi
 static bool download_and_install_firmware();     // 下载并安装固件
+static void ota_ble_begin(uint32_t size);        // 开始(或继续)BLE OTA
+static bool ota_finish_image();                  // 验证并完成OTA更新
+static void ota_reboot();                        // 重启到新固件
 
 // ============================================================================
 // BLE回调类
@@ -111,6 +139,36 @@ class OTAControlCallback : public BLECharacteristicCallbacks {
 void ota_set_characteristics(BLECharacteristic *controlChar, BLECharacteristic *dataChar) {
     otaControlCharacteristic = controlChar;
     otaDataCharacteristic = dataChar;
+    bleOtaLock = xSemaphoreCreateMutex();
+}
+
+/**
+ * parse_url - 解析URL命令
+ *
+ * @param {uint8_t*} data - 命令数据,格式: [cmd, url_len_high, url_len_low, url...]
+ * @param {size_t} length - 数据长度
+ * @param {char*} url - 输出URL(至少OTA_MAX_URL_LEN + 1字节)
+ * @returns {bool} 成功返回true,失败时已通知错误状态
+ */
+static bool parse_url(uint8_t *data, size_t length, char *url) {
+    if (length < 4) {
+        Serial.println("OTA: Invalid URL command length");
+        ota_notify_status(OTA_STATUS_ERROR);
+        return false;
+    }
+
+    // 解析URL长度(大端序,2字节)
+    uint16_t urlLen = (data[1] << 8) | data[2];
+    if (urlLen > OTA_MAX_URL_LEN || length < 3 + urlLen) {
+        Serial.println("OTA: Invalid URL length");
+        ota_notify_status(OTA_STATUS_ERROR);
+        return false;
+    }
+
+    // 复制URL
+    memcpy(url, &data[3], urlLen);
+    url[urlLen] = '\0';
+    return true;
 }
 
 /**
@@ -134,6 +192,21 @@ void ota_set_characteristics(BLECharacteristic *controlChar, BLECharacteristic *
  *
  * - OTA_CMD_GET_STATUS (0x04): 查询状态
  *   格式: [cmd]
+ *
+ * - OTA_CMD_SET_OFFLOAD_URL (0x06): 设置离线照片上传URL
+ *   格式: [cmd, url_len_high, url_len_low, url...]
+ *
+ * - OTA_CMD_START_OFFLOAD (0x07): 通过WiFi上传离线照片
+ *   格式: [cmd]
+ *
+ * - OTA_CMD_START_PREVIEW (0x08): 通过WiFi提供相机实时预览,正在预览时更新帧率和质量
+ *   格式: [cmd, fps, jpeg_quality] (0或省略表示默认值)
+ *
+ * - OTA_CMD_STOP_PREVIEW (0x09): 停止预览
+ *   格式: [cmd]
+ *
+ * - OTA_CMD_BLE_BEGIN (0x0A): 通过BLE数据通道接收固件或差分补丁,不需要WiFi
+ *   格式: [cmd, size(4字节,小端)]; 同样大小的BLE OTA正在进行时从已写入的位置继续
  */
 void ota_handle_command(uint8_t *data, size_t length) {
     if (length < 1) return;
@@ -184,27 +257,59 @@ void ota_handle_command(uint8_t *data, size_t length) {
         case OTA_CMD_SET_URL: {
             // 设置固件URL
             // 格式: [cmd, url_len_high, url_len_low, url...]
-            if (length < 4) {
-                Serial.println("OTA: Invalid URL command length");
-                ota_notify_status(OTA_STATUS_ERROR);
+            if (!parse_url(data, length, firmwareURL)) {
                 return;
             }
 
-            // 解析URL长度(大端序,2字节)
-            uint16_t urlLen = (data[1] << 8) | data[2];
-            if (urlLen > OTA_MAX_URL_LEN || length < 3 + urlLen) {
-                Serial.println("OTA: Invalid URL length");
-                ota_notify_status(OTA_STATUS_ERROR);
+            firmwareURLSet = true;
+            Serial.printf("OTA: Firmware URL set: %s\n", firmwareURL);
+            ota_notify_status(OTA_STATUS_IDLE);
+            break;
+        }
+
+        case OTA_CMD_SET_OFFLOAD_URL: {
+            // 设置离线照片上传URL,格式同OTA_CMD_SET_URL
+            char url[OTA_MAX_URL_LEN + 1];
+            if (!parse_url(data, length, url)) {
                 return;
             }
+            photo_offload_set_url(url);
+            ota_notify_status(OTA_STATUS_IDLE);
+            break;
+        }
 
-            // 复制URL
-            memcpy(firmwareURL, &data[3], urlLen);
-            firmwareURL[urlLen] = '\0';
+        case OTA_CMD_START_OFFLOAD: {
+            // 通过WiFi上传离线照片(需要WiFi凭据、上传URL和离线照片)
+            if (!photo_offload_start()) {
+                Serial.println("OTA: Cannot start photo offload");
+                ota_notify_status(OTA_STATUS_ERROR);
+            }
+            break;
+        }
 
-            firmwareURLSet = true;
-            Serial.printf("OTA: Firmware URL set: %s\n", firmwareURL);
-            ota_notify_status(OTA_STATUS_IDLE);
+        case OTA_CMD_START_PREVIEW: {
+            // 相机实时预览(需要WiFi凭据)
+            uint8_t fps = length > 1 ? data[1] : 0;
+            uint8_t quality = length > 2 ? data[2] : 0;
+            if (!camera_preview_start(fps, quality)) {
+                Serial.println("OTA: Cannot start camera preview");
+                ota_notify_status(OTA_STATUS_ERROR);
+            }
+            break;
+        }
+
+        case OTA_CMD_STOP_PREVIEW: {
+            camera_preview_stop();
+            break;
+        }
+
+        case OTA_CMD_BLE_BEGIN: {
+            if (length < 5) {
+                Serial.println("OTA: Invalid BLE begin command length");
+                ota_notify_status(OTA_STATUS_ERROR);
+                break;
+            }
+            ota_ble_begin(data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t) data[4] << 24));
             break;
         }
 
@@ -228,6 +333,12 @@ void ota_handle_command(uint8_t *data, size_t length) {
                 return;
             }
 
+            if (photo_offload_is_busy() || camera_preview_is_busy()) {
+                Serial.println("OTA: WiFi busy with photo offload or camera preview");
+                ota_notify_status(OTA_STATUS_ERROR);
+                return;
+            }
+
             // 创建OTA任务
             otaCancelled = false;
             otaTaskRunning = true;
@@ -281,16 +392,38 @@ void ota_notify_status(uint8_t status, uint8_t progress) {
     otaStatus = status;
     otaProgress = progress;
 
-    // 通过BLE发送通知
+    // 通过BLE发送调度通知(控制类,优先于照片)
     if (otaDataCharacteristic != NULL) {
         uint8_t notification[2] = {status, progress};
-        otaDataCharacteristic->setValue(notification, 2);
-        otaDataCharacteristic->notify();
+        ble_tx_send(BLE_TX_CONTROL, otaDataCharacteristic, notification, 2, 0);
     }
 
     Serial.printf("OTA: Status 0x%02X, Progress %d%%\n", status, progress);
 }
 
+/**
+ * ota_notify_status_data - 通知状态和附加数据(例如预览的IP地址和端口)
+ *
+ * @param {uint8_t} status - 状态码
+ * @param {const uint8_t*} data - 附加数据,不超过OTA_NOTIFY_DATA_MAX字节
+ * @param {size_t} length - 附加数据长度
+ */
+void ota_notify_status_data(uint8_t status, const uint8_t *data, size_t length) {
+    otaStatus = status;
+    otaProgress = 0;
+    if (length > OTA_NOTIFY_DATA_MAX) {
+        length = OTA_NOTIFY_DATA_MAX;
+    }
+
+    if (otaDataCharacteristic != NULL) {
+        uint8_t notification[1 + OTA_NOTIFY_DATA_MAX] = {status};
+        memcpy(notification + 1, data, length);
+        ble_tx_send(BLE_TX_CONTROL, otaDataCharacteristic, notification, 1 + length, 0);
+    }
+
+    Serial.printf("OTA: Status 0x%02X with %u bytes\n", status, (unsigned) length);
+}
+
 // ============================================================================
 // OTA任务主函数
 // ============================================================================
@@ -343,6 +476,16 @@ static void ota_task(void *parameter) {
     // ========================================================================
     // 步骤3: 准备重启
     // ========================================================================
+    ota_reboot();
+
+    // 不应到达这里
+    vTaskDelete(NULL);
+}
+
+/**
+ * ota_reboot - 通知后关闭WiFi并重启,启动新固件
+ */
+static void ota_reboot() {
     Serial.println("OTA: Preparing to reboot...");
     ota_notify_status(OTA_STATUS_REBOOTING);
     delay(2000);  // 给BLE通知留出发送时间
@@ -354,9 +497,6 @@ static void ota_task(void *parameter) {
 
     Serial.println("OTA: Rebooting now!");
     ESP.restart(); // 重启系统,启动新固件
-
-    // 不应到达这里
-    vTaskDelete(NULL);
 }
 
 // ============================================================================
@@ -409,21 +549,297 @@ static bool connect_wifi() {
 // 固件下载和安装函数
 // ============================================================================
 
+// ============================================================================
+// Flash写入任务: 一个缓冲区写入Flash的同时,下一个缓冲区接收网络数据
+// ============================================================================
+
+typedef struct {
+    uint8_t *data;  // 缓冲区(PSRAM), nullptr表示结束写入任务
+    size_t length;  // 有效数据长度
+    uint16_t block; // 缓冲区所在的块(BLOCK_POOL_OTA)
+} ota_chunk_t;
+
+static QueueHandle_t otaFreeQueue = NULL;       // 空闲缓冲区
+static QueueHandle_t otaFullQueue = NULL;       // 等待写入Flash的缓冲区(按接收顺序)
+static SemaphoreHandle_t otaWriterDone = NULL;  // 写入任务退出时释放
+static volatile bool otaWriteFailed = false;    // Update.write失败,之后的数据不再写入
+static volatile bool otaImageStarted = false;   // 写入任务已收到第一个缓冲区(已开始Update)
+static size_t otaImageSize = 0;                 // 下载的大小(完整固件时用于Update.begin)
+static bool otaDelta = false;                   // 下载的是差分补丁(delta_patch)
+
+/**
+ * ota_write_chunk - 写入下载的一段数据
+ *
+ * 第一段数据决定下载的类型: 以补丁magic开头时交给delta_patch重建固件,否则作为完整固件写入
+ */
+static bool ota_write_chunk(const uint8_t *data, size_t length) {
+    if (!otaImageStarted) {
+        otaImageStarted = true;
+        otaDelta = delta_patch_detect(data, length);
+        if (otaDelta) {
+            delta_patch_begin();
+        } else if (!Update.begin(otaImageSize)) {
+            Serial.println("OTA: Not enough space for update");
+            return false;
+        }
+    }
+    if (otaDelta) {
+        return delta_patch_write(data, length);
+    }
+    if (Update.write((uint8_t *) data, length) != length) {
+        Serial.printf("OTA: Write failed: %s\n", Update.errorString());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * ota_writer_task - 按接收顺序把缓冲区写入Flash,写完归还空闲队列
+ */
+static void ota_writer_task(void *parameter) {
+    ota_chunk_t chunk;
+    while (xQueueReceive(otaFullQueue, &chunk, portMAX_DELAY) == pdTRUE && chunk.data != nullptr) {
+        if (!otaWriteFailed && !ota_write_chunk(chunk.data, chunk.length)) {
+            otaWriteFailed = true;
+        }
+        xQueueSend(otaFreeQueue, &chunk, portMAX_DELAY);
+    }
+    xSemaphoreGive(otaWriterDone);
+    vTaskDelete(NULL);
+}
+
+/**
+ * ota_writer_drain - 等待所有已接收的数据写入Flash(所有缓冲区回到空闲队列)
+ */
+static void ota_writer_drain() {
+    ota_chunk_t chunks[OTA_DOWNLOAD_BUFFERS];
+    for (int i = 0; i < OTA_DOWNLOAD_BUFFERS; i++) {
+        xQueueReceive(otaFreeQueue, &chunks[i], portMAX_DELAY);
+    }
+    for (int i = 0; i < OTA_DOWNLOAD_BUFFERS; i++) {
+        xQueueSend(otaFreeQueue, &chunks[i], portMAX_DELAY);
+    }
+}
+
+/**
+ * ota_writer_start - 从块池取下载缓冲区并启动写入任务
+ *
+ * 块池在第一次OTA时分配并一直保留,重试和之后的OTA不再向堆申请缓冲区
+ *
+ * @returns {bool} 成功返回true,失败时已经归还取出的资源
+ */
+static bool ota_writer_start() {
+    block_pool_init(BLOCK_POOL_OTA, OTA_DOWNLOAD_BUFFER_SIZE, OTA_DOWNLOAD_BUFFERS, "OTA buffers");
+    otaFreeQueue = xQueueCreate(OTA_DOWNLOAD_BUFFERS, sizeof(ota_chunk_t));
+    otaFullQueue = xQueueCreate(OTA_DOWNLOAD_BUFFERS + 1, sizeof(ota_chunk_t)); // 加上结束标记
+    otaWriterDone = xSemaphoreCreateBinary();
+    otaWriteFailed = false;
+    otaImageStarted = false;
+    bool ok = otaFreeQueue != NULL && otaFullQueue != NULL && otaWriterDone != NULL;
+
+    for (int i = 0; ok && i < OTA_DOWNLOAD_BUFFERS; i++) {
+        uint16_t block = block_pool_alloc(BLOCK_POOL_OTA, OTA_DOWNLOAD_BUFFER_SIZE);
+        ok = block != BLOCK_POOL_NONE;
+        if (ok) {
+            ota_chunk_t chunk = {block_pool_data(BLOCK_POOL_OTA, block), 0, block};
+            xQueueSend(otaFreeQueue, &chunk, 0);
+        }
+    }
+    if (ok && xTaskCreate(ota_writer_task, "ota_writer", OTA_WRITER_TASK_STACK_SIZE, NULL, 5, NULL) == pdPASS) {
+        return true;
+    }
+
+    Serial.println("OTA: Failed to start the flash writer");
+    ota_chunk_t chunk;
+    while (otaFreeQueue != NULL && xQueueReceive(otaFreeQueue, &chunk, 0) == pdTRUE) {
+        block_pool_free(BLOCK_POOL_OTA, chunk.block);
+    }
+    if (otaFreeQueue) vQueueDelete(otaFreeQueue);
+    if (otaFullQueue) vQueueDelete(otaFullQueue);
+    if (otaWriterDone) vSemaphoreDelete(otaWriterDone);
+    otaFreeQueue = otaFullQueue = NULL;
+    otaWriterDone = NULL;
+    return false;
+}
+
+/**
+ * ota_writer_stop - 写完剩余数据,结束写入任务并把缓冲区还给块池
+ */
+static void ota_writer_stop() {
+    ota_writer_drain();
+    ota_chunk_t end = {nullptr, 0, BLOCK_POOL_NONE};
+    xQueueSend(otaFullQueue, &end, portMAX_DELAY);
+    xSemaphoreTake(otaWriterDone, portMAX_DELAY);
+
+    ota_chunk_t chunk;
+    while (xQueueReceive(otaFreeQueue, &chunk, 0) == pdTRUE) {
+        block_pool_free(BLOCK_POOL_OTA, chunk.block);
+    }
+    vQueueDelete(otaFreeQueue);
+    vQueueDelete(otaFullQueue);
+    vSemaphoreDelete(otaWriterDone);
+    otaFreeQueue = otaFullQueue = NULL;
+    otaWriterDone = NULL;
+}
+
+// ============================================================================
+// 固件下载和安装函数
+// ============================================================================
+
+// 一次HTTP请求的结果
+typedef enum {
+    FETCH_DONE,      // 固件已全部接收
+    FETCH_RETRY,     // 连接中断或服务器暂时错误,从已接收的位置续传
+    FETCH_FAILED,    // 无法继续,状态已通知
+    FETCH_CANCELLED, // 用户取消
+} fetch_result_t;
+
+// 下载进度,续传时保持
+typedef struct {
+    size_t total;    // 下载大小(完整固件或差分补丁), 0表示还没有开始下载
+    size_t received; // 已交给写入任务的字节数
+    String etag;     // 第一次响应的ETag,续传时用If-Range确认文件没有变化
+    int lastProgress;
+} ota_download_t;
+
+/**
+ * fetch_firmware - 发送一次GET请求并接收数据,交给Flash写入任务
+ *
+ * @param {WiFiClient*} client - HTTP或HTTPS客户端(多次请求复用)
+ * @param {ota_download_t*} dl - 下载进度
+ * @returns {fetch_result_t} 请求结果
+ *
+ * 已接收过数据时带Range请求头从断点继续:
+ * - 206: 从断点继续接收
+ * - 200: 文件已变化或服务器不支持Range,放弃已写入的数据从头开始
+ */
+static fetch_result_t fetch_firmware(WiFiClient *client, ota_download_t *dl) {
+    HTTPClient http;
+    http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS); // 严格跟随重定向
+    http.begin(*client, firmwareURL);
+    http.setTimeout(30000);  // 30秒超时
+    http.addHeader("User-Agent", "ESP32-OTA/1.0");
+    const char *headerKeys[] = {"ETag"};
+    http.collectHeaders(headerKeys, 1);
+    if (dl->received > 0) {
+        http.addHeader("Range", "bytes=" + String((unsigned long) dl->received) + "-");
+        if (dl->etag.length() > 0) {
+            http.addHeader("If-Range", dl->etag);
+        }
+        Serial.printf("OTA: Resuming at %u of %u bytes\n", (unsigned) dl->received, (unsigned) dl->total);
+    }
+
+    int httpCode = http.GET();
+    Serial.printf("OTA: HTTP response code: %d\n", httpCode);
+
+    if (httpCode == HTTP_CODE_OK) {
+        if (dl->total > 0) {
+            // 从头开始: 等写入任务写完,丢弃已写入的数据
+            Serial.println("OTA: Server sent the whole file, starting over");
+            ota_writer_drain();
+            Update.abort();
+            otaWriteFailed = false;
+            otaImageStarted = false;
+            dl->total = 0;
+            dl->received = 0;
+        }
+
+        int contentLength = http.getSize();
+        if (contentLength <= 0) {
+            Serial.println("OTA: Invalid content length");
+            http.end();
+            ota_notify_status(OTA_STATUS_DOWNLOAD_FAILED);
+            return FETCH_FAILED;
+        }
+        Serial.printf("OTA: Download size: %d bytes\n", contentLength);
+
+        // 写入任务收到第一个缓冲区时开始Update(完整固件检查Flash空间,补丁先检查补丁头)
+        otaImageSize = contentLength;
+        dl->total = contentLength;
+        dl->etag = http.header("ETag");
+        ota_notify_status(OTA_STATUS_INSTALLING, 0);
+    } else if (httpCode != HTTP_CODE_PARTIAL_CONTENT || dl->total == 0) {
+        http.end();
+        // 网络错误和5xx可能是暂时的,其他响应重试也没有用
+        if (httpCode < 0 || httpCode >= 500) {
+            return FETCH_RETRY;
+        }
+        Serial.printf("OTA: HTTP GET failed, code: %d\n", httpCode);
+        ota_notify_status(OTA_STATUS_DOWNLOAD_FAILED);
+        return FETCH_FAILED;
+    }
+
+    // 接收数据,缓冲区满后交给写入任务,同时接收下一个缓冲区
+    WiFiClient *stream = http.getStreamPtr();
+    ota_chunk_t chunk;
+    xQueueReceive(otaFreeQueue, &chunk, portMAX_DELAY);
+    chunk.length = 0;
+    unsigned long lastDataTime = millis();
+    fetch_result_t result = FETCH_DONE;
+
+    while (dl->received + chunk.length < dl->total) {
+        if (otaCancelled) {
+            Serial.println("OTA: Download cancelled");
+            result = FETCH_CANCELLED;
+            break;
+        }
+        if (otaWriteFailed) {
+            result = FETCH_FAILED;
+            ota_notify_status(OTA_STATUS_INSTALL_FAILED);
+            break;
+        }
+
+        size_t space = OTA_DOWNLOAD_BUFFER_SIZE - chunk.length;
+        size_t left = dl->total - dl->received - chunk.length;
+        int bytesRead = stream->available() > 0 ? stream->read(chunk.data + chunk.length, min(space, left)) : 0;
+        if (bytesRead > 0) {
+            chunk.length += bytesRead;
+            lastDataTime = millis();
+            if (chunk.length == OTA_DOWNLOAD_BUFFER_SIZE) {
+                dl->received += chunk.length;
+                xQueueSend(otaFullQueue, &chunk, portMAX_DELAY);
+                xQueueReceive(otaFreeQueue, &chunk, portMAX_DELAY);
+                chunk.length = 0;
+            }
+        } else if (!stream->connected() || millis() - lastDataTime > OTA_STALL_TIMEOUT_MS) {
+            Serial.printf("OTA: Connection lost at %u bytes\n", (unsigned) (dl->received + chunk.length));
+            result = FETCH_RETRY;
+            break;
+        } else {
+            delay(1); // 等待更多数据
+        }
+
+        int progress = ((dl->received + chunk.length) * 100ULL) / dl->total;
+        // 每5%通知一次进度
+        if (progress != dl->lastProgress && progress % 5 == 0) {
+            ota_notify_status(OTA_STATUS_INSTALLING, progress);
+            dl->lastProgress = progress;
+        }
+    }
+
+    // 不完整的缓冲区也写入,续传从它之后开始
+    if (chunk.length > 0 && result != FETCH_CANCELLED) {
+        dl->received += chunk.length;
+        xQueueSend(otaFullQueue, &chunk, portMAX_DELAY);
+    } else {
+        xQueueSend(otaFreeQueue, &chunk, portMAX_DELAY);
+    }
+    http.end();
+    return result;
+}
+
 /**
  * download_and_install_firmware - 下载并安装固件
  *
  * @returns {bool} 成功返回true,失败返回false
  *
  * 功能说明:
- * 1. 判断URL是HTTP还是HTTPS
- * 2. 创建对应的WiFi客户端
- * 3. 发送HTTP GET请求
- * 4. 检查响应码和内容长度
- * 5. 初始化OTA更新(检查Flash空间)
- * 6. 流式下载固件并写入Flash
- * 7. 每5%进度通知一次
- * 8. 验证下载完整性
- * 9. 完成OTA更新
+ * 1. 判断URL是HTTP还是HTTPS,创建对应的WiFi客户端
+ * 2. 从块池取OTA_DOWNLOAD_BUFFERS个PSRAM缓冲区,启动Flash写入任务
+ * 3. 接收网络数据的同时写入上一个缓冲区(Update.write,差分补丁交给delta_patch)
+ * 4. 连接中断时等待后重连WiFi,用Range请求从断点继续,最多OTA_RESUME_ATTEMPTS次
+ * 5. 每5%进度通知一次
+ * 6. 验证下载完整性(差分补丁还验证重建固件的CRC),完成OTA更新
  *
  * 安全特性:
  * - 支持HTTPS(setInsecure跳过证书验证)
@@ -467,107 +883,39 @@ static bool download_and_install_firmware() {
     }
 
     // ========================================================================
-    // 2. 配置HTTP客户端
-    // ========================================================================
-    HTTPClient http;
-    http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS); // 严格跟随重定向
-    http.begin(*client, firmwareURL);
-    http.setTimeout(30000);  // 30秒超时
-    http.addHeader("User-Agent", "ESP32-OTA/1.0");
-
-    // ========================================================================
-    // 3. 发送GET请求
+    // 2. 下载缓冲区和Flash写入任务
     // ========================================================================
-    Serial.printf("OTA: Starting HTTP GET request...\n");
-    int httpCode = http.GET();
-    Serial.printf("OTA: HTTP response code: %d\n", httpCode);
-
-    if (httpCode != HTTP_CODE_OK) {
-        Serial.printf("OTA: HTTP GET failed, code: %d\n", httpCode);
-        ota_notify_status(OTA_STATUS_DOWNLOAD_FAILED);
-        http.end();
+    if (!ota_writer_start()) {
         if (secureClient) delete secureClient; else delete client;
-        return false;
-    }
-
-    // ========================================================================
-    // 4. 检查内容长度
-    // ========================================================================
-    int contentLength = http.getSize();
-    if (contentLength <= 0) {
-        Serial.println("OTA: Invalid content length");
         ota_notify_status(OTA_STATUS_DOWNLOAD_FAILED);
-        http.end();
-        if (secureClient) delete secureClient; else delete client;
-        return false;
-    }
-
-    Serial.printf("OTA: Firmware size: %d bytes\n", contentLength);
-
-    // ========================================================================
-    // 5. 初始化OTA更新(检查Flash空间)
-    // ========================================================================
-    if (!Update.begin(contentLength)) {
-        Serial.println("OTA: Not enough space for update");
-        ota_notify_status(OTA_STATUS_INSTALL_FAILED);
-        http.end();
-        if (secureClient) delete secureClient; else delete client;
         return false;
     }
 
     // ========================================================================
-    // 6. 流式下载并写入Flash
+    // 3. 下载,连接中断时续传
     // ========================================================================
-    WiFiClient *stream = http.getStreamPtr();
-    uint8_t buffer[1024];  // 1KB缓冲区
-    int totalRead = 0;
-    int lastProgress = -1;
-
-    ota_notify_status(OTA_STATUS_INSTALLING, 0);
-
-    while (http.connected() && totalRead < contentLength) {
-        // 检查是否被取消
-        if (otaCancelled) {
-            Serial.println("OTA: Download cancelled");
-            Update.abort();
-            http.end();
-            if (secureClient) delete secureClient; else delete client;
-            ota_notify_status(OTA_STATUS_IDLE);
-            return false;
-        }
-
-        size_t available = stream->available();
-        if (available > 0) {
-            // 读取数据
-            size_t toRead = min(available, sizeof(buffer));
-            int bytesRead = stream->readBytes(buffer, toRead);
-
-            if (bytesRead > 0) {
-                // 写入Flash
-                if (Update.write(buffer, bytesRead) != bytesRead) {
-                    Serial.println("OTA: Write failed");
-                    Update.abort();
-                    http.end();
-                    if (secureClient) delete secureClient; else delete client;
-                    ota_notify_status(OTA_STATUS_INSTALL_FAILED);
-                    return false;
-                }
-
-                totalRead += bytesRead;
-                int progress = (totalRead * 100) / contentLength;
-
-                // 每5%通知一次进度
-                if (progress != lastProgress && progress % 5 == 0) {
-                    ota_notify_status(OTA_STATUS_INSTALLING, progress);
-                    lastProgress = progress;
-                }
+    ota_download_t dl = {0, 0, String(), -1};
+    fetch_result_t result = FETCH_RETRY;
+    for (int attempt = 0; attempt <= OTA_RESUME_ATTEMPTS && result == FETCH_RETRY; attempt++) {
+        if (attempt > 0) {
+            Serial.printf("OTA: Retry %d of %d\n", attempt, OTA_RESUME_ATTEMPTS);
+            for (unsigned long waitStart = millis();
+                 millis() - waitStart < (unsigned long) attempt * OTA_RESUME_BACKOFF_MS && !otaCancelled;) {
+                delay(100);
+            }
+            if (otaCancelled) {
+                result = FETCH_CANCELLED;
+                break;
+            }
+            if (WiFi.status() != WL_CONNECTED && !connect_wifi()) {
+                continue;
             }
-        } else {
-            delay(10); // 等待更多数据
         }
+        result = fetch_firmware(client, &dl);
     }
 
-    http.end();
+    // 等待剩余数据写入Flash
+    ota_writer_stop();
 
     // 释放客户端内存
     if (secureClient) {
@@ -576,19 +924,50 @@ static bool download_and_install_firmware() {
         delete client;
     }
 
+    if (result != FETCH_DONE || otaWriteFailed) {
+        if (dl.total > 0) {
+            Update.abort();
+        }
+        if (result == FETCH_CANCELLED) {
+            ota_notify_status(OTA_STATUS_IDLE);
+        } else if (result == FETCH_RETRY) {
+            Serial.printf("OTA: Download failed after %d retries\n", OTA_RESUME_ATTEMPTS);
+            ota_notify_status(OTA_STATUS_DOWNLOAD_FAILED);
+        } else if (otaWriteFailed && result == FETCH_DONE) {
+            ota_notify_status(OTA_STATUS_INSTALL_FAILED);
+        }
+        return false;
+    }
+
     // ========================================================================
-    // 7. 验证下载完整性
+    // 4. 验证下载完整性
     // ========================================================================
-    if (totalRead != contentLength) {
-        Serial.printf("OTA: Incomplete download: %d/%d\n", totalRead, contentLength);
+    if (dl.received != dl.total) {
+        Serial.printf("OTA: Incomplete download: %u/%u\n", (unsigned) dl.received, (unsigned) dl.total);
         Update.abort();
         ota_notify_status(OTA_STATUS_DOWNLOAD_FAILED);
         return false;
     }
 
     // ========================================================================
-    // 8. 完成OTA更新
+    // 5. 完成OTA更新
     // ========================================================================
+    return ota_finish_image();
+}
+
+/**
+ * ota_finish_image - 所有数据写入后验证并完成OTA更新
+ *
+ * 差分补丁: 重建的固件必须完整且CRC符合
+ *
+ * @returns {bool} 成功返回true,失败时已通知OTA_STATUS_INSTALL_FAILED
+ */
+static bool ota_finish_image() {
+    if (otaDelta && !delta_patch_finish()) {
+        Update.abort();
+        ota_notify_status(OTA_STATUS_INSTALL_FAILED);
+        return false;
+    }
     if (!Update.end(true)) {
         Serial.printf("OTA: Update failed: %s\n", Update.errorString());
         ota_notify_status(OTA_STATUS_INSTALL_FAILED);
@@ -601,6 +980,174 @@ static bool download_and_install_firmware() {
     return true;
 }
 
+// ============================================================================
+// BLE数据通道OTA: 固件通过BLE写入,不需要WiFi
+// ============================================================================
+
+/**
+ * ota_ble_ack - 通知已按顺序写入的字节数(窗口确认,或偏移不连续时请求重发)
+ */
+static void ota_ble_ack(uint32_t received) {
+    uint8_t ack[4] = {(uint8_t) received, (uint8_t) (received >> 8), (uint8_t) (received >> 16),
+                      (uint8_t) (received >> 24)};
+    ota_notify_status_data(OTA_STATUS_BLE_ACK, ack, sizeof(ack));
+}
+
+/**
+ * ota_ble_task - 从环形缓冲区取出数据包,按偏移顺序写入Flash(Update.write或delta_patch)
+ *
+ * 写入Flash时BLE回调继续把数据包放入环形缓冲区,接收和写入重叠
+ * 全部写入后完成更新并重启; 失败、取消或OTA_BLE_STALL_TIMEOUT_MS内没有数据时放弃
+ */
+static void ota_ble_task(void *parameter) {
+    static uint8_t packet[OTA_BLE_PACKET_MAX];
+    uint32_t received = 0;
+    uint32_t lastAck = 0;
+    bool gap = false; // 已请求重发,等待偏移正确的数据包
+    bool done = false;
+    unsigned long lastData = millis();
+
+    ota_notify_status(OTA_STATUS_INSTALLING, 0);
+    ota_ble_ack(0);
+    while (!otaCancelled && !otaWriteFailed) {
+        uint16_t len = pipe_ring_get(&bleRing, packet, sizeof(packet));
+        if (len == 0) {
+            // 没有更多数据: 确认剩余的字节,客户端不会因为窗口等待
+            if (received != lastAck) {
+                ota_ble_ack(received);
+                lastAck = received;
+            }
+            if (millis() - lastData > OTA_BLE_STALL_TIMEOUT_MS) {
+                Serial.printf("OTA: BLE transfer stalled at %u bytes\n", (unsigned) received);
+                break;
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(OTA_BLE_WAIT_MS));
+            continue;
+        }
+        lastData = millis();
+
+        uint32_t offset = packet[0] | (packet[1] << 8) | (packet[2] << 16) | ((uint32_t) packet[3] << 24);
+        size_t n = len - OTA_BLE_HEADER_SIZE;
+        if (offset != received || n > otaImageSize - received) {
+            if (!gap) {
+                Serial.printf("OTA: BLE packet at %u, expected %u\n", (unsigned) offset, (unsigned) received);
+                ota_ble_ack(received);
+                lastAck = received;
+                gap = true;
+            }
+            continue;
+        }
+        gap = false;
+        if (!ota_write_chunk(packet + OTA_BLE_HEADER_SIZE, n)) {
+            otaWriteFailed = true;
+            break;
+        }
+        received += n;
+        bleOtaReceived = received;
+        if (received == otaImageSize) {
+            done = true;
+            break;
+        }
+        if (received - lastAck >= OTA_BLE_ACK_BYTES) {
+            ota_ble_ack(received);
+            lastAck = received;
+            ble_tx_note_bulk(); // 接收期间保持短连接间隔
+        }
+    }
+
+    // 锁内关闭后不会再有回调在写环形缓冲区,这时才能归还它的块
+    xSemaphoreTake(bleOtaLock, portMAX_DELAY);
+    bleOtaActive = false;
+    xSemaphoreGive(bleOtaLock);
+    block_pool_free(BLOCK_POOL_OTA, bleRingBlock);
+    bleRingBlock = BLOCK_POOL_NONE;
+    if (done) {
+        ota_ble_ack(received);
+        if (ota_finish_image()) {
+            ota_reboot();
+        }
+    } else {
+        if (otaImageStarted) {
+            Update.abort();
+        }
+        if (otaCancelled) {
+            ota_notify_status(OTA_STATUS_IDLE);
+        } else {
+            ota_notify_status(otaWriteFailed ? OTA_STATUS_INSTALL_FAILED : OTA_STATUS_DOWNLOAD_FAILED);
+        }
+    }
+    otaTaskRunning = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * ota_ble_begin - 开始BLE OTA,同样大小的BLE OTA正在进行时(例如重新连接后)从已写入的位置继续
+ *
+ * @param {uint32_t} size - 固件或差分补丁的大小
+ */
+static void ota_ble_begin(uint32_t size) {
+    if (bleOtaActive && size == otaImageSize) {
+        Serial.printf("OTA: Resuming BLE transfer at %u of %u bytes\n", (unsigned) bleOtaReceived, (unsigned) size);
+        ota_ble_ack(bleOtaReceived);
+        return;
+    }
+    if (otaTaskRunning || photo_offload_is_busy() || camera_preview_is_busy() || size == 0) {
+        Serial.println("OTA: Cannot start BLE transfer");
+        ota_notify_status(OTA_STATUS_ERROR);
+        return;
+    }
+
+    block_pool_init(BLOCK_POOL_OTA, OTA_DOWNLOAD_BUFFER_SIZE, OTA_DOWNLOAD_BUFFERS, "OTA buffers");
+    bleRingBlock = block_pool_alloc(BLOCK_POOL_OTA, OTA_DOWNLOAD_BUFFER_SIZE);
+    if (bleRingBlock == BLOCK_POOL_NONE) {
+        ota_notify_status(OTA_STATUS_ERROR);
+        return;
+    }
+    pipe_ring_init(&bleRing, block_pool_data(BLOCK_POOL_OTA, bleRingBlock), OTA_DOWNLOAD_BUFFER_SIZE);
+    otaImageSize = size;
+    otaImageStarted = false;
+    otaWriteFailed = false;
+    otaCancelled = false;
+    bleOtaReceived = 0;
+    otaTaskRunning = true;
+    Serial.printf("OTA: Receiving %u bytes over BLE\n", (unsigned) size);
+    // 回调要等任务句柄设置好才能通知任务
+    xSemaphoreTake(bleOtaLock, portMAX_DELAY);
+    bleOtaActive = true;
+    bool created = xTaskCreate(ota_ble_task, "ota_ble", OTA_BLE_TASK_STACK_SIZE, NULL, 5, &bleOtaTaskHandle) == pdPASS;
+    if (!created) {
+        bleOtaActive = false;
+    }
+    xSemaphoreGive(bleOtaLock);
+    if (!created) {
+        otaTaskRunning = false;
+        block_pool_free(BLOCK_POOL_OTA, bleRingBlock);
+        bleRingBlock = BLOCK_POOL_NONE;
+        ota_notify_status(OTA_STATUS_ERROR);
+    }
+}
+
+/**
+ * ota_ble_data - BLE数据特性收到一个数据包(BLE回调中调用)
+ *
+ * 环形缓冲区满(客户端超出窗口)时丢弃,之后偏移不连续,任务请求重发
+ * 只在BLE OTA开始和结束的一瞬间等待bleOtaLock
+ *
+ * @param {const uint8_t*} data - [偏移(4字节,小端), 数据]
+ * @param {size_t} length - 数据包长度
+ */
+void ota_ble_data(const uint8_t *data, size_t length) {
+    if (!bleOtaActive || length <= OTA_BLE_HEADER_SIZE || length > OTA_BLE_PACKET_MAX) {
+        return;
+    }
+    xSemaphoreTake(bleOtaLock, portMAX_DELAY);
+    if (bleOtaActive) {
+        pipe_ring_put(&bleRing, data, length);
+        xTaskNotifyGive(bleOtaTaskHandle);
+    }
+    xSemaphoreGive(bleOtaLock);
+}
+
 // ============================================================================
 // 其他公开API函数
 // ============================================================================
@@ -643,4 +1190,35 @@ void ota_cancel() {
         Serial.println("OTA: Cancelling...");
         otaCancelled = true;
     }
+    photo_offload_cancel();
+    camera_preview_stop();
+}
+
+/**
+ * ota_wifi_configured - 检查是否已设置WiFi凭据
+ *
+ * @returns {bool} 已设置返回true
+ */
+bool ota_wifi_configured() {
+    return wifiCredentialsSet;
+}
+
+/**
+ * ota_wifi_connect - 连接WiFi(供照片批量上传使用)
+ *
+ * @returns {bool} 成功返回true
+ *
+ * 只在OTA未运行时调用,状态通知与OTA相同
+ */
+bool ota_wifi_connect() {
+    otaCancelled = false;
+    return connect_wifi();
+}
+
+/**
+ * ota_wifi_off - 断开WiFi并关闭射频
+ */
+void ota_wifi_off() {
+    WiFi.disconnect(true);
+    WiFi.mode(WIFI_OFF);
 }
@@ -2,7 +2,8 @@
 #define OTA_H
 
 #include <Arduino.h>
-#include <BLECharacteristic.h>
+
+#include "ble_backend.h"
 
 // Initialize OTA service and characteristics
 void ota_init(BLEService *service);
@@ -13,6 +14,11 @@ void ota_set_characteristics(BLECharacteristic *controlChar, BLECharacteristic *
 // Handle incoming OTA command
 void ota_handle_command(uint8_t *data, size_t length);
 
+// Handle a packet written to the BLE OTA data characteristic: [offset u32 LE, firmware bytes]. The
+// first packet must hold at least 24 bytes, so a delta patch is recognized by its header. Called
+// from the BLE callback, never blocks
+void ota_ble_data(const uint8_t *data, size_t length);
+
 // Process OTA in main loop (non-blocking)
 void ota_loop();
 
@@ -25,7 +31,19 @@ bool ota_is_busy();
 // Cancel any ongoing OTA operation
 void ota_cancel();
 
+// Check if WiFi credentials were set (OTA_CMD_SET_WIFI)
+bool ota_wifi_configured();
+
+// Connect to the configured WiFi network for other bulk transfers, blocking up to WIFI_CONNECT_TIMEOUT_MS
+bool ota_wifi_connect();
+
+// Disconnect and switch the WiFi radio off
+void ota_wifi_off();
+
 // Notify status change via BLE
 void ota_notify_status(uint8_t status, uint8_t progress = 0);
 
+// Notify a status followed by up to OTA_NOTIFY_DATA_MAX bytes of data instead of the progress byte
+void ota_notify_status_data(uint8_t status, const uint8_t *data, size_t length);
+
 #endif // OTA_H
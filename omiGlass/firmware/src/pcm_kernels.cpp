@@ -0,0 +1,67 @@
+/**
+ * PCM处理内核 - 增益、限幅和去直流
+ *
+ * 麦克风数据在写入Opus环形缓冲区时处理(opus_receive_pcm),不再单独遍历一次缓冲区
+ * ESP32-S3的CLAMPS指令一条指令完成16位饱和,其他平台使用比较限幅
+ */
+#include "pcm_kernels.h"
+
+#include "config.h"
+
+#if defined(__XTENSA__)
+#include <xtensa/config/core-isa.h>
+#endif
+
+/**
+ * sat16 - 饱和到16位范围(-32768 ~ 32767)
+ */
+static inline int32_t sat16(int32_t value)
+{
+#if defined(__XTENSA__) && XCHAL_HAVE_CLAMPS
+    int32_t result;
+    __asm__("clamps %0, %1, 15" : "=a"(result) : "a"(value));
+    return result;
+#else
+    if (value > 32767) {
+        return 32767;
+    }
+    if (value < -32768) {
+        return -32768;
+    }
+    return value;
+#endif
+}
+
+/**
+ * pcm_gain_dc - 复制PCM数据,应用增益和限幅,可选去直流
+ *
+ * 去直流: y[n] = x[n] - x[n-1] + R * y[n-1], R = MIC_DC_FILTER_COEF_Q15 / 32768
+ * 先滤波再乘增益,滤波器状态保持原始精度
+ */
+void pcm_gain_dc(int16_t *dst, const int16_t *src, size_t samples, int32_t gain, pcm_dc_state_t *dc)
+{
+    if (dc == nullptr) {
+        if (gain == 1) {
+            if (dst != src) {
+                memcpy(dst, src, samples * sizeof(int16_t));
+            }
+            return;
+        }
+        for (size_t i = 0; i < samples; i++) {
+            dst[i] = (int16_t) sat16((int32_t) src[i] * gain);
+        }
+        return;
+    }
+
+    int32_t x_prev = dc->x_prev;
+    int32_t y_prev = dc->y_prev;
+    for (size_t i = 0; i < samples; i++) {
+        int32_t x = src[i];
+        int32_t y = x - x_prev + ((y_prev * MIC_DC_FILTER_COEF_Q15 + (1 << 14)) >> 15); // 四舍五入,截断会留下直流偏差
+        x_prev = x;
+        y_prev = sat16(y); // 阶跃输入时限制状态,防止溢出
+        dst[i] = (int16_t) sat16(y_prev * gain);
+    }
+    dc->x_prev = x_prev;
+    dc->y_prev = y_prev;
+}
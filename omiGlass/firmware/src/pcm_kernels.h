@@ -0,0 +1,24 @@
+#ifndef PCM_KERNELS_H
+#define PCM_KERNELS_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// State of the DC removal filter, zero-initialized before the first block
+typedef struct {
+    int32_t x_prev; // Last input sample
+    int32_t y_prev; // Last filter output, before the gain
+} pcm_dc_state_t;
+
+/**
+ * @brief Copy PCM samples applying an integer gain with saturation to 16 bits, and optionally
+ *        removing the DC offset first (one-pole high-pass, MIC_DC_FILTER_COEF_Q15)
+ * @param dst Output samples, may be src
+ * @param src Input samples
+ * @param samples Number of samples
+ * @param gain Integer gain
+ * @param dc Filter state carried across blocks, nullptr for gain only
+ */
+void pcm_gain_dc(int16_t *dst, const int16_t *src, size_t samples, int32_t gain, pcm_dc_state_t *dc);
+
+#endif // PCM_KERNELS_H
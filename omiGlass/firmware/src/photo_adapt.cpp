@@ -0,0 +1,172 @@
+/**
+ * 照片自适应模块 - 按链路吞吐量选择分辨率和JPEG质量
+ *
+ * 主要功能:
+ * 1. 统计最近照片的上传吞吐量(字节/秒,指数平滑)
+ * 2. 统计每个档位的平均照片大小
+ * 3. 选择预计能在PHOTO_UPLOAD_TARGET_MS内上传完的最好档位
+ * 4. 通过传感器接口(set_framesize/set_quality)应用到相机
+ *
+ * 档位范围可由应用设置(照片控制特性,见config.h中的PHOTO_CMD_SET_QUALITY_BOUNDS)
+ */
+#include "photo_adapt.h"
+
+#include "config.h"
+#include "esp_camera.h"
+
+typedef struct {
+    framesize_t frame_size; // 分辨率(不超过初始化时的CAMERA_FRAME_SIZE)
+    int quality;            // JPEG质量(0-63,越小越好)
+    float est_bytes;        // 平均照片大小(初始为经验值,随上传更新)
+} photo_level_t;
+
+// 档位表: 0为最好(最大)
+static photo_level_t levels[] = {
+    {FRAMESIZE_VGA, CAMERA_JPEG_QUALITY, 12000}, // 640x480
+    {FRAMESIZE_VGA, 35, 8000},                   // 640x480, 更高压缩
+    {FRAMESIZE_HVGA, 30, 6000},                  // 480x320
+    {FRAMESIZE_QVGA, 30, 3500},                  // 320x240
+    {FRAMESIZE_QVGA, 45, 2200},                  // 320x240, 更高压缩
+};
+#define LEVEL_COUNT (sizeof(levels) / sizeof(levels[0]))
+
+static float throughput = 0;                  // 上传吞吐量(字节/秒), 0表示还没有测量
+static uint8_t best_level = 0;                // 应用允许的最好档位
+static uint8_t worst_level = LEVEL_COUNT - 1; // 应用允许的最差档位
+static uint8_t chosen_level = 0;              // 策略选择的档位
+static int applied_level = 0;                 // 已应用到传感器的档位(初始化时为档位0, 只由拍摄任务使用)
+// BLE任务写入统计和范围,上传和拍摄任务读取; 上面除applied_level外的状态都在锁内访问
+static portMUX_TYPE adapt_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * choose_level - 选择预计能按时上传完的最好档位
+ *
+ * 没有吞吐量数据时使用允许的最好档位; 都不能按时上传时使用允许的最差档位
+ * 调用时持有adapt_lock
+ */
+static uint8_t choose_level()
+{
+    if (throughput <= 0) {
+        return best_level;
+    }
+    for (uint8_t level = best_level; level <= worst_level; level++) {
+        float expected_ms = levels[level].est_bytes * 1000.0f / throughput;
+        if (expected_ms <= PHOTO_UPLOAD_TARGET_MS) {
+            return level;
+        }
+    }
+    return worst_level;
+}
+
+/**
+ * photo_adapt_init - 重置吞吐量统计和档位范围
+ */
+void photo_adapt_init()
+{
+    portENTER_CRITICAL(&adapt_lock);
+    throughput = 0;
+    best_level = 0;
+    worst_level = LEVEL_COUNT - 1;
+    chosen_level = 0;
+    portEXIT_CRITICAL(&adapt_lock);
+}
+
+/**
+ * photo_adapt_upload_done - 记录一张照片的上传结果
+ *
+ * @param {uint8_t} level - 拍摄时的档位
+ * @param {size_t} bytes - 照片大小(字节)
+ * @param {uint32_t} duration_ms - 从第一块到结束标记的时间
+ */
+void photo_adapt_upload_done(uint8_t level, size_t bytes, uint32_t duration_ms)
+{
+    if (level >= LEVEL_COUNT || bytes == 0) {
+        return;
+    }
+    if (duration_ms == 0) {
+        duration_ms = 1;
+    }
+
+    // 指数平滑: 新值占PHOTO_ADAPT_ALPHA
+    float measured = bytes * 1000.0f / duration_ms;
+    portENTER_CRITICAL(&adapt_lock);
+    throughput = throughput <= 0 ? measured : throughput + PHOTO_ADAPT_ALPHA * (measured - throughput);
+    levels[level].est_bytes += PHOTO_ADAPT_ALPHA * (bytes - levels[level].est_bytes);
+    chosen_level = choose_level();
+    float average = throughput;
+    uint8_t next = chosen_level;
+    portEXIT_CRITICAL(&adapt_lock);
+    Serial.printf("Photo upload: %u bytes in %u ms, %.0f B/s average, next level %u\n", (unsigned) bytes,
+                  (unsigned) duration_ms, average, next);
+}
+
+/**
+ * photo_adapt_set_bounds - 设置允许的档位范围(应用命令)
+ *
+ * @returns {bool} 范围有效返回true
+ */
+bool photo_adapt_set_bounds(uint8_t best, uint8_t worst)
+{
+    if (best > worst || worst >= LEVEL_COUNT) {
+        return false;
+    }
+    portENTER_CRITICAL(&adapt_lock);
+    best_level = best;
+    worst_level = worst;
+    chosen_level = choose_level();
+    uint8_t next = chosen_level;
+    portEXIT_CRITICAL(&adapt_lock);
+    Serial.printf("Photo levels %u-%u, next level %u\n", best, worst, next);
+    return true;
+}
+
+/**
+ * photo_adapt_apply - 把选择的档位应用到传感器
+ *
+ * 档位变化时丢弃一帧: 备用帧缓冲区里可能还是旧设置拍的
+ *
+ * @returns {uint8_t} 下一张照片的档位
+ */
+uint8_t photo_adapt_apply()
+{
+    portENTER_CRITICAL(&adapt_lock);
+    uint8_t level = chosen_level;
+    portEXIT_CRITICAL(&adapt_lock);
+    if (level == applied_level) {
+        return level;
+    }
+
+    sensor_t *sensor = esp_camera_sensor_get();
+    if (sensor == nullptr) {
+        return applied_level;
+    }
+    sensor->set_framesize(sensor, levels[level].frame_size);
+    sensor->set_quality(sensor, levels[level].quality);
+    applied_level = level;
+
+    camera_fb_t *stale = esp_camera_fb_get();
+    if (stale) {
+        esp_camera_fb_return(stale);
+    }
+    return level;
+}
+
+/**
+ * photo_adapt_sensor_reset - 相机重新初始化后传感器回到档位0的设置
+ *
+ * 下一次photo_adapt_apply重新应用选择的档位
+ */
+void photo_adapt_sensor_reset()
+{
+    applied_level = 0;
+}
+
+/**
+ * photo_adapt_sensor_changed - 传感器设置被其他模块改过(相机预览)
+ *
+ * 下一次photo_adapt_apply重新设置选择的档位
+ */
+void photo_adapt_sensor_changed()
+{
+    applied_level = -1; // 不等于任何档位
+}
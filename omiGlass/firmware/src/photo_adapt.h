@@ -0,0 +1,30 @@
+#ifndef PHOTO_ADAPT_H
+#define PHOTO_ADAPT_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Pick the photo frame size and JPEG quality from the upload throughput of recent photos, so a
+// weak link gets a smaller photo on time. Levels index the table in photo_adapt.cpp,
+// 0 is the largest and best.
+
+// Reset the throughput estimate and allow every level
+void photo_adapt_init();
+
+// Record a finished upload of a photo taken at level
+void photo_adapt_upload_done(uint8_t level, size_t bytes, uint32_t duration_ms);
+
+// Limit the levels the policy may pick (set by the app), returns false if out of range
+bool photo_adapt_set_bounds(uint8_t best_level, uint8_t worst_level);
+
+// Apply the chosen level to the sensor if it changed (call from the capture task before a grab),
+// returns the level the next photo is taken at
+uint8_t photo_adapt_apply();
+
+// The camera was initialized again (after a power down) and is back at level 0
+void photo_adapt_sensor_reset();
+
+// Something else changed the sensor settings (camera preview), the next apply sets them again
+void photo_adapt_sensor_changed();
+
+#endif // PHOTO_ADAPT_H
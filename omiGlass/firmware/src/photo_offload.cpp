@@ -0,0 +1,168 @@
+/**
+ * 照片WiFi批量上传模块 - 离线照片较多时改用WiFi上传
+ *
+ * BLE每秒只有几十KB,几十张离线照片用WiFi上传快得多
+ *
+ * 流程:
+ * 1. 离线存储达到PHOTO_OFFLOAD_THRESHOLD张,或客户端发送OTA_CMD_START_OFFLOAD
+ * 2. 用OTA的WiFi凭据连接WiFi(ota_wifi_connect)
+ * 3. 每张照片一个HTTP(S) POST请求(整张JPEG一次写入,连接复用)
+ * 4. 服务器返回2xx后从存储中删除,失败时停止并保留剩余照片
+ * 5. 关闭WiFi
+ *
+ * 进度通过OTA数据特性通知(OTA_STATUS_OFFLOADING,进度0-100)
+ */
+#include "photo_offload.h"
+
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+
+#include "camera_preview.h"
+#include "config.h"
+#include "ota.h"
+#include "photo_store.h"
+
+static char offloadURL[OTA_MAX_URL_LEN + 1] = {0}; // 照片上传URL
+static volatile bool offloadRunning = false;       // 上传任务是否正在运行
+static volatile bool offloadCancelled = false;     // 取消标志
+static unsigned long lastAttempt = 0;              // 上次自动上传的时间
+static bool attempted = false;                     // 是否自动上传过
+
+/**
+ * post_photos - 逐张POST离线照片
+ *
+ * @returns {bool} 全部上传完成返回true
+ */
+static bool post_photos(WiFiClient *client)
+{
+    size_t total = photo_store_count();
+    size_t sent = 0;
+    const uint8_t *data;
+    size_t len;
+    uint8_t level;
+    uint16_t id;
+    char orientation[4];
+    snprintf(orientation, sizeof(orientation), "%d", (int) FIXED_IMAGE_ORIENTATION);
+
+    while (!offloadCancelled && photo_store_peek(&data, &len, &level, &id)) {
+        HTTPClient http;
+        http.setReuse(true); // 保持连接,下一张照片不再握手
+        http.begin(*client, offloadURL);
+        http.setTimeout(PHOTO_OFFLOAD_TIMEOUT_MS);
+        http.addHeader("Content-Type", "image/jpeg");
+        http.addHeader("X-Photo-Orientation", orientation);
+        http.addHeader("X-Photo-Id", String(id)); // 与BLE上传相同的ID,部分上传过的照片可以去重
+        int httpCode = http.POST((uint8_t *) data, len);
+        http.end();
+
+        bool uploaded = httpCode >= 200 && httpCode < 300;
+        photo_store_release(uploaded);
+        if (!uploaded) {
+            Serial.printf("Offload: POST failed, code: %d\n", httpCode);
+            return false;
+        }
+        sent++;
+        ota_notify_status(OTA_STATUS_OFFLOADING, total ? sent * 100 / total : 100);
+    }
+    Serial.printf("Offload: %u photos uploaded\n", (unsigned) sent);
+    return !offloadCancelled;
+}
+
+/**
+ * offload_task - WiFi批量上传任务
+ *
+ * 优先级低于音频和照片任务; 完成后关闭WiFi并删除任务
+ */
+static void offload_task(void *parameter)
+{
+    bool ok = false;
+    ota_notify_status(OTA_STATUS_OFFLOADING, 0);
+
+    if (ota_wifi_connect()) {
+        WiFiClient *client;
+        if (strncmp(offloadURL, "https://", 8) == 0) {
+            WiFiClientSecure *secureClient = new WiFiClientSecure;
+            secureClient->setInsecure(); // 与OTA相同,跳过证书验证
+            client = secureClient;
+        } else {
+            client = new WiFiClient;
+        }
+        ok = post_photos(client);
+        client->stop();
+        delete client;
+    }
+
+    ota_wifi_off();
+    ota_notify_status(ok ? OTA_STATUS_OFFLOAD_COMPLETE : OTA_STATUS_OFFLOAD_FAILED);
+    offloadRunning = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * photo_offload_set_url - 设置照片上传URL
+ */
+void photo_offload_set_url(const char *url)
+{
+    strncpy(offloadURL, url, OTA_MAX_URL_LEN);
+    offloadURL[OTA_MAX_URL_LEN] = '\0';
+    Serial.printf("Offload: URL set: %s\n", offloadURL);
+}
+
+/**
+ * photo_offload_start - 启动WiFi批量上传
+ *
+ * @returns {bool} 已启动返回true
+ */
+bool photo_offload_start()
+{
+    if (offloadRunning || ota_is_busy() || camera_preview_is_busy() || !ota_wifi_configured() ||
+        offloadURL[0] == '\0' || photo_store_count() == 0) {
+        return false;
+    }
+    Serial.printf("Offload: Uploading %u stored photos over WiFi\n", (unsigned) photo_store_count());
+    offloadCancelled = false;
+    offloadRunning = true;
+    xTaskCreatePinnedToCore(offload_task, "photo_offload", PHOTO_OFFLOAD_TASK_STACK_SIZE, NULL,
+                            PHOTO_OFFLOAD_TASK_PRIORITY, NULL, PHOTO_OFFLOAD_TASK_CORE);
+    return true;
+}
+
+/**
+ * photo_offload_loop - 离线照片达到阈值时自动上传
+ *
+ * 失败后PHOTO_OFFLOAD_RETRY_MS内不再自动重试(例如不在WiFi范围内)
+ */
+void photo_offload_loop()
+{
+    if (offloadRunning || photo_store_count() < PHOTO_OFFLOAD_THRESHOLD) {
+        return;
+    }
+    unsigned long now = millis();
+    if (attempted && now - lastAttempt < PHOTO_OFFLOAD_RETRY_MS) {
+        return;
+    }
+    if (photo_offload_start()) {
+        attempted = true;
+        lastAttempt = now;
+    }
+}
+
+/**
+ * photo_offload_is_busy - 检查WiFi批量上传是否正在运行
+ */
+bool photo_offload_is_busy()
+{
+    return offloadRunning;
+}
+
+/**
+ * photo_offload_cancel - 取消WiFi批量上传(当前照片完成后停止)
+ */
+void photo_offload_cancel()
+{
+    if (offloadRunning) {
+        Serial.println("Offload: Cancelling...");
+        offloadCancelled = true;
+    }
+}
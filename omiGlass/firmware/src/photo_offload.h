@@ -0,0 +1,26 @@
+#ifndef PHOTO_OFFLOAD_H
+#define PHOTO_OFFLOAD_H
+
+#include <Arduino.h>
+
+// Bulk upload of the offline photo store over Wi-Fi, with the credentials set for OTA
+// (OTA_CMD_SET_WIFI). Each photo is one HTTP(S) POST of the JPEG to the offload URL, then Wi-Fi
+// is switched off again.
+
+// Set the URL photos are posted to (OTA_CMD_SET_OFFLOAD_URL)
+void photo_offload_set_url(const char *url);
+
+// Start an offload (OTA_CMD_START_OFFLOAD), returns false without credentials, URL or photos,
+// or while an OTA update, offload or camera preview runs
+bool photo_offload_start();
+
+// Start an offload when the store holds PHOTO_OFFLOAD_THRESHOLD photos (call from the main loop)
+void photo_offload_loop();
+
+// Check if an offload is running
+bool photo_offload_is_busy();
+
+// Stop a running offload after the current photo
+void photo_offload_cancel();
+
+#endif // PHOTO_OFFLOAD_H
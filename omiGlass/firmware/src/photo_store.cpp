@@ -0,0 +1,273 @@
+/**
+ * 离线照片存储模块 - 断开连接时保存照片,重新连接后上传
+ *
+ * 主要功能:
+ * 1. PSRAM中的照片环(最多PHOTO_STORE_RAM_SLOTS张),每张照片占块池(BLOCK_POOL_PHOTO)的一串块,
+ *    大小不同的照片按实际大小占用空间,会话再长也不会让堆碎片化
+ * 2. PSRAM满(照片数或空闲块)时把最旧的照片转存到flash分区的固定槽位
+ *    (PHOTO_STORE_PARTITION,没有该分区时只用PSRAM)
+ * 3. 两者都满时丢弃最旧的照片
+ * 4. 按配置从最旧或最新的照片开始取出上传
+ *
+ * 照片顺序: flash中的照片都比PSRAM中的旧(转存的总是PSRAM中最旧的)
+ * 索引只在内存中,重启后flash中的照片不再读取
+ */
+#include "photo_store.h"
+
+#include "block_pool.h"
+#include "config.h"
+#include "esp_partition.h"
+#include "mem_placement.h"
+
+static_assert(PHOTO_STORE_RAM_SLOTS <= PHOTO_STORE_MAX_SLOTS, "PHOTO_STORE_RAM_SLOTS above PHOTO_STORE_MAX_SLOTS");
+
+typedef struct {
+    uint16_t slots;                        // 槽位数
+    uint16_t head;                         // 下一个写入的槽位
+    uint16_t count;                        // 已存储的照片数
+    uint32_t len[PHOTO_STORE_MAX_SLOTS];   // 每个槽位的照片大小
+    uint8_t level[PHOTO_STORE_MAX_SLOTS];  // 每个槽位的照片档位(photo_adapt)
+    uint16_t id[PHOTO_STORE_MAX_SLOTS];    // 每个槽位的照片ID(断点续传)
+    uint16_t block[PHOTO_STORE_MAX_SLOTS]; // PSRAM中每张照片的第一块(块池)
+} slot_ring_t;
+
+static uint8_t *read_buffer = nullptr;             // 上传时照片读到这里(连续的一张)
+static const esp_partition_t *partition = nullptr; // 转存分区,nullptr表示只用PSRAM
+static slot_ring_t ram_ring;                       // PSRAM中的照片(较新)
+static slot_ring_t flash_ring;                     // flash中的照片(较旧)
+static SemaphoreHandle_t store_mutex = nullptr;    // 拍摄任务和上传任务共用
+
+static slot_ring_t *busy_ring = nullptr; // 正在上传的照片所在的环,nullptr表示没有
+static bool busy_newest = false;         // 正在上传的是该环中最新的(否则是最旧的)
+
+// 最旧照片的槽位
+static uint16_t ring_oldest(const slot_ring_t *ring)
+{
+    return (ring->head + ring->slots - ring->count) % ring->slots;
+}
+
+// 最新照片的槽位
+static uint16_t ring_newest(const slot_ring_t *ring)
+{
+    return (ring->head + ring->slots - 1) % ring->slots;
+}
+
+// 删除最旧或最新的照片,PSRAM中的照片归还它的块
+static void ring_remove(slot_ring_t *ring, bool newest)
+{
+    if (ring == &ram_ring) {
+        block_pool_free(BLOCK_POOL_PHOTO, ram_ring.block[newest ? ring_newest(ring) : ring_oldest(ring)]);
+    }
+    if (newest) {
+        ring->head = ring_newest(ring);
+    }
+    ring->count--;
+}
+
+/**
+ * ram_has_room - PSRAM是否放得下len字节的新照片(照片数和空闲块)
+ */
+static bool ram_has_room(size_t len)
+{
+    block_pool_stats_t stats;
+    block_pool_stats(BLOCK_POOL_PHOTO, &stats);
+    return ram_ring.count < ram_ring.slots && (size_t) stats.free * stats.block_size >= len;
+}
+
+/**
+ * put_disturbs_busy - 保存新照片是否会影响正在上传的照片
+ *
+ * 新照片成为最新的; spill(需要转存)时转存PSRAM中最旧的,flash也满时删除flash中最旧的
+ */
+static bool put_disturbs_busy(bool spill)
+{
+    if (busy_ring == nullptr) {
+        return false;
+    }
+    if (busy_newest) {
+        return true;
+    }
+    if (!spill) {
+        return false;
+    }
+    if (busy_ring == &ram_ring) {
+        return true;
+    }
+    return flash_ring.count == flash_ring.slots;
+}
+
+/**
+ * spill_oldest - 把PSRAM中最旧的照片转存到flash
+ *
+ * flash满时覆盖flash中最旧的照片; 没有flash分区时直接丢弃
+ */
+static void spill_oldest()
+{
+    uint16_t slot = ring_oldest(&ram_ring);
+    if (partition != nullptr) {
+        if (flash_ring.count == flash_ring.slots) {
+            ring_remove(&flash_ring, false);
+            Serial.println("Photo store full, oldest photo dropped");
+        }
+        size_t offset = (size_t) flash_ring.head * PHOTO_STORE_SLOT_BYTES;
+        uint32_t left = ram_ring.len[slot];
+        esp_err_t err = esp_partition_erase_range(partition, offset, PHOTO_STORE_SLOT_BYTES);
+        // 块链按顺序写入槽位
+        for (uint16_t block = ram_ring.block[slot]; err == ESP_OK && block != BLOCK_POOL_NONE && left > 0;
+             block = block_pool_next(BLOCK_POOL_PHOTO, block)) {
+            uint32_t n = left < PHOTO_STORE_BLOCK_BYTES ? left : PHOTO_STORE_BLOCK_BYTES;
+            err = esp_partition_write(partition, offset, block_pool_data(BLOCK_POOL_PHOTO, block), n);
+            offset += n;
+            left -= n;
+        }
+        if (err == ESP_OK) {
+            flash_ring.len[flash_ring.head] = ram_ring.len[slot];
+            flash_ring.level[flash_ring.head] = ram_ring.level[slot];
+            flash_ring.id[flash_ring.head] = ram_ring.id[slot];
+            flash_ring.head = (flash_ring.head + 1) % flash_ring.slots;
+            flash_ring.count++;
+        } else {
+            Serial.printf("Photo store flash write failed: 0x%x\n", err);
+        }
+    } else {
+        Serial.println("Photo store full, oldest photo dropped");
+    }
+    ring_remove(&ram_ring, false);
+}
+
+/**
+ * photo_store_init - 分配PSRAM块池并查找flash分区
+ */
+void photo_store_init()
+{
+    store_mutex = xSemaphoreCreateMutex();
+    read_buffer = (uint8_t *) mem_alloc_bulk(PHOTO_STORE_SLOT_BYTES, "Photo store read");
+    if (read_buffer == nullptr ||
+        !block_pool_init(BLOCK_POOL_PHOTO, PHOTO_STORE_BLOCK_BYTES, PHOTO_STORE_RAM_BLOCKS, "Photo store")) {
+        Serial.println("Photo store unavailable");
+        return;
+    }
+    ram_ring.slots = PHOTO_STORE_RAM_SLOTS;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, PHOTO_STORE_PARTITION);
+    if (partition != nullptr) {
+        size_t slots = partition->size / PHOTO_STORE_SLOT_BYTES;
+        flash_ring.slots = slots > PHOTO_STORE_MAX_SLOTS ? PHOTO_STORE_MAX_SLOTS : slots;
+        if (flash_ring.slots == 0) {
+            partition = nullptr;
+        }
+    }
+    Serial.printf("Photo store: %u KB for up to %u photos in PSRAM, %u photos in flash\n",
+                  (unsigned) (PHOTO_STORE_RAM_BLOCKS * PHOTO_STORE_BLOCK_BYTES / 1024), ram_ring.slots,
+                  flash_ring.slots);
+}
+
+/**
+ * photo_store_put - 保存一张照片
+ *
+ * @param {const uint8_t*} data - JPEG数据
+ * @param {size_t} len - 数据长度
+ * @param {uint8_t} level - 照片档位
+ * @param {uint16_t} id - 照片ID
+ * @returns {bool} 保存成功返回true
+ */
+bool photo_store_put(const uint8_t *data, size_t len, uint8_t level, uint16_t id)
+{
+    if (ram_ring.slots == 0 || len > PHOTO_STORE_SLOT_BYTES) {
+        return false;
+    }
+
+    xSemaphoreTake(store_mutex, portMAX_DELAY);
+    if (put_disturbs_busy(false)) {
+        xSemaphoreGive(store_mutex);
+        return false;
+    }
+    while (!ram_has_room(len)) {
+        if (ram_ring.count == 0 || put_disturbs_busy(true)) {
+            // 正在上传的照片会被转存或删除(断开连接后BLE上传任务很快会放弃)
+            xSemaphoreGive(store_mutex);
+            return false;
+        }
+        spill_oldest();
+    }
+    uint16_t first = block_pool_alloc(BLOCK_POOL_PHOTO, len);
+    block_pool_write(BLOCK_POOL_PHOTO, first, data, len);
+    ram_ring.block[ram_ring.head] = first;
+    ram_ring.len[ram_ring.head] = len;
+    ram_ring.level[ram_ring.head] = level;
+    ram_ring.id[ram_ring.head] = id;
+    ram_ring.head = (ram_ring.head + 1) % ram_ring.slots;
+    ram_ring.count++;
+    xSemaphoreGive(store_mutex);
+    return true;
+}
+
+/**
+ * photo_store_count - 已存储的照片数
+ */
+size_t photo_store_count()
+{
+    return ram_ring.count + flash_ring.count;
+}
+
+/**
+ * photo_store_peek - 取出下一张要上传的照片
+ *
+ * PSRAM中的照片从块链拷到read_buffer,flash中的照片从槽位读到read_buffer
+ *
+ * @returns {bool} 有照片返回true
+ */
+bool photo_store_peek(const uint8_t **data, size_t *len, uint8_t *level, uint16_t *id)
+{
+    bool found = false;
+
+    xSemaphoreTake(store_mutex, portMAX_DELAY);
+    if (busy_ring == nullptr && photo_store_count() > 0) {
+        // 最新的照片在PSRAM中(若有),最旧的在flash中(若有)
+        bool newest = PHOTO_STORE_DRAIN_NEWEST_FIRST;
+        slot_ring_t *ring;
+        if (newest) {
+            ring = ram_ring.count > 0 ? &ram_ring : &flash_ring;
+        } else {
+            ring = flash_ring.count > 0 ? &flash_ring : &ram_ring;
+        }
+        uint16_t slot = newest ? ring_newest(ring) : ring_oldest(ring);
+        size_t offset = (size_t) slot * PHOTO_STORE_SLOT_BYTES;
+
+        if (ring == &ram_ring) {
+            block_pool_read(BLOCK_POOL_PHOTO, ram_ring.block[slot], read_buffer, ring->len[slot]);
+            *data = read_buffer;
+            found = true;
+        } else if (esp_partition_read(partition, offset, read_buffer, ring->len[slot]) == ESP_OK) {
+            *data = read_buffer;
+            found = true;
+        } else {
+            Serial.println("Photo store flash read failed, photo dropped");
+            ring_remove(ring, newest);
+        }
+        if (found) {
+            *len = ring->len[slot];
+            *level = ring->level[slot];
+            *id = ring->id[slot];
+            busy_ring = ring;
+            busy_newest = newest;
+        }
+    }
+    xSemaphoreGive(store_mutex);
+    return found;
+}
+
+/**
+ * photo_store_release - 结束上传photo_store_peek取出的照片
+ *
+ * @param {bool} uploaded - 已上传完成时从存储中删除,否则下次重新上传
+ */
+void photo_store_release(bool uploaded)
+{
+    xSemaphoreTake(store_mutex, portMAX_DELAY);
+    if (busy_ring != nullptr && uploaded) {
+        ring_remove(busy_ring, busy_newest);
+    }
+    busy_ring = nullptr;
+    xSemaphoreGive(store_mutex);
+}
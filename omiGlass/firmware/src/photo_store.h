@@ -0,0 +1,27 @@
+#ifndef PHOTO_STORE_H
+#define PHOTO_STORE_H
+
+#include <Arduino.h>
+
+// Photos captured while disconnected, uploaded after the next connection. A ring of photos in
+// PSRAM, each a chain of BLOCK_POOL_PHOTO blocks, spilling the oldest photos to fixed slots of the
+// PHOTO_STORE_PARTITION flash partition when full (PSRAM only without the partition). The oldest
+// photo is dropped when both are full.
+
+// Allocate the PSRAM slots and find the flash partition
+void photo_store_init();
+
+// Store a photo with its ID, returns false if it is larger than a slot or would move the photo being uploaded
+bool photo_store_put(const uint8_t *data, size_t len, uint8_t level, uint16_t id);
+
+// Number of photos stored
+size_t photo_store_count();
+
+// Get the next photo to upload (oldest or newest first, PHOTO_STORE_DRAIN_NEWEST_FIRST) and keep
+// it until photo_store_release(), returns false if none is stored
+bool photo_store_peek(const uint8_t **data, size_t *len, uint8_t *level, uint16_t *id);
+
+// Finish with the photo from photo_store_peek(), removed from the store if it was uploaded
+void photo_store_release(bool uploaded);
+
+#endif // PHOTO_STORE_H
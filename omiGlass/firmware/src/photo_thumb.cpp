@@ -0,0 +1,105 @@
+/**
+ * 照片缩略图模块 - 渐进式照片传输,先发缩略图,再发完整照片
+ *
+ * 主要功能:
+ * 1. 相机JPEG按1/PHOTO_THUMB_SCALE_DIV比例解码为RGB565(解码器按比例只做部分IDCT)
+ * 2. 重新编码为PHOTO_THUMB_QUALITY质量的JPEG(VGA约3KB),先于完整照片上传
+ * 3. 应用通过照片控制命令[PHOTO_CMD_SET_THUMBNAIL, 0/1]开启,默认关闭(旧版应用不受影响)
+ *
+ * 只由上传任务调用,解码缓冲区和缩略图缓冲区放在PSRAM,首次使用时分配并一直复用
+ * (fmt2jpg每张照片都会malloc输出缓冲区,这里用fmt2jpg_cb写入固定缓冲区,堆不会碎片化)
+ */
+#include "photo_thumb.h"
+
+#include "config.h"
+#include "img_converters.h"
+#include "mem_placement.h"
+
+static volatile bool enabled = false;    // 应用是否开启了缩略图
+static uint8_t *decode_buffer = nullptr; // 缩小解码的RGB565图像(PSRAM)
+static size_t decode_size = 0;           // decode_buffer的大小
+static uint8_t *thumb_buffer = nullptr;  // 缩略图JPEG(PHOTO_THUMB_MAX_BYTES,PSRAM)
+static size_t thumb_len = 0;             // thumb_buffer中已编码的字节数
+
+/**
+ * photo_thumb_set_enabled - 开启或关闭缩略图(照片控制命令)
+ */
+void photo_thumb_set_enabled(bool on)
+{
+    enabled = on;
+    Serial.printf("Photo thumbnails %s\n", on ? "on" : "off");
+}
+
+/**
+ * photo_thumb_enabled - 新照片是否先发缩略图
+ */
+bool photo_thumb_enabled()
+{
+    return enabled;
+}
+
+/**
+ * thumb_out - fmt2jpg_cb的输出回调,写入thumb_buffer
+ *
+ * @returns {size_t} 写入的字节数,缩略图超过PHOTO_THUMB_MAX_BYTES时返回0(编码失败)
+ */
+static size_t thumb_out(void *arg, size_t index, const void *data, size_t len)
+{
+    if (index + len > PHOTO_THUMB_MAX_BYTES) {
+        return 0;
+    }
+    memcpy(thumb_buffer + index, data, len);
+    thumb_len = index + len;
+    return len;
+}
+
+/**
+ * photo_thumb_make - 生成一张照片的缩略图JPEG
+ *
+ * @param {const camera_fb_t*} frame - 相机JPEG帧
+ * @param {size_t*} len - 返回缩略图大小
+ * @returns {uint8_t*} 缩略图,失败返回nullptr; 下一次调用前用photo_thumb_free释放
+ */
+uint8_t *photo_thumb_make(const camera_fb_t *frame, size_t *len)
+{
+    uint16_t width = frame->width / PHOTO_THUMB_SCALE_DIV;
+    uint16_t height = frame->height / PHOTO_THUMB_SCALE_DIV;
+    size_t needed = (size_t) width * height * 2;
+    if (width == 0 || height == 0) {
+        return nullptr;
+    }
+
+    // 照片档位只会降低分辨率,第一次分配的大小一般够用
+    if (needed > decode_size) {
+        mem_free(decode_buffer);
+        decode_buffer = (uint8_t *) mem_alloc_bulk(needed, "thumbnail decode");
+        decode_size = decode_buffer ? needed : 0;
+        if (decode_buffer == nullptr) {
+            return nullptr;
+        }
+    }
+    if (!jpg2rgb565(frame->buf, frame->len, decode_buffer, PHOTO_THUMB_SCALE)) {
+        return nullptr;
+    }
+
+    if (thumb_buffer == nullptr) {
+        thumb_buffer = (uint8_t *) mem_alloc_bulk(PHOTO_THUMB_MAX_BYTES, "thumbnail");
+        if (thumb_buffer == nullptr) {
+            return nullptr;
+        }
+    }
+    thumb_len = 0;
+    if (!fmt2jpg_cb(decode_buffer, needed, width, height, PIXFORMAT_RGB565, PHOTO_THUMB_QUALITY, thumb_out, nullptr)) {
+        return nullptr;
+    }
+    *len = thumb_len;
+    return thumb_buffer;
+}
+
+/**
+ * photo_thumb_free - 释放缩略图(缓冲区留给下一张照片,不归还堆)
+ */
+void photo_thumb_free(uint8_t *thumb)
+{
+    (void) thumb;
+}
@@ -0,0 +1,26 @@
+#ifndef PHOTO_THUMB_H
+#define PHOTO_THUMB_H
+
+#include <Arduino.h>
+
+#include "esp_camera.h"
+
+// Thumbnails for progressive photo delivery: the camera JPEG decoded at 1/PHOTO_THUMB_SCALE_DIV
+// scale and encoded again at PHOTO_THUMB_QUALITY. A few KB that reach the app well before the full
+// frame, so it can show something and the backend can start on it early. Off until the app asks.
+
+// Turn thumbnails on or off (photo control command)
+void photo_thumb_set_enabled(bool enabled);
+
+// Whether new photos get a thumbnail
+bool photo_thumb_enabled();
+
+// Make the thumbnail JPEG of frame, returns nullptr if it cannot be decoded or encoded into
+// PHOTO_THUMB_MAX_BYTES. The result lives in a buffer reused by the next call; release it with
+// photo_thumb_free() before making another
+uint8_t *photo_thumb_make(const camera_fb_t *frame, size_t *len);
+
+// Free a thumbnail from photo_thumb_make(), may be nullptr
+void photo_thumb_free(uint8_t *thumb);
+
+#endif // PHOTO_THUMB_H
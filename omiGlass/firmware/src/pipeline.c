@@ -0,0 +1,7 @@
+/**
+ * 共享流水线核心 - 编译omi/firmware/lib/pipeline中眼镜使用的部分
+ *
+ * Arduino只编译src/下的源文件,库的源文件从这里包含进来,与吊坠固件是同一份代码
+ */
+#include "../../../omi/firmware/lib/pipeline/pipe_frame.c"
+#include "../../../omi/firmware/lib/pipeline/pipe_ring.c"
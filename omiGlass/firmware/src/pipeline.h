@@ -0,0 +1,10 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// The pipeline core shared with the pendant (omi/firmware/lib/pipeline): the lock-free frame ring
+// and the live audio framing. The Arduino build only compiles src/, so pipeline.c pulls the
+// library sources in from there.
+#include "../../../omi/firmware/lib/pipeline/pipe_frame.h"
+#include "../../../omi/firmware/lib/pipeline/pipe_ring.h"
+
+#endif // PIPELINE_H
@@ -0,0 +1,232 @@
+/**
+ * 电源管理模块 - 按负载调节CPU频率
+ *
+ * 使用ESP-IDF电源管理锁代替手动setCpuFrequencyMhz:
+ * - 音频编码、照片拍摄、照片上传运行时各自持有锁
+ * - 没有锁时CPU降到MIN_CPU_FREQ_MHZ,支持时自动进入轻度睡眠
+ * - 频率切换由电源管理完成,外设时钟(APB)随锁保持稳定
+ *
+ * 固件没有启用CONFIG_PM_ENABLE时esp_pm_configure失败,锁不起作用,
+ * 应用继续使用enterPowerSave/exitPowerSave
+ *
+ * 同时统计各CPU频率的驻留时间和轻度睡眠时间(性能遥测,见metrics)
+ */
+#include "power_mgmt.h"
+
+#include "config.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+
+static bool pm_active = false;        // 电源管理是否生效
+static bool auto_light_sleep = false; // 是否自动轻度睡眠
+static esp_pm_lock_handle_t locks[POWER_LOCK_COUNT];
+
+// 频率驻留统计(锁在两个核心的任务中使用,用自旋锁保护)
+static portMUX_TYPE residency_mux = portMUX_INITIALIZER_UNLOCKED;
+static const uint32_t freq_mhz[POWER_FREQ_COUNT] = {40, 80, 160, 240};
+static const uint32_t lock_mhz[POWER_LOCK_COUNT] = {NORMAL_CPU_FREQ_MHZ, PM_MAX_CPU_FREQ_MHZ, NORMAL_CPU_FREQ_MHZ};
+static uint8_t lock_held[POWER_LOCK_COUNT];           // 每个锁的持有次数
+static uint32_t current_mhz = NORMAL_CPU_FREQ_MHZ;    // 当前(请求的)频率
+static int64_t current_since_us = 0;                  // 进入当前频率的时间
+static uint64_t residency_us[POWER_FREQ_COUNT];       // 各频率的累计时间
+static uint64_t light_sleep_us = 0;                   // 轻度睡眠累计时间
+static bool light_sleep_measured = true;              // 自动轻度睡眠无法统计时为false
+
+/**
+ * residency_switch - 把到现在为止的时间记到当前频率,再切换到mhz(调用者持有residency_mux)
+ */
+static void residency_switch(uint32_t mhz)
+{
+    int64_t now = esp_timer_get_time();
+    int index = 0;
+    while (index < POWER_FREQ_COUNT - 1 && current_mhz > freq_mhz[index]) {
+        index++;
+    }
+    residency_us[index] += now - current_since_us;
+    current_since_us = now;
+    current_mhz = mhz;
+}
+
+/**
+ * locked_mhz - 当前持有的锁要求的最低频率(调用者持有residency_mux)
+ */
+static uint32_t locked_mhz()
+{
+    uint32_t mhz = MIN_CPU_FREQ_MHZ;
+    for (int i = 0; i < POWER_LOCK_COUNT; i++) {
+        if (lock_held[i] > 0 && lock_mhz[i] > mhz) {
+            mhz = lock_mhz[i];
+        }
+    }
+    return mhz;
+}
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+/**
+ * light_sleep_exit - 自动轻度睡眠唤醒回调(空闲任务中,中断关闭时调用)
+ */
+static esp_err_t IRAM_ATTR light_sleep_exit(int64_t sleep_time_us, void *arg)
+{
+    portENTER_CRITICAL_ISR(&residency_mux);
+    light_sleep_us += sleep_time_us;
+    portEXIT_CRITICAL_ISR(&residency_mux);
+    return ESP_OK;
+}
+#endif
+
+/**
+ * power_init - 配置动态调频并创建各负载的锁
+ *
+ * 先尝试带自动轻度睡眠的配置(需要tickless idle),失败时只调频
+ * 固件支持轻度睡眠回调(CONFIG_PM_LIGHT_SLEEP_CALLBACKS)时统计自动睡眠时间
+ *
+ * @returns {bool} 电源管理生效返回true
+ */
+bool power_init()
+{
+    current_since_us = esp_timer_get_time();
+    current_mhz = getCpuFrequencyMhz();
+
+    esp_pm_config_esp32s3_t config = {
+        .max_freq_mhz = PM_MAX_CPU_FREQ_MHZ,
+        .min_freq_mhz = MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = PM_AUTO_LIGHT_SLEEP,
+    };
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK && config.light_sleep_enable) {
+        config.light_sleep_enable = false;
+        err = esp_pm_configure(&config);
+    }
+    if (err != ESP_OK) {
+        Serial.printf("Power management unavailable (0x%x), using fixed CPU frequency\n", err);
+        return false;
+    }
+
+    const struct {
+        esp_pm_lock_type_t type;
+        const char *name;
+    } specs[POWER_LOCK_COUNT] = {
+        {ESP_PM_APB_FREQ_MAX, "audio"},
+        {ESP_PM_CPU_FREQ_MAX, "camera"},
+        {ESP_PM_APB_FREQ_MAX, "upload"},
+    };
+    for (int i = 0; i < POWER_LOCK_COUNT; i++) {
+        if (esp_pm_lock_create(specs[i].type, 0, specs[i].name, &locks[i]) != ESP_OK) {
+            // 没有锁时不能降频,固定在正常频率
+            Serial.printf("Failed to create power lock %s\n", specs[i].name);
+            config.max_freq_mhz = NORMAL_CPU_FREQ_MHZ;
+            config.min_freq_mhz = NORMAL_CPU_FREQ_MHZ;
+            config.light_sleep_enable = false;
+            esp_pm_configure(&config);
+            return false;
+        }
+    }
+
+    portENTER_CRITICAL(&residency_mux);
+    pm_active = true;
+    residency_switch(locked_mhz());
+    portEXIT_CRITICAL(&residency_mux);
+    auto_light_sleep = config.light_sleep_enable;
+    if (auto_light_sleep) {
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+        esp_pm_sleep_cbs_register_config_t cbs = {};
+        cbs.exit_cb = light_sleep_exit;
+        light_sleep_measured = esp_pm_light_sleep_register_cbs(&cbs) == ESP_OK;
+#else
+        light_sleep_measured = false;
+#endif
+    }
+    Serial.printf("Power management: %d-%d MHz, automatic light sleep %s\n", MIN_CPU_FREQ_MHZ,
+                  PM_MAX_CPU_FREQ_MHZ, auto_light_sleep ? "on" : "off");
+    return true;
+}
+
+bool power_pm_active()
+{
+    return pm_active;
+}
+
+bool power_auto_light_sleep()
+{
+    return auto_light_sleep;
+}
+
+/**
+ * power_lock - 持有负载锁(可重复持有,计数)
+ */
+void power_lock(power_lock_t lock)
+{
+    if (pm_active) {
+        esp_pm_lock_acquire(locks[lock]);
+        portENTER_CRITICAL(&residency_mux);
+        lock_held[lock]++;
+        residency_switch(locked_mhz());
+        portEXIT_CRITICAL(&residency_mux);
+    }
+}
+
+/**
+ * power_unlock - 释放负载锁
+ */
+void power_unlock(power_lock_t lock)
+{
+    if (pm_active) {
+        portENTER_CRITICAL(&residency_mux);
+        if (lock_held[lock] > 0) {
+            lock_held[lock]--;
+        }
+        residency_switch(locked_mhz());
+        portEXIT_CRITICAL(&residency_mux);
+        esp_pm_lock_release(locks[lock]);
+    }
+}
+
+/**
+ * power_residency_ms - 各频率的累计时间(ms)
+ */
+void power_residency_ms(uint32_t residency[POWER_FREQ_COUNT])
+{
+    portENTER_CRITICAL(&residency_mux);
+    residency_switch(current_mhz); // 把当前频率到现在的时间也计入
+    for (int i = 0; i < POWER_FREQ_COUNT; i++) {
+        residency[i] = (uint32_t) (residency_us[i] / 1000);
+    }
+    portEXIT_CRITICAL(&residency_mux);
+}
+
+/**
+ * power_note_frequency - 手动调频后记录新频率(电源管理生效时频率跟随锁,不需要)
+ */
+void power_note_frequency()
+{
+    if (!pm_active) {
+        uint32_t mhz = getCpuFrequencyMhz();
+        portENTER_CRITICAL(&residency_mux);
+        residency_switch(mhz);
+        portEXIT_CRITICAL(&residency_mux);
+    }
+}
+
+/**
+ * power_add_light_sleep_us - 记录一次手动轻度睡眠
+ */
+void power_add_light_sleep_us(int64_t us)
+{
+    portENTER_CRITICAL(&residency_mux);
+    light_sleep_us += us;
+    portEXIT_CRITICAL(&residency_mux);
+}
+
+/**
+ * power_light_sleep_ms - 轻度睡眠累计时间(ms),自动睡眠无法统计时返回POWER_UNKNOWN
+ */
+uint32_t power_light_sleep_ms()
+{
+    if (!light_sleep_measured) {
+        return POWER_UNKNOWN;
+    }
+    portENTER_CRITICAL(&residency_mux);
+    uint64_t us = light_sleep_us;
+    portEXIT_CRITICAL(&residency_mux);
+    return (uint32_t) (us / 1000);
+}
@@ -0,0 +1,48 @@
+#ifndef POWER_MGMT_H
+#define POWER_MGMT_H
+
+#include <Arduino.h>
+
+// CPU frequency from ESP-IDF power management: each workload holds a lock while it runs, the
+// CPU drops to MIN_CPU_FREQ_MHZ (and light sleeps, if the build supports it) when none does.
+// Without CONFIG_PM_ENABLE in the build the locks are no-ops and the app keeps switching the
+// frequency itself (enterPowerSave/exitPowerSave).
+
+typedef enum {
+    POWER_LOCK_AUDIO,  // Opus encoding, 80 MHz
+    POWER_LOCK_CAMERA, // Capture, JPEG scene check and offline store, PM_MAX_CPU_FREQ_MHZ
+    POWER_LOCK_UPLOAD, // BLE photo upload, 80 MHz
+    POWER_LOCK_COUNT
+} power_lock_t;
+
+// Configure dynamic frequency scaling and create the locks, returns false if the build lacks it
+bool power_init();
+
+// Whether the frequency follows the locks
+bool power_pm_active();
+
+// Whether the idle CPU light sleeps by itself
+bool power_auto_light_sleep();
+
+// Hold or release a workload lock (counted, each power_lock needs one power_unlock)
+void power_lock(power_lock_t lock);
+void power_unlock(power_lock_t lock);
+
+// CPU frequency residency, at 40, 80, 160 and 240 MHz. With power management this is the frequency
+// the locks ask for (the BLE and WiFi drivers may hold the CPU higher), otherwise the fixed one.
+#define POWER_FREQ_COUNT 4
+#define POWER_UNKNOWN 0xFFFFFFFFu
+
+// Time at each frequency since boot in ms
+void power_residency_ms(uint32_t residency[POWER_FREQ_COUNT]);
+
+// Account a manual frequency change (setCpuFrequencyMhz without power management)
+void power_note_frequency();
+
+// Count time spent in a manual light sleep
+void power_add_light_sleep_us(int64_t us);
+
+// Time spent in light sleep since boot in ms, POWER_UNKNOWN if the build cannot report automatic sleeps
+uint32_t power_light_sleep_ms();
+
+#endif // POWER_MGMT_H
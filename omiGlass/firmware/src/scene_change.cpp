@@ -0,0 +1,116 @@
+/**
+ * 场景变化检测模块 - 跳过内容没有变化的间隔照片
+ *
+ * 主要功能:
+ * 1. JPEG按1/8比例解码(只解码DC,很快),再按网格平均成小的亮度缩略图
+ * 2. 与上一张已发送照片的缩略图比较平均绝对差
+ * 3. 差值低于PHOTO_SCENE_THRESHOLD时跳过上传,节省BLE带宽
+ *
+ * 缩略图网格与分辨率无关,照片档位(photo_adapt)变化后仍可比较
+ */
+#include "scene_change.h"
+
+#include "config.h"
+#include "img_converters.h"
+#include "mem_placement.h"
+
+#define THUMB_CELLS (PHOTO_SCENE_GRID_W * PHOTO_SCENE_GRID_H)
+
+static uint8_t *decode_buffer = nullptr; // 1/8比例解码的RGB565图像(PSRAM)
+static uint8_t reference[THUMB_CELLS];   // 上一张已发送照片的缩略图
+static uint8_t current[THUMB_CELLS];     // 刚拍摄照片的缩略图
+// 网格单元的亮度和与像素数; 和缩略图一样是静态的,只有拍照任务调用,不占它的栈
+static uint32_t sums[THUMB_CELLS];
+static uint32_t counts[THUMB_CELLS];
+static bool has_reference = false;       // 是否有参考缩略图
+static uint16_t skipped = 0;             // 连续跳过的照片数
+
+/**
+ * make_thumbnail - 生成亮度缩略图
+ *
+ * @param {const camera_fb_t*} frame - JPEG帧
+ * @param {uint8_t*} thumb - 输出缩略图(PHOTO_SCENE_GRID_W x PHOTO_SCENE_GRID_H)
+ * @returns {bool} 解码成功返回true
+ */
+static bool make_thumbnail(const camera_fb_t *frame, uint8_t *thumb)
+{
+    size_t width = frame->width / 8;
+    size_t height = frame->height / 8;
+    if (width < PHOTO_SCENE_GRID_W || height < PHOTO_SCENE_GRID_H ||
+        width * height * 2 > PHOTO_SCENE_DECODE_BYTES) {
+        return false;
+    }
+
+    if (decode_buffer == nullptr) {
+        decode_buffer = (uint8_t *) mem_alloc_bulk(PHOTO_SCENE_DECODE_BYTES, "scene decode");
+        if (decode_buffer == nullptr) {
+            return false;
+        }
+    }
+    if (!jpg2rgb565(frame->buf, frame->len, decode_buffer, JPG_SCALE_8X)) {
+        return false;
+    }
+
+    // 每个网格单元取像素亮度的平均值(RGB565高字节在前)
+    memset(sums, 0, sizeof(sums));
+    memset(counts, 0, sizeof(counts));
+    for (size_t y = 0; y < height; y++) {
+        size_t row = y * PHOTO_SCENE_GRID_H / height * PHOTO_SCENE_GRID_W;
+        const uint8_t *pixel = decode_buffer + y * width * 2;
+        for (size_t x = 0; x < width; x++, pixel += 2) {
+            uint32_t r = pixel[0] >> 3;
+            uint32_t g = ((pixel[0] & 0x07) << 3) | (pixel[1] >> 5);
+            uint32_t b = pixel[1] & 0x1F;
+            // 亮度近似: (2R + 5G + B) / 8, 各分量先扩展到8位
+            uint32_t luma = (2 * (r << 3) + 5 * (g << 2) + (b << 3)) >> 3;
+            size_t cell = row + x * PHOTO_SCENE_GRID_W / width;
+            sums[cell] += luma;
+            counts[cell]++;
+        }
+    }
+    for (size_t i = 0; i < THUMB_CELLS; i++) {
+        thumb[i] = counts[i] ? sums[i] / counts[i] : 0;
+    }
+    return true;
+}
+
+/**
+ * scene_change_reset - 清除参考缩略图,下一张照片总是发送
+ */
+void scene_change_reset()
+{
+    has_reference = false;
+    skipped = 0;
+}
+
+/**
+ * scene_change_check - 判断照片是否需要上传
+ *
+ * @param {const camera_fb_t*} frame - 刚拍摄的JPEG帧
+ * @returns {bool} 需要上传返回true(并成为新的参考)
+ */
+bool scene_change_check(const camera_fb_t *frame)
+{
+    if (!make_thumbnail(frame, current)) {
+        return true; // 无法比较时照常上传
+    }
+
+    if (has_reference && skipped < PHOTO_SCENE_MAX_SKIPS) {
+        uint32_t diff = 0;
+        for (size_t i = 0; i < THUMB_CELLS; i++) {
+            diff += abs((int) current[i] - (int) reference[i]);
+        }
+        diff /= THUMB_CELLS;
+        if (diff < PHOTO_SCENE_THRESHOLD) {
+            skipped++;
+            Serial.printf("Scene unchanged (difference %u), photo skipped\n", (unsigned) diff);
+            return false;
+        }
+        Serial.printf("Scene changed (difference %u)\n", (unsigned) diff);
+    }
+
+    memcpy(reference, current, sizeof(reference));
+    has_reference = true;
+    skipped = 0;
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef SCENE_CHANGE_H
+#define SCENE_CHANGE_H
+
+#include <Arduino.h>
+
+#include "esp_camera.h"
+
+// Skip interval photos of an unchanged scene: each JPEG is decoded at 1/8 scale and averaged into
+// a small luma thumbnail, compared against the thumbnail of the last photo sent.
+
+// Forget the last photo sent, so the next one is always sent (e.g. for a new connection)
+void scene_change_reset();
+
+// Whether the frame differs enough from the last photo sent to be uploaded, if so it becomes the
+// new reference. Also true every PHOTO_SCENE_MAX_SKIPS photos, or if the frame cannot be decoded.
+bool scene_change_check(const camera_fb_t *frame);
+
+#endif // SCENE_CHANGE_H